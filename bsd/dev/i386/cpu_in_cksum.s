@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ *  extern uint64_t os_cpu_in_cksum_sse2(const void *data, uint64_t len);
+ *  extern uint64_t os_cpu_in_cksum_avx2(const void *data, uint64_t len);
+ *
+ *  input :
+ *      data : starting address, no alignment requirement
+ *      len : byte stream length, a non-zero multiple of 64
+ *
+ *  output :
+ *	the sum of the 32-bit words of the byte stream, folded to 33 bits;
+ *	since 2^32 = 1 modulo 0xffff, this is congruent to the 16-bit one's
+ *	complement sum of the stream, and the caller (os_cpu_in_cksum_mbuf)
+ *	adds it to its 64-bit partial sum and folds it with the rest
+ *
+ *  Each 16-byte vector w3 : w2 : w1 : w0 is masked into 0 : w2 : 0 : w0
+ *  and shifted right quadword 32-bit into 0 : w3 : 0 : w1 (the AVX2
+ *  variant does the same on 32-byte vectors), and these are accumulated
+ *  into quadword lanes without carry handling: the lanes can absorb 2^32
+ *  words each, way more than any byte stream we are given.
+ *
+ *  The AVX2 variant is only used in user space: in the kernel, a VEX
+ *  encoded restore of the vector registers would clear the upper bits
+ *  of the user's ZMM state.
+ */
+
+	.globl	_os_cpu_in_cksum_sse2
+	.text
+	.align	4
+_os_cpu_in_cksum_sse2:
+
+#define	data		%rdi
+#define	len		%rsi
+
+	/* push callee-saved registers and set up base pointer */
+	push	%rbp
+	movq	%rsp, %rbp
+
+#ifdef KERNEL
+	/* allocate stack space and save xmm0-xmm5 */
+	sub	$6*16, %rsp
+	movdqa	%xmm0, 0*16(%rsp)
+	movdqa	%xmm1, 1*16(%rsp)
+	movdqa	%xmm2, 2*16(%rsp)
+	movdqa	%xmm3, 3*16(%rsp)
+	movdqa	%xmm4, 4*16(%rsp)
+	movdqa	%xmm5, 5*16(%rsp)
+#endif
+
+	pxor	%xmm0, %xmm0		// accumulators
+	pxor	%xmm1, %xmm1
+	pcmpeqd	%xmm5, %xmm5		// 0x00000000ffffffff mask
+	psrlq	$32, %xmm5
+
+L_sse2_loop:
+	movdqu	0*16(data), %xmm2
+	movdqu	1*16(data), %xmm3
+	movdqa	%xmm2, %xmm4
+	pand	%xmm5, %xmm2
+	psrlq	$32, %xmm4
+	paddq	%xmm2, %xmm0
+	paddq	%xmm4, %xmm1
+	movdqa	%xmm3, %xmm4
+	pand	%xmm5, %xmm3
+	psrlq	$32, %xmm4
+	paddq	%xmm3, %xmm0
+	paddq	%xmm4, %xmm1
+
+	movdqu	2*16(data), %xmm2
+	movdqu	3*16(data), %xmm3
+	movdqa	%xmm2, %xmm4
+	pand	%xmm5, %xmm2
+	psrlq	$32, %xmm4
+	paddq	%xmm2, %xmm0
+	paddq	%xmm4, %xmm1
+	movdqa	%xmm3, %xmm4
+	pand	%xmm5, %xmm3
+	psrlq	$32, %xmm4
+	paddq	%xmm3, %xmm0
+	paddq	%xmm4, %xmm1
+
+	add	$64, data
+	sub	$64, len
+	jg	L_sse2_loop
+
+	/* add the 4 quadword lanes */
+	paddq	%xmm1, %xmm0
+	movq	%xmm0, %rax
+	pshufd	$0x4e, %xmm0, %xmm0
+	movq	%xmm0, %rcx
+	add	%rcx, %rax
+
+	/* fold 64-bit to 33-bit */
+	mov	%rax, %rcx
+	shr	$32, %rcx
+	mov	%eax, %eax
+	add	%rcx, %rax
+
+#ifdef KERNEL
+	/* restore xmm0-xmm5 and deallocate stack space */
+	movdqa	0*16(%rsp), %xmm0
+	movdqa	1*16(%rsp), %xmm1
+	movdqa	2*16(%rsp), %xmm2
+	movdqa	3*16(%rsp), %xmm3
+	movdqa	4*16(%rsp), %xmm4
+	movdqa	5*16(%rsp), %xmm5
+	add	$6*16, %rsp
+#endif
+
+	/* restore callee-saved registers */
+	pop	%rbp
+	ret
+
+#ifndef KERNEL
+	.globl	_os_cpu_in_cksum_avx2
+	.text
+	.align	4
+_os_cpu_in_cksum_avx2:
+
+	/* push callee-saved registers and set up base pointer */
+	push	%rbp
+	movq	%rsp, %rbp
+
+	vpxor	%ymm0, %ymm0, %ymm0	// accumulators
+	vpxor	%ymm1, %ymm1, %ymm1
+	vpcmpeqd %ymm5, %ymm5, %ymm5	// 0x00000000ffffffff mask
+	vpsrlq	$32, %ymm5, %ymm5
+
+L_avx2_loop:
+	vmovdqu	0*32(data), %ymm2
+	vmovdqu	1*32(data), %ymm3
+	vpand	%ymm5, %ymm2, %ymm4
+	vpsrlq	$32, %ymm2, %ymm2
+	vpaddq	%ymm4, %ymm0, %ymm0
+	vpaddq	%ymm2, %ymm1, %ymm1
+	vpand	%ymm5, %ymm3, %ymm4
+	vpsrlq	$32, %ymm3, %ymm3
+	vpaddq	%ymm4, %ymm0, %ymm0
+	vpaddq	%ymm3, %ymm1, %ymm1
+
+	add	$64, data
+	sub	$64, len
+	jg	L_avx2_loop
+
+	/* add the 8 quadword lanes */
+	vpaddq	%ymm1, %ymm0, %ymm0
+	vextracti128 $1, %ymm0, %xmm1
+	vpaddq	%xmm1, %xmm0, %xmm0
+	vmovq	%xmm0, %rax
+	vpextrq	$1, %xmm0, %rcx
+	add	%rcx, %rax
+
+	/* fold 64-bit to 33-bit */
+	mov	%rax, %rcx
+	shr	$32, %rcx
+	mov	%eax, %eax
+	add	%rcx, %rax
+
+	vzeroupper
+
+	/* restore callee-saved registers */
+	pop	%rbp
+	ret
+#endif /* !KERNEL */
@@ -73,6 +73,7 @@
 
 #include <sys/malloc.h>
 #include <sys/sysctl.h>
+#include <sys/kauth.h>
 
 #include <libkern/libkern.h>
 
@@ -426,3 +427,112 @@ SYSCTL_PROC(_kern, OID_AUTO, zones_collectable_bytes,
     CTLTYPE_QUAD | CTLFLAG_RD | CTLFLAG_MASKED | CTLFLAG_LOCKED,
     0, 0, &sysctl_zones_collectable_bytes, "Q",
     "Collectable memory in zones");
+
+/*
+ * kern.zone_cache_info
+ *
+ * Returns an array of struct zone_cache_info, one per zone with
+ * caching enabled, describing the current depth of its magazines,
+ * the size of its per-cpu depots, its recirculation contention rate,
+ * and the traffic through its per-cluster depots.
+ */
+static int
+sysctl_zone_cache_info SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	__block int error = 0;
+
+	if (req->newptr) {
+		return EPERM;
+	}
+
+	zone_cache_info_foreach(^(const struct zone_cache_info *zci) {
+		if (error == 0) {
+		        error = SYSCTL_OUT(req, zci, sizeof(*zci));
+		}
+	});
+
+	return error;
+}
+
+SYSCTL_PROC(_kern, OID_AUTO, zone_cache_info,
+    CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_MASKED | CTLFLAG_LOCKED,
+    0, 0, &sysctl_zone_cache_info, "S,zone_cache_info",
+    "Magazine depth and recirculation contention of cached zones");
+
+SYSCTL_NODE(_kern, OID_AUTO, zone_sample, CTLFLAG_RW | CTLFLAG_LOCKED, 0,
+    "zone sampling profiler");
+
+/*
+ * kern.zone_sample.interval
+ *
+ * Average number of allocated bytes between two samples,
+ * setting it to 0 turns sampling off and discards all samples.
+ */
+static int
+sysctl_zone_sample_interval SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	uint32_t value = zone_sample_get_interval();
+	int changed = 0;
+	int error;
+
+	error = sysctl_io_number(req, value, sizeof(value), &value, &changed);
+	if (error || !changed) {
+		return error;
+	}
+
+	return mach_to_bsd_errno(zone_sample_set_interval(value));
+}
+
+SYSCTL_PROC(_kern_zone_sample, OID_AUTO, interval,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+    0, 0, &sysctl_zone_sample_interval, "IU",
+    "Average bytes allocated between two samples (0 to disable)");
+
+static int
+sysctl_zone_sample_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct zone_sample_stats stats;
+
+	zone_sample_get_stats(&stats);
+	return SYSCTL_OUT(req, &stats, sizeof(stats));
+}
+
+SYSCTL_PROC(_kern_zone_sample, OID_AUTO, stats,
+    CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_LOCKED,
+    0, 0, &sysctl_zone_sample_stats, "S,zone_sample_stats",
+    "Zone sampling profiler statistics");
+
+/*
+ * kern.zone_sample.sites
+ *
+ * Returns an array of struct zone_sample_site_info,
+ * one per (backtrace, zone) pair that was sampled.
+ *
+ * Backtraces describe the kernel text layout, only root may read them.
+ */
+static int
+sysctl_zone_sample_sites SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	__block int error = 0;
+
+	if (req->newptr || !kauth_cred_issuser(kauth_cred_get())) {
+		return EPERM;
+	}
+
+	zone_sample_site_foreach(^(const struct zone_sample_site_info *zssi) {
+		if (error == 0) {
+		        error = SYSCTL_OUT(req, zssi, sizeof(*zssi));
+		}
+	});
+
+	return error;
+}
+
+SYSCTL_PROC(_kern_zone_sample, OID_AUTO, sites,
+    CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_MASKED | CTLFLAG_LOCKED,
+    0, 0, &sysctl_zone_sample_sites, "S,zone_sample_site_info",
+    "Sampled allocations per backtrace and zone");
@@ -4647,6 +4647,8 @@ SYSCTL_INT(_vm, OID_AUTO, compressor_codec, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_com
 SYSCTL_INT(_vm, OID_AUTO, compressor_test_wp, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_test_seg_wp, 0, "");
 
 SYSCTL_INT(_vm, OID_AUTO, wksw_force, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_compressor_force_sw_wkdm, 0, "");
+extern int WKdm_sw_simd_enabled;
+SYSCTL_INT(_vm, OID_AUTO, wksw_simd, CTLFLAG_RW | CTLFLAG_LOCKED, &WKdm_sw_simd_enabled, 0, "");
 extern int precompy, wkswhw;
 
 SYSCTL_INT(_vm, OID_AUTO, precompy, CTLFLAG_RW | CTLFLAG_LOCKED, &precompy, 0, "");
@@ -204,6 +204,11 @@ static int bpf_hdr_comp_enable = 1;
 SYSCTL_INT(_debug, OID_AUTO, bpf_hdr_comp_enable, CTLFLAG_RW | CTLFLAG_LOCKED,
     &bpf_hdr_comp_enable, 1, "");
 
+/* Precompile filters set with BIOCSETF, see bpf_compile() */
+static int bpf_filter_compile = 1;
+SYSCTL_INT(_debug, OID_AUTO, bpf_filter_compile, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &bpf_filter_compile, 1, "");
+
 static int sysctl_bpf_stats SYSCTL_HANDLER_ARGS;
 SYSCTL_PROC(_debug, OID_AUTO, bpf_stats, CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_LOCKED,
     0, 0,
@@ -2446,6 +2451,7 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns,
     u_long cmd)
 {
 	struct bpf_insn *fcode, *old;
+	struct bpf_cprog *cfcode, *cold;
 	u_int flen, size;
 
 	while (d->bd_hbuf_read) {
@@ -2457,15 +2463,20 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns,
 	}
 
 	old = d->bd_filter;
+	cold = d->bd_filter_compiled;
 	if (bf_insns == USER_ADDR_NULL) {
 		if (bf_len != 0) {
 			return EINVAL;
 		}
 		d->bd_filter = NULL;
+		d->bd_filter_compiled = NULL;
 		reset_d(d);
 		if (old != 0) {
 			kfree_data_addr(old);
 		}
+		if (cold != NULL) {
+			bpf_compiled_free(cold);
+		}
 		return 0;
 	}
 	flen = bf_len;
@@ -2480,7 +2491,11 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns,
 	}
 	if (copyin(bf_insns, (caddr_t)fcode, size) == 0 &&
 	    bpf_validate(fcode, (int)flen)) {
+		/* on failure, bpf_tap_imp() falls back to bpf_filter() */
+		cfcode = bpf_filter_compile ? bpf_compile(fcode, flen) : NULL;
+
 		d->bd_filter = fcode;
+		d->bd_filter_compiled = cfcode;
 
 		if (cmd == BIOCSETF32 || cmd == BIOCSETF64) {
 			reset_d(d);
@@ -2489,6 +2504,9 @@ bpf_setf(struct bpf_d *d, u_int bf_len, user_addr_t bf_insns,
 		if (old != 0) {
 			kfree_data_addr(old);
 		}
+		if (cold != NULL) {
+			bpf_compiled_free(cold);
+		}
 
 		return 0;
 	}
@@ -3040,8 +3058,13 @@ bpf_tap_imp(
 		}
 
 		++d->bd_rcount;
-		slen = bpf_filter(d->bd_filter, (u_char *)bpf_pkt,
-		    (u_int)bpf_pkt->bpfp_total_length, 0);
+		if (d->bd_filter_compiled != NULL) {
+			slen = bpf_filter_compiled(d->bd_filter_compiled,
+			    (u_char *)bpf_pkt, (u_int)bpf_pkt->bpfp_total_length, 0);
+		} else {
+			slen = bpf_filter(d->bd_filter, (u_char *)bpf_pkt,
+			    (u_int)bpf_pkt->bpfp_total_length, 0);
+		}
 
 		if (slen != 0) {
 			if (bp->bif_ifp->if_type == IFT_PKTAP &&
@@ -4022,6 +4045,9 @@ bpf_freed(struct bpf_d *d)
 	if (d->bd_filter) {
 		kfree_data_addr(d->bd_filter);
 	}
+	if (d->bd_filter_compiled != NULL) {
+		bpf_compiled_free(d->bd_filter_compiled);
+	}
 }
 
 /*
@@ -4369,3 +4395,126 @@ sysctl_bpf_stats SYSCTL_HANDLER_ARGS
 	kfree_data(xbdbuf, buf_size);
 	return error;
 }
+
+#if DEVELOPMENT || DEBUG
+/*
+ * Runs a filter through both bpf_filter() and its compiled form on an
+ * mbuf chain laid out as requested, for tests/bpf_filter_compile.c:
+ * the data is split into an optional bpfp_header and one mbuf per
+ * segment, so that loads can straddle the header and the mbufs.
+ */
+#define BPF_FILTER_PROBE_MAX_INSNS      64
+#define BPF_FILTER_PROBE_MAX_SEGS       16
+#define BPF_FILTER_PROBE_MAX_DATA       256
+
+struct bpf_filter_probe {
+	uint32_t        bfp_ninsns;
+	uint32_t        bfp_wirelen;
+	uint16_t        bfp_hdrlen;
+	uint16_t        bfp_nsegs;
+	uint16_t        bfp_seglen[BPF_FILTER_PROBE_MAX_SEGS];
+	struct bpf_insn bfp_insns[BPF_FILTER_PROBE_MAX_INSNS];
+	u_char          bfp_data[BPF_FILTER_PROBE_MAX_DATA];
+};
+
+struct bpf_filter_probe_result {
+	uint32_t        bfpr_interpreted;
+	uint32_t        bfpr_compiled;
+};
+
+static int
+bpf_filter_probe(struct bpf_filter_probe *p,
+    struct bpf_filter_probe_result *res)
+{
+	struct bpf_packet bpf_pkt = {};
+	struct bpf_cprog *prog;
+	struct mbuf *m, *head = NULL, **tail = &head;
+	size_t off = p->bfp_hdrlen;
+	int error = 0;
+
+	if (p->bfp_ninsns == 0 || p->bfp_ninsns > BPF_FILTER_PROBE_MAX_INSNS ||
+	    p->bfp_nsegs == 0 || p->bfp_nsegs > BPF_FILTER_PROBE_MAX_SEGS ||
+	    !bpf_validate(p->bfp_insns, (int)p->bfp_ninsns)) {
+		return EINVAL;
+	}
+	for (uint16_t i = 0; i < p->bfp_nsegs; i++) {
+		off += p->bfp_seglen[i];
+	}
+	if (off > BPF_FILTER_PROBE_MAX_DATA || off > p->bfp_wirelen) {
+		return EINVAL;
+	}
+
+	prog = bpf_compile(p->bfp_insns, p->bfp_ninsns);
+	if (prog == NULL) {
+		return EINVAL;
+	}
+
+	off = p->bfp_hdrlen;
+	for (uint16_t i = 0; i < p->bfp_nsegs; i++) {
+		m = m_getcl(M_WAITOK, MT_DATA, 0);
+		if (m == NULL) {
+			error = ENOBUFS;
+			goto out;
+		}
+		bcopy(&p->bfp_data[off], mtod(m, u_char *), p->bfp_seglen[i]);
+		m->m_len = p->bfp_seglen[i];
+		off += p->bfp_seglen[i];
+		*tail = m;
+		tail = &m->m_next;
+	}
+
+	bpf_pkt.bpfp_type = BPF_PACKET_TYPE_MBUF;
+	bpf_pkt.bpfp_mbuf = head;
+	if (p->bfp_hdrlen != 0) {
+		bpf_pkt.bpfp_header = p->bfp_data;
+		bpf_pkt.bpfp_header_length = p->bfp_hdrlen;
+	}
+	bpf_pkt.bpfp_total_length = off;
+
+	res->bfpr_interpreted = bpf_filter(p->bfp_insns, (u_char *)&bpf_pkt,
+	    p->bfp_wirelen, 0);
+	res->bfpr_compiled = bpf_filter_compiled(prog, (u_char *)&bpf_pkt,
+	    p->bfp_wirelen, 0);
+
+out:
+	if (head != NULL) {
+		m_freem(head);
+	}
+	bpf_compiled_free(prog);
+	return error;
+}
+
+static int
+sysctl_bpf_filter_probe SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct bpf_filter_probe_result res = {};
+	struct bpf_filter_probe *p;
+	int error;
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		return SYSCTL_OUT(req, NULL, sizeof(res));
+	}
+	if (req->newptr == USER_ADDR_NULL || req->newlen != sizeof(*p)) {
+		return EINVAL;
+	}
+
+	p = kalloc_data(sizeof(*p), Z_WAITOK | Z_ZERO);
+	if (p == NULL) {
+		return ENOMEM;
+	}
+	error = SYSCTL_IN(req, p, sizeof(*p));
+	if (error == 0) {
+		error = bpf_filter_probe(p, &res);
+	}
+	if (error == 0) {
+		error = SYSCTL_OUT(req, &res, sizeof(res));
+	}
+	kfree_data(p, sizeof(*p));
+	return error;
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, bpf_filter_probe,
+    CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_LOCKED | CTLFLAG_MASKED, 0, 0,
+    sysctl_bpf_filter_probe, "S", "Run a BPF filter on an mbuf chain, interpreted and compiled");
+#endif /* DEVELOPMENT || DEBUG */
@@ -1477,6 +1477,11 @@ extern int      bpf_validate(const struct bpf_insn *, int);
 extern void     bpfdetach(struct ifnet *);
 extern void     bpfilterattach(int);
 extern u_int    bpf_filter(const struct bpf_insn *, u_char *, u_int, u_int);
+
+struct bpf_cprog;
+extern struct bpf_cprog *bpf_compile(const struct bpf_insn *, u_int);
+extern void     bpf_compiled_free(struct bpf_cprog *);
+extern u_int    bpf_filter_compiled(const struct bpf_cprog *, u_char *, u_int, u_int);
 #endif /* KERNEL_PRIVATE */
 
 #endif /* !defined(DRIVERKIT) */
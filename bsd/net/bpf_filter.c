@@ -76,6 +76,7 @@
 
 #ifdef KERNEL
 #include <sys/mbuf.h>
+#include <kern/kalloc.h>
 #endif
 #include <net/bpf.h>
 #ifdef KERNEL
@@ -757,6 +758,723 @@ bpf_filter(const struct bpf_insn *pc, u_char *p, u_int wirelen, u_int buflen)
 	}
 }
 
+/*
+ * Compiled filters
+ *
+ * The kernel can't map code generated at run time as executable, so
+ * instead of translating filters to native code, bpf_compile() turns a
+ * validated program into a form that is cheaper to interpret than the
+ * classic encoding:
+ *
+ * - opcodes are renumbered densely so that the dispatch is a single
+ *   jump table, and invalid opcodes become an explicit "return 0",
+ *
+ * - relative jump offsets are resolved to absolute instruction indices,
+ *
+ * - a packet load at a constant offset immediately followed by an
+ *   equality test against a constant (the bulk of what tcpdump emits)
+ *   is fused into a single instruction when the test isn't the target
+ *   of another jump,
+ *
+ * - packet loads first try the two contiguous windows of the packet
+ *   (the optional header and the first mbuf or buflet), computed once
+ *   per packet, and only walk the chain when a load falls outside of them.
+ *
+ * Compiled instructions map 1:1 to the original ones, and the result of
+ * bpf_filter_compiled() is always the same as bpf_filter()'s for the
+ * same program and packet.
+ */
+enum {
+	BPF_C_RET_ZERO = 0,
+	BPF_C_RET_K,
+	BPF_C_RET_A,
+	BPF_C_LD_W_ABS,
+	BPF_C_LD_H_ABS,
+	BPF_C_LD_B_ABS,
+	BPF_C_LD_W_IND,
+	BPF_C_LD_H_IND,
+	BPF_C_LD_B_IND,
+	BPF_C_LD_W_ABS_JEQ,
+	BPF_C_LD_H_ABS_JEQ,
+	BPF_C_LD_B_ABS_JEQ,
+	BPF_C_LDX_MSH,
+	BPF_C_LD_LEN,
+	BPF_C_LDX_LEN,
+	BPF_C_LD_IMM,
+	BPF_C_LDX_IMM,
+	BPF_C_LD_MEM,
+	BPF_C_LDX_MEM,
+	BPF_C_ST,
+	BPF_C_STX,
+	BPF_C_JA,
+	BPF_C_JGT_K,
+	BPF_C_JGE_K,
+	BPF_C_JEQ_K,
+	BPF_C_JSET_K,
+	BPF_C_JGT_X,
+	BPF_C_JGE_X,
+	BPF_C_JEQ_X,
+	BPF_C_JSET_X,
+	BPF_C_ADD_K,
+	BPF_C_SUB_K,
+	BPF_C_MUL_K,
+	BPF_C_DIV_K,
+	BPF_C_AND_K,
+	BPF_C_OR_K,
+	BPF_C_LSH_K,
+	BPF_C_RSH_K,
+	BPF_C_ADD_X,
+	BPF_C_SUB_X,
+	BPF_C_MUL_X,
+	BPF_C_DIV_X,
+	BPF_C_AND_X,
+	BPF_C_OR_X,
+	BPF_C_LSH_X,
+	BPF_C_RSH_X,
+	BPF_C_NEG,
+	BPF_C_TAX,
+	BPF_C_TXA,
+};
+
+struct bpf_cinsn {
+	uint16_t        ci_op;          /* BPF_C_* */
+	uint16_t        ci_jt;          /* absolute jump targets */
+	uint16_t        ci_jf;
+	bpf_u_int32     ci_k;
+	bpf_u_int32     ci_k2;          /* constant of a fused comparison */
+};
+
+struct bpf_cprog {
+	u_int           bcp_len;
+	struct bpf_cinsn bcp_insns[];
+};
+
+/*
+ * Contiguous windows of the packet being filtered.
+ */
+struct bpf_cwin {
+	const u_char    *bw_base[2];
+	size_t          bw_len[2];
+	int             bw_flat;        /* plain buffer, no chain to walk */
+#ifdef KERNEL
+	struct bpf_packet *bw_bp;
+#endif /* KERNEL */
+};
+
+static void
+bpf_cwin_init(struct bpf_cwin *w, u_char *p, u_int buflen)
+{
+	bzero(w, sizeof(*w));
+#ifdef KERNEL
+	if (buflen == 0) {
+		struct bpf_packet *bp = (struct bpf_packet *)(void *)p;
+
+		w->bw_bp = bp;
+		switch (bp->bpfp_type) {
+		case BPF_PACKET_TYPE_MBUF:
+			w->bw_base[0] = bp->bpfp_header;
+			w->bw_len[0] = bp->bpfp_header_length;
+			if (bp->bpfp_mbuf != NULL) {
+				w->bw_base[1] = mtod(bp->bpfp_mbuf, u_char *);
+				w->bw_len[1] = bp->bpfp_mbuf->m_len;
+			}
+			break;
+#if SKYWALK
+		case BPF_PACKET_TYPE_PKT: {
+			kern_buflet_t buflet;
+			u_char *addr;
+
+			w->bw_base[0] = bp->bpfp_header;
+			w->bw_len[0] = bp->bpfp_header_length;
+			buflet = kern_packet_get_next_buflet(bp->bpfp_pkt, NULL);
+			if (buflet != NULL &&
+			    (addr = buflet_get_address(buflet)) != NULL) {
+				w->bw_base[1] = addr;
+				w->bw_len[1] = kern_buflet_get_data_length(buflet);
+			}
+			break;
+		}
+#endif /* SKYWALK */
+		default:
+			/* bp_x*() fail all loads from unknown packet types */
+			break;
+		}
+		return;
+	}
+#endif /* KERNEL */
+	w->bw_base[0] = p;
+	w->bw_len[0] = buflen;
+	w->bw_flat = 1;
+}
+
+/*
+ * Load size bytes at offset k of the packet, returns 0 if out of bounds.
+ */
+static inline int
+bpf_cload(const struct bpf_cwin *w, bpf_u_int32 k, u_int size, u_int32_t *val)
+{
+	const u_char *cp;
+
+	if (k < w->bw_len[0] && size <= w->bw_len[0] - k) {
+		cp = w->bw_base[0] + k;
+	} else if (k >= w->bw_len[0] && size <= w->bw_len[1] &&
+	    k - w->bw_len[0] <= w->bw_len[1] - size) {
+		cp = w->bw_base[1] + (k - w->bw_len[0]);
+	} else {
+#ifdef KERNEL
+		int merr = 1;
+
+		if (w->bw_bp == NULL) {
+			return 0;
+		}
+		switch (size) {
+		case sizeof(int32_t):
+			*val = bp_xword(w->bw_bp, k, &merr);
+			break;
+		case sizeof(int16_t):
+			*val = bp_xhalf(w->bw_bp, k, &merr);
+			break;
+		default:
+			*val = bp_xbyte(w->bw_bp, k, &merr);
+			break;
+		}
+		return merr == 0;
+#else /* KERNEL */
+		return 0;
+#endif /* KERNEL */
+	}
+
+	switch (size) {
+	case sizeof(int32_t):
+		*val = EXTRACT_LONG(cp);
+		break;
+	case sizeof(int16_t):
+		*val = EXTRACT_SHORT(cp);
+		break;
+	default:
+		*val = *cp;
+		break;
+	}
+	return 1;
+}
+
+/*
+ * Compiled opcode for a packet load of the given base (BPF_C_LD_W_*),
+ * the H and B variants follow the W one.
+ */
+static uint16_t
+bpf_compile_load(uint16_t base, u_short code)
+{
+	switch (BPF_SIZE(code)) {
+	case BPF_W:
+		return base;
+	case BPF_H:
+		return base + 1;
+	default:
+		return base + 2;
+	}
+}
+
+/*
+ * Translate the program f of len instructions into out, which must have
+ * room for len compiled instructions.  Returns 0 if a jump is out of range,
+ * which bpf_validate() would have rejected.
+ */
+static int
+bpf_compile_insns(const struct bpf_insn *f, u_int len, struct bpf_cinsn *out)
+{
+	uint8_t targets[howmany(BPF_MAXINSNS, NBBY)];
+	const struct bpf_insn *p;
+	struct bpf_cinsn *ci;
+	u_int i;
+
+	if (len < 1 || len > BPF_MAXINSNS) {
+		return 0;
+	}
+
+	bzero(targets, sizeof(targets));
+	bzero(out, len * sizeof(*out));
+
+	/* resolve jumps, and note which instructions are jumped to */
+	for (i = 0; i < len; i++) {
+		p = &f[i];
+		ci = &out[i];
+		if (BPF_CLASS(p->code) != BPF_JMP) {
+			continue;
+		}
+		if (BPF_OP(p->code) == BPF_JA) {
+			if (p->k >= len - i - 1) {
+				return 0;
+			}
+			ci->ci_jt = (uint16_t)(i + 1 + p->k);
+			setbit(targets, ci->ci_jt);
+		} else {
+			if (p->jt >= len - i - 1 || p->jf >= len - i - 1) {
+				return 0;
+			}
+			ci->ci_jt = (uint16_t)(i + 1 + p->jt);
+			ci->ci_jf = (uint16_t)(i + 1 + p->jf);
+			setbit(targets, ci->ci_jt);
+			setbit(targets, ci->ci_jf);
+		}
+	}
+
+	for (i = 0; i < len; i++) {
+		p = &f[i];
+		ci = &out[i];
+		ci->ci_k = p->k;
+
+		switch (p->code) {
+		case BPF_RET | BPF_K:
+			ci->ci_op = BPF_C_RET_K;
+			break;
+		case BPF_RET | BPF_A:
+			ci->ci_op = BPF_C_RET_A;
+			break;
+
+		case BPF_LD | BPF_W | BPF_ABS:
+		case BPF_LD | BPF_H | BPF_ABS:
+		case BPF_LD | BPF_B | BPF_ABS:
+			ci->ci_op = bpf_compile_load(BPF_C_LD_W_ABS, p->code);
+			if (i + 1 < len &&
+			    f[i + 1].code == (BPF_JMP | BPF_JEQ | BPF_K) &&
+			    isclr(targets, i + 1)) {
+				ci->ci_op = bpf_compile_load(BPF_C_LD_W_ABS_JEQ, p->code);
+				ci->ci_k2 = f[i + 1].k;
+				ci->ci_jt = out[i + 1].ci_jt;
+				ci->ci_jf = out[i + 1].ci_jf;
+			}
+			break;
+		case BPF_LD | BPF_W | BPF_IND:
+		case BPF_LD | BPF_H | BPF_IND:
+		case BPF_LD | BPF_B | BPF_IND:
+			ci->ci_op = bpf_compile_load(BPF_C_LD_W_IND, p->code);
+			break;
+		case BPF_LDX | BPF_MSH | BPF_B:
+			ci->ci_op = BPF_C_LDX_MSH;
+			break;
+		case BPF_LD | BPF_W | BPF_LEN:
+			ci->ci_op = BPF_C_LD_LEN;
+			break;
+		case BPF_LDX | BPF_W | BPF_LEN:
+			ci->ci_op = BPF_C_LDX_LEN;
+			break;
+		case BPF_LD | BPF_IMM:
+			ci->ci_op = BPF_C_LD_IMM;
+			break;
+		case BPF_LDX | BPF_IMM:
+			ci->ci_op = BPF_C_LDX_IMM;
+			break;
+
+		case BPF_LD | BPF_MEM:
+		case BPF_LDX | BPF_MEM:
+		case BPF_ST:
+		case BPF_STX:
+			if (p->k >= BPF_MEMWORDS) {
+				ci->ci_op = BPF_C_RET_ZERO;
+				break;
+			}
+			switch (p->code) {
+			case BPF_LD | BPF_MEM:
+				ci->ci_op = BPF_C_LD_MEM;
+				break;
+			case BPF_LDX | BPF_MEM:
+				ci->ci_op = BPF_C_LDX_MEM;
+				break;
+			case BPF_ST:
+				ci->ci_op = BPF_C_ST;
+				break;
+			default:
+				ci->ci_op = BPF_C_STX;
+				break;
+			}
+			break;
+
+		case BPF_JMP | BPF_JA:
+			ci->ci_op = BPF_C_JA;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_K:
+			ci->ci_op = BPF_C_JGT_K;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_K:
+			ci->ci_op = BPF_C_JGE_K;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_K:
+			ci->ci_op = BPF_C_JEQ_K;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_K:
+			ci->ci_op = BPF_C_JSET_K;
+			break;
+		case BPF_JMP | BPF_JGT | BPF_X:
+			ci->ci_op = BPF_C_JGT_X;
+			break;
+		case BPF_JMP | BPF_JGE | BPF_X:
+			ci->ci_op = BPF_C_JGE_X;
+			break;
+		case BPF_JMP | BPF_JEQ | BPF_X:
+			ci->ci_op = BPF_C_JEQ_X;
+			break;
+		case BPF_JMP | BPF_JSET | BPF_X:
+			ci->ci_op = BPF_C_JSET_X;
+			break;
+
+		case BPF_ALU | BPF_ADD | BPF_K:
+			ci->ci_op = BPF_C_ADD_K;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_K:
+			ci->ci_op = BPF_C_SUB_K;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_K:
+			ci->ci_op = BPF_C_MUL_K;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_K:
+			ci->ci_op = p->k != 0 ? BPF_C_DIV_K : BPF_C_RET_ZERO;
+			break;
+		case BPF_ALU | BPF_AND | BPF_K:
+			ci->ci_op = BPF_C_AND_K;
+			break;
+		case BPF_ALU | BPF_OR | BPF_K:
+			ci->ci_op = BPF_C_OR_K;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_K:
+			ci->ci_op = BPF_C_LSH_K;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_K:
+			ci->ci_op = BPF_C_RSH_K;
+			break;
+		case BPF_ALU | BPF_ADD | BPF_X:
+			ci->ci_op = BPF_C_ADD_X;
+			break;
+		case BPF_ALU | BPF_SUB | BPF_X:
+			ci->ci_op = BPF_C_SUB_X;
+			break;
+		case BPF_ALU | BPF_MUL | BPF_X:
+			ci->ci_op = BPF_C_MUL_X;
+			break;
+		case BPF_ALU | BPF_DIV | BPF_X:
+			ci->ci_op = BPF_C_DIV_X;
+			break;
+		case BPF_ALU | BPF_AND | BPF_X:
+			ci->ci_op = BPF_C_AND_X;
+			break;
+		case BPF_ALU | BPF_OR | BPF_X:
+			ci->ci_op = BPF_C_OR_X;
+			break;
+		case BPF_ALU | BPF_LSH | BPF_X:
+			ci->ci_op = BPF_C_LSH_X;
+			break;
+		case BPF_ALU | BPF_RSH | BPF_X:
+			ci->ci_op = BPF_C_RSH_X;
+			break;
+		case BPF_ALU | BPF_NEG:
+			ci->ci_op = BPF_C_NEG;
+			break;
+		case BPF_MISC | BPF_TAX:
+			ci->ci_op = BPF_C_TAX;
+			break;
+		case BPF_MISC | BPF_TXA:
+			ci->ci_op = BPF_C_TXA;
+			break;
+
+		default:
+			ci->ci_op = BPF_C_RET_ZERO;
+			break;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Execute the compiled filter program starting at pc on the packet p,
+ * with the same arguments and result as bpf_filter().
+ */
+static u_int
+bpf_filter_cinsns(const struct bpf_cinsn *pc, u_char *p, u_int wirelen,
+    u_int buflen)
+{
+	const struct bpf_cinsn *insns = pc;
+	u_int32_t A = 0, X = 0, v;
+	bpf_u_int32 k;
+	int32_t mem[BPF_MEMWORDS];
+	struct bpf_cwin win;
+
+	bzero(mem, sizeof(mem));
+	bpf_cwin_init(&win, p, buflen);
+
+	while (1) {
+		switch (pc->ci_op) {
+		case BPF_C_RET_ZERO:
+		default:
+			return 0;
+
+		case BPF_C_RET_K:
+			return (u_int)pc->ci_k;
+
+		case BPF_C_RET_A:
+			return (u_int)A;
+
+		case BPF_C_LD_W_ABS:
+			if (!bpf_cload(&win, pc->ci_k, sizeof(int32_t), &A)) {
+				return 0;
+			}
+			break;
+
+		case BPF_C_LD_H_ABS:
+			if (!bpf_cload(&win, pc->ci_k, sizeof(int16_t), &A)) {
+				return 0;
+			}
+			break;
+
+		case BPF_C_LD_B_ABS:
+			if (!bpf_cload(&win, pc->ci_k, sizeof(int8_t), &A)) {
+				return 0;
+			}
+			break;
+
+		case BPF_C_LD_W_ABS_JEQ:
+			if (!bpf_cload(&win, pc->ci_k, sizeof(int32_t), &A)) {
+				return 0;
+			}
+			pc = &insns[(A == pc->ci_k2) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_LD_H_ABS_JEQ:
+			if (!bpf_cload(&win, pc->ci_k, sizeof(int16_t), &A)) {
+				return 0;
+			}
+			pc = &insns[(A == pc->ci_k2) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_LD_B_ABS_JEQ:
+			if (!bpf_cload(&win, pc->ci_k, sizeof(int8_t), &A)) {
+				return 0;
+			}
+			pc = &insns[(A == pc->ci_k2) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		/* plain buffers never wrap around, see bpf_filter() */
+		case BPF_C_LD_W_IND:
+			k = X + pc->ci_k;
+			if ((win.bw_flat && k < X) ||
+			    !bpf_cload(&win, k, sizeof(int32_t), &A)) {
+				return 0;
+			}
+			break;
+
+		case BPF_C_LD_H_IND:
+			k = X + pc->ci_k;
+			if ((win.bw_flat && k < X) ||
+			    !bpf_cload(&win, k, sizeof(int16_t), &A)) {
+				return 0;
+			}
+			break;
+
+		case BPF_C_LD_B_IND:
+			k = X + pc->ci_k;
+			if ((win.bw_flat && k < X) ||
+			    !bpf_cload(&win, k, sizeof(int8_t), &A)) {
+				return 0;
+			}
+			break;
+
+		case BPF_C_LDX_MSH:
+			if (!bpf_cload(&win, pc->ci_k, sizeof(int8_t), &v)) {
+				return 0;
+			}
+			X = (v & 0xf) << 2;
+			break;
+
+		case BPF_C_LD_LEN:
+			A = wirelen;
+			break;
+
+		case BPF_C_LDX_LEN:
+			X = wirelen;
+			break;
+
+		case BPF_C_LD_IMM:
+			A = pc->ci_k;
+			break;
+
+		case BPF_C_LDX_IMM:
+			X = pc->ci_k;
+			break;
+
+		case BPF_C_LD_MEM:
+			A = mem[pc->ci_k];
+			break;
+
+		case BPF_C_LDX_MEM:
+			X = mem[pc->ci_k];
+			break;
+
+		case BPF_C_ST:
+			mem[pc->ci_k] = A;
+			break;
+
+		case BPF_C_STX:
+			mem[pc->ci_k] = X;
+			break;
+
+		case BPF_C_JA:
+			pc = &insns[pc->ci_jt];
+			continue;
+
+		case BPF_C_JGT_K:
+			pc = &insns[(A > pc->ci_k) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_JGE_K:
+			pc = &insns[(A >= pc->ci_k) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_JEQ_K:
+			pc = &insns[(A == pc->ci_k) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_JSET_K:
+			pc = &insns[(A & pc->ci_k) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_JGT_X:
+			pc = &insns[(A > X) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_JGE_X:
+			pc = &insns[(A >= X) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_JEQ_X:
+			pc = &insns[(A == X) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_JSET_X:
+			pc = &insns[(A & X) ? pc->ci_jt : pc->ci_jf];
+			continue;
+
+		case BPF_C_ADD_K:
+			A += pc->ci_k;
+			break;
+
+		case BPF_C_SUB_K:
+			A -= pc->ci_k;
+			break;
+
+		case BPF_C_MUL_K:
+			A *= pc->ci_k;
+			break;
+
+		case BPF_C_DIV_K:
+			A /= pc->ci_k;
+			break;
+
+		case BPF_C_AND_K:
+			A &= pc->ci_k;
+			break;
+
+		case BPF_C_OR_K:
+			A |= pc->ci_k;
+			break;
+
+		case BPF_C_LSH_K:
+			A <<= pc->ci_k;
+			break;
+
+		case BPF_C_RSH_K:
+			A >>= pc->ci_k;
+			break;
+
+		case BPF_C_ADD_X:
+			A += X;
+			break;
+
+		case BPF_C_SUB_X:
+			A -= X;
+			break;
+
+		case BPF_C_MUL_X:
+			A *= X;
+			break;
+
+		case BPF_C_DIV_X:
+			if (X == 0) {
+				return 0;
+			}
+			A /= X;
+			break;
+
+		case BPF_C_AND_X:
+			A &= X;
+			break;
+
+		case BPF_C_OR_X:
+			A |= X;
+			break;
+
+		case BPF_C_LSH_X:
+			A <<= X;
+			break;
+
+		case BPF_C_RSH_X:
+			A >>= X;
+			break;
+
+		case BPF_C_NEG:
+			A = -A;
+			break;
+
+		case BPF_C_TAX:
+			X = A;
+			break;
+
+		case BPF_C_TXA:
+			A = X;
+			break;
+		}
+		pc++;
+	}
+}
+
+#ifdef KERNEL
+/*
+ * Compile a program that passed bpf_validate(), returns NULL on failure
+ * in which case the caller should keep using bpf_filter().
+ */
+struct bpf_cprog *
+bpf_compile(const struct bpf_insn *f, u_int len)
+{
+	struct bpf_cprog *prog;
+
+	if (len < 1 || len > BPF_MAXINSNS) {
+		return NULL;
+	}
+	prog = kalloc_data(sizeof(*prog) + len * sizeof(struct bpf_cinsn),
+	    Z_WAITOK | Z_ZERO);
+	if (prog == NULL) {
+		return NULL;
+	}
+	prog->bcp_len = len;
+	if (!bpf_compile_insns(f, len, prog->bcp_insns)) {
+		bpf_compiled_free(prog);
+		return NULL;
+	}
+	return prog;
+}
+
+void
+bpf_compiled_free(struct bpf_cprog *prog)
+{
+	kfree_data(prog, sizeof(*prog) + prog->bcp_len * sizeof(struct bpf_cinsn));
+}
+
+u_int
+bpf_filter_compiled(const struct bpf_cprog *prog, u_char *p, u_int wirelen,
+    u_int buflen)
+{
+	return bpf_filter_cinsns(prog->bcp_insns, p, wirelen, buflen);
+}
+#endif /* KERNEL */
+
 #ifdef KERNEL
 /*
  * Return true if the 'fcode' is a valid filter program.
@@ -111,6 +111,7 @@ struct bpf_d {
 	uint32_t        bd_rtout;       /* Read timeout in 'ticks' */
 	struct bpf_if   *bd_bif;        /* interface descriptor */
 	struct bpf_insn *bd_filter;     /* filter code */
+	struct bpf_cprog *bd_filter_compiled; /* compiled bd_filter, if any */
 	uint64_t        bd_rcount;      /* number of packets received */
 	uint64_t        bd_dcount;      /* number of received packets dropped */
 	uint64_t        bd_fcount;      /* number of received packets which matched filter */
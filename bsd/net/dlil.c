@@ -92,6 +92,7 @@
 #include <netinet/ip_var.h>
 #include <netinet/tcp.h>
 #include <netinet/tcp_var.h>
+#include <netinet/tcp_seq.h>
 #include <netinet/udp.h>
 #include <netinet/udp_var.h>
 #include <netinet/if_ether.h>
@@ -104,6 +105,7 @@
 
 #include <net/nat464_utils.h>
 #include <netinet6/in6_var.h>
+#include <netinet6/ip6_var.h>
 #include <netinet6/nd6.h>
 #include <netinet6/mld6_var.h>
 #include <netinet6/scope6_var.h>
@@ -419,6 +421,15 @@ static void dlil_rxpoll_input_thread_cont(void *, wait_result_t);
 static int dlil_create_input_thread(ifnet_t, struct dlil_threading_info *,
     thread_continue_t *);
 static void dlil_terminate_input_thread(struct dlil_threading_info *);
+static struct mbuf *dlil_gro_input(struct dlil_gro *, struct ifnet *,
+    boolean_t, uint32_t, struct mbuf *, u_int32_t *);
+static void dlil_gro_purge(struct dlil_threading_info *);
+static void dlil_create_rss_input_threads(struct ifnet *,
+    struct dlil_threading_info *, uint32_t);
+static void dlil_destroy_rss_input_threads(struct dlil_threading_info *);
+static errno_t dlil_input_rss(struct dlil_threading_info *, struct ifnet *,
+    struct mbuf *, const struct ifnet_stat_increment_param *, boolean_t,
+    struct thread *);
 static void dlil_input_stats_add(const struct ifnet_stat_increment_param *,
     struct dlil_threading_info *, struct ifnet *, boolean_t);
 static boolean_t dlil_input_stats_sync(struct ifnet *,
@@ -687,6 +698,20 @@ SYSCTL_UINT(_net_link_generic_system, OID_AUTO, dlil_input_threads,
     CTLFLAG_RD | CTLFLAG_LOCKED, &cur_dlil_input_threads, 0,
     "Current number of DLIL input threads");
 
+static u_int32_t if_input_threads = 1;
+static u_int32_t dlil_rss_seed;         /* receive steering hash seed */
+static int sysctl_input_threads SYSCTL_HANDLER_ARGS;
+SYSCTL_PROC(_net_link_generic_system, OID_AUTO, input_threads_per_if,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED, &if_input_threads, 0,
+    sysctl_input_threads, "I",
+    "input threads per interface with the legacy input model "
+    "(applies to interfaces attached afterwards)");
+
+static int sysctl_input_queue_stats SYSCTL_HANDLER_ARGS;
+SYSCTL_NODE(_net_link_generic_system, OID_AUTO, input_queue_stats,
+    CTLFLAG_RD | CTLFLAG_LOCKED, sysctl_input_queue_stats,
+    "per input thread queue statistics of an interface");
+
 #if IFNET_INPUT_SANITY_CHK
 SYSCTL_UINT(_net_link_generic_system, OID_AUTO, dlil_input_sanity_check,
     CTLFLAG_RW | CTLFLAG_LOCKED, &dlil_input_sanity_check, 0,
@@ -804,6 +829,31 @@ SYSCTL_UINT(_net_link_generic_system, OID_AUTO, hwcksum_rx,
     CTLFLAG_RW | CTLFLAG_LOCKED, &hwcksum_rx, 0,
     "enable receive hardware checksum offload");
 
+static uint32_t sw_gro = 1;
+SYSCTL_UINT(_net_link_generic_system, OID_AUTO, sw_gro,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &sw_gro, 0,
+    "enable software receive offload on interfaces that ask for it");
+
+static uint32_t sw_gro_flush_usec = 0;
+SYSCTL_UINT(_net_link_generic_system, OID_AUTO, sw_gro_flush_usec,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &sw_gro_flush_usec, 0,
+    "hold coalesced packets across input batches for up to this long");
+
+static uint64_t sw_gro_merged = 0;
+SYSCTL_QUAD(_net_link_generic_system, OID_AUTO, sw_gro_merged,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &sw_gro_merged,
+    "inbound TCP segments merged into a previous segment");
+
+static uint64_t sw_gro_flushed = 0;
+SYSCTL_QUAD(_net_link_generic_system, OID_AUTO, sw_gro_flushed,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &sw_gro_flushed,
+    "coalesced packets handed to protocol input");
+
+static uint64_t sw_gro_flushed_timeout = 0;
+SYSCTL_QUAD(_net_link_generic_system, OID_AUTO, sw_gro_flushed_timeout,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &sw_gro_flushed_timeout,
+    "coalesced packets flushed by the hold timeout");
+
 SYSCTL_PROC(_net_link_generic_system, OID_AUTO, tx_chain_len_stats,
     CTLFLAG_RD | CTLFLAG_LOCKED, 0, 9,
     sysctl_tx_chain_len_stats, "S", "");
@@ -2346,8 +2396,13 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp,
 		 */
 		func = dlil_input_thread_func;
 		VERIFY(inp != dlil_main_input_thread);
-		(void) snprintf(inp->dlth_name, DLIL_THREADNAME_LEN,
-		    "%s_input", if_name(ifp));
+		if (inp->dlth_rss_idx == 0) {
+			(void) snprintf(inp->dlth_name, DLIL_THREADNAME_LEN,
+			    "%s_input", if_name(ifp));
+		} else {
+			(void) snprintf(inp->dlth_name, DLIL_THREADNAME_LEN,
+			    "%s_input_%u", if_name(ifp), inp->dlth_rss_idx);
+		}
 	} else {
 		/*
 		 * Synchronous strategy if there's a netif below and
@@ -2422,7 +2477,7 @@ dlil_create_input_thread(ifnet_t ifp, struct dlil_threading_info *inp,
 		 * thread or the starter thread (for loopback) can be
 		 * scheduled on the same processor set as the input thread.
 		 */
-		if (net_affinity) {
+		if (net_affinity && inp->dlth_rss_idx == 0) {
 			struct thread *tp = inp->dlth_thread;
 			u_int32_t tag;
 			/*
@@ -2489,6 +2544,11 @@ dlil_clean_threading_info(struct dlil_threading_info *inp)
 	qlimit(&inp->dlth_pkts) = 0;
 	bzero(&inp->dlth_stats, sizeof(inp->dlth_stats));
 
+	VERIFY(inp->dlth_gro.dg_nflows == 0);
+	VERIFY(inp->dlth_rss == NULL && inp->dlth_rss_cnt == 0);
+	inp->dlth_rss_idx = 0;
+	inp->dlth_enq_pkts = 0;
+	inp->dlth_qlen_max = 0;
 	VERIFY(!inp->dlth_affinity);
 	inp->dlth_thread = THREAD_NULL;
 	inp->dlth_strategy = NULL;
@@ -2523,12 +2583,19 @@ dlil_terminate_input_thread(struct dlil_threading_info *inp)
 	}
 #endif /* TEST_INPUT_THREAD_TERMINATION */
 
+	/* only this thread touches GRO state, purge it while inp is ours */
+	dlil_gro_purge(inp);
+
 	lck_mtx_lock_spin(&inp->dlth_lock);
 	_getq_all(&inp->dlth_pkts, &pkt, NULL, NULL, NULL);
 	VERIFY((inp->dlth_flags & DLIL_INPUT_TERMINATE) != 0);
 	inp->dlth_flags |= DLIL_INPUT_TERMINATE_COMPLETE;
 	wakeup_one((caddr_t)&inp->dlth_flags);
 	lck_mtx_unlock(&inp->dlth_lock);
+	/*
+	 * The waiter may clean up and free inp from here on (see
+	 * dlil_destroy_rss_input_threads()), so don't touch it again.
+	 */
 
 	/* free up pending packets */
 	if (pkt.cp_mbuf != NULL) {
@@ -2548,6 +2615,91 @@ dlil_terminate_input_thread(struct dlil_threading_info *inp)
 	/* NOTREACHED */
 }
 
+/*
+ * Give an interface with the legacy input model `n' input threads in
+ * total, the first one being `inp' (ifp->if_inp) which must already be
+ * running.  The additional threads are not part of an affinity set,
+ * since the point is to spread the input processing across processors.
+ */
+static void
+dlil_create_rss_input_threads(struct ifnet *ifp,
+    struct dlil_threading_info *inp, uint32_t n)
+{
+	thread_continue_t thfunc = NULL;
+	int err;
+
+	n = MIN(n, MIN(ml_wait_max_cpus(), DLIL_INPUT_MAX_THREADS));
+	if (n <= 1) {
+		return;
+	}
+
+	VERIFY(inp == ifp->if_inp && inp->dlth_rss == NULL);
+	if (dlil_rss_seed == 0) {
+		read_frandom(&dlil_rss_seed, sizeof(dlil_rss_seed));
+	}
+
+	inp->dlth_rss = kalloc_type(struct dlil_threading_info *, n,
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	inp->dlth_rss[0] = inp;
+	for (uint32_t i = 1; i < n; i++) {
+		struct dlil_threading_info *qinp;
+
+		qinp = kalloc_type(struct dlil_threading_info,
+		    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+		qinp->dlth_rss_idx = i;
+		ifnet_incr_pending_thread_count(ifp);
+		err = dlil_create_input_thread(ifp, qinp, &thfunc);
+		if (err != 0 || thfunc != dlil_input_thread_func) {
+			panic_plain("%s: ifp=%p couldn't get input thread %u; "
+			    "err=%d", __func__, ifp, i, err);
+			/* NOTREACHED */
+		}
+		inp->dlth_rss[i] = qinp;
+	}
+	/* start steering only once all the threads are there */
+	os_atomic_store(&inp->dlth_rss_cnt, n, release);
+}
+
+/*
+ * Terminate the additional input threads of an interface; called at
+ * detach time once the first input thread has gone away.
+ */
+static void
+dlil_destroy_rss_input_threads(struct dlil_threading_info *inp)
+{
+	uint32_t n = inp->dlth_rss_cnt;
+
+	if (inp->dlth_rss == NULL) {
+		return;
+	}
+
+	for (uint32_t i = 1; i < n; i++) {
+		struct dlil_threading_info *qinp = inp->dlth_rss[i];
+
+		lck_mtx_lock_spin(&qinp->dlth_lock);
+		qinp->dlth_flags |= DLIL_INPUT_TERMINATE;
+		if (!(qinp->dlth_flags & DLIL_INPUT_RUNNING)) {
+			wakeup_one((caddr_t)&qinp->dlth_flags);
+		}
+		while ((qinp->dlth_flags & DLIL_INPUT_TERMINATE_COMPLETE) == 0) {
+			(void) msleep(&qinp->dlth_flags, &qinp->dlth_lock,
+			    (PZERO - 1) | PSPIN, qinp->dlth_name, NULL);
+		}
+		lck_mtx_unlock(&qinp->dlth_lock);
+
+		/*
+		 * The thread purged its GRO flows before it set
+		 * DLIL_INPUT_TERMINATE_COMPLETE and doesn't look at qinp
+		 * once it has dropped the lock, so qinp is ours to free.
+		 */
+		dlil_clean_threading_info(qinp);
+		kfree_type(struct dlil_threading_info, qinp);
+	}
+	kfree_type(struct dlil_threading_info *, n, inp->dlth_rss);
+	inp->dlth_rss = NULL;
+	inp->dlth_rss_cnt = 0;
+}
+
 static kern_return_t
 dlil_affinity_set(struct thread *tp, u_int32_t tag)
 {
@@ -3307,6 +3459,780 @@ dlil_main_input_thread_cont(void *v, wait_result_t wres)
 	__builtin_unreachable();
 }
 
+/*
+ * Software receive offload (GRO) for the legacy input path.
+ *
+ * Before a batch dequeued by a legacy input thread goes through demux
+ * and protocol input, in-order TCP segments of the same flow get chained
+ * onto the first segment of that flow, much like the flowswitch does for
+ * netif-attached interfaces (see flow_agg.c).  The merged packet keeps
+ * the headers of the first segment with the IP length adjusted, records
+ * the number of coalesced segments in seg_cnt, and carries a fully
+ * validated receive checksum; segments that fail checksum verification
+ * are never merged and are left for TCP to drop.
+ *
+ * Coalesced packets are flushed at the end of the batch, or, when
+ * sw_gro_flush_usec is set, held across wakeups of the input thread
+ * until that much time has passed since the oldest one was started.
+ *
+ * This runs ahead of demux, so only untagged Ethernet frames carrying
+ * TCP over IPv4 without options or IPv6 without extension headers are
+ * considered.  Nothing would resegment a coalesced packet on output,
+ * hence GRO stays out of the way when the host forwards or bridges.
+ */
+struct dlil_gro_pkt {
+	uint8_t                 dgp_af;         /* AF_INET or AF_INET6 */
+	uint16_t                dgp_iphlen;     /* IP header length */
+	uint16_t                dgp_hlen;       /* IP + TCP header length */
+	uint32_t                dgp_plen;       /* TCP payload length */
+	struct tcphdr           *dgp_th;
+};
+
+#define DLIL_GRO_IP(_m)         mtod(_m, struct ip *)
+#define DLIL_GRO_IP6(_m)        mtod(_m, struct ip6_hdr *)
+#define DLIL_GRO_TH(_m, _iphlen)                                        \
+	((struct tcphdr *)(void *)(mtod(_m, uint8_t *) + (_iphlen)))
+
+static inline boolean_t
+dlil_gro_enabled(struct ifnet *ifp)
+{
+	return sw_gro != 0 && (ifp->if_xflags & IFXF_SW_GRO) != 0 &&
+	       ifp->if_family == IFNET_FAMILY_ETHERNET &&
+	       ifp->if_bridge == NULL && hwcksum_rx != 0 && hwcksum_dbg == 0;
+}
+
+/*
+ * What dlil_gro_parse() makes of a packet.  A packet that GRO does not
+ * coalesce must still not overtake segments of its flow that are held,
+ * so TCP segments it passes up are looked up and their flow flushed
+ * first, and anything that might be TCP but whose flow can't be told
+ * (IP fragments, IPv6 extension headers, odd layouts) flushes them all.
+ */
+#define DLIL_GRO_PASS           0       /* not TCP */
+#define DLIL_GRO_BARRIER        1       /* may be TCP of any flow */
+#define DLIL_GRO_FLOW           2       /* TCP segment not to be merged */
+#define DLIL_GRO_MERGE          3       /* TCP segment GRO may coalesce */
+
+/*
+ * Classify the packet, and fill in its header layout unless it's
+ * DLIL_GRO_PASS or DLIL_GRO_BARRIER.
+ */
+static int
+dlil_gro_parse(struct ifnet *ifp, struct mbuf *m, struct dlil_gro_pkt *pkt)
+{
+	struct ether_header *eh = m->m_pkthdr.pkt_hdr;
+	struct tcphdr *th;
+	uint32_t iphlen, thlen;
+	boolean_t merge = TRUE;
+
+	if (eh == NULL) {
+		return DLIL_GRO_BARRIER;
+	}
+
+	switch (ntohs(eh->ether_type)) {
+	case ETHERTYPE_IP: {
+		struct ip *ip = DLIL_GRO_IP(m);
+
+		if (!IP_HDR_ALIGNED_P(mtod(m, caddr_t)) ||
+		    m->m_len < sizeof(*ip)) {
+			return DLIL_GRO_BARRIER;
+		}
+		if (ip->ip_v != IPVERSION || ip->ip_p != IPPROTO_TCP) {
+			return DLIL_GRO_PASS;
+		}
+		if ((ip->ip_off & htons(IP_MF | IP_OFFMASK)) != 0) {
+			return DLIL_GRO_BARRIER;
+		}
+		iphlen = ip->ip_hl << 2;
+		if (iphlen < sizeof(*ip)) {
+			return DLIL_GRO_PASS;   /* ip_input() drops it */
+		}
+		if (ipforwarding || iphlen != sizeof(*ip) ||
+		    ntohs(ip->ip_len) != m->m_pkthdr.len) {
+			merge = FALSE;
+		}
+		pkt->dgp_af = AF_INET;
+		break;
+	}
+
+	case ETHERTYPE_IPV6: {
+		struct ip6_hdr *ip6 = DLIL_GRO_IP6(m);
+
+		if (!IP_HDR_ALIGNED_P(mtod(m, caddr_t)) ||
+		    m->m_len < sizeof(*ip6)) {
+			return DLIL_GRO_BARRIER;
+		}
+		if ((ip6->ip6_vfc & IPV6_VERSION_MASK) != IPV6_VERSION) {
+			return DLIL_GRO_PASS;
+		}
+		switch (ip6->ip6_nxt) {
+		case IPPROTO_TCP:
+			break;
+		case IPPROTO_HOPOPTS:
+		case IPPROTO_ROUTING:
+		case IPPROTO_FRAGMENT:
+		case IPPROTO_DSTOPTS:
+			return DLIL_GRO_BARRIER;
+		default:
+			return DLIL_GRO_PASS;
+		}
+		iphlen = sizeof(*ip6);
+		if (ip6_forwarding ||
+		    ntohs(ip6->ip6_plen) + iphlen != m->m_pkthdr.len) {
+			merge = FALSE;
+		}
+		pkt->dgp_af = AF_INET6;
+		break;
+	}
+
+	default:
+		return DLIL_GRO_PASS;
+	}
+
+	if (m->m_len < iphlen + sizeof(*th)) {
+		return DLIL_GRO_BARRIER;
+	}
+	th = DLIL_GRO_TH(m, iphlen);
+	pkt->dgp_iphlen = (uint16_t)iphlen;
+	pkt->dgp_th = th;
+
+	thlen = th->th_off << 2;
+	if (!merge || m->m_pkthdr.rcvif != ifp ||
+	    (m->m_flags & (M_BCAST | M_MCAST | M_HASFCS)) != 0 ||
+	    (m->m_pkthdr.csum_flags & CSUM_VLAN_TAG_VALID) != 0 ||
+	    (m->m_pkthdr.pkt_flags & PKTF_WAKE_PKT) != 0 ||
+	    ETHER_IS_MULTICAST(eh->ether_dhost) ||
+	    m_tag_first(m) != NULL ||
+	    thlen < sizeof(*th) || m->m_len < iphlen + thlen ||
+	    m->m_pkthdr.len <= iphlen + thlen ||
+	    (th->th_flags & ~TH_PUSH) != TH_ACK) {
+		return DLIL_GRO_FLOW;
+	}
+
+	pkt->dgp_hlen = (uint16_t)(iphlen + thlen);
+	pkt->dgp_plen = m->m_pkthdr.len - pkt->dgp_hlen;
+	return DLIL_GRO_MERGE;
+}
+
+/*
+ * Make sure the IP and TCP checksums of the packet are good, verifying
+ * them in software if the hardware did not, and mark the packet as
+ * fully validated so that the checksum outlives coalescing.
+ */
+static boolean_t
+dlil_gro_cksum_ok(struct mbuf *m, const struct dlil_gro_pkt *pkt)
+{
+	uint32_t flags = m->m_pkthdr.csum_flags;
+	uint32_t tlen = m->m_pkthdr.len - pkt->dgp_iphlen;
+
+	if (pkt->dgp_af == AF_INET) {
+		if (!(flags & CSUM_IP_CHECKED)) {
+			if (inet_cksum(m, 0, 0, pkt->dgp_iphlen) != 0) {
+				return FALSE;
+			}
+			flags |= (CSUM_IP_CHECKED | CSUM_IP_VALID);
+		} else if (!(flags & CSUM_IP_VALID)) {
+			return FALSE;
+		}
+	}
+
+	if ((flags & (CSUM_DATA_VALID | CSUM_PSEUDO_HDR | CSUM_PARTIAL)) ==
+	    (CSUM_DATA_VALID | CSUM_PSEUDO_HDR)) {
+		if ((m->m_pkthdr.csum_rx_val ^ 0xffff) != 0) {
+			return FALSE;
+		}
+	} else {
+		uint16_t sum;
+
+		if (pkt->dgp_af == AF_INET) {
+			sum = inet_cksum(m, IPPROTO_TCP, pkt->dgp_iphlen, tlen);
+		} else {
+			sum = inet6_cksum(m, IPPROTO_TCP, pkt->dgp_iphlen, tlen);
+		}
+		if (sum != 0) {
+			return FALSE;
+		}
+		flags &= ~CSUM_PARTIAL;
+		flags |= (CSUM_DATA_VALID | CSUM_PSEUDO_HDR);
+		m->m_pkthdr.csum_rx_start = 0;
+		m->m_pkthdr.csum_rx_val = 0xffff;
+	}
+	m->m_pkthdr.csum_flags = flags;
+
+	return TRUE;
+}
+
+static struct dlil_gro_flow *
+dlil_gro_lookup(struct dlil_gro *dg, struct mbuf *m,
+    const struct dlil_gro_pkt *pkt)
+{
+	for (uint32_t i = 0; i < dg->dg_nflows; i++) {
+		struct dlil_gro_flow *dgf = &dg->dg_flows[i];
+		struct mbuf *head = dgf->dgf_head;
+		struct tcphdr *hth;
+
+		if (dgf->dgf_af != pkt->dgp_af) {
+			continue;
+		}
+		/* held packets never have IP options, the packet may */
+		hth = DLIL_GRO_TH(head, dgf->dgf_af == AF_INET ?
+		    sizeof(struct ip) : sizeof(struct ip6_hdr));
+		if (hth->th_sport != pkt->dgp_th->th_sport ||
+		    hth->th_dport != pkt->dgp_th->th_dport) {
+			continue;
+		}
+		if (pkt->dgp_af == AF_INET) {
+			struct ip *hip = DLIL_GRO_IP(head), *ip = DLIL_GRO_IP(m);
+
+			if (hip->ip_src.s_addr == ip->ip_src.s_addr &&
+			    hip->ip_dst.s_addr == ip->ip_dst.s_addr) {
+				return dgf;
+			}
+		} else {
+			struct ip6_hdr *hip6 = DLIL_GRO_IP6(head);
+			struct ip6_hdr *ip6 = DLIL_GRO_IP6(m);
+
+			if (IN6_ARE_ADDR_EQUAL(&hip6->ip6_src, &ip6->ip6_src) &&
+			    IN6_ARE_ADDR_EQUAL(&hip6->ip6_dst, &ip6->ip6_dst)) {
+				return dgf;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns TRUE if the segment continues the flow's coalesced packet: it
+ * must be the next in sequence, no bigger than the first segment, and
+ * carry the same frame, IP and TCP headers except for the fields that
+ * change from one segment to the next.  Timestamps may advance; the
+ * newest one is kept in the coalesced packet.
+ */
+static boolean_t
+dlil_gro_can_merge(struct dlil_gro_flow *dgf, struct mbuf *m,
+    const struct dlil_gro_pkt *pkt)
+{
+	struct mbuf *head = dgf->dgf_head;
+	struct tcphdr *hth = DLIL_GRO_TH(head, pkt->dgp_iphlen);
+	struct tcphdr *th = pkt->dgp_th;
+	uint32_t optlen;
+
+	if (pkt->dgp_hlen != dgf->dgf_hlen ||
+	    ntohl(th->th_seq) != dgf->dgf_next_seq ||
+	    pkt->dgp_plen > dgf->dgf_mss ||
+	    head->m_pkthdr.seg_cnt == UINT8_MAX ||
+	    bcmp(head->m_pkthdr.pkt_hdr, m->m_pkthdr.pkt_hdr,
+	    ETHER_HDR_LEN) != 0) {
+		return FALSE;
+	}
+
+	if (pkt->dgp_af == AF_INET) {
+		struct ip *hip = DLIL_GRO_IP(head), *ip = DLIL_GRO_IP(m);
+
+		if (ntohs(hip->ip_len) + pkt->dgp_plen > IP_MAXPACKET ||
+		    hip->ip_tos != ip->ip_tos || hip->ip_ttl != ip->ip_ttl ||
+		    hip->ip_off != ip->ip_off) {
+			return FALSE;
+		}
+	} else {
+		struct ip6_hdr *hip6 = DLIL_GRO_IP6(head);
+		struct ip6_hdr *ip6 = DLIL_GRO_IP6(m);
+
+		if (ntohs(hip6->ip6_plen) + pkt->dgp_plen > IPV6_MAXPACKET ||
+		    hip6->ip6_flow != ip6->ip6_flow ||
+		    hip6->ip6_hlim != ip6->ip6_hlim) {
+			return FALSE;
+		}
+	}
+
+	if (hth->th_ack != th->th_ack || hth->th_win != th->th_win ||
+	    hth->th_urp != th->th_urp ||
+	    (hth->th_flags & ~TH_PUSH) != (th->th_flags & ~TH_PUSH)) {
+		return FALSE;
+	}
+
+	optlen = (th->th_off << 2) - sizeof(*th);
+	if (optlen == TCPOLEN_TSTAMP_APPA &&
+	    *(uint32_t *)(void *)(hth + 1) == htonl(TCPOPT_TSTAMP_HDR) &&
+	    *(uint32_t *)(void *)(th + 1) == htonl(TCPOPT_TSTAMP_HDR)) {
+		uint32_t *hts = (uint32_t *)(void *)(hth + 1);
+		uint32_t *ts = (uint32_t *)(void *)(th + 1);
+
+		/* [1] is TSval, [2] is TSecr */
+		return hts[2] == ts[2] &&
+		       SEQ_GEQ(ntohl(ts[1]), ntohl(hts[1]));
+	}
+	return optlen == 0 || bcmp(hth + 1, th + 1, optlen) == 0;
+}
+
+static void
+dlil_gro_merge(struct dlil_gro_flow *dgf, struct mbuf *m,
+    const struct dlil_gro_pkt *pkt)
+{
+	struct mbuf *head = dgf->dgf_head;
+	struct tcphdr *hth = DLIL_GRO_TH(head, pkt->dgp_iphlen);
+	struct tcphdr *th = pkt->dgp_th;
+
+	if (pkt->dgp_af == AF_INET) {
+		struct ip *hip = DLIL_GRO_IP(head);
+		uint16_t olen = hip->ip_len;
+		uint32_t sum;
+
+		hip->ip_len = htons(ntohs(olen) + (uint16_t)pkt->dgp_plen);
+		/* incremental update of the header checksum (RFC 1624) */
+		sum = (uint16_t)~hip->ip_sum + (uint16_t)~olen + hip->ip_len;
+		sum = (sum >> 16) + (sum & 0xffff);
+		sum += (sum >> 16);
+		hip->ip_sum = (uint16_t)~sum;
+	} else {
+		struct ip6_hdr *hip6 = DLIL_GRO_IP6(head);
+
+		hip6->ip6_plen = htons(ntohs(hip6->ip6_plen) +
+		    (uint16_t)pkt->dgp_plen);
+	}
+
+	/* TCP checksum is taken care of by the validated csum_rx_val */
+	if (dgf->dgf_hlen - pkt->dgp_iphlen ==
+	    sizeof(*th) + TCPOLEN_TSTAMP_APPA) {
+		bcopy(th + 1, hth + 1, TCPOLEN_TSTAMP_APPA);
+	}
+	hth->th_flags |= (th->th_flags & TH_PUSH);
+
+	/* strip the headers and chain the payload onto the packet */
+	m_adj(m, pkt->dgp_hlen);
+	if (m->m_len == 0 && m->m_next != NULL) {
+		m = m_free(m);
+	}
+	m->m_flags &= ~M_PKTHDR;
+	dgf->dgf_tail->m_next = m;
+	while (m->m_next != NULL) {
+		m = m->m_next;
+	}
+	dgf->dgf_tail = m;
+
+	head->m_pkthdr.len += pkt->dgp_plen;
+	if (head->m_pkthdr.seg_cnt == 0) {
+		head->m_pkthdr.seg_cnt = 1;
+	}
+	head->m_pkthdr.seg_cnt++;
+	dgf->dgf_next_seq += pkt->dgp_plen;
+}
+
+static void
+dlil_gro_open(struct dlil_gro *dg, struct mbuf *m,
+    const struct dlil_gro_pkt *pkt)
+{
+	struct dlil_gro_flow *dgf = &dg->dg_flows[dg->dg_nflows++];
+	struct mbuf *tail = m;
+
+	ASSERT(dg->dg_nflows <= DLIL_GRO_FLOWS);
+	while (tail->m_next != NULL) {
+		tail = tail->m_next;
+	}
+	dgf->dgf_head = m;
+	dgf->dgf_tail = tail;
+	dgf->dgf_next_seq = ntohl(pkt->dgp_th->th_seq) + pkt->dgp_plen;
+	dgf->dgf_mss = (uint16_t)pkt->dgp_plen;
+	dgf->dgf_hlen = pkt->dgp_hlen;
+	dgf->dgf_af = pkt->dgp_af;
+}
+
+/*
+ * Remove a flow from the table and return its coalesced packet.
+ */
+static struct mbuf *
+dlil_gro_close(struct dlil_gro *dg, struct dlil_gro_flow *dgf)
+{
+	struct mbuf *m = dgf->dgf_head;
+
+	ASSERT(dg->dg_nflows > 0);
+	*dgf = dg->dg_flows[--dg->dg_nflows];
+	bzero(&dg->dg_flows[dg->dg_nflows], sizeof(*dgf));
+	return m;
+}
+
+#define DLIL_GRO_APPEND(_m) do {                                        \
+	*tailp = (_m);                                                  \
+	tailp = &(_m)->m_nextpkt;                                       \
+	cnt++;                                                          \
+} while (0)
+
+#define DLIL_GRO_FLUSH_ALL() do {                                       \
+	while (dg->dg_nflows != 0) {                                    \
+		struct mbuf *_sm = dlil_gro_close(dg, &dg->dg_flows[0]); \
+		DLIL_GRO_APPEND(_sm);                                   \
+		flushed++;                                              \
+	}                                                               \
+} while (0)
+
+/*
+ * Run a batch of inbound packets of ifp through GRO.  Returns the packets
+ * to hand to protocol input, in arrival order within each flow, and their
+ * count in *cntp.  Coalesced packets may be held back for the next batch
+ * for up to flush_usec; see above.  When GRO isn't enabled, whatever is
+ * held goes out ahead of the batch.
+ */
+static struct mbuf *
+dlil_gro_input(struct dlil_gro *dg, struct ifnet *ifp, boolean_t enabled,
+    uint32_t flush_usec, struct mbuf *m, u_int32_t *cntp)
+{
+	struct mbuf *head = NULL, **tailp = &head;
+	uint64_t merged = 0, flushed = 0;
+	u_int32_t cnt = 0;
+
+	/* what was held from earlier batches goes ahead of this one */
+	if (!enabled) {
+		DLIL_GRO_FLUSH_ALL();
+	}
+
+	while (m != NULL) {
+		struct mbuf *next = m->m_nextpkt;
+		struct dlil_gro_flow *dgf;
+		struct dlil_gro_pkt pkt;
+		struct mbuf *sm;
+
+		m->m_nextpkt = NULL;
+		switch (enabled ? dlil_gro_parse(ifp, m, &pkt) : DLIL_GRO_PASS) {
+		case DLIL_GRO_MERGE:
+			break;
+		case DLIL_GRO_BARRIER:
+			DLIL_GRO_FLUSH_ALL();
+			OS_FALLTHROUGH;
+		case DLIL_GRO_PASS:
+			DLIL_GRO_APPEND(m);
+			m = next;
+			continue;
+		case DLIL_GRO_FLOW:
+			/* e.g. a FIN or a pure ACK: data held before goes first */
+			dgf = dlil_gro_lookup(dg, m, &pkt);
+			if (dgf != NULL) {
+				sm = dlil_gro_close(dg, dgf);
+				DLIL_GRO_APPEND(sm);
+				flushed++;
+			}
+			DLIL_GRO_APPEND(m);
+			m = next;
+			continue;
+		}
+
+		dgf = dlil_gro_lookup(dg, m, &pkt);
+		if (dgf != NULL) {
+			if (dlil_gro_can_merge(dgf, m, &pkt) &&
+			    dlil_gro_cksum_ok(m, &pkt)) {
+				dlil_gro_merge(dgf, m, &pkt);
+				merged++;
+				/* a pushed or short segment ends the burst */
+				if ((pkt.dgp_th->th_flags & TH_PUSH) ||
+				    pkt.dgp_plen < dgf->dgf_mss) {
+					sm = dlil_gro_close(dg, dgf);
+					DLIL_GRO_APPEND(sm);
+					flushed++;
+				}
+				m = next;
+				continue;
+			}
+			/* keep the flow in order */
+			sm = dlil_gro_close(dg, dgf);
+			DLIL_GRO_APPEND(sm);
+			flushed++;
+		}
+
+		if (!(pkt.dgp_th->th_flags & TH_PUSH) &&
+		    dg->dg_nflows < DLIL_GRO_FLOWS &&
+		    dlil_gro_cksum_ok(m, &pkt)) {
+			dlil_gro_open(dg, m, &pkt);
+		} else {
+			DLIL_GRO_APPEND(m);
+		}
+		m = next;
+	}
+
+	if (dg->dg_nflows != 0) {
+		uint64_t now = mach_absolute_time();
+		boolean_t expired = (dg->dg_deadline != 0 &&
+		    now >= dg->dg_deadline);
+
+		if (!enabled || flush_usec == 0 || expired) {
+			if (expired) {
+				os_atomic_add(&sw_gro_flushed_timeout,
+				    dg->dg_nflows, relaxed);
+			}
+			DLIL_GRO_FLUSH_ALL();
+			dg->dg_deadline = 0;
+		} else if (dg->dg_deadline == 0) {
+			nanoseconds_to_absolutetime(
+				(uint64_t)flush_usec * NSEC_PER_USEC,
+				&dg->dg_deadline);
+			dg->dg_deadline += now;
+		}
+	} else {
+		dg->dg_deadline = 0;
+	}
+
+	if (merged != 0) {
+		os_atomic_add(&sw_gro_merged, merged, relaxed);
+	}
+	if (flushed != 0) {
+		os_atomic_add(&sw_gro_flushed, flushed, relaxed);
+	}
+
+	*cntp = cnt;
+	return head;
+}
+
+#undef DLIL_GRO_FLUSH_ALL
+#undef DLIL_GRO_APPEND
+
+/*
+ * Free whatever GRO still holds; called when the input thread goes away.
+ */
+static void
+dlil_gro_purge(struct dlil_threading_info *inp)
+{
+	struct dlil_gro *dg = &inp->dlth_gro;
+
+	while (dg->dg_nflows != 0) {
+		m_freem(dlil_gro_close(dg, &dg->dg_flows[0]));
+	}
+	dg->dg_deadline = 0;
+}
+
+#if (DEVELOPMENT || DEBUG)
+/*
+ * net.link.generic.system.sw_gro_replay runs a list of TCP segments of a
+ * few IPv4 flows through GRO in batches, the way the legacy input thread
+ * would, and checks what comes out: each flow's packets must follow one
+ * another in sequence and carry intact data.  Used by tests/net_sw_gro.c.
+ */
+struct dlil_gro_replay_seg {
+	uint32_t        dgrs_off;       /* offset from the flow's ISS */
+	uint16_t        dgrs_len;       /* payload length */
+	uint8_t         dgrs_flags;     /* TH_* */
+	uint8_t         dgrs_flow;      /* < DLIL_GRO_REPLAY_FLOWS */
+	uint32_t        dgrs_ctl;       /* DLIL_GRO_REPLAY_* */
+};
+
+#define DLIL_GRO_REPLAY_EOB     0x1     /* last segment of its batch */
+#define DLIL_GRO_REPLAY_OFF     0x2     /* GRO is off for this batch */
+#define DLIL_GRO_REPLAY_HOLD    0x4     /* hold flows past this batch */
+
+struct dlil_gro_replay_result {
+	uint64_t        dgrr_delivered; /* payload bytes passed up */
+	uint32_t        dgrr_pkts;      /* packets passed up */
+	uint32_t        dgrr_merged;    /* segments merged into a packet */
+	uint32_t        dgrr_misordered; /* packets out of sequence */
+	uint32_t        dgrr_corrupt;   /* payload bytes that did not match */
+	uint32_t        dgrr_fin;       /* FINs passed up */
+	uint32_t        dgrr_rst;       /* RSTs passed up */
+	uint32_t        dgrr_held;      /* batches that ended with flows held */
+	uint32_t        dgrr_max_segs;  /* most segments in one packet */
+};
+
+#define DLIL_GRO_REPLAY_MAX     (1 << 16)       /* segments per run */
+#define DLIL_GRO_REPLAY_FLOWS   8
+#define DLIL_GRO_REPLAY_ISS     0xffff0000      /* wraps after 64KB */
+
+static inline uint8_t
+dlil_gro_replay_byte(uint32_t flow, uint32_t off)
+{
+	return (uint8_t)(((off + (flow << 20)) * 2654435761u) >> 24);
+}
+
+static struct mbuf *
+dlil_gro_replay_pkt(const struct dlil_gro_replay_seg *seg)
+{
+	struct ether_header *eh;
+	struct tcphdr *th;
+	struct ip *ip;
+	struct mbuf *m;
+	uint8_t *data;
+
+	m = m_getcl(M_WAITOK, MT_DATA, M_PKTHDR);
+	if (m == NULL) {
+		return NULL;
+	}
+	/* the way drivers leave it: frame header ahead of m_data */
+	m->m_data += ETHER_ALIGN;
+	eh = mtod(m, struct ether_header *);
+	bzero(eh, ETHER_HDR_LEN);
+	eh->ether_dhost[5] = 1;
+	eh->ether_shost[5] = 2;
+	eh->ether_type = htons(ETHERTYPE_IP);
+	m->m_pkthdr.pkt_hdr = eh;
+	m->m_data += ETHER_HDR_LEN;
+
+	ip = mtod(m, struct ip *);
+	bzero(ip, sizeof(*ip) + sizeof(*th));
+	ip->ip_v = IPVERSION;
+	ip->ip_hl = sizeof(*ip) >> 2;
+	ip->ip_len = htons((uint16_t)(sizeof(*ip) + sizeof(*th) + seg->dgrs_len));
+	ip->ip_ttl = 64;
+	ip->ip_p = IPPROTO_TCP;
+	ip->ip_src.s_addr = htonl(0x0a000001 + seg->dgrs_flow);
+	ip->ip_dst.s_addr = htonl(0x0a000064);
+
+	th = (struct tcphdr *)(void *)(ip + 1);
+	th->th_sport = htons((uint16_t)(5000 + seg->dgrs_flow));
+	th->th_dport = htons(80);
+	th->th_seq = htonl(DLIL_GRO_REPLAY_ISS + seg->dgrs_off);
+	th->th_ack = htonl(1);
+	th->th_off = sizeof(*th) >> 2;
+	th->th_flags = seg->dgrs_flags;
+	th->th_win = htons(65535);
+
+	data = (uint8_t *)(th + 1);
+	for (int i = 0; i < seg->dgrs_len; i++) {
+		data[i] = dlil_gro_replay_byte(seg->dgrs_flow, seg->dgrs_off + i);
+	}
+	m->m_len = m->m_pkthdr.len = sizeof(*ip) + sizeof(*th) + seg->dgrs_len;
+	m->m_pkthdr.rcvif = lo_ifp;
+
+	/* as validated by the hardware, so no checksums to compute */
+	m->m_pkthdr.csum_flags = CSUM_IP_CHECKED | CSUM_IP_VALID |
+	    CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+	m->m_pkthdr.csum_rx_val = 0xffff;
+	return m;
+}
+
+static void
+dlil_gro_replay_deliver(struct mbuf *m, uint32_t *next,
+    struct dlil_gro_replay_result *res)
+{
+	struct mbuf *n;
+
+	for (; m != NULL; m = n) {
+		struct ip *ip = mtod(m, struct ip *);
+		struct tcphdr *th = (struct tcphdr *)(void *)(ip + 1);
+		uint32_t flow = ntohl(ip->ip_src.s_addr) - 0x0a000001;
+		uint32_t off = ntohl(th->th_seq) - DLIL_GRO_REPLAY_ISS;
+		int hlen = sizeof(*ip) + sizeof(*th);
+		int plen = m->m_pkthdr.len - hlen;
+		uint8_t buf[256];
+
+		n = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+
+		if (off != next[flow] || ntohs(ip->ip_len) != m->m_pkthdr.len) {
+			res->dgrr_misordered++;
+		}
+		for (int done = 0; done < plen; done += sizeof(buf)) {
+			int len = MIN(plen - done, (int)sizeof(buf));
+
+			m_copydata(m, hlen + done, len, buf);
+			for (int i = 0; i < len; i++) {
+				if (buf[i] != dlil_gro_replay_byte(flow,
+				    off + done + i)) {
+					res->dgrr_corrupt++;
+				}
+			}
+		}
+		next[flow] = off + plen + ((th->th_flags & TH_FIN) ? 1 : 0);
+
+		res->dgrr_delivered += plen;
+		res->dgrr_pkts++;
+		res->dgrr_max_segs = MAX(res->dgrr_max_segs,
+		    MAX(m->m_pkthdr.seg_cnt, 1));
+		res->dgrr_fin += !!(th->th_flags & TH_FIN);
+		res->dgrr_rst += !!(th->th_flags & TH_RST);
+		m_freem(m);
+	}
+}
+
+static int
+dlil_gro_replay(struct dlil_gro_replay_seg *segs, size_t nsegs,
+    struct dlil_gro_replay_result *res)
+{
+	uint32_t next[DLIL_GRO_REPLAY_FLOWS] = {};
+	struct mbuf *head = NULL, **tailp = &head;
+	struct dlil_gro *dg;
+	u_int32_t cnt, in = 0;
+	struct mbuf *m;
+	int error = 0;
+	size_t s;
+
+	dg = kalloc_type(struct dlil_gro, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+
+	for (s = 0; s < nsegs; s++) {
+		uint32_t ctl = segs[s].dgrs_ctl;
+
+		if (segs[s].dgrs_flow >= DLIL_GRO_REPLAY_FLOWS ||
+		    segs[s].dgrs_len > MCLBYTES - ETHER_ALIGN - ETHER_HDR_LEN -
+		    sizeof(struct ip) - sizeof(struct tcphdr)) {
+			error = EINVAL;
+			break;
+		}
+		if ((m = dlil_gro_replay_pkt(&segs[s])) == NULL) {
+			error = ENOBUFS;
+			break;
+		}
+		*tailp = m;
+		tailp = &m->m_nextpkt;
+		in++;
+
+		if (!(ctl & DLIL_GRO_REPLAY_EOB) && s + 1 < nsegs) {
+			continue;
+		}
+		m = dlil_gro_input(dg, lo_ifp, !(ctl & DLIL_GRO_REPLAY_OFF),
+		    (ctl & DLIL_GRO_REPLAY_HOLD) ? USEC_PER_SEC : 0, head, &cnt);
+		res->dgrr_held += (dg->dg_nflows != 0);
+		dlil_gro_replay_deliver(m, next, res);
+		head = NULL;
+		tailp = &head;
+		in = 0;
+	}
+	if (head != NULL) {
+		m_freem_list(head);
+		s -= in;
+	}
+
+	/* what's still held goes out the way it would with GRO turned off */
+	m = dlil_gro_input(dg, lo_ifp, FALSE, 0, NULL, &cnt);
+	dlil_gro_replay_deliver(m, next, res);
+	VERIFY(dg->dg_nflows == 0);
+	res->dgrr_merged = (uint32_t)s - res->dgrr_pkts;
+	kfree_type(struct dlil_gro, dg);
+
+	return error;
+}
+
+static int
+sysctl_sw_gro_replay SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct dlil_gro_replay_result res = {};
+	struct dlil_gro_replay_seg *segs;
+	size_t len = req->newlen;
+	int error;
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		return SYSCTL_OUT(req, NULL, sizeof(res));
+	}
+	if (req->newptr == USER_ADDR_NULL || len == 0 ||
+	    len % sizeof(*segs) != 0 ||
+	    len > DLIL_GRO_REPLAY_MAX * sizeof(*segs)) {
+		return EINVAL;
+	}
+
+	segs = kalloc_data(len, Z_WAITOK);
+	if (segs == NULL) {
+		return ENOMEM;
+	}
+	error = SYSCTL_IN(req, segs, len);
+	if (error == 0) {
+		error = dlil_gro_replay(segs, len / sizeof(*segs), &res);
+	}
+	if (error == 0) {
+		error = SYSCTL_OUT(req, &res, sizeof(res));
+	}
+	kfree_data(segs, len);
+	return error;
+}
+
+SYSCTL_PROC(_net_link_generic_system, OID_AUTO, sw_gro_replay,
+    CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_LOCKED | CTLFLAG_MASKED, 0, 0,
+    sysctl_sw_gro_replay, "S", "Replay TCP segments through GRO");
+#endif /* (DEVELOPMENT || DEBUG) */
+
 /*
  * Input thread for interfaces with legacy input model.
  */
@@ -3329,8 +4255,13 @@ dlil_input_thread_func(void *v, wait_result_t w)
 
 	/* construct the name for this thread, and then apply it */
 	bzero(thread_name, sizeof(thread_name));
-	(void) snprintf(thread_name, sizeof(thread_name),
-	    "dlil_input_%s", ifp->if_xname);
+	if (inp->dlth_rss_idx == 0) {
+		(void) snprintf(thread_name, sizeof(thread_name),
+		    "dlil_input_%s", ifp->if_xname);
+	} else {
+		(void) snprintf(thread_name, sizeof(thread_name),
+		    "dlil_input_%s_%u", ifp->if_xname, inp->dlth_rss_idx);
+	}
 	thread_set_thread_name(inp->dlth_thread, thread_name);
 
 	lck_mtx_lock(&inp->dlth_lock);
@@ -3366,6 +4297,7 @@ dlil_input_thread_cont(void *v, wait_result_t wres)
 		classq_pkt_t pkt = CLASSQ_PKT_INITIALIZER(pkt);
 		boolean_t notify = FALSE;
 		boolean_t embryonic;
+		boolean_t gro;
 		u_int32_t m_cnt;
 
 		inp->dlth_flags &= ~DLIL_INPUT_WAITING;
@@ -3412,6 +4344,16 @@ dlil_input_thread_cont(void *v, wait_result_t wres)
 			ifnet_notify_data_threshold(ifp);
 		}
 
+		/*
+		 * Coalesce TCP segments, and flush what's held by GRO
+		 * if it's time to.
+		 */
+		gro = dlil_gro_enabled(ifp);
+		if (gro || inp->dlth_gro.dg_nflows != 0) {
+			m = dlil_gro_input(&inp->dlth_gro, ifp, gro,
+			    sw_gro_flush_usec, m, &m_cnt);
+		}
+
 		/*
 		 * NOTE warning %%% attention !!!!
 		 * We should think about putting some thread starvation
@@ -3438,7 +4380,13 @@ terminate:
 		dlil_terminate_input_thread(inp);
 		/* NOTREACHED */
 	} else {
-		(void) assert_wait(&inp->dlth_flags, THREAD_UNINT);
+		/* come back to flush GRO if nothing else wakes us up */
+		if (inp->dlth_gro.dg_nflows != 0) {
+			(void) assert_wait_deadline(&inp->dlth_flags,
+			    THREAD_UNINT, inp->dlth_gro.dg_deadline);
+		} else {
+			(void) assert_wait(&inp->dlth_flags, THREAD_UNINT);
+		}
 		lck_mtx_unlock(&inp->dlth_lock);
 		(void) thread_block_parameter(dlil_input_thread_cont, inp);
 		/* NOTREACHED */
@@ -4134,11 +5082,169 @@ dlil_input_handler(struct ifnet *ifp, struct mbuf *m_head,
 		return dlil_input_sync(inp, ifp, m_head, m_tail, s, poll, tp);
 	} else
 #endif /* (DEVELOPMENT || DEBUG) */
-	{
+	if (os_atomic_load(&inp->dlth_rss_cnt, acquire) > 1) {
+		return dlil_input_rss(inp, ifp, m_head, s, poll, tp);
+	} else {
 		return inp->dlth_strategy(inp, ifp, m_head, m_tail, s, poll, tp);
 	}
 }
 
+/*
+ * Receive steering: interfaces with several input threads spread their
+ * inbound packets across them by a hash of the 5-tuple, so that packets
+ * of the same flow always land on the same thread and stay in order.
+ * The key has the same layout as the one inp_calc_flowhash() uses, seen
+ * from the receiving end; a flow ID generated by the interface itself is
+ * used as is.  Anything that isn't IP over Ethernet goes to the first
+ * thread, and fragments are hashed on their addresses and protocol only.
+ */
+struct dlil_rss_key {
+	struct in6_addr         drk_laddr;
+	struct in6_addr         drk_faddr;
+	u_int32_t               drk_lport;
+	u_int32_t               drk_fport;
+	u_int32_t               drk_af;
+	u_int32_t               drk_proto;
+};
+
+static uint32_t
+dlil_input_rss_queue(struct ifnet *ifp, struct mbuf *m, uint32_t n)
+{
+	struct dlil_rss_key key __attribute__((aligned(8)));
+	struct ether_header *eh;
+	boolean_t frag = FALSE;
+	uint32_t hash, off;
+	uint8_t proto;
+
+	if ((m->m_pkthdr.pkt_flags & PKTF_FLOW_ID) &&
+	    m->m_pkthdr.pkt_flowsrc == FLOWSRC_IFNET) {
+		hash = m->m_pkthdr.pkt_flowid;
+		goto done;
+	}
+
+	if (ifp->if_family != IFNET_FAMILY_ETHERNET ||
+	    (eh = m->m_pkthdr.pkt_hdr) == NULL) {
+		return 0;
+	}
+
+	bzero(&key, sizeof(key));
+	switch (ntohs(eh->ether_type)) {
+	case ETHERTYPE_IP: {
+		struct ip ip;
+
+		if (m->m_len < sizeof(ip)) {
+			return 0;
+		}
+		/* the IP header need not be aligned here */
+		bcopy(mtod(m, void *), &ip, sizeof(ip));
+		if (ip.ip_v != IPVERSION) {
+			return 0;
+		}
+		bcopy(&ip.ip_dst, &key.drk_laddr, sizeof(ip.ip_dst));
+		bcopy(&ip.ip_src, &key.drk_faddr, sizeof(ip.ip_src));
+		key.drk_af = AF_INET;
+		frag = ((ip.ip_off & htons(IP_MF | IP_OFFMASK)) != 0);
+		off = ip.ip_hl << 2;
+		proto = ip.ip_p;
+		break;
+	}
+
+	case ETHERTYPE_IPV6: {
+		struct ip6_hdr ip6;
+
+		if (m->m_len < sizeof(ip6)) {
+			return 0;
+		}
+		bcopy(mtod(m, void *), &ip6, sizeof(ip6));
+		if ((ip6.ip6_vfc & IPV6_VERSION_MASK) != IPV6_VERSION) {
+			return 0;
+		}
+		key.drk_laddr = ip6.ip6_dst;
+		key.drk_faddr = ip6.ip6_src;
+		key.drk_af = AF_INET6;
+		off = sizeof(ip6);
+		proto = ip6.ip6_nxt;
+		break;
+	}
+
+	default:
+		return 0;
+	}
+
+	if ((proto == IPPROTO_TCP || proto == IPPROTO_UDP) && !frag &&
+	    m->m_len >= off + 2 * sizeof(u_int16_t)) {
+		u_int16_t ports[2];
+
+		bcopy(mtod(m, uint8_t *) + off, ports, sizeof(ports));
+		key.drk_fport = ports[0];
+		key.drk_lport = ports[1];
+	}
+	key.drk_proto = proto;
+	hash = net_flowhash(&key, sizeof(key), dlil_rss_seed);
+
+done:
+	return (uint32_t)(((uint64_t)hash * n) >> 32);
+}
+
+/*
+ * Split an inbound chain across the input threads of the interface.
+ * Statistics other than the packet and byte counts are accounted to
+ * the first thread, and so is the driver thread for affinity purposes.
+ */
+static errno_t
+dlil_input_rss(struct dlil_threading_info *inp, struct ifnet *ifp,
+    struct mbuf *m_head, const struct ifnet_stat_increment_param *s,
+    boolean_t poll, struct thread *tp)
+{
+	struct mbuf *heads[DLIL_INPUT_MAX_THREADS];
+	struct mbuf *tails[DLIL_INPUT_MAX_THREADS];
+	struct ifnet_stat_increment_param sq[DLIL_INPUT_MAX_THREADS];
+	uint32_t n = os_atomic_load(&inp->dlth_rss_cnt, acquire);
+	struct mbuf *m, *next;
+	boolean_t other;
+
+	ASSERT(n > 1 && n <= DLIL_INPUT_MAX_THREADS);
+	bzero(heads, n * sizeof(heads[0]));
+	bzero(tails, n * sizeof(tails[0]));
+	bzero(sq, n * sizeof(sq[0]));
+
+	for (m = m_head; m != NULL; m = next) {
+		uint32_t q = dlil_input_rss_queue(ifp, m, n);
+
+		next = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		if (heads[q] == NULL) {
+			heads[q] = m;
+		} else {
+			tails[q]->m_nextpkt = m;
+		}
+		tails[q] = m;
+		sq[q].packets_in++;
+		sq[q].bytes_in += m_pktlen(m);
+	}
+
+	sq[0].errors_in = s->errors_in;
+	sq[0].packets_out = s->packets_out;
+	sq[0].bytes_out = s->bytes_out;
+	sq[0].errors_out = s->errors_out;
+	sq[0].collisions = s->collisions;
+	sq[0].dropped = s->dropped;
+	other = (s->errors_in | s->packets_out | s->bytes_out |
+	    s->errors_out | s->collisions | s->dropped) != 0;
+
+	for (uint32_t q = 0; q < n; q++) {
+		struct dlil_threading_info *qinp = inp->dlth_rss[q];
+
+		if (heads[q] == NULL && (q != 0 || !other)) {
+			continue;
+		}
+		(void) qinp->dlth_strategy(qinp, ifp, heads[q], tails[q],
+		    &sq[q], poll, q == 0 ? tp : NULL);
+	}
+
+	return 0;
+}
+
 /*
  * Detect whether a queue contains a burst that needs to be trimmed.
  */
@@ -4313,6 +5419,10 @@ dlil_input_async(struct dlil_threading_info *inp,
 		}
 
 		_addq_multi(input_queue, &head, &tail, m_cnt, m_size);
+		inp->dlth_enq_pkts += m_cnt;
+		if (qlen(input_queue) > inp->dlth_qlen_max) {
+			inp->dlth_qlen_max = qlen(input_queue);
+		}
 
 		if (MBUF_QUEUE_IS_OVERCOMMITTED(input_queue)) {
 			dlil_trim_overcomitted_queue_locked(input_queue, &freeq, &s_adj);
@@ -9170,6 +10280,10 @@ ifnet_attach(ifnet_t ifp, const struct sockaddr_dl *ll_addr)
 			panic_plain("%s: ifp=%p couldn't get an input thread; "
 			    "err=%d", __func__, ifp, err);
 			/* NOTREACHED */
+		} else if (thfunc == dlil_input_thread_func &&
+		    if_input_threads > 1) {
+			dlil_create_rss_input_threads(ifp, ifp->if_inp,
+			    if_input_threads);
 		}
 	}
 	/*
@@ -10121,6 +11235,9 @@ ifnet_detach_final(struct ifnet *ifp)
 				    (PZERO - 1) | PSPIN, inp->dlth_name, NULL);
 			}
 			lck_mtx_unlock(&inp->dlth_lock);
+
+			/* and for the other ones, if any */
+			dlil_destroy_rss_input_threads(inp);
 			ifnet_lock_exclusive(ifp);
 		}
 
@@ -11281,6 +12398,79 @@ sysctl_rcvq_burst_limit SYSCTL_HANDLER_ARGS
 	return err;
 }
 
+static int
+sysctl_input_threads SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2)
+	int i, err;
+
+	i = if_input_threads;
+
+	err = sysctl_handle_int(oidp, &i, 0, req);
+	if (err != 0 || req->newptr == USER_ADDR_NULL) {
+		return err;
+	}
+
+	if (i < 1 || i > DLIL_INPUT_MAX_THREADS) {
+		return EINVAL;
+	}
+
+	if_input_threads = i;
+	return err;
+}
+
+static int
+sysctl_input_queue_stats SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp)
+	int *name = (int *)arg1;
+	u_int namelen = arg2;
+	struct if_inputq_stats stats[DLIL_INPUT_MAX_THREADS];
+	struct dlil_threading_info *inp;
+	struct ifnet *ifp;
+	uint32_t n = 0;
+	int idx;
+
+	if (req->newptr != USER_ADDR_NULL) {
+		return EPERM;
+	}
+	if (namelen != 1) {
+		return EINVAL;
+	}
+
+	idx = name[0];
+	ifnet_head_lock_shared();
+	if (!IF_INDEX_IN_RANGE(idx) || (ifp = ifindex2ifnet[idx]) == NULL ||
+	    !ifnet_is_attached(ifp, 1)) {
+		ifnet_head_done();
+		return ENOENT;
+	}
+	ifnet_head_done();
+
+	bzero(stats, sizeof(stats));
+	if ((inp = ifp->if_inp) != NULL) {
+		n = MAX(os_atomic_load(&inp->dlth_rss_cnt, acquire), 1);
+		for (uint32_t i = 0; i < n; i++) {
+			struct dlil_threading_info *qinp =
+			    (i == 0) ? inp : inp->dlth_rss[i];
+			struct if_inputq_stats *st = &stats[i];
+
+			lck_mtx_lock_spin(&qinp->dlth_lock);
+			st->ifiq_index = i;
+			st->ifiq_len = qlen(&qinp->dlth_pkts);
+			st->ifiq_limit = qlimit(&qinp->dlth_pkts);
+			st->ifiq_len_max = qinp->dlth_qlen_max;
+			st->ifiq_packets = qinp->dlth_enq_pkts;
+			st->ifiq_dropped = qinp->dlth_trim_pkts_dropped;
+			st->ifiq_trim_cnt = qinp->dlth_trim_cnt;
+			lck_mtx_unlock(&qinp->dlth_lock);
+		}
+	}
+	ifnet_decr_iorefcnt(ifp);
+
+	return SYSCTL_OUT(req, stats, n * sizeof(stats[0]));
+}
+
 static int
 sysctl_rcvq_trim_pct SYSCTL_HANDLER_ARGS
 {
@@ -151,6 +151,35 @@ struct iff_filter;
 
 #define DLIL_THREADNAME_LEN     32
 
+/*
+ * Maximum number of input threads of an interface (receive steering)
+ */
+#define DLIL_INPUT_MAX_THREADS  16
+
+/*
+ * Software receive offload (GRO) state of a legacy DLIL input thread.
+ *
+ * In-order TCP segments of up to DLIL_GRO_FLOWS flows are coalesced into
+ * one packet each before protocol input.  This is only ever touched by
+ * the input thread itself, so it is not protected by dlth_lock.
+ */
+#define DLIL_GRO_FLOWS          8
+
+struct dlil_gro_flow {
+	struct mbuf     *dgf_head;      /* coalesced packet */
+	struct mbuf     *dgf_tail;      /* last mbuf of dgf_head */
+	uint32_t        dgf_next_seq;   /* next expected seq (host order) */
+	uint16_t        dgf_mss;        /* payload length of first segment */
+	uint16_t        dgf_hlen;       /* IP + TCP header length */
+	uint8_t         dgf_af;         /* AF_INET or AF_INET6 */
+};
+
+struct dlil_gro {
+	struct dlil_gro_flow dg_flows[DLIL_GRO_FLOWS];
+	uint32_t        dg_nflows;      /* # of flows held */
+	uint64_t        dg_deadline;    /* flush deadline (mach absolute) */
+};
+
 /*
  * DLIL threading info
  */
@@ -184,6 +213,20 @@ struct dlil_threading_info {
 	uint32_t        dlth_trim_cnt;          /* # of trim events */
 	uint32_t        dlth_trim_pkts_dropped; /* # of packets dropped
 	                                         * when trimming */
+	uint64_t        dlth_enq_pkts;          /* # of packets enqueued */
+	uint32_t        dlth_qlen_max;          /* input queue high watermark */
+
+	/*
+	 * Receive steering across several input threads of an interface;
+	 * dlth_rss is only set on the first one (ifp->if_inp).  dlth_rss_cnt
+	 * is published with a release store once dlth_rss is filled in, and
+	 * must be read with an acquire load before indexing dlth_rss.
+	 */
+	uint32_t        dlth_rss_idx;           /* index of this thread */
+	uint32_t        dlth_rss_cnt;           /* # of input threads */
+	struct dlil_threading_info **dlth_rss;  /* all input threads */
+
+	struct dlil_gro dlth_gro;               /* software receive offload */
 #if IFNET_INPUT_SANITY_CHK
 	/*
 	 * For debugging.
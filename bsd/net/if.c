@@ -2988,6 +2988,7 @@ ifioctl_restrict_intcoproc(unsigned long cmd, const char *ifname,
 	case SIOCGIFXFLAGS:
 	case SIOCGIFNOTRAFFICSHAPING:
 	case SIOCGIFGENERATIONID:
+	case SIOCGIFSWGRO:
 		return false;
 	default:
 #if (DEBUG || DEVELOPMENT)
@@ -3078,6 +3079,7 @@ ifioctl_restrict_management(unsigned long cmd, const char *ifname,
 	case SIOCGIFXFLAGS:
 	case SIOCGIFNOTRAFFICSHAPING:
 	case SIOCGIFGENERATIONID:
+	case SIOCGIFSWGRO:
 		return false;
 	default:
 		if (!IOCurrentTaskHasEntitlement(MANAGEMENT_CONTROL_ENTITLEMENT)) {
@@ -3354,6 +3356,8 @@ ifioctl(struct socket *so, u_long cmd, caddr_t data, struct proc *p)
 	case SIOCSIFNOTRAFFICSHAPING:           /* struct ifreq */
 	case SIOCGIFNOTRAFFICSHAPING:           /* struct ifreq */
 	case SIOCGIFGENERATIONID:               /* struct ifreq */
+	case SIOCSIFSWGRO:                      /* struct ifreq */
+	case SIOCGIFSWGRO:                      /* struct ifreq */
 	{                       /* struct ifreq */
 		struct ifreq ifr;
 		bcopy(data, &ifr, sizeof(ifr));
@@ -4632,6 +4636,28 @@ ifioctl_ifreq(struct socket *so, u_long cmd, struct ifreq *ifr, struct proc *p)
 		ifr->ifr_creation_generation_id = ifp->if_creation_generation_id;
 		break;
 
+	case SIOCSIFSWGRO:
+		if ((error = priv_check_cred(kauth_cred_get(),
+		    PRIV_NET_INTERFACE_CONTROL, 0)) != 0) {
+			return error;
+		}
+		os_log_info(OS_LOG_DEFAULT, "SIOCSIFSWGRO %s %d",
+		    ifp->if_xname, ifr->ifr_intval);
+		if (ifr->ifr_intval != 0) {
+			if_set_xflags(ifp, IFXF_SW_GRO);
+		} else {
+			if_clear_xflags(ifp, IFXF_SW_GRO);
+		}
+		break;
+
+	case SIOCGIFSWGRO:
+		if ((ifp->if_xflags & IFXF_SW_GRO) != 0) {
+			ifr->ifr_intval = 1;
+		} else {
+			ifr->ifr_intval = 0;
+		}
+		break;
+
 	default:
 		VERIFY(0);
 		/* NOTREACHED */
@@ -6333,6 +6359,9 @@ ifioctl_cassert(void)
 
 	case SIOCSIFNOTRAFFICSHAPING:
 	case SIOCGIFNOTRAFFICSHAPING:
+
+	case SIOCSIFSWGRO:
+	case SIOCGIFSWGRO:
 		;
 	}
 }
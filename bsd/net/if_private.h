@@ -156,6 +156,7 @@ struct if_clonereq32 {
 #define IFXF_FAST_PKT_DELIVERY          0x00001000 /* Fast Packet Delivery */
 #define IFXF_NO_TRAFFIC_SHAPING         0x00002000 /* Skip dummynet and netem traffic shaping */
 #define IFXF_MANAGEMENT                 0x00004000 /* Management interface */
+#define IFXF_SW_GRO                     0x00008000 /* Software receive offload */
 
 /*
  * Current requirements for an AWDL interface.  Setting/clearing IFEF_AWDL
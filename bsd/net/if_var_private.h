@@ -246,6 +246,21 @@ struct if_netif_stats {
 	u_int32_t       ifn_rx_mit_cfg_interval;/* delay interval (nsec) */
 };
 
+/*
+ * Input queue of one of the DLIL input threads of an interface
+ * (net.link.generic.system.input_queue_stats.<ifindex>)
+ */
+struct if_inputq_stats {
+	u_int32_t       ifiq_index;         /* input thread index */
+	u_int32_t       ifiq_len;           /* current queue length */
+	u_int32_t       ifiq_limit;         /* queue limit */
+	u_int32_t       ifiq_len_max;       /* largest queue length seen */
+	u_int64_t       ifiq_packets;       /* # of packets enqueued */
+	u_int64_t       ifiq_dropped;       /* # of packets dropped */
+	u_int32_t       ifiq_trim_cnt;      /* # of queue trim events */
+	u_int32_t       ifiq_reserved;
+};
+
 struct if_tcp_ecn_perf_stat {
 	u_int64_t total_txpkts;
 	u_int64_t total_rxmitpkts;
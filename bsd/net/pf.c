@@ -77,6 +77,7 @@
 #include <sys/random.h>
 #include <sys/mcache.h>
 #include <sys/protosw.h>
+#include <sys/sysctl.h>
 
 #include <libkern/crypto/md5.h>
 #include <libkern/libkern.h>
@@ -158,9 +159,6 @@ LCK_MTX_DECLARE(pf_lock, &pf_lock_grp);
 static LCK_GRP_DECLARE(pf_perim_lock_grp, "pf_perim");
 LCK_RW_DECLARE(pf_perim_lock, &pf_perim_lock_grp);
 
-/* state tables */
-struct pf_state_tree_lan_ext     pf_statetbl_lan_ext;
-struct pf_state_tree_ext_gwy     pf_statetbl_ext_gwy;
 static uint32_t pf_state_tree_ext_gwy_nat64_cnt = 0;
 
 struct pf_palist         pf_pabuf;
@@ -513,13 +511,250 @@ struct pf_state_tree_id tree_id;
 struct pf_state_queue state_list;
 
 RB_GENERATE(pf_src_tree, pf_src_node, entry, pf_src_compare);
-RB_GENERATE(pf_state_tree_lan_ext, pf_state_key,
-    entry_lan_ext, pf_state_compare_lan_ext);
-RB_GENERATE(pf_state_tree_ext_gwy, pf_state_key,
-    entry_ext_gwy, pf_state_compare_ext_gwy);
 RB_GENERATE(pf_state_tree_id, pf_state,
     entry_id, pf_state_compare_id);
 
+/*
+ * The lan_ext and ext_gwy state key tables are chained hash tables, split
+ * into shards by the top bits of the hash so that each shard can grow on
+ * its own without rehashing the whole table at once.  Only the fields the
+ * comparators above always look at go into the hash; the comparator then
+ * has the final say on every candidate with a matching hash, so wildcard
+ * ext addresses and ports (UDP endpoint filtering) still match.
+ *
+ * The tables are protected by pf_lock like the rest of the state.
+ */
+#define PF_STATE_HASH_SHARD_SHIFT       4
+#define PF_STATE_HASH_SHARDS            (1 << PF_STATE_HASH_SHARD_SHIFT)
+#define PF_STATE_HASH_MIN_BUCKETS       64
+#define PF_STATE_HASH_MAX_BUCKETS       (1 << 20)       /* per shard */
+
+LIST_HEAD(pf_state_key_list, pf_state_key);
+
+struct pf_state_hash_shard {
+	struct pf_state_key_list *buckets;
+	u_int32_t                mask;
+	u_int32_t                count;
+};
+
+struct pf_state_hash {
+	struct pf_state_hash_shard shards[PF_STATE_HASH_SHARDS];
+};
+
+/* what gets hashed, zero filled so that unused fields hash alike */
+struct pf_state_hash_key {
+	struct pf_addr  addr[2];
+	u_int32_t       xport[2];
+	u_int8_t        af;
+	u_int8_t        proto;
+	u_int8_t        proto_variant;
+	u_int8_t        nat64;
+};
+
+static struct pf_state_hash pf_statetbl[PF_SK_TABLES];
+static u_int32_t pf_state_hash_seed;
+
+void
+pf_state_hash_init(void)
+{
+	struct pf_state_hash_shard *sh;
+	int table, i;
+
+	/* unlike pf_hash_seed this one stays put while states are hashed */
+	pf_state_hash_seed = RandomULong();
+
+	for (table = 0; table < PF_SK_TABLES; table++) {
+		for (i = 0; i < PF_STATE_HASH_SHARDS; i++) {
+			sh = &pf_statetbl[table].shards[i];
+			sh->buckets = kalloc_type(struct pf_state_key_list,
+			    PF_STATE_HASH_MIN_BUCKETS,
+			    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+			sh->mask = PF_STATE_HASH_MIN_BUCKETS - 1;
+			sh->count = 0;
+		}
+	}
+}
+
+static u_int32_t
+pf_state_hash_calc(int table, u_int8_t proto, u_int8_t proto_variant,
+    sa_family_t af, u_int8_t nat64, struct pf_state_host *host,
+    struct pf_state_host *ext)
+{
+	struct pf_state_hash_key hk;
+	int extfilter = PF_EXTFILTER_APD;
+
+	bzero(&hk, sizeof(hk));
+	hk.af = af;
+	hk.proto = proto;
+	hk.nat64 = nat64;
+
+	switch (proto) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		hk.xport[0] = host->xport.port;
+		break;
+
+	case IPPROTO_TCP:
+		hk.xport[0] = host->xport.port;
+		hk.xport[1] = ext->xport.port;
+		break;
+
+	case IPPROTO_UDP:
+		hk.proto_variant = proto_variant;
+		extfilter = proto_variant;
+		hk.xport[0] = host->xport.port;
+		if (extfilter < PF_EXTFILTER_AD) {
+			hk.xport[1] = ext->xport.port;
+		}
+		break;
+
+	case IPPROTO_ESP:
+		/* keyed by the remote SPI in lan_ext, by our own in ext_gwy */
+		hk.xport[0] = (table == PF_SK_LAN_EXT) ?
+		    ext->xport.spi : host->xport.spi;
+		break;
+
+	default:
+		break;
+	}
+
+	switch (af) {
+#if INET
+	case AF_INET:
+#endif /* INET */
+	case AF_INET6:
+		pf_addrcpy(&hk.addr[0], &host->addr, af);
+		if (extfilter < PF_EXTFILTER_EI) {
+			pf_addrcpy(&hk.addr[1], &ext->addr, af);
+		}
+		break;
+	}
+
+	return net_flowhash(&hk, sizeof(hk), pf_state_hash_seed);
+}
+
+static __inline u_int32_t
+pf_state_hash_of(int table, struct pf_state_key_cmp *key)
+{
+	if (table == PF_SK_LAN_EXT) {
+		return pf_state_hash_calc(table, key->proto,
+		           key->proto_variant, key->af_lan, 0,
+		           &key->lan, &key->ext_lan);
+	}
+	return pf_state_hash_calc(table, key->proto, key->proto_variant,
+	           key->af_gwy, (key->af_lan == PF_INET6 && key->af_gwy == PF_INET),
+	           &key->gwy, &key->ext_gwy);
+}
+
+static __inline int
+pf_state_hash_compare(int table, struct pf_state_key *a,
+    struct pf_state_key *b)
+{
+	if (table == PF_SK_LAN_EXT) {
+		return pf_state_compare_lan_ext(a, b);
+	}
+	return pf_state_compare_ext_gwy(a, b);
+}
+
+static __inline struct pf_state_hash_shard *
+pf_state_hash_shard(int table, u_int32_t hash)
+{
+	return &pf_statetbl[table].shards[hash >>
+	       (32 - PF_STATE_HASH_SHARD_SHIFT)];
+}
+
+static struct pf_state_key *
+pf_state_hash_find(int table, struct pf_state_key_cmp *key)
+{
+	u_int32_t hash = pf_state_hash_of(table, key);
+	struct pf_state_hash_shard *sh = pf_state_hash_shard(table, hash);
+	struct pf_state_key *sk;
+
+	LIST_FOREACH(sk, &sh->buckets[hash & sh->mask], entry_hash[table]) {
+		if (sk->hash[table] == hash && pf_state_hash_compare(table,
+		    (struct pf_state_key *)key, sk) == 0) {
+			return sk;
+		}
+	}
+	return NULL;
+}
+
+static void
+pf_state_hash_grow(int table, struct pf_state_hash_shard *sh)
+{
+	struct pf_state_key_list *buckets;
+	struct pf_state_key *sk;
+	u_int32_t nbuckets = (sh->mask + 1) << 1;
+	u_int32_t i;
+
+	/* called with pf_lock held; just live with longer chains on failure */
+	buckets = kalloc_type(struct pf_state_key_list, nbuckets,
+	    Z_NOWAIT | Z_ZERO);
+	if (buckets == NULL) {
+		return;
+	}
+	for (i = 0; i <= sh->mask; i++) {
+		while ((sk = LIST_FIRST(&sh->buckets[i])) != NULL) {
+			LIST_REMOVE(sk, entry_hash[table]);
+			LIST_INSERT_HEAD(&buckets[sk->hash[table] &
+			    (nbuckets - 1)], sk, entry_hash[table]);
+		}
+	}
+	kfree_type(struct pf_state_key_list, sh->mask + 1, sh->buckets);
+	sh->buckets = buckets;
+	sh->mask = nbuckets - 1;
+}
+
+/*
+ * Returns the key already in the table that matches sk, if any, in which
+ * case sk is not inserted.
+ */
+static struct pf_state_key *
+pf_state_hash_insert(int table, struct pf_state_key *sk)
+{
+	u_int32_t hash = pf_state_hash_of(table, (struct pf_state_key_cmp *)sk);
+	struct pf_state_hash_shard *sh = pf_state_hash_shard(table, hash);
+	struct pf_state_key_list *head = &sh->buckets[hash & sh->mask];
+	struct pf_state_key *cur;
+
+	VERIFY(!(sk->hashed & PF_SK_HASHED(table)));
+	LIST_FOREACH(cur, head, entry_hash[table]) {
+		if (cur->hash[table] == hash &&
+		    pf_state_hash_compare(table, sk, cur) == 0) {
+			return cur;
+		}
+	}
+
+	sk->hash[table] = hash;
+	sk->hashed |= PF_SK_HASHED(table);
+	LIST_INSERT_HEAD(head, sk, entry_hash[table]);
+	if (++sh->count > 2 * (sh->mask + 1) &&
+	    sh->mask + 1 < PF_STATE_HASH_MAX_BUCKETS) {
+		pf_state_hash_grow(table, sh);
+	}
+	return NULL;
+}
+
+/*
+ * Uses the hash saved at insert time, so the key fields may have been
+ * changed since.  Returns sk, or NULL if it was not in the table.
+ */
+static struct pf_state_key *
+pf_state_hash_remove(int table, struct pf_state_key *sk)
+{
+	struct pf_state_hash_shard *sh;
+
+	if (!(sk->hashed & PF_SK_HASHED(table))) {
+		return NULL;
+	}
+	sh = pf_state_hash_shard(table, sk->hash[table]);
+	LIST_REMOVE(sk, entry_hash[table]);
+	sk->hashed &= ~PF_SK_HASHED(table);
+	VERIFY(sh->count > 0);
+	sh->count--;
+	return sk;
+}
+
 #define PF_DT_SKIP_LANEXT       0x01
 #define PF_DT_SKIP_EXTGWY       0x02
 
@@ -1129,8 +1364,7 @@ pf_find_state(struct pfi_kif *kif, struct pf_state_key_cmp *key, u_int dir)
 
 	switch (dir) {
 	case PF_OUT:
-		sk = RB_FIND(pf_state_tree_lan_ext, &pf_statetbl_lan_ext,
-		    (struct pf_state_key *)key);
+		sk = pf_state_hash_find(PF_SK_LAN_EXT, key);
 
 		break;
 	case PF_IN:
@@ -1151,23 +1385,19 @@ pf_find_state(struct pfi_kif *kif, struct pf_state_key_cmp *key, u_int dir)
 		if (pf_state_tree_ext_gwy_nat64_cnt > 0 &&
 		    key->af_lan == PF_INET && key->af_gwy == PF_INET) {
 			key->af_lan = PF_INET6;
-			sk = RB_FIND(pf_state_tree_ext_gwy, &pf_statetbl_ext_gwy,
-			    (struct pf_state_key *) key);
+			sk = pf_state_hash_find(PF_SK_EXT_GWY, key);
 			key->af_lan = PF_INET;
 		}
 
 		if (sk == NULL) {
-			sk = RB_FIND(pf_state_tree_ext_gwy, &pf_statetbl_ext_gwy,
-			    (struct pf_state_key *)key);
+			sk = pf_state_hash_find(PF_SK_EXT_GWY, key);
 		}
 		/*
 		 * NAT64 is done only on input, for packets coming in from
 		 * from the LAN side, need to lookup the lan_ext tree.
 		 */
 		if (sk == NULL) {
-			sk = RB_FIND(pf_state_tree_lan_ext,
-			    &pf_statetbl_lan_ext,
-			    (struct pf_state_key *)key);
+			sk = pf_state_hash_find(PF_SK_LAN_EXT, key);
 			if (sk && sk->af_lan == sk->af_gwy) {
 				sk = NULL;
 			}
@@ -1198,20 +1428,16 @@ pf_find_state_all(struct pf_state_key_cmp *key, u_int dir, int *more)
 
 	switch (dir) {
 	case PF_OUT:
-		sk = RB_FIND(pf_state_tree_lan_ext,
-		    &pf_statetbl_lan_ext, (struct pf_state_key *)key);
+		sk = pf_state_hash_find(PF_SK_LAN_EXT, key);
 		break;
 	case PF_IN:
-		sk = RB_FIND(pf_state_tree_ext_gwy,
-		    &pf_statetbl_ext_gwy, (struct pf_state_key *)key);
+		sk = pf_state_hash_find(PF_SK_EXT_GWY, key);
 		/*
 		 * NAT64 is done only on input, for packets coming in from
 		 * from the LAN side, need to lookup the lan_ext tree.
 		 */
 		if ((sk == NULL) && pf_nat64_configured) {
-			sk = RB_FIND(pf_state_tree_lan_ext,
-			    &pf_statetbl_lan_ext,
-			    (struct pf_state_key *)key);
+			sk = pf_state_hash_find(PF_SK_LAN_EXT, key);
 			if (sk && sk->af_lan == sk->af_gwy) {
 				sk = NULL;
 			}
@@ -1482,8 +1708,7 @@ pf_stateins_err(const char *tree, struct pf_state *s, struct pfi_kif *kif)
 static __inline struct pf_state_key *
 pf_insert_state_key_ext_gwy(struct pf_state_key *psk)
 {
-	struct pf_state_key * ret = RB_INSERT(pf_state_tree_ext_gwy,
-	    &pf_statetbl_ext_gwy, psk);
+	struct pf_state_key * ret = pf_state_hash_insert(PF_SK_EXT_GWY, psk);
 	if (!ret && psk->af_lan == PF_INET6 &&
 	    psk->af_gwy == PF_INET) {
 		pf_state_tree_ext_gwy_nat64_cnt++;
@@ -1494,8 +1719,7 @@ pf_insert_state_key_ext_gwy(struct pf_state_key *psk)
 static __inline struct pf_state_key *
 pf_remove_state_key_ext_gwy(struct pf_state_key *psk)
 {
-	struct pf_state_key * ret = RB_REMOVE(pf_state_tree_ext_gwy,
-	    &pf_statetbl_ext_gwy, psk);
+	struct pf_state_key * ret = pf_state_hash_remove(PF_SK_EXT_GWY, psk);
 	if (ret && psk->af_lan == PF_INET6 &&
 	    psk->af_gwy == PF_INET) {
 		pf_state_tree_ext_gwy_nat64_cnt--;
@@ -1512,7 +1736,7 @@ pf_insert_state(struct pfi_kif *kif, struct pf_state *s)
 	VERIFY(s->state_key != NULL);
 	s->kif = kif;
 
-	if ((cur = RB_INSERT(pf_state_tree_lan_ext, &pf_statetbl_lan_ext,
+	if ((cur = pf_state_hash_insert(PF_SK_LAN_EXT,
 	    s->state_key)) != NULL) {
 		/* key exists. check for same kif, if none, add to key */
 		TAILQ_FOREACH(sp, &cur->states, next)
@@ -3211,6 +3435,84 @@ pf_step_out_of_anchor(int *depth, struct pf_ruleset **rs, int n,
 	return quick;
 }
 
+/*
+ * Walks the filter rules pf_rule_index_lookup() leaves for a packet,
+ * following pf_test_rule() into and out of anchors: each ruleset the
+ * walk enters is looked up in its own index, if it has one.
+ */
+struct pf_rule_cursor {
+	struct pf_ruleset       *rs;
+	struct pf_rule          **rules;
+	u_int32_t                count;
+	u_int32_t                next;
+	int                      indexed;
+	int                      noindex;       /* PFDESC_NO_INDEX */
+	u_int8_t                 dir;
+	u_int8_t                 proto;
+	sa_family_t              af;
+	u_int16_t                dport;
+};
+
+static void
+pf_rule_cursor_init(struct pf_rule_cursor *c, u_int8_t dir, sa_family_t af,
+    u_int8_t proto, u_int16_t dport, int noindex)
+{
+	bzero(c, sizeof(*c));
+	c->noindex = noindex;
+	c->dir = dir;
+	c->af = af;
+	c->proto = proto;
+	c->dport = dport;
+}
+
+/*
+ * Returns the first rule at or after r in ruleset rs (NULL for the main
+ * ruleset) that the index does not rule out, or r itself if rs is not
+ * indexed.
+ */
+static struct pf_rule *
+pf_rule_cursor_seek(struct pf_rule_cursor *c, struct pf_ruleset *rs,
+    struct pf_rule *r)
+{
+	struct pf_rule_index *idx;
+	u_int32_t lo, hi, mid;
+
+	if (r == NULL) {
+		return NULL;
+	}
+	if (rs == NULL) {
+		rs = &pf_main_ruleset;
+	}
+	if (c->rs != rs) {
+		c->rs = rs;
+		idx = rs->rules[PF_RULESET_FILTER].active.index;
+		c->indexed = !c->noindex && idx != NULL &&
+		    pf_rule_index_lookup(idx, c->dir, c->af, c->proto,
+		    c->dport, &c->rules, &c->count);
+		if (!c->indexed) {
+			return r;
+		}
+		/* possibly back from an anchor, well into the list */
+		lo = 0;
+		hi = c->count;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (c->rules[mid]->nr < r->nr) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		c->next = lo;
+	} else if (!c->indexed) {
+		return r;
+	}
+	while (c->next < c->count && c->rules[c->next]->nr < r->nr) {
+		c->next++;
+	}
+	return c->next < c->count ? c->rules[c->next] : NULL;
+}
+
 void
 pf_poolmask(struct pf_addr *naddr, struct pf_addr *raddr,
     struct pf_addr *rmask, struct pf_addr *saddr, sa_family_t af)
@@ -4459,8 +4761,7 @@ pf_detach_state(struct pf_state *s, int flags)
 			pf_remove_state_key_ext_gwy(sk);
 		}
 		if (!(flags & PF_DT_SKIP_LANEXT)) {
-			RB_REMOVE(pf_state_tree_lan_ext,
-			    &pf_statetbl_lan_ext, sk);
+			pf_state_hash_remove(PF_SK_LAN_EXT, sk);
 		}
 		if (sk->app_state) {
 			pool_put(&pf_app_state_pl, sk->app_state);
@@ -4969,6 +5270,7 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 	struct pf_grev1_hdr     *grev1 = pd->hdr.grev1;
 	union pf_state_xport bxport, bdxport, nxport, sxport, dxport;
 	struct pf_state_key      psk;
+	struct pf_rule_cursor    rc;
 
 	LCK_MTX_ASSERT(&pf_lock, LCK_MTX_ASSERT_OWNED);
 
@@ -5283,6 +5585,11 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 		tag = nr->tag;
 	}
 
+	/* th_dport is uh_dport for UDP */
+	pf_rule_cursor_init(&rc, direction, pd->af, pd->proto,
+	    (pd->proto == IPPROTO_TCP || pd->proto == IPPROTO_UDP) ?
+	    th->th_dport : 0, pd->flags & PFDESC_NO_INDEX);
+	r = pf_rule_cursor_seek(&rc, ruleset, r);
 	while (r != NULL) {
 		r->evaluations++;
 		if (pfi_kif_match(r->kif, kif) == r->ifnot) {
@@ -5383,6 +5690,7 @@ pf_test_rule(struct pf_rule **rm, struct pf_state **sm, int direction,
 				    PF_RULESET_FILTER, &r, &a, &match);
 			}
 		}
+		r = pf_rule_cursor_seek(&rc, ruleset, r);
 		if (r == NULL && pf_step_out_of_anchor(&asd, &ruleset,
 		    PF_RULESET_FILTER, &r, &a, &match)) {
 			break;
@@ -8914,12 +9222,10 @@ pf_test_state_esp(struct pf_state **state, int direction, struct pfi_kif *kif,
 			if (s) {
 				struct pf_state_key *sk = s->state_key;
 
-				RB_REMOVE(pf_state_tree_lan_ext,
-				    &pf_statetbl_lan_ext, sk);
+				pf_state_hash_remove(PF_SK_LAN_EXT, sk);
 				sk->ext_lan.xport.spi = esp->spi;
 
-				if (RB_INSERT(pf_state_tree_lan_ext,
-				    &pf_statetbl_lan_ext, sk)) {
+				if (pf_state_hash_insert(PF_SK_LAN_EXT, sk)) {
 					pf_detach_state(s, PF_DT_SKIP_LANEXT);
 				} else {
 					*state = s;
@@ -11194,3 +11500,177 @@ done:
 	return compat_bitmap;
 }
 #endif // SKYWALK && defined(XNU_TARGET_OS_OSX)
+
+#if DEVELOPMENT || DEBUG
+/*
+ * Runs pf_test_rule() on a TCP or UDP packet described by the caller,
+ * with or without the filter rule index, and returns the rule that
+ * decided.  Used by tests/pf_rule_index.c to compare both walks on
+ * rulesets loaded with DIOCADDRULE.  The packet is neither sent nor
+ * normalized, the probed rules should neither keep state nor translate.
+ */
+struct pf_rule_probe {
+	struct pf_addr  prb_saddr;
+	struct pf_addr  prb_daddr;
+	u_int16_t       prb_sport;      /* network byte order */
+	u_int16_t       prb_dport;      /* network byte order */
+	sa_family_t     prb_af;
+	u_int8_t        prb_proto;
+	u_int8_t        prb_dir;        /* PF_IN or PF_OUT */
+	u_int8_t        prb_flags;      /* TCP flags */
+	u_int8_t        prb_noindex;
+};
+
+struct pf_rule_probe_result {
+	u_int32_t       prr_action;
+	u_int32_t       prr_nr;         /* UINT32_MAX for the default rule */
+	u_int32_t       prr_anchor_nr;  /* UINT32_MAX outside of anchors */
+	char            prr_anchor[MAXPATHLEN];
+};
+
+static int
+pf_rule_probe(struct pf_rule_probe *prb, struct pf_rule_probe_result *res)
+{
+	struct pf_rule *r = &pf_default_rule, *a = NULL;
+	struct pf_ruleset *ruleset = NULL;
+	struct pf_state *s = NULL;
+	struct pf_pdesc pd;
+	pbuf_t pbuf_store, *pbuf = &pbuf_store;
+	struct tcphdr th;
+	struct udphdr uh;
+	struct mbuf *m;
+	void *h;
+	int off, hdrlen;
+
+	if ((prb->prb_af != AF_INET && prb->prb_af != AF_INET6) ||
+	    (prb->prb_proto != IPPROTO_TCP && prb->prb_proto != IPPROTO_UDP) ||
+	    (prb->prb_dir != PF_IN && prb->prb_dir != PF_OUT) ||
+	    prb->prb_sport == 0 || prb->prb_dport == 0) {
+		return EINVAL;
+	}
+
+	bzero(&th, sizeof(th));
+	th.th_sport = prb->prb_sport;
+	th.th_dport = prb->prb_dport;
+	th.th_off = sizeof(th) >> 2;
+	th.th_flags = prb->prb_flags;
+	th.th_win = htons(65535);
+	bzero(&uh, sizeof(uh));
+	uh.uh_sport = prb->prb_sport;
+	uh.uh_dport = prb->prb_dport;
+	uh.uh_ulen = htons(sizeof(uh));
+	hdrlen = prb->prb_proto == IPPROTO_TCP ? sizeof(th) : sizeof(uh);
+
+	m = m_gethdr(M_WAITOK, MT_HEADER);
+	if (m == NULL) {
+		return ENOBUFS;
+	}
+	h = mtod(m, void *);
+	bzero(&pd, sizeof(pd));
+	if (prb->prb_af == AF_INET) {
+		struct ip *ip = h;
+
+		off = sizeof(*ip);
+		bzero(ip, sizeof(*ip));
+		ip->ip_v = IPVERSION;
+		ip->ip_hl = sizeof(*ip) >> 2;
+		ip->ip_len = htons((u_short)(off + hdrlen));
+		ip->ip_ttl = IPDEFTTL;
+		ip->ip_p = prb->prb_proto;
+		ip->ip_src = prb->prb_saddr.v4addr;
+		ip->ip_dst = prb->prb_daddr.v4addr;
+		pd.src = (struct pf_addr *)&ip->ip_src;
+		pd.dst = (struct pf_addr *)&ip->ip_dst;
+		pd.ip_sum = &ip->ip_sum;
+		pd.ttl = ip->ip_ttl;
+	} else {
+		struct ip6_hdr *ip6 = h;
+
+		off = sizeof(*ip6);
+		bzero(ip6, sizeof(*ip6));
+		ip6->ip6_vfc = IPV6_VERSION;
+		ip6->ip6_plen = htons((u_short)hdrlen);
+		ip6->ip6_nxt = prb->prb_proto;
+		ip6->ip6_hlim = IPV6_DEFHLIM;
+		ip6->ip6_src = prb->prb_saddr.v6addr;
+		ip6->ip6_dst = prb->prb_daddr.v6addr;
+		pd.src = (struct pf_addr *)(uintptr_t)&ip6->ip6_src;
+		pd.dst = (struct pf_addr *)(uintptr_t)&ip6->ip6_dst;
+		pd.ttl = ip6->ip6_hlim;
+	}
+	if (prb->prb_proto == IPPROTO_TCP) {
+		bcopy(&th, mtod(m, u_char *) + off, sizeof(th));
+		pd.hdr.tcp = &th;
+	} else {
+		bcopy(&uh, mtod(m, u_char *) + off, sizeof(uh));
+		pd.hdr.udp = &uh;
+	}
+	m->m_len = m->m_pkthdr.len = off + hdrlen;
+	pbuf_init_mbuf(pbuf, m, NULL);
+
+	pd.mp = pbuf;
+	pd.pf_mtag = pf_get_mtag_pbuf(pbuf);
+	PF_ACPY(&pd.baddr, pd.src, prb->prb_af);
+	PF_ACPY(&pd.bdaddr, pd.dst, prb->prb_af);
+	pd.proto = prb->prb_proto;
+	pd.af = pd.naf = prb->prb_af;
+	pd.tot_len = off + hdrlen;
+	pd.off = off;
+	pd.hdrlen = hdrlen;
+	pd.sc = MBUF_SCIDX(pbuf_get_service_class(pbuf));
+	if (prb->prb_noindex) {
+		pd.flags |= PFDESC_NO_INDEX;
+	}
+
+	lck_rw_lock_shared(&pf_perim_lock);
+	lck_mtx_lock(&pf_lock);
+	res->prr_action = pf_test_rule(&r, &s, prb->prb_dir, pfi_all, pbuf,
+	    off, h, &pd, &a, &ruleset, NULL);
+	res->prr_nr = r == &pf_default_rule ? UINT32_MAX : r->nr;
+	res->prr_anchor_nr = a != NULL ? a->nr : UINT32_MAX;
+	if (ruleset != NULL && ruleset->anchor != NULL) {
+		strlcpy(res->prr_anchor, ruleset->anchor->path,
+		    sizeof(res->prr_anchor));
+	}
+	lck_mtx_unlock(&pf_lock);
+	lck_rw_done(&pf_perim_lock);
+
+	pbuf_destroy(pbuf);
+	return 0;
+}
+
+static int
+sysctl_pf_rule_probe SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct pf_rule_probe_result *res;
+	struct pf_rule_probe prb;
+	int error;
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		return SYSCTL_OUT(req, NULL, sizeof(*res));
+	}
+	if (req->newptr == USER_ADDR_NULL || req->newlen != sizeof(prb)) {
+		return EINVAL;
+	}
+	error = SYSCTL_IN(req, &prb, sizeof(prb));
+	if (error != 0) {
+		return error;
+	}
+
+	res = kalloc_data(sizeof(*res), Z_WAITOK | Z_ZERO);
+	if (res == NULL) {
+		return ENOMEM;
+	}
+	error = pf_rule_probe(&prb, res);
+	if (error == 0) {
+		error = SYSCTL_OUT(req, res, sizeof(*res));
+	}
+	kfree_data(res, sizeof(*res));
+	return error;
+}
+
+SYSCTL_PROC(_debug, OID_AUTO, pf_rule_probe,
+    CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_LOCKED | CTLFLAG_MASKED, 0, 0,
+    sysctl_pf_rule_probe, "S", "Match a packet against the pf filter rules");
+#endif /* DEVELOPMENT || DEBUG */
@@ -185,6 +185,7 @@ static int pf_rule_setup(struct pfioc_rule *, struct pf_rule *,
 static void pf_delete_rule_by_owner(char *, u_int32_t);
 static int pf_delete_rule_by_ticket(struct pfioc_rule *, u_int32_t);
 static void pf_ruleset_cleanup(struct pf_ruleset *, int);
+static void pf_ruleset_reindex(struct pf_ruleset *, int);
 static void pf_deleterule_anchor_step_out(struct pf_ruleset **,
     int, struct pf_rule **);
 #if SKYWALK && defined(XNU_TARGET_OS_OSX)
@@ -540,6 +541,7 @@ pfinit(void)
 	bzero(&pf_status, sizeof(pf_status));
 	pf_status.debug = PF_DEBUG_URGENT;
 	pf_hash_seed = RandomULong();
+	pf_state_hash_init();
 
 	/* XXX do our best to avoid a conflict */
 	pf_status.hostid = random();
@@ -1170,6 +1172,7 @@ pf_commit_rules(u_int32_t ticket, int rs_num, char *anchor)
 	rs->rules[rs_num].active.ticket =
 	    rs->rules[rs_num].inactive.ticket;
 	pf_calc_skip_steps(rs->rules[rs_num].active.ptr);
+	pf_ruleset_reindex(rs, rs_num);
 
 
 	/* Purge the old rule list. */
@@ -2502,6 +2505,11 @@ pf_delete_rule_from_ruleset(struct pf_ruleset *ruleset, int rs_num,
 
 	pf_expire_states_and_src_nodes(rule);
 
+	/* until pf_ruleset_cleanup(), which some callers batch */
+	if (rs_num == PF_RULESET_FILTER) {
+		pf_rule_index_free(ruleset->rules[rs_num].active.index);
+		ruleset->rules[rs_num].active.index = NULL;
+	}
 	pf_rm_rule(ruleset->rules[rs_num].active.ptr, rule);
 	if (ruleset->rules[rs_num].active.rcount-- == 0) {
 		panic("%s: rcount value broken!", __func__);
@@ -2519,10 +2527,26 @@ static void
 pf_ruleset_cleanup(struct pf_ruleset *ruleset, int rs)
 {
 	pf_calc_skip_steps(ruleset->rules[rs].active.ptr);
+	pf_ruleset_reindex(ruleset, rs);
 	ruleset->rules[rs].active.ticket =
 	    ++ruleset->rules[rs].inactive.ticket;
 }
 
+/*
+ * Rebuilds the index pf_test_rule() uses to skip filter rules that
+ * cannot match, after the active rules or their numbering changed.
+ */
+static void
+pf_ruleset_reindex(struct pf_ruleset *ruleset, int rs)
+{
+	if (rs != PF_RULESET_FILTER) {
+		return;
+	}
+	pf_rule_index_free(ruleset->rules[rs].active.index);
+	ruleset->rules[rs].active.index = pf_rule_index_build(
+		ruleset->rules[rs].active.ptr, ruleset->rules[rs].active.rcount);
+}
+
 /*
  * req_dev encodes the PF interface. Currently, possible values are
  * 0 or PFRULE_PFM
@@ -3229,6 +3253,7 @@ pfioctl_ioc_rule(u_long cmd, int minordev, struct pfioc_rule *pr, struct proc *p
 		ruleset->rules[rs_num].active.ticket++;
 
 		pf_calc_skip_steps(ruleset->rules[rs_num].active.ptr);
+		pf_ruleset_reindex(ruleset, rs_num);
 #if SKYWALK && defined(XNU_TARGET_OS_OSX)
 		pf_process_compatibilities();
 #endif // SKYWALK && defined(XNU_TARGET_OS_OSX)
@@ -3691,6 +3716,8 @@ pfioctl_ioc_natlook(u_long cmd, struct pfioc_natlook *pnl, struct proc *p)
 		struct pf_state_key_cmp  key;
 		int                      m = 0, direction = pnl->direction;
 
+		/* the unused side still feeds the NAT64 check and the hash */
+		bzero(&key, sizeof(key));
 		key.proto = pnl->proto;
 		key.proto_variant = pnl->proto_variant;
 
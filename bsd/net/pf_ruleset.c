@@ -94,6 +94,9 @@
 #define rs_malloc_type(type)    kalloc_type(type, Z_WAITOK | Z_ZERO)
 #define rs_free_data            kfree_data
 #define rs_free_type            kfree_type
+#define rs_malloc_type_array(type, count) \
+	kalloc_type(type, count, Z_WAITOK | Z_ZERO)
+#define rs_free_type_array      kfree_type
 
 #else
 /* Userland equivalents so we can lend code to pfctl et al. */
@@ -115,6 +118,9 @@ rs_malloc_data(size_t size)
 #define rs_malloc_type(type)    ((type*) rs_malloc_data(sizeof(type)))
 #define rs_free_data(ptr, size) free(ptr)
 #define rs_free_type(type, ptr) free(ptr)
+#define rs_malloc_type_array(type, count) \
+	((type*) rs_malloc_data(sizeof(type) * (count)))
+#define rs_free_type_array(type, count, ptr) free(ptr)
 
 #ifdef PFDEBUG
 #include <sys/stdarg.h>
@@ -562,3 +568,377 @@ pf_anchor_remove(struct pf_rule *r)
 	pf_release_anchor(r->anchor);
 	r->anchor = NULL;
 }
+
+/*
+ * Rule index.
+ *
+ * A filter ruleset with many rules is indexed by direction, address
+ * family and protocol (TCP and UDP only) and then by destination port:
+ * the port space is cut into intervals at every bound of a port
+ * operator in the ruleset, and each interval keeps the rules, in ruleset
+ * order, that are not ruled out for a packet whose destination port lies
+ * in it.  Evaluating only those rules, still in order, gives the same
+ * first quick or last match as walking the whole list, since everything
+ * left out fails one of these checks in pf_test_rule().
+ */
+#define PF_RULE_INDEX_MIN_RULES         32
+#define PF_RULE_INDEX_MAX_ENTRIES       (1 << 20)       /* whole index */
+#define PF_RULE_INDEX_CLASSES           8
+#define PF_RULE_INDEX_PORTS             65536
+
+struct pf_rule_index_class {
+	u_int32_t                nintervals;
+	u_int32_t                nrules;
+	u_int16_t               *start;         /* first port of each interval */
+	u_int32_t               *offset;        /* nintervals + 1, into rules */
+	struct pf_rule          **rules;
+};
+
+struct pf_rule_index {
+	struct pf_rule_index_class cls[PF_RULE_INDEX_CLASSES];
+	u_int32_t                entries;
+};
+
+static int
+pf_rule_index_class(u_int8_t dir, sa_family_t af, u_int8_t proto)
+{
+	int c;
+
+	switch (dir) {
+	case PF_IN:
+		c = 0;
+		break;
+	case PF_OUT:
+		c = 4;
+		break;
+	default:
+		return -1;
+	}
+	switch (af) {
+	case AF_INET:
+		break;
+	case AF_INET6:
+		c |= 2;
+		break;
+	default:
+		return -1;
+	}
+	switch (proto) {
+	case IPPROTO_TCP:
+		break;
+	case IPPROTO_UDP:
+		c |= 1;
+		break;
+	default:
+		return -1;
+	}
+	return c;
+}
+
+/* rules that can match a packet of this class (given the right port) */
+static __inline int
+pf_rule_index_candidate(struct pf_rule *r, u_int8_t dir, sa_family_t af,
+    u_int8_t proto)
+{
+	return (!r->direction || r->direction == dir) &&
+	       (!r->af || r->af == af) &&
+	       (!r->proto || r->proto == proto);
+}
+
+/*
+ * The ports a destination port operator matches, as up to two inclusive
+ * ranges; mirrors pf_match() in pf.c.
+ */
+static int
+pf_rule_index_ranges(struct pf_rule *r, u_int32_t lo[2], u_int32_t hi[2])
+{
+	u_int32_t a1 = ntohs(r->dst.xport.range.port[0]);
+	u_int32_t a2 = ntohs(r->dst.xport.range.port[1]);
+	u_int32_t max = PF_RULE_INDEX_PORTS - 1;
+	int n = 0;
+
+#define PF_RULE_INDEX_RANGE(l, h) do {          \
+	if ((l) <= (h)) {                       \
+	        lo[n] = (l);                    \
+	        hi[n] = (h);                    \
+	        n++;                            \
+	}                                       \
+} while (0)
+
+	switch (r->dst.xport.range.op) {
+	case PF_OP_IRG:
+		if (a2 > 0) {
+			PF_RULE_INDEX_RANGE(a1 + 1, a2 - 1);
+		}
+		break;
+	case PF_OP_XRG:
+		if (a1 > 0) {
+			PF_RULE_INDEX_RANGE(0, a1 - 1);
+		}
+		PF_RULE_INDEX_RANGE(a2 + 1, max);
+		break;
+	case PF_OP_RRG:
+		PF_RULE_INDEX_RANGE(a1, a2);
+		break;
+	case PF_OP_EQ:
+		PF_RULE_INDEX_RANGE(a1, a1);
+		break;
+	case PF_OP_NE:
+		if (a1 > 0) {
+			PF_RULE_INDEX_RANGE(0, a1 - 1);
+		}
+		PF_RULE_INDEX_RANGE(a1 + 1, max);
+		break;
+	case PF_OP_LT:
+		if (a1 > 0) {
+			PF_RULE_INDEX_RANGE(0, a1 - 1);
+		}
+		break;
+	case PF_OP_LE:
+		PF_RULE_INDEX_RANGE(0, a1);
+		break;
+	case PF_OP_GT:
+		PF_RULE_INDEX_RANGE(a1 + 1, max);
+		break;
+	case PF_OP_GE:
+		PF_RULE_INDEX_RANGE(a1, max);
+		break;
+	default:
+		PF_RULE_INDEX_RANGE(0, max);
+		break;
+	}
+#undef PF_RULE_INDEX_RANGE
+	/* "a1 >< a2" with a2 < a1 matches everything */
+	if (n == 2 && lo[1] <= hi[0] + 1) {
+		hi[0] = MAX(hi[0], hi[1]);
+		n = 1;
+	}
+	return n;
+}
+
+/* the interval that port falls in */
+static u_int32_t
+pf_rule_index_interval(struct pf_rule_index_class *ic, u_int32_t port)
+{
+	u_int32_t lo = 0, hi = ic->nintervals - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (ic->start[mid] <= port) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+static int
+pf_rule_index_build_class(struct pf_rule_index *idx, int c,
+    struct pf_rulequeue *rules, u_int64_t *bounds)
+{
+	struct pf_rule_index_class *ic = &idx->cls[c];
+	u_int8_t dir = (c & 4) ? PF_OUT : PF_IN;
+	sa_family_t af = (c & 2) ? AF_INET6 : AF_INET;
+	u_int8_t proto = (c & 1) ? IPPROTO_UDP : IPPROTO_TCP;
+	u_int32_t lo[2], hi[2], i, end, n, k, nint, run, wild, total;
+	u_int32_t *pos = NULL;
+	struct pf_rule *r;
+	int error = 0;
+
+	/* cut the port space at each bound of the operators that apply */
+	memset(bounds, 0, PF_RULE_INDEX_PORTS / 8);
+	bounds[0] = 1;
+	TAILQ_FOREACH(r, rules, entries) {
+		if (!pf_rule_index_candidate(r, dir, af, proto) ||
+		    r->proto != proto || !r->dst.xport.range.op) {
+			continue;
+		}
+		n = pf_rule_index_ranges(r, lo, hi);
+		for (k = 0; k < n; k++) {
+			bounds[lo[k] / 64] |= 1ULL << (lo[k] % 64);
+			if (hi[k] + 1 < PF_RULE_INDEX_PORTS) {
+				bounds[(hi[k] + 1) / 64] |= 1ULL << ((hi[k] + 1) % 64);
+			}
+		}
+	}
+	nint = 0;
+	for (i = 0; i < PF_RULE_INDEX_PORTS / 64; i++) {
+		nint += __builtin_popcountll(bounds[i]);
+	}
+
+	ic->nintervals = nint;
+	ic->start = rs_malloc_data(sizeof(u_int16_t) * nint);
+	ic->offset = rs_malloc_data(sizeof(u_int32_t) * (nint + 1));
+	pos = rs_malloc_data(sizeof(u_int32_t) * nint);
+	if (ic->start == NULL || ic->offset == NULL || pos == NULL) {
+		error = ENOMEM;
+		goto done;
+	}
+	memset(ic->offset, 0, sizeof(u_int32_t) * (nint + 1));
+	for (i = 0, k = 0; i < PF_RULE_INDEX_PORTS / 64; i++) {
+		u_int64_t w = bounds[i];
+
+		while (w != 0) {
+			ic->start[k++] = (u_int16_t)(i * 64 + __builtin_ctzll(w));
+			w &= w - 1;
+		}
+	}
+
+	/* count the rules of each interval, offset[] as a difference array */
+	wild = 0;
+	TAILQ_FOREACH(r, rules, entries) {
+		if (!pf_rule_index_candidate(r, dir, af, proto)) {
+			continue;
+		}
+		if (r->proto != proto || !r->dst.xport.range.op) {
+			wild++;
+			continue;
+		}
+		n = pf_rule_index_ranges(r, lo, hi);
+		for (k = 0; k < n; k++) {
+			end = hi[k] + 1 < PF_RULE_INDEX_PORTS ?
+			    pf_rule_index_interval(ic, hi[k] + 1) :
+			    ic->nintervals;
+			ic->offset[pf_rule_index_interval(ic, lo[k])]++;
+			ic->offset[end]--;
+		}
+	}
+	run = total = 0;
+	for (i = 0; i < ic->nintervals; i++) {
+		run += ic->offset[i];
+		ic->offset[i] = total;
+		total += run + wild;
+		if (idx->entries + total > PF_RULE_INDEX_MAX_ENTRIES) {
+			error = E2BIG;
+			goto done;
+		}
+	}
+	ic->offset[ic->nintervals] = total;
+
+	if (total > 0) {
+		ic->rules = rs_malloc_type_array(struct pf_rule *, total);
+		if (ic->rules == NULL) {
+			error = ENOMEM;
+			goto done;
+		}
+	}
+	ic->nrules = total;
+	idx->entries += total;
+
+	/* fill them in ruleset order */
+	memcpy(pos, ic->offset, sizeof(u_int32_t) * ic->nintervals);
+	TAILQ_FOREACH(r, rules, entries) {
+		if (!pf_rule_index_candidate(r, dir, af, proto)) {
+			continue;
+		}
+		if (r->proto != proto || !r->dst.xport.range.op) {
+			for (i = 0; i < ic->nintervals; i++) {
+				ic->rules[pos[i]++] = r;
+			}
+			continue;
+		}
+		n = pf_rule_index_ranges(r, lo, hi);
+		for (k = 0; k < n; k++) {
+			end = hi[k] + 1 < PF_RULE_INDEX_PORTS ?
+			    pf_rule_index_interval(ic, hi[k] + 1) :
+			    ic->nintervals;
+			for (i = pf_rule_index_interval(ic, lo[k]); i < end; i++) {
+				ic->rules[pos[i]++] = r;
+			}
+		}
+	}
+
+done:
+	if (pos != NULL) {
+		rs_free_data(pos, sizeof(u_int32_t) * nint);
+	}
+	return error;
+}
+
+void
+pf_rule_index_free(struct pf_rule_index *idx)
+{
+	struct pf_rule_index_class *ic;
+	int c;
+
+	if (idx == NULL) {
+		return;
+	}
+	for (c = 0; c < PF_RULE_INDEX_CLASSES; c++) {
+		ic = &idx->cls[c];
+		if (ic->start != NULL) {
+			rs_free_data(ic->start,
+			    sizeof(u_int16_t) * ic->nintervals);
+		}
+		if (ic->offset != NULL) {
+			rs_free_data(ic->offset,
+			    sizeof(u_int32_t) * (ic->nintervals + 1));
+		}
+		if (ic->rules != NULL) {
+			rs_free_type_array(struct pf_rule *, ic->nrules,
+			    ic->rules);
+		}
+	}
+	rs_free_type(struct pf_rule_index, idx);
+}
+
+/*
+ * Builds the index of a filter rule list, numbered in order.  Returns
+ * NULL when the list is too short to be worth it or the index would be
+ * too large, in which case the list is evaluated as is.
+ */
+struct pf_rule_index *
+pf_rule_index_build(struct pf_rulequeue *rules, u_int32_t rcount)
+{
+	struct pf_rule_index *idx;
+	u_int64_t *bounds;
+	int c;
+
+	if (rcount < PF_RULE_INDEX_MIN_RULES) {
+		return NULL;
+	}
+	idx = rs_malloc_type(struct pf_rule_index);
+	bounds = rs_malloc_data(PF_RULE_INDEX_PORTS / 8);
+	if (idx == NULL || bounds == NULL) {
+		goto fail;
+	}
+	for (c = 0; c < PF_RULE_INDEX_CLASSES; c++) {
+		if (pf_rule_index_build_class(idx, c, rules, bounds) != 0) {
+			goto fail;
+		}
+	}
+	rs_free_data(bounds, PF_RULE_INDEX_PORTS / 8);
+	return idx;
+
+fail:
+	if (bounds != NULL) {
+		rs_free_data(bounds, PF_RULE_INDEX_PORTS / 8);
+	}
+	pf_rule_index_free(idx);
+	return NULL;
+}
+
+/*
+ * Looks up the rules to evaluate, in order, for a packet with the given
+ * direction, family, protocol and destination port (network order).
+ * Returns 0 if the packet is not covered by the index.
+ */
+int
+pf_rule_index_lookup(struct pf_rule_index *idx, u_int8_t dir,
+    sa_family_t af, u_int8_t proto, u_int16_t dport,
+    struct pf_rule ***rules, u_int32_t *count)
+{
+	struct pf_rule_index_class *ic;
+	u_int32_t i;
+	int c;
+
+	if ((c = pf_rule_index_class(dir, af, proto)) < 0) {
+		return 0;
+	}
+	ic = &idx->cls[c];
+	i = pf_rule_index_interval(ic, ntohs(dport));
+	*count = ic->offset[i + 1] - ic->offset[i];
+	*rules = *count > 0 ? ic->rules + ic->offset[i] : NULL;
+	return 1;
+}
@@ -132,7 +132,8 @@ struct pfr_walktree {
 		PFRW_GET_ADDRS,
 		PFRW_GET_ASTATS,
 		PFRW_POOL_GET,
-		PFRW_DYNADDR_UPDATE
+		PFRW_DYNADDR_UPDATE,
+		PFRW_SNAPSHOT
 	}        pfrw_op;
 	union {
 		user_addr_t              pfrw1_addr;
@@ -140,6 +141,7 @@ struct pfr_walktree {
 		struct pfr_kentryworkq  *pfrw1_workq;
 		struct pfr_kentry       *pfrw1_kentry;
 		struct pfi_dynaddr      *pfrw1_dyn;
+		struct pfr_snap_prefix  *pfrw1_prefix;
 	}        pfrw_1;
 	int      pfrw_free;
 	int      pfrw_flags;
@@ -149,10 +151,50 @@ struct pfr_walktree {
 #define pfrw_workq      pfrw_1.pfrw1_workq
 #define pfrw_kentry     pfrw_1.pfrw1_kentry
 #define pfrw_dyn        pfrw_1.pfrw1_dyn
+#define pfrw_prefix     pfrw_1.pfrw1_prefix
 #define pfrw_cnt        pfrw_free
 
 #define senderr(e)      do { rv = (e); goto _bad; } while (0)
 
+/*
+ * Read-optimized snapshot of the IPv4 entries of a table, for the
+ * per-packet matches in pfr_match_addr() and pfr_update_stats().
+ *
+ * The longest prefix match is resolved ahead of time into a sorted
+ * array of disjoint address ranges, each mapped to the entry that
+ * matches all of its addresses (or to none), with adjacent ranges of
+ * the same entry merged.  The top bits of the address index into that
+ * array, so that a match is a binary search over a handful of ranges
+ * instead of a walk down the radix tree.  N entries make at most 2N + 1
+ * ranges of 12 bytes each.
+ *
+ * A snapshot is never updated in place: any change to the IPv4 radix
+ * tree drops it, and the ioctls that change the addresses of a table
+ * rebuild it when they are done (pfr_snap_update()).  Entries added
+ * from the packet path, to overload tables, leave the table without a
+ * snapshot until the next such ioctl.
+ */
+#define PFR_SNAP_MIN_ADDRS      32      /* smaller tables use the radix */
+#define PFR_SNAP_INDEX_BITS     16      /* at most, 256 KB of index */
+
+struct pfr_snapshot {
+	u_int32_t                pfrs_n;         /* ranges in use */
+	u_int32_t                pfrs_max;       /* ranges allocated */
+	u_int32_t                pfrs_shift;     /* 32 - index bits */
+	u_int32_t               *pfrs_start;     /* first address of a range */
+	struct pfr_kentry      **pfrs_ke;        /* its entry, or NULL */
+	u_int32_t               *pfrs_index;     /* range holding index << shift */
+};
+
+struct pfr_snap_prefix {
+	u_int32_t                pfrsp_start;    /* host order */
+	u_int32_t                pfrsp_end;
+	struct pfr_kentry       *pfrsp_ke;
+};
+
+__private_extern__ void qsort(void *, size_t, size_t,
+    int (*)(const void *, const void *));
+
 struct pool              pfr_ktable_pl;
 struct pool              pfr_kentry_pl;
 
@@ -199,6 +241,10 @@ static void pfr_clean_node_mask(struct pfr_ktable *, struct pfr_kentryworkq *);
 static int pfr_table_count(struct pfr_table *, int);
 static int pfr_skip_table(struct pfr_table *, struct pfr_ktable *, int);
 static struct pfr_kentry *pfr_kentry_byidx(struct pfr_ktable *, int, int);
+static void pfr_snap_update(struct pfr_ktable *);
+static void pfr_snap_drop(struct pfr_ktable *);
+static struct pfr_kentry *pfr_snap_match(const struct pfr_snapshot *,
+    u_int32_t);
 
 RB_PROTOTYPE_SC(static, pfr_ktablehead, pfr_ktable, pfrkt_tree,
     pfr_ktable_compare);
@@ -338,6 +384,7 @@ pfr_add_addrs(struct pfr_table *tbl, user_addr_t _addr, int size,
 	pfr_clean_node_mask(tmpkt, &workq);
 	if (!(flags & PFR_FLAG_DUMMY)) {
 		pfr_insert_kentries(kt, &workq, tzero);
+		pfr_snap_update(kt);
 	} else {
 		pfr_destroy_kentries(&workq);
 	}
@@ -445,6 +492,7 @@ pfr_del_addrs(struct pfr_table *tbl, user_addr_t _addr, int size,
 	}
 	if (!(flags & PFR_FLAG_DUMMY)) {
 		pfr_remove_kentries(kt, &workq);
+		pfr_snap_update(kt);
 	}
 	if (ndel != NULL) {
 		*ndel = xdel;
@@ -561,6 +609,7 @@ _skip:
 		pfr_insert_kentries(kt, &addq, tzero);
 		pfr_remove_kentries(kt, &delq);
 		pfr_clstats_kentries(&changeq, tzero, INVERT_NEG_FLAG);
+		pfr_snap_update(kt);
 	} else {
 		pfr_destroy_kentries(&addq);
 	}
@@ -894,7 +943,12 @@ pfr_lookup_addr(struct pfr_ktable *kt, struct pfr_addr *ad, int exact)
 			ke = NULL;
 		}
 	} else {
-		ke = (struct pfr_kentry *)rn_match(&sa, head);
+		if (ad->pfra_af == AF_INET && kt->pfrkt_snap4 != NULL) {
+			ke = pfr_snap_match(kt->pfrkt_snap4,
+			    ntohl(ad->pfra_ip4addr.s_addr));
+		} else {
+			ke = (struct pfr_kentry *)rn_match(&sa, head);
+		}
 		if (ke && KENTRY_RNF_ROOT(ke)) {
 			ke = NULL;
 		}
@@ -1096,6 +1150,7 @@ pfr_route_kentry(struct pfr_ktable *kt, struct pfr_kentry *ke)
 	bzero(ke->pfrke_node, sizeof(ke->pfrke_node));
 	if (ke->pfrke_af == AF_INET) {
 		head = kt->pfrkt_ip4;
+		pfr_snap_drop(kt);
 	} else if (ke->pfrke_af == AF_INET6) {
 		head = kt->pfrkt_ip6;
 	} else {
@@ -1123,6 +1178,7 @@ pfr_unroute_kentry(struct pfr_ktable *kt, struct pfr_kentry *ke)
 
 	if (ke->pfrke_af == AF_INET) {
 		head = kt->pfrkt_ip4;
+		pfr_snap_drop(kt);
 	} else if (ke->pfrke_af == AF_INET6) {
 		head = kt->pfrkt_ip6;
 	} else {
@@ -1223,6 +1279,18 @@ pfr_walktree(struct radix_node *rn, void *arg)
 			return 1; /* finish search */
 		}
 		break;
+	case PFRW_SNAPSHOT:
+		if (w->pfrw_free-- > 0) {
+			struct pfr_snap_prefix *sp = w->pfrw_prefix++;
+
+			sp->pfrsp_start = ntohl(ke->pfrke_sa.sin.sin_addr.s_addr);
+			sp->pfrsp_end = sp->pfrsp_start;
+			if (ke->pfrke_net < 32) {
+				sp->pfrsp_end |= 0xffffffffU >> ke->pfrke_net;
+			}
+			sp->pfrsp_ke = ke;
+		}
+		break;
 	case PFRW_DYNADDR_UPDATE:
 		if (ke->pfrke_af == AF_INET) {
 			if (w->pfrw_dyn->pfid_acnt4++ > 0) {
@@ -1248,6 +1316,184 @@ pfr_walktree(struct radix_node *rn, void *arg)
 	return 0;
 }
 
+static int
+pfr_snap_prefix_cmp(const void *a, const void *b)
+{
+	const struct pfr_snap_prefix *p = a, *q = b;
+
+	/* by first address, and the widest prefix first */
+	if (p->pfrsp_start != q->pfrsp_start) {
+		return p->pfrsp_start < q->pfrsp_start ? -1 : 1;
+	}
+	if (p->pfrsp_end != q->pfrsp_end) {
+		return p->pfrsp_end > q->pfrsp_end ? -1 : 1;
+	}
+	return 0;
+}
+
+/* start a range at start, unless the previous one has the same entry */
+static void
+pfr_snap_emit(struct pfr_snapshot *snap, u_int64_t start,
+    struct pfr_kentry *ke)
+{
+	if (snap->pfrs_n > 0 && snap->pfrs_ke[snap->pfrs_n - 1] == ke) {
+		return;
+	}
+	VERIFY(snap->pfrs_n < snap->pfrs_max);
+	snap->pfrs_start[snap->pfrs_n] = (u_int32_t)start;
+	snap->pfrs_ke[snap->pfrs_n] = ke;
+	snap->pfrs_n++;
+}
+
+static void
+pfr_snap_free(struct pfr_snapshot *snap)
+{
+	kfree_data(snap->pfrs_start, snap->pfrs_max * sizeof(u_int32_t));
+	kfree_type(struct pfr_kentry *, snap->pfrs_max, snap->pfrs_ke);
+	kfree_data(snap->pfrs_index,
+	    ((1U << (32 - snap->pfrs_shift)) + 1) * sizeof(u_int32_t));
+	kfree_type(struct pfr_snapshot, snap);
+}
+
+static struct pfr_snapshot *
+pfr_snap_build(struct pfr_ktable *kt)
+{
+	struct pfr_snapshot     *snap = NULL;
+	struct pfr_snap_prefix  *prefixes, *sp, *stack[33];
+	struct pfr_walktree      w;
+	u_int32_t                i, n, h, r, bits;
+	u_int64_t                cur = 0;
+	int                      depth = 0;
+
+	LCK_MTX_ASSERT(&pf_lock, LCK_MTX_ASSERT_OWNED);
+
+	prefixes = kalloc_type(struct pfr_snap_prefix, kt->pfrkt_cnt,
+	    Z_WAITOK);
+	if (prefixes == NULL) {
+		return NULL;
+	}
+	bzero(&w, sizeof(w));
+	w.pfrw_op = PFRW_SNAPSHOT;
+	w.pfrw_prefix = prefixes;
+	w.pfrw_free = kt->pfrkt_cnt;
+	if (kt->pfrkt_ip4->rnh_walktree(kt->pfrkt_ip4, pfr_walktree, &w) ||
+	    w.pfrw_free < 0) {
+		goto done;
+	}
+	n = (u_int32_t)(w.pfrw_prefix - prefixes);
+	if (n == 0) {
+		goto done;
+	}
+	qsort(prefixes, n, sizeof(*prefixes), pfr_snap_prefix_cmp);
+
+	bits = MIN(PFR_SNAP_INDEX_BITS, 32 - __builtin_clz(n));
+	snap = kalloc_type(struct pfr_snapshot, Z_WAITOK | Z_ZERO);
+	if (snap == NULL) {
+		goto done;
+	}
+	snap->pfrs_max = 2 * n + 1;
+	snap->pfrs_shift = 32 - bits;
+	snap->pfrs_start = kalloc_data(snap->pfrs_max * sizeof(u_int32_t),
+	    Z_WAITOK);
+	snap->pfrs_ke = kalloc_type(struct pfr_kentry *, snap->pfrs_max,
+	    Z_WAITOK);
+	snap->pfrs_index = kalloc_data(((1U << bits) + 1) * sizeof(u_int32_t),
+	    Z_WAITOK);
+	if (snap->pfrs_start == NULL || snap->pfrs_ke == NULL ||
+	    snap->pfrs_index == NULL) {
+		pfr_snap_free(snap);
+		snap = NULL;
+		goto done;
+	}
+
+	/*
+	 * Prefixes nest or don't overlap, so a sweep in address order
+	 * with a stack of the prefixes covering the current address
+	 * gives every range its longest match.
+	 */
+	for (i = 0; i < n; i++) {
+		sp = &prefixes[i];
+		while (depth > 0 &&
+		    stack[depth - 1]->pfrsp_end < sp->pfrsp_start) {
+			struct pfr_snap_prefix *top = stack[--depth];
+
+			if (cur <= top->pfrsp_end) {
+				pfr_snap_emit(snap, cur, top->pfrsp_ke);
+				cur = (u_int64_t)top->pfrsp_end + 1;
+			}
+		}
+		if (cur < sp->pfrsp_start) {
+			pfr_snap_emit(snap, cur,
+			    depth > 0 ? stack[depth - 1]->pfrsp_ke : NULL);
+			cur = sp->pfrsp_start;
+		}
+		VERIFY(depth < (int)(sizeof(stack) / sizeof(stack[0])));
+		stack[depth++] = sp;
+	}
+	while (depth > 0) {
+		sp = stack[--depth];
+		if (cur <= sp->pfrsp_end) {
+			pfr_snap_emit(snap, cur, sp->pfrsp_ke);
+			cur = (u_int64_t)sp->pfrsp_end + 1;
+		}
+	}
+	if (cur <= 0xffffffffULL) {
+		pfr_snap_emit(snap, cur, NULL);
+	}
+
+	for (h = 0, r = 0; h < (1U << bits); h++) {
+		while (r + 1 < snap->pfrs_n &&
+		    snap->pfrs_start[r + 1] <= h << snap->pfrs_shift) {
+			r++;
+		}
+		snap->pfrs_index[h] = r;
+	}
+	snap->pfrs_index[1U << bits] = snap->pfrs_n - 1;
+done:
+	kfree_type(struct pfr_snap_prefix, kt->pfrkt_cnt, prefixes);
+	return snap;
+}
+
+/*
+ * Called once an ioctl is done changing the addresses of a table.
+ */
+static void
+pfr_snap_update(struct pfr_ktable *kt)
+{
+	if (kt->pfrkt_snap4 == NULL && kt->pfrkt_cnt >= PFR_SNAP_MIN_ADDRS) {
+		kt->pfrkt_snap4 = pfr_snap_build(kt);
+	}
+}
+
+static void
+pfr_snap_drop(struct pfr_ktable *kt)
+{
+	if (kt->pfrkt_snap4 != NULL) {
+		pfr_snap_free(kt->pfrkt_snap4);
+		kt->pfrkt_snap4 = NULL;
+	}
+}
+
+/* addr is in host order */
+static struct pfr_kentry *
+pfr_snap_match(const struct pfr_snapshot *snap, u_int32_t addr)
+{
+	u_int32_t lo, hi, mid;
+
+	/* the ranges holding the first and last address of this slice */
+	lo = snap->pfrs_index[addr >> snap->pfrs_shift];
+	hi = snap->pfrs_index[(addr >> snap->pfrs_shift) + 1];
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (snap->pfrs_start[mid] <= addr) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return snap->pfrs_ke[lo];
+}
+
 int
 pfr_clr_tables(struct pfr_table *filter, int *ndel, int flags)
 {
@@ -1908,14 +2154,17 @@ pfr_commit_ktable(struct pfr_ktable *kt, u_int64_t tzero)
 		pfr_remove_kentries(kt, &delq);
 		pfr_clstats_kentries(&changeq, tzero, INVERT_NEG_FLAG);
 		pfr_destroy_kentries(&garbageq);
+		pfr_snap_update(kt);
 	} else {
 		/* kt cannot contain addresses */
+		pfr_snap_drop(kt);
 		SWAP(struct radix_node_head *, kt->pfrkt_ip4,
 		    shadow->pfrkt_ip4);
 		SWAP(struct radix_node_head *, kt->pfrkt_ip6,
 		    shadow->pfrkt_ip6);
 		SWAP(int, kt->pfrkt_cnt, shadow->pfrkt_cnt);
 		pfr_clstats_ktable(kt, tzero, 1);
+		pfr_snap_update(kt);
 	}
 	nflags = ((shadow->pfrkt_flags & PFR_TFLAG_USRMASK) |
 	    (kt->pfrkt_flags & PFR_TFLAG_SETMASK) | PFR_TFLAG_ACTIVE) &
@@ -2194,6 +2443,7 @@ pfr_destroy_ktable(struct pfr_ktable *kt, int flushaddr)
 		pfr_clean_node_mask(kt, &addrq);
 		pfr_destroy_kentries(&addrq);
 	}
+	pfr_snap_drop(kt);
 	if (kt->pfrkt_ip4 != NULL) {
 		zfree(radix_node_head_zone, kt->pfrkt_ip4);
 	}
@@ -2249,6 +2499,10 @@ pfr_match_addr(struct pfr_ktable *kt, struct pf_addr *a, sa_family_t af)
 	switch (af) {
 #if INET
 	case AF_INET:
+		if (kt->pfrkt_snap4 != NULL) {
+			ke = pfr_snap_match(kt->pfrkt_snap4, ntohl(a->addr32[0]));
+			break;
+		}
 		pfr_sin.sin_addr.s_addr = a->addr32[0];
 		ke = (struct pfr_kentry *)rn_match(&pfr_sin, kt->pfrkt_ip4);
 		if (ke && KENTRY_RNF_ROOT(ke)) {
@@ -2291,6 +2545,10 @@ pfr_update_stats(struct pfr_ktable *kt, struct pf_addr *a, sa_family_t af,
 	switch (af) {
 #if INET
 	case AF_INET:
+		if (kt->pfrkt_snap4 != NULL) {
+			ke = pfr_snap_match(kt->pfrkt_snap4, ntohl(a->addr32[0]));
+			break;
+		}
 		pfr_sin.sin_addr.s_addr = a->addr32[0];
 		ke = (struct pfr_kentry *)rn_match(&pfr_sin, kt->pfrkt_ip4);
 		if (ke && KENTRY_RNF_ROOT(ke)) {
@@ -992,6 +992,12 @@ struct pf_state_key_cmp {
 
 TAILQ_HEAD(pf_statelist, pf_state);
 
+/* state key tables, see pf_state_hash_find() */
+#define PF_SK_LAN_EXT           0
+#define PF_SK_EXT_GWY           1
+#define PF_SK_TABLES            2
+#define PF_SK_HASHED(table)     (1 << (table))
+
 struct pf_state_key {
 	struct pf_state_host lan;
 	struct pf_state_host gwy;
@@ -1006,8 +1012,10 @@ struct pf_state_key {
 	u_int32_t        flowsrc;
 	u_int32_t        flowhash;
 
-	RB_ENTRY(pf_state_key)   entry_lan_ext;
-	RB_ENTRY(pf_state_key)   entry_ext_gwy;
+	/* linkage and hash values in the lan_ext and ext_gwy state tables */
+	LIST_ENTRY(pf_state_key) entry_hash[PF_SK_TABLES];
+	u_int32_t        hash[PF_SK_TABLES];
+	u_int8_t         hashed;        /* PF_SK_HASHED(table) flags */
 	struct pf_statelist      states;
 	u_int32_t        refcnt;
 };
@@ -1198,6 +1206,8 @@ TAILQ_HEAD(pf_rulequeue, pf_rule);
 
 struct pf_anchor;
 
+struct pf_rule_index;
+
 struct pf_ruleset {
 	struct {
 		struct pf_rulequeue      queues[2];
@@ -1208,6 +1218,7 @@ struct pf_ruleset {
 			u_int32_t                rsize;
 			u_int32_t                ticket;
 			int                      open;
+			struct pf_rule_index    *index; /* see pf_rule_index_build() */
 		}                        active, inactive;
 	}                        rules[PF_RULESET_MAX];
 	struct pf_anchor        *anchor;
@@ -1324,6 +1335,8 @@ struct pfr_kentry {
 	u_int8_t                 pfrke_intrpool;
 };
 
+struct pfr_snapshot;
+
 SLIST_HEAD(pfr_ktableworkq, pfr_ktable);
 RB_HEAD(pfr_ktablehead, pfr_ktable);
 struct pfr_ktable {
@@ -1332,6 +1345,7 @@ struct pfr_ktable {
 	SLIST_ENTRY(pfr_ktable)  pfrkt_workq;
 	struct radix_node_head  *pfrkt_ip4;
 	struct radix_node_head  *pfrkt_ip6;
+	struct pfr_snapshot     *pfrkt_snap4;   /* IPv4 match snapshot */
 	struct pfr_ktable       *pfrkt_shadow;
 	struct pfr_ktable       *pfrkt_root;
 	struct pf_ruleset       *pfrkt_rs;
@@ -1351,20 +1365,8 @@ struct pfr_ktable {
 #define pfrkt_nomatch   pfrkt_ts.pfrts_nomatch
 #define pfrkt_tzero     pfrkt_ts.pfrts_tzero
 
-RB_HEAD(pf_state_tree_lan_ext, pf_state_key);
-RB_PROTOTYPE_SC(__private_extern__, pf_state_tree_lan_ext, pf_state_key,
-    entry_lan_ext, pf_state_compare_lan_ext);
-
-RB_HEAD(pf_state_tree_ext_gwy, pf_state_key);
-RB_PROTOTYPE_SC(__private_extern__, pf_state_tree_ext_gwy, pf_state_key,
-    entry_ext_gwy, pf_state_compare_ext_gwy);
-
 RB_HEAD(pfi_ifhead, pfi_kif);
 
-/* state tables */
-extern struct pf_state_tree_lan_ext      pf_statetbl_lan_ext;
-extern struct pf_state_tree_ext_gwy      pf_statetbl_ext_gwy;
-
 struct pfi_kif {
 	char                             pfik_name[IFNAMSIZ];
 	RB_ENTRY(pfi_kif)                pfik_tree;
@@ -1443,6 +1445,7 @@ struct pf_pdesc {
 #define PFDESC_TCP_NORM 0x0001          /* TCP shall be statefully scrubbed */
 #define PFDESC_IP_REAS  0x0002          /* IP frags would've been reassembled */
 #define PFDESC_IP_FRAG  0x0004          /* This is a fragment */
+#define PFDESC_NO_INDEX 0x0008          /* Walk every filter rule */
 	sa_family_t      af;
 	sa_family_t      naf;           /*  address family after translation */
 	u_int8_t         proto;
@@ -2186,6 +2189,7 @@ __private_extern__ void pf_purge_expired_src_nodes(void);
 __private_extern__ void pf_purge_expired_states(u_int32_t);
 __private_extern__ void pf_unlink_state(struct pf_state *);
 __private_extern__ void pf_free_state(struct pf_state *);
+__private_extern__ void pf_state_hash_init(void);
 __private_extern__ int pf_insert_state(struct pfi_kif *, struct pf_state *);
 __private_extern__ int pf_insert_src_node(struct pf_src_node **,
     struct pf_rule *, struct pf_addr *, sa_family_t);
@@ -2391,6 +2395,11 @@ __private_extern__ struct pf_ruleset *pf_find_ruleset_with_owner(const char *,
     const char *, int, int *);
 __private_extern__ struct pf_ruleset *pf_find_or_create_ruleset(const char *);
 __private_extern__ void pf_rs_initialize(void);
+__private_extern__ struct pf_rule_index *pf_rule_index_build(
+	struct pf_rulequeue *, u_int32_t);
+__private_extern__ void pf_rule_index_free(struct pf_rule_index *);
+__private_extern__ int pf_rule_index_lookup(struct pf_rule_index *, u_int8_t,
+    sa_family_t, u_int8_t, u_int16_t, struct pf_rule ***, u_int32_t *);
 
 __private_extern__ int pf_osfp_add(struct pf_osfp_ioctl *);
 __private_extern__ struct pf_osfp_enlist *pf_osfp_fingerprint(struct pf_pdesc *,
@@ -2437,6 +2446,11 @@ extern struct pf_ruleset *pf_find_ruleset_with_owner(const char *,
     const char *, int, int *);
 extern struct pf_ruleset *pf_find_or_create_ruleset(const char *);
 extern void pf_rs_initialize(void);
+extern struct pf_rule_index *pf_rule_index_build(struct pf_rulequeue *,
+    u_int32_t);
+extern void pf_rule_index_free(struct pf_rule_index *);
+extern int pf_rule_index_lookup(struct pf_rule_index *, u_int8_t, sa_family_t,
+    u_int8_t, u_int16_t, struct pf_rule ***, u_int32_t *);
 #endif /* !KERNEL */
 
 #ifdef  __cplusplus
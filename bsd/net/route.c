@@ -78,7 +78,9 @@
 #include <sys/protosw.h>
 #include <sys/sdt.h>
 #include <sys/kernel.h>
+#include <kern/counter.h>
 #include <kern/locks.h>
+#include <kern/smr.h>
 #include <kern/zalloc.h>
 
 #include <net/dlil.h>
@@ -86,6 +88,7 @@
 #include <net/route.h>
 #include <net/ntstat.h>
 #include <net/nwk_wq.h>
+#include <net/rt_fib.h>
 #if NECP
 #include <net/necp.h>
 #endif /* NECP */
@@ -178,7 +181,12 @@
  *
  * rt_genid
  *
- *	- Assumes that 32-bit writes are atomic; no locks.
+ *	- Assumes that 32-bit writes are atomic; no locks when rnh_lock
+ *	  is held, rt_lock otherwise (rtalloc_fib()).
+ *
+ * rt_fib_linked, rt_fib_seq
+ *
+ *	- Routing table lock (rnh_lock).
  *
  * rt_dlt, rt_output
  *
@@ -194,7 +202,10 @@
  *
  * LOOKUP of an entry holds the rnh_lock and bumps up the reference count
  * before returning; it is valid to also bump up the reference count using
- * RT_ADDREF after the lookup has returned an entry.
+ * RT_ADDREF after the lookup has returned an entry.  IPv4 lookups may
+ * first try the lock-free FIB (see rtalloc1_fib()), which only ever
+ * references entries that already have references, and only tries the
+ * rt_lock of the entries it looks at.
  *
  * REMOVAL of an entry from the radix tree holds the rnh_lock, removes the
  * entry but does not decrement the reference count.  Removal happens when
@@ -329,6 +340,11 @@ static void rt_clear_idleref(struct rtentry *);
 static void rt_str4(struct rtentry *, char *, uint32_t, char *, uint32_t);
 static void rt_str6(struct rtentry *, char *, uint32_t, char *, uint32_t);
 static boolean_t route_ignore_protocol_cloning_for_dst(struct rtentry *, struct sockaddr *);
+static boolean_t rt_trylock_spin(struct rtentry *);
+static void rt_fib_add(struct rtentry *);
+static void rt_fib_del(struct rtentry *);
+static struct rtentry *rtalloc1_fib(struct sockaddr *, int, uint32_t,
+    unsigned int);
 
 uint32_t route_genid_inet = 0;
 uint32_t route_genid_inet6 = 0;
@@ -393,12 +409,44 @@ static unsigned int primary6_ifscope = IFSCOPE_NONE;
 #define RT_HOST(r)      (RT(r)->rt_flags & RTF_HOST)
 
 unsigned int rt_verbose = 0;
-#if (DEVELOPMENT || DEBUG)
 SYSCTL_DECL(_net_route);
+#if (DEVELOPMENT || DEBUG)
 SYSCTL_UINT(_net_route, OID_AUTO, verbose, CTLFLAG_RW | CTLFLAG_LOCKED,
     &rt_verbose, 0, "");
 #endif /* (DEVELOPMENT || DEBUG) */
 
+/*
+ * IPv4 forwarding table mirroring the AF_INET radix tree, for lookups
+ * that don't take rnh_lock; see rtalloc1_fib().  Non-scoped routes live
+ * in rt_fib4, scoped ones in the table of their interface scope.  Routes
+ * that can't be mirrored (non-contiguous masks, large scopes) are only
+ * counted, and turn the lock-free lookup off while they exist.  All of
+ * this is modified with rnh_lock held.
+ *
+ * rt_fib4 starts with a small root, and only gets the wide one that
+ * suits full Internet tables once it holds that many routes.
+ */
+#define RT_FIB_ROOT_BITS        12      /* 32 KB root */
+#define RT_FIB_LARGE_ROOT_BITS  18      /* 2 MB root, for large tables */
+#define RT_FIB_LARGE_ROUTES     (1u << 14)
+#define RT_FIB_SCOPED_ROOT_BITS 8
+#define RT_FIB_SCOPES           256
+
+static struct rt_fib *rt_fib4;
+static struct rt_fib *rt_fib4_scoped[RT_FIB_SCOPES];
+static uint32_t rt_fib4_unmirrored;
+
+static int rt_fib_enabled = 1;
+SYSCTL_INT(_net_route, OID_AUTO, fib, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &rt_fib_enabled, 0, "Look up IPv4 routes without taking rnh_lock");
+
+SCALABLE_COUNTER_DEFINE(rt_fib_hits);
+SCALABLE_COUNTER_DEFINE(rt_fib_fallbacks);
+SYSCTL_SCALABLE_COUNTER(_net_route, fib_hits, rt_fib_hits,
+    "route lookups satisfied without rnh_lock");
+SYSCTL_SCALABLE_COUNTER(_net_route, fib_fallbacks, rt_fib_fallbacks,
+    "route lookups that fell back to rnh_lock");
+
 static void
 rtable_init(void **table)
 {
@@ -452,6 +500,8 @@ route_init(void)
 	rte_zone = zone_create(RTE_ZONE_NAME, size, ZC_NONE);
 
 	TAILQ_INIT(&rttrash_head);
+
+	rt_fib4 = rt_fib_create(RT_FIB_ROOT_BITS);
 }
 
 /*
@@ -858,7 +908,8 @@ routegenid_update(void)
 void
 routegenid_inet_update(void)
 {
-	os_atomic_inc(&route_genid_inet, relaxed);
+	/* orders the rt_fib4 update before it, see rtalloc_fib() */
+	os_atomic_inc(&route_genid_inet, release);
 }
 
 void
@@ -867,6 +918,297 @@ routegenid_inet6_update(void)
 	os_atomic_inc(&route_genid_inet6, relaxed);
 }
 
+/*
+ * Compute where a route goes in the IPv4 FIB; returns FALSE if it
+ * can't be represented there.
+ */
+static boolean_t
+rt_fib_key(struct rtentry *rt, uint32_t *addr, uint8_t *plen,
+    unsigned int *scope)
+{
+	struct sockaddr_in mask;
+	uint32_t m = 0xffffffff;
+
+	/* radix masks may be shorter than a sockaddr_in; zeroes follow */
+	if (rt_mask(rt) != NULL) {
+		bzero(&mask, sizeof(mask));
+		bcopy(rt_mask(rt), &mask,
+		    MIN(rt_mask(rt)->sa_len, sizeof(mask)));
+		m = ntohl(mask.sin_addr.s_addr);
+	}
+	if ((~m & (~m + 1)) != 0) {
+		return FALSE;           /* non-contiguous mask */
+	}
+	*scope = (rt->rt_flags & RTF_IFSCOPE) ?
+	    sin_get_ifscope(rt_key(rt)) : IFSCOPE_NONE;
+	if (*scope >= RT_FIB_SCOPES) {
+		return FALSE;
+	}
+	*addr = ntohl(SIN(rt_key(rt))->sin_addr.s_addr) & m;
+	*plen = (uint8_t)__builtin_popcount(m);
+	return TRUE;
+}
+
+/*
+ * Mirror a route that was just added to the AF_INET radix tree.
+ */
+static void
+rt_fib_add(struct rtentry *rt)
+{
+	struct rt_fib *fib;
+	unsigned int scope;
+	uint32_t addr;
+	uint8_t plen;
+
+	LCK_MTX_ASSERT(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (!rt_fib_key(rt, &addr, &plen, &scope)) {
+		os_atomic_inc(&rt_fib4_unmirrored, relaxed);
+		return;
+	}
+	if (scope == IFSCOPE_NONE) {
+		fib = rt_fib4;
+	} else if ((fib = rt_fib4_scoped[scope]) == NULL) {
+		fib = rt_fib_create(RT_FIB_SCOPED_ROOT_BITS);
+		os_atomic_store(&rt_fib4_scoped[scope], fib, release);
+	}
+	if (rt_fib_insert(fib, addr, plen, rt) != 0) {
+		os_atomic_inc(&rt_fib4_unmirrored, relaxed);
+		return;
+	}
+	rt->rt_fib_linked = TRUE;
+
+	if (fib == rt_fib4 && rt_fib_count(fib) >= RT_FIB_LARGE_ROUTES &&
+	    rt_fib_root_bits(fib) < RT_FIB_LARGE_ROOT_BITS) {
+		VERIFY(rt_fib_grow(fib, RT_FIB_LARGE_ROOT_BITS) == 0);
+	}
+}
+
+/*
+ * Undo rt_fib_add() for a route that was just removed from the radix
+ * tree.  Lock-free lookups may still be looking at it, so remember the
+ * SMR goal rtfree_common() must reach before the entry is torn down.
+ */
+static void
+rt_fib_del(struct rtentry *rt)
+{
+	void *removed;
+	unsigned int scope;
+	uint32_t addr;
+	uint8_t plen;
+
+	LCK_MTX_ASSERT(rnh_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (!rt->rt_fib_linked) {
+		os_atomic_dec(&rt_fib4_unmirrored, relaxed);
+		return;
+	}
+	(void) rt_fib_key(rt, &addr, &plen, &scope);
+	removed = rt_fib_remove(scope == IFSCOPE_NONE ? rt_fib4 :
+	    rt_fib4_scoped[scope], addr, plen);
+	VERIFY(removed == rt);
+	rt->rt_fib_linked = FALSE;
+	rt->rt_fib_seq = smr_advance(&smr_net);
+}
+
+static struct rtentry *
+rt_fib_lookup_scoped(uint32_t addr, unsigned int ifscope)
+{
+	struct rt_fib *fib;
+
+	if (ifscope >= RT_FIB_SCOPES) {
+		return NULL;
+	}
+	fib = os_atomic_load(&rt_fib4_scoped[ifscope], dependency);
+	return fib != NULL ? rt_fib_lookup(fib, addr) : NULL;
+}
+
+/*
+ * Lock-free equivalent of rtalloc1_common_locked() for AF_INET.
+ *
+ * This follows the scoped routing rules of rt_lookup_common(), using
+ * rt_fib4 for the non-scoped search and the interface's own table for
+ * the scoped one.  Returns NULL whenever the answer would need rnh_lock:
+ * no route, a route to be cloned, the loopback exception, the fallback
+ * to the non-scoped default route, or a route with no references yet
+ * (the first reference unexpires it, see in_validate()).  Route locks
+ * are only tried, since we can't block in an SMR critical section.
+ */
+static struct rtentry *
+rtalloc1_fib(struct sockaddr *dst, int report, uint32_t ignflags,
+    unsigned int ifscope)
+{
+	struct rtentry *rt0, *rt;
+	uint32_t addr;
+
+	if (!rt_fib_enabled || dst->sa_family != AF_INET ||
+	    dst->sa_len < sizeof(struct sockaddr_in) ||
+	    os_atomic_load(&rt_fib4_unmirrored, relaxed) != 0) {
+		return NULL;
+	}
+	if (ifscope == IFSCOPE_NONE) {
+		ifscope = sin_get_ifscope(dst);
+	}
+	addr = ntohl(SIN(dst)->sin_addr.s_addr);
+
+	smr_net_enter();
+	rt0 = rt_fib_lookup(rt_fib4, addr);
+	if (rt0 == NULL || !rt_trylock_spin(rt0)) {
+		goto fallback;
+	}
+	rt = rt0;
+	if (!(rt0->rt_ifp->if_flags & IFF_LOOPBACK) ||
+	    (rt0->rt_flags & RTF_GATEWAY)) {
+		if (ifscope == IFSCOPE_NONE) {
+			ifscope = rt0->rt_ifp->if_index;
+		} else if (rt0->rt_ifp->if_index != ifscope) {
+			RT_UNLOCK(rt0);
+			if (ifscope == lo_ifp->if_index) {
+				goto fallback;
+			}
+			rt0 = NULL;
+		}
+
+		rt = rt_fib_lookup_scoped(addr, ifscope);
+		if (rt == NULL) {
+			if ((rt = rt0) == NULL) {
+				goto fallback;
+			}
+		} else if (!rt_trylock_spin(rt)) {
+			if (rt0 != NULL) {
+				RT_UNLOCK(rt0);
+			}
+			goto fallback;
+		} else if (rt0 != NULL) {
+			/* same preference for the non-scoped result */
+			if ((INET_DEFAULT(rt_key(rt)) &&
+			    !INET_DEFAULT(rt_key(rt0))) ||
+			    (!RT_HOST(rt) && RT_HOST(rt0))) {
+				RT_UNLOCK(rt);
+				rt = rt0;
+			} else {
+				RT_UNLOCK(rt0);
+			}
+		}
+	}
+
+	RT_LOCK_ASSERT_HELD(rt);
+	if ((rt->rt_flags & (RTF_UP | RTF_CONDEMNED)) != RTF_UP ||
+	    rt->rt_refcnt == 0 || (report &&
+	    (rt->rt_flags & ~ignflags & (RTF_CLONING | RTF_PRCLONING)))) {
+		RT_UNLOCK(rt);
+		goto fallback;
+	}
+	RT_ADDREF_LOCKED(rt);
+	RT_UNLOCK(rt);
+	smr_net_leave();
+
+	counter_inc(&rt_fib_hits);
+	return rt;
+
+fallback:
+	smr_net_leave();
+	counter_inc(&rt_fib_fallbacks);
+	return NULL;
+}
+
+/*
+ * rtalloc_ign_common_locked() through rtalloc1_fib(), for a route
+ * that isn't cached yet.  The generation ID is sampled before the
+ * lookup, since a route added after it might have been missed.
+ */
+static boolean_t
+rtalloc_fib(struct route *ro, uint32_t ignore, unsigned int ifscope)
+{
+	uint32_t genid = os_atomic_load(&route_genid_inet, acquire);
+	struct rtentry *rt;
+
+	if (ro->ro_rt != NULL) {
+		return FALSE;
+	}
+	rt = rtalloc1_fib(SA(&ro->ro_dst), 1, ignore, ifscope);
+	if (rt == NULL) {
+		return FALSE;
+	}
+	/* shared with other lookups, and rnh_lock isn't held */
+	RT_LOCK_SPIN(rt);
+	rt->rt_genid = genid;
+	RT_UNLOCK(rt);
+	ro->ro_rt = rt;
+	return TRUE;
+}
+
+#if (DEVELOPMENT || DEBUG)
+/*
+ * net.route.fib_probe looks up an IPv4 destination with rtalloc1_fib(),
+ * and when that gives a route, checks that it's the one the lookup
+ * under rnh_lock gives.  Used by tests/route_fib_select.c.
+ */
+struct rt_fib_probe {
+	struct sockaddr_in      rfp_dst;
+	uint32_t                rfp_ifscope;
+	uint32_t                rfp_report;
+	uint32_t                rfp_hit;        /* out: rtalloc1_fib() found it */
+	uint32_t                rfp_same;       /* out: as rnh_lock's lookup did */
+	uint32_t                rfp_ifindex;    /* out: the route's interface */
+	uint32_t                rfp_flags;      /* out: and its RTF_* flags */
+};
+
+static int
+sysctl_rt_fib_probe SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct rt_fib_probe probe;
+	struct rtentry *rt, *locked_rt;
+	int error;
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		return SYSCTL_OUT(req, NULL, sizeof(probe));
+	}
+	if (req->newptr == USER_ADDR_NULL || req->newlen != sizeof(probe)) {
+		return EINVAL;
+	}
+	error = SYSCTL_IN(req, &probe, sizeof(probe));
+	if (error != 0) {
+		return error;
+	}
+	if (probe.rfp_dst.sin_family != AF_INET ||
+	    probe.rfp_dst.sin_len != sizeof(probe.rfp_dst)) {
+		return EINVAL;
+	}
+	/* the scope only comes from rfp_ifscope */
+	bzero(probe.rfp_dst.sin_zero, sizeof(probe.rfp_dst.sin_zero));
+
+	probe.rfp_same = 0;
+	probe.rfp_ifindex = 0;
+	probe.rfp_flags = 0;
+	rt = rtalloc1_fib(SA(&probe.rfp_dst), probe.rfp_report, 0,
+	    probe.rfp_ifscope);
+	probe.rfp_hit = (rt != NULL);
+	if (rt != NULL) {
+		lck_mtx_lock(rnh_lock);
+		locked_rt = rtalloc1_scoped_locked(SA(&probe.rfp_dst),
+		    probe.rfp_report, 0, probe.rfp_ifscope);
+		lck_mtx_unlock(rnh_lock);
+
+		RT_LOCK(rt);
+		probe.rfp_same = (locked_rt == rt);
+		probe.rfp_ifindex = rt->rt_ifp->if_index;
+		probe.rfp_flags = rt->rt_flags;
+		RT_UNLOCK(rt);
+		if (locked_rt != NULL) {
+			rtfree(locked_rt);
+		}
+		rtfree(rt);
+	}
+	return SYSCTL_OUT(req, &probe, sizeof(probe));
+}
+
+SYSCTL_PROC(_net_route, OID_AUTO, fib_probe,
+    CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_LOCKED | CTLFLAG_MASKED, 0, 0,
+    sysctl_rt_fib_probe, "S", "Look up an IPv4 route without rnh_lock");
+#endif /* (DEVELOPMENT || DEBUG) */
+
 /*
  * Packet routing routines.
  */
@@ -908,6 +1250,9 @@ void
 rtalloc_ign(struct route *ro, uint32_t ignore)
 {
 	LCK_MTX_ASSERT(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if (rtalloc_fib(ro, ignore, IFSCOPE_NONE)) {
+		return;
+	}
 	lck_mtx_lock(rnh_lock);
 	rtalloc_ign_common_locked(ro, ignore, IFSCOPE_NONE);
 	lck_mtx_unlock(rnh_lock);
@@ -917,6 +1262,9 @@ void
 rtalloc_scoped_ign(struct route *ro, uint32_t ignore, unsigned int ifscope)
 {
 	LCK_MTX_ASSERT(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if (rtalloc_fib(ro, ignore, ifscope)) {
+		return;
+	}
 	lck_mtx_lock(rnh_lock);
 	rtalloc_ign_common_locked(ro, ignore, ifscope);
 	lck_mtx_unlock(rnh_lock);
@@ -1111,6 +1459,9 @@ rtalloc1(struct sockaddr *dst, int report, uint32_t ignflags)
 {
 	struct rtentry *entry;
 	LCK_MTX_ASSERT(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if ((entry = rtalloc1_fib(dst, report, ignflags, IFSCOPE_NONE)) != NULL) {
+		return entry;
+	}
 	lck_mtx_lock(rnh_lock);
 	entry = rtalloc1_locked(dst, report, ignflags);
 	lck_mtx_unlock(rnh_lock);
@@ -1123,6 +1474,9 @@ rtalloc1_scoped(struct sockaddr *dst, int report, uint32_t ignflags,
 {
 	struct rtentry *entry;
 	LCK_MTX_ASSERT(rnh_lock, LCK_MTX_ASSERT_NOTOWNED);
+	if ((entry = rtalloc1_fib(dst, report, ignflags, ifscope)) != NULL) {
+		return entry;
+	}
 	lck_mtx_lock(rnh_lock);
 	entry = rtalloc1_scoped_locked(dst, report, ignflags, ifscope);
 	lck_mtx_unlock(rnh_lock);
@@ -1226,6 +1580,11 @@ rtfree_common(struct rtentry *rt, boolean_t locked)
 		struct rtentry *rt_parent;
 		struct ifaddr *rt_ifa;
 
+		/* lock-free lookups may still try rt_lock, see rt_fib_del() */
+		if (rt->rt_fib_seq != SMR_SEQ_INVALID) {
+			smr_wait(&smr_net, rt->rt_fib_seq);
+		}
+
 		rt->rt_flags |= RTF_DEAD;
 		if (rt->rt_nodes->rn_flags & (RNF_ACTIVE | RNF_ROOT)) {
 			panic("rt %p freed while in radix tree", rt);
@@ -1966,6 +2325,9 @@ rtrequest_common_locked(int req, struct sockaddr *dst0,
 			/* NOTREACHED */
 		}
 		rt = (struct rtentry *)rn;
+		if (af == AF_INET) {
+			rt_fib_del(rt);
+		}
 
 		RT_LOCK(rt);
 		old_rt_refcnt = rt->rt_refcnt;
@@ -2413,6 +2775,10 @@ makeroute:
 		}
 #endif /* NECP */
 
+		if (af == AF_INET) {
+			rt_fib_add(rt);
+		}
+
 		/*
 		 * actually return a resultant rtentry and
 		 * give the caller a single reference.
@@ -3795,6 +4161,19 @@ rt_lock(struct rtentry *rt, boolean_t spin)
 	}
 }
 
+static boolean_t
+rt_trylock_spin(struct rtentry *rt)
+{
+	RT_LOCK_ASSERT_NOTHELD(rt);
+	if (!lck_mtx_try_lock_spin(&rt->rt_lock)) {
+		return FALSE;
+	}
+	if (rte_debug & RTD_DEBUG) {
+		rte_lock_debug((struct rtentry_dbg *)rt);
+	}
+	return TRUE;
+}
+
 void
 rt_unlock(struct rtentry *rt)
 {
@@ -77,6 +77,7 @@ struct route_old {
 
 #ifdef BSD_KERNEL_PRIVATE
 #include <kern/locks.h>
+#include <kern/smr_types.h>
 #include <net/radix.h>
 #include <net/if_llatbl.h>
 #include <sys/eventhandler.h>
@@ -212,6 +213,8 @@ struct rtentry {
 	u_int32_t rtt_min;              /* minimum RTT computed from history */
 	u_int32_t rtt_expire_ts;        /* RTT history expire timestamp */
 	u_int8_t rtt_index;             /* Index into RTT history */
+	boolean_t rt_fib_linked;        /* mirrored in the IPv4 FIB */
+	smr_seq_t rt_fib_seq;           /* SMR goal once out of the FIB */
 	/* Event handler context for the rtentrt */
 	struct eventhandler_lists_ctxt rt_evhdlr_ctxt;
 };
@@ -0,0 +1,753 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Poptrie-style compressed multibit trie for IPv4 longest prefix matches,
+ * see rt_fib.h.
+ *
+ * The root is a plain array indexed by the top root_bits of the address,
+ * published along with root_bits so that it can be swapped for a wider
+ * one as the table grows (rt_fib_grow()).
+ * Each slot there holds nothing, the longest prefix covering the slot's
+ * whole address range (leaf pushing), or a child node tagged with
+ * RT_FIB_NODE.  A node resolves the next 6 bits (fewer at the bottom)
+ * into 64 slots of the same kinds, but stores them compressed:
+ * rfn_nodevec marks the slots holding a child and rfn_leafvec the leaf
+ * slots where a new run of one leaf starts, and rfn_ptr[] holds the
+ * children followed by one leaf per run, so that a slot is found with
+ * one popcount.  A node only exists while some prefix longer than its
+ * parent slot lives inside it.
+ *
+ * Nodes never change once published.  An update rebuilds the nodes on
+ * the path to the prefix (and, for a short prefix, the nodes it covers
+ * whose leaves change), stores the new top of that path in the root with
+ * release semantics, and frees the replaced nodes only after an SMR grace
+ * period, so lookups may run concurrently with one writer.
+ *
+ * Leaves can't tell which shorter prefix they hide, so the prefixes are
+ * also kept in a hash by (address, length).  Removing a prefix looks up
+ * the next shorter one covering it there, and puts it back in every slot
+ * the removed prefix occupied.
+ *
+ * This file builds in user space as well, for tests/route_fib.c.
+ */
+
+#ifdef KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/errno.h>
+#include <kern/zalloc.h>
+#include <kern/smr.h>
+
+#include <net/rt_fib.h>
+
+#define rt_fib_alloc_type(type) \
+	kalloc_type(type, Z_WAITOK | Z_ZERO | Z_NOFAIL)
+#define rt_fib_free_type(type, ptr)     kfree_type(type, ptr)
+#define rt_fib_alloc_array(type, count) \
+	kalloc_type(type, count, Z_WAITOK | Z_ZERO | Z_NOFAIL)
+#define rt_fib_free_array(type, count, ptr) \
+	kfree_type(type, count, ptr)
+#define rt_fib_alloc_node(count) \
+	kalloc_type(struct rt_fib_node, uintptr_t, count, \
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL)
+#define rt_fib_free_node(node) \
+	kfree_type(struct rt_fib_node, uintptr_t, (node)->rfn_count, node)
+#define rt_fib_alloc_root(bits) \
+	kalloc_type(struct rt_fib_root, uintptr_t, 1u << (bits), \
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL)
+#define rt_fib_free_root(root) \
+	kfree_type(struct rt_fib_root, uintptr_t, 1u << (root)->rfr_bits, root)
+
+#define RT_FIB_LOAD(p)          os_atomic_load(p, dependency)
+#define RT_FIB_STORE(p, v)      os_atomic_store(p, v, release)
+
+#else
+/* Userland equivalents so that tests can exercise the table. */
+
+#include <sys/param.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "rt_fib.h"
+
+static __inline void *
+rt_fib_calloc(size_t count, size_t size)
+{
+	void *result = calloc(count, size);
+
+	if (result == NULL) {
+		abort();
+	}
+	return result;
+}
+#define rt_fib_alloc_type(type) ((type *)rt_fib_calloc(1, sizeof(type)))
+#define rt_fib_free_type(type, ptr)     free(ptr)
+#define rt_fib_alloc_array(type, count) \
+	((type *)rt_fib_calloc(count, sizeof(type)))
+#define rt_fib_free_array(type, count, ptr) free(ptr)
+#define rt_fib_alloc_node(count) \
+	((struct rt_fib_node *)rt_fib_calloc(1, \
+	sizeof(struct rt_fib_node) + (count) * sizeof(uintptr_t)))
+#define rt_fib_free_node(node)          free(node)
+#define rt_fib_alloc_root(bits) \
+	((struct rt_fib_root *)rt_fib_calloc(1, \
+	sizeof(struct rt_fib_root) + (1u << (bits)) * sizeof(uintptr_t)))
+#define rt_fib_free_root(root)          free(root)
+
+#define RT_FIB_LOAD(p)          (*(p))
+#define RT_FIB_STORE(p, v)      (*(p) = (v))
+#endif /* KERNEL */
+
+#define RT_FIB_STRIDE           6
+#define RT_FIB_NODE_SLOTS       (1u << RT_FIB_STRIDE)
+#define RT_FIB_NODE             ((uintptr_t)1)  /* slot points to a node */
+
+#define RT_FIB_HASH_MIN_BITS    6
+#define RT_FIB_HASH_MAX_BITS    24
+
+struct rt_fib_prefix {
+#ifdef KERNEL
+	struct smr_node         rfp_smr;
+#endif
+	struct rt_fib_prefix    *rfp_next;      /* hash chain */
+	void                    *rfp_value;
+	uint32_t                rfp_addr;
+	uint8_t                 rfp_plen;
+};
+
+struct rt_fib_node {
+#ifdef KERNEL
+	struct smr_node         rfn_smr;
+#endif
+	struct rt_fib_node      *rfn_retired;   /* replaced by the same update */
+	uint64_t                rfn_nodevec;    /* slots holding a child */
+	uint64_t                rfn_leafvec;    /* leaf slots starting a run */
+	uint8_t                 rfn_nnodes;
+	uint8_t                 rfn_count;      /* children and leaf runs */
+	uintptr_t               rfn_ptr[];
+};
+
+struct rt_fib_root {
+#ifdef KERNEL
+	struct smr_node         rfr_smr;
+#endif
+	uint32_t                rfr_bits;
+	uintptr_t               rfr_slots[];
+};
+
+struct rt_fib {
+	struct rt_fib_root      *fib_root;
+	uint32_t                fib_count;      /* prefixes */
+	uint32_t                fib_nodes;
+	size_t                  fib_node_bytes;
+	uint32_t                fib_hash_bits;
+	struct rt_fib_prefix    **fib_hash;     /* by (address, length) */
+};
+
+/*
+ * Replace the leaves of prefix fu_addr/fu_plen: when inserting (fu_old is
+ * NULL) every leaf shorter than fu_new, when removing every fu_old leaf.
+ * Nodes rebuilt along the way are collected on fu_retired.
+ */
+struct rt_fib_update {
+	struct rt_fib_prefix    *fu_old;
+	struct rt_fib_prefix    *fu_new;
+	struct rt_fib_node      *fu_retired;
+	uint32_t                fu_addr;
+	uint8_t                 fu_plen;
+};
+
+#ifdef KERNEL
+static void
+rt_fib_prefix_free_smr(smr_node_t smr)
+{
+	struct rt_fib_prefix *p;
+
+	p = __container_of(smr, struct rt_fib_prefix, rfp_smr);
+	rt_fib_free_type(struct rt_fib_prefix, p);
+}
+
+static void
+rt_fib_node_free_smr(smr_node_t smr)
+{
+	struct rt_fib_node *node;
+
+	node = __container_of(smr, struct rt_fib_node, rfn_smr);
+	rt_fib_free_node(node);
+}
+
+static void
+rt_fib_root_free_smr(smr_node_t smr)
+{
+	struct rt_fib_root *root;
+
+	root = __container_of(smr, struct rt_fib_root, rfr_smr);
+	rt_fib_free_root(root);
+}
+
+#define rt_fib_prefix_retire(p) \
+	smr_net_call(&(p)->rfp_smr, sizeof(*(p)), rt_fib_prefix_free_smr)
+#define rt_fib_node_retire(node) \
+	smr_net_call(&(node)->rfn_smr, sizeof(*(node)) + \
+	    (node)->rfn_count * sizeof(uintptr_t), rt_fib_node_free_smr)
+#define rt_fib_root_retire(root) \
+	smr_net_call(&(root)->rfr_smr, sizeof(*(root)) + \
+	    (sizeof(uintptr_t) << (root)->rfr_bits), rt_fib_root_free_smr)
+#else
+#define rt_fib_prefix_retire(p) \
+	rt_fib_free_type(struct rt_fib_prefix, p)
+#define rt_fib_node_retire(node)        rt_fib_free_node(node)
+#define rt_fib_root_retire(root)        rt_fib_free_root(root)
+#endif /* KERNEL */
+
+static inline uint32_t
+rt_fib_mask(uint8_t plen)
+{
+	return plen == 0 ? 0 : ~0u << (32 - plen);
+}
+
+/* Bits resolved by a node whose parent slot resolves the first done bits */
+static inline uint32_t
+rt_fib_stride(uint32_t done)
+{
+	return MIN(RT_FIB_STRIDE, 32 - done);
+}
+
+static inline struct rt_fib_node *
+rt_fib_slot_node(uintptr_t slot)
+{
+	return (struct rt_fib_node *)(slot & ~RT_FIB_NODE);
+}
+
+/* The slot of a node at index idx */
+static inline uintptr_t
+rt_fib_node_slot(const struct rt_fib_node *node, uint32_t idx)
+{
+	uint64_t bit = 1ULL << idx;
+
+	if (node->rfn_nodevec & bit) {
+		return RT_FIB_LOAD(&node->rfn_ptr[
+			   __builtin_popcountll(node->rfn_nodevec & (bit - 1))]);
+	}
+	return RT_FIB_LOAD(&node->rfn_ptr[node->rfn_nnodes +
+	           __builtin_popcountll(node->rfn_leafvec & ((bit << 1) - 1)) - 1]);
+}
+
+static inline int
+rt_fib_leaf_plen(uintptr_t slot)
+{
+	return slot == 0 ? -1 : ((struct rt_fib_prefix *)slot)->rfp_plen;
+}
+
+static struct rt_fib_prefix **
+rt_fib_hash_head(const struct rt_fib *fib, uint32_t addr, uint8_t plen)
+{
+	uint64_t key = ((uint64_t)plen << 32) | addr;
+
+	return &fib->fib_hash[(key * 0x9e3779b97f4a7c15ULL) >>
+	           (64 - fib->fib_hash_bits)];
+}
+
+static struct rt_fib_prefix *
+rt_fib_hash_find(const struct rt_fib *fib, uint32_t addr, uint8_t plen)
+{
+	struct rt_fib_prefix *p;
+
+	for (p = *rt_fib_hash_head(fib, addr, plen); p != NULL; p = p->rfp_next) {
+		if (p->rfp_addr == addr && p->rfp_plen == plen) {
+			break;
+		}
+	}
+	return p;
+}
+
+static void
+rt_fib_hash_grow(struct rt_fib *fib)
+{
+	struct rt_fib_prefix **old = fib->fib_hash, *p, **head;
+	uint32_t i, osize = 1u << fib->fib_hash_bits;
+
+	fib->fib_hash_bits++;
+	fib->fib_hash = rt_fib_alloc_array(struct rt_fib_prefix *,
+	    1u << fib->fib_hash_bits);
+	for (i = 0; i < osize; i++) {
+		while ((p = old[i]) != NULL) {
+			old[i] = p->rfp_next;
+			head = rt_fib_hash_head(fib, p->rfp_addr, p->rfp_plen);
+			p->rfp_next = *head;
+			*head = p;
+		}
+	}
+	rt_fib_free_array(struct rt_fib_prefix *, osize, old);
+}
+
+static void
+rt_fib_node_expand(const struct rt_fib_node *node, uintptr_t *slots,
+    uint32_t nslots)
+{
+	uint32_t i, child = 0, leaf = node->rfn_nnodes;
+
+	for (i = 0; i < nslots; i++) {
+		uint64_t bit = 1ULL << i;
+
+		if (node->rfn_nodevec & bit) {
+			slots[i] = node->rfn_ptr[child++];
+		} else {
+			if (node->rfn_leafvec & bit) {
+				leaf++;
+			}
+			slots[i] = node->rfn_ptr[leaf - 1];
+		}
+	}
+}
+
+/*
+ * Compress a node out of its slots, or return the leaf they all hold.
+ */
+static uintptr_t
+rt_fib_node_build(struct rt_fib *fib, const uintptr_t *slots, uint32_t nslots)
+{
+	struct rt_fib_node *node;
+	uint64_t nodevec = 0, leafvec = 0;
+	uintptr_t last = 0;
+	uint32_t i, nnodes = 0, nleaves = 0, child = 0, leaf;
+	bool first = true;
+
+	for (i = 0; i < nslots; i++) {
+		if (slots[i] & RT_FIB_NODE) {
+			nodevec |= 1ULL << i;
+			nnodes++;
+		} else if (first || slots[i] != last) {
+			leafvec |= 1ULL << i;
+			nleaves++;
+			last = slots[i];
+			first = false;
+		}
+	}
+	if (nnodes == 0 && nleaves == 1) {
+		return slots[0];
+	}
+
+	node = rt_fib_alloc_node(nnodes + nleaves);
+	node->rfn_nodevec = nodevec;
+	node->rfn_leafvec = leafvec;
+	node->rfn_nnodes = (uint8_t)nnodes;
+	node->rfn_count = (uint8_t)(nnodes + nleaves);
+	leaf = nnodes;
+	for (i = 0; i < nslots; i++) {
+		if (nodevec & (1ULL << i)) {
+			node->rfn_ptr[child++] = slots[i];
+		} else if (leafvec & (1ULL << i)) {
+			node->rfn_ptr[leaf++] = slots[i];
+		}
+	}
+	fib->fib_nodes++;
+	fib->fib_node_bytes += sizeof(*node) + node->rfn_count * sizeof(uintptr_t);
+	return (uintptr_t)node | RT_FIB_NODE;
+}
+
+static void
+rt_fib_node_replaced(struct rt_fib *fib, struct rt_fib_update *fu,
+    uintptr_t slot)
+{
+	struct rt_fib_node *node = rt_fib_slot_node(slot);
+
+	fib->fib_nodes--;
+	fib->fib_node_bytes -= sizeof(*node) + node->rfn_count * sizeof(uintptr_t);
+	node->rfn_retired = fu->fu_retired;
+	fu->fu_retired = node;
+}
+
+/*
+ * New contents of a slot resolving the first done bits of the address,
+ * whose whole range lies within the prefix being updated.
+ */
+static uintptr_t
+rt_fib_update_slot(struct rt_fib *fib, struct rt_fib_update *fu,
+    uintptr_t slot, uint32_t done)
+{
+	uintptr_t slots[RT_FIB_NODE_SLOTS], s;
+	uint32_t i, stride;
+	bool changed = false;
+
+	if (!(slot & RT_FIB_NODE)) {
+		if (fu->fu_old == NULL ?
+		    rt_fib_leaf_plen(slot) < fu->fu_new->rfp_plen :
+		    slot == (uintptr_t)fu->fu_old) {
+			return (uintptr_t)fu->fu_new;
+		}
+		return slot;
+	}
+
+	stride = rt_fib_stride(done);
+	rt_fib_node_expand(rt_fib_slot_node(slot), slots, 1u << stride);
+	for (i = 0; i < (1u << stride); i++) {
+		s = rt_fib_update_slot(fib, fu, slots[i], done + stride);
+		if (s != slots[i]) {
+			slots[i] = s;
+			changed = true;
+		}
+	}
+	if (!changed) {
+		return slot;
+	}
+	rt_fib_node_replaced(fib, fu, slot);
+	return rt_fib_node_build(fib, slots, 1u << stride);
+}
+
+/*
+ * New contents of a slot resolving the first done bits of the address,
+ * inside of which the prefix being updated lies.
+ */
+static uintptr_t
+rt_fib_update_path(struct rt_fib *fib, struct rt_fib_update *fu,
+    uintptr_t slot, uint32_t done)
+{
+	uintptr_t slots[RT_FIB_NODE_SLOTS], s;
+	uint32_t i, idx, n, stride = rt_fib_stride(done);
+	bool changed = false;
+
+	if (slot & RT_FIB_NODE) {
+		rt_fib_node_expand(rt_fib_slot_node(slot), slots, 1u << stride);
+	} else if (fu->fu_old != NULL) {
+		/* a leaf here means the prefix being removed isn't below */
+		return slot;
+	} else {
+		for (i = 0; i < (1u << stride); i++) {
+			slots[i] = slot;
+		}
+	}
+
+	idx = (fu->fu_addr >> (32 - done - stride)) & ((1u << stride) - 1);
+	if (fu->fu_plen <= done + stride) {
+		n = 1u << (done + stride - fu->fu_plen);
+		for (i = idx; i < idx + n; i++) {
+			s = rt_fib_update_slot(fib, fu, slots[i], done + stride);
+			if (s != slots[i]) {
+				slots[i] = s;
+				changed = true;
+			}
+		}
+	} else {
+		s = rt_fib_update_path(fib, fu, slots[idx], done + stride);
+		if (s != slots[idx]) {
+			slots[idx] = s;
+			changed = true;
+		}
+	}
+	if (!changed) {
+		return slot;
+	}
+	if (slot & RT_FIB_NODE) {
+		rt_fib_node_replaced(fib, fu, slot);
+	}
+	return rt_fib_node_build(fib, slots, 1u << stride);
+}
+
+static void
+rt_fib_retire_nodes(struct rt_fib_update *fu)
+{
+	struct rt_fib_node *node;
+
+	while ((node = fu->fu_retired) != NULL) {
+		fu->fu_retired = node->rfn_retired;
+		rt_fib_node_retire(node);
+	}
+}
+
+static void
+rt_fib_update(struct rt_fib *fib, struct rt_fib_update *fu)
+{
+	struct rt_fib_root *root = fib->fib_root;
+	uint32_t bits = root->rfr_bits;
+	uint32_t idx = fu->fu_addr >> (32 - bits), i, n;
+	uintptr_t s;
+
+	fu->fu_retired = NULL;
+	if (fu->fu_plen <= bits) {
+		n = 1u << (bits - fu->fu_plen);
+		for (i = idx; i < idx + n; i++) {
+			s = rt_fib_update_slot(fib, fu, root->rfr_slots[i], bits);
+			if (s != root->rfr_slots[i]) {
+				RT_FIB_STORE(&root->rfr_slots[i], s);
+			}
+		}
+	} else {
+		s = rt_fib_update_path(fib, fu, root->rfr_slots[idx], bits);
+		if (s != root->rfr_slots[idx]) {
+			RT_FIB_STORE(&root->rfr_slots[idx], s);
+		}
+	}
+
+	/* only now is nothing new able to reach them */
+	rt_fib_retire_nodes(fu);
+}
+
+/*
+ * Spread a slot over the 1 << grow slots of a root grown by grow bits
+ * that cover the same addresses.  grow is a whole number of strides, so
+ * the nodes found that deep still resolve the bits they did; the nodes
+ * above them are taken apart, and collected on fu_retired.
+ */
+static void
+rt_fib_root_spread(struct rt_fib *fib, struct rt_fib_update *fu,
+    uintptr_t slot, uint32_t grow, uintptr_t *out)
+{
+	uintptr_t slots[RT_FIB_NODE_SLOTS];
+	uint32_t i, n;
+
+	if (grow == 0) {
+		out[0] = slot;
+		return;
+	}
+	if (!(slot & RT_FIB_NODE)) {
+		for (i = 0; i < (1u << grow); i++) {
+			out[i] = slot;
+		}
+		return;
+	}
+	rt_fib_node_expand(rt_fib_slot_node(slot), slots, RT_FIB_NODE_SLOTS);
+	rt_fib_node_replaced(fib, fu, slot);
+	n = 1u << (grow - RT_FIB_STRIDE);
+	for (i = 0; i < RT_FIB_NODE_SLOTS; i++) {
+		rt_fib_root_spread(fib, fu, slots[i], grow - RT_FIB_STRIDE,
+		    &out[i * n]);
+	}
+}
+
+static int
+rt_fib_root_bits_valid(unsigned int root_bits)
+{
+	return root_bits >= RT_FIB_STRIDE && root_bits <= 24;
+}
+
+struct rt_fib *
+rt_fib_create(unsigned int root_bits)
+{
+	struct rt_fib *fib;
+
+	if (!rt_fib_root_bits_valid(root_bits)) {
+		return NULL;
+	}
+	fib = rt_fib_alloc_type(struct rt_fib);
+	fib->fib_root = rt_fib_alloc_root(root_bits);
+	fib->fib_root->rfr_bits = root_bits;
+	fib->fib_hash_bits = RT_FIB_HASH_MIN_BITS;
+	fib->fib_hash = rt_fib_alloc_array(struct rt_fib_prefix *,
+	    1u << fib->fib_hash_bits);
+	return fib;
+}
+
+static void
+rt_fib_destroy_node(struct rt_fib_node *node)
+{
+	uint32_t i;
+
+	for (i = 0; i < node->rfn_nnodes; i++) {
+		rt_fib_destroy_node(rt_fib_slot_node(node->rfn_ptr[i]));
+	}
+	rt_fib_free_node(node);
+}
+
+/*
+ * Free the table right away; there must be no lookups left running.
+ * The values aren't touched.
+ */
+void
+rt_fib_destroy(struct rt_fib *fib)
+{
+	struct rt_fib_root *root = fib->fib_root;
+	struct rt_fib_prefix *p;
+	uint32_t i;
+
+	for (i = 0; i < (1u << root->rfr_bits); i++) {
+		if (root->rfr_slots[i] & RT_FIB_NODE) {
+			rt_fib_destroy_node(rt_fib_slot_node(root->rfr_slots[i]));
+		}
+	}
+	for (i = 0; i < (1u << fib->fib_hash_bits); i++) {
+		while ((p = fib->fib_hash[i]) != NULL) {
+			fib->fib_hash[i] = p->rfp_next;
+			rt_fib_free_type(struct rt_fib_prefix, p);
+		}
+	}
+	rt_fib_free_array(struct rt_fib_prefix *, 1u << fib->fib_hash_bits,
+	    fib->fib_hash);
+	rt_fib_free_root(root);
+	rt_fib_free_type(struct rt_fib, fib);
+}
+
+/*
+ * Switch to a wider root of root_bits.  Lookups may run meanwhile: they
+ * find the same values through either root.  The root only grows by
+ * whole strides, so that the nodes below keep their place in the trie.
+ */
+int
+rt_fib_grow(struct rt_fib *fib, unsigned int root_bits)
+{
+	struct rt_fib_root *old = fib->fib_root, *root;
+	struct rt_fib_update fu = { };
+	uint32_t i, grow;
+
+	if (!rt_fib_root_bits_valid(root_bits) || root_bits <= old->rfr_bits ||
+	    (root_bits - old->rfr_bits) % RT_FIB_STRIDE != 0) {
+		return EINVAL;
+	}
+	grow = root_bits - old->rfr_bits;
+	root = rt_fib_alloc_root(root_bits);
+	root->rfr_bits = root_bits;
+	for (i = 0; i < (1u << old->rfr_bits); i++) {
+		rt_fib_root_spread(fib, &fu, old->rfr_slots[i], grow,
+		    &root->rfr_slots[i << grow]);
+	}
+	RT_FIB_STORE(&fib->fib_root, root);
+
+	rt_fib_retire_nodes(&fu);
+	rt_fib_root_retire(old);
+	return 0;
+}
+
+int
+rt_fib_insert(struct rt_fib *fib, uint32_t addr, uint8_t plen, void *value)
+{
+	struct rt_fib_update fu;
+	struct rt_fib_prefix *p, **head;
+
+	if (plen > 32 || value == NULL) {
+		return EINVAL;
+	}
+	addr &= rt_fib_mask(plen);
+	if (rt_fib_hash_find(fib, addr, plen) != NULL) {
+		return EEXIST;
+	}
+	if (fib->fib_count >= (1u << fib->fib_hash_bits) &&
+	    fib->fib_hash_bits < RT_FIB_HASH_MAX_BITS) {
+		rt_fib_hash_grow(fib);
+	}
+
+	p = rt_fib_alloc_type(struct rt_fib_prefix);
+	p->rfp_value = value;
+	p->rfp_addr = addr;
+	p->rfp_plen = plen;
+	head = rt_fib_hash_head(fib, addr, plen);
+	p->rfp_next = *head;
+	*head = p;
+	fib->fib_count++;
+
+	fu.fu_old = NULL;
+	fu.fu_new = p;
+	fu.fu_addr = addr;
+	fu.fu_plen = plen;
+	rt_fib_update(fib, &fu);
+	return 0;
+}
+
+/*
+ * Remove a prefix, returning its value, or NULL if it wasn't there.
+ */
+void *
+rt_fib_remove(struct rt_fib *fib, uint32_t addr, uint8_t plen)
+{
+	struct rt_fib_update fu;
+	struct rt_fib_prefix *p, *q = NULL, **pp;
+	void *value;
+	uint8_t len;
+
+	if (plen > 32) {
+		return NULL;
+	}
+	addr &= rt_fib_mask(plen);
+	for (pp = rt_fib_hash_head(fib, addr, plen); (p = *pp) != NULL;
+	    pp = &p->rfp_next) {
+		if (p->rfp_addr == addr && p->rfp_plen == plen) {
+			break;
+		}
+	}
+	if (p == NULL) {
+		return NULL;
+	}
+	*pp = p->rfp_next;
+	fib->fib_count--;
+
+	/* the prefix that takes over its address range */
+	for (len = plen; len-- > 0 && q == NULL;) {
+		q = rt_fib_hash_find(fib, addr & rt_fib_mask(len), len);
+	}
+
+	fu.fu_old = p;
+	fu.fu_new = q;
+	fu.fu_addr = addr;
+	fu.fu_plen = plen;
+	rt_fib_update(fib, &fu);
+
+	value = p->rfp_value;
+	rt_fib_prefix_retire(p);
+	return value;
+}
+
+void *
+rt_fib_lookup(const struct rt_fib *fib, uint32_t addr)
+{
+	const struct rt_fib_root *root = RT_FIB_LOAD(&fib->fib_root);
+	uint32_t done = root->rfr_bits, stride;
+	uintptr_t s;
+
+	s = RT_FIB_LOAD(&root->rfr_slots[addr >> (32 - done)]);
+	while (s & RT_FIB_NODE) {
+		stride = rt_fib_stride(done);
+		done += stride;
+		s = rt_fib_node_slot(rt_fib_slot_node(s),
+		    (addr >> (32 - done)) & ((1u << stride) - 1));
+	}
+	return s != 0 ? ((struct rt_fib_prefix *)s)->rfp_value : NULL;
+}
+
+uint32_t
+rt_fib_count(const struct rt_fib *fib)
+{
+	return fib->fib_count;
+}
+
+unsigned int
+rt_fib_root_bits(const struct rt_fib *fib)
+{
+	return fib->fib_root->rfr_bits;
+}
+
+/* Bytes of memory held by the table */
+size_t
+rt_fib_size(const struct rt_fib *fib)
+{
+	return sizeof(*fib) + fib->fib_node_bytes + sizeof(*fib->fib_root) +
+	       ((size_t)1 << fib->fib_root->rfr_bits) * sizeof(uintptr_t) +
+	       ((size_t)1 << fib->fib_hash_bits) * sizeof(struct rt_fib_prefix *) +
+	       (size_t)fib->fib_count * sizeof(struct rt_fib_prefix);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#ifndef _NET_RT_FIB_H_
+#define _NET_RT_FIB_H_
+
+#include <sys/types.h>
+
+/*
+ * IPv4 longest prefix match table: a root array indexed by the top
+ * root_bits of the address, then popcount-compressed 64-way nodes, so
+ * that a lookup is at most 1 + (37 - root_bits) / 6 dependent loads.
+ * An 18-bit root resolves most of a full Internet table in two, but
+ * takes 2 MB: a table may start with a narrower root and rt_fib_grow()
+ * it once it gets large.
+ *
+ * Updates are serialized by the caller.  Lookups take no lock; in the
+ * kernel they must run inside an smr_net critical section, and the
+ * values they return stay valid only as long as the caller keeps them
+ * alive for a grace period after rt_fib_remove().  Addresses are in host
+ * byte order.
+ */
+struct rt_fib;
+
+extern struct rt_fib *rt_fib_create(unsigned int root_bits);
+extern void rt_fib_destroy(struct rt_fib *fib);
+extern int rt_fib_grow(struct rt_fib *fib, unsigned int root_bits);
+extern int rt_fib_insert(struct rt_fib *fib, uint32_t addr, uint8_t plen,
+    void *value);
+extern void *rt_fib_remove(struct rt_fib *fib, uint32_t addr, uint8_t plen);
+extern void *rt_fib_lookup(const struct rt_fib *fib, uint32_t addr);
+extern uint32_t rt_fib_count(const struct rt_fib *fib);
+extern unsigned int rt_fib_root_bits(const struct rt_fib *fib);
+extern size_t rt_fib_size(const struct rt_fib *fib);
+
+#endif /* _NET_RT_FIB_H_ */
@@ -366,6 +366,39 @@ post_initial_offset:
 }
 
 #else /* __LP64__ */
+
+#if defined(__x86_64__)
+#ifndef KERNEL
+#include <machine/cpu_capabilities.h>
+#endif /* !KERNEL */
+
+/*
+ * Vector routines from cpu_in_cksum.s, summing the 32-bit words of a
+ * multiple of 64 bytes into a value of at most 33 bits.
+ */
+extern uint64_t os_cpu_in_cksum_sse2(const void *, uint64_t);
+#ifndef KERNEL
+extern uint64_t os_cpu_in_cksum_avx2(const void *, uint64_t);
+#endif /* !KERNEL */
+
+/*
+ * Below this, the unrolled loop is as fast as the vector routines
+ * (which in the kernel have to preserve the SSE registers).
+ */
+#define CKSUM_VECTOR_MIN        256
+
+static inline uint64_t
+os_cpu_in_cksum_vector(const void *data, uint64_t len)
+{
+#ifndef KERNEL
+	if (_get_cpu_capabilities() & kHasAVX2_0) {
+		return os_cpu_in_cksum_avx2(data, len);
+	}
+#endif /* !KERNEL */
+	return os_cpu_in_cksum_sse2(data, len);
+}
+#endif /* __x86_64__ */
+
 /* 64-bit version */
 uint32_t
 os_cpu_in_cksum_mbuf(struct _mbuf *m, int len, int off, uint32_t initial_sum)
@@ -438,6 +471,16 @@ post_initial_offset:
 			data += 2;
 			mlen -= 2;
 		}
+#if defined(__x86_64__)
+		if (mlen >= CKSUM_VECTOR_MIN) {
+			int vlen = mlen & ~63;
+
+			/* partial is at most 17-bit here, this can't carry */
+			partial += os_cpu_in_cksum_vector(data, vlen);
+			data += vlen;
+			mlen -= vlen;
+		}
+#endif /* __x86_64__ */
 		while (mlen >= 64) {
 			__builtin_prefetch(data + 32);
 			__builtin_prefetch(data + 64);
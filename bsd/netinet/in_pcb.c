@@ -86,6 +86,8 @@
 
 #include <machine/limits.h>
 
+#include <kern/counter.h>
+#include <kern/smr_hash.h>
 #include <kern/zalloc.h>
 
 #include <net/if.h>
@@ -153,6 +155,7 @@ static void inpcb_sched_timeout(void);
 static void inpcb_sched_lazy_timeout(void);
 static void _inpcb_sched_timeout(unsigned int);
 static void inpcb_timeout(void *, void *);
+static boolean_t _inp_restricted_recv(struct inpcb *, struct ifnet *);
 const int inpcb_timeout_lazy = 10;      /* 10 seconds leeway for lazy timers */
 extern int tvtohz(struct timeval *);
 
@@ -256,6 +259,25 @@ SYSCTL_PROC(_net_inet_ip_portrange, OID_AUTO, hilast,
 SYSCTL_INT(_net_inet_ip_portrange, OID_AUTO, ipport_allow_udp_port_exhaustion,
     CTLFLAG_LOCKED | CTLFLAG_RW, &allow_udp_port_exhaustion, 0, "");
 
+/*
+ * Lock-free lookup of connected pcbs; pcbs keep being published while
+ * this is turned off, so it can be flipped at any time.
+ */
+static int inpcb_smr_lookup = 1;
+SYSCTL_INT(_net_inet_ip, OID_AUTO, pcb_smr_lookup,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &inpcb_smr_lookup, 0,
+    "Look up connected pcbs without taking the pcbinfo lock");
+
+SCALABLE_COUNTER_DEFINE(inpcb_smr_lookup_hits);
+SCALABLE_COUNTER_DEFINE(inpcb_smr_lookup_fallbacks);
+SYSCTL_SCALABLE_COUNTER(_net_inet_ip, pcb_smr_lookup_hits,
+    inpcb_smr_lookup_hits, "pcb lookups satisfied without the pcbinfo lock");
+SYSCTL_SCALABLE_COUNTER(_net_inet_ip, pcb_smr_lookup_fallbacks,
+    inpcb_smr_lookup_fallbacks, "pcb lookups that fell back to the pcbinfo lock");
+SCALABLE_COUNTER_DEFINE(inpcb_smr_republish_deferred);
+SYSCTL_SCALABLE_COUNTER(_net_inet_ip, pcb_smr_republish_deferred,
+    inpcb_smr_republish_deferred, "rehashed pcbs left out of the lock-free table");
+
 static uint32_t apn_fallbk_debug = 0;
 #define apn_fallbk_log(x)       do { if (apn_fallbk_debug >= 1) log x; } while (0)
 
@@ -2004,6 +2026,9 @@ in_pcbdetach(struct inpcb *inp)
 		inp->inp_keepalive_data = NULL;
 	}
 
+	/* lock-free lookups stop finding it, like the locked ones below */
+	in_pcb_smr_retire(inp);
+
 	/* mark socket state as dead */
 	if (in_pcb_checkstate(inp, WNT_STOPUSING, 1) != WNT_STOPUSING) {
 		panic("%s: so=%p proto=%d couldn't set to STOPUSING",
@@ -2105,6 +2130,15 @@ in_pcbdispose(struct inpcb *inp)
 	/* access ipi in in_pcbremlists */
 	in_pcbremlists(inp);
 
+	/*
+	 * Lock-free lookups that found this pcb before it was retired
+	 * must be done looking at it before it is torn down; the goal
+	 * has usually been reached since in_pcbdetach().
+	 */
+	if (inp->inp_flags2 & INP2_SMRHASH_RETIRED) {
+		smr_wait(&smr_net, inp->inp_smr_seq);
+	}
+
 	if (so != NULL) {
 		if (so->so_proto->pr_flags & PR_PCBLOCK) {
 			sofreelastref(so, 0);
@@ -2559,6 +2593,168 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	return found;
 }
 
+/*
+ * Lock-free lookup of connected IPv4 pcbs.
+ *
+ * A pcbinfo that opts in with in_pcbinfo_smr_lookup_init() additionally
+ * publishes every pcb with a fully specified 4-tuple in ipi_smr_hash,
+ * an SMR protected scalable hash table.  in_pcblookup_hash() consults it
+ * first and only takes ipi_lock when it misses, which is always the case
+ * for wildcard (listening) matches.
+ *
+ * A pcb is retired from the table when it is detached or rehashed, and
+ * in_pcbdispose() waits for the SMR goal recorded at that point before
+ * the pcb memory can be released or recycled, so that lock-free readers
+ * never observe freed memory.  A rehashed pcb is published again once
+ * that goal has passed, as inp_smr_link may not be reused while readers
+ * can still be walking it; until then (typically when a connection is
+ * rehashed twice within one grace period) it is only found through the
+ * locked hash, which pcb_smr_republish_deferred counts.
+ */
+#define INPCB_SMR_KEY(k) \
+	((smrh_key_t){ .smrk_opaque = (k), .smrk_len = sizeof(struct inpcb_smr_key) })
+
+static uint32_t
+in_pcb_smr_obj_hash(const struct smrq_slink *link, uint32_t seed)
+{
+	const struct inpcb *inp;
+
+	inp = __container_of(link, const struct inpcb, inp_smr_link);
+	return smrh_key_hash_mem(INPCB_SMR_KEY(&inp->inp_smr_key), seed);
+}
+
+static bool
+in_pcb_smr_obj_equ(const struct smrq_slink *link, smrh_key_t key)
+{
+	const struct inpcb *inp;
+
+	inp = __container_of(link, const struct inpcb, inp_smr_link);
+	return smrh_key_equ_mem(INPCB_SMR_KEY(&inp->inp_smr_key), key);
+}
+
+static bool
+in_pcb_smr_obj_try_get(void *obj __unused)
+{
+	/*
+	 * Like the locked hash, the table may briefly hold several pcbs
+	 * with the same tuple (e.g. a dead TIME_WAIT pcb and its successor):
+	 * never let an insertion coalesce with an existing entry.
+	 */
+	return false;
+}
+
+SMRH_TRAITS_DEFINE_MEM(inpcb_smr_traits, struct inpcb, inp_smr_link,
+    .domain      = &smr_net,
+    .obj_hash    = in_pcb_smr_obj_hash,
+    .obj_equ     = in_pcb_smr_obj_equ,
+    .obj_try_get = in_pcb_smr_obj_try_get);
+
+void
+in_pcbinfo_smr_lookup_init(struct inpcbinfo *ipi)
+{
+	VERIFY(ipi->ipi_smr_hash == NULL);
+
+	ipi->ipi_smr_hash = kalloc_type(struct smr_shash, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	smr_shash_init(ipi->ipi_smr_hash, SMRSH_BALANCED, ipi->ipi_hashmask + 1);
+}
+
+/*
+ * Publish a connected pcb in ipi_smr_hash.
+ * Must be called with the socket lock and ipi_lock held exclusively.
+ */
+static void
+in_pcb_smr_publish(struct inpcb *inp)
+{
+	struct inpcbinfo *ipi = inp->inp_pcbinfo;
+	struct inpcb_smr_key *key = &inp->inp_smr_key;
+
+	if (ipi->ipi_smr_hash == NULL || (inp->inp_flags2 & INP2_IN_SMRHASH) ||
+	    inp->inp_state == INPCB_STATE_DEAD) {
+		return;
+	}
+	if ((inp->inp_vflag & (INP_IPV4 | INP_IPV6)) != INP_IPV4 ||
+	    inp->inp_faddr.s_addr == INADDR_ANY ||
+	    inp->inp_laddr.s_addr == INADDR_ANY ||
+	    inp->inp_fport == 0 || inp->inp_lport == 0) {
+		return;
+	}
+
+	if (inp->inp_flags2 & INP2_SMRHASH_RETIRED) {
+		/* readers may still be walking inp_smr_link */
+		if (!smr_poll(&smr_net, inp->inp_smr_seq)) {
+			counter_inc(&inpcb_smr_republish_deferred);
+			return;
+		}
+		inp->inp_flags2 &= ~INP2_SMRHASH_RETIRED;
+	}
+
+	key->isk_faddr = inp->inp_faddr;
+	key->isk_laddr = inp->inp_laddr;
+	key->isk_fport = inp->inp_fport;
+	key->isk_lport = inp->inp_lport;
+
+	(void)smr_shash_get_or_insert(ipi->ipi_smr_hash, INPCB_SMR_KEY(key),
+	    &inp->inp_smr_link, &inpcb_smr_traits);
+	inp->inp_flags2 |= INP2_IN_SMRHASH;
+}
+
+/*
+ * Remove a pcb from ipi_smr_hash; lock-free lookups can't find it anymore
+ * once this returns.  Must be called with the socket lock held.
+ */
+void
+in_pcb_smr_retire(struct inpcb *inp)
+{
+	if (!(inp->inp_flags2 & INP2_IN_SMRHASH)) {
+		return;
+	}
+
+	smr_shash_remove(inp->inp_pcbinfo->ipi_smr_hash, &inp->inp_smr_link,
+	    &inpcb_smr_traits);
+	inp->inp_smr_seq = smr_advance(&smr_net);
+	inp->inp_flags2 &= ~INP2_IN_SMRHASH;
+	inp->inp_flags2 |= INP2_SMRHASH_RETIRED;
+}
+
+/*
+ * Look up an exact match in ipi_smr_hash, returning the pcb with a want
+ * reference like in_pcblookup_hash() does, or NULL if the caller must
+ * fall back to the locked lookup.
+ */
+static struct inpcb *
+in_pcblookup_hash_smr(struct inpcbinfo *pcbinfo, struct in_addr faddr,
+    u_short fport, struct in_addr laddr, u_short lport, struct ifnet *ifp)
+{
+	struct inpcb_smr_key key = {
+		.isk_faddr = faddr,
+		.isk_laddr = laddr,
+		.isk_fport = fport,
+		.isk_lport = lport,
+	};
+	struct inpcb *inp;
+
+	smr_net_enter();
+	inp = smr_shash_entered_find(pcbinfo->ipi_smr_hash, INPCB_SMR_KEY(&key),
+	    &inpcb_smr_traits);
+	/*
+	 * Published pcbs always have a foreign address, which NECP never
+	 * filters on receive; only the interface restrictions apply.  If
+	 * they do, let the locked lookup decide what else might match.
+	 */
+	if (inp != NULL && (_inp_restricted_recv(inp, ifp) ||
+	    in_pcb_checkstate(inp, WNT_ACQUIRE, 0) == WNT_STOPUSING)) {
+		inp = NULL;
+	}
+	smr_net_leave();
+
+	if (inp == NULL) {
+		counter_inc(&inpcb_smr_lookup_fallbacks);
+	} else {
+		counter_inc(&inpcb_smr_lookup_hits);
+	}
+	return inp;
+}
+
 /*
  * Lookup PCB in hash list.
  */
@@ -2574,8 +2770,15 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	struct inpcb *local_wild_mapped = NULL;
 
 	/*
-	 * We may have found the pcb in the last lookup - check this first.
+	 * Established flows are usually found without taking ipi_lock.
 	 */
+	if (pcbinfo->ipi_smr_hash != NULL && inpcb_smr_lookup) {
+		inp = in_pcblookup_hash_smr(pcbinfo, faddr, fport, laddr,
+		    lport, ifp);
+		if (inp != NULL) {
+			return inp;
+		}
+	}
 
 	lck_rw_lock_shared(&pcbinfo->ipi_lock);
 
@@ -2796,6 +2999,7 @@ in_pcbinshash(struct inpcb *inp, int locked)
 	LIST_INSERT_HEAD(&phd->phd_pcblist, inp, inp_portlist);
 	LIST_INSERT_HEAD(pcbhash, inp, inp_hash);
 	inp->inp_flags2 |= INP2_INHASHLIST;
+	in_pcb_smr_publish(inp);
 
 	if (!locked) {
 		lck_rw_done(&pcbinfo->ipi_lock);
@@ -2872,10 +3076,13 @@ in_pcbrehash(struct inpcb *inp)
 		LIST_REMOVE(inp, inp_hash);
 		inp->inp_flags2 &= ~INP2_INHASHLIST;
 	}
+	/* the tuple it was published under may no longer be valid */
+	in_pcb_smr_retire(inp);
 
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
 	LIST_INSERT_HEAD(head, inp, inp_hash);
 	inp->inp_flags2 |= INP2_INHASHLIST;
+	in_pcb_smr_publish(inp);
 
 #if NECP
 	// This call catches updates to the remote addresses
@@ -2922,6 +3129,7 @@ in_pcbremlists(struct inpcb *inp)
 #endif /* SKYWALK */
 	}
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
+	in_pcb_smr_retire(inp);
 
 	if (inp->inp_flags2 & INP2_TIMEWAIT) {
 		/* Remove from time-wait queue */
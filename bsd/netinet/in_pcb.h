@@ -79,6 +79,7 @@
 #include <sys/bitstring.h>
 #include <sys/tree.h>
 #include <kern/locks.h>
+#include <kern/smr_types.h>
 #include <kern/zalloc.h>
 #include <netinet/in_stat.h>
 #endif /* BSD_KERNEL_PRIVATE */
@@ -147,6 +148,17 @@ struct inp_necp_attributes {
 	char *inp_domain_context;
 };
 
+/*
+ * Fully specified IPv4 tuple under which a connected pcb is published
+ * in its pcbinfo's lock-free lookup table (see ipi_smr_hash).
+ */
+struct inpcb_smr_key {
+	struct in_addr  isk_faddr;
+	struct in_addr  isk_laddr;
+	u_short         isk_fport;
+	u_short         isk_lport;
+};
+
 /*
  * struct inpcb captures the network layer state for TCP, UDP and raw IPv6
  * and IPv6 sockets.  In the case of TCP, further per-connection state is
@@ -162,6 +174,9 @@ struct inpcb {
 	LIST_ENTRY(inpcb) inp_portlist; /* list for this PCB's local port */
 	RB_ENTRY(inpcb) infc_link;      /* link for flowhash RB tree */
 	struct inpcbport *inp_phd;      /* head of this list */
+	struct smrq_slink inp_smr_link; /* link for ipi_smr_hash */
+	struct inpcb_smr_key inp_smr_key; /* tuple inp_smr_link is hashed on */
+	smr_seq_t inp_smr_seq;          /* SMR goal once retired from it */
 	inp_gen_t inp_gencnt;           /* generation count of this instance */
 	int     inp_hash_element;       /* array index of pcb's hash list */
 	int     inp_wantcnt;            /* wanted count; atomically updated */
@@ -625,6 +640,13 @@ struct inpcbinfo {
 	struct inpcbporthead    *ipi_porthashbase;
 	u_long                  ipi_porthashmask;
 
+	/*
+	 * Optional SMR protected hash of connected IPv4 pcbs, keyed by
+	 * their full 4-tuple, letting lookups of established flows
+	 * bypass ipi_lock (see in_pcbinfo_smr_lookup_init()).
+	 */
+	struct smr_shash        *ipi_smr_hash;
+
 	/*
 	 * Misc.
 	 */
@@ -755,6 +777,8 @@ struct inpcbinfo {
 #define INP2_MANAGEMENT_ALLOWED 0x00010000 /* Allow communication over a management interface */
 #define INP2_MANAGEMENT_CHECKED 0x00020000 /* Checked entitlements for a management interface */
 #define INP2_BIND_IN_PROGRESS   0x00040000 /* A bind call is in proggress */
+#define INP2_IN_SMRHASH         0x00080000 /* pcb is in ipi_smr_hash */
+#define INP2_SMRHASH_RETIRED    0x00100000 /* pcb was removed from ipi_smr_hash */
 
 /*
  * Flags passed to in_pcblookup*() functions.
@@ -825,6 +849,8 @@ extern int in_pcblookup_hash_exists(struct inpcbinfo *, struct in_addr,
 extern void in_pcbnotifyall(struct inpcbinfo *, struct in_addr, int,
     void (*)(struct inpcb *, int));
 extern void in_pcbrehash(struct inpcb *);
+extern void in_pcbinfo_smr_lookup_init(struct inpcbinfo *);
+extern void in_pcb_smr_retire(struct inpcb *);
 extern int in_getpeeraddr(struct socket *, struct sockaddr **);
 extern int in_getsockaddr(struct socket *, struct sockaddr **);
 extern int in_getsockaddr_s(struct socket *, struct sockaddr_in *);
@@ -232,7 +232,7 @@ tcpcb_to_xtcpcb_n(struct tcpcb *tp, struct xtcpcb_n *xt)
 	xt->xt_len = sizeof(struct xtcpcb_n);
 	xt->xt_kind = XSO_TCPCB;
 
-	xt->t_segq = (uint32_t)VM_KERNEL_ADDRPERM(tp->t_segq.lh_first);
+	xt->t_segq = (uint32_t)VM_KERNEL_ADDRPERM(RB_ROOT(&tp->t_segq));
 	xt->t_dupacks = tp->t_dupacks;
 	xt->t_timer[TCPT_REXMT_EXT] = tp->t_timer[TCPT_REXMT];
 	xt->t_timer[TCPT_PERSIST_EXT] = tp->t_timer[TCPT_PERSIST];
@@ -83,6 +83,7 @@
 #include <sys/mcache.h>
 #include <sys/kauth.h>
 #include <kern/cpu_number.h>    /* before tcp_seq.h, for tcp_random18() */
+#include <mach/mach_time.h>
 
 #include <machine/endian.h>
 
@@ -198,6 +199,33 @@ SYSCTL_INT(_net_inet_tcp_reass, OID_AUTO, qlen,
     CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_reass_total_qlen, 0,
     "Total number of TCP segments in reassembly queues");
 
+int64_t tcp_reass_total_mbcnt = 0;
+SYSCTL_QUAD(_net_inet_tcp_reass, OID_AUTO, mem,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_reass_total_mbcnt,
+    "Total mbuf space held by TCP reassembly queues");
+
+static uint64_t tcp_reass_maxmem = 0;
+SYSCTL_QUAD(_net_inet_tcp_reass, OID_AUTO, maxmem,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &tcp_reass_maxmem,
+    "Limit on mbuf space held by all TCP reassembly queues "
+    "(0: a quarter of the cluster pool)");
+
+static uint32_t tcp_reass_conn_maxmem = 0;
+SYSCTL_UINT(_net_inet_tcp_reass, OID_AUTO, conn_maxmem,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &tcp_reass_conn_maxmem, 0,
+    "Limit on mbuf space held by a single TCP reassembly queue "
+    "(0: the receive buffer's mbuf limit)");
+
+static int tcp_reass_memdrops = 0;
+SYSCTL_INT(_net_inet_tcp_reass, OID_AUTO, memdrops,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_reass_memdrops, 0,
+    "Segments dropped because of the global reassembly memory limit");
+
+static int tcp_reass_conn_memdrops = 0;
+SYSCTL_INT(_net_inet_tcp_reass, OID_AUTO, conn_memdrops,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_reass_conn_memdrops, 0,
+    "Segments dropped because of the per-connection reassembly memory limit");
+
 
 SYSCTL_SKMEM_TCP_INT(OID_AUTO, slowlink_wsize, CTLFLAG_RW | CTLFLAG_LOCKED,
     __private_extern__ int, slowlink_wsize, 8192,
@@ -554,103 +582,166 @@ tcp_bwmeas_check(struct tcpcb *tp)
 	}
 }
 
+/*
+ * The reassembly queue holds one entry per contiguous range of
+ * out-of-order data, sorted by sequence number.  Segments filling in
+ * the space between two ranges are merged into them in place, so the
+ * cost of queueing a segment only depends on the number of holes and
+ * not on the number of segments received past rcv_nxt.
+ */
 static int
-tcp_reass(struct tcpcb *tp, struct tcphdr *th, int *tlenp, struct mbuf *m,
-    struct ifnet *ifp, int *dowakeup)
+tcp_reass_cmp(struct tseg_qent *a, struct tseg_qent *b)
 {
-	struct tseg_qent *q;
-	struct tseg_qent *p = NULL;
-	struct tseg_qent *nq;
-	struct tseg_qent *te = NULL;
-	struct inpcb *inp = tp->t_inpcb;
-	struct socket *so = inp->inp_socket;
-	int flags = 0;
-	uint32_t qlimit;
-	boolean_t cell = IFNET_IS_CELLULAR(ifp);
-	boolean_t wifi = (!cell && IFNET_IS_WIFI(ifp));
-	boolean_t wired = (!wifi && IFNET_IS_WIRED(ifp));
-	boolean_t dsack_set = FALSE;
+	if (SEQ_LT(a->tqe_seq, b->tqe_seq)) {
+		return -1;
+	}
+	if (SEQ_GT(a->tqe_seq, b->tqe_seq)) {
+		return 1;
+	}
+	return 0;
+}
 
-	/*
-	 * If the reassembly queue already has entries or if we are going
-	 * to add a new one, then the connection has reached a loss state.
-	 * Reset the stretch-ack algorithm at this point.
-	 */
-	tcp_reset_stretch_ack(tp);
-	tp->t_forced_acks = TCP_FORCED_ACKS_COUNT;
+RB_PROTOTYPE_PREV(tsegqe_tree, tseg_qent, tqe_rb, tcp_reass_cmp);
+RB_GENERATE_PREV(tsegqe_tree, tseg_qent, tqe_rb, tcp_reass_cmp);
 
-#if TRAFFIC_MGT
-	if (tp->acc_iaj > 0) {
-		reset_acc_iaj(tp);
+static uint32_t
+tcp_reass_mbcnt(struct mbuf *m)
+{
+	uint32_t mbcnt = 0;
+
+	for (; m != NULL; m = m->m_next) {
+		mbcnt += _MSIZE;
+		if (m->m_flags & M_EXT) {
+			mbcnt += m->m_ext.ext_size;
+		}
 	}
-#endif /* TRAFFIC_MGT */
+	return mbcnt;
+}
 
-	if (th->th_seq != tp->rcv_nxt) {
-		struct mbuf *tmp = m;
-		while (tmp != NULL) {
-			if (mbuf_class_under_pressure(tmp)) {
-				m_freem(m);
-				tcp_reass_overflows++;
-				tcpstat.tcps_rcvmemdrop++;
-				*tlenp = 0;
-				return 0;
-			}
+static void
+tcp_reass_account(struct tcpcb *tp, int pkts, int mbcnt)
+{
+	tp->t_reassqlen += pkts;
+	tp->t_reassq_mbcnt += mbcnt;
+	OSAddAtomic(pkts, &tcp_reass_total_qlen);
+	os_atomic_add(&tcp_reass_total_mbcnt, (int64_t)mbcnt, relaxed);
+}
 
-			tmp = tmp->m_next;
-		}
+static uint64_t
+tcp_reass_maxmem_limit(void)
+{
+	if (tcp_reass_maxmem != 0) {
+		return tcp_reass_maxmem;
 	}
+	return ((uint64_t)nmbclusters << MCLSHIFT) >> 2;
+}
 
-	/*
-	 * Limit the number of segments in the reassembly queue to prevent
-	 * holding on to too many segments (and thus running out of mbufs).
-	 * Make sure to let the missing segment through which caused this
-	 * queue.  Always keep one global queue entry spare to be able to
-	 * process the missing segment.
-	 */
-	qlimit = min(max(100, so->so_rcv.sb_hiwat >> 10),
-	    (tcp_autorcvbuf_max >> 10));
-	if (th->th_seq != tp->rcv_nxt &&
-	    (tp->t_reassqlen + 1) >= qlimit) {
-		tcp_reass_overflows++;
-		tcpstat.tcps_rcvmemdrop++;
+/*
+ * Release a whole range, which must be on the queue.
+ */
+static void
+tcp_reass_range_free(struct tcpcb *tp, struct tseg_qent *q)
+{
+	RB_REMOVE(tsegqe_tree, &tp->t_segq, q);
+	tcp_reass_account(tp, -(int)q->tqe_pkts, -(int)q->tqe_mbcnt);
+	m_freem_list(q->tqe_m);
+	zfree(tcp_reass_zone, q);
+}
+
+/*
+ * Drop the first trim bytes of a range.  Packets falling entirely
+ * within them are freed; the range keeps its place in the tree since
+ * it still starts before its successor.
+ */
+static void
+tcp_reass_range_trim(struct tcpcb *tp, struct tseg_qent *q, int trim)
+{
+	struct mbuf *m;
+	uint32_t mbcnt;
+
+	VERIFY(trim < q->tqe_len);
+	q->tqe_seq += trim;
+	q->tqe_len -= trim;
+
+	while (trim > 0) {
+		m = q->tqe_m;
+		if (m->m_pkthdr.len > trim) {
+			m_adj(m, trim);
+			break;
+		}
+		trim -= m->m_pkthdr.len;
+		q->tqe_m = m->m_nextpkt;
+		m->m_nextpkt = NULL;
+		mbcnt = tcp_reass_mbcnt(m);
+		q->tqe_pkts--;
+		q->tqe_mbcnt -= mbcnt;
+		tcp_reass_account(tp, -1, -(int)mbcnt);
 		m_freem(m);
-		*tlenp = 0;
-		return 0;
 	}
+}
+
+/*
+ * Queue the out-of-order segment m carrying *lenp bytes from *seqp.
+ *
+ * Data the preceding range already holds is trimmed off the front of
+ * the segment and reported through DSACK.  Ranges the segment covers
+ * completely are released, and a range it partially covers gives up
+ * the overlapping bytes.  The segment is then merged with whichever
+ * neighbours it now touches, so ranges on the queue never overlap nor
+ * abut each other.
+ *
+ * Returns the range the segment ended up in, with *seqp and *lenp
+ * updated for the trimmed segment.  Returns NULL if the segment was a
+ * complete duplicate; it has then been freed and *lenp is unchanged.
+ */
+static struct tseg_qent *
+tcp_reass_enqueue(struct tcpcb *tp, tcp_seq *seqp, int *lenp,
+    uint8_t thflags, struct mbuf *m)
+{
+	struct tseg_qent key;
+	struct tseg_qent *p, *q, *nq, *te;
+	tcp_seq seq = *seqp;
+	int len = *lenp;
+	uint32_t mbcnt;
+	boolean_t dsack_set = FALSE;
 
-	/* Allocate a new queue entry. If we can't, just drop the pkt. XXX */
-	te = zalloc_flags(tcp_reass_zone, Z_WAITOK | Z_NOFAIL);
-	tp->t_reassqlen++;
-	OSIncrementAtomic(&tcp_reass_total_qlen);
+	/* Range lengths are kept as the sum of their packets' lengths */
+	if (m->m_pkthdr.len > len) {
+		m_adj(m, len - m->m_pkthdr.len);
+	}
 
 	/*
-	 * Find a segment which begins after this one does.
+	 * p is the last range starting at or before the segment, q the
+	 * first one starting after it.
 	 */
-	LIST_FOREACH(q, &tp->t_segq, tqe_q) {
-		if (SEQ_GT(q->tqe_th->th_seq, th->th_seq)) {
-			break;
-		}
+	key.tqe_seq = seq;
+	q = RB_NFIND(tsegqe_tree, &tp->t_segq, &key);
+	if (q != NULL && q->tqe_seq == seq) {
 		p = q;
+		q = RB_NEXT(tsegqe_tree, &tp->t_segq, q);
+	} else if (q != NULL) {
+		p = RB_PREV(tsegqe_tree, &tp->t_segq, q);
+	} else {
+		p = RB_MAX(tsegqe_tree, &tp->t_segq);
 	}
 
 	/*
-	 * If there is a preceding segment, it may provide some of
+	 * If there is a preceding range, it may provide some of
 	 * our data already.  If so, drop the data from the incoming
 	 * segment.  If it provides all of our data, drop us.
 	 */
 	if (p != NULL) {
 		int i;
 		/* conversion to int (in i) handles seq wraparound */
-		i = p->tqe_th->th_seq + p->tqe_len - th->th_seq;
+		i = p->tqe_seq + p->tqe_len - seq;
 		if (i > 0) {
 			if (i > 1) {
 				/*
 				 * Note duplicate data sequnce numbers
 				 * to report in DSACK option
 				 */
-				tp->t_dsack_lseq = th->th_seq;
-				tp->t_dsack_rseq = th->th_seq +
-				    min(i, *tlenp);
+				tp->t_dsack_lseq = seq;
+				tp->t_dsack_rseq = seq + min(i, len);
 
 				/*
 				 * Report only the first part of partial/
@@ -658,62 +749,24 @@ tcp_reass(struct tcpcb *tp, struct tcphdr *th, int *tlenp, struct mbuf *m,
 				 */
 				dsack_set = TRUE;
 			}
-			if (i >= *tlenp) {
-				tcpstat.tcps_rcvduppack++;
-				tcpstat.tcps_rcvdupbyte += *tlenp;
-				if (nstat_collect) {
-					nstat_route_rx(inp->inp_route.ro_rt,
-					    1, *tlenp,
-					    NSTAT_RX_FLAG_DUPLICATE);
-					INP_ADD_STAT(inp, cell, wifi, wired,
-					    rxpackets, 1);
-					INP_ADD_STAT(inp, cell, wifi, wired,
-					    rxbytes, *tlenp);
-					tp->t_stat.rxduplicatebytes += *tlenp;
-					inp_set_activity_bitmap(inp);
-				}
+			if (i >= len) {
 				m_freem(m);
-				zfree(tcp_reass_zone, te);
-				te = NULL;
-				tp->t_reassqlen--;
-				OSDecrementAtomic(&tcp_reass_total_qlen);
-				/*
-				 * Try to present any queued data
-				 * at the left window edge to the user.
-				 * This is needed after the 3-WHS
-				 * completes.
-				 */
-				goto present;
+				return NULL;
 			}
 			m_adj(m, i);
-			*tlenp -= i;
-			th->th_seq += i;
+			len -= i;
+			seq += i;
 		}
 	}
-
-	if (th->th_seq != tp->rcv_nxt) {
-		tp->t_rcvoopack++;
-		tcpstat.tcps_rcvoopack++;
-		tcpstat.tcps_rcvoobyte += *tlenp;
-		if (nstat_collect) {
-			tp->t_stat.rxoutoforderbytes += *tlenp;
-		}
-	}
-
-	if (nstat_collect) {
-		nstat_route_rx(inp->inp_route.ro_rt, 1, *tlenp,
-		    NSTAT_RX_FLAG_OUT_OF_ORDER);
-		INP_ADD_STAT(inp, cell, wifi, wired, rxpackets, 1);
-		INP_ADD_STAT(inp, cell, wifi, wired, rxbytes, *tlenp);
-		inp_set_activity_bitmap(inp);
-	}
+	*seqp = seq;
+	*lenp = len;
 
 	/*
-	 * While we overlap succeeding segments trim them or,
+	 * While we overlap succeeding ranges trim them or,
 	 * if they are completely covered, dequeue them.
 	 */
-	while (q) {
-		int i = (th->th_seq + *tlenp) - q->tqe_th->th_seq;
+	while (q != NULL) {
+		int i = (seq + len) - q->tqe_seq;
 		if (i <= 0) {
 			break;
 		}
@@ -726,7 +779,7 @@ tcp_reass(struct tcpcb *tp, struct tcphdr *th, int *tlenp, struct mbuf *m,
 		 */
 		if (i > 1 && !dsack_set) {
 			if (tp->t_dsack_lseq == 0) {
-				tp->t_dsack_lseq = q->tqe_th->th_seq;
+				tp->t_dsack_lseq = q->tqe_seq;
 				tp->t_dsack_rseq =
 				    tp->t_dsack_lseq + min(i, q->tqe_len);
 			} else {
@@ -740,34 +793,201 @@ tcp_reass(struct tcpcb *tp, struct tcphdr *th, int *tlenp, struct mbuf *m,
 			}
 		}
 		if (i < q->tqe_len) {
-			q->tqe_th->th_seq += i;
-			q->tqe_len -= i;
-			m_adj(q->tqe_m, i);
+			tcp_reass_range_trim(tp, q, i);
 			break;
 		}
 
-		nq = LIST_NEXT(q, tqe_q);
-		LIST_REMOVE(q, tqe_q);
-		tp->t_reassq_mbcnt -= _MSIZE + (q->tqe_m->m_flags & M_EXT) ?
-		    q->tqe_m->m_ext.ext_size : 0;
-		m_freem(q->tqe_m);
-		zfree(tcp_reass_zone, q);
-		tp->t_reassqlen--;
-		OSDecrementAtomic(&tcp_reass_total_qlen);
+		/* A covered FIN still comes after our data */
+		if (i == q->tqe_len) {
+			thflags |= (q->tqe_flags & TH_FIN);
+		}
+		nq = RB_NEXT(tsegqe_tree, &tp->t_segq, q);
+		tcp_reass_range_free(tp, q);
 		q = nq;
 	}
 
-	/* Insert the new segment queue entry into place. */
-	te->tqe_m = m;
-	te->tqe_th = th;
-	te->tqe_len = *tlenp;
+	mbcnt = tcp_reass_mbcnt(m);
+	tcp_reass_account(tp, 1, (int)mbcnt);
+	thflags &= (TH_PUSH | TH_FIN);
+
+	if (p != NULL && p->tqe_seq + p->tqe_len == seq) {
+		/* Extend the preceding range */
+		te = p;
+		te->tqe_mtail->m_nextpkt = m;
+		te->tqe_mtail = m;
+		te->tqe_len += len;
+		te->tqe_pkts++;
+		te->tqe_mbcnt += mbcnt;
+		te->tqe_flags = (te->tqe_flags & TH_FIN) | thflags;
+
+		/* ... possibly closing the hole up to the next one */
+		if (q != NULL && seq + len == q->tqe_seq) {
+			RB_REMOVE(tsegqe_tree, &tp->t_segq, q);
+			te->tqe_mtail->m_nextpkt = q->tqe_m;
+			te->tqe_mtail = q->tqe_mtail;
+			te->tqe_len += q->tqe_len;
+			te->tqe_pkts += q->tqe_pkts;
+			te->tqe_mbcnt += q->tqe_mbcnt;
+			te->tqe_flags = (te->tqe_flags & TH_FIN) | q->tqe_flags;
+			zfree(tcp_reass_zone, q);
+		}
+	} else if (q != NULL && seq + len == q->tqe_seq) {
+		/* Prepend to the next range, which stays in place */
+		te = q;
+		m->m_nextpkt = te->tqe_m;
+		te->tqe_m = m;
+		te->tqe_seq = seq;
+		te->tqe_len += len;
+		te->tqe_pkts++;
+		te->tqe_mbcnt += mbcnt;
+		te->tqe_flags |= (thflags & TH_FIN);
+	} else {
+		te = zalloc_flags(tcp_reass_zone, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+		te->tqe_m = m;
+		te->tqe_mtail = m;
+		te->tqe_seq = seq;
+		te->tqe_len = len;
+		te->tqe_pkts = 1;
+		te->tqe_mbcnt = mbcnt;
+		te->tqe_flags = thflags;
+		RB_INSERT(tsegqe_tree, &tp->t_segq, te);
+	}
+	return te;
+}
 
-	tp->t_reassq_mbcnt += _MSIZE + (m->m_flags & M_EXT) ? m->m_ext.ext_size : 0;
+/*
+ * Remove and return the range starting at rcv_nxt, if there is one.
+ * The caller owns its packets and must free the entry.
+ */
+static struct tseg_qent *
+tcp_reass_dequeue(struct tcpcb *tp)
+{
+	struct tseg_qent *q;
 
-	if (p == NULL) {
-		LIST_INSERT_HEAD(&tp->t_segq, te, tqe_q);
-	} else {
-		LIST_INSERT_AFTER(p, te, tqe_q);
+	q = RB_MIN(tsegqe_tree, &tp->t_segq);
+	if (q == NULL || q->tqe_seq != tp->rcv_nxt) {
+		return NULL;
+	}
+	RB_REMOVE(tsegqe_tree, &tp->t_segq, q);
+	tcp_reass_account(tp, -(int)q->tqe_pkts, -(int)q->tqe_mbcnt);
+	return q;
+}
+
+int
+tcp_reass_flush(struct tcpcb *tp)
+{
+	struct tseg_qent *q;
+	int rv = 0;
+
+	while ((q = RB_MIN(tsegqe_tree, &tp->t_segq)) != NULL) {
+		tcp_reass_range_free(tp, q);
+		rv = 1;
+	}
+	VERIFY(tp->t_reassqlen == 0 && tp->t_reassq_mbcnt == 0);
+	return rv;
+}
+
+static int
+tcp_reass(struct tcpcb *tp, struct tcphdr *th, int *tlenp, struct mbuf *m,
+    struct ifnet *ifp, int *dowakeup)
+{
+	struct tseg_qent *q;
+	struct inpcb *inp = tp->t_inpcb;
+	struct socket *so = inp->inp_socket;
+	struct mbuf *n;
+	tcp_seq seq = th->th_seq;
+	int flags = 0;
+	uint32_t qlimit;
+	uint32_t mbcnt;
+	boolean_t cell = IFNET_IS_CELLULAR(ifp);
+	boolean_t wifi = (!cell && IFNET_IS_WIFI(ifp));
+	boolean_t wired = (!wifi && IFNET_IS_WIRED(ifp));
+
+	/*
+	 * If the reassembly queue already has entries or if we are going
+	 * to add a new one, then the connection has reached a loss state.
+	 * Reset the stretch-ack algorithm at this point.
+	 */
+	tcp_reset_stretch_ack(tp);
+	tp->t_forced_acks = TCP_FORCED_ACKS_COUNT;
+
+#if TRAFFIC_MGT
+	if (tp->acc_iaj > 0) {
+		reset_acc_iaj(tp);
+	}
+#endif /* TRAFFIC_MGT */
+
+	/*
+	 * Limit the number of segments and the amount of mbuf space held
+	 * by the reassembly queues, both per connection and globally, to
+	 * prevent holding on to too many mbufs.  Make sure to let the
+	 * missing segment through which caused this queue.
+	 */
+	if (th->th_seq != tp->rcv_nxt) {
+		for (n = m; n != NULL; n = n->m_next) {
+			if (mbuf_class_under_pressure(n)) {
+				goto overflow;
+			}
+		}
+
+		qlimit = min(max(100, so->so_rcv.sb_hiwat >> 10),
+		    (tcp_autorcvbuf_max >> 10));
+		if ((tp->t_reassqlen + 1) >= qlimit) {
+			goto overflow;
+		}
+
+		mbcnt = tcp_reass_mbcnt(m);
+		if (tp->t_reassq_mbcnt + mbcnt > (tcp_reass_conn_maxmem != 0 ?
+		    tcp_reass_conn_maxmem : so->so_rcv.sb_mbmax)) {
+			tcp_reass_conn_memdrops++;
+			goto overflow;
+		}
+		if ((uint64_t)tcp_reass_total_mbcnt + mbcnt >
+		    tcp_reass_maxmem_limit()) {
+			tcp_reass_memdrops++;
+			goto overflow;
+		}
+	}
+
+	q = tcp_reass_enqueue(tp, &seq, tlenp, th->th_flags, m);
+	if (q == NULL) {
+		tcpstat.tcps_rcvduppack++;
+		tcpstat.tcps_rcvdupbyte += *tlenp;
+		if (nstat_collect) {
+			nstat_route_rx(inp->inp_route.ro_rt,
+			    1, *tlenp,
+			    NSTAT_RX_FLAG_DUPLICATE);
+			INP_ADD_STAT(inp, cell, wifi, wired,
+			    rxpackets, 1);
+			INP_ADD_STAT(inp, cell, wifi, wired,
+			    rxbytes, *tlenp);
+			tp->t_stat.rxduplicatebytes += *tlenp;
+			inp_set_activity_bitmap(inp);
+		}
+		/*
+		 * Try to present any queued data
+		 * at the left window edge to the user.
+		 * This is needed after the 3-WHS
+		 * completes.
+		 */
+		goto present;
+	}
+
+	if (seq != tp->rcv_nxt) {
+		tp->t_rcvoopack++;
+		tcpstat.tcps_rcvoopack++;
+		tcpstat.tcps_rcvoobyte += *tlenp;
+		if (nstat_collect) {
+			tp->t_stat.rxoutoforderbytes += *tlenp;
+		}
+	}
+
+	if (nstat_collect) {
+		nstat_route_rx(inp->inp_route.ro_rt, 1, *tlenp,
+		    NSTAT_RX_FLAG_OUT_OF_ORDER);
+		INP_ADD_STAT(inp, cell, wifi, wired, rxpackets, 1);
+		INP_ADD_STAT(inp, cell, wifi, wired, rxbytes, *tlenp);
+		inp_set_activity_bitmap(inp);
 	}
 
 present:
@@ -778,8 +998,8 @@ present:
 	if (!TCPS_HAVEESTABLISHED(tp->t_state)) {
 		return 0;
 	}
-	q = LIST_FIRST(&tp->t_segq);
-	if (!q || q->tqe_th->th_seq != tp->rcv_nxt) {
+	q = RB_MIN(tsegqe_tree, &tp->t_segq);
+	if (!q || q->tqe_seq != tp->rcv_nxt) {
 		return 0;
 	}
 
@@ -796,31 +1016,30 @@ present:
 	/* lost packet was recovered, so ooo data can be returned */
 	tcpstat.tcps_recovered_pkts++;
 
-	do {
+	while ((q = tcp_reass_dequeue(tp)) != NULL) {
 		tp->rcv_nxt += q->tqe_len;
-		flags = q->tqe_th->th_flags & TH_FIN;
-		LIST_REMOVE(q, tqe_q);
-		tp->t_reassq_mbcnt -= _MSIZE + (q->tqe_m->m_flags & M_EXT) ?
-		    q->tqe_m->m_ext.ext_size : 0;
-		if (so->so_state & SS_CANTRCVMORE) {
-			m_freem(q->tqe_m);
-		} else {
-			so_recv_data_stat(so, q->tqe_m, 0); /* XXXX */
-			if (q->tqe_th->th_flags & TH_PUSH) {
+		flags = q->tqe_flags & TH_FIN;
+		if (!(so->so_state & SS_CANTRCVMORE)) {
+			if (q->tqe_flags & TH_PUSH) {
 				tp->t_flagsext |= TF_LAST_IS_PSH;
 			} else {
 				tp->t_flagsext &= ~TF_LAST_IS_PSH;
 			}
-
-			if (sbappendstream_rcvdemux(so, q->tqe_m)) {
-				*dowakeup = 1;
+		}
+		while ((n = q->tqe_m) != NULL) {
+			q->tqe_m = n->m_nextpkt;
+			n->m_nextpkt = NULL;
+			if (so->so_state & SS_CANTRCVMORE) {
+				m_freem(n);
+			} else {
+				so_recv_data_stat(so, n, 0); /* XXXX */
+				if (sbappendstream_rcvdemux(so, n)) {
+					*dowakeup = 1;
+				}
 			}
 		}
 		zfree(tcp_reass_zone, q);
-		tp->t_reassqlen--;
-		OSDecrementAtomic(&tcp_reass_total_qlen);
-		q = LIST_FIRST(&tp->t_segq);
-	} while (q && q->tqe_th->th_seq == tp->rcv_nxt);
+	}
 	tp->t_flagsext &= ~TF_REASS_INPROG;
 
 	if ((inp->inp_vflag & INP_IPV6) != 0) {
@@ -838,8 +1057,196 @@ present:
 	}
 
 	return flags;
+
+overflow:
+	tcp_reass_overflows++;
+	tcpstat.tcps_rcvmemdrop++;
+	m_freem(m);
+	*tlenp = 0;
+	return 0;
 }
 
+#if (DEVELOPMENT || DEBUG)
+/*
+ * net.inet.tcp.reass.replay runs a list of segments, given as offsets
+ * from an initial sequence number, through the reassembly queue of a
+ * detached tcpcb the way tcp_input() would, and checks that the data
+ * comes out in order and intact.  Used by tests/tcp_reass_replay.c to
+ * verify the queue on loss and reordering patterns and to measure its
+ * cost per segment.
+ */
+struct tcp_reass_replay_seg {
+	uint32_t        trs_off;        /* offset from the initial sequence */
+	uint16_t        trs_len;        /* payload length */
+	uint16_t        trs_flags;      /* TH_PUSH, TH_FIN */
+};
+
+struct tcp_reass_replay_result {
+	uint64_t        trr_ns;         /* time spent queueing and dequeueing */
+	uint64_t        trr_delivered;  /* bytes delivered in order */
+	uint64_t        trr_dupbytes;   /* bytes dropped as duplicates */
+	uint32_t        trr_corrupt;    /* delivered bytes that did not match */
+	uint32_t        trr_fin;        /* FIN was delivered */
+	uint32_t        trr_max_pkts;   /* most packets queued at once */
+	uint32_t        trr_ranges;     /* ranges left queued at the end */
+};
+
+#define TCP_REASS_REPLAY_MAX    (1 << 20)       /* segments per run */
+#define TCP_REASS_REPLAY_ISS    0xfff00000      /* wraps after 1MB */
+
+static inline uint8_t
+tcp_reass_replay_byte(uint32_t off)
+{
+	return (uint8_t)((off * 2654435761u) >> 24);
+}
+
+static void
+tcp_reass_replay_deliver(struct mbuf *m, struct tcp_reass_replay_result *res)
+{
+	struct mbuf *n;
+
+	for (n = m; n != NULL; n = n->m_next) {
+		uint8_t *data = mtod(n, uint8_t *);
+
+		for (int i = 0; i < n->m_len; i++) {
+			if (data[i] != tcp_reass_replay_byte(
+				    (uint32_t)res->trr_delivered)) {
+				res->trr_corrupt++;
+			}
+			res->trr_delivered++;
+		}
+	}
+	m_freem(m);
+}
+
+static int
+tcp_reass_replay(struct tcp_reass_replay_seg *segs, size_t nsegs,
+    struct tcp_reass_replay_result *res)
+{
+	struct tcpcb *tp;
+	struct tseg_qent *q;
+	struct mbuf *m;
+	uint64_t start, elapsed = 0;
+	int error = 0;
+
+	tp = kalloc_type(struct tcpcb, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	RB_INIT(&tp->t_segq);
+	tp->rcv_nxt = TCP_REASS_REPLAY_ISS;
+
+	for (size_t s = 0; s < nsegs && !res->trr_fin; s++) {
+		tcp_seq seq = TCP_REASS_REPLAY_ISS + segs[s].trs_off;
+		int len = segs[s].trs_len;
+		int todrop;
+		uint8_t *data;
+
+		if (len > MCLBYTES || (segs[s].trs_flags & ~(TH_PUSH | TH_FIN))) {
+			error = EINVAL;
+			break;
+		}
+		m = m_getcl(M_WAITOK, MT_DATA, M_PKTHDR);
+		if (m == NULL) {
+			error = ENOBUFS;
+			break;
+		}
+		data = mtod(m, uint8_t *);
+		for (int i = 0; i < len; i++) {
+			data[i] = tcp_reass_replay_byte(segs[s].trs_off + i);
+		}
+		m->m_len = m->m_pkthdr.len = len;
+
+		start = mach_absolute_time();
+
+		/* What tcp_input() trims before handing data to tcp_reass() */
+		todrop = tp->rcv_nxt - seq;
+		if (todrop > 0) {
+			if (todrop >= len) {
+				res->trr_dupbytes += len;
+				m_freem(m);
+				elapsed += mach_absolute_time() - start;
+				continue;
+			}
+			m_adj(m, todrop);
+			seq += todrop;
+			len -= todrop;
+		}
+
+		if (seq == tp->rcv_nxt && RB_EMPTY(&tp->t_segq)) {
+			tp->rcv_nxt += len;
+			elapsed += mach_absolute_time() - start;
+			res->trr_fin = !!(segs[s].trs_flags & TH_FIN);
+			tcp_reass_replay_deliver(m, res);
+			continue;
+		}
+
+		if (tcp_reass_enqueue(tp, &seq, &len, (uint8_t)segs[s].trs_flags,
+		    m) == NULL) {
+			res->trr_dupbytes += len;
+		}
+		res->trr_max_pkts = MAX(res->trr_max_pkts, tp->t_reassqlen);
+
+		while ((q = tcp_reass_dequeue(tp)) != NULL) {
+			tp->rcv_nxt += q->tqe_len;
+			elapsed += mach_absolute_time() - start;
+			res->trr_fin = !!(q->tqe_flags & TH_FIN);
+			while ((m = q->tqe_m) != NULL) {
+				q->tqe_m = m->m_nextpkt;
+				m->m_nextpkt = NULL;
+				tcp_reass_replay_deliver(m, res);
+			}
+			zfree(tcp_reass_zone, q);
+			start = mach_absolute_time();
+		}
+		elapsed += mach_absolute_time() - start;
+	}
+
+	RB_FOREACH(q, tsegqe_tree, &tp->t_segq) {
+		res->trr_ranges++;
+	}
+	tcp_reass_flush(tp);
+	kfree_type(struct tcpcb, tp);
+
+	absolutetime_to_nanoseconds(elapsed, &res->trr_ns);
+	return error;
+}
+
+static int
+sysctl_tcp_reass_replay SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	struct tcp_reass_replay_result res = {};
+	struct tcp_reass_replay_seg *segs;
+	size_t len = req->newlen;
+	int error;
+
+	if (req->oldptr == USER_ADDR_NULL) {
+		return SYSCTL_OUT(req, NULL, sizeof(res));
+	}
+	if (req->newptr == USER_ADDR_NULL || len == 0 ||
+	    len % sizeof(*segs) != 0 ||
+	    len > TCP_REASS_REPLAY_MAX * sizeof(*segs)) {
+		return EINVAL;
+	}
+
+	segs = kalloc_data(len, Z_WAITOK);
+	if (segs == NULL) {
+		return ENOMEM;
+	}
+	error = SYSCTL_IN(req, segs, len);
+	if (error == 0) {
+		error = tcp_reass_replay(segs, len / sizeof(*segs), &res);
+	}
+	if (error == 0) {
+		error = SYSCTL_OUT(req, &res, sizeof(res));
+	}
+	kfree_data(segs, len);
+	return error;
+}
+
+SYSCTL_PROC(_net_inet_tcp_reass, OID_AUTO, replay,
+    CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_LOCKED | CTLFLAG_MASKED, 0, 0,
+    sysctl_tcp_reass_replay, "S", "Replay segments through a reassembly queue");
+#endif /* (DEVELOPMENT || DEBUG) */
+
 /*
  * Reduce congestion window -- used when ECN is seen or when a tail loss
  * probe recovers the last packet.
@@ -1047,7 +1454,7 @@ tcp_sbrcv_grow(struct tcpcb *tp, struct sockbuf *sbrcv,
 	    sbrcv->sb_hiwat >= tcp_autorcvbuf_max ||
 	    (tp->t_flagsext & TF_RECV_THROTTLE) ||
 	    (so->so_flags1 & SOF1_EXTEND_BK_IDLE_WANTED) ||
-	    (!tcp_autotune_reorder && !LIST_EMPTY(&tp->t_segq))) {
+	    (!tcp_autotune_reorder && !RB_EMPTY(&tp->t_segq))) {
 		/* Can not resize the socket buffer, just return */
 		goto out;
 	}
@@ -3039,7 +3446,7 @@ findpcb:
 	    ((tp->t_flags & TF_NEEDFIN) == 0) &&
 	    ((to.to_flags & TOF_TS) == 0 ||
 	    TSTMP_GEQ(to.to_tsval, tp->ts_recent)) &&
-	    th->th_seq == tp->rcv_nxt && LIST_EMPTY(&tp->t_segq)) {
+	    th->th_seq == tp->rcv_nxt && RB_EMPTY(&tp->t_segq)) {
 		int seg_size = tlen;
 		if (tp->iaj_pktcnt <= IAJ_IGNORE_PKTCNT) {
 			TCP_INC_VAR(tp->iaj_pktcnt, segment_count);
@@ -3240,7 +3647,7 @@ findpcb:
 				KERNEL_DEBUG(DBG_FNC_TCP_INPUT | DBG_FUNC_END, 0, 0, 0, 0, 0);
 				return;
 			}
-		} else if (th->th_ack == tp->snd_una && LIST_EMPTY(&tp->t_segq) &&
+		} else if (th->th_ack == tp->snd_una && RB_EMPTY(&tp->t_segq) &&
 		    tlen <= tcp_sbspace(tp)) {
 			/*
 			 * this is a pure, in-sequence data packet
@@ -4525,7 +4932,7 @@ close:
 		}
 		tp->t_forced_acks = TCP_FORCED_ACKS_COUNT;
 
-		VERIFY(LIST_EMPTY(&tp->t_segq));
+		VERIFY(RB_EMPTY(&tp->t_segq));
 		tp->snd_wl1 = th->th_seq - 1;
 
 		/*
@@ -5528,7 +5935,7 @@ dodata:
 		 * immediately when segments are out of order (so
 		 * fast retransmit can work).
 		 */
-		if (th->th_seq == tp->rcv_nxt && LIST_EMPTY(&tp->t_segq)) {
+		if (th->th_seq == tp->rcv_nxt && RB_EMPTY(&tp->t_segq)) {
 			TCP_INC_VAR(tp->t_unacksegs, segment_count);
 
 			/* Calculate the RTT on the receiver */
@@ -7492,7 +7899,8 @@ dump_tcp_reass_qlen(char *str, int str_len)
 	int k, clen = str_len;
 
 	if (tcp_reass_total_qlen != 0) {
-		k = scnprintf(c, clen, "\ntcp reass qlen %d\n", tcp_reass_total_qlen);
+		k = scnprintf(c, clen, "\ntcp reass qlen %d mem %lld\n",
+		    tcp_reass_total_qlen, tcp_reass_total_mbcnt);
 		DUMP_BUF_CHK();
 	}
 
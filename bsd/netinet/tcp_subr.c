@@ -574,6 +574,7 @@ tcp_init(struct protosw *pp, struct domain *dp)
 	tcbinfo.ipi_porthashbase = hashinit(tcp_tcbhashsize, M_PCB,
 	    &tcbinfo.ipi_porthashmask);
 	tcbinfo.ipi_zone = tcpcbzone;
+	in_pcbinfo_smr_lookup_init(&tcbinfo);
 
 	tcbinfo.ipi_gc = tcp_gc;
 	tcbinfo.ipi_timer = tcp_itimer;
@@ -1100,7 +1101,7 @@ tcp_newtcpcb(struct inpcb *inp)
 	}
 
 	bzero((char *) tp, sizeof(struct tcpcb));
-	LIST_INIT(&tp->t_segq);
+	RB_INIT(&tp->t_segq);
 	tp->t_maxseg = tp->t_maxopd = isipv6 ? tcp_v6mssdflt : tcp_mssdflt;
 
 	tp->t_flags = TF_REQ_SCALE | (tcp_do_timestamps ? TF_REQ_TSTMP : 0);
@@ -1709,24 +1710,7 @@ no_valid_rt:
 int
 tcp_freeq(struct tcpcb *tp)
 {
-	struct tseg_qent *q;
-	int rv = 0;
-	int count = 0;
-
-	while ((q = LIST_FIRST(&tp->t_segq)) != NULL) {
-		LIST_REMOVE(q, tqe_q);
-		tp->t_reassq_mbcnt -= _MSIZE + (q->tqe_m->m_flags & M_EXT) ?
-		    q->tqe_m->m_ext.ext_size : 0;
-		m_freem(q->tqe_m);
-		zfree(tcp_reass_zone, q);
-		rv = 1;
-		count++;
-	}
-	tp->t_reassqlen = 0;
-	if (count > 0) {
-		OSAddAtomic(-count, &tcp_reass_total_qlen);
-	}
-	return rv;
+	return tcp_reass_flush(tp);
 }
 
 
@@ -1856,7 +1840,7 @@ get_tcp_inp_list(struct inpcb **inp_list, int n, inp_gen_t gencnt)
 static void
 tcpcb_to_otcpcb(struct tcpcb *tp, struct otcpcb *otp)
 {
-	otp->t_segq = (uint32_t)VM_KERNEL_ADDRPERM(tp->t_segq.lh_first);
+	otp->t_segq = (uint32_t)VM_KERNEL_ADDRPERM(RB_ROOT(&tp->t_segq));
 	otp->t_dupacks = tp->t_dupacks;
 	otp->t_timer[TCPT_REXMT_EXT] = tp->t_timer[TCPT_REXMT];
 	otp->t_timer[TCPT_PERSIST_EXT] = tp->t_timer[TCPT_PERSIST];
@@ -2042,7 +2026,7 @@ SYSCTL_PROC(_net_inet_tcp, TCPCTL_PCBLIST, pcblist,
 static void
 tcpcb_to_xtcpcb64(struct tcpcb *tp, struct xtcpcb64 *otp)
 {
-	otp->t_segq = (uint32_t)VM_KERNEL_ADDRPERM(tp->t_segq.lh_first);
+	otp->t_segq = (uint32_t)VM_KERNEL_ADDRPERM(RB_ROOT(&tp->t_segq));
 	otp->t_dupacks = tp->t_dupacks;
 	otp->t_timer[TCPT_REXMT_EXT] = tp->t_timer[TCPT_REXMT];
 	otp->t_timer[TCPT_PERSIST_EXT] = tp->t_timer[TCPT_PERSIST];
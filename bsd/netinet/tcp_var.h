@@ -85,6 +85,7 @@ struct name {                           \
 #endif
 
 #ifdef KERNEL_PRIVATE
+#include <sys/tree.h>
 
 #define TCP_RETRANSHZ   1000    /* granularity of TCP timestamps, 1ms */
 /* Minimum time quantum within which the timers are coalesced */
@@ -160,14 +161,29 @@ struct name {                           \
  * Kernel variables for tcp.
  */
 
-/* TCP segment queue entry */
+/*
+ * TCP segment queue entry
+ *
+ * MPTCP keeps one segment per entry on a list (tqe_q).  The TCP
+ * reassembly queue instead keeps one entry per contiguous range of
+ * out-of-order data in a tree (tqe_rb) sorted by tqe_seq; the packets
+ * making up the range are chained through m_nextpkt from tqe_m to
+ * tqe_mtail.
+ */
 struct tseg_qent {
 	LIST_ENTRY(tseg_qent) tqe_q;
-	int     tqe_len;                /* TCP segment data length */
+	RB_ENTRY(tseg_qent) tqe_rb;
+	int     tqe_len;                /* TCP segment (range) data length */
 	struct  tcphdr *tqe_th;         /* a pointer to tcp header */
 	struct  mbuf    *tqe_m;         /* mbuf contains packet */
+	struct  mbuf    *tqe_mtail;     /* last packet of the range */
+	tcp_seq tqe_seq;                /* first sequence number of the range */
+	uint32_t tqe_mbcnt;             /* mbuf space held by the range */
+	uint32_t tqe_pkts;              /* number of packets in the range */
+	uint8_t tqe_flags;              /* TH_PUSH/TH_FIN of the last segment */
 };
 LIST_HEAD(tsegqe_head, tseg_qent);
+RB_HEAD(tsegqe_tree, tseg_qent);
 
 struct sackblk {
 	tcp_seq start;          /* start seq no. of sack block */
@@ -282,7 +298,7 @@ struct tcp_rledbat_state {
  * Organized for 16 byte cacheline efficiency.
  */
 struct tcpcb {
-	struct tsegqe_head t_segq;
+	struct tsegqe_tree t_segq;
 	uint32_t t_dupacks;             /* consecutive dup acks recd */
 	int      t_state;               /* state of this connection */
 	uint32_t t_timer[TCPT_NTIMERS]; /* tcp timers */
@@ -1648,6 +1664,7 @@ extern int tcp_cubic_rfc_compliant;
 extern int tcp_flow_control_response;
 
 extern int tcp_reass_total_qlen;
+extern int64_t tcp_reass_total_mbcnt;
 
 struct protosw;
 struct domain;
@@ -1788,6 +1805,7 @@ extern void tcp_disable_tfo(struct tcpcb *tp);
 extern void tcp_tfo_gen_cookie(struct inpcb *inp, u_char *out, size_t blk_size);
 #define TCP_FASTOPEN_KEYLEN 16
 extern int tcp_freeq(struct tcpcb *tp);
+extern int tcp_reass_flush(struct tcpcb *tp);
 extern errno_t tcp_notify_ack_id_valid(struct tcpcb *, struct socket *, u_int32_t);
 extern errno_t tcp_add_notify_ack_marker(struct tcpcb *, u_int32_t);
 extern void tcp_notify_ack_free(struct tcpcb *);
@@ -892,6 +892,9 @@ in6_pcbdetach(struct inpcb *inp)
 	    (SOCK_PROTO(so) == IPPROTO_TCP || SOCK_PROTO(so) == IPPROTO_UDP)) {
 		nstat_pcb_detach(inp);
 	}
+	/* a v4-mapped pcb may have been published for lock-free lookups */
+	in_pcb_smr_retire(inp);
+
 	/* mark socket state as dead */
 	if (in_pcb_checkstate(inp, WNT_STOPUSING, 1) != WNT_STOPUSING) {
 		panic("%s: so=%p proto=%d couldn't set to STOPUSING",
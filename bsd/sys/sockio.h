@@ -372,6 +372,9 @@
 #define SIOCGIFNOTRAFFICSHAPING _IOWR('i', 216, struct ifreq) /* skip dummynet and netem traffic shaping */
 
 #define SIOCGIFGENERATIONID _IOWR('i', 217, struct ifreq) /* value of generation count at interface creation */
+
+#define SIOCSIFSWGRO _IOWR('i', 218, struct ifreq) /* enable/disable software receive offload */
+#define SIOCGIFSWGRO _IOWR('i', 219, struct ifreq) /* get software receive offload state */
 #endif /* PRIVATE */
 
 #endif /* !_SYS_SOCKIO_H_ */
@@ -117,6 +117,7 @@
 #endif
 
 #include <kern/bits.h>
+#include <kern/kcdata.h>
 
 #if CONFIG_CSR
 #include <sys/csr.h>
@@ -3470,6 +3471,61 @@ SYSCTL_UINT(_vm, OID_AUTO, page_realtime_count, CTLFLAG_RD | CTLFLAG_LOCKED, &vm
 extern int vm_pageout_protect_realtime;
 SYSCTL_INT(_vm, OID_AUTO, pageout_protect_realtime, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_pageout_protect_realtime, 0, "");
 
+/*
+ * Multi-generational LRU mode of the pageout daemon, and what to compare
+ * it with the default policy on the same workload: the sizes of the
+ * active queue's generations (oldest first), what became of the pages
+ * found at its head, and how soon evicted file pages were faulted back.
+ */
+extern uint32_t vm_pageout_mglru;
+SYSCTL_UINT(_vm, OID_AUTO, pageout_mglru, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &vm_pageout_mglru, 0, "Age the active queue in generations");
+extern uint32_t vm_mglru_min_seq, vm_mglru_max_seq;
+SYSCTL_UINT(_vm, OID_AUTO, mglru_min_seq, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &vm_mglru_min_seq, 0, "Oldest generation of the active queue");
+SYSCTL_UINT(_vm, OID_AUTO, mglru_max_seq, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &vm_mglru_max_seq, 0, "Youngest generation of the active queue");
+
+#define VM_MGLRU_SYSCTL_GENS    4
+
+static int
+sysctl_vm_mglru_gen_pages SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	uint32_t min_seq, max_seq, gen_pages[VM_MGLRU_SYSCTL_GENS];
+
+	vm_page_mglru_snapshot(&min_seq, &max_seq, gen_pages, VM_MGLRU_SYSCTL_GENS);
+	return SYSCTL_OUT(req, gen_pages, sizeof(gen_pages));
+}
+SYSCTL_PROC(_vm, OID_AUTO, mglru_gen_pages,
+    CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+    0, 0, &sysctl_vm_mglru_gen_pages, "IU",
+    "Pages in each generation of the active queue, oldest first");
+SYSCTL_ULONG(_vm, OID_AUTO, pageout_mglru_aged, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &vm_pageout_vminfo.vm_pageout_mglru_aged, "Generations started");
+SYSCTL_ULONG(_vm, OID_AUTO, pageout_mglru_promoted, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &vm_pageout_vminfo.vm_pageout_mglru_promoted, "Referenced active pages moved to the youngest generation");
+SYSCTL_ULONG(_vm, OID_AUTO, pageout_mglru_deactivated, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &vm_pageout_vminfo.vm_pageout_mglru_deactivated, "Unreferenced active pages deactivated from the oldest generation");
+
+#if CONFIG_PHANTOM_CACHE
+#define VM_REFAULT_DISTANCE_SYSCTL_BUCKETS      32
+
+static int
+sysctl_vm_phantom_cache_refault_distance SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	uint64_t buckets[VM_REFAULT_DISTANCE_SYSCTL_BUCKETS];
+
+	vm_phantom_cache_refault_distances(buckets, VM_REFAULT_DISTANCE_SYSCTL_BUCKETS);
+	return SYSCTL_OUT(req, buckets, sizeof(buckets));
+}
+SYSCTL_PROC(_vm, OID_AUTO, phantom_cache_refault_distance,
+    CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+    0, 0, &sysctl_vm_phantom_cache_refault_distance, "QU",
+    "Refaults of file pages by distance: bucket i counts [2^(i-1), 2^i) pages evicted in between");
+#endif /* CONFIG_PHANTOM_CACHE */
+
 /* counts of pages prefaulted when entering a memory object */
 extern int64_t vm_prefault_nb_pages, vm_prefault_nb_bailout;
 SYSCTL_QUAD(_vm, OID_AUTO, prefault_nb_pages, CTLFLAG_RW | CTLFLAG_LOCKED, &vm_prefault_nb_pages, "");
@@ -3997,6 +4053,76 @@ SYSCTL_INT(_vm, OID_AUTO, fault_resilient_media_inject_error3_rate, CTLFLAG_RW |
 SYSCTL_INT(_vm, OID_AUTO, fault_resilient_media_inject_error3, CTLFLAG_RD | CTLFLAG_LOCKED, &vm_fault_resilient_media_inject_error3, 0, "");
 #endif /* MACH_ASSERT */
 
+/*
+ * Fault-around: vm.fault_around is the window of the calling process,
+ * in pages, and vm.fault_around_mapped the neighbors mapped for it so
+ * far.  New processes start with vm.fault_around_default; forks inherit
+ * the window of their parent.
+ */
+static int
+sysctl_vm_fault_around SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	vm_map_t map = current_map();
+	int error, changed = 0;
+	int value = (int)vm_map_fault_around(map);
+
+	error = sysctl_io_number(req, value, sizeof(value), &value, &changed);
+	if (error || !changed) {
+		return error;
+	}
+	if (value < 0 || value > VM_FAULT_AROUND_MAX) {
+		return EINVAL;
+	}
+	vm_map_set_fault_around(map, (unsigned int)value);
+	return 0;
+}
+SYSCTL_PROC(_vm, OID_AUTO, fault_around,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_ANYBODY | CTLFLAG_LOCKED,
+    0, 0, &sysctl_vm_fault_around, "I",
+    "Pages mapped around a soft read fault in this process");
+
+static int
+sysctl_vm_fault_around_mapped SYSCTL_HANDLER_ARGS
+{
+#pragma unused(oidp, arg1, arg2)
+	uint32_t mapped = vm_map_fault_around_pages(current_map());
+
+	return SYSCTL_OUT(req, &mapped, sizeof(mapped));
+}
+SYSCTL_PROC(_vm, OID_AUTO, fault_around_mapped,
+    CTLTYPE_INT | CTLFLAG_RD | CTLFLAG_ANYBODY | CTLFLAG_LOCKED,
+    0, 0, &sysctl_vm_fault_around_mapped, "IU",
+    "Neighbor pages mapped by fault-around in this process");
+
+extern unsigned int vm_fault_around_default;
+SYSCTL_UINT(_vm, OID_AUTO, fault_around_default, CTLFLAG_RW | CTLFLAG_LOCKED,
+    &vm_fault_around_default, 0, "Fault-around window of new processes");
+SCALABLE_COUNTER_DECLARE(vm_fault_around_calls);
+SCALABLE_COUNTER_DECLARE(vm_fault_around_pages);
+SYSCTL_SCALABLE_COUNTER(_vm, fault_around_calls, vm_fault_around_calls,
+    "Soft read faults that looked for neighbors to map");
+SYSCTL_SCALABLE_COUNTER(_vm, fault_around_pages, vm_fault_around_pages,
+    "Neighbor pages mapped by fault-around");
+
+/*
+ * Lockless fault lookups (see vm_map_lock_read_fault()): faults that
+ * pinned their map, faults that found it held exclusive and took the
+ * lock instead, and exclusive holders that had to wait for pins.
+ */
+extern unsigned int vm_map_lockless_faults;
+SYSCTL_UINT(_vm, OID_AUTO, lockless_faults, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &vm_map_lockless_faults, 0, "Whether new processes fault without their map lock");
+SCALABLE_COUNTER_DECLARE(vm_map_fault_pins);
+SCALABLE_COUNTER_DECLARE(vm_map_fault_pin_fallbacks);
+SCALABLE_COUNTER_DECLARE(vm_map_pin_drains);
+SYSCTL_SCALABLE_COUNTER(_vm, lockless_fault_pins, vm_map_fault_pins,
+    "Faults that looked their map up without its lock");
+SYSCTL_SCALABLE_COUNTER(_vm, lockless_fault_fallbacks, vm_map_fault_pin_fallbacks,
+    "Faults that found their map held exclusive");
+SYSCTL_SCALABLE_COUNTER(_vm, lockless_fault_drains, vm_map_pin_drains,
+    "Map writers that waited for lockless faults");
+
 extern uint64_t pmap_query_page_info_retries;
 SYSCTL_QUAD(_vm, OID_AUTO, pmap_query_page_info_retries, CTLFLAG_RD | CTLFLAG_LOCKED, &pmap_query_page_info_retries, "");
 
@@ -4155,6 +4281,114 @@ SYSCTL_QUAD(_vm, OID_AUTO, c_seg_filled_no_contention, CTLFLAG_RD | CTLFLAG_LOCK
 SYSCTL_QUAD(_vm, OID_AUTO, c_seg_filled_contention, CTLFLAG_RD | CTLFLAG_LOCKED, &c_seg_filled_contention, "");
 SYSCTL_ULONG(_vm, OID_AUTO, c_seg_filled_contention_sec_max, CTLFLAG_RD | CTLFLAG_LOCKED, &c_seg_filled_contention_sec_max, "");
 SYSCTL_UINT(_vm, OID_AUTO, c_seg_filled_contention_nsec_max, CTLFLAG_RD | CTLFLAG_LOCKED, &c_seg_filled_contention_nsec_max, 0, "");
+extern uint32_t c_compress_batch_limit;
+extern uint64_t c_compress_batches;
+extern uint64_t c_compress_batched_pages;
+extern uint32_t c_compress_batch_size_max;
+SYSCTL_UINT(_vm, OID_AUTO, c_compress_batch_limit, CTLFLAG_RW | CTLFLAG_LOCKED, &c_compress_batch_limit, 0, "");
+SYSCTL_QUAD(_vm, OID_AUTO, c_compress_batches, CTLFLAG_RD | CTLFLAG_LOCKED, &c_compress_batches, "");
+SYSCTL_QUAD(_vm, OID_AUTO, c_compress_batched_pages, CTLFLAG_RD | CTLFLAG_LOCKED, &c_compress_batched_pages, "");
+SYSCTL_UINT(_vm, OID_AUTO, c_compress_batch_size_max, CTLFLAG_RD | CTLFLAG_LOCKED, &c_compress_batch_size_max, 0, "");
+
+extern void vm_compressor_outcome_stats_get(struct compressor_outcome_stats *);
+
+static int
+sysctl_compressor_outcomes SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	struct compressor_outcome_stats cos;
+
+	if (req->newptr != USER_ADDR_NULL) {
+		return EPERM;
+	}
+	vm_compressor_outcome_stats_get(&cos);
+	return SYSCTL_OUT(req, &cos, sizeof(cos));
+}
+SYSCTL_PROC(_vm, OID_AUTO, compressor_outcomes, CTLTYPE_STRUCT | CTLFLAG_RD | CTLFLAG_LOCKED,
+    0, 0, sysctl_compressor_outcomes, "S,compressor_outcome_stats", "");
+
+extern uint32_t vm_compressor_major_compact_workers;
+extern uint32_t vm_compressor_major_compact_chunk;
+extern uint64_t c_major_compact_parallel_rounds;
+extern uint64_t c_major_compact_parallel_runs;
+extern kern_return_t vm_compressor_major_compact_set_workers(uint32_t);
+extern kern_return_t vm_compressor_major_compact_set_chunk(uint32_t);
+
+static int
+sysctl_compressor_major_compact_workers SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	int error, changed;
+	int new_value;
+
+	error = sysctl_io_number(req, vm_compressor_major_compact_workers, sizeof(int), &new_value, &changed);
+	if (error || !changed) {
+		return error;
+	}
+	if (new_value < 1) {
+		return EINVAL;
+	}
+	if (vm_compressor_major_compact_set_workers((uint32_t)new_value) != KERN_SUCCESS) {
+		return EINVAL;
+	}
+	return 0;
+}
+SYSCTL_PROC(_vm, OID_AUTO, compressor_major_compact_workers, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+    0, 0, sysctl_compressor_major_compact_workers, "I", "");
+
+static int
+sysctl_compressor_major_compact_chunk SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	int error, changed;
+	int new_value;
+
+	error = sysctl_io_number(req, vm_compressor_major_compact_chunk, sizeof(int), &new_value, &changed);
+	if (error || !changed) {
+		return error;
+	}
+	if (new_value < 1) {
+		return EINVAL;
+	}
+	if (vm_compressor_major_compact_set_chunk((uint32_t)new_value) != KERN_SUCCESS) {
+		return EINVAL;
+	}
+	return 0;
+}
+SYSCTL_PROC(_vm, OID_AUTO, compressor_major_compact_chunk, CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED,
+    0, 0, sysctl_compressor_major_compact_chunk, "I", "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_major_compact_parallel_rounds, CTLFLAG_RD | CTLFLAG_LOCKED, &c_major_compact_parallel_rounds, "");
+SYSCTL_QUAD(_vm, OID_AUTO, compressor_major_compact_parallel_runs, CTLFLAG_RD | CTLFLAG_LOCKED, &c_major_compact_parallel_runs, "");
+
+#if DEVELOPMENT || DEBUG
+extern kern_return_t vm_compressor_major_compact_test(uint64_t *, uint64_t *);
+
+/*
+ * Writing to vm.compressor_major_compact_test major compacts the age queue
+ * and reads back { segments compacted, elapsed usecs }.
+ */
+static int
+sysctl_compressor_major_compact_test SYSCTL_HANDLER_ARGS
+{
+#pragma unused(arg1, arg2, oidp)
+	uint64_t        result[2] = { 0, 0 };
+	int             error, value = 0;
+
+	if (req->newptr == USER_ADDR_NULL) {
+		return EINVAL;
+	}
+	error = SYSCTL_IN(req, &value, sizeof(value));
+	if (error) {
+		return error;
+	}
+	if (value && vm_compressor_major_compact_test(&result[0], &result[1]) != KERN_SUCCESS) {
+		return ENOTSUP;
+	}
+	return SYSCTL_OUT(req, result, sizeof(result));
+}
+SYSCTL_PROC(_vm, OID_AUTO, compressor_major_compact_test, CTLTYPE_OPAQUE | CTLFLAG_RW | CTLFLAG_LOCKED | CTLFLAG_MASKED,
+    0, 0, sysctl_compressor_major_compact_test, "Q", "");
+#endif /* DEVELOPMENT || DEBUG */
 #if (XNU_TARGET_OS_OSX && __arm64__)
 extern clock_nsec_t c_process_major_report_over_ms; /* report if over ? ms */
 extern int c_process_major_yield_after; /* yield after moving ? segments */
@@ -552,6 +552,7 @@ struct kcdata_type_definition {
 #define STACKSHOT_KCTYPE_SHAREDCACHE_AOTINFO         0x944u /* struct dyld_aot_cache_uuid_info */
 #define STACKSHOT_KCTYPE_SHAREDCACHE_ID              0x945u /* uint32_t in task: if we aren't attached to Primary, which one */
 #define STACKSHOT_KCTYPE_CODESIGNING_INFO            0x946u /* struct stackshot_task_codesigning_info */
+#define STACKSHOT_KCTYPE_COMPRESSOR_OUTCOMES         0x947u /* struct compressor_outcome_stats */
 
 
 struct stack_snapshot_frame32 {
@@ -733,6 +734,27 @@ struct mem_and_io_snapshot {
 	uint8_t         pages_wanted_reclaimed_valid; // did mach_vm_pressure_monitor succeed?
 } __attribute__((packed));
 
+/*
+ * What happened to the pages handed to the VM compressor, per codec
+ * (index 0 is WKdm, 1 is LZ4). cos_size_buckets[codec][i] counts pages
+ * that compressed to [i * cos_bucket_size, (i + 1) * cos_bucket_size).
+ */
+#define COMPRESSOR_OUTCOME_CODECS        2
+#define COMPRESSOR_OUTCOME_SIZE_BUCKETS  16
+
+struct compressor_outcome_stats {
+	uint32_t        cos_page_size;
+	uint32_t        cos_bucket_size;
+	uint64_t        cos_sv_pages[COMPRESSOR_OUTCOME_CODECS];      /* single value pages */
+	uint64_t        cos_sv_zero_pages[COMPRESSOR_OUTCOME_CODECS]; /* ... of which zero filled */
+	uint64_t        cos_sv_hash_full;       /* single value pages that had to be stored in a c_seg */
+	uint64_t        cos_compressed_pages[COMPRESSOR_OUTCOME_CODECS];
+	uint64_t        cos_incompressible_pages[COMPRESSOR_OUTCOME_CODECS];
+	uint64_t        cos_seg_full_retries;   /* page didn't fit in the rest of a c_seg */
+	uint64_t        cos_limit_bailouts;     /* no c_seg could be allocated (segment or page limit) */
+	uint64_t        cos_size_buckets[COMPRESSOR_OUTCOME_CODECS][COMPRESSOR_OUTCOME_SIZE_BUCKETS];
+} __attribute__((packed));
+
 /* SS_TH_* macros are for ths_state */
 #define SS_TH_WAIT 0x01       /* queued for waiting */
 #define SS_TH_SUSP 0x02       /* stopped or requested to stop */
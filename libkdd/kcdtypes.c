@@ -314,6 +314,23 @@ kcdata_get_typedescription(unsigned type_id, uint8_t * buffer, uint32_t buffer_s
 		break;
 	}
 
+	case STACKSHOT_KCTYPE_COMPRESSOR_OUTCOMES: {
+		i = 0;
+		_SUBTYPE(KC_ST_UINT32, struct compressor_outcome_stats, cos_page_size);
+		_SUBTYPE(KC_ST_UINT32, struct compressor_outcome_stats, cos_bucket_size);
+		_SUBTYPE_ARRAY(KC_ST_UINT64, struct compressor_outcome_stats, cos_sv_pages, COMPRESSOR_OUTCOME_CODECS);
+		_SUBTYPE_ARRAY(KC_ST_UINT64, struct compressor_outcome_stats, cos_sv_zero_pages, COMPRESSOR_OUTCOME_CODECS);
+		_SUBTYPE(KC_ST_UINT64, struct compressor_outcome_stats, cos_sv_hash_full);
+		_SUBTYPE_ARRAY(KC_ST_UINT64, struct compressor_outcome_stats, cos_compressed_pages, COMPRESSOR_OUTCOME_CODECS);
+		_SUBTYPE_ARRAY(KC_ST_UINT64, struct compressor_outcome_stats, cos_incompressible_pages, COMPRESSOR_OUTCOME_CODECS);
+		_SUBTYPE(KC_ST_UINT64, struct compressor_outcome_stats, cos_seg_full_retries);
+		_SUBTYPE(KC_ST_UINT64, struct compressor_outcome_stats, cos_limit_bailouts);
+		_SUBTYPE_ARRAY(KC_ST_UINT64, struct compressor_outcome_stats, cos_size_buckets,
+		    COMPRESSOR_OUTCOME_CODECS * COMPRESSOR_OUTCOME_SIZE_BUCKETS);
+		setup_type_definition(retval, type_id, i, "compressor_outcome_stats");
+		break;
+	}
+
 	case STACKSHOT_KCCONTAINER_SHAREDCACHE:
 		setup_type_definition(retval, type_id, 0, "shared_caches");
 		break;
@@ -39,6 +39,7 @@
 #include <libkern/c++/OSSharedPtr.h>
 #include <libkern/c++/OSSymbol.h>
 #include <os/cpp_util.h>
+#include <os/hash.h>
 
 #define super OSCollection
 
@@ -78,27 +79,185 @@ OSDictionary::sortBySymbol(void)
 {
 	qsort(dictionary, count, sizeof(OSDictionary::dictEntry),
 	    &OSDictionary::dictEntry::compare);
+
+	// the entries moved, reindex them
+	if (isHashed()) {
+		hashRebuild();
+	}
+}
+
+/*
+ * Hash index
+ *
+ * Dictionaries with a capacity of at least kOSDictionaryHashThreshold
+ * entries keep an open addressing hash table of their keys, keyed by OSSymbol
+ * address, right after the last entry of the dictionary storage:
+ *
+ *   dictionary[0 .. capacity)            the entries, in insertion order
+ *                                        (or sorted, for kSort dictionaries)
+ *   (uint32_t *)&dictionary[capacity]    hashBucketCount(capacity) buckets
+ *
+ * Each bucket holds either 0 (empty), or the index of an entry plus one.
+ * The table is probed linearly and has a load factor of at most 2/3.
+ *
+ * Whether the index exists only depends on the capacity, which never shrinks,
+ * so that the layout of the class (and the ABI for subclasses) is unchanged.
+ * Hashed dictionaries grow geometrically, and unless they are sorted never
+ * need to shift their entries to insert, which makes building large property
+ * tables amortized constant time per key. Sorted ones still insert in order,
+ * so that iterating over them stays sorted, and renumber the entries they
+ * shift in the index.  Removing an entry shifts the ones after it.
+ */
+#define kOSDictionaryHashThreshold      32
+
+unsigned int
+OSDictionary::hashBucketCount(unsigned int theCapacity)
+{
+	unsigned int buckets = kOSDictionaryHashThreshold;
+
+	while (buckets < theCapacity + theCapacity / 2) {
+		buckets *= 2;
+	}
+	return buckets;
+}
+
+unsigned long
+OSDictionary::storageCount(unsigned int theCapacity)
+{
+	unsigned long bytes;
+
+	if (theCapacity < kOSDictionaryHashThreshold) {
+		return theCapacity;
+	}
+
+	bytes = hashBucketCount(theCapacity) * sizeof(uint32_t);
+	return theCapacity + (bytes + sizeof(dictEntry) - 1) / sizeof(dictEntry);
+}
+
+unsigned int
+OSDictionary::capacityForStorage(unsigned int storage)
+{
+	unsigned int theCapacity = storage;
+
+	// storageCount() is monotonic, find the largest capacity that fits
+	while (theCapacity && storageCount(theCapacity) > storage) {
+		theCapacity--;
+	}
+	return theCapacity;
+}
+
+bool
+OSDictionary::isHashed(void) const
+{
+	return capacity >= kOSDictionaryHashThreshold;
+}
+
+unsigned int
+OSDictionary::hashLookup(const OSSymbol *aKey) const
+{
+	const uint32_t *buckets = (const uint32_t *)&dictionary[capacity];
+	uint32_t mask = hashBucketCount(capacity) - 1;
+	uint32_t h = os_hash_kernel_pointer(aKey) & mask;
+
+	for (uint32_t b; (b = buckets[h]); h = (h + 1) & mask) {
+		if (aKey == dictionary[b - 1].key) {
+			return b - 1;
+		}
+	}
+
+	return count;
+}
+
+void
+OSDictionary::hashInsert(unsigned int index)
+{
+	uint32_t *buckets = (uint32_t *)&dictionary[capacity];
+	uint32_t mask = hashBucketCount(capacity) - 1;
+	uint32_t h = os_hash_kernel_pointer(dictionary[index].key.get()) & mask;
+
+	while (buckets[h]) {
+		h = (h + 1) & mask;
+	}
+	buckets[h] = index + 1;
+}
+
+/*
+ * Remove the bucket of an entry, shifting back the entries probed after
+ * it that may move into its place, so that no probe sequence is broken.
+ */
+void
+OSDictionary::hashRemove(unsigned int index)
+{
+	uint32_t *buckets = (uint32_t *)&dictionary[capacity];
+	uint32_t mask = hashBucketCount(capacity) - 1;
+	uint32_t h = os_hash_kernel_pointer(dictionary[index].key.get()) & mask;
+	uint32_t next, home;
+
+	while (buckets[h] != index + 1) {
+		h = (h + 1) & mask;
+	}
+	for (next = (h + 1) & mask; buckets[next]; next = (next + 1) & mask) {
+		home = os_hash_kernel_pointer(dictionary[buckets[next] - 1].key.get()) & mask;
+		// the hole is between its home and where it is
+		if (((next - home) & mask) >= ((next - h) & mask)) {
+			buckets[h] = buckets[next];
+			h = next;
+		}
+	}
+	buckets[h] = 0;
+}
+
+/*
+ * Point the bucket of the entry now at index, which was at oldIndex,
+ * to its new place.  Callers moving several entries renumber them in
+ * the order that never makes a new index equal to an old one not yet
+ * renumbered.
+ */
+void
+OSDictionary::hashRenumber(unsigned int index, unsigned int oldIndex)
+{
+	uint32_t *buckets = (uint32_t *)&dictionary[capacity];
+	uint32_t mask = hashBucketCount(capacity) - 1;
+	uint32_t h = os_hash_kernel_pointer(dictionary[index].key.get()) & mask;
+
+	while (buckets[h] != oldIndex + 1) {
+		h = (h + 1) & mask;
+	}
+	buckets[h] = index + 1;
+}
+
+void
+OSDictionary::hashRebuild(void)
+{
+	bzero(&dictionary[capacity], hashBucketCount(capacity) * sizeof(uint32_t));
+	for (unsigned int i = 0; i < count; i++) {
+		hashInsert(i);
+	}
 }
 
 bool
 OSDictionary::initWithCapacity(unsigned int inCapacity)
 {
+	unsigned int storage;
+
 	if (!super::init()) {
 		return false;
 	}
 
-	if (inCapacity > (UINT_MAX / sizeof(dictEntry))) {
+	if (storageCount(inCapacity) > (UINT_MAX / sizeof(dictEntry))) {
 		return false;
 	}
 
 //fOptions |= kSort;
 
-	dictionary = kallocp_type_container(dictEntry, &inCapacity, Z_WAITOK_ZERO);
+	storage = (unsigned int)storageCount(inCapacity);
+	dictionary = kallocp_type_container(dictEntry, &storage, Z_WAITOK_ZERO);
 	if (!dictionary) {
 		return false;
 	}
 
-	OSCONTAINER_ACCUMSIZE(inCapacity * sizeof(dictEntry));
+	inCapacity = capacityForStorage(storage);
+	OSCONTAINER_ACCUMSIZE(storageCount(inCapacity) * sizeof(dictEntry));
 
 	count = 0;
 	capacity = inCapacity;
@@ -212,8 +371,8 @@ OSDictionary::initWithDictionary(const OSDictionary *dict,
 		dictionary[i].value = dict->dictionary[i].value;
 	}
 
-	if ((kSort & fOptions) && !(kSort & dict->fOptions)) {
-		sortBySymbol();
+	if (isHashed()) {
+		hashRebuild();
 	}
 
 	return true;
@@ -280,8 +439,10 @@ OSDictionary::free()
 	(void) super::setOptions(0, kImmutable);
 	flushCollection();
 	if (dictionary) {
-		kfree_type(dictEntry, capacity, dictionary);
-		OSCONTAINER_ACCUMSIZE( -(capacity * sizeof(dictEntry)));
+		unsigned int storage = (unsigned int)storageCount(capacity);
+
+		kfree_type(dictEntry, storage, dictionary);
+		OSCONTAINER_ACCUMSIZE( -(storage * sizeof(dictEntry)));
 	}
 
 	super::free();
@@ -317,6 +478,7 @@ OSDictionary::ensureCapacity(unsigned int newCapacity)
 {
 	dictEntry *newDict;
 	unsigned int finalCapacity;
+	unsigned int oldStorage, storage;
 
 	if (newCapacity <= capacity) {
 		return capacity;
@@ -327,16 +489,28 @@ OSDictionary::ensureCapacity(unsigned int newCapacity)
 	    * capacityIncrement;
 
 	// integer overflow check
-	if (finalCapacity < newCapacity) {
+	if (finalCapacity < newCapacity ||
+	    storageCount(finalCapacity) > (UINT_MAX / sizeof(dictEntry))) {
 		return capacity;
 	}
 
+	oldStorage = (unsigned int)storageCount(capacity);
+	storage = (unsigned int)storageCount(finalCapacity);
 	newDict = kreallocp_type_container(dictEntry, dictionary,
-	    capacity, &finalCapacity, Z_WAITOK_ZERO);
+	    oldStorage, &storage, Z_WAITOK_ZERO);
 	if (newDict) {
-		OSCONTAINER_ACCUMSIZE(sizeof(dictEntry) * (finalCapacity - capacity));
+		// the old hash index is now part of the entries, clear it
+		bzero(&newDict[capacity], (oldStorage - capacity) * sizeof(dictEntry));
+
+		finalCapacity = capacityForStorage(storage);
+		OSCONTAINER_ACCUMSIZE(sizeof(dictEntry) *
+		    (storageCount(finalCapacity) - oldStorage));
 		dictionary = newDict;
 		capacity = finalCapacity;
+
+		if (isHashed()) {
+			hashRebuild();
+		}
 	}
 
 	return capacity;
@@ -352,6 +526,10 @@ OSDictionary::flushCollection()
 		dictionary[i].value.reset();
 	}
 	count = 0;
+
+	if (isHashed()) {
+		hashRebuild();
+	}
 }
 
 bool
@@ -367,7 +545,10 @@ setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject, bool onlyAdd)
 
 	// if the key exists, replace the object
 
-	if (fOptions & kSort) {
+	if (isHashed()) {
+		i = hashLookup(aKey);
+		exists = (i < count);
+	} else if (fOptions & kSort) {
 		i = OSSymbol::bsearch(aKey, &dictionary[0], count, sizeof(dictionary[0]));
 		exists = (i < count) && (aKey == dictionary[i].key);
 	} else {
@@ -391,13 +572,30 @@ setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject, bool onlyAdd)
 		return true;
 	}
 
-	// add new key, possibly extending our capacity
-	if (count >= capacity && count >= ensureCapacity(count + 1)) {
-		return false;
+	// add new key, possibly extending our capacity,
+	// hashed dictionaries grow by half their size at a time
+	if (count >= capacity) {
+		unsigned int newCapacity = count + 1;
+
+		if (count >= kOSDictionaryHashThreshold) {
+			newCapacity = MAX(newCapacity, count + count / 2);
+		}
+		if (count >= ensureCapacity(newCapacity)) {
+			return false;
+		}
 	}
 
 	haveUpdated();
 
+	// hashed dictionaries append, unless they are sorted
+	if (isHashed()) {
+		if (fOptions & kSort) {
+			i = OSSymbol::bsearch(aKey, &dictionary[0], count, sizeof(dictionary[0]));
+		} else {
+			i = count;
+		}
+	}
+
 	new (&dictionary[count]) dictEntry();
 	os::move_backward(&dictionary[i], &dictionary[count], &dictionary[count + 1]);
 
@@ -405,6 +603,14 @@ setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject, bool onlyAdd)
 	dictionary[i].value.reset(anObject, OSRetain);
 	count++;
 
+	if (isHashed()) {
+		// entries after the new one moved up, last first
+		for (unsigned int j = count - 1; j > i; j--) {
+			hashRenumber(j, j - 1);
+		}
+		hashInsert(i);
+	}
+
 	return true;
 }
 
@@ -445,7 +651,10 @@ OSDictionary::removeObject(const OSSymbol *aKey)
 
 	// if the key exists, remove the object
 
-	if (fOptions & kSort) {
+	if (isHashed()) {
+		i = hashLookup(aKey);
+		exists = (i < count);
+	} else if (fOptions & kSort) {
 		i = OSSymbol::bsearch(aKey, &dictionary[0], count, sizeof(dictionary[0]));
 		exists = (i < count) && (aKey == dictionary[i].key);
 	} else {
@@ -461,9 +670,20 @@ OSDictionary::removeObject(const OSSymbol *aKey)
 
 		haveUpdated();
 
+		if (isHashed()) {
+			hashRemove(i);
+		}
+
 		count--;
 		bcopy(&dictionary[i + 1], &dictionary[i], (count - i) * sizeof(dictionary[0]));
 
+		// entries after the removed one moved down, first first
+		if (isHashed()) {
+			for (unsigned int j = i; j < count; j++) {
+				hashRenumber(j, j + 1);
+			}
+		}
+
 		oldEntry.key->taggedRelease(OSTypeID(OSCollection));
 		oldEntry.value->taggedRelease(OSTypeID(OSCollection));
 		return;
@@ -515,7 +735,14 @@ OSDictionary::getObject(const OSSymbol *aKey) const
 	// of OSSymbol::bsearch
 	//
 	// If we have less than 4 objects, scanning is faster.
-	if (count > 4 && (fOptions & kSort)) {
+	//
+	// Large dictionaries use their hash index instead.
+	if (isHashed()) {
+		i = hashLookup(aKey);
+		if (i < count) {
+			return const_cast<OSObject *> ((const OSObject *)dictionary[i].value.get());
+		}
+	} else if (count > 4 && (fOptions & kSort)) {
 		while (l < r) {
 			i = (l + r) / 2;
 			if (aKey == dictionary[i].key) {
@@ -875,3 +1102,132 @@ OSDictionary::iterateObjects(bool (^block)(const OSSymbol * key, OSObject * obje
 {
 	return iterateObjects((void *)block, &OSDictionaryIterateObjectsBlock);
 }
+
+#if DEBUG || DEVELOPMENT
+/*
+ * Checks that every symbol of `syms` is in `dict` (mapping to itself), but
+ * for the even ones if `evensRemoved`, that a symbol never added isn't, and
+ * that `dict` iterates in symbol order if it is sorted.
+ */
+static bool
+iokit_dictionary_check(OSDictionary *dict, OSArray *syms, const OSSymbol *missing,
+    bool evensRemoved)
+{
+	OSSharedPtr<OSCollectionIterator> iter;
+	const OSSymbol *key, *prev = NULL;
+	unsigned int expected = 0;
+
+	for (unsigned int i = 0; i < syms->getCount(); i++) {
+		const OSSymbol *sym = OSDynamicCast(OSSymbol, syms->getObject(i));
+		bool present = !(evensRemoved && (i % 2) == 0);
+
+		if (dict->getObject(sym) != (present ? sym : NULL)) {
+			return false;
+		}
+		expected += present;
+	}
+	if (dict->getCount() != expected || dict->getObject(missing)) {
+		return false;
+	}
+
+	if (dict->setOptions(0, 0) & OSCollection::kSort) {
+		iter = OSCollectionIterator::withCollection(dict);
+		if (!iter) {
+			return false;
+		}
+		while ((key = OSDynamicCast(OSSymbol, iter->getNextObject()))) {
+			if (prev && key <= prev) {
+				return false;
+			}
+			prev = key;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Builds dictionaries of `n` keys, sorted or not, and checks lookups,
+ * replacements, removals, copies and sorting an existing dictionary,
+ * on either side of kOSDictionaryHashThreshold.
+ */
+static int
+iokit_dictionary_hash_test(int64_t n, int64_t *out)
+{
+	OSSharedPtr<OSArray> syms;
+	OSSharedPtr<OSDictionary> dict, copy;
+	OSSharedPtr<const OSSymbol> missing;
+	char name[48];
+
+	if (n <= 0 || n > 65536) {
+		return EINVAL;
+	}
+
+	syms = OSArray::withCapacity((unsigned int)n);
+	missing = OSSymbol::withCString("iokit_dictionary_hash_test.missing");
+	if (!syms || !missing) {
+		return ENOMEM;
+	}
+	for (int64_t i = 0; i < n; i++) {
+		OSSharedPtr<const OSSymbol> sym;
+
+		snprintf(name, sizeof(name), "iokit_dictionary_hash_test.%lld", i);
+		sym = OSSymbol::withCString(name);
+		if (!sym || !syms->setObject(sym.get())) {
+			return ENOMEM;
+		}
+	}
+
+	for (int sorted = 0; sorted < 3; sorted++) {
+		dict = OSDictionary::withCapacity(1);
+		if (!dict) {
+			return ENOMEM;
+		}
+		if (sorted == 1) {
+			dict->setOptions(OSCollection::kSort, OSCollection::kSort);
+		}
+		for (unsigned int i = 0; i < syms->getCount(); i++) {
+			const OSSymbol *sym = OSDynamicCast(OSSymbol, syms->getObject(i));
+
+			if (!dict->setObject(sym, sym)) {
+				return ENOMEM;
+			}
+		}
+		if (sorted == 2) {
+			// sort a dictionary which is already populated
+			dict->setOptions(OSCollection::kSort, OSCollection::kSort);
+		}
+		if (!iokit_dictionary_check(dict.get(), syms.get(), missing.get(), false)) {
+			return EINVAL;
+		}
+
+		// replacing a value doesn't add an entry
+		const OSSymbol *first = OSDynamicCast(OSSymbol, syms->getObject(0));
+		if (!dict->setObject(first, syms.get()) ||
+		    dict->getObject(first) != syms.get() ||
+		    dict->getCount() != syms->getCount() ||
+		    !dict->setObject(first, first)) {
+			return EINVAL;
+		}
+
+		copy = OSDictionary::withDictionary(dict.get());
+		if (!copy) {
+			return ENOMEM;
+		}
+		if (!iokit_dictionary_check(copy.get(), syms.get(), missing.get(), false)) {
+			return EINVAL;
+		}
+
+		for (unsigned int i = 0; i < syms->getCount(); i += 2) {
+			dict->removeObject(OSDynamicCast(OSSymbol, syms->getObject(i)));
+		}
+		if (!iokit_dictionary_check(dict.get(), syms.get(), missing.get(), true)) {
+			return EINVAL;
+		}
+	}
+
+	*out = 1;
+	return 0;
+}
+SYSCTL_TEST_REGISTER(iokit_dictionary_hash, iokit_dictionary_hash_test);
+#endif /* DEBUG || DEVELOPMENT */
@@ -33,9 +33,9 @@
 #include <sys/cdefs.h>
 
 #include <kern/bits.h>
+#include <kern/clock.h>
 #include <kern/locks.h>
 #include <kern/smr_hash.h>
-#include <kern/thread_call.h>
 
 #if defined(__arm64__)
 #include <arm64/amcc_rorgn.h> /* rorgn_contains */
@@ -59,17 +59,48 @@ static LCK_GRP_DECLARE(lock_group, "OSSymbolPool");
  *
  * (https://www.usenix.org/legacy/event/atc11/tech/final_files/Triplett.pdf)
  *
+ * The table is a scalable hash table (smr_shash) with per-bucket locks,
+ * so that creating symbols concurrently doesn't serialize on a global lock.
+ *
  * One twist is that the OSSymbol_smr_free() callback must be
  * preemption-disabled safe, which means the `kfree_data()` it calls _MUST_ be
  * smaller than KALLOC_SAFE_ALLOC_SIZE. To deal with that, if a Symbol is made
  * with a string that is much larger (should be rare), these go on a lock-based
  * "huge" queue.
+ *
+ * Scalable hash tables can't be enumerated, so symbols which string is
+ * borrowed from their creator (kOSStringNoCopy) and which aren't permanent
+ * are also kept on a lock-based "nocopy" queue, for the benefit of
+ * checkForPageUnload(). Those are inserted in the hash table under the lock.
+ *
+ * Lastly, lookups by C string consult a small per-CPU cache first,
+ * indexed by the address of the C string. Drivers mostly look up symbols
+ * from string constants, which makes this cache hit often, and avoids both
+ * hashing the string and walking the hash table.
+ *
+ * Cache entries are only valid if the string of the cached symbol still
+ * matches the looked up string, and the symbol can still be retained.
+ * Symbols are purged from all caches when they are removed from the hash
+ * table, before their memory can be reused, which makes dereferencing cached
+ * symbols safe inside of an SMR critical section.
  */
 class OSSymbolPool
 {
 	/* empirically most devices have at least 10+k symbols */
 	static constexpr uint32_t MIN_SIZE = 4096;
 
+	/* number of entries of the per-CPU lookup caches */
+	static constexpr uint32_t CACHE_SIZE = 32;
+
+	struct cacheEntry {
+		const char     *key;
+		OSSymbol       *sym;
+	};
+
+	struct cpuCache {
+		cacheEntry      entries[CACHE_SIZE];
+	};
+
 	static inline smrh_key_t
 	OSSymbol_get_key(const OSSymbol *sym)
 	{
@@ -104,18 +135,25 @@ class OSSymbolPool
 		       sym->taggedTryRetain(nullptr);
 	}
 
+	static inline bool
+	OSSymbol_is_nocopy(const OSSymbol *sym)
+	{
+		return (sym->flags & (kOSStringNoCopy | kOSSSymbolPermanent)) ==
+		       kOSStringNoCopy;
+	}
+
 	SMRH_TRAITS_DEFINE_STR(hash_traits, OSSymbol, hashlink,
 	    .domain      = &smr_iokit,
 	    .obj_hash    = OSSymbol_obj_hash,
 	    .obj_equ     = OSSymbol_obj_equ,
 	    .obj_try_get = OSSymbol_obj_try_get);
 
-	mutable lck_mtx_t _mutex;
-	struct smr_hash   _hash;
-	smrq_slist_head   _huge_head;
-	thread_call_t     _tcall;
-	uint32_t          _hugeCount = 0;
-	bool              _tcallScheduled;
+	mutable lck_mtx_t   _mutex;
+	struct smr_shash    _hash;
+	smrq_slist_head     _huge_head;
+	smrq_list_head      _nocopy_head;
+	cpuCache *__zpercpu _cache;
+	uint32_t            _hugeCount = 0;
 
 private:
 
@@ -131,34 +169,31 @@ private:
 		lck_mtx_unlock(&_mutex);
 	}
 
-	inline bool
-	shouldShrink() const
+	static inline uint32_t
+	cacheIndex(const char *cString)
 	{
-		/* shrink if there are more than 2 buckets per 1 symbol */
-		return smr_hash_serialized_should_shrink(&_hash, MIN_SIZE, 2, 1);
+		return os_hash_kernel_pointer(cString) & (CACHE_SIZE - 1);
 	}
 
-	inline bool
-	shouldGrow() const
-	{
-		/* shrink if there less more than 1 bucket per 4 symbol */
-		return smr_hash_serialized_should_grow(&_hash, 1, 4);
-	}
+	OSSymbol *cacheLookup(const char *cString, smrh_key_t key) const;
+
+	void cacheInsert(const char *cString, OSSymbol *sym) const;
+
+	void cachePurge(OSSymbol *sym);
 
 public:
 
-	static void rehash(thread_call_param_t, thread_call_param_t);
 	inline static OSSymbolPool &instance() __pure2;
 
 	OSSymbolPool()
 	{
 		lck_mtx_init(&_mutex, &lock_group, LCK_ATTR_NULL);
 
-		smr_hash_init(&_hash, MIN_SIZE);
+		smr_shash_init(&_hash, SMRSH_BALANCED, MIN_SIZE);
 		smrq_init(&_huge_head);
+		smrq_init(&_nocopy_head);
 
-		_tcall = thread_call_allocate_with_options(rehash, this,
-		    THREAD_CALL_PRIORITY_KERNEL, THREAD_CALL_OPTIONS_ONCE);
+		_cache = zalloc_percpu_permanent_type(cpuCache);
 	}
 	OSSymbolPool(const OSSymbolPool &) = delete;
 	OSSymbolPool(OSSymbolPool &&) = delete;
@@ -176,8 +211,6 @@ public:
 
 	void removeSymbol(OSSymbol *sym);
 
-	void rehash();
-
 	void checkForPageUnload(void *startAddr, void *endAddr);
 };
 
@@ -195,6 +228,56 @@ OSSymbol_is_huge(size_t size)
 	return size > KALLOC_SAFE_ALLOC_SIZE;
 }
 
+/*
+ * Must be called inside an smr_iokit critical section,
+ * returns a retained symbol on success.
+ */
+OSSymbol *
+OSSymbolPool::cacheLookup(const char *cString, smrh_key_t key) const
+{
+	cacheEntry *ce = &zpercpu_get(_cache)->entries[cacheIndex(cString)];
+	OSSymbol *sym = os_atomic_load(&ce->sym, relaxed);
+
+	if (sym && ce->key == cString &&
+	    OSSymbol_obj_equ(&sym->hashlink, key) &&
+	    OSSymbol_obj_try_get(sym)) {
+		return sym;
+	}
+
+	return NULL;
+}
+
+/*
+ * Must be called inside an smr_iokit critical section,
+ * with a retained symbol that is in the hash table.
+ */
+void
+OSSymbolPool::cacheInsert(const char *cString, OSSymbol *sym) const
+{
+	cacheEntry *ce = &zpercpu_get(_cache)->entries[cacheIndex(cString)];
+
+	ce->key = cString;
+	os_atomic_store(&ce->sym, sym, relaxed);
+}
+
+/*
+ * Called once a symbol has been removed from the hash table,
+ * before its memory is retired.
+ */
+void
+OSSymbolPool::cachePurge(OSSymbol *sym)
+{
+	zpercpu_foreach(cache, _cache) {
+		for (uint32_t i = 0; i < CACHE_SIZE; i++) {
+			cacheEntry *ce = &cache->entries[i];
+
+			if (os_atomic_load(&ce->sym, relaxed) == sym) {
+				os_atomic_cmpxchg(&ce->sym, sym, NULL, relaxed);
+			}
+		}
+	}
+}
+
 OSSharedPtr<const OSSymbol>
 OSSymbolPool::findSymbol(smrh_key_t key) const
 {
@@ -203,11 +286,12 @@ OSSymbolPool::findSymbol(smrh_key_t key) const
 
 	if (!OSSymbol_is_huge(key.smrk_len)) {
 		char tmp_buf[128]; /* empirically all keys are < 110 bytes */
+		const char *cString = key.smrk_string;
 		char *copy_s = NULL;
 
 		/*
 		 * rdar://105075708: the key might be in pageable memory,
-		 * and smr_hash_get() disable preemption which prevents
+		 * and smr_shash_get() disable preemption which prevents
 		 * faulting the memory.
 		 */
 		if (key.smrk_len <= sizeof(tmp_buf)) {
@@ -219,7 +303,17 @@ OSSymbolPool::findSymbol(smrh_key_t key) const
 			memcpy(copy_s, key.smrk_opaque, key.smrk_len);
 			key.smrk_string = copy_s;
 		}
-		sym = smr_hash_get(&_hash, key, &hash_traits);
+
+		smr_iokit_enter();
+		sym = cacheLookup(cString, key);
+		if (sym == NULL) {
+			sym = smr_shash_entered_get(&_hash, key, &hash_traits);
+			if (sym) {
+				cacheInsert(cString, sym);
+			}
+		}
+		smr_iokit_leave();
+
 		if (copy_s) {
 			kfree_data(copy_s, key.smrk_len);
 		}
@@ -256,18 +350,16 @@ OSSymbolPool::insertSymbol(
 		symToInsert->flags |= kOSSSymbolPermanent;
 	}
 
-	lock();
-
-	if (!OSSymbol_is_huge(key.smrk_len)) {
-		sym = smr_hash_serialized_get_or_insert(&_hash, key,
-		    &symToInsert->hashlink, &hash_traits);
+	/*
+	 * Compare against the string of the symbol rather than the key,
+	 * as the latter might be in pageable memory (see findSymbol()).
+	 */
+	if (!(symToInsert->flags & kOSStringNoCopy)) {
+		key.smrk_string = symToInsert->string;
+	}
 
-		if (shouldGrow() && !_tcallScheduled &&
-		    startup_phase >= STARTUP_SUB_THREAD_CALL) {
-			_tcallScheduled = true;
-			thread_call_enter(_tcall);
-		}
-	} else {
+	if (OSSymbol_is_huge(key.smrk_len)) {
+		lock();
 		sym = (OSSymbol *)__smr_hash_serialized_find(&_huge_head, key,
 		    &hash_traits.smrht);
 		if (!sym || !OSSymbol_obj_try_get(sym)) {
@@ -276,10 +368,21 @@ OSSymbolPool::insertSymbol(
 			_hugeCount++;
 			sym = NULL;
 		}
+		unlock();
+	} else if (OSSymbol_is_nocopy(symToInsert.get())) {
+		lock();
+		sym = smr_shash_get_or_insert(&_hash, key,
+		    &symToInsert->hashlink, &hash_traits);
+		if (sym == NULL) {
+			smrq_serialized_insert_head(&_nocopy_head,
+			    &symToInsert->nocopylink);
+		}
+		unlock();
+	} else {
+		sym = smr_shash_get_or_insert(&_hash, key,
+		    &symToInsert->hashlink, &hash_traits);
 	}
 
-	unlock();
-
 	if (sym) {
 		symToInsert->flags &= ~(kOSSSymbolHashed | kOSSSymbolPermanent);
 		symToInsert.reset(sym, OSNoRetain);
@@ -289,45 +392,28 @@ OSSymbolPool::insertSymbol(
 void
 OSSymbolPool::removeSymbol(OSSymbol *sym)
 {
-	lock();
-
 	assert(sym->flags & kOSSSymbolHashed);
-	sym->flags &= ~kOSSSymbolHashed;
-
-	if (!OSSymbol_is_huge(sym->length)) {
-		smr_hash_serialized_remove(&_hash, &sym->hashlink, &hash_traits);
 
-		if (shouldShrink() && !_tcallScheduled &&
-		    startup_phase >= STARTUP_SUB_THREAD_CALL) {
-			_tcallScheduled = true;
-			thread_call_enter(_tcall);
-		}
-	} else {
+	if (OSSymbol_is_huge(sym->length)) {
+		lock();
+		sym->flags &= ~kOSSSymbolHashed;
 		smrq_serialized_remove(&_huge_head, &sym->hashlink);
 		_hugeCount--;
-	}
-
-	unlock();
-}
-
-void
-OSSymbolPool::rehash(thread_call_param_t arg0, thread_call_param_t arg1 __unused)
-{
-	reinterpret_cast<OSSymbolPool *>(arg0)->rehash();
-}
-
-void
-OSSymbolPool::rehash()
-{
-	lock();
-	_tcallScheduled = false;
-
-	if (shouldShrink()) {
-		smr_hash_shrink_and_unlock(&_hash, &_mutex, &hash_traits);
-	} else if (shouldGrow()) {
-		smr_hash_grow_and_unlock(&_hash, &_mutex, &hash_traits);
-	} else {
 		unlock();
+	} else if (OSSymbol_is_nocopy(sym)) {
+		lock();
+		/* checkForPageUnload() might have raced with us */
+		if (OSSymbol_is_nocopy(sym)) {
+			smrq_serialized_remove(&_nocopy_head, &sym->nocopylink);
+		}
+		sym->flags &= ~kOSSSymbolHashed;
+		smr_shash_remove(&_hash, &sym->hashlink, &hash_traits);
+		unlock();
+		cachePurge(sym);
+	} else {
+		sym->flags &= ~kOSSSymbolHashed;
+		smr_shash_remove(&_hash, &sym->hashlink, &hash_traits);
+		cachePurge(sym);
 	}
 }
 
@@ -339,7 +425,7 @@ OSSymbolPool::checkForPageUnload(void *startAddr, void *endAddr)
 	bool mustSync = false;
 
 	lock();
-	smr_hash_foreach(sym, &_hash, &hash_traits) {
+	smrq_serialized_foreach_safe(sym, &_nocopy_head, nocopylink) {
 		if (sym->string >= startAddr && sym->string < endAddr) {
 			assert(sym->flags & kOSStringNoCopy);
 
@@ -358,6 +444,7 @@ OSSymbolPool::checkForPageUnload(void *startAddr, void *endAddr)
 			}
 			sym->string = s;
 			sym->flags &= ~kOSStringNoCopy;
+			smrq_serialized_remove(&_nocopy_head, &sym->nocopylink);
 			mustSync = true;
 		}
 	}
@@ -760,4 +847,55 @@ iokit_symbol_basic_test(int64_t size, int64_t *out)
 	return 0;
 }
 SYSCTL_TEST_REGISTER(iokit_symbol_basic, iokit_symbol_basic_test);
+
+/*
+ * Looks up symbols for `iterations` property keys the way drivers do,
+ * and returns how long it took in nanoseconds.
+ *
+ * Userspace calls this concurrently from several threads
+ * to measure how symbol lookups scale with the number of cores.
+ */
+static int
+iokit_symbol_lookup_bench(int64_t iterations, int64_t *out)
+{
+	static const char *keys[] = {
+		"IOProviderClass", "IOClass", "IOMatchCategory",
+		"IOPropertyMatch", "IONameMatch", "IOResourceMatch",
+		"IOParentMatch", "IOPathMatch", "IOLocationMatch",
+		"IOProbeScore", "IOUserClientClass", "IOKitDebug",
+		"IOInterruptSpecifiers", "IOInterruptControllers",
+		"IODeviceMemory", "IOPowerManagement",
+	};
+	OSSharedPtr<const OSSymbol> sym;
+	uint64_t start, elapsed;
+	char buf[32];
+
+	if (iterations <= 0) {
+		return EINVAL;
+	}
+
+	start = mach_absolute_time();
+	for (int64_t i = 0; i < iterations; i++) {
+		const char *key = keys[i % (sizeof(keys) / sizeof(keys[0]))];
+
+		/* every 8th lookup uses a transient buffer, like a parser would */
+		if (i % 8 == 7) {
+			strlcpy(buf, key, sizeof(buf));
+			key = buf;
+		}
+
+		sym = OSSymbol::withCString(key);
+		if (sym == nullptr) {
+			return ENOMEM;
+		}
+		if (!sym->isEqualTo(key)) {
+			return EINVAL;
+		}
+	}
+	absolutetime_to_nanoseconds(mach_absolute_time() - start, &elapsed);
+
+	*out = (int64_t)elapsed;
+	return 0;
+}
+SYSCTL_TEST_REGISTER(iokit_symbol_lookup_bench, iokit_symbol_lookup_bench);
 #endif /* DEBUG || DEVELOPMENT */
@@ -97,9 +97,12 @@ typedef OSDictionary* OSDictionaryPtr;
  * An OSDictionary also grows as necessary to accommodate new key/value pairs,
  * <i>unlike</i> Core Foundation collections (it does not, however, shrink).
  *
- * <b>Note:</b> OSDictionary currently uses a linear search algorithm,
- * and is not designed for high-performance access of many values.
- * It is intended as a simple associative-storage mechanism only.
+ * <b>Note:</b> OSDictionary uses a linear search algorithm
+ * for small dictionaries. Once its capacity grows past a few dozen
+ * entries, it also maintains a hash index of its keys
+ * (keyed by OSSymbol address) so that lookups and insertions
+ * stay constant time on average.
+ * It is still intended as a simple associative-storage mechanism only.
  *
  * <b>Use Restrictions</b>
  *
@@ -948,6 +951,16 @@ public:
 	bool setObject(const OSSymbol *aKey, const OSMetaClassBase *anObject, bool onlyAdd);
 	void sortBySymbol(void);
 	OSPtr<OSArray> copyKeys(void);
+
+	static unsigned int hashBucketCount(unsigned int capacity);
+	static unsigned long storageCount(unsigned int capacity);
+	static unsigned int capacityForStorage(unsigned int storage);
+	bool isHashed(void) const;
+	unsigned int hashLookup(const OSSymbol *aKey) const;
+	void hashInsert(unsigned int index);
+	void hashRemove(unsigned int index);
+	void hashRenumber(unsigned int index, unsigned int oldIndex);
+	void hashRebuild(void);
 #endif /* XNU_KERNEL_PRIVATE */
 
 
@@ -93,6 +93,7 @@ class OSSymbol final : public OSString
 
 private:
 	struct smrq_slink hashlink;
+	struct smrq_link  nocopylink;
 
 	static void initialize();
 
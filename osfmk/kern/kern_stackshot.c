@@ -3240,6 +3240,10 @@ kdp_stackshot_kcdata_format(int pid, uint64_t trace_flags, uint32_t * pBytesTrac
 		struct mem_and_io_snapshot mais = {0};
 		kdp_mem_and_io_snapshot(&mais);
 		kcd_exit_on_error(kcdata_push_data(stackshot_kcdata_p, STACKSHOT_KCTYPE_GLOBAL_MEM_STATS, sizeof(mais), &mais));
+
+		struct compressor_outcome_stats cos;
+		vm_compressor_outcome_stats_get(&cos);
+		kcd_exit_on_error(kcdata_push_data(stackshot_kcdata_p, STACKSHOT_KCTYPE_COMPRESSOR_OUTCOMES, sizeof(cos), &cos));
 	}
 
 #if CONFIG_THREAD_GROUPS
@@ -1083,6 +1083,22 @@ extern struct smr smr_system_sleepable;
 #define smr_iokit_barrier()             smr_barrier(&smr_iokit)
 
 
+/*!
+ * @macro smr_net
+ *
+ * @brief
+ * The SMR domain for networking protocol control blocks.
+ */
+#define smr_net                         smr_system
+#define smr_net_entered()               smr_entered(&smr_net)
+#define smr_net_enter()                 smr_enter(&smr_net)
+#define smr_net_leave()                 smr_leave(&smr_net)
+
+#define smr_net_call(n, sz, cb)         smr_call(&smr_net, n, sz, cb)
+#define smr_net_synchronize()           smr_synchronize(&smr_net)
+#define smr_net_barrier()               smr_barrier(&smr_net)
+
+
 #pragma mark XNU only: implementation details
 
 extern void __smr_domain_init(smr_t);
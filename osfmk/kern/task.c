@@ -1744,6 +1744,8 @@ task_create_internal(
 		new_task->p_switch = 0;
 		new_task->ps_switch = 0;
 		new_task->decompressions = 0;
+		new_task->map_lookup_cache_hits = 0;
+		new_task->map_lookup_cache_misses = 0;
 		new_task->low_mem_notified_warn = 0;
 		new_task->low_mem_notified_critical = 0;
 		new_task->purged_memory_warn = 0;
@@ -1887,6 +1889,8 @@ task_rollup_accounting_info(task_t to_task, task_t from_task)
 	counter_add(&to_task->messages_sent, counter_load(&from_task->messages_sent));
 	counter_add(&to_task->messages_received, counter_load(&from_task->messages_received));
 	to_task->decompressions = from_task->decompressions;
+	to_task->map_lookup_cache_hits = from_task->map_lookup_cache_hits;
+	to_task->map_lookup_cache_misses = from_task->map_lookup_cache_misses;
 	to_task->syscalls_mach = from_task->syscalls_mach;
 	to_task->syscalls_unix = from_task->syscalls_unix;
 	to_task->c_switch = from_task->c_switch;
@@ -5937,6 +5941,18 @@ task_info(
 			    &vm_info->ledger_swapins);
 			*task_info_count = TASK_VM_INFO_REV6_COUNT;
 		}
+		if (original_task_info_count >= TASK_VM_INFO_REV7_COUNT) {
+			thread_t thread;
+			uint64_t hits = task->map_lookup_cache_hits;
+			uint64_t misses = task->map_lookup_cache_misses;
+			queue_iterate(&task->threads, thread, thread_t, task_threads) {
+				hits += thread->t_map_lookup_hits;
+				misses += thread->t_map_lookup_misses;
+			}
+			vm_info->map_lookup_cache_hits = hits;
+			vm_info->map_lookup_cache_misses = misses;
+			*task_info_count = TASK_VM_INFO_REV7_COUNT;
+		}
 
 		break;
 	}
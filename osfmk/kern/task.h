@@ -265,6 +265,8 @@ struct task {
 	counter_t messages_sent;      /* messages sent counter */
 	counter_t messages_received;  /* messages received counter */
 	uint32_t decompressions;      /* decompression counter */
+	uint64_t map_lookup_cache_hits;   /* fault lookup cache hits of terminated threads */
+	uint64_t map_lookup_cache_misses; /* fault lookup cache misses of terminated threads */
 	uint32_t syscalls_mach;       /* mach system call counter */
 	uint32_t syscalls_unix;       /* unix system call counter */
 	uint32_t c_switch;            /* total context switches */
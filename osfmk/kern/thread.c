@@ -1072,6 +1072,8 @@ thread_terminate_queue_invoke(mpsc_queue_chain_t e,
 	task->task_timer_wakeups_bin_2 += thread->thread_timer_wakeups_bin_2;
 	task->task_gpu_ns += ml_gpu_stat(thread);
 	task->decompressions += thread->decompressions;
+	task->map_lookup_cache_hits += thread->t_map_lookup_hits;
+	task->map_lookup_cache_misses += thread->t_map_lookup_misses;
 
 	thread_update_qos_cpu_time(thread);
 
@@ -298,6 +298,17 @@ typedef union thread_rr_state {
 	};
 } thread_rr_state_t;
 
+/*
+ * An entry vm_map_lookup_entry_cached() found, along with the map's
+ * vmmap_serial and vmmap_pin_epoch at the time.
+ */
+struct thread_map_lookup {
+	uint64_t                tml_serial;
+	uint64_t                tml_epoch;
+	struct vm_map_entry    *tml_entry;
+};
+#define THREAD_MAP_LOOKUP_CACHE_SIZE    4
+
 struct thread {
 #if MACH_ASSERT
 #define THREAD_MAGIC 0x1234ABCDDCBA4321ULL
@@ -731,6 +742,12 @@ struct thread {
 	uint64_t                t_page_creation_throttled_soft;
 #endif /* DEVELOPMENT || DEBUG */
 	int                     t_pagein_error;         /* for vm_fault(), holds error from vnop_pagein() */
+	vm_map_t                t_map_fault_pin;        /* map vm_fault() reads under a pin instead of its lock */
+	uint64_t                t_map_fault_pin_epoch;  /* vmmap_pin_epoch the pin was taken in */
+	struct thread_map_lookup t_map_lookup_cache[THREAD_MAP_LOOKUP_CACHE_SIZE];
+	uint32_t                t_map_lookup_next;      /* slot of t_map_lookup_cache a miss replaces */
+	uint64_t                t_map_lookup_hits;      /* per-thread counters to be added to the task's */
+	uint64_t                t_map_lookup_misses;
 
 	mach_port_name_t        ith_voucher_name;
 	ipc_voucher_t           ith_voucher;
@@ -89,12 +89,15 @@
 #include <kern/sched.h>
 #include <kern/locks.h>
 #include <kern/sched_prim.h>
+#include <kern/processor.h>
 #include <kern/misc_protos.h>
 #include <kern/thread_call.h>
 #include <kern/zalloc_internal.h>
 #include <kern/kalloc.h>
 #include <kern/debug.h>
 
+#include <os/hash.h>
+
 #include <prng/random.h>
 
 #include <vm/pmap.h>
@@ -265,11 +268,16 @@ static_assert(sizeof(struct zone_page_metadata) == 16, "validate packing");
  * Magazine of cached allocations.
  *
  * @field zm_next       linkage used by magazine depots.
- * @field zm_elems      an array of @c zc_mag_size() elements.
+ * @field zm_count      the number of elements of a full magazine
+ *                      (the zone's magazine depth at the time it filled up).
+ * @field zm_cluster    the cluster of the CPU which filled the magazine.
+ * @field zm_elems      an array of @c zc_mag_size_max() elements.
  */
 struct zone_magazine {
 	zone_magazine_t         zm_next;
 	smr_seq_t               zm_seq;
+	uint16_t                zm_count;
+	uint16_t                zm_cluster;
 	vm_offset_t             zm_elems[0];
 };
 
@@ -291,7 +299,7 @@ struct zone_magazine {
  * - the Zone Allocator.
  *
  * The per-cpu and recirculation depot layer use magazines (@c zone_magazine_t),
- * which are stacks of up to @c zc_mag_size() elements.
+ * which are stacks of up to @c zone_mag_size() elements.
  *
  * <h2>CPU layer</h2>
  *
@@ -342,12 +350,34 @@ struct zone_magazine {
  * in the depot or shrink it based on the @c zc_grow_level and @c zc_shrink_level
  * thresholds.
  *
+ * Once the depot can't grow any further, sustained contention grows the depth
+ * of the zone's magazines instead (@c z_mag_size), up to @c zc_mag_size_max(),
+ * so that each trip to the recirculation layer moves more elements.
+ * Conversely, zones that have shrunk their depot away entirely also shrink
+ * their magazine depth back, down to @c zc_mag_size_min(), to hold on to
+ * fewer cached elements. Magazines are always allocated for the maximum depth,
+ * and record how many elements they hold when they become full, so that the
+ * depth can change at any time.
+ *
  * The per-cpu layer will attempt to work with its depot, finding both full and
  * empty magazines cached there. If it can't get what it needs, then it will
  * mediate with the zone recirculation layer. Such recirculation is done in
  * batches in order to amortize lock holds.
  * (See @c {zalloc,zfree}_cached_depot_recirculate()).
  *
+ * <h2>Cluster layer</h2>
+ *
+ * On systems with several CPU clusters, non SMR zones also have a cluster
+ * depot per cluster (@c zone_cluster_depot) sitting between the per-cpu layer
+ * and the recirculation layer, indexed by the cluster ID of the processor set
+ * of the CPU (see sched_amp_common.c). CPUs exchange magazines with their
+ * cluster depot, which only spills to (or refills from) the recirculation
+ * layer when it has too many (or not enough) magazines. This keeps magazines,
+ * and the elements they hold, warm in the caches of the cluster that used
+ * them last. Full magazines taken from the recirculation layer which were
+ * filled on another cluster are counted as migrations. Trimming the zone
+ * brings cluster depots back to the size of a per-cpu depot.
+ *
  * The recirculation layer keeps a track of what the minimum amount of magazines
  * it had over time was for each of the full and empty queues. This allows for
  * @c compute_zone_working_set_size() to return memory to the system when a zone
@@ -382,6 +412,29 @@ typedef struct zone_cache {
 	zone_smr_free_cb_t XNU_PTRAUTH_SIGNED_FUNCTION_PTR("zc_free") zc_free;
 } __attribute__((aligned(64))) * zone_cache_t;
 
+/*!
+ * @struct zone_cluster_depot
+ *
+ * @abstract
+ * The per-cluster depot of magazines of a zone.
+ *
+ * @field zcd_lock          a lock protecting all the fields.
+ * @field zcd_depot         the list of full and empty magazines.
+ * @field zcd_spills        number of full magazines given
+ *                          to the recirculation layer.
+ * @field zcd_refills       number of full magazines taken
+ *                          from the recirculation layer.
+ * @field zcd_migrations    number of full magazines taken from
+ *                          the recirculation layer filled on another cluster.
+ */
+struct zone_cluster_depot {
+	hw_lck_ticket_t            zcd_lock;
+	struct zone_depot          zcd_depot;
+	uint64_t                   zcd_spills;
+	uint64_t                   zcd_refills;
+	uint64_t                   zcd_migrations;
+} __attribute__((aligned(64)));
+
 #if !__x86_64__
 static
 #endif
@@ -573,7 +626,18 @@ static int zalloc_simulate_vm_pressure;
  * Zone caching tunables
  *
  * zc_mag_size():
- *   size of magazines, larger to reduce contention at the expense of memory
+ *   initial depth of magazines, larger to reduce contention
+ *   at the expense of memory
+ *
+ * zc_mag_size_max():
+ *   maximum depth magazines can grow to under contention
+ *   (0 to use twice zc_mag_size()).
+ *
+ * zc_mag_adaptive
+ *   whether the depth of magazines adapts to contention (see above).
+ *
+ * zc_cluster_depots
+ *   whether zones use per-cluster depots on multi-cluster systems.
  *
  * zc_enable_level
  *   number of contentions per second after which zone caching engages
@@ -610,6 +674,9 @@ static int zalloc_simulate_vm_pressure;
  *   the zone lock held (and preemption disabled).
  */
 Z_TUNABLE(uint16_t, zc_mag_size, 8);
+static Z_TUNABLE(uint16_t, zc_mag_size_max, 0);
+static Z_TUNABLE(bool, zc_mag_adaptive, true);
+static Z_TUNABLE(bool, zc_cluster_depots, true);
 static Z_TUNABLE(uint32_t, zc_enable_level, 10);
 static Z_TUNABLE(uint32_t, zc_grow_level, 5 * Z_WMA_UNIT);
 static Z_TUNABLE(uint32_t, zc_shrink_level, Z_WMA_UNIT / 2);
@@ -618,7 +685,14 @@ static Z_TUNABLE(uint32_t, zc_autotrim_size, 16 << 10);
 static Z_TUNABLE(uint32_t, zc_autotrim_buckets, 8);
 static Z_TUNABLE(uint32_t, zc_free_batch_size, 256);
 
+static inline uint16_t
+zc_mag_size_min(void)
+{
+	return MAX(zc_mag_size() / 2, 2);
+}
+
 static SECURITY_READ_ONLY_LATE(size_t)    zone_pages_wired_max;
+static SECURITY_READ_ONLY_LATE(uint32_t)  zone_cluster_count = 1;
 static SECURITY_READ_ONLY_LATE(vm_map_t)  zone_submaps[Z_SUBMAP_IDX_COUNT];
 static SECURITY_READ_ONLY_LATE(vm_map_t)  zone_meta_map;
 static char const * const zone_submaps_names[Z_SUBMAP_IDX_COUNT] = {
@@ -2380,6 +2454,35 @@ zone_recirc_unlock_nopreempt(zone_t zone)
 	hw_lck_ticket_unlock_nopreempt(&zone->z_recirc_lock);
 }
 
+static inline void
+zone_cluster_lock_nopreempt_check_contention(
+	zone_t                  zone,
+	struct zone_cluster_depot *zcd)
+{
+	uint32_t ticket;
+
+	if (__probable(hw_lck_ticket_reserve_nopreempt(&zcd->zcd_lock,
+	    &ticket, &zone_locks_grp))) {
+		return;
+	}
+
+	hw_lck_ticket_wait(&zcd->zcd_lock, ticket, NULL, &zone_locks_grp);
+
+	/*
+	 * Contention on the cluster depot means the per-cpu depots
+	 * are too small just like for the recirculation depot.
+	 */
+	if (__probable(!zone_caching_disabled && !zone_exhausted(zone))) {
+		os_atomic_inc(&zone->z_recirc_cont_cur, relaxed);
+	}
+}
+
+static inline void
+zone_cluster_unlock_nopreempt(struct zone_cluster_depot *zcd)
+{
+	hw_lck_ticket_unlock_nopreempt(&zcd->zcd_lock);
+}
+
 static inline void
 zone_lock_nopreempt_check_contention(zone_t zone)
 {
@@ -2543,6 +2646,7 @@ zone_depot_insert_head_full(struct zone_depot *zd, zone_magazine_t mag)
 	if (zd->zd_full++ == 0) {
 		zd->zd_tail = &mag->zm_next;
 	}
+	zd->zd_elems += mag->zm_count;
 	mag->zm_next = zd->zd_head;
 	zd->zd_head = mag;
 }
@@ -2551,6 +2655,7 @@ static inline void
 zone_depot_insert_tail_full(struct zone_depot *zd, zone_magazine_t mag)
 {
 	zd->zd_full++;
+	zd->zd_elems += mag->zm_count;
 	mag->zm_next = *zd->zd_tail;
 	*zd->zd_tail = mag;
 	zd->zd_tail = &mag->zm_next;
@@ -2572,6 +2677,7 @@ zone_depot_pop_head_full(struct zone_depot *zd, zone_t z)
 	assert(zd->zd_full);
 
 	zd->zd_full--;
+	zd->zd_elems -= mag->zm_count;
 	if (z && z->z_recirc_full_min > zd->zd_full) {
 		z->z_recirc_full_min = zd->zd_full;
 	}
@@ -2609,6 +2715,7 @@ zone_depot_move_full(
 	zone_t                  z)
 {
 	zone_magazine_t head, last;
+	uint32_t elems;
 
 	assert(n);
 	assert(src->zd_full >= n);
@@ -2618,11 +2725,14 @@ zone_depot_move_full(
 		z->z_recirc_full_min = src->zd_full;
 	}
 	head = last = src->zd_head;
+	elems = last->zm_count;
 	for (uint32_t i = n; i-- > 1;) {
 		last = last->zm_next;
+		elems += last->zm_count;
 	}
 
 	src->zd_head = last->zm_next;
+	src->zd_elems -= elems;
 	if (src->zd_full == 0) {
 		src->zd_tail = &src->zd_head;
 	}
@@ -2639,6 +2749,7 @@ zone_depot_move_full(
 		dst->zd_tail = &last->zm_next;
 	}
 	dst->zd_full += n;
+	dst->zd_elems += elems;
 
 	return last->zm_seq;
 }
@@ -2681,6 +2792,133 @@ zone_depot_poll(struct zone_depot *depot, smr_t smr)
 	return smr == NULL || smr_poll(smr, depot->zd_head->zm_seq);
 }
 
+/*
+ * Returns the cluster of the current CPU, preemption must be disabled.
+ */
+static inline uint16_t
+zone_cluster_id(void)
+{
+	if (zone_cluster_count == 1) {
+		return 0;
+	}
+	return (uint16_t)MIN(current_processor()->processor_set->pset_cluster_id,
+	    zone_cluster_count - 1);
+}
+
+static inline struct zone_cluster_depot *
+zone_cluster_depot(zone_t zone)
+{
+	return &zone->z_cluster_depots[zone_cluster_id()];
+}
+
+/*
+ * Returns the (approximate) number of elements cached in cluster depots.
+ */
+static uint32_t
+zone_cluster_depots_cached(zone_t zone)
+{
+	uint32_t elems = 0;
+
+	for (uint32_t i = 0; zone->z_cluster_depots && i < zone_cluster_count; i++) {
+		elems += zone->z_cluster_depots[i].zcd_depot.zd_elems;
+	}
+	return elems;
+}
+
+/*
+ * How many full (or empty) magazines a cluster depot keeps
+ * before spilling to the recirculation layer.
+ */
+static inline uint32_t
+zone_cluster_depot_limit(uint32_t depot_max)
+{
+	return 2 * (depot_max + 1);
+}
+
+/*
+ * Makes sure the cluster depot has at least @c full full magazines
+ * and @c empty empty ones, as far as the recirculation layer allows.
+ *
+ * Called with the cluster depot lock held.
+ */
+static void
+zone_cluster_depot_refill(
+	zone_t                  zone,
+	struct zone_cluster_depot *zcd,
+	uint32_t                full,
+	uint32_t                empty)
+{
+	struct zone_depot *zd = &zcd->zcd_depot;
+	uint16_t cluster = (uint16_t)(zcd - zone->z_cluster_depots);
+	zone_magazine_t mag;
+	uint32_t n;
+
+	if (zd->zd_full >= full && zd->zd_empty >= empty) {
+		return;
+	}
+
+	zone_recirc_lock_nopreempt_check_contention(zone);
+
+	if (zd->zd_full < full) {
+		n = MIN(full - zd->zd_full, zone->z_recirc.zd_full);
+		if (n) {
+			mag = zone->z_recirc.zd_head;
+			for (uint32_t i = 0; i < n; i++, mag = mag->zm_next) {
+				if (mag->zm_cluster != cluster) {
+					zcd->zcd_migrations++;
+				}
+			}
+			zone_depot_move_full(zd, &zone->z_recirc, n, zone);
+			zcd->zcd_refills += n;
+		}
+	}
+
+	if (zd->zd_empty < empty) {
+		n = MIN(empty - zd->zd_empty, zone->z_recirc.zd_empty);
+		if (n) {
+			zone_depot_move_empty(zd, &zone->z_recirc, n, zone);
+		}
+	}
+
+	zone_recirc_unlock_nopreempt(zone);
+}
+
+/*
+ * Gives the oldest magazines of a cluster depot which has more than @c limit
+ * full or empty magazines back to the recirculation layer.
+ *
+ * Called with the cluster depot lock held.
+ */
+static void
+zone_cluster_depot_spill(
+	zone_t                  zone,
+	struct zone_cluster_depot *zcd,
+	uint32_t                limit)
+{
+	struct zone_depot *zd = &zcd->zcd_depot;
+	uint32_t full = 0, empty = 0;
+
+	if (zd->zd_full > limit) {
+		full = zd->zd_full - limit / 2;
+	}
+	if (zd->zd_empty > limit) {
+		empty = zd->zd_empty - limit / 2;
+	}
+	if (full == 0 && empty == 0) {
+		return;
+	}
+
+	zone_recirc_lock_nopreempt_check_contention(zone);
+	if (full) {
+		zone_depot_move_full(&zone->z_recirc, zd, full, NULL);
+		zcd->zcd_spills += full;
+	}
+	if (empty) {
+		zone_depot_move_empty(&zone->z_recirc, zd, empty, NULL);
+	}
+	zone_recirc_unlock_nopreempt(zone);
+}
+
 static void
 zone_cache_swap_magazines(zone_cache_t cache)
 {
@@ -2689,8 +2927,8 @@ zone_cache_swap_magazines(zone_cache_t cache)
 	vm_offset_t *elems_a = cache->zc_alloc_elems;
 	vm_offset_t *elems_f = cache->zc_free_elems;
 
-	z_debug_assert(count_a <= zc_mag_size());
-	z_debug_assert(count_f <= zc_mag_size());
+	z_debug_assert(count_a <= zc_mag_size_max());
+	z_debug_assert(count_f <= zc_mag_size_max());
 
 	cache->zc_alloc_cur = count_f;
 	cache->zc_free_cur = count_a;
@@ -2721,15 +2959,22 @@ zone_magazine_replace(zone_cache_t zc, zone_magazine_t mag, bool empty)
 
 	if (empty) {
 		elems = &zc->zc_free_elems;
-		zc->zc_free_cur = 0;
 	} else {
 		elems = &zc->zc_alloc_elems;
-		zc->zc_alloc_cur = zc_mag_size();
 	}
 	old = (zone_magazine_t)((uintptr_t)*elems -
 	    offsetof(struct zone_magazine, zm_elems));
 	*elems = mag->zm_elems;
 
+	if (empty) {
+		old->zm_count = zc->zc_free_cur;
+		old->zm_cluster = zone_cluster_id();
+		zc->zc_free_cur = 0;
+	} else {
+		zc->zc_alloc_cur = mag->zm_count;
+		old->zm_count = 0;
+	}
+
 	return old;
 }
 
@@ -2760,15 +3005,23 @@ zone_magazine_free_list(struct zone_depot *zd)
 	zd->zd_empty = 0;
 }
 
+static uint16_t
+zone_depot_limit_for_mag_size(zone_t zone, uint16_t mag_size)
+{
+	size_t size_per_mag = zone_elem_inner_size(zone) * mag_size;
+	size_t depot_limit;
+
+	depot_limit = zc_pcpu_max() / size_per_mag;
+	return (uint16_t)MIN(depot_limit, INT16_MAX);
+}
+
 void
 zone_enable_caching(zone_t zone)
 {
-	size_t size_per_mag = zone_elem_inner_size(zone) * zc_mag_size();
 	zone_cache_t caches;
-	size_t depot_limit;
 
-	depot_limit = zc_pcpu_max() / size_per_mag;
-	zone->z_depot_limit = (uint16_t)MIN(depot_limit, INT16_MAX);
+	zone->z_mag_size = zc_mag_size();
+	zone->z_depot_limit = zone_depot_limit_for_mag_size(zone, zc_mag_size());
 
 	caches = zalloc_percpu_permanent_type(struct zone_cache);
 	zpercpu_foreach(zc, caches) {
@@ -2778,6 +3031,20 @@ zone_enable_caching(zone_t zone)
 		hw_lck_ticket_init(&zc->zc_depot_lock, &zone_locks_grp);
 	}
 
+	/* SMR magazines must age in the recirculation layer, in order */
+	if (zone_cluster_count > 1 && zc_cluster_depots() && !zone->z_smr &&
+	    zone->z_cluster_depots == NULL) {
+		struct zone_cluster_depot *zcd;
+
+		zcd = zalloc_permanent(sizeof(*zcd) * zone_cluster_count,
+		    ZALIGN(struct zone_cluster_depot));
+		for (uint32_t i = 0; i < zone_cluster_count; i++) {
+			zone_depot_init(&zcd[i].zcd_depot);
+			hw_lck_ticket_init(&zcd[i].zcd_lock, &zone_locks_grp);
+		}
+		zone->z_cluster_depots = zcd;
+	}
+
 	zone_lock(zone);
 	assert(zone->z_pcpu_cache == NULL);
 	zone->z_pcpu_cache = caches;
@@ -2834,7 +3101,6 @@ zpercpu_count(void)
 	return zpercpu_early_count;
 }
 
-#if ZSECURITY_CONFIG(SAD_FENG_SHUI) || CONFIG_PROB_GZALLOC
 /*
  * Returns a random number of a given bit-width.
  *
@@ -2874,6 +3140,7 @@ zalloc_random_mask64(uint32_t bits)
 	return v;
 }
 
+#if ZSECURITY_CONFIG(SAD_FENG_SHUI) || CONFIG_PROB_GZALLOC
 /*
  * Returns a random number within [bound_min, bound_max)
  *
@@ -4640,6 +4907,21 @@ zalloc_expand_drain_exhausted_caches_locked(zone_t z)
 		zone_depot_unlock_nopreempt(zc);
 	}
 
+	for (uint32_t i = 0; z->z_cluster_depots && i < zone_cluster_count; i++) {
+		struct zone_cluster_depot *zcd = &z->z_cluster_depots[i];
+		uint32_t n;
+
+		hw_lck_ticket_lock_nopreempt(&zcd->zcd_lock, &zone_locks_grp);
+		n = zcd->zcd_depot.zd_full;
+		if (n) {
+			zone_recirc_lock_nopreempt(z);
+			zone_depot_move_full(&z->z_recirc,
+			    &zcd->zcd_depot, n, NULL);
+			zone_recirc_unlock_nopreempt(z);
+		}
+		zone_cluster_unlock_nopreempt(zcd);
+	}
+
 	zone_recirc_lock_nopreempt(z);
 	if (z->z_recirc.zd_full) {
 		mag = zone_depot_pop_head_full(&z->z_recirc, z);
@@ -4647,7 +4929,7 @@ zalloc_expand_drain_exhausted_caches_locked(zone_t z)
 	zone_recirc_unlock_nopreempt(z);
 
 	if (mag) {
-		zone_reclaim_elements(z, zc_mag_size(), mag->zm_elems);
+		zone_reclaim_elements(z, mag->zm_count, mag->zm_elems);
 		zone_magazine_free(mag);
 	}
 
@@ -5645,129 +5927,690 @@ panic_display_pgz_uaf_info(bool has_syms, vm_offset_t addr)
 
 #endif /* CONFIG_PROB_GZALLOC */
 #endif /* !ZALLOC_TEST */
-#pragma mark zfree
+#pragma mark zone sampling
 #if !ZALLOC_TEST
 
 /*!
- * @defgroup zfree
+ * @defgroup Zone sampling
  * @{
  *
  * @brief
- * The codepath for zone frees.
+ * Low overhead sampling heap profiler for zones and kalloc.
  *
  * @discussion
- * There are 4 major ways to allocate memory that end up in the zone allocator:
- * - @c zfree()
- * - @c zfree_percpu()
- * - @c kfree*()
- * - @c zfree_permanent()
+ * Unlike zone logging (zlog=) which records every allocation of a few
+ * chosen zones, sampling covers every allocation made through
+ * @c zalloc_ext() (this includes all of kalloc and kalloc_type) but only
+ * records an allocation every @c zone_sample_interval bytes on average.
  *
- * While permanent zones have their own allocation scheme, all other codepaths
- * will eventually go through the @c zfree_ext() choking point.
+ * Each CPU counts down the number of bytes left until its next sample.
+ * Intervals are drawn from an exponential distribution, which makes sampling
+ * a Poisson process over allocated bytes: an allocation is sampled with
+ * a probability that grows with its size, and no call site can systematically
+ * hide between samples. Each sample is weighted with the number of bytes
+ * it statistically stands for (see @c zone_sample_weight()).
+ *
+ * Samples are aggregated per "site", which is a (backtrace, zone) pair,
+ * where the backtrace is a @c btref_t from the btlog backtrace library.
+ * Sites remember how many sampled bytes they allocated in total, and how many
+ * are still live. Live samples are remembered in a table indexed by address,
+ * so that frees can return their weight to their site.
+ *
+ * Frees first consult a small counting filter indexed by a hash of the
+ * address, so that freeing an element that wasn't sampled (the overwhelming
+ * majority) costs a single byte load.
+ *
+ * Both tables have a fixed size and samples that do not fit are dropped
+ * (and counted), which bounds the memory used by the profiler.
+ *
+ * SMR zones are not sampled since their frees do not go through
+ * @c zfree_ext().
+ *
+ *
+ * Tunables:
+ * --------
+ *
+ * zsample_interval=<bytes>
+ *   the average number of allocated bytes between two samples,
+ *   0 (the default) disables sampling.
+ *
+ *   It can also be changed at runtime with the kern.zone_sample.interval
+ *   sysctl. Tables are allocated the first time sampling is enabled.
  */
 
-__header_always_inline void
-zfree_drop(zone_t zone, vm_offset_t addr)
-{
-	vm_offset_t esize = zone_elem_outer_size(zone);
-	struct zone_page_metadata *meta;
-	vm_offset_t eidx;
-
-	meta = zone_element_resolve(zone, addr, &eidx);
-
-	if (!zone_meta_mark_free(meta, eidx)) {
-		zone_meta_double_free_panic(zone, addr, __func__);
-	}
+#define ZONE_SAMPLE_SITES       1024    /* must be a power of 2 */
+#define ZONE_SAMPLE_SITES_MAX   (ZONE_SAMPLE_SITES * 3 / 4)
+#define ZONE_SAMPLE_ELEMS       8192    /* must be a power of 2 */
+#define ZONE_SAMPLE_ELEMS_MAX   (ZONE_SAMPLE_ELEMS / 2)
+#define ZONE_SAMPLE_FILTER      (1u << 16)
+#define ZONE_SAMPLE_INTERVAL_MIN 1024
+
+static_assert(ZONE_SAMPLE_MAX_DEPTH == BTLOG_MAX_DEPTH, "zone_sample_site_info");
+
+struct zone_sample_site {
+	btref_t                 zsite_ref;
+	zone_id_t               zsite_zid;
+	uint32_t                zsite_live_count;
+	uint64_t                zsite_live_bytes;
+	uint64_t                zsite_total_count;
+	uint64_t                zsite_total_bytes;
+};
 
-	vm_offset_t old_size = meta->zm_alloc_size;
-	vm_offset_t max_size = ptoa(meta->zm_chunk_len) + ZM_ALLOC_SIZE_LOCK;
-	vm_offset_t new_size = zone_meta_alloc_size_sub(zone, meta, esize);
+struct zone_sample_elem {
+	vm_offset_t             zse_addr;
+	uint32_t                zse_weight;
+	uint16_t                zse_site;
+};
 
-	if (new_size == 0) {
-		/* whether the page was on the intermediate or all_used, queue, move it to free */
-		zone_meta_requeue(zone, &zone->z_pageq_empty, meta);
-		zone->z_wired_empty += meta->zm_chunk_len;
-	} else if (old_size + esize > max_size) {
-		/* first free element on page, move from all_used */
-		zone_meta_requeue(zone, &zone->z_pageq_partial, meta);
-	}
+static TUNABLE(uint32_t, zone_sample_interval_boot, "zsample_interval", 0);
+static uint32_t                 zone_sample_interval;
+static int64_t PERCPU_DATA(zone_sample_bytes);
+static uint8_t                 *zone_sample_filter;
+static struct zone_sample_site *zone_sample_sites;
+static struct zone_sample_elem *zone_sample_elems;
+static struct zone_sample_stats zone_sample_stats;
+static LCK_MTX_DECLARE(zone_sample_mtx, &zone_locks_grp);
+static LCK_SPIN_DECLARE(zone_sample_lock, &zone_locks_grp);
 
-	if (__improbable(zone->z_exhausted_wait)) {
-		zone->z_exhausted_wait = false;
-		thread_wakeup(&zone->z_expander);
-	}
+static inline uint32_t
+zone_sample_hash(vm_offset_t addr)
+{
+	return os_hash_kernel_pointer((void *)addr);
 }
 
-__attribute__((noinline))
-static void
-zfree_item(zone_t zone, vm_offset_t addr)
+/*
+ * Draws the number of bytes until the next sample, from an exponential
+ * distribution of mean @c interval: -ln(u) * interval for u uniform in (0, 1].
+ *
+ * This is computed in 16.16 fixed point, approximating log2(u)
+ * by linear interpolation between powers of 2 (less than 9% error)
+ * which is plenty for the purpose of picking sampling points.
+ */
+static int64_t
+zone_sample_next(uint32_t interval)
 {
-	/* transfer preemption count to lock */
-	zone_lock_nopreempt_check_contention(zone);
+	uint64_t u = zalloc_random_mask64(32) | 1;
+	uint32_t e = 63 - __builtin_clzll(u);
+	uint64_t mlog2, mln;
 
-	zfree_drop(zone, addr);
-	zone->z_elems_free += 1;
+	/* -log2(u / 2^32) = 32 - (e + mantissa) */
+	mlog2 = ((uint64_t)(32 - e) << 16) - (((u - (1ull << e)) << 16) >> e);
+	/* ln(2) is 45426 in 16.16 */
+	mln = (mlog2 * 45426) >> 16;
 
-	zone_unlock(zone);
+	return (int64_t)((interval * mln) >> 16);
 }
 
-static void
-zfree_cached_depot_recirculate(
-	zone_t                  zone,
-	uint32_t                depot_max,
-	zone_cache_t            cache)
+/*
+ * An allocation of @c size bytes is sampled with probability
+ * 1 - exp(-size / interval), so it stands for size / (1 - exp(-size / interval))
+ * bytes, which is approximated as interval + size / 2 for small allocations,
+ * and size + interval / 2 for large ones (both agree at size == interval).
+ */
+static inline uint32_t
+zone_sample_weight(uint32_t interval, vm_size_t size)
 {
-	smr_t smr = zone_cache_smr(cache);
-	smr_seq_t seq;
-	uint32_t n;
-
-	zone_recirc_lock_nopreempt_check_contention(zone);
+	if (size < interval) {
+		return interval + (uint32_t)size / 2;
+	}
+	return (uint32_t)MIN(size + interval / 2, UINT32_MAX);
+}
 
-	n = cache->zc_depot.zd_full;
-	if (n >= depot_max) {
-		/*
-		 * If SMR is in use, rotate the entire chunk of magazines.
-		 *
-		 * If the head of the recirculation layer is ready to be
-		 * reused, pull them back to refill a little.
-		 */
-		seq = zone_depot_move_full(&zone->z_recirc,
-		    &cache->zc_depot, smr ? n : n - depot_max / 2, NULL);
+static struct zone_sample_site *
+zone_sample_site_find(btref_t ref, zone_id_t zid, bool create)
+{
+	struct zone_sample_site *site;
+	uint32_t idx = (os_hash_jenkins(&ref, sizeof(ref)) ^ zid) %
+	    ZONE_SAMPLE_SITES;
 
-		if (smr) {
-			smr_deferred_advance_commit(smr, seq);
-			if (depot_max > 1 && zone_depot_poll(&zone->z_recirc, smr)) {
-				zone_depot_move_full(&cache->zc_depot,
-				    &zone->z_recirc, depot_max / 2, NULL);
-			}
+	for (;;) {
+		site = &zone_sample_sites[idx];
+		if (site->zsite_ref == ref && site->zsite_zid == zid) {
+			return site;
+		}
+		if (site->zsite_ref == BTREF_NULL) {
+			break;
 		}
+		idx = (idx + 1) % ZONE_SAMPLE_SITES;
 	}
 
-	n = depot_max - cache->zc_depot.zd_full;
-	if (n > zone->z_recirc.zd_empty) {
-		n = zone->z_recirc.zd_empty;
-	}
-	if (n) {
-		zone_depot_move_empty(&cache->zc_depot, &zone->z_recirc,
-		    n, zone);
+	if (!create || zone_sample_stats.zss_sites >= ZONE_SAMPLE_SITES_MAX) {
+		return NULL;
 	}
 
-	zone_recirc_unlock_nopreempt(zone);
+	zone_sample_stats.zss_sites++;
+	site->zsite_ref = ref;
+	site->zsite_zid = zid;
+	return site;
 }
 
-static zone_cache_t
-zfree_cached_recirculate(zone_t zone, zone_cache_t cache)
+static struct zone_sample_elem *
+zone_sample_elem_find(vm_offset_t addr)
 {
-	zone_magazine_t mag = NULL, tmp = NULL;
-	smr_t smr = zone_cache_smr(cache);
+	struct zone_sample_elem *zse;
+	uint32_t idx = zone_sample_hash(addr) % ZONE_SAMPLE_ELEMS;
 
-	if (zone->z_recirc.zd_empty == 0) {
-		mag = zone_magazine_alloc(Z_NOWAIT);
+	for (;;) {
+		zse = &zone_sample_elems[idx];
+		if (zse->zse_addr == addr || zse->zse_addr == 0) {
+			return zse;
+		}
+		idx = (idx + 1) % ZONE_SAMPLE_ELEMS;
 	}
+}
 
-	zone_recirc_lock_nopreempt_check_contention(zone);
+/*
+ * Removes an element from the linear probing table,
+ * moving back the entries of its cluster that need to.
+ */
+static void
+zone_sample_elem_remove(struct zone_sample_elem *zse)
+{
+	struct zone_sample_site *site = &zone_sample_sites[zse->zse_site];
+	uint32_t hole = (uint32_t)(zse - zone_sample_elems);
+	uint32_t fidx = zone_sample_hash(zse->zse_addr) % ZONE_SAMPLE_FILTER;
+	uint32_t idx = hole, home;
 
-	if (mag == NULL && zone->z_recirc.zd_empty) {
+	site->zsite_live_count--;
+	site->zsite_live_bytes -= zse->zse_weight;
+	zone_sample_stats.zss_live_samples--;
+	zone_sample_stats.zss_live_bytes -= zse->zse_weight;
+	if (zone_sample_filter[fidx] != UINT8_MAX) {
+		zone_sample_filter[fidx]--;
+	}
+
+	for (;;) {
+		idx = (idx + 1) % ZONE_SAMPLE_ELEMS;
+		if (zone_sample_elems[idx].zse_addr == 0) {
+			break;
+		}
+		home = zone_sample_hash(zone_sample_elems[idx].zse_addr) %
+		    ZONE_SAMPLE_ELEMS;
+		/* can the entry at idx move to the hole without passing its home? */
+		if ((idx - home) % ZONE_SAMPLE_ELEMS >=
+		    (idx - hole) % ZONE_SAMPLE_ELEMS) {
+			zone_sample_elems[hole] = zone_sample_elems[idx];
+			hole = idx;
+		}
+	}
+	zone_sample_elems[hole] = (struct zone_sample_elem){ };
+}
+
+__attribute__((noinline))
+static void
+zone_sample_record(zone_t zone, vm_offset_t addr, vm_size_t esize, void *fp)
+{
+	uint32_t interval = os_atomic_load(&zone_sample_interval, relaxed);
+	struct zone_sample_site *site;
+	struct zone_sample_elem *zse;
+	btref_get_flags_t flags = 0;
+	btref_t ref;
+	uint32_t weight, fidx;
+
+	if (interval == 0) {
+		*PERCPU_GET(zone_sample_bytes) = INT64_MAX;
+		return;
+	}
+
+	/*
+	 * Note: like for PGZ, accessing zone_sample_bytes is racy
+	 *       but this is acceptable for a statistical profiler.
+	 */
+	*PERCPU_GET(zone_sample_bytes) = zone_sample_next(interval);
+
+	if (zone->z_smr) {
+		return;
+	}
+
+	if (get_preemption_level() || zone_supports_vm(zone)) {
+		/*
+		 * VM zones can be used by btlog, avoid reentrancy issues.
+		 */
+		flags = BTREF_GET_NOWAIT;
+	}
+
+	ref = btref_get(fp, flags);
+	if (ref == BTREF_NULL) {
+		os_atomic_inc(&zone_sample_stats.zss_dropped, relaxed);
+		return;
+	}
+
+	weight = zone_sample_weight(interval, esize);
+	fidx = zone_sample_hash(addr) % ZONE_SAMPLE_FILTER;
+
+	lck_spin_lock(&zone_sample_lock);
+
+	if (os_atomic_load(&zone_sample_interval, relaxed) == 0) {
+		/* sampling got disabled and the tables reset */
+		goto out;
+	}
+
+	zone_sample_stats.zss_samples++;
+
+	site = zone_sample_site_find(ref, zone_index(zone), true);
+	if (site == NULL) {
+		os_atomic_inc(&zone_sample_stats.zss_dropped, relaxed);
+		goto out;
+	}
+	if (site->zsite_ref == ref && site->zsite_total_count == 0) {
+		/* the site took ownership of the reference */
+		ref = BTREF_NULL;
+	}
+	site->zsite_total_count++;
+	site->zsite_total_bytes += weight;
+
+	zse = zone_sample_elem_find(addr);
+	if (zse->zse_addr) {
+		/*
+		 * The element was freed behind our back without a zfree_ext(),
+		 * (e.g. zfree_nozero_n()) and reallocated, forget the old sample.
+		 */
+		zone_sample_elem_remove(zse);
+		zse = zone_sample_elem_find(addr);
+	}
+	if (zone_sample_stats.zss_live_samples >= ZONE_SAMPLE_ELEMS_MAX) {
+		os_atomic_inc(&zone_sample_stats.zss_dropped, relaxed);
+		goto out;
+	}
+
+	*zse = (struct zone_sample_elem){
+		.zse_addr   = addr,
+		.zse_weight = weight,
+		.zse_site   = (uint16_t)(site - zone_sample_sites),
+	};
+	site->zsite_live_count++;
+	site->zsite_live_bytes += weight;
+	zone_sample_stats.zss_live_samples++;
+	zone_sample_stats.zss_live_bytes += weight;
+	if (zone_sample_filter[fidx] != UINT8_MAX) {
+		zone_sample_filter[fidx]++;
+	}
+
+out:
+	lck_spin_unlock(&zone_sample_lock);
+	if (ref != BTREF_NULL) {
+		btref_put(ref);
+	}
+}
+
+__attribute__((noinline))
+static void
+zone_sample_forget(vm_offset_t addr)
+{
+	struct zone_sample_elem *zse;
+
+	lck_spin_lock(&zone_sample_lock);
+	if (zone_sample_elems) {
+		zse = zone_sample_elem_find(addr);
+		if (zse->zse_addr) {
+			zone_sample_elem_remove(zse);
+		}
+	}
+	lck_spin_unlock(&zone_sample_lock);
+}
+
+/*
+ * Called on every allocation made by zalloc_ext(), must be very cheap.
+ */
+__attribute__((always_inline))
+static inline void
+zone_sample_alloc(zone_t zone, vm_offset_t addr, vm_size_t esize, void *fp)
+{
+	int64_t *counterp = PERCPU_GET(zone_sample_bytes);
+	int64_t cnt = *counterp - (int64_t)esize;
+
+	*counterp = cnt;
+	if (__improbable(cnt < 0)) {
+		zone_sample_record(zone, addr, esize, fp);
+	}
+}
+
+/*
+ * Called on every free made by zfree_ext(), must be very cheap.
+ */
+__attribute__((always_inline))
+static inline void
+zone_sample_free(vm_offset_t addr)
+{
+	uint8_t *filter = os_atomic_load(&zone_sample_filter, relaxed);
+
+	if (__improbable(filter != NULL) &&
+	    filter[zone_sample_hash(addr) % ZONE_SAMPLE_FILTER]) {
+		zone_sample_forget(addr);
+	}
+}
+
+/*
+ * Must be called with zone_sample_mtx held.
+ */
+static void
+zone_sample_reset(void)
+{
+	struct zone_sample_site *site;
+	btref_t ref;
+
+	for (uint32_t i = 0; i < ZONE_SAMPLE_SITES; i++) {
+		lck_spin_lock(&zone_sample_lock);
+		site = &zone_sample_sites[i];
+		ref = site->zsite_ref;
+		*site = (struct zone_sample_site){ };
+		lck_spin_unlock(&zone_sample_lock);
+
+		if (ref != BTREF_NULL) {
+			btref_put(ref);
+		}
+	}
+
+	lck_spin_lock(&zone_sample_lock);
+	bzero(zone_sample_elems, sizeof(struct zone_sample_elem) * ZONE_SAMPLE_ELEMS);
+	bzero(zone_sample_filter, ZONE_SAMPLE_FILTER);
+	zone_sample_stats = (struct zone_sample_stats){ };
+	lck_spin_unlock(&zone_sample_lock);
+}
+
+kern_return_t
+zone_sample_set_interval(uint32_t interval)
+{
+	if (interval && interval < ZONE_SAMPLE_INTERVAL_MIN) {
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	lck_mtx_lock(&zone_sample_mtx);
+
+	if (interval && zone_sample_sites == NULL) {
+		zone_sample_sites = kalloc_type(struct zone_sample_site,
+		    ZONE_SAMPLE_SITES, Z_WAITOK_ZERO_NOFAIL);
+		zone_sample_elems = kalloc_type(struct zone_sample_elem,
+		    ZONE_SAMPLE_ELEMS, Z_WAITOK_ZERO_NOFAIL);
+		zone_sample_filter = kalloc_data(ZONE_SAMPLE_FILTER,
+		    Z_WAITOK_ZERO_NOFAIL);
+	}
+
+	if (interval == 0) {
+		/*
+		 * Stop sampling first, frees are still forgotten
+		 * while the filter is around.
+		 *
+		 * The tables are never freed, so that racing samplers
+		 * and frees looking at them are always safe.
+		 */
+		os_atomic_store(&zone_sample_interval, 0, relaxed);
+		percpu_foreach(counter, zone_sample_bytes) {
+			*counter = INT64_MAX;
+		}
+		if (zone_sample_sites) {
+			zone_sample_reset();
+		}
+	} else {
+		os_atomic_store(&zone_sample_interval, interval, relaxed);
+		percpu_foreach(counter, zone_sample_bytes) {
+			*counter = zone_sample_next(interval);
+		}
+	}
+
+	lck_mtx_unlock(&zone_sample_mtx);
+
+	return KERN_SUCCESS;
+}
+
+uint32_t
+zone_sample_get_interval(void)
+{
+	return os_atomic_load(&zone_sample_interval, relaxed);
+}
+
+void
+zone_sample_get_stats(struct zone_sample_stats *stats)
+{
+	lck_spin_lock(&zone_sample_lock);
+	*stats = zone_sample_stats;
+	lck_spin_unlock(&zone_sample_lock);
+	stats->zss_interval = zone_sample_get_interval();
+}
+
+void
+zone_sample_site_foreach(void (^block)(const struct zone_sample_site_info *))
+{
+	struct zone_sample_site_info info;
+	struct zone_sample_site site;
+	zone_t z;
+
+	lck_mtx_lock(&zone_sample_mtx);
+
+	for (uint32_t i = 0; zone_sample_sites && i < ZONE_SAMPLE_SITES; i++) {
+		lck_spin_lock(&zone_sample_lock);
+		site = zone_sample_sites[i];
+		lck_spin_unlock(&zone_sample_lock);
+
+		if (site.zsite_ref == BTREF_NULL) {
+			continue;
+		}
+
+		/* sites hold a reference, and resets need zone_sample_mtx */
+		bzero(&info, sizeof(info));
+		z = &zone_array[site.zsite_zid];
+		snprintf(info.zssi_zone, sizeof(info.zssi_zone), "%s%s",
+		    zone_heap_name(z), zone_name(z));
+		info.zssi_live_count = site.zsite_live_count;
+		info.zssi_live_bytes = site.zsite_live_bytes;
+		info.zssi_total_count = site.zsite_total_count;
+		info.zssi_total_bytes = site.zsite_total_bytes;
+		info.zssi_depth = btref_decode_unslide(site.zsite_ref, info.zssi_frames);
+
+		block(&info);
+	}
+
+	lck_mtx_unlock(&zone_sample_mtx);
+}
+
+__startup_func
+static void
+zone_sample_init(void)
+{
+	if (zone_sample_interval_boot) {
+		zone_sample_set_interval(MAX(zone_sample_interval_boot,
+		    ZONE_SAMPLE_INTERVAL_MIN));
+	}
+}
+STARTUP(EARLY_BOOT, STARTUP_RANK_MIDDLE, zone_sample_init);
+
+/*! @} */
+#endif /* !ZALLOC_TEST */
+#pragma mark zfree
+#if !ZALLOC_TEST
+
+/*!
+ * @defgroup zfree
+ * @{
+ *
+ * @brief
+ * The codepath for zone frees.
+ *
+ * @discussion
+ * There are 4 major ways to allocate memory that end up in the zone allocator:
+ * - @c zfree()
+ * - @c zfree_percpu()
+ * - @c kfree*()
+ * - @c zfree_permanent()
+ *
+ * While permanent zones have their own allocation scheme, all other codepaths
+ * will eventually go through the @c zfree_ext() choking point.
+ */
+
+__header_always_inline void
+zfree_drop(zone_t zone, vm_offset_t addr)
+{
+	vm_offset_t esize = zone_elem_outer_size(zone);
+	struct zone_page_metadata *meta;
+	vm_offset_t eidx;
+
+	meta = zone_element_resolve(zone, addr, &eidx);
+
+	if (!zone_meta_mark_free(meta, eidx)) {
+		zone_meta_double_free_panic(zone, addr, __func__);
+	}
+
+	vm_offset_t old_size = meta->zm_alloc_size;
+	vm_offset_t max_size = ptoa(meta->zm_chunk_len) + ZM_ALLOC_SIZE_LOCK;
+	vm_offset_t new_size = zone_meta_alloc_size_sub(zone, meta, esize);
+
+	if (new_size == 0) {
+		/* whether the page was on the intermediate or all_used, queue, move it to free */
+		zone_meta_requeue(zone, &zone->z_pageq_empty, meta);
+		zone->z_wired_empty += meta->zm_chunk_len;
+	} else if (old_size + esize > max_size) {
+		/* first free element on page, move from all_used */
+		zone_meta_requeue(zone, &zone->z_pageq_partial, meta);
+	}
+
+	if (__improbable(zone->z_exhausted_wait)) {
+		zone->z_exhausted_wait = false;
+		thread_wakeup(&zone->z_expander);
+	}
+}
+
+__attribute__((noinline))
+static void
+zfree_item(zone_t zone, vm_offset_t addr)
+{
+	/* transfer preemption count to lock */
+	zone_lock_nopreempt_check_contention(zone);
+
+	zfree_drop(zone, addr);
+	zone->z_elems_free += 1;
+
+	zone_unlock(zone);
+}
+
+static void
+zfree_cached_cluster_depot_recirculate(
+	zone_t                  zone,
+	uint32_t                depot_max,
+	zone_cache_t            cache)
+{
+	struct zone_cluster_depot *zcd = zone_cluster_depot(zone);
+	struct zone_depot *zd = &zcd->zcd_depot;
+	uint32_t n;
+
+	zone_cluster_lock_nopreempt_check_contention(zone, zcd);
+
+	n = cache->zc_depot.zd_full;
+	if (n >= depot_max) {
+		zone_depot_move_full(zd, &cache->zc_depot,
+		    n - depot_max / 2, NULL);
+	}
+
+	n = depot_max - cache->zc_depot.zd_full;
+	zone_cluster_depot_refill(zone, zcd, 0, n);
+	n = MIN(n, zd->zd_empty);
+	if (n) {
+		zone_depot_move_empty(&cache->zc_depot, zd, n, NULL);
+	}
+
+	zone_cluster_depot_spill(zone, zcd, zone_cluster_depot_limit(depot_max));
+	zone_cluster_unlock_nopreempt(zcd);
+}
+
+static void
+zfree_cached_depot_recirculate(
+	zone_t                  zone,
+	uint32_t                depot_max,
+	zone_cache_t            cache)
+{
+	smr_t smr = zone_cache_smr(cache);
+	smr_seq_t seq;
+	uint32_t n;
+
+	if (zone->z_cluster_depots) {
+		return zfree_cached_cluster_depot_recirculate(zone,
+		    depot_max, cache);
+	}
+
+	zone_recirc_lock_nopreempt_check_contention(zone);
+
+	n = cache->zc_depot.zd_full;
+	if (n >= depot_max) {
+		/*
+		 * If SMR is in use, rotate the entire chunk of magazines.
+		 *
+		 * If the head of the recirculation layer is ready to be
+		 * reused, pull them back to refill a little.
+		 */
+		seq = zone_depot_move_full(&zone->z_recirc,
+		    &cache->zc_depot, smr ? n : n - depot_max / 2, NULL);
+
+		if (smr) {
+			smr_deferred_advance_commit(smr, seq);
+			if (depot_max > 1 && zone_depot_poll(&zone->z_recirc, smr)) {
+				zone_depot_move_full(&cache->zc_depot,
+				    &zone->z_recirc, depot_max / 2, NULL);
+			}
+		}
+	}
+
+	n = depot_max - cache->zc_depot.zd_full;
+	if (n > zone->z_recirc.zd_empty) {
+		n = zone->z_recirc.zd_empty;
+	}
+	if (n) {
+		zone_depot_move_empty(&cache->zc_depot, &zone->z_recirc,
+		    n, zone);
+	}
+
+	zone_recirc_unlock_nopreempt(zone);
+}
+
+static zone_cache_t
+zfree_cached_cluster_recirculate(zone_t zone, zone_cache_t cache)
+{
+	struct zone_cluster_depot *zcd = zone_cluster_depot(zone);
+	struct zone_depot *zd = &zcd->zcd_depot;
+	zone_magazine_t mag = NULL, tmp = NULL;
+
+	if (zd->zd_empty == 0 && zone->z_recirc.zd_empty == 0) {
+		mag = zone_magazine_alloc(Z_NOWAIT);
+	}
+
+	zone_cluster_lock_nopreempt_check_contention(zone, zcd);
+
+	if (mag == NULL) {
+		zone_cluster_depot_refill(zone, zcd, 0, 1);
+		if (zd->zd_empty) {
+			mag = zone_depot_pop_head_empty(zd, NULL);
+		}
+	}
+	if (mag) {
+		tmp = zone_magazine_replace(cache, mag, true);
+		if (zone_security_array[zone_index(zone)].z_lifo) {
+			zone_depot_insert_head_full(zd, tmp);
+		} else {
+			zone_depot_insert_tail_full(zd, tmp);
+		}
+		zone_cluster_depot_spill(zone, zcd, zone_cluster_depot_limit(0));
+	}
+
+	zone_cluster_unlock_nopreempt(zcd);
+
+	return mag ? cache : NULL;
+}
+
+static zone_cache_t
+zfree_cached_recirculate(zone_t zone, zone_cache_t cache)
+{
+	zone_magazine_t mag = NULL, tmp = NULL;
+	smr_t smr = zone_cache_smr(cache);
+
+	if (zone->z_cluster_depots) {
+		return zfree_cached_cluster_recirculate(zone, cache);
+	}
+
+	if (zone->z_recirc.zd_empty == 0) {
+		mag = zone_magazine_alloc(Z_NOWAIT);
+	}
+
+	zone_recirc_lock_nopreempt_check_contention(zone);
+
+	if (mag == NULL && zone->z_recirc.zd_empty) {
 		mag = zone_depot_pop_head_empty(&zone->z_recirc, zone);
 		__builtin_assume(mag);
 	}
@@ -5827,11 +6670,13 @@ zfree_cached_get_pcpu_cache(zone_t zone, int cpu)
 {
 	zone_cache_t cache = zpercpu_get_cpu(zone->z_pcpu_cache, cpu);
 
-	if (__probable(cache->zc_free_cur < zc_mag_size())) {
+	uint16_t mag_size = zone_mag_size(zone);
+
+	if (__probable(cache->zc_free_cur < mag_size)) {
 		return cache;
 	}
 
-	if (__probable(cache->zc_alloc_cur < zc_mag_size())) {
+	if (__probable(cache->zc_alloc_cur < mag_size)) {
 		zone_cache_swap_magazines(cache);
 		return cache;
 	}
@@ -5846,7 +6691,8 @@ zfree_cached_get_pcpu_cache_smr(zone_t zone, int cpu)
 	zone_cache_t cache = zpercpu_get_cpu(zone->z_pcpu_cache, cpu);
 	size_t idx = cache->zc_free_cur;
 
-	if (__probable(idx + 1 < zc_mag_size())) {
+	/* SMR zones never change their magazine depth, see zone_mag_resize() */
+	if (__probable(idx + 1 < zone_mag_size(zone))) {
 		return cache;
 	}
 
@@ -5863,7 +6709,7 @@ zfree_cached_get_pcpu_cache_smr(zone_t zone, int cpu)
 	 * mechanically reduces the pace of these commits as usage increases.
 	 */
 
-	if (__probable(idx + 1 == zc_mag_size())) {
+	if (__probable(idx + 1 == zone_mag_size(zone))) {
 		zone_magazine_t mag;
 
 		mag = (zone_magazine_t)((uintptr_t)cache->zc_free_elems -
@@ -5957,6 +6803,7 @@ zfree_ext(zone_t zone, zone_stats_t zstats, void *addr, uint64_t combined_size)
 	DTRACE_VM2(zfree, zone_t, zone, void*, elem);
 
 	ZFREE_LOG(zone, elem, 1);
+	zone_sample_free(elem);
 	elem = __zcache_mark_invalid(zone, elem, combined_size);
 
 	disable_preemption();
@@ -5998,9 +6845,14 @@ zcache_free_stack_to_cpu(
 	zone_cache_ops_t        ops,
 	bool                    zero)
 {
-	size_t       n = MIN(zc_mag_size() - cache->zc_free_cur, stack.z_count);
+	uint16_t     mag_size = zone_mag_size(zone_by_id(zid));
+	size_t       n;
 	vm_offset_t *p;
 
+	/* the depth might have shrunk since zfree_cached_get_pcpu_cache() */
+	n = mag_size > cache->zc_free_cur ? mag_size - cache->zc_free_cur : 1;
+	n = MIN(n, stack.z_count);
+
 	stack.z_count -= n;
 	cache->zc_free_cur += n;
 	p = cache->zc_free_elems + cache->zc_free_cur;
@@ -6481,6 +7333,7 @@ zalloc_return(
 	zalloc_validate_element(zone, addr, elem_size, flags);
 #endif /* ZALLOC_ENABLE_ZERO_CHECK */
 	ZALLOC_LOG(zone, addr, 1);
+	zone_sample_alloc(zone, addr, elem_size, __builtin_frame_address(0));
 
 	DTRACE_VM2(zalloc, zone_t, zone, void*, addr);
 	return (struct kalloc_result){ (void *)addr, elem_size };
@@ -6550,7 +7403,7 @@ zalloc_cached_import(
 	zalloc_flags_t          flags,
 	zone_cache_t            cache)
 {
-	uint16_t n_elems = zc_mag_size();
+	uint16_t n_elems = zone_mag_size(zone);
 
 	zone_lock_nopreempt(zone);
 
@@ -6569,6 +7422,35 @@ zalloc_cached_import(
 	zone_unlock_nopreempt(zone);
 }
 
+static void
+zalloc_cached_cluster_depot_recirculate(
+	zone_t                  zone,
+	uint32_t                depot_max,
+	zone_cache_t            cache)
+{
+	struct zone_cluster_depot *zcd = zone_cluster_depot(zone);
+	struct zone_depot *zd = &zcd->zcd_depot;
+	uint32_t n;
+
+	zone_cluster_lock_nopreempt_check_contention(zone, zcd);
+
+	n = cache->zc_depot.zd_empty;
+	if (n >= depot_max) {
+		zone_depot_move_empty(zd, &cache->zc_depot,
+		    n - depot_max / 2, NULL);
+	}
+
+	n = depot_max - cache->zc_depot.zd_empty;
+	zone_cluster_depot_refill(zone, zcd, n, 0);
+	n = MIN(n, zd->zd_full);
+	if (n) {
+		zone_depot_move_full(&cache->zc_depot, zd, n, NULL);
+	}
+
+	zone_cluster_depot_spill(zone, zcd, zone_cluster_depot_limit(depot_max));
+	zone_cluster_unlock_nopreempt(zcd);
+}
+
 static void
 zalloc_cached_depot_recirculate(
 	zone_t                  zone,
@@ -6579,6 +7461,11 @@ zalloc_cached_depot_recirculate(
 	smr_seq_t seq;
 	uint32_t n;
 
+	if (zone->z_cluster_depots) {
+		return zalloc_cached_cluster_depot_recirculate(zone,
+		    depot_max, cache);
+	}
+
 	zone_recirc_lock_nopreempt_check_contention(zone);
 
 	n = cache->zc_depot.zd_empty;
@@ -6618,7 +7505,7 @@ zalloc_cached_reuse_smr(zone_t z, zone_cache_t cache, zone_magazine_t mag)
 	zone_smr_free_cb_t zc_free = cache->zc_free;
 	vm_size_t esize = zone_elem_inner_size(z);
 
-	for (uint16_t i = 0; i < zc_mag_size(); i++) {
+	for (uint16_t i = 0; i < mag->zm_count; i++) {
 		vm_offset_t elem = mag->zm_elems[i];
 
 		zc_free((void *)elem, zone_elem_inner_size(z));
@@ -6628,6 +7515,32 @@ zalloc_cached_reuse_smr(zone_t z, zone_cache_t cache, zone_magazine_t mag)
 	}
 }
 
+static void
+zalloc_cached_cluster_recirculate(
+	zone_t                  zone,
+	zone_cache_t            cache)
+{
+	struct zone_cluster_depot *zcd = zone_cluster_depot(zone);
+	struct zone_depot *zd = &zcd->zcd_depot;
+	zone_magazine_t mag;
+
+	if (zd->zd_full == 0 && zone->z_recirc.zd_full == 0) {
+		return;
+	}
+
+	zone_cluster_lock_nopreempt_check_contention(zone, zcd);
+
+	zone_cluster_depot_refill(zone, zcd, 1, 0);
+	if (zd->zd_full) {
+		mag = zone_depot_pop_head_full(zd, NULL);
+		mag = zone_magazine_replace(cache, mag, false);
+		zone_depot_insert_head_empty(zd, mag);
+		zone_cluster_depot_spill(zone, zcd, zone_cluster_depot_limit(0));
+	}
+
+	zone_cluster_unlock_nopreempt(zcd);
+}
+
 static void
 zalloc_cached_recirculate(
 	zone_t                  zone,
@@ -6682,6 +7595,8 @@ zalloc_cached_prime(
 		}
 
 		zone_depot_unlock_nopreempt(cache);
+	} else if (zone->z_cluster_depots) {
+		zalloc_cached_cluster_recirculate(zone, cache);
 	} else if (zone->z_recirc.zd_full) {
 		zalloc_cached_recirculate(zone, cache);
 	}
@@ -7429,7 +8344,7 @@ zone_reclaim_chunk(
 static void
 zone_reclaim_elements(zone_t z, uint16_t n, vm_offset_t *elems)
 {
-	z_debug_assert(n <= zc_mag_size());
+	z_debug_assert(n <= zc_mag_size_max());
 
 	for (uint16_t i = 0; i < n; i++) {
 		vm_offset_t addr = elems[i];
@@ -7443,7 +8358,7 @@ zone_reclaim_elements(zone_t z, uint16_t n, vm_offset_t *elems)
 static void
 zcache_reclaim_elements(zone_id_t zid, uint16_t n, vm_offset_t *elems)
 {
-	z_debug_assert(n <= zc_mag_size());
+	z_debug_assert(n <= zc_mag_size_max());
 	zone_cache_ops_t ops = zcache_ops[zid];
 
 	for (uint16_t i = 0; i < n; i++) {
@@ -7456,23 +8371,37 @@ zcache_reclaim_elements(zone_id_t zid, uint16_t n, vm_offset_t *elems)
 	os_atomic_sub(&zone_by_id(zid)->z_elems_avail, n, relaxed);
 }
 
+static void
+zone_depot_trim_one(struct zone_depot *src, uint32_t target, struct zone_depot *zd)
+{
+	if (src->zd_full > (target + 1) / 2) {
+		uint32_t n = src->zd_full - (target + 1) / 2;
+		zone_depot_move_full(zd, src, n, NULL);
+	}
+
+	if (src->zd_empty > target / 2) {
+		uint32_t n = src->zd_empty - target / 2;
+		zone_depot_move_empty(zd, src, n, NULL);
+	}
+}
+
 static void
 zone_depot_trim(zone_t z, uint32_t target, struct zone_depot *zd)
 {
 	zpercpu_foreach(zc, z->z_pcpu_cache) {
 		zone_depot_lock(zc);
+		zone_depot_trim_one(&zc->zc_depot, target, zd);
+		zone_depot_unlock(zc);
+	}
 
-		if (zc->zc_depot.zd_full > (target + 1) / 2) {
-			uint32_t n = zc->zc_depot.zd_full - (target + 1) / 2;
-			zone_depot_move_full(zd, &zc->zc_depot, n, NULL);
-		}
+	if (z->z_cluster_depots) {
+		for (uint32_t i = 0; i < zone_cluster_count; i++) {
+			struct zone_cluster_depot *zcd = &z->z_cluster_depots[i];
 
-		if (zc->zc_depot.zd_empty > target / 2) {
-			uint32_t n = zc->zc_depot.zd_empty - target / 2;
-			zone_depot_move_empty(zd, &zc->zc_depot, n, NULL);
+			hw_lck_ticket_lock(&zcd->zcd_lock, &zone_locks_grp);
+			zone_depot_trim_one(&zcd->zcd_depot, target, zd);
+			hw_lck_ticket_unlock(&zcd->zcd_lock);
 		}
-
-		zone_depot_unlock(zc);
 	}
 }
 
@@ -7592,6 +8521,23 @@ zone_reclaim_recirc_trim(zone_t z, struct zone_depot *zd)
 	}
 }
 
+/*
+ * Trimmed cluster depots keep as many full and empty magazines
+ * as a per-cpu depot holds: what a CPU of the cluster asks for
+ * in one go at most.
+ */
+static void
+zone_reclaim_cluster_trim(zone_t z, struct zone_depot *zd)
+{
+	for (uint32_t i = 0; z->z_cluster_depots && i < zone_cluster_count; i++) {
+		struct zone_cluster_depot *zcd = &z->z_cluster_depots[i];
+
+		hw_lck_ticket_lock_nopreempt(&zcd->zcd_lock, &zone_locks_grp);
+		zone_depot_trim_one(&zcd->zcd_depot, 2 * z->z_depot_size, zd);
+		zone_cluster_unlock_nopreempt(zcd);
+	}
+}
+
 /*!
  * @function zone_reclaim
  *
@@ -7662,6 +8608,7 @@ zone_reclaim(zone_t z, zone_reclaim_mode_t mode)
 		 */
 		if (mode == ZONE_RECLAIM_TRIM) {
 			zone_reclaim_recirc_trim(z, &zd);
+			zone_reclaim_cluster_trim(z, &zd);
 		} else {
 			zone_reclaim_recirc_drain(z, &zd);
 		}
@@ -7672,17 +8619,19 @@ zone_reclaim(zone_t z, zone_reclaim_mode_t mode)
 			smr_t smr = zone_cache_smr(cache);
 
 			while (zd.zd_full) {
+				uint16_t count;
+
 				mag = zone_depot_pop_head_full(&zd, NULL);
+				count = mag->zm_count;
 				if (smr) {
 					smr_wait(smr, mag->zm_seq);
 					zalloc_cached_reuse_smr(z, cache, mag);
-					freed += zc_mag_size();
+					freed += count;
 				}
-				zone_reclaim_elements(z, zc_mag_size(),
-				    mag->zm_elems);
+				zone_reclaim_elements(z, count, mag->zm_elems);
 				zone_depot_insert_head_empty(&zd, mag);
 
-				freed += zc_mag_size();
+				freed += count;
 				if (freed >= zc_free_batch_size()) {
 					zone_unlock(z);
 					zone_magazine_free_list(&zd);
@@ -7700,7 +8649,7 @@ zone_reclaim(zone_t z, zone_reclaim_mode_t mode)
 
 			while (zd.zd_full) {
 				mag = zone_depot_pop_head_full(&zd, NULL);
-				zcache_reclaim_elements(zid, zc_mag_size(),
+				zcache_reclaim_elements(zid, mag->zm_count,
 				    mag->zm_elems);
 				zone_magazine_free(mag);
 			}
@@ -7853,6 +8802,31 @@ zone_gc_drain(void)
 	zone_gc(ZONE_GC_DRAIN);
 }
 
+/*
+ * Whether zone_reclaim_cluster_trim() would free enough to bother,
+ * in the same terms as the recirculation layer checks below.
+ */
+static bool
+zone_cluster_trim_needed(zone_t z)
+{
+	uint32_t keep = z->z_depot_size;
+	uint32_t e_n = 0, f_n = 0;
+
+	for (uint32_t i = 0; i < zone_cluster_count; i++) {
+		struct zone_depot *zd = &z->z_cluster_depots[i].zcd_depot;
+
+		e_n += zd->zd_empty > keep ? zd->zd_empty - keep : 0;
+		f_n += zd->zd_full > keep ? zd->zd_full - keep : 0;
+	}
+
+	if (e_n > zc_autotrim_buckets()) {
+		return true;
+	}
+
+	return f_n * z->z_mag_size > z->z_elems_rsv &&
+	       f_n * z->z_mag_size * zone_elem_inner_size(z) > zc_autotrim_size();
+}
+
 static bool
 zone_trim_needed(zone_t z)
 {
@@ -7875,13 +8849,13 @@ zone_trim_needed(zone_t z)
 			return true;
 		}
 
-		if (f_n * zc_mag_size() > z->z_elems_rsv * Z_WMA_UNIT &&
-		    f_n * zc_mag_size() * zone_elem_inner_size(z) >
+		if (f_n * z->z_mag_size > z->z_elems_rsv * Z_WMA_UNIT &&
+		    f_n * z->z_mag_size * zone_elem_inner_size(z) >
 		    zc_autotrim_size() * Z_WMA_UNIT) {
 			return true;
 		}
 
-		return false;
+		return z->z_cluster_depots && zone_cluster_trim_needed(z);
 	}
 
 	if (!zone_pva_is_null(z->z_pageq_empty)) {
@@ -7921,6 +8895,88 @@ zone_trim_async(__unused thread_call_param_t p0, __unused thread_call_param_t p1
 	current_thread()->options &= ~TH_OPT_ZONE_PRIV;
 }
 
+/*!
+ * @function zone_mag_resize
+ *
+ * @brief
+ * Grows or shrinks the depth of the magazines of a cached zone by one step.
+ *
+ * @discussion
+ * Full magazines remember how many elements they hold,
+ * so the new depth only applies to magazines filled from now on.
+ *
+ * SMR zones tag their magazines when they are one element away from being
+ * full, and keep a fixed depth.
+ *
+ * Must be called with the zone lock held.
+ *
+ * @returns whether the depth changed.
+ */
+static bool
+zone_mag_resize(zone_t z, bool grow)
+{
+	uint16_t size = z->z_mag_size;
+
+	if (!zc_mag_adaptive() || z->z_smr) {
+		return false;
+	}
+
+	if (grow) {
+		size = MIN(size + 2, zc_mag_size_max());
+	} else {
+		size = MAX(size - 1, zc_mag_size_min());
+	}
+	if (size == z->z_mag_size) {
+		return false;
+	}
+
+	os_atomic_store(&z->z_mag_size, size, relaxed);
+	z->z_depot_limit = zone_depot_limit_for_mag_size(z, size);
+	if (z->z_depot_size > z->z_depot_limit) {
+		z->z_depot_size = z->z_depot_limit;
+		z->z_depot_cleanup = true;
+	}
+	return true;
+}
+
+void
+zone_cache_info_foreach(void (^block)(const struct zone_cache_info *))
+{
+	zone_foreach(z) {
+		struct zone_cache_info zci = { };
+
+		if (z->z_self != z || z->z_pcpu_cache == NULL) {
+			continue;
+		}
+
+		snprintf(zci.zci_name, sizeof(zci.zci_name), "%s%s",
+		    zone_heap_name(z), zone_name(z));
+
+		zone_lock(z);
+		zci.zci_mag_size = z->z_mag_size;
+		zci.zci_depot_size = z->z_depot_size;
+		zci.zci_depot_limit = z->z_depot_limit;
+		zci.zci_mag_size_max = zc_mag_size_max();
+		zci.zci_recirc_cont_wma = z->z_recirc_cont_wma;
+		zpercpu_foreach(zc, z->z_pcpu_cache) {
+			zci.zci_cached += zc->zc_alloc_cur + zc->zc_free_cur;
+			zci.zci_cached += zc->zc_depot.zd_elems;
+		}
+		zci.zci_cached += z->z_recirc.zd_elems;
+		zci.zci_cached += zone_cluster_depots_cached(z);
+		for (uint32_t i = 0; z->z_cluster_depots && i < zone_cluster_count; i++) {
+			struct zone_cluster_depot *zcd = &z->z_cluster_depots[i];
+
+			zci.zci_cluster_spills += zcd->zcd_spills;
+			zci.zci_cluster_refills += zcd->zcd_refills;
+			zci.zci_cluster_migrations += zcd->zcd_migrations;
+		}
+		zone_unlock(z);
+
+		block(&zci);
+	}
+}
+
 void
 compute_zone_working_set_size(__unused void *param)
 {
@@ -7979,13 +9035,26 @@ compute_zone_working_set_size(__unused void *param)
 			if (zone_exhausted(z)) {
 				z->z_depot_size = 0;
 				z->z_depot_cleanup = true;
+			} else if (size == z->z_depot_limit && cur > zc_grow_level() &&
+			    zone_mag_resize(z, true)) {
+				/*
+				 * The depot can't grow any further,
+				 * make magazines deeper instead.
+				 */
+				cur = (zc_grow_level() + zc_shrink_level()) / 2;
+			} else if (size == 0 && cur <= zc_shrink_level() &&
+			    zone_mag_resize(z, false)) {
+				/*
+				 * Cold zone with no depot left,
+				 * make magazines shallower.
+				 */
 			} else if (size < z->z_depot_limit && cur > zc_grow_level()) {
 				/*
 				 * lose history on purpose now
 				 * that we just grew, to give
 				 * the sytem time to adjust.
 				 */
-				cur  = (zc_grow_level() + zc_shrink_level()) / 2;
+				cur = (zc_grow_level() + zc_shrink_level()) / 2;
 				size = size ? (3 * size + 2) / 2 : 2;
 				z->z_depot_size = MIN(z->z_depot_limit, size);
 			} else if (size > 0 && cur <= zc_shrink_level()) {
@@ -8368,8 +9437,9 @@ get_zone_info(
 	if (z->z_pcpu_cache) {
 		zpercpu_foreach(zc, z->z_pcpu_cache) {
 			cached += zc->zc_alloc_cur + zc->zc_free_cur;
-			cached += zc->zc_depot.zd_full * zc_mag_size();
+			cached += zc->zc_depot.zd_elems;
 		}
+		cached += zone_cluster_depots_cached(z);
 	}
 	zone_unlock(z);
 
@@ -9003,8 +10073,9 @@ zone_get_stats(
 		zpercpu_foreach(zc, zone->z_pcpu_cache) {
 			stats->zbs_cached += zc->zc_alloc_cur +
 			    zc->zc_free_cur +
-			    zc->zc_depot.zd_full * zc_mag_size();
+			    zc->zc_depot.zd_elems;
 		}
+		stats->zbs_cached += zone_cluster_depots_cached(zone);
 	}
 
 	stats->zbs_free = zone_count_free(zone) + stats->zbs_cached;
@@ -9569,6 +10640,10 @@ zone_enable_smr(zone_t zone, struct smr *smr, zone_smr_free_cb_t free_cb)
 	assert(!zone_security_array[zone_index(zone)].z_lifo);
 	assert((smr->smr_flags & SMR_SLEEPABLE) == 0);
 
+	zone_lock(zone);
+	zone->z_smr = true;
+	zone_unlock(zone);
+
 	if (!zone->z_pcpu_cache) {
 		zone_enable_caching(zone);
 	}
@@ -9579,7 +10654,11 @@ zone_enable_smr(zone_t zone, struct smr *smr, zone_smr_free_cb_t free_cb)
 		it->zc_smr = smr;
 		it->zc_free = free_cb;
 	}
-	zone->z_smr = true;
+	/*
+	 * The zone was made with ZC_CACHING: forget about
+	 * its cluster depots, which are still empty.
+	 */
+	zone->z_cluster_depots = NULL;
 
 	zone_unlock(zone);
 }
@@ -9792,6 +10871,17 @@ zone_bootstrap(void)
 			_zc_mag_size = 10;
 		}
 	}
+	if (_zc_mag_size_max == 0) {
+		_zc_mag_size_max = zc_mag_adaptive() ? 2 * _zc_mag_size : _zc_mag_size;
+	}
+	_zc_mag_size_max = MAX(_zc_mag_size_max, _zc_mag_size);
+
+#if __arm64__
+	/*
+	 * Clusters are known from the device tree, way before zalloc.
+	 */
+	zone_cluster_count = MIN((uint32_t)ml_get_max_cluster_number() + 1, MAX_PSETS);
+#endif /* __arm64__ */
 
 	/*
 	 * Initialize random used to scramble early allocations
@@ -9800,6 +10890,11 @@ zone_bootstrap(void)
 		random_bool_init(&zone_bool_gen[cpu].zbg_bg);
 	}
 
+	/*
+	 * Do not sample allocations until zone_sample_set_interval() is called.
+	 */
+	*PERCPU_GET_MASTER(zone_sample_bytes) = INT64_MAX;
+
 #if CONFIG_PROB_GZALLOC
 	/*
 	 * Set pgz_sample_counter on the boot CPU so that we do not sample
@@ -10335,7 +11430,7 @@ zone_init(void)
 	});
 
 	zc_magazine_zone = zone_create("zcc_magazine_zone", sizeof(struct zone_magazine) +
-	    zc_mag_size() * sizeof(vm_offset_t),
+	    zc_mag_size_max() * sizeof(vm_offset_t),
 	    ZC_VM | ZC_NOCACHING | ZC_ZFREE_CLEARMEM | ZC_PGZ_USE_GUARDS);
 	zone_raise_reserve(zc_magazine_zone, (uint16_t)(2 * zpercpu_count()));
 
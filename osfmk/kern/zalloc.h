@@ -2594,6 +2594,94 @@ extern uint32_t                 zone_map_jetsam_limit;
 
 extern kern_return_t zone_map_jetsam_set_limit(uint32_t value);
 
+/*!
+ * @struct zone_cache_info
+ *
+ * @brief
+ * Snapshot of the caching layer state of a zone,
+ * exported by the kern.zone_cache_info sysctl.
+ */
+struct zone_cache_info {
+	char                zci_name[ZONE_NAME_MAX_LEN];
+	uint16_t            zci_mag_size;
+	uint16_t            zci_depot_size;
+	uint16_t            zci_depot_limit;
+	uint16_t            zci_mag_size_max;
+	uint32_t            zci_recirc_cont_wma;
+	uint32_t            zci_cached;
+	uint64_t            zci_cluster_spills;
+	uint64_t            zci_cluster_refills;
+	uint64_t            zci_cluster_migrations;
+};
+
+/*
+ * Calls the block for each zone with caching enabled.
+ */
+extern void zone_cache_info_foreach(
+	void (^block)(const struct zone_cache_info *));
+
+#define ZONE_SAMPLE_MAX_DEPTH   15
+
+/*!
+ * @struct zone_sample_stats
+ *
+ * @brief
+ * Global statistics of the zone sampling profiler,
+ * exported by the kern.zone_sample.stats sysctl.
+ *
+ * @field zss_interval          average bytes between samples (0 if disabled).
+ * @field zss_samples           number of samples taken.
+ * @field zss_dropped           samples dropped for lack of room or memory.
+ * @field zss_sites             number of (backtrace, zone) sites.
+ * @field zss_live_samples      number of sampled elements not freed yet.
+ * @field zss_live_bytes        estimated bytes the live samples stand for.
+ */
+struct zone_sample_stats {
+	uint32_t            zss_interval;
+	uint32_t            zss_sites;
+	uint64_t            zss_samples;
+	uint64_t            zss_dropped;
+	uint64_t            zss_live_samples;
+	uint64_t            zss_live_bytes;
+};
+
+/*!
+ * @struct zone_sample_site_info
+ *
+ * @brief
+ * Sampled allocations of a given backtrace in a given zone,
+ * exported to root by the kern.zone_sample.sites sysctl.
+ *
+ * @discussion
+ * Byte counts are estimates of the real amount of memory allocated,
+ * derived from the samples weights.
+ */
+struct zone_sample_site_info {
+	char                zssi_zone[ZONE_NAME_MAX_LEN];
+	uint32_t            zssi_depth;
+	uint32_t            zssi_live_count;
+	uint64_t            zssi_live_bytes;
+	uint64_t            zssi_total_count;
+	uint64_t            zssi_total_bytes;
+	mach_vm_address_t   zssi_frames[ZONE_SAMPLE_MAX_DEPTH];
+};
+
+/*
+ * Sets the average number of bytes allocated between two samples,
+ * 0 disables sampling and discards all samples.
+ */
+extern kern_return_t zone_sample_set_interval(uint32_t interval);
+
+extern uint32_t zone_sample_get_interval(void);
+
+extern void zone_sample_get_stats(struct zone_sample_stats *stats);
+
+/*
+ * Calls the block for each site with samples, with unslid backtraces.
+ */
+extern void zone_sample_site_foreach(
+	void (^block)(const struct zone_sample_site_info *));
+
 extern zone_t percpu_u64_zone;
 
 #pragma GCC visibility pop
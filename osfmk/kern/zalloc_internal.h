@@ -154,7 +154,9 @@ typedef struct zone_magazine *zone_magazine_t;
  *
  * @discussion
  * The data structure is a "STAILQ" and an "SLIST" combined with counters
- * to know their lengths in O(1). Here is a graphical example:
+ * to know their lengths in O(1). @c zd_elems tracks how many elements
+ * the full magazines hold, which isn't @c zd_full times the magazine size
+ * once that size has been changed at runtime. Here is a graphical example:
  *
  *      zd_full = 3
  *      zd_empty = 1
@@ -168,6 +170,7 @@ typedef struct zone_magazine *zone_magazine_t;
 struct zone_depot {
 	uint32_t            zd_full;
 	uint32_t            zd_empty;
+	uint32_t            zd_elems;   /* sum of zm_count of full magazines */
 	zone_magazine_t     zd_head;
 	zone_magazine_t    *zd_tail;
 };
@@ -315,6 +318,15 @@ struct zone {
 	 *   magazines in the depot over time, with "min" being the minimum
 	 *   it hit for the current period, and "wma" the weighted moving
 	 *   average of those value.
+	 *
+	 * z_mag_size:
+	 *   current depth of the magazines of this zone, adjusted based
+	 *   on z_recirc_cont_wma along with the depot size, and bounded
+	 *   by zc_mag_size_max(). Mutated under the zone lock, read racily.
+	 *
+	 * z_cluster_depots:
+	 *   per-cluster depots sitting between the per-cpu caches and z_recirc,
+	 *   or NULL (single cluster systems, SMR zones).
 	 */
 	struct zone_cache  *__zpercpu z_pcpu_cache;
 	struct zone_depot   z_recirc;
@@ -335,6 +347,8 @@ struct zone {
 
 	uint16_t            z_depot_size;
 	uint16_t            z_depot_limit;
+	uint16_t            z_mag_size;
+	struct zone_cluster_depot *z_cluster_depots;
 
 	uint8_t             z_cacheline2[0] __attribute__((aligned(64)));
 
@@ -674,10 +688,16 @@ zone_security_config(zone_t z)
 	return zone_security_array[zid];
 }
 
+static inline uint16_t
+zone_mag_size(zone_t zone)
+{
+	return os_atomic_load(&zone->z_mag_size, relaxed);
+}
+
 static inline uint32_t
 zone_count_free(zone_t zone)
 {
-	return zone->z_elems_free + zone->z_recirc.zd_full * _zc_mag_size;
+	return zone->z_elems_free + zone->z_recirc.zd_elems;
 }
 
 static inline uint32_t
@@ -422,12 +422,18 @@ struct task_vm_info {
 
 	/* added for rev6 */
 	int64_t ledger_swapins;
+
+	/* added for rev7 */
+	uint64_t map_lookup_cache_hits;     /* fault lookups found in the thread's cache */
+	uint64_t map_lookup_cache_misses;   /* fault lookups that walked the map */
 };
 typedef struct task_vm_info     task_vm_info_data_t;
 typedef struct task_vm_info     *task_vm_info_t;
 #define TASK_VM_INFO_COUNT      ((mach_msg_type_number_t) \
 	        (sizeof (task_vm_info_data_t) / sizeof (natural_t)))
-#define TASK_VM_INFO_REV6_COUNT TASK_VM_INFO_COUNT
+#define TASK_VM_INFO_REV7_COUNT TASK_VM_INFO_COUNT
+#define TASK_VM_INFO_REV6_COUNT /* doesn't include map lookup cache counts */ \
+	((mach_msg_type_number_t) (TASK_VM_INFO_REV7_COUNT - 4))
 #define TASK_VM_INFO_REV5_COUNT /* doesn't include ledger swapins */ \
 	((mach_msg_type_number_t) (TASK_VM_INFO_REV6_COUNT - 2))
 #define TASK_VM_INFO_REV4_COUNT /* doesn't include decompressions */ \
@@ -66,7 +66,10 @@
 extern "C" {
 #endif
 
+#ifndef PAGE_SIZE
 #include <mach/vm_param.h>
+#endif
+#include <stdbool.h>
 
 
 #define WKdm_SCRATCH_BUF_SIZE_INTERNAL  PAGE_SIZE
@@ -110,6 +113,23 @@ WKdm_compress_new(const WK_word* src_buf,
     unsigned int limit);
 #endif
 
+/*
+ * Portable C implementation, format compatible with the above.
+ * Uses SSE2/NEON where available unless WKdm_sw_simd_enabled is false.
+ */
+extern int WKdm_sw_simd_enabled;
+
+int
+WKdm_compress_sw(const WK_word* src_buf,
+    WK_word* dest_buf,
+    WK_word* scratch,
+    unsigned int limit);
+bool
+WKdm_decompress_sw(const WK_word* src_buf,
+    WK_word* dest_buf,
+    WK_word* scratch,
+    unsigned int bytes);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,806 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Portable C implementation of the WKdm_new page compressor.
+ *
+ * This produces exactly the same stream as the hand written
+ * WKdm_compress_new / WKdm_compress_{4k,16k} assembly (see
+ * osfmk/x86_64/WKdmCompress_new.s for a description of the format),
+ * including the zero/single value page, mostly-zero (MZV) page and
+ * early abort heuristics, so that either implementation can decode
+ * the output of the other.
+ *
+ * It is used when the compressor is asked to avoid the assembly
+ * (vm_compressor_force_sw_wkdm), and it is what the host side codec
+ * harness in tests/vm/compressor_codec_bench.c links against.
+ *
+ * The tag/qpos/low bits packing and unpacking stages and the zero run
+ * detection have SSE2 and NEON variants. The dictionary walk itself is
+ * inherently serial and stays scalar. Both variants are instantiated from
+ * the same code and the vector one is picked at runtime unless
+ * WKdm_sw_simd_enabled is cleared; tests/vm/wkdm_sw_bench.c checks
+ * them against each other.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "WKdm_new.h"
+
+#if defined(__arm64__) || defined(__aarch64__)
+#if __has_include(<arm_neon.h>)
+#include <arm_neon.h>
+#define WKDM_SW_NEON                    1
+#endif
+#elif defined(__x86_64__) && !KERNEL
+/* the x86_64 kernel is built with -msoft-float */
+#include <emmintrin.h>
+#define WKDM_SW_SSE2                    1
+#endif
+
+#ifndef WKDM_SW_NEON
+#define WKDM_SW_NEON                    0
+#endif
+#ifndef WKDM_SW_SSE2
+#define WKDM_SW_SSE2                    0
+#endif
+#define WKDM_SW_SIMD                    (WKDM_SW_NEON || WKDM_SW_SSE2)
+
+#define WKDM_SW_INLINE                  static inline __attribute__((always_inline))
+
+#define WKDM_SW_HEADER_WORDS            3
+#define WKDM_SW_MZV_MAGIC               17185
+
+/* early abort: checkpoint after this many bytes of a 4k page (scaled) */
+#define WKDM_SW_CHKPT_BYTES             416
+#define WKDM_SW_CHKPT_WORDS             (WKDM_SW_CHKPT_BYTES / 4)
+#define WKDM_SW_CHKPT_TAG_BYTES         (WKDM_SW_CHKPT_BYTES / 16)
+#define WKDM_SW_CHKPT_SHRUNK_BYTES      426
+
+#define WKDM_SW_TAG_ZERO                0
+#define WKDM_SW_TAG_PARTIAL             1
+#define WKDM_SW_TAG_MISS                2
+#define WKDM_SW_TAG_EXACT               3
+
+int WKdm_sw_simd_enabled = WKDM_SW_SIMD;
+
+/*
+ * Maps bits [17:10] of an input word to one of the 16 dictionary entries.
+ * This is _hashLookupTable_new (which holds byte offsets) divided by 4.
+ */
+const uint8_t WKdm_sw_hash_table[256] = {
+	0, 13, 2, 14, 4, 3, 7, 5, 1, 9, 12, 6, 11, 10, 8, 15,
+	2, 3, 7, 5, 1, 15, 4, 9, 6, 12, 11, 8, 13, 14, 10, 3,
+	2, 12, 4, 13, 15, 7, 14, 8, 5, 6, 9, 10, 11, 1, 2, 10,
+	15, 8, 5, 11, 1, 9, 13, 6, 4, 14, 12, 3, 7, 4, 2, 10,
+	9, 7, 8, 3, 1, 11, 13, 5, 6, 12, 15, 14, 10, 12, 2, 8,
+	7, 9, 1, 11, 5, 14, 15, 6, 13, 4, 3, 3, 1, 12, 5, 2,
+	13, 4, 15, 6, 9, 11, 7, 14, 10, 8, 9, 5, 6, 15, 10, 11,
+	13, 4, 8, 1, 12, 2, 7, 14, 3, 7, 8, 10, 13, 9, 4, 5,
+	12, 2, 1, 15, 6, 14, 11, 3, 2, 9, 6, 7, 4, 15, 5, 14,
+	8, 10, 12, 3, 1, 11, 13, 11, 10, 3, 14, 2, 9, 6, 15, 7,
+	12, 1, 8, 5, 4, 13, 15, 3, 6, 9, 2, 1, 4, 14, 12, 11,
+	10, 13, 8, 5, 7, 8, 3, 9, 7, 6, 14, 10, 4, 13, 11, 1,
+	5, 15, 2, 12, 12, 13, 3, 5, 8, 11, 9, 7, 1, 10, 6, 2,
+	14, 15, 4, 9, 8, 2, 10, 1, 13, 6, 11, 5, 3, 7, 12, 14,
+	4, 15, 1, 13, 15, 12, 5, 4, 14, 11, 6, 2, 10, 3, 8, 7,
+	9, 6, 8, 3, 1, 5, 4, 15, 9, 7, 2, 13, 10, 12, 11, 14,
+};
+
+#define WKDM_SW_HASH(w)                 WKdm_sw_hash_table[((w) >> 10) & 0xff]
+
+/*
+ * Compression state of the scan pass.
+ */
+struct WKdm_sw_scan {
+	WK_word         dictionary[16];
+	uint8_t        *next_qpos;
+	uint16_t       *next_lowbits;
+	WK_word        *next_full;
+	int             byte_count;
+};
+
+WKDM_SW_INLINE uint32_t
+WKdm_sw_load32(const void *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+WKDM_SW_INLINE uint16_t
+WKdm_sw_load16(const void *p)
+{
+	uint16_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+WKDM_SW_INLINE void
+WKdm_sw_store32(void *p, uint32_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+WKDM_SW_INLINE void
+WKdm_sw_store16(void *p, uint16_t v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+/*
+ * Size estimate used by both the early abort checkpoint and the
+ * mostly-zero packer decision. This mirrors the fixed point arithmetic
+ * of the assembly exactly (2/3 is approximated by 1365 >> 11), since it
+ * decides which encoding gets emitted.
+ */
+WKDM_SW_INLINE uint32_t
+WKdm_sw_packed_estimate(uint32_t nlowbits, uint32_t nmisses, uint32_t nqpos)
+{
+	return ((nlowbits * 2 * 1365) >> 11) + nmisses * 4 + (nqpos >> 1);
+}
+
+/*
+ * Classifies one input word, returns false when the budget is exhausted.
+ */
+WKDM_SW_INLINE bool
+WKdm_sw_record(struct WKdm_sw_scan *st, uint8_t *tag, WK_word input)
+{
+	uint32_t dict_index;
+	WK_word  dict_word;
+
+	if (input == 0) {
+		*tag = WKDM_SW_TAG_ZERO;
+		return true;
+	}
+
+	dict_index = WKDM_SW_HASH(input);
+	dict_word = st->dictionary[dict_index];
+
+	if (dict_word == input) {
+		*tag = WKDM_SW_TAG_EXACT;
+		*st->next_qpos++ = (uint8_t)dict_index;
+	} else if (((input ^ dict_word) >> 10) == 0) {
+		*tag = WKDM_SW_TAG_PARTIAL;
+		*st->next_qpos++ = (uint8_t)dict_index;
+		*st->next_lowbits++ = (uint16_t)(input & 0x3ff);
+		st->dictionary[dict_index] = input;
+	} else {
+		*tag = WKDM_SW_TAG_MISS;
+		*st->next_full++ = input;
+		st->dictionary[dict_index] = input;
+		st->byte_count -= 4;
+		if (st->byte_count <= 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#pragma mark SIMD helpers
+
+#if WKDM_SW_SSE2
+
+WKDM_SW_INLINE bool
+WKdm_sw_is_zero16(const void *p)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff;
+}
+
+/* transposes a 4x4 matrix of 32 bit values */
+WKDM_SW_INLINE void
+WKdm_sw_transpose4(__m128i *a, __m128i *b, __m128i *c, __m128i *d)
+{
+	__m128i t0 = _mm_unpacklo_epi32(*a, *b);
+	__m128i t1 = _mm_unpacklo_epi32(*c, *d);
+	__m128i t2 = _mm_unpackhi_epi32(*a, *b);
+	__m128i t3 = _mm_unpackhi_epi32(*c, *d);
+
+	*a = _mm_unpacklo_epi64(t0, t1);
+	*b = _mm_unpackhi_epi64(t0, t1);
+	*c = _mm_unpacklo_epi64(t2, t3);
+	*d = _mm_unpackhi_epi64(t2, t3);
+}
+
+/* 64 tags into 4 words */
+WKDM_SW_INLINE void
+WKdm_sw_pack_tags64(WK_word *dest, const uint8_t *tags)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *)(tags + 0));
+	__m128i b = _mm_loadu_si128((const __m128i *)(tags + 16));
+	__m128i c = _mm_loadu_si128((const __m128i *)(tags + 32));
+	__m128i d = _mm_loadu_si128((const __m128i *)(tags + 48));
+
+	WKdm_sw_transpose4(&a, &b, &c, &d);
+	a = _mm_or_si128(a, _mm_slli_epi32(b, 2));
+	a = _mm_or_si128(a, _mm_slli_epi32(c, 4));
+	a = _mm_or_si128(a, _mm_slli_epi32(d, 6));
+	_mm_storeu_si128((__m128i *)dest, a);
+}
+
+/* 4 words into 64 tags */
+WKDM_SW_INLINE void
+WKdm_sw_unpack_tags64(uint8_t *tags, const WK_word *src)
+{
+	__m128i w = _mm_loadu_si128((const __m128i *)src);
+	__m128i m = _mm_set1_epi8(3);
+	__m128i a = _mm_and_si128(w, m);
+	__m128i b = _mm_and_si128(_mm_srli_epi32(w, 2), m);
+	__m128i c = _mm_and_si128(_mm_srli_epi32(w, 4), m);
+	__m128i d = _mm_and_si128(_mm_srli_epi32(w, 6), m);
+
+	WKdm_sw_transpose4(&a, &b, &c, &d);
+	_mm_storeu_si128((__m128i *)(tags + 0), a);
+	_mm_storeu_si128((__m128i *)(tags + 16), b);
+	_mm_storeu_si128((__m128i *)(tags + 32), c);
+	_mm_storeu_si128((__m128i *)(tags + 48), d);
+}
+
+/* 32 queue positions into 4 words */
+WKDM_SW_INLINE void
+WKdm_sw_pack_qpos32(WK_word *dest, const uint8_t *qpos)
+{
+	__m128i a = _mm_loadu_si128((const __m128i *)(qpos + 0));
+	__m128i b = _mm_loadu_si128((const __m128i *)(qpos + 16));
+	__m128 ev, od;
+
+	/* even 32 bit lanes hold the low nibbles, odd lanes the high ones */
+	ev = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0));
+	od = _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(3, 1, 3, 1));
+	_mm_storeu_si128((__m128i *)dest, _mm_or_si128(_mm_castps_si128(ev),
+	    _mm_slli_epi32(_mm_castps_si128(od), 4)));
+}
+
+/* 4 words into 32 queue positions */
+WKDM_SW_INLINE void
+WKdm_sw_unpack_qpos32(uint8_t *qpos, const WK_word *src)
+{
+	__m128i w = _mm_loadu_si128((const __m128i *)src);
+	__m128i m = _mm_set1_epi8(0xf);
+	__m128i lo = _mm_and_si128(w, m);
+	__m128i hi = _mm_and_si128(_mm_srli_epi32(w, 4), m);
+
+	_mm_storeu_si128((__m128i *)(qpos + 0), _mm_unpacklo_epi32(lo, hi));
+	_mm_storeu_si128((__m128i *)(qpos + 16), _mm_unpackhi_epi32(lo, hi));
+}
+
+/*
+ * 12 ten bit values into 4 words. Reads 2 bytes past the 12th value.
+ */
+WKDM_SW_INLINE void
+WKdm_sw_pack_lowbits12(WK_word *dest, const uint16_t *lowbits)
+{
+	const __m128i m0 = _mm_set1_epi64x(0x3ffull);
+	const __m128i m1 = _mm_set1_epi64x(0x3ffull << 10);
+	const __m128i m2 = _mm_set1_epi64x(0x3ffull << 20);
+	__m128i a, b;
+
+	/* each 64 bit lane holds a triplet at bits 0, 16 and 32 */
+	a = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(lowbits + 0)),
+	    _mm_loadl_epi64((const __m128i *)(lowbits + 3)));
+	b = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(lowbits + 6)),
+	    _mm_loadl_epi64((const __m128i *)(lowbits + 9)));
+
+	a = _mm_or_si128(_mm_and_si128(a, m0), _mm_or_si128(
+		    _mm_and_si128(_mm_srli_epi64(a, 6), m1),
+		    _mm_and_si128(_mm_srli_epi64(a, 12), m2)));
+	b = _mm_or_si128(_mm_and_si128(b, m0), _mm_or_si128(
+		    _mm_and_si128(_mm_srli_epi64(b, 6), m1),
+		    _mm_and_si128(_mm_srli_epi64(b, 12), m2)));
+
+	_mm_storeu_si128((__m128i *)dest, _mm_castps_si128(_mm_shuffle_ps(
+		    _mm_castsi128_ps(a), _mm_castsi128_ps(b), _MM_SHUFFLE(2, 0, 2, 0))));
+}
+
+/*
+ * 4 words into 12 ten bit values. Writes 2 bytes past the 12th value.
+ */
+WKDM_SW_INLINE void
+WKdm_sw_unpack_lowbits12(uint16_t *lowbits, const WK_word *src)
+{
+	const __m128i m0 = _mm_set1_epi64x(0x3ffull);
+	const __m128i m1 = _mm_set1_epi64x(0x3ffull << 16);
+	const __m128i m2 = _mm_set1_epi64x(0x3ffull << 32);
+	__m128i w = _mm_loadu_si128((const __m128i *)src);
+	__m128i a = _mm_unpacklo_epi32(w, _mm_setzero_si128());
+	__m128i b = _mm_unpackhi_epi32(w, _mm_setzero_si128());
+
+	a = _mm_or_si128(_mm_and_si128(a, m0), _mm_or_si128(
+		    _mm_and_si128(_mm_slli_epi64(a, 6), m1),
+		    _mm_and_si128(_mm_slli_epi64(a, 12), m2)));
+	b = _mm_or_si128(_mm_and_si128(b, m0), _mm_or_si128(
+		    _mm_and_si128(_mm_slli_epi64(b, 6), m1),
+		    _mm_and_si128(_mm_slli_epi64(b, 12), m2)));
+
+	/* overlapping stores, in order, so each one clobbers only padding */
+	_mm_storel_epi64((__m128i *)(lowbits + 0), a);
+	_mm_storel_epi64((__m128i *)(lowbits + 3), _mm_unpackhi_epi64(a, a));
+	_mm_storel_epi64((__m128i *)(lowbits + 6), b);
+	_mm_storel_epi64((__m128i *)(lowbits + 9), _mm_unpackhi_epi64(b, b));
+}
+
+#elif WKDM_SW_NEON
+
+WKDM_SW_INLINE bool
+WKdm_sw_is_zero16(const void *p)
+{
+	return vmaxvq_u8(vld1q_u8((const uint8_t *)p)) == 0;
+}
+
+WKDM_SW_INLINE void
+WKdm_sw_pack_tags64(WK_word *dest, const uint8_t *tags)
+{
+	uint32x4x4_t t = vld4q_u32((const uint32_t *)tags);
+	uint32x4_t   w;
+
+	w = vorrq_u32(t.val[0], vshlq_n_u32(t.val[1], 2));
+	w = vorrq_u32(w, vshlq_n_u32(t.val[2], 4));
+	w = vorrq_u32(w, vshlq_n_u32(t.val[3], 6));
+	vst1q_u32(dest, w);
+}
+
+WKDM_SW_INLINE void
+WKdm_sw_unpack_tags64(uint8_t *tags, const WK_word *src)
+{
+	uint32x4_t   w = vld1q_u32(src);
+	uint32x4_t   m = vdupq_n_u32(0x03030303);
+	uint32x4x4_t t;
+
+	t.val[0] = vandq_u32(w, m);
+	t.val[1] = vandq_u32(vshrq_n_u32(w, 2), m);
+	t.val[2] = vandq_u32(vshrq_n_u32(w, 4), m);
+	t.val[3] = vandq_u32(vshrq_n_u32(w, 6), m);
+	vst4q_u32((uint32_t *)tags, t);
+}
+
+WKDM_SW_INLINE void
+WKdm_sw_pack_qpos32(WK_word *dest, const uint8_t *qpos)
+{
+	uint32x4x2_t q = vld2q_u32((const uint32_t *)qpos);
+
+	vst1q_u32(dest, vorrq_u32(q.val[0], vshlq_n_u32(q.val[1], 4)));
+}
+
+WKDM_SW_INLINE void
+WKdm_sw_unpack_qpos32(uint8_t *qpos, const WK_word *src)
+{
+	uint32x4_t   w = vld1q_u32(src);
+	uint32x4_t   m = vdupq_n_u32(0x0f0f0f0f);
+	uint32x4x2_t q;
+
+	q.val[0] = vandq_u32(w, m);
+	q.val[1] = vandq_u32(vshrq_n_u32(w, 4), m);
+	vst2q_u32((uint32_t *)qpos, q);
+}
+
+/*
+ * 12 ten bit values into 4 words. Unlike the SSE2 variant this doesn't
+ * touch anything past the 12th value, callers use the stricter bound.
+ */
+WKDM_SW_INLINE void
+WKdm_sw_pack_lowbits12(WK_word *dest, const uint16_t *lowbits)
+{
+	uint16x4x3_t l = vld3_u16(lowbits);
+	uint32x4_t   w;
+
+	w = vmovl_u16(l.val[0]);
+	w = vorrq_u32(w, vshlq_n_u32(vmovl_u16(l.val[1]), 10));
+	w = vorrq_u32(w, vshlq_n_u32(vmovl_u16(l.val[2]), 20));
+	vst1q_u32(dest, w);
+}
+
+WKDM_SW_INLINE void
+WKdm_sw_unpack_lowbits12(uint16_t *lowbits, const WK_word *src)
+{
+	uint32x4_t   w = vld1q_u32(src);
+	uint32x4_t   m = vdupq_n_u32(0x3ff);
+	uint16x4x3_t l;
+
+	l.val[0] = vmovn_u32(vandq_u32(w, m));
+	l.val[1] = vmovn_u32(vandq_u32(vshrq_n_u32(w, 10), m));
+	l.val[2] = vmovn_u32(vandq_u32(vshrq_n_u32(w, 20), m));
+	vst3_u16(lowbits, l);
+}
+
+#endif /* WKDM_SW_NEON */
+
+#if !WKDM_SW_SIMD
+/* never called, keeps the shared code below free of #ifdefs */
+#define WKdm_sw_is_zero16(p)            false
+#define WKdm_sw_pack_tags64(d, t)       ((void)0)
+#define WKdm_sw_unpack_tags64(t, s)     ((void)0)
+#define WKdm_sw_pack_qpos32(d, q)       ((void)0)
+#define WKdm_sw_unpack_qpos32(q, s)     ((void)0)
+#define WKdm_sw_pack_lowbits12(d, l)    ((void)0)
+#define WKdm_sw_unpack_lowbits12(l, s)  ((void)0)
+#endif /* !WKDM_SW_SIMD */
+
+#pragma mark compression
+
+WKDM_SW_INLINE int
+WKdm_sw_compress(const WK_word *src_buf, WK_word *dest_buf,
+    WK_word *scratch, unsigned int limit, const bool simd)
+{
+	const uint32_t  nwords = PAGE_SIZE / sizeof(WK_word);
+	const uint32_t  scale = nwords / 1024;
+	const uint32_t  tags_bytes = nwords / 4;
+	const uint32_t  checkpoint = WKDM_SW_CHKPT_WORDS * scale;
+	uint8_t        *tags = (uint8_t *)scratch;
+	uint8_t        *qpos = tags + nwords;
+	uint16_t       *lowbits = (uint16_t *)(qpos + nwords);
+	WK_word        *full_start = dest_buf + WKDM_SW_HEADER_WORDS + tags_bytes / 4;
+	struct WKdm_sw_scan st = {
+		.next_qpos    = qpos,
+		.next_lowbits = lowbits,
+		.next_full    = full_start,
+	};
+	uint32_t        nqpos, nlowbits, nmisses, npacked;
+	uint32_t        sparse_size, default_size;
+	WK_word        *next;
+	uint32_t        i;
+
+	st.byte_count = (int)limit - (int)(WKDM_SW_HEADER_WORDS * 4 + tags_bytes);
+	if (st.byte_count <= 0) {
+		return -1;
+	}
+
+	/* the checkpoint is a multiple of 4, so it falls on a group boundary */
+	for (i = 0; i < nwords; i += 4) {
+		if (i == checkpoint) {
+			uint32_t est = WKdm_sw_packed_estimate(
+				(uint32_t)(st.next_lowbits - lowbits),
+				(uint32_t)(st.next_full - full_start),
+				(uint32_t)(st.next_qpos - qpos));
+
+			if (est + WKDM_SW_CHKPT_TAG_BYTES * scale >
+			    WKDM_SW_CHKPT_SHRUNK_BYTES * scale) {
+				return -1;
+			}
+		}
+
+		if (simd && WKdm_sw_is_zero16(&src_buf[i])) {
+			WKdm_sw_store32(&tags[i], 0);
+			continue;
+		}
+
+		for (uint32_t k = i; k < i + 4; k++) {
+			if (!WKdm_sw_record(&st, &tags[k], src_buf[k])) {
+				return -1;
+			}
+		}
+	}
+
+	nqpos = (uint32_t)(st.next_qpos - qpos);
+	nlowbits = (uint32_t)(st.next_lowbits - lowbits);
+	nmisses = (uint32_t)(st.next_full - full_start);
+
+	/* zero page */
+	if (nmisses == 0 && nqpos == 0) {
+		return 0;
+	}
+
+	/* single value page: the caller records src_buf[0] itself */
+	if (nlowbits == 0 && nqpos == nwords - 1 && nmisses == 1 &&
+	    tags[0] == WKDM_SW_TAG_MISS) {
+		return 0;
+	}
+	if (nlowbits == 1 && nqpos == nwords && tags[0] == WKDM_SW_TAG_PARTIAL) {
+		return 0;
+	}
+
+	/*
+	 * Mostly zero page: emit <word, byte offset> pairs for every non zero
+	 * word if that is no larger than the default encoding.
+	 */
+	sparse_size = (nmisses + nqpos) * 6 + 4;
+	default_size = WKdm_sw_packed_estimate(nlowbits, nmisses, nqpos) +
+	    WKDM_SW_HEADER_WORDS * 4 + tags_bytes;
+
+	if (default_size >= sparse_size) {
+		uint8_t *out = (uint8_t *)dest_buf;
+
+		if (sparse_size > limit) {
+			return -1;
+		}
+
+		WKdm_sw_store32(out, WKDM_SW_MZV_MAGIC);
+		out += 4;
+		for (i = 0; i < nwords; i++) {
+			if (simd && (i & 3) == 0 && WKdm_sw_is_zero16(&src_buf[i])) {
+				i += 3;
+				continue;
+			}
+			if (src_buf[i] != 0) {
+				WKdm_sw_store32(out, src_buf[i]);
+				WKdm_sw_store16(out + 4, (uint16_t)(i * sizeof(WK_word)));
+				out += 6;
+			}
+		}
+		return (int)sparse_size;
+	}
+
+	/*
+	 * Default encoding: header, packed tags, full words, qpos, low bits.
+	 * The budget checks below only ever fail on the last word written,
+	 * so they are done upfront.
+	 */
+	npacked = (nqpos + 7) >> 3;
+	st.byte_count -= (int)(npacked * 4);
+	if (st.byte_count < 0) {
+		return -1;
+	}
+	if (st.byte_count - (int)((nlowbits + 2) / 3) * 4 <= 0 && nlowbits) {
+		return -1;
+	}
+
+	dest_buf[0] = (WK_word)(st.next_full - dest_buf);
+
+	next = dest_buf + WKDM_SW_HEADER_WORDS;
+	i = 0;
+	if (simd) {
+		for (; i < nwords; i += 64, next += 4) {
+			WKdm_sw_pack_tags64(next, &tags[i]);
+		}
+	}
+	for (; i < nwords; i += 16) {
+		*next++ = WKdm_sw_load32(&tags[i]) |
+		    (WKdm_sw_load32(&tags[i + 4]) << 2) |
+		    (WKdm_sw_load32(&tags[i + 8]) << 4) |
+		    (WKdm_sw_load32(&tags[i + 12]) << 6);
+	}
+
+	next = st.next_full;
+	memset(&qpos[nqpos], 0, npacked * 8 - nqpos);
+	i = 0;
+	if (simd) {
+		for (; i + 32 <= npacked * 8; i += 32, next += 4) {
+			WKdm_sw_pack_qpos32(next, &qpos[i]);
+		}
+	}
+	for (; i < npacked * 8; i += 8) {
+		*next++ = WKdm_sw_load32(&qpos[i]) |
+		    (WKdm_sw_load32(&qpos[i + 4]) << 4);
+	}
+	dest_buf[1] = (WK_word)(next - dest_buf);
+
+	i = 0;
+	if (simd) {
+		/* the vector packer reads one value past the 12 it packs */
+		for (; i + 13 <= nlowbits; i += 12, next += 4) {
+			WKdm_sw_pack_lowbits12(next, &lowbits[i]);
+		}
+	}
+	for (; i < nlowbits; i += 3) {
+		WK_word w = lowbits[i];
+
+		if (i + 1 < nlowbits) {
+			w |= (WK_word)lowbits[i + 1] << 10;
+		}
+		if (i + 2 < nlowbits) {
+			w |= (WK_word)lowbits[i + 2] << 20;
+		}
+		*next++ = w;
+	}
+	dest_buf[2] = (WK_word)(next - dest_buf);
+
+	return (int)((next - dest_buf) * sizeof(WK_word));
+}
+
+static int
+WKdm_compress_scalar(const WK_word *src_buf, WK_word *dest_buf,
+    WK_word *scratch, unsigned int limit)
+{
+	return WKdm_sw_compress(src_buf, dest_buf, scratch, limit, false);
+}
+
+#if WKDM_SW_SIMD
+static int
+WKdm_compress_simd(const WK_word *src_buf, WK_word *dest_buf,
+    WK_word *scratch, unsigned int limit)
+{
+	return WKdm_sw_compress(src_buf, dest_buf, scratch, limit, true);
+}
+#endif /* WKDM_SW_SIMD */
+
+int
+WKdm_compress_sw(const WK_word *src_buf, WK_word *dest_buf,
+    WK_word *scratch, unsigned int limit)
+{
+#if WKDM_SW_SIMD
+	if (WKdm_sw_simd_enabled) {
+		return WKdm_compress_simd(src_buf, dest_buf, scratch, limit);
+	}
+#endif /* WKDM_SW_SIMD */
+	return WKdm_compress_scalar(src_buf, dest_buf, scratch, limit);
+}
+
+#pragma mark decompression
+
+WKDM_SW_INLINE bool
+WKdm_sw_decompress(const WK_word *src_buf, WK_word *dest_buf,
+    WK_word *scratch, unsigned int bytes, const bool simd)
+{
+	const uint32_t  nwords = PAGE_SIZE / sizeof(WK_word);
+	const uint32_t  tags_words = nwords / 16;
+	const uint32_t  src_words = bytes / sizeof(WK_word);
+	uint8_t        *tags = (uint8_t *)scratch;
+	uint8_t        *qpos = tags + nwords;
+	uint16_t       *lowbits = (uint16_t *)(qpos + nwords);
+	const WK_word  *next_full, *p;
+	WK_word         dictionary[16] = { 0 };
+	uint32_t        nqpos, nlowbits = 0, i;
+
+	if (bytes >= 4 && src_buf[0] == WKDM_SW_MZV_MAGIC) {
+		const uint8_t *in = (const uint8_t *)src_buf;
+
+		if ((bytes - 4) % 6) {
+			return false;
+		}
+		memset(dest_buf, 0, PAGE_SIZE);
+		for (uint32_t off = 4; off < bytes; off += 6) {
+			uint16_t index = WKdm_sw_load16(in + off + 4);
+
+			if (index >= PAGE_SIZE || (index % sizeof(WK_word))) {
+				return false;
+			}
+			dest_buf[index / sizeof(WK_word)] = WKdm_sw_load32(in + off);
+		}
+		return true;
+	}
+
+	if (src_words < WKDM_SW_HEADER_WORDS + tags_words ||
+	    src_buf[0] < WKDM_SW_HEADER_WORDS + tags_words ||
+	    src_buf[0] > src_buf[1] || src_buf[1] > src_buf[2] ||
+	    src_buf[2] > src_words ||
+	    src_buf[1] - src_buf[0] > nwords / 8) {
+		return false;
+	}
+
+	p = src_buf + WKDM_SW_HEADER_WORDS;
+	i = 0;
+	if (simd) {
+		for (; i < nwords; i += 64, p += 4) {
+			WKdm_sw_unpack_tags64(&tags[i], p);
+		}
+	}
+	for (; i < nwords; i += 16, p++) {
+		WK_word w = *p;
+
+		for (uint32_t j = 0; j < 4; j++) {
+			tags[i + j] = (w >> (8 * j)) & 3;
+			tags[i + 4 + j] = (w >> (8 * j + 2)) & 3;
+			tags[i + 8 + j] = (w >> (8 * j + 4)) & 3;
+			tags[i + 12 + j] = (w >> (8 * j + 6)) & 3;
+		}
+	}
+
+	nqpos = 8 * (src_buf[1] - src_buf[0]);
+	p = src_buf + src_buf[0];
+	i = 0;
+	if (simd) {
+		for (; i + 32 <= nqpos; i += 32, p += 4) {
+			WKdm_sw_unpack_qpos32(&qpos[i], p);
+		}
+	}
+	for (; i < nqpos; i += 8, p++) {
+		WK_word w = *p;
+
+		for (uint32_t j = 0; j < 4; j++) {
+			qpos[i + j] = (w >> (8 * j)) & 0xf;
+			qpos[i + 4 + j] = (w >> (8 * j + 4)) & 0xf;
+		}
+	}
+
+	p = src_buf + src_buf[1];
+	if (simd) {
+		/* the vector unpacker writes one value past the 12 it produces */
+		for (; p + 4 <= src_buf + src_buf[2] && nlowbits + 13 <= nwords;
+		    p += 4, nlowbits += 12) {
+			WKdm_sw_unpack_lowbits12(&lowbits[nlowbits], p);
+		}
+	}
+	for (; p < src_buf + src_buf[2]; p++) {
+		WK_word w = *p;
+
+		for (uint32_t j = 0; j < 3 && nlowbits < nwords; j++) {
+			lowbits[nlowbits++] = (w >> (10 * j)) & 0x3ff;
+		}
+	}
+
+	next_full = src_buf + WKDM_SW_HEADER_WORDS + tags_words;
+	for (i = 0; i < nwords; i++) {
+		WK_word input;
+
+		if (simd && (i & 15) == 0 && WKdm_sw_is_zero16(&tags[i])) {
+			memset(&dest_buf[i], 0, 16 * sizeof(WK_word));
+			i += 15;
+			continue;
+		}
+
+		switch (tags[i]) {
+		case WKDM_SW_TAG_ZERO:
+			dest_buf[i] = 0;
+			break;
+		case WKDM_SW_TAG_EXACT:
+			if (nqpos-- == 0) {
+				return false;
+			}
+			dest_buf[i] = dictionary[*qpos++];
+			break;
+		case WKDM_SW_TAG_PARTIAL:
+			if (nqpos-- == 0 || nlowbits-- == 0) {
+				return false;
+			}
+			input = (dictionary[*qpos] & ~0x3ffu) | *lowbits++;
+			dictionary[*qpos++] = input;
+			dest_buf[i] = input;
+			break;
+		default:
+			if (next_full >= src_buf + src_buf[0]) {
+				return false;
+			}
+			input = *next_full++;
+			dictionary[WKDM_SW_HASH(input)] = input;
+			dest_buf[i] = input;
+			break;
+		}
+	}
+
+	return true;
+}
+
+static bool
+WKdm_decompress_scalar(const WK_word *src_buf, WK_word *dest_buf,
+    WK_word *scratch, unsigned int bytes)
+{
+	return WKdm_sw_decompress(src_buf, dest_buf, scratch, bytes, false);
+}
+
+#if WKDM_SW_SIMD
+static bool
+WKdm_decompress_simd(const WK_word *src_buf, WK_word *dest_buf,
+    WK_word *scratch, unsigned int bytes)
+{
+	return WKdm_sw_decompress(src_buf, dest_buf, scratch, bytes, true);
+}
+#endif /* WKDM_SW_SIMD */
+
+bool
+WKdm_decompress_sw(const WK_word *src_buf, WK_word *dest_buf,
+    WK_word *scratch, unsigned int bytes)
+{
+#if WKDM_SW_SIMD
+	if (WKdm_sw_simd_enabled) {
+		return WKdm_decompress_simd(src_buf, dest_buf, scratch, bytes);
+	}
+#endif /* WKDM_SW_SIMD */
+	return WKdm_decompress_scalar(src_buf, dest_buf, scratch, bytes);
+}
@@ -29,7 +29,11 @@
 #pragma once
 #include <stdint.h>
 #include <stddef.h>
+#if KERNEL
 #include <kern/assert.h>
+#else
+#include <assert.h>
+#endif
 #include <machine/limits.h>
 #include "lz4_assembly_select.h"
 #include "lz4_constants.h"
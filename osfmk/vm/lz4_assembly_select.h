@@ -31,8 +31,10 @@
 //  Common header to enable/disable the assembly code paths
 //  Rule: one define for each assembly source file
 
-//  To enable assembly
-#if defined __arm64__
+//  To enable assembly (host builds, e.g. tests/vm/compressor_codec_bench.c,
+//  only ever use the C implementation)
+#if !KERNEL
+#elif defined __arm64__
 #define LZ4_ENABLE_ASSEMBLY_ENCODE_ARM64 1
 #define LZ4_ENABLE_ASSEMBLY_DECODE_ARM64 1
 #elif defined __ARM_NEON__
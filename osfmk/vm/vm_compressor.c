@@ -43,6 +43,7 @@
 #if DEVELOPMENT || DEBUG
 #include <kern/hvg_hypercall.h>
 #endif
+#include <kern/kcdata.h>
 #include <kern/ledger.h>
 #include <kern/policy_internal.h>
 #include <kern/thread_group.h>
@@ -382,6 +383,7 @@ struct c_sv_hash_entry c_segment_sv_hash_table[C_SV_HASH_SIZE]  __attribute__ ((
 static void vm_compressor_swap_trigger_thread(void);
 static void vm_compressor_do_delayed_compactions(boolean_t);
 static void vm_compressor_compact_and_swap(boolean_t);
+static void vm_compressor_major_compact_workers_init(void);
 static void vm_compressor_process_regular_swapped_in_segments(boolean_t);
 void vm_compressor_process_special_swapped_in_segments(void);
 static void vm_compressor_process_special_swapped_in_segments_locked(void);
@@ -1204,6 +1206,8 @@ vm_compressor_init(void)
 	}
 	thread_deallocate(thread);
 
+	vm_compressor_major_compact_workers_init();
+
 	if (vm_pageout_internal_start() != KERN_SUCCESS) {
 		panic("vm_compressor_init: Failed to start the internal pageout thread.");
 	}
@@ -2299,7 +2303,7 @@ c_seg_major_compact(
 	c_seg_src->c_was_major_donor++;
 #endif
 	assertf(c_seg_dst->c_has_donated_pages == c_seg_src->c_has_donated_pages, "Mismatched donation status Dst: %p, Src: %p\n", c_seg_dst, c_seg_src);
-	c_seg_major_compact_stats[c_seg_major_compact_stats_now].compactions++;
+	os_atomic_inc(&c_seg_major_compact_stats[c_seg_major_compact_stats_now].compactions, relaxed);
 
 	dst_slot = c_seg_dst->c_nextslot;
 
@@ -2345,8 +2349,8 @@ c_seg_major_compact(
 
 		c_rounded_size = (c_size + C_SEG_OFFSET_ALIGNMENT_MASK) & ~C_SEG_OFFSET_ALIGNMENT_MASK;
 
-		c_seg_major_compact_stats[c_seg_major_compact_stats_now].moved_slots++;
-		c_seg_major_compact_stats[c_seg_major_compact_stats_now].moved_bytes += c_size;
+		os_atomic_inc(&c_seg_major_compact_stats[c_seg_major_compact_stats_now].moved_slots, relaxed);
+		os_atomic_add(&c_seg_major_compact_stats[c_seg_major_compact_stats_now].moved_bytes, c_size, relaxed);
 
 		cslot_copy(c_dst, c_src);
 		c_dst->c_offset = c_seg_dst->c_nextoffset;
@@ -2943,7 +2947,7 @@ vm_compressor_do_delayed_compactions(boolean_t flush_all)
 int min_csegs_per_major_compaction = DELAYED_COMPACTIONS_PER_PASS;
 
 static bool
-vm_compressor_major_compact_cseg(c_segment_t c_seg, uint32_t* c_seg_considered, bool* bail_wanted_cseg, uint64_t* total_bytes_freed)
+vm_compressor_major_compact_cseg(c_segment_t c_seg, uint32_t* c_seg_considered, bool* bail_wanted_cseg, uint64_t* total_bytes_freed, bool stop_at_busy)
 {
 	/*
 	 * Major compaction
@@ -2983,6 +2987,15 @@ vm_compressor_major_compact_cseg(c_segment_t c_seg, uint32_t* c_seg_considered,
 
 		lck_mtx_lock_spin_always(&c_seg_next->c_lock);
 
+		if (c_seg_next->c_busy && stop_at_busy) {
+			/*
+			 * Our neighbor belongs to someone else,
+			 * possibly another major compaction run,
+			 * so it marks the end of our run.
+			 */
+			lck_mtx_unlock_always(&c_seg_next->c_lock);
+			break;
+		}
 		if (c_seg_next->c_busy) {
 			/*
 			 * We are going to block for our neighbor.
@@ -3017,7 +3030,7 @@ vm_compressor_major_compact_cseg(c_segment_t c_seg, uint32_t* c_seg_considered,
 			 * so we can't continue to use c_seg_next
 			 */
 			bytes_freed += bytes_to_free;
-			c_seg_major_compact_stats[c_seg_major_compact_stats_now].count_of_freed_segs++;
+			os_atomic_inc(&c_seg_major_compact_stats[c_seg_major_compact_stats_now].count_of_freed_segs, relaxed);
 			continue;
 		}
 
@@ -3046,7 +3059,7 @@ vm_compressor_major_compact_cseg(c_segment_t c_seg, uint32_t* c_seg_considered,
 		bytes_to_free = C_SEG_OFFSET_TO_BYTES(c_seg_next->c_populated_offset);
 		if (c_seg_minor_compaction_and_unlock(c_seg_next, TRUE)) {
 			bytes_freed += bytes_to_free;
-			c_seg_major_compact_stats[c_seg_major_compact_stats_now].count_of_freed_segs++;
+			os_atomic_inc(&c_seg_major_compact_stats[c_seg_major_compact_stats_now].count_of_freed_segs, relaxed);
 		} else {
 			bytes_to_free -= C_SEG_OFFSET_TO_BYTES(c_seg_next->c_populated_offset);
 			bytes_freed += bytes_to_free;
@@ -3257,7 +3270,7 @@ vm_compressor_process_special_swapped_in_segments_locked(void)
 		PAGE_REPLACEMENT_DISALLOWED(FALSE);
 		lck_mtx_lock_spin_always(c_list_lock);
 
-		switch_state = vm_compressor_major_compact_cseg(c_seg, &number_considered, &bail_wanted_cseg, &bytes_freed);
+		switch_state = vm_compressor_major_compact_cseg(c_seg, &number_considered, &bail_wanted_cseg, &bytes_freed, false);
 		assert(c_seg->c_busy);
 		assert(!c_seg->c_on_minorcompact_q);
 
@@ -3680,6 +3693,475 @@ do_fastwake_warmup(queue_head_t *c_queue, boolean_t consider_all_cseg)
 extern bool     vm_swapout_thread_running;
 extern boolean_t        compressor_store_stop_compaction;
 
+/*
+ * Moves a c_seg that major compaction is done with off the age queue:
+ * to the swapout queue if it should (and may, as per "swapout") be
+ * swapped out, or else out of the way onto the majorcompact queue.
+ *
+ * Called with c_list_lock and the c_seg lock held.
+ */
+static void
+vm_compressor_major_compact_retire(c_segment_t c_seg, boolean_t flush_all, bool swapout, clock_sec_t now)
+{
+#if !(XNU_TARGET_OS_OSX && __arm64__)
+#pragma unused(flush_all)
+#endif /* !(XNU_TARGET_OS_OSX && __arm64__) */
+
+	if (!swapout) {
+		/* just move it out of the way, see below */
+	} else if (VM_CONFIG_SWAP_IS_ACTIVE) {
+		int new_state = C_ON_SWAPOUT_Q;
+#if (XNU_TARGET_OS_OSX && __arm64__)
+		if (flush_all == false && compressor_swapout_conditions_met() == false) {
+			new_state = C_ON_MAJORCOMPACT_Q;
+		}
+#endif /* (XNU_TARGET_OS_OSX && __arm64__) */
+
+		if (new_state == C_ON_SWAPOUT_Q) {
+			/*
+			 * This mode of putting a generic c_seg on the swapout list is
+			 * only supported when we have general swapping enabled
+			 */
+			clock_sec_t lnow;
+			clock_nsec_t lnsec;
+			clock_get_system_nanotime(&lnow, &lnsec);
+			if (c_seg->c_agedin_ts && (lnow - c_seg->c_agedin_ts) < 30) {
+				vmcs_stats.unripe_under_30s++;
+			} else if (c_seg->c_agedin_ts && (lnow - c_seg->c_agedin_ts) < 60) {
+				vmcs_stats.unripe_under_60s++;
+			} else if (c_seg->c_agedin_ts && (lnow - c_seg->c_agedin_ts) < 300) {
+				vmcs_stats.unripe_under_300s++;
+			}
+		}
+
+		c_seg_switch_state(c_seg, new_state, FALSE);
+	} else {
+		if ((vm_swapout_ripe_segments == TRUE && c_overage_swapped_count < c_overage_swapped_limit)) {
+			assert(VM_CONFIG_SWAP_IS_PRESENT);
+			/*
+			 * we are running compressor sweeps with swap-behind
+			 * make sure the c_seg has aged enough before swapping it
+			 * out...
+			 */
+			if ((now - c_seg->c_creation_ts) >= vm_ripe_target_age) {
+				c_seg->c_overage_swap = TRUE;
+				c_overage_swapped_count++;
+				c_seg_switch_state(c_seg, C_ON_SWAPOUT_Q, FALSE);
+			}
+		}
+	}
+	if (c_seg->c_state == C_ON_AGE_Q) {
+		/*
+		 * this c_seg didn't get moved to the swapout queue
+		 * so we need to move it out of the way...
+		 * we just did a major compaction on it so put it
+		 * on that queue
+		 */
+		c_seg_switch_state(c_seg, C_ON_MAJORCOMPACT_Q, FALSE);
+	} else {
+		c_seg_major_compact_stats[c_seg_major_compact_stats_now].wasted_space_in_swapouts += c_seg_bufsize - c_seg->c_bytes_used;
+		c_seg_major_compact_stats[c_seg_major_compact_stats_now].count_of_swapouts++;
+	}
+}
+
+/*
+ * Parallel major compaction.
+ *
+ * The compactor/swapper thread carves the head of the age queue into up
+ * to vm_compressor_major_compact_workers runs of (at most)
+ * vm_compressor_major_compact_chunk segments each, marks the first segment
+ * of every run busy, and then compacts the first run itself while the
+ * other ones are handed to a pool of worker threads.
+ *
+ * A run stops at the first busy segment it meets, which is how runs stay
+ * out of each other's way: the next run's head is busy from the start,
+ * and everything a run goes on to compact or absorb is busy while it does.
+ */
+#define C_MAJOR_COMPACT_WORKERS_MAX     8
+
+#define C_MAJOR_COMPACT_CHUNK_MAX       1024
+
+uint32_t        vm_compressor_major_compact_workers = 1;
+uint32_t        vm_compressor_major_compact_chunk = DELAYED_COMPACTIONS_PER_PASS;
+
+uint64_t        c_major_compact_parallel_rounds;        /* # of times runs were handed to workers */
+uint64_t        c_major_compact_parallel_runs;          /* # of runs compacted by workers */
+
+struct c_major_compact_run {
+	uint32_t        cmr_considered;
+	uint32_t        cmr_wanted_found;
+	uint32_t        cmr_compacted;
+	uint64_t        cmr_bytes_freed;
+};
+
+static struct c_major_compact_worker {
+	thread_t                        ccw_thread;
+	c_segment_t                     ccw_head;       /* run to compact, NULL when idle */
+	bool                            ccw_swapout;
+	clock_sec_t                     ccw_now;
+	struct c_major_compact_run      ccw_run;
+} c_major_compact_workers[C_MAJOR_COMPACT_WORKERS_MAX - 1];
+
+static uint32_t c_major_compact_workers_pending;
+static uint32_t c_major_compact_workers_started;
+static LCK_MTX_DECLARE(c_major_compact_workers_lock, &vm_compressor_lck_grp);
+
+/*
+ * Whether a run that swaps out what it compacts should stop before the
+ * next segment, which are the same checks vm_compressor_compact_and_swap()
+ * makes before every segment it compacts serially.
+ *
+ * Called and returns with c_list_lock held, drops it meanwhile.
+ */
+static bool
+vm_compressor_major_compact_swap_done(void)
+{
+	uint32_t        c_swapout_count;
+	bool            needs_to_swap;
+
+	c_swapout_count = c_early_swapout_count + c_regular_swapout_count + c_late_swapout_count;
+	if (VM_CONFIG_SWAP_IS_ACTIVE && !vm_swap_out_of_space() && c_swapout_count >= C_SWAPOUT_LIMIT) {
+		return true;
+	}
+
+	lck_mtx_unlock_always(c_list_lock);
+
+	needs_to_swap = compressor_needs_to_swap();
+
+	lck_mtx_lock_spin_always(c_list_lock);
+
+	return !needs_to_swap;
+}
+
+/*
+ * Major compacts a run of segments of the age queue starting at c_seg,
+ * which the caller marked busy, see "Parallel major compaction" above.
+ *
+ * Called and returns with c_list_lock held.
+ */
+static void
+vm_compressor_major_compact_run(c_segment_t c_seg, bool swapout, clock_sec_t now, struct c_major_compact_run *run)
+{
+	uint32_t        budget = MAX(vm_compressor_major_compact_chunk, 1);
+	c_segment_t     c_seg_next;
+	bool            switch_state, bail_wanted_cseg;
+
+	for (;;) {
+		if (swapout && vm_compressor_major_compact_swap_done()) {
+			/* enough is on its way to swap, leave the rest of the run be */
+			lck_mtx_lock_spin_always(&c_seg->c_lock);
+			C_SEG_WAKEUP_DONE(c_seg);
+			lck_mtx_unlock_always(&c_seg->c_lock);
+			break;
+		}
+
+		lck_mtx_lock_spin_always(&c_seg->c_lock);
+
+		assert(c_seg->c_busy);
+		assert(c_seg->c_state == C_ON_AGE_Q);
+		/* we might have been handed this c_seg by the thread that busied it */
+		c_seg->c_busy_for_thread = current_thread();
+
+		if (c_seg_do_minor_compaction_and_unlock(c_seg, FALSE, TRUE, TRUE)) {
+			/*
+			 * found an empty c_segment and freed it,
+			 * which loses our place in the queue
+			 */
+			os_atomic_inc(&c_seg_major_compact_stats[c_seg_major_compact_stats_now].count_of_freed_segs, relaxed);
+			break;
+		}
+
+		bail_wanted_cseg = false;
+		switch_state = vm_compressor_major_compact_cseg(c_seg, &run->cmr_considered,
+		    &bail_wanted_cseg, &run->cmr_bytes_freed, true);
+		if (bail_wanted_cseg) {
+			run->cmr_wanted_found++;
+		}
+
+		assert(c_seg->c_busy);
+		assert(!c_seg->c_on_minorcompact_q);
+
+		c_seg_next = (c_segment_t) queue_next(&c_seg->c_age_list);
+		if (queue_end(&c_age_list_head, (queue_entry_t)c_seg_next)) {
+			c_seg_next = NULL;
+		}
+
+		if (switch_state) {
+			vm_compressor_major_compact_retire(c_seg, FALSE, swapout, now);
+		}
+		C_SEG_WAKEUP_DONE(c_seg);
+
+		lck_mtx_unlock_always(&c_seg->c_lock);
+
+		run->cmr_compacted++;
+
+		if (c_seg_next == NULL || --budget == 0 ||
+		    compaction_swapper_abort || compressor_store_stop_compaction) {
+			break;
+		}
+
+		lck_mtx_lock_spin_always(&c_seg_next->c_lock);
+
+		if (c_seg_next->c_busy) {
+			/* the head of another run, or in use */
+			lck_mtx_unlock_always(&c_seg_next->c_lock);
+			break;
+		}
+		C_SEG_BUSY(c_seg_next);
+
+		lck_mtx_unlock_always(&c_seg_next->c_lock);
+
+		c_seg = c_seg_next;
+	}
+}
+
+static void
+vm_compressor_major_compact_worker_thread(void *param, __unused wait_result_t wr)
+{
+	struct c_major_compact_worker *ccw = param;
+
+	current_thread()->options |= TH_OPT_VMPRIV;
+	thread_set_thread_name(current_thread(), "VM_cmajor_compact");
+#if CONFIG_THREAD_GROUPS
+	thread_group_vm_add();
+#endif
+
+	lck_mtx_lock_spin_always(c_list_lock);
+
+	for (;;) {
+		while (ccw->ccw_head == NULL) {
+			assert_wait((event_t)ccw, THREAD_UNINT);
+
+			lck_mtx_unlock_always(c_list_lock);
+
+			thread_block(THREAD_CONTINUE_NULL);
+
+			lck_mtx_lock_spin_always(c_list_lock);
+		}
+
+		vm_compressor_major_compact_run(ccw->ccw_head, ccw->ccw_swapout, ccw->ccw_now, &ccw->ccw_run);
+		ccw->ccw_head = NULL;
+
+		assert(c_major_compact_workers_pending > 0);
+		if (--c_major_compact_workers_pending == 0) {
+			thread_wakeup((event_t)&c_major_compact_workers_pending);
+		}
+	}
+	/* NOTREACHED */
+}
+
+/*
+ * Sets the number of threads major compaction runs on (the compactor/swapper
+ * thread included), starting worker threads as needed: they are never
+ * stopped, lowering the count just leaves some of them idle.
+ */
+kern_return_t
+vm_compressor_major_compact_set_workers(uint32_t nworkers)
+{
+	if (nworkers < 1 || nworkers > C_MAJOR_COMPACT_WORKERS_MAX) {
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	lck_mtx_lock(&c_major_compact_workers_lock);
+
+	while (c_major_compact_workers_started < nworkers - 1) {
+		struct c_major_compact_worker *ccw;
+
+		ccw = &c_major_compact_workers[c_major_compact_workers_started];
+		if (kernel_thread_start_priority(vm_compressor_major_compact_worker_thread, ccw,
+		    BASEPRI_VM, &ccw->ccw_thread) != KERN_SUCCESS) {
+			panic("vm_compressor_major_compact_worker_thread: create failed");
+		}
+		os_atomic_inc(&c_major_compact_workers_started, release);
+	}
+	os_atomic_store(&vm_compressor_major_compact_workers, nworkers, relaxed);
+
+	lck_mtx_unlock(&c_major_compact_workers_lock);
+
+	return KERN_SUCCESS;
+}
+
+/*
+ * Sets how many segments a run of parallel major compaction takes on.
+ */
+kern_return_t
+vm_compressor_major_compact_set_chunk(uint32_t chunk)
+{
+	if (chunk < 1 || chunk > C_MAJOR_COMPACT_CHUNK_MAX) {
+		return KERN_INVALID_ARGUMENT;
+	}
+	os_atomic_store(&vm_compressor_major_compact_chunk, chunk, relaxed);
+
+	return KERN_SUCCESS;
+}
+
+static void
+vm_compressor_major_compact_workers_init(void)
+{
+	uint32_t        workers = vm_compressor_major_compact_workers;
+
+	PE_parse_boot_argn("vm_compressor_major_compact_workers", &workers, sizeof(workers));
+	vm_compressor_major_compact_set_workers(MIN(MAX(workers, 1), C_MAJOR_COMPACT_WORKERS_MAX));
+}
+
+/*
+ * Compacts up to "nworkers" runs from the head of the age queue in
+ * parallel, see "Parallel major compaction" above, and accumulates
+ * how they went into "total".
+ *
+ * Returns false without doing anything if the segments at the head of the
+ * age queue are all busy, in which case the caller should wait for the
+ * first one.
+ *
+ * Called and returns with c_list_lock held, with compaction_swapper_running set.
+ */
+static bool
+vm_compressor_major_compact_parallel(uint32_t nworkers, bool swapout, clock_sec_t now, struct c_major_compact_run *total)
+{
+	c_segment_t     heads[C_MAJOR_COMPACT_WORKERS_MAX];
+	c_segment_t     c_seg;
+	uint32_t        nheads = 0, stride;
+
+	nworkers = MIN(MAX(nworkers, 1), os_atomic_load(&c_major_compact_workers_started, acquire) + 1);
+	stride = MAX(vm_compressor_major_compact_chunk, 1);
+
+	c_seg = (c_segment_t) queue_first(&c_age_list_head);
+
+	while (nheads < nworkers && !queue_end(&c_age_list_head, (queue_entry_t)c_seg)) {
+		uint32_t skip = 1;
+
+		lck_mtx_lock_spin_always(&c_seg->c_lock);
+		if (!c_seg->c_busy) {
+			C_SEG_BUSY(c_seg);
+			heads[nheads++] = c_seg;
+			skip = stride;
+		}
+		lck_mtx_unlock_always(&c_seg->c_lock);
+
+		while (skip-- && !queue_end(&c_age_list_head, (queue_entry_t)c_seg)) {
+			c_seg = (c_segment_t) queue_next(&c_seg->c_age_list);
+		}
+	}
+	if (nheads == 0) {
+		return false;
+	}
+
+	if (nheads > 1) {
+		assert(c_major_compact_workers_pending == 0);
+		c_major_compact_workers_pending = nheads - 1;
+
+		for (uint32_t i = 1; i < nheads; i++) {
+			struct c_major_compact_worker *ccw = &c_major_compact_workers[i - 1];
+
+			assert(ccw->ccw_head == NULL);
+			ccw->ccw_run = (struct c_major_compact_run){ };
+			ccw->ccw_swapout = swapout;
+			ccw->ccw_now = now;
+			ccw->ccw_head = heads[i];
+			thread_wakeup((event_t)ccw);
+		}
+		c_major_compact_parallel_rounds++;
+		c_major_compact_parallel_runs += nheads - 1;
+	}
+
+	vm_compressor_major_compact_run(heads[0], swapout, now, total);
+
+	while (c_major_compact_workers_pending) {
+		assert_wait((event_t)&c_major_compact_workers_pending, THREAD_UNINT);
+
+		lck_mtx_unlock_always(c_list_lock);
+
+		thread_block(THREAD_CONTINUE_NULL);
+
+		lck_mtx_lock_spin_always(c_list_lock);
+	}
+
+	for (uint32_t i = 1; i < nheads; i++) {
+		struct c_major_compact_run *run = &c_major_compact_workers[i - 1].ccw_run;
+
+		total->cmr_considered += run->cmr_considered;
+		total->cmr_wanted_found += run->cmr_wanted_found;
+		total->cmr_compacted += run->cmr_compacted;
+		total->cmr_bytes_freed += run->cmr_bytes_freed;
+	}
+	return true;
+}
+
+#if DEVELOPMENT || DEBUG
+/*
+ * Runs major compaction over the segments currently on the age queue,
+ * on vm_compressor_major_compact_workers threads and without swapping
+ * any of them out, and returns how many were compacted and how long
+ * that took.  Used to measure how compaction scales with the workers.
+ */
+kern_return_t
+vm_compressor_major_compact_test(uint64_t *compacted, uint64_t *usecs)
+{
+	c_segment_t     c_seg;
+	clock_sec_t     now;
+	clock_nsec_t    nsec;
+	uint64_t        start, end, barrier;
+
+	if (c_segment_count == 0) {
+		return KERN_FAILURE;
+	}
+	*compacted = 0;
+
+	lck_mtx_lock_spin_always(c_list_lock);
+
+	while (compaction_swapper_running) {
+		assert_wait((event_t)&compaction_swapper_running, THREAD_UNINT);
+
+		lck_mtx_unlock_always(c_list_lock);
+
+		thread_block(THREAD_CONTINUE_NULL);
+
+		lck_mtx_lock_spin_always(c_list_lock);
+	}
+	compaction_swapper_running = 1;
+
+	clock_get_system_nanotime(&now, &nsec);
+	barrier = c_generation_id;
+	start = mach_absolute_time();
+
+	while (!queue_empty(&c_age_list_head) && !compaction_swapper_abort && !compressor_store_stop_compaction) {
+		struct c_major_compact_run run = { };
+
+		c_seg = (c_segment_t) queue_first(&c_age_list_head);
+
+		if (c_seg->c_generation_id > barrier) {
+			break;
+		}
+		if (!vm_compressor_major_compact_parallel(vm_compressor_major_compact_workers, false, now, &run)) {
+			lck_mtx_lock_spin_always(&c_seg->c_lock);
+
+			if (c_seg->c_busy) {
+				lck_mtx_unlock_always(c_list_lock);
+				c_seg_wait_on_busy(c_seg);
+				lck_mtx_lock_spin_always(c_list_lock);
+			} else {
+				lck_mtx_unlock_always(&c_seg->c_lock);
+			}
+			continue;
+		}
+		*compacted += run.cmr_compacted;
+	}
+
+	end = mach_absolute_time();
+
+	compaction_swapper_running = 0;
+
+	lck_mtx_unlock_always(c_list_lock);
+
+	thread_wakeup((event_t)&compaction_swapper_running);
+
+	absolutetime_to_nanoseconds(end - start, usecs);
+	*usecs /= NSEC_PER_USEC;
+
+	return KERN_SUCCESS;
+}
+#endif /* DEVELOPMENT || DEBUG */
+
 void
 vm_compressor_compact_and_swap(boolean_t flush_all)
 {
@@ -3850,6 +4332,16 @@ vm_compressor_compact_and_swap(boolean_t flush_all)
 			VM_DEBUG_CONSTANT_EVENT(vm_compressor_compact_and_swap, VM_COMPRESSOR_COMPACT_AND_SWAP, DBG_FUNC_NONE, 4, c_age_count, 0, 0);
 			break;
 		}
+		if (flush_all == FALSE && vm_compressor_major_compact_workers > 1) {
+			struct c_major_compact_run run = { };
+
+			if (vm_compressor_major_compact_parallel(vm_compressor_major_compact_workers, true, now, &run)) {
+				number_considered += run.cmr_considered;
+				wanted_cseg_found += run.cmr_wanted_found;
+				bytes_freed += run.cmr_bytes_freed;
+				goto compacted;
+			}
+		}
 		c_seg = (c_segment_t) queue_first(&c_age_list_head);
 
 		assert(c_seg->c_state == C_ON_AGE_Q);
@@ -3882,7 +4374,7 @@ vm_compressor_compact_and_swap(boolean_t flush_all)
 			continue;
 		}
 
-		switch_state = vm_compressor_major_compact_cseg(c_seg, &number_considered, &bail_wanted_cseg, &bytes_freed);
+		switch_state = vm_compressor_major_compact_cseg(c_seg, &number_considered, &bail_wanted_cseg, &bytes_freed, false);
 		if (bail_wanted_cseg) {
 			wanted_cseg_found++;
 			bail_wanted_cseg = false;
@@ -3892,65 +4384,14 @@ vm_compressor_compact_and_swap(boolean_t flush_all)
 		assert(!c_seg->c_on_minorcompact_q);
 
 		if (switch_state) {
-			if (VM_CONFIG_SWAP_IS_ACTIVE) {
-				int new_state = C_ON_SWAPOUT_Q;
-#if (XNU_TARGET_OS_OSX && __arm64__)
-				if (flush_all == false && compressor_swapout_conditions_met() == false) {
-					new_state = C_ON_MAJORCOMPACT_Q;
-				}
-#endif /* (XNU_TARGET_OS_OSX && __arm64__) */
-
-				if (new_state == C_ON_SWAPOUT_Q) {
-					/*
-					 * This mode of putting a generic c_seg on the swapout list is
-					 * only supported when we have general swapping enabled
-					 */
-					clock_sec_t lnow;
-					clock_nsec_t lnsec;
-					clock_get_system_nanotime(&lnow, &lnsec);
-					if (c_seg->c_agedin_ts && (lnow - c_seg->c_agedin_ts) < 30) {
-						vmcs_stats.unripe_under_30s++;
-					} else if (c_seg->c_agedin_ts && (lnow - c_seg->c_agedin_ts) < 60) {
-						vmcs_stats.unripe_under_60s++;
-					} else if (c_seg->c_agedin_ts && (lnow - c_seg->c_agedin_ts) < 300) {
-						vmcs_stats.unripe_under_300s++;
-					}
-				}
-
-				c_seg_switch_state(c_seg, new_state, FALSE);
-			} else {
-				if ((vm_swapout_ripe_segments == TRUE && c_overage_swapped_count < c_overage_swapped_limit)) {
-					assert(VM_CONFIG_SWAP_IS_PRESENT);
-					/*
-					 * we are running compressor sweeps with swap-behind
-					 * make sure the c_seg has aged enough before swapping it
-					 * out...
-					 */
-					if ((now - c_seg->c_creation_ts) >= vm_ripe_target_age) {
-						c_seg->c_overage_swap = TRUE;
-						c_overage_swapped_count++;
-						c_seg_switch_state(c_seg, C_ON_SWAPOUT_Q, FALSE);
-					}
-				}
-			}
-			if (c_seg->c_state == C_ON_AGE_Q) {
-				/*
-				 * this c_seg didn't get moved to the swapout queue
-				 * so we need to move it out of the way...
-				 * we just did a major compaction on it so put it
-				 * on that queue
-				 */
-				c_seg_switch_state(c_seg, C_ON_MAJORCOMPACT_Q, FALSE);
-			} else {
-				c_seg_major_compact_stats[c_seg_major_compact_stats_now].wasted_space_in_swapouts += c_seg_bufsize - c_seg->c_bytes_used;
-				c_seg_major_compact_stats[c_seg_major_compact_stats_now].count_of_swapouts++;
-			}
+			vm_compressor_major_compact_retire(c_seg, flush_all, true, now);
 		}
 
 		C_SEG_WAKEUP_DONE(c_seg);
 
 		lck_mtx_unlock_always(&c_seg->c_lock);
-
+compacted:
+		c_swapout_count = c_early_swapout_count + c_regular_swapout_count + c_late_swapout_count;
 		/*
 		 * On systems _with_ general swap, regardless of jetsam, we wake up the swapout thread here.
 		 * On systems _without_ general swap, it's the responsibility of the memorystatus
@@ -4634,24 +5075,98 @@ c_compressed_record_data(char *src, int c_size)
 #endif
 
 
-static int
-c_compress_page(char *src, c_slot_mapping_t slot_ptr, c_segment_t *current_chead, char *scratch_buf)
+/*
+ * Upper bound on the number of pages c_compress_pages() compresses
+ * while holding a c_seg lock. That lock is taken in spin mode, so this
+ * bounds how long preemption stays disabled.
+ */
+uint32_t        c_compress_batch_limit = 16;
+
+uint64_t        c_compress_batches;             /* # of c_seg lock holds that compressed pages */
+uint64_t        c_compress_batched_pages;       /* # of pages compressed by those */
+uint32_t        c_compress_batch_size_max;      /* largest batch achieved */
+
+/*
+ * Per-codec breakdown of what became of each page handed to the
+ * compressor, see struct compressor_outcome_stats for the exported form.
+ */
+static struct {
+	uint64_t        sv_pages[COMPRESSOR_OUTCOME_CODECS];
+	uint64_t        sv_zero_pages[COMPRESSOR_OUTCOME_CODECS];
+	uint64_t        sv_hash_full;
+	uint64_t        compressed_pages[COMPRESSOR_OUTCOME_CODECS];
+	uint64_t        incompressible_pages[COMPRESSOR_OUTCOME_CODECS];
+	uint64_t        seg_full_retries;
+	uint64_t        limit_bailouts;
+	uint64_t        size_buckets[COMPRESSOR_OUTCOME_CODECS][COMPRESSOR_OUTCOME_SIZE_BUCKETS];
+} c_outcomes;
+
+#define C_OUTCOME_BUCKET_SIZE   (PAGE_SIZE / COMPRESSOR_OUTCOME_SIZE_BUCKETS)
+
+void
+vm_compressor_outcome_stats_get(struct compressor_outcome_stats *cos)
+{
+	bzero(cos, sizeof(*cos));
+
+	cos->cos_page_size = PAGE_SIZE;
+	cos->cos_bucket_size = C_OUTCOME_BUCKET_SIZE;
+	for (int i = 0; i < COMPRESSOR_OUTCOME_CODECS; i++) {
+		cos->cos_sv_pages[i] = os_atomic_load(&c_outcomes.sv_pages[i], relaxed);
+		cos->cos_sv_zero_pages[i] = os_atomic_load(&c_outcomes.sv_zero_pages[i], relaxed);
+		cos->cos_compressed_pages[i] = os_atomic_load(&c_outcomes.compressed_pages[i], relaxed);
+		cos->cos_incompressible_pages[i] = os_atomic_load(&c_outcomes.incompressible_pages[i], relaxed);
+		for (int b = 0; b < COMPRESSOR_OUTCOME_SIZE_BUCKETS; b++) {
+			cos->cos_size_buckets[i][b] = os_atomic_load(&c_outcomes.size_buckets[i][b], relaxed);
+		}
+	}
+	cos->cos_sv_hash_full = os_atomic_load(&c_outcomes.sv_hash_full, relaxed);
+	cos->cos_seg_full_retries = os_atomic_load(&c_outcomes.seg_full_retries, relaxed);
+	cos->cos_limit_bailouts = os_atomic_load(&c_outcomes.limit_bailouts, relaxed);
+}
+
+/*
+ * Whether another page can be appended to the filling c_seg without
+ * going back through c_seg_allocate(), which might need to block to
+ * grow the slot array or to populate more of the segment's buffer.
+ */
+static bool
+c_seg_can_append_locked(c_segment_t c_seg)
+{
+	int             min_needed;
+
+	if (c_seg->c_nextslot >= c_seg_fixed_array_len &&
+	    (c_seg->c_nextslot - c_seg_fixed_array_len) >= c_seg->c_slot_var_array_len) {
+		return false;
+	}
+	if (C_SEG_OFFSET_TO_BYTES(c_seg->c_populated_offset) < c_seg_allocsize) {
+		min_needed = PAGE_SIZE + (c_seg_allocsize - c_seg_bufsize);
+
+		if (C_SEG_OFFSET_TO_BYTES(c_seg->c_populated_offset - c_seg->c_nextoffset) < (unsigned) min_needed) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Compresses one page into the next slot of c_seg, which is locked and
+ * has room for it as per c_seg_allocate().
+ *
+ * Returns false if the page didn't fit in what is left of the segment,
+ * in which case c_seg has been filled and unlocked, and the page must be
+ * retried against a new segment.
+ */
+static bool
+c_compress_page_locked(c_segment_t c_seg, char *src, c_slot_mapping_t slot_ptr,
+    c_segment_t *current_chead, char *scratch_buf, int *c_size_p, int *c_rounded_size_p)
 {
 	int             c_size = -1;
 	int             c_rounded_size = 0;
 	int             max_csize;
 	c_slot_t        cs;
-	c_segment_t     c_seg;
-	bool            single_value = false;
+	uint16_t        codec = CCWK;
 
-	KERNEL_DEBUG(0xe0400000 | DBG_FUNC_START, *current_chead, 0, 0, 0, 0);
-retry:
-	if ((c_seg = c_seg_allocate(current_chead)) == NULL) {
-		return 1;
-	}
 	/*
-	 * returns with c_seg lock held
-	 * and PAGE_REPLACEMENT_DISALLOWED(TRUE)...
 	 * c_nextslot has been allocated and
 	 * c_store.c_buffer populated
 	 */
@@ -4697,7 +5212,13 @@ retry:
 		}
 		assert(ccodec == CCWK || ccodec == CCLZ4);
 		cs->c_codec = ccodec;
+		codec = ccodec;
 #endif
+	} else if (__improbable(vm_compressor_force_sw_wkdm)) {
+		/* same stream as the assembly below, see WKdm_sw.c */
+		cs->c_codec = CCWK;
+		c_size = WKdm_compress_sw((const WK_word *)(uintptr_t)src, (WK_word *)(uintptr_t)&c_seg->c_store.c_buffer[cs->c_offset],
+		    (WK_word *)(uintptr_t)scratch_buf, max_csize_adj);
 	} else {
 #if defined(__arm64__)
 		cs->c_codec = CCWK;
@@ -4729,7 +5250,8 @@ retry:
 			 * budget exhaustion.
 			 */
 			PAGE_REPLACEMENT_DISALLOWED(FALSE);
-			goto retry;
+			os_atomic_inc(&c_outcomes.seg_full_retries, relaxed);
+			return false;
 		}
 		c_size = PAGE_SIZE;
 
@@ -4738,13 +5260,17 @@ retry:
 		}
 
 		OSAddAtomic(1, &c_segment_noncompressible_pages);
+		os_atomic_inc(&c_outcomes.incompressible_pages[codec], relaxed);
 	} else if (c_size == 0) {
 		int             hash_index;
 
 		/*
 		 * special case - this is a page completely full of a single 32 bit value
 		 */
-		single_value = true;
+		os_atomic_inc(&c_outcomes.sv_pages[codec], relaxed);
+		if (*(uint32_t *)(uintptr_t)src == 0) {
+			os_atomic_inc(&c_outcomes.sv_zero_pages[codec], relaxed);
+		}
 		hash_index = c_segment_sv_hash_insert(*(uint32_t *)(uintptr_t)src);
 
 		if (hash_index != -1) {
@@ -4765,6 +5291,10 @@ retry:
 		memcpy(&c_seg->c_store.c_buffer[cs->c_offset], src, c_size);
 
 		OSAddAtomic(1, &c_segment_svp_hash_failed);
+		os_atomic_inc(&c_outcomes.sv_hash_full, relaxed);
+	} else {
+		os_atomic_inc(&c_outcomes.compressed_pages[codec], relaxed);
+		os_atomic_inc(&c_outcomes.size_buckets[codec][c_size / C_OUTCOME_BUCKET_SIZE], relaxed);
 	}
 
 #if RECORD_THE_COMPRESSED_DATA
@@ -4805,9 +5335,21 @@ sv_compression:
 		assert(*current_chead == NULL);
 	}
 
-	lck_mtx_unlock_always(&c_seg->c_lock);
+	*c_size_p = c_size;
+	*c_rounded_size_p = c_rounded_size;
+	return true;
+}
 
-	PAGE_REPLACEMENT_DISALLOWED(FALSE);
+/*
+ * Accounts for the pages compressed under one c_seg lock hold,
+ * called once that lock has been dropped.
+ */
+static void
+c_compress_batch_done(uint32_t npages, uint64_t c_bytes, uint64_t c_rounded_bytes)
+{
+	if (npages == 0) {
+		return;
+	}
 
 #if RECORD_THE_COMPRESSED_DATA
 	if ((c_compressed_record_cptr - c_compressed_record_sbuf) >= c_seg_allocsize) {
@@ -4815,28 +5357,102 @@ sv_compression:
 		c_compressed_record_cptr = c_compressed_record_sbuf;
 	}
 #endif
-	if (c_size) {
-		OSAddAtomic64(c_size, &c_segment_compressed_bytes);
-		OSAddAtomic64(c_rounded_size, &compressor_bytes_used);
+	if (c_bytes) {
+		OSAddAtomic64(c_bytes, &c_segment_compressed_bytes);
+		OSAddAtomic64(c_rounded_bytes, &compressor_bytes_used);
 	}
-	OSAddAtomic64(PAGE_SIZE, &c_segment_input_bytes);
+	OSAddAtomic64((uint64_t)npages * PAGE_SIZE, &c_segment_input_bytes);
 
-	OSAddAtomic(1, &c_segment_pages_compressed);
+	OSAddAtomic((SInt32)npages, &c_segment_pages_compressed);
 #if DEVELOPMENT || DEBUG
 	if (!compressor_running_perf_test) {
 		/*
 		 * The perf_compressor benchmark should not be able to trigger
 		 * compressor thrashing jetsams.
 		 */
-		OSAddAtomic(1, &sample_period_compression_count);
+		OSAddAtomic((SInt32)npages, &sample_period_compression_count);
 	}
 #else /* DEVELOPMENT || DEBUG */
-	OSAddAtomic(1, &sample_period_compression_count);
+	OSAddAtomic((SInt32)npages, &sample_period_compression_count);
 #endif /* DEVELOPMENT || DEBUG */
 
-	KERNEL_DEBUG(0xe0400000 | DBG_FUNC_END, *current_chead, c_size, c_segment_input_bytes, c_segment_compressed_bytes, 0);
+	os_atomic_inc(&c_compress_batches, relaxed);
+	os_atomic_add(&c_compress_batched_pages, npages, relaxed);
+	os_atomic_max(&c_compress_batch_size_max, npages, relaxed);
+}
 
-	return 0;
+/*
+ * Compresses up to "count" pages into the current c_seg of "current_chead".
+ *
+ * Consecutive pages are appended to the same c_seg under a single hold
+ * of its lock for as long as it has room for them (and at most
+ * c_compress_batch_limit of them), which amortizes the segment lookup,
+ * the locking and the global accounting over the batch.
+ *
+ * Pages are processed in order, the first one that can't be compressed
+ * stops the batch. Returns the number of pages compressed.
+ */
+static uint32_t
+c_compress_pages(char **srcs, c_slot_mapping_t *slots, uint32_t count,
+    c_segment_t *current_chead, char *scratch_buf)
+{
+	c_segment_t     c_seg = NULL;
+	uint32_t        done, held = 0;
+	uint64_t        c_bytes = 0, c_rounded_bytes = 0;
+	int             c_size, c_rounded_size;
+
+	for (done = 0; done < count; done++) {
+		KERNEL_DEBUG(0xe0400000 | DBG_FUNC_START, *current_chead, 0, 0, 0, 0);
+
+		for (;;) {
+			if (c_seg == NULL) {
+				/*
+				 * returns with c_seg lock held
+				 * and PAGE_REPLACEMENT_DISALLOWED(TRUE)...
+				 */
+				if ((c_seg = c_seg_allocate(current_chead)) == NULL) {
+					os_atomic_inc(&c_outcomes.limit_bailouts, relaxed);
+					return done;
+				}
+			}
+			if (c_compress_page_locked(c_seg, srcs[done], slots[done],
+			    current_chead, scratch_buf, &c_size, &c_rounded_size)) {
+				break;
+			}
+			/* c_seg got filled and unlocked */
+			c_compress_batch_done(held, c_bytes, c_rounded_bytes);
+			c_seg = NULL;
+			held = 0;
+			c_bytes = c_rounded_bytes = 0;
+		}
+
+		held++;
+		c_bytes += c_size;
+		c_rounded_bytes += c_rounded_size;
+
+		if (done + 1 == count || *current_chead != c_seg ||
+		    held >= c_compress_batch_limit ||
+		    !c_seg_can_append_locked(c_seg)) {
+			lck_mtx_unlock_always(&c_seg->c_lock);
+
+			PAGE_REPLACEMENT_DISALLOWED(FALSE);
+
+			c_compress_batch_done(held, c_bytes, c_rounded_bytes);
+			c_seg = NULL;
+			held = 0;
+			c_bytes = c_rounded_bytes = 0;
+		}
+
+		KERNEL_DEBUG(0xe0400000 | DBG_FUNC_END, *current_chead, c_size, c_segment_input_bytes, c_segment_compressed_bytes, 0);
+	}
+
+	return done;
+}
+
+static int
+c_compress_page(char *src, c_slot_mapping_t slot_ptr, c_segment_t *current_chead, char *scratch_buf)
+{
+	return c_compress_pages(&src, &slot_ptr, 1, current_chead, scratch_buf) == 1 ? 0 : 1;
 }
 
 static inline void
@@ -5128,6 +5744,11 @@ bypass_busy_check:
 					assert(inline_popcount == C_SLOT_NO_POPCOUNT);
 				}
 #endif
+			} else if (__improbable(vm_compressor_force_sw_wkdm)) {
+				if (!WKdm_decompress_sw((WK_word *)(uintptr_t)&c_seg->c_store.c_buffer[cs->c_offset],
+				    (WK_word *)(uintptr_t)dst, (WK_word *)(uintptr_t)scratch_buf, c_size)) {
+					retval = -1;
+				}
 			} else {
 #if defined(__arm64__)
 				__unreachable_ok_push
@@ -5511,6 +6132,38 @@ vm_compressor_put(ppnum_t pn, int *slot, void  **current_chead, char *scratch_bu
 	return retval;
 }
 
+/*
+ * Compresses up to VM_COMPRESSOR_PUT_BATCH_MAX pages into the same
+ * c_seg(s), see c_compress_pages(). Unlike vm_compressor_put(), doesn't
+ * handle unmodified pages.
+ *
+ * Returns the number of pages compressed: pages[0 .. n - 1] have been
+ * stored in their slot, the others (if any) haven't been touched.
+ */
+unsigned int
+vm_compressor_put_batch(ppnum_t *pns, int **slots, unsigned int count,
+    void **current_chead, char *scratch_buf)
+{
+	char            *srcs[VM_COMPRESSOR_PUT_BATCH_MAX];
+	unsigned int    i, n;
+
+	assert(count <= VM_COMPRESSOR_PUT_BATCH_MAX);
+
+	for (i = 0; i < count; i++) {
+		srcs[i] = pmap_map_compressor_page(pns[i]);
+		assert(srcs[i] != NULL);
+	}
+
+	n = c_compress_pages(srcs, (c_slot_mapping_t *)slots, count,
+	    (c_segment_t *)current_chead, scratch_buf);
+
+	for (i = 0; i < count; i++) {
+		pmap_unmap_compressor_page(pns[i], srcs[i]);
+	}
+
+	return n;
+}
+
 void
 vm_compressor_transfer(
 	int     *dst_slot_p,
@@ -370,6 +370,13 @@ typedef struct c_segment *c_segment_t;
 typedef struct c_slot   *c_slot_t;
 
 uint64_t vm_compressor_total_compressions(void);
+struct compressor_outcome_stats;
+void vm_compressor_outcome_stats_get(struct compressor_outcome_stats *);
+kern_return_t vm_compressor_major_compact_set_workers(uint32_t);
+kern_return_t vm_compressor_major_compact_set_chunk(uint32_t);
+#if DEVELOPMENT || DEBUG
+kern_return_t vm_compressor_major_compact_test(uint64_t *, uint64_t *);
+#endif /* DEVELOPMENT || DEBUG */
 void vm_wake_compactor_swapper(void);
 void vm_run_compactor(void);
 void vm_thrashing_jetsam_done(void);
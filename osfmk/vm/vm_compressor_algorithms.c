@@ -31,11 +31,19 @@
  */
 #include "lz4.h"
 #include "WKdm_new.h"
+#if !VM_COMPRESSOR_CODEC_TEST
 #include <vm/vm_compressor_algorithms.h>
 #include <vm/vm_compressor.h>
+#else
+/*
+ * Built into the host side codec harness (tests/vm/compressor_codec_bench.c)
+ * which provides the handful of kernel definitions used below.
+ */
+#include "vm_compressor_algorithms.h"
+#endif /* !VM_COMPRESSOR_CODEC_TEST */
 
 #define MZV_MAGIC (17185)
-#if defined(__arm64__)
+#if defined(__arm64__) && !VM_COMPRESSOR_CODEC_TEST
 #include <arm64/proc_reg.h>
 #endif
 
@@ -238,28 +246,31 @@ static inline bool
 WKdmD(WK_word* src_buf, WK_word* dest_buf, WK_word* scratch, unsigned int bytes,
     __unused uint32_t *pop_count)
 {
-#if defined(__arm64__)
-#endif
 	WKdm_hv(src_buf);
+#if !VM_COMPRESSOR_CODEC_TEST
+	if (__probable(!vm_compressor_force_sw_wkdm)) {
 #if defined(__arm64__)
 #ifndef __ARM_16K_PG__
-	if (PAGE_SIZE == 4096) {
-		WKdm_decompress_4k(src_buf, dest_buf, scratch, bytes);
-	} else
+		if (PAGE_SIZE == 4096) {
+			WKdm_decompress_4k(src_buf, dest_buf, scratch, bytes);
+		} else
 #endif /* !____ARM_16K_PG__ */
-	{
-		__unused uint64_t wdsstart;
+		{
+			__unused uint64_t wdsstart;
 
-		VM_COMPRESSOR_STAT_DBG(wdsstart = mach_absolute_time());
-		WKdm_decompress_16k(src_buf, dest_buf, scratch, bytes);
+			VM_COMPRESSOR_STAT_DBG(wdsstart = mach_absolute_time());
+			WKdm_decompress_16k(src_buf, dest_buf, scratch, bytes);
 
-		VM_COMPRESSOR_STAT_DBG(compressor_stats.wks_dabstime += mach_absolute_time() - wdsstart);
-		VM_COMPRESSOR_STAT(compressor_stats.wks_decompressions++);
-	}
+			VM_COMPRESSOR_STAT_DBG(compressor_stats.wks_dabstime += mach_absolute_time() - wdsstart);
+			VM_COMPRESSOR_STAT(compressor_stats.wks_decompressions++);
+		}
 #else /* !defined arm64 */
-	WKdm_decompress_new(src_buf, dest_buf, scratch, bytes);
+		WKdm_decompress_new(src_buf, dest_buf, scratch, bytes);
 #endif
-	return true;
+		return true;
+	}
+#endif /* !VM_COMPRESSOR_CODEC_TEST */
+	return WKdm_decompress_sw(src_buf, dest_buf, scratch, bytes);
 }
 #if DEVELOPMENT || DEBUG
 int precompy, wkswhw;
@@ -271,26 +282,32 @@ WKdmC(WK_word* src_buf, WK_word* dest_buf, WK_word* scratch,
 {
 	(void)incomp_copy;
 	int wkcval;
+#if !VM_COMPRESSOR_CODEC_TEST
+	if (__probable(!vm_compressor_force_sw_wkdm)) {
 #if defined(__arm64__)
 #ifndef __ARM_16K_PG__
-	if (PAGE_SIZE == 4096) {
-		wkcval = WKdm_compress_4k(src_buf, dest_buf, scratch, limit);
-	} else
+		if (PAGE_SIZE == 4096) {
+			wkcval = WKdm_compress_4k(src_buf, dest_buf, scratch, limit);
+		} else
 #endif /* !____ARM_16K_PG__ */
-	{
-		__unused uint64_t wcswstart;
+		{
+			__unused uint64_t wcswstart;
 
-		VM_COMPRESSOR_STAT_DBG(wcswstart = mach_absolute_time());
+			VM_COMPRESSOR_STAT_DBG(wcswstart = mach_absolute_time());
 
-		int wkswsz = WKdm_compress_16k(src_buf, dest_buf, scratch, limit);
+			int wkswsz = WKdm_compress_16k(src_buf, dest_buf, scratch, limit);
 
-		VM_COMPRESSOR_STAT_DBG(compressor_stats.wks_cabstime += mach_absolute_time() - wcswstart);
-		VM_COMPRESSOR_STAT(compressor_stats.wks_compressions++);
-		wkcval = wkswsz;
-	}
+			VM_COMPRESSOR_STAT_DBG(compressor_stats.wks_cabstime += mach_absolute_time() - wcswstart);
+			VM_COMPRESSOR_STAT(compressor_stats.wks_compressions++);
+			wkcval = wkswsz;
+		}
 #else
-	wkcval = WKdm_compress_new(src_buf, dest_buf, scratch, limit);
+		wkcval = WKdm_compress_new(src_buf, dest_buf, scratch, limit);
 #endif
+		return wkcval;
+	}
+#endif /* !VM_COMPRESSOR_CODEC_TEST */
+	wkcval = WKdm_compress_sw(src_buf, dest_buf, scratch, limit);
 	return wkcval;
 }
 
@@ -458,6 +475,10 @@ vm_compressor_algorithm_init(void)
 #endif
 
 	PE_parse_boot_argn("vm_compressor_codec", &new_codec, sizeof(new_codec));
+	PE_parse_boot_argn("vm_compressor_sw_wkdm", &vm_compressor_force_sw_wkdm,
+	    sizeof(vm_compressor_force_sw_wkdm));
+	PE_parse_boot_argn("vm_compressor_sw_wkdm_simd", &WKdm_sw_simd_enabled,
+	    sizeof(WKdm_sw_simd_enabled));
 	assertf(((new_codec == VM_COMPRESSOR_DEFAULT_CODEC) || (new_codec == CMODE_WK) ||
 	    (new_codec == CMODE_LZ4) || (new_codec == CMODE_HYB)),
 	    "Invalid VM compression codec: %u", new_codec);
@@ -90,6 +90,9 @@ typedef struct {
 
 extern compressor_tuneables_t vmctune;
 
+/* use WKdm_sw.c instead of the assembly, the vm_compressor_sw_wkdm boot-arg */
+extern boolean_t vm_compressor_force_sw_wkdm;
+
 int metacompressor(const uint8_t *in, uint8_t *cdst, int32_t outbufsz,
     uint16_t *codec, void *cscratch, boolean_t *, uint32_t *pop_count_p);
 bool metadecompressor(const uint8_t *source, uint8_t *dest, uint32_t csize,
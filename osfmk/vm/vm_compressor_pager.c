@@ -805,6 +805,62 @@ vm_compressor_pager_put(
 	return KERN_SUCCESS;
 }
 
+/*
+ * Batched version of vm_compressor_pager_put() for pages of the same
+ * pager, see vm_compressor_put_batch(). Returns the number of pages
+ * compressed, which are always the first ones.
+ */
+unsigned int
+vm_compressor_pager_put_batch(
+	memory_object_t                 mem_obj,
+	memory_object_offset_t          *offsets,
+	ppnum_t                         *ppnums,
+	unsigned int                    count,
+	void                            **current_chead,
+	char                            *scratch_buf,
+	int                             *compressed_count_delta_p)
+{
+	compressor_pager_t      pager;
+	compressor_slot_t       *slots[VM_COMPRESSOR_PUT_BATCH_MAX];
+	unsigned int            compressed;
+
+	assert(count <= VM_COMPRESSOR_PUT_BATCH_MAX);
+
+	compressor_pager_stats.put += count;
+
+	*compressed_count_delta_p = 0;
+
+	compressor_pager_lookup(mem_obj, pager);
+
+	for (unsigned int i = 0; i < count; i++) {
+		if ((uint32_t)(offsets[i] / PAGE_SIZE) != (offsets[i] / PAGE_SIZE)) {
+			/* overflow */
+			panic("%s: offset 0x%llx overflow",
+			    __FUNCTION__, (uint64_t) offsets[i]);
+		}
+
+		compressor_pager_slot_lookup(pager, TRUE, offsets[i], &slots[i]);
+
+		if (slots[i] == NULL) {
+			/* out of range ? */
+			panic("vm_compressor_pager_put_batch: out of range");
+		}
+		if (*slots[i] != 0) {
+			/*
+			 * Already compressed: forget about the old one,
+			 * see vm_compressor_pager_put().
+			 */
+			vm_compressor_free(slots[i], 0);
+			*compressed_count_delta_p -= 1;
+		}
+	}
+
+	compressed = vm_compressor_put_batch(ppnums, slots, count, current_chead, scratch_buf);
+	*compressed_count_delta_p += compressed;
+
+	return compressed;
+}
+
 
 kern_return_t
 vm_compressor_pager_get(
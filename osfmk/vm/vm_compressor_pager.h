@@ -43,6 +43,14 @@ extern kern_return_t vm_compressor_pager_put(
 	void                            **current_chead,
 	char                            *scratch_buf,
 	int                             *compressed_count_delta_p);
+extern unsigned int vm_compressor_pager_put_batch(
+	memory_object_t                 mem_obj,
+	memory_object_offset_t          *offsets,
+	ppnum_t                         *ppnums,
+	unsigned int                    count,
+	void                            **current_chead,
+	char                            *scratch_buf,
+	int                             *compressed_count_delta_p);
 extern kern_return_t vm_compressor_pager_get(
 	memory_object_t         mem_obj,
 	memory_object_offset_t  offset,
@@ -116,6 +124,9 @@ extern bool osenvironment_is_diagnostics(void);
 extern void vm_compressor_init(void);
 extern bool vm_compressor_is_slot_compressed(int *slot);
 extern int vm_compressor_put(ppnum_t pn, int *slot, void **current_chead, char *scratch_buf, bool unmodified);
+/* max number of pages handed to vm_compressor_put_batch() at once */
+#define VM_COMPRESSOR_PUT_BATCH_MAX     16
+extern unsigned int vm_compressor_put_batch(ppnum_t *pns, int **slots, unsigned int count, void **current_chead, char *scratch_buf);
 extern int vm_compressor_get(ppnum_t pn, int *slot, vm_compressor_options_t flags);
 extern int vm_compressor_free(int *slot, vm_compressor_options_t flags);
 
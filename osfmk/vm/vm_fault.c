@@ -4159,6 +4159,89 @@ vm_fault_type_for_tracing(boolean_t need_copy_on_read, int type_of_fault)
 	return type_of_fault;
 }
 
+/*
+ * Fault-around: after a soft read fault on a page of the object a map
+ * entry points at, also map the resident neighbors of that page in a
+ * naturally aligned window of map->fault_around pages, clipped to the
+ * entry.  A process walking through mapped files or its own text then
+ * takes one fault per window instead of one per page.
+ *
+ * Neighbors are mapped read-only like the faulting page, and only when
+ * that needs neither the object lock exclusive nor a blocking pmap
+ * operation: busy, absent or unusual pages, pages in the laundry, pages
+ * that still need code-signing validation and addresses that are
+ * already mapped are skipped, and the first pmap_enter() that would
+ * need a page table allocation ends the window.
+ *
+ * Called with the map and the object locked, from the fast path of
+ * vm_fault_internal() once the faulting page is mapped.
+ */
+SCALABLE_COUNTER_DEFINE(vm_fault_around_calls);
+SCALABLE_COUNTER_DEFINE(vm_fault_around_pages);
+
+static void
+vm_fault_around(
+	vm_map_t                map,
+	pmap_t                  pmap,
+	vm_object_t             object,
+	vm_map_offset_t         vaddr,
+	vm_object_offset_t      offset,
+	vm_prot_t               prot,
+	vm_object_fault_info_t  fault_info,
+	uint8_t                 *object_lock_type)
+{
+	vm_map_size_t           window = ptoa_64(map->fault_around);
+	vm_map_offset_t         before, after;
+	vm_object_offset_t      off, hi;
+	boolean_t               need_retry = FALSE;
+	uint32_t                mapped = 0;
+	int                     type_of_fault;
+	kern_return_t           kr;
+	vm_page_t               m;
+
+	before = vaddr % window;
+	after = window - before;
+	off = offset - MIN(before, offset - fault_info->lo_offset);
+	hi = offset + MIN(after, fault_info->hi_offset - offset);
+
+	for (; off < hi; off += PAGE_SIZE_64) {
+		if (off == offset) {
+			continue;
+		}
+		m = vm_page_lookup(object, off);
+		if (m == VM_PAGE_NULL ||
+		    m->vmp_busy ||
+		    m->vmp_laundry ||
+		    m->vmp_fictitious ||
+		    (m->vmp_unusual && (m->vmp_error || m->vmp_restart ||
+		    m->vmp_private || m->vmp_absent)) ||
+		    vm_fault_cs_need_validation(pmap, m, object, PAGE_SIZE, 0)) {
+			continue;
+		}
+		if (pmap_find_phys(pmap, vaddr + (off - offset)) != 0) {
+			continue;
+		}
+
+		type_of_fault = DBG_CACHE_HIT_FAULT;
+		kr = vm_fault_enter(m, pmap, vaddr + (off - offset),
+		    PAGE_SIZE, 0, prot & ~VM_PROT_WRITE, VM_PROT_READ,
+		    FALSE, FALSE, VM_KERN_MEMORY_NONE, fault_info,
+		    &need_retry, &type_of_fault, object_lock_type);
+		if (need_retry) {
+			break;
+		}
+		if (kr == KERN_SUCCESS) {
+			mapped++;
+		}
+	}
+
+	counter_inc(&vm_fault_around_calls);
+	if (mapped) {
+		counter_add(&vm_fault_around_pages, mapped);
+		os_atomic_add(&map->fault_around_pages, mapped, relaxed);
+	}
+}
+
 uint64_t vm_fault_resilient_media_initiate = 0;
 uint64_t vm_fault_resilient_media_retry = 0;
 uint64_t vm_fault_resilient_media_proceed = 0;
@@ -4239,6 +4322,7 @@ vm_fault_internal(
 	vm_object_t             resilient_media_object = VM_OBJECT_NULL;
 	vm_object_offset_t      resilient_media_offset = (vm_object_offset_t)-1;
 	bool                    page_needs_data_sync = false;
+	bool                    fault_around;
 	/*
 	 * Was the VM object contended when vm_map_lookup_and_lock_object locked it?
 	 * If so, the zero fill path will drop the lock
@@ -4361,7 +4445,7 @@ RetryFault:
 	 */
 	fault_type = original_fault_type;
 	map = original_map;
-	vm_map_lock_read(map);
+	vm_map_lock_read_fault(map);
 
 	if (resilient_media_retry) {
 		/*
@@ -4938,6 +5022,25 @@ FastPmapEnter:
 				}
 				assertf(VM_PAGE_OBJECT(m) == m_object, "m=%p m_object=%p object=%p", m, m_object, object);
 				assert(VM_PAGE_OBJECT(m) != VM_OBJECT_NULL);
+
+				/*
+				 * Soft read faults on the entry's own object
+				 * may map resident neighbors as well.
+				 */
+				fault_around = (original_map->fault_around != 0 &&
+				    map == original_map &&
+				    caller_pmap == PMAP_NULL &&
+				    physpage_p == NULL &&
+				    !wired && !change_wiring && !need_copy &&
+				    !(fault_type & VM_PROT_WRITE) &&
+				    top_object == VM_OBJECT_NULL &&
+				    m_object == object &&
+				    type_of_fault == DBG_CACHE_HIT_FAULT &&
+				    fault_page_size == PAGE_SIZE &&
+				    !pmap_has_prot_policy(pmap,
+				    fault_info.pmap_options & PMAP_OPTIONS_TRANSLATED_ALLOW_EXECUTE,
+				    prot));
+
 				if (caller_pmap) {
 					kr = vm_fault_enter(m,
 					    caller_pmap,
@@ -4970,6 +5073,12 @@ FastPmapEnter:
 					    &object_lock_type);
 				}
 
+				if (fault_around && kr == KERN_SUCCESS && !need_retry) {
+					vm_fault_around(original_map, pmap, object,
+					    vaddr, offset, prot, &fault_info,
+					    &object_lock_type);
+				}
+
 				vm_fault_complete(
 					map,
 					real_map,
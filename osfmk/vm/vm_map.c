@@ -180,6 +180,22 @@ static TUNABLE(bool, vm_map_executable_immutable,
 #define vm_map_executable_immutable true
 #endif
 
+/*
+ * Fault-around window of new user maps, in pages (see vm_fault_around()).
+ * Off by default; vm.fault_around changes it for the calling process.
+ */
+TUNABLE_WRITEABLE(unsigned int, vm_fault_around_default,
+    "vm_fault_around", 0);
+
+/*
+ * Whether new user maps let vm_fault() look them up under a pin
+ * instead of their lock (see vm_map_lock_read_fault()).
+ */
+TUNABLE(unsigned int, vm_map_lockless_faults, "vm_lockless_faults", 1);
+
+/* vmmap_serial of the next map, never 0 */
+static uint64_t vm_map_serial_next;
+
 os_refgrp_decl(static, map_refgrp, "vm_map", NULL);
 
 extern u_int32_t random(void);  /* from <libkern/libkern.h> */
@@ -542,6 +558,153 @@ vm_map_entry_copy(
 	new->vme_no_copy_on_read = FALSE;
 }
 
+/*
+ * Lockless fault lookups.
+ *
+ * With many threads faulting, the cache line of the map lock, which
+ * every fault takes shared, is what limits the fault rate of a process.
+ * vm_fault() can instead "pin" a user map: the thread bumps its CPU's
+ * slot of vmmap_pins_taken and checks that nobody holds the map
+ * exclusive, and bumps vmmap_pins_dropped when it is done.  Whoever
+ * takes the lock exclusive raises vmmap_pin_writer so that no new pin
+ * is taken, and waits until every pin taken has been dropped before
+ * touching the map.  A pin thus gives the same guarantees as holding
+ * the lock shared, without writing to any shared cache line.
+ *
+ * Summing the per-CPU counters is not free, so an exclusive holder
+ * only does it if a pin was taken since the previous one: pins record
+ * the epoch they were taken in in vmmap_pin_used, and each exclusive
+ * holder bumps vmmap_pin_epoch.
+ *
+ * The pinned map is remembered in the thread, so that
+ * vm_map_unlock_read() and the lock assertions work on a pinned map
+ * as on a locked one.  A pin cannot be upgraded:
+ * vm_map_lock_read_to_write() fails and drops it, like a failed
+ * upgrade drops the shared lock.
+ */
+SCALABLE_COUNTER_DEFINE(vm_map_fault_pins);
+SCALABLE_COUNTER_DEFINE(vm_map_fault_pin_fallbacks);
+SCALABLE_COUNTER_DEFINE(vm_map_pin_drains);
+
+static bool
+vm_map_pins_quiescent(vm_map_t map)
+{
+	uint64_t dropped;
+
+	/*
+	 * A pin is dropped after it is taken: read the drops first,
+	 * so that no drop is counted without the matching take.
+	 */
+	dropped = counter_load(&map->vmmap_pins_dropped);
+	os_atomic_thread_fence(acquire);
+	return counter_load(&map->vmmap_pins_taken) == dropped;
+}
+
+/*
+ * Shuts out new pins and returns whether the pins already taken
+ * might not all have been dropped yet.
+ */
+static bool
+vm_map_pin_writer_enter(vm_map_t map)
+{
+	uint64_t epoch = map->vmmap_pin_epoch;
+	bool used;
+
+	os_atomic_store(&map->vmmap_pin_writer, true, relaxed);
+	os_atomic_thread_fence(seq_cst);
+	used = os_atomic_load(&map->vmmap_pin_used, relaxed) == epoch;
+	os_atomic_store(&map->vmmap_pin_epoch, epoch + 1, relaxed);
+
+	return used && !vm_map_pins_quiescent(map);
+}
+
+static void
+vm_map_pin_drop(vm_map_t map)
+{
+	os_atomic_thread_fence(release);
+	counter_inc(&map->vmmap_pins_dropped);
+	os_atomic_thread_fence(seq_cst);
+	if (os_atomic_load(&map->vmmap_pin_writer, relaxed)) {
+		thread_wakeup((event_t)&map->vmmap_pin_writer);
+	}
+}
+
+void
+vm_map_pin_drain(vm_map_t map)
+{
+	if (!vm_map_pin_writer_enter(map)) {
+		return;
+	}
+
+	counter_inc(&vm_map_pin_drains);
+	for (;;) {
+		assert_wait((event_t)&map->vmmap_pin_writer, THREAD_UNINT);
+		if (vm_map_pins_quiescent(map)) {
+			clear_wait(current_thread(), THREAD_AWAKENED);
+			break;
+		}
+		thread_block(THREAD_CONTINUE_NULL);
+	}
+}
+
+void
+vm_map_lock_read_fault(vm_map_t map)
+{
+	thread_t thread = current_thread();
+	uint64_t epoch;
+
+	if (map->vmmap_pins_taken == NULL ||
+	    thread->t_map_fault_pin != VM_MAP_NULL) {
+		vm_map_lock_read(map);
+		return;
+	}
+
+	epoch = os_atomic_load(&map->vmmap_pin_epoch, relaxed);
+	if (os_atomic_load(&map->vmmap_pin_used, relaxed) < epoch) {
+		os_atomic_max(&map->vmmap_pin_used, epoch, relaxed);
+	}
+	counter_inc(&map->vmmap_pins_taken);
+	os_atomic_thread_fence(seq_cst);
+
+	if (__improbable(os_atomic_load(&map->vmmap_pin_writer, acquire) ||
+	    os_atomic_load(&map->vmmap_pin_epoch, relaxed) != epoch)) {
+		/* someone has or had the map exclusive: wait for them */
+		vm_map_pin_drop(map);
+		counter_inc(&vm_map_fault_pin_fallbacks);
+		vm_map_lock_read(map);
+		return;
+	}
+
+	DTRACE_VM(vm_map_lock_r);
+	thread->t_map_fault_pin = map;
+	thread->t_map_fault_pin_epoch = epoch;
+	counter_inc(&vm_map_fault_pins);
+}
+
+void
+vm_map_unpin(vm_map_t map)
+{
+	thread_t thread = current_thread();
+
+	assert(thread->t_map_fault_pin == map);
+	thread->t_map_fault_pin = VM_MAP_NULL;
+	vm_map_pin_drop(map);
+}
+
+wait_result_t
+vm_map_entry_sleep(vm_map_t map, wait_interrupt_t interruptible)
+{
+	wait_result_t wr;
+
+	vm_map_pin_writer_end(map);
+	wr = lck_rw_sleep(&map->lock,
+	    LCK_SLEEP_EXCLUSIVE | LCK_SLEEP_PROMOTED_PRI,
+	    (event_t)&map->hdr, interruptible);
+	vm_map_pin_writer_begin(map);
+
+	return wr;
+}
+
 /*
  * Normal lock_read_to_write() returns FALSE/0 on failure.
  * These functions evaluate to zero on success and non-zero value on failure.
@@ -550,8 +713,13 @@ __attribute__((always_inline))
 int
 vm_map_lock_read_to_write(vm_map_t map)
 {
+	if (vm_map_is_pinned(map)) {
+		vm_map_unpin(map);
+		return 1;
+	}
 	if (lck_rw_lock_shared_to_exclusive(&(map)->lock)) {
 		DTRACE_VM(vm_map_lock_upgrade);
+		vm_map_pin_writer_begin(map);
 		return 0;
 	}
 	return 1;
@@ -562,6 +730,14 @@ boolean_t
 vm_map_try_lock(vm_map_t map)
 {
 	if (lck_rw_try_lock_exclusive(&(map)->lock)) {
+		if (map->vmmap_pins_taken == NULL) {
+			map->vmmap_pin_epoch++;
+		} else if (vm_map_pin_writer_enter(map)) {
+			/* faults in flight, don't wait for them */
+			vm_map_pin_writer_end(map);
+			lck_rw_done(&(map)->lock);
+			return FALSE;
+		}
 		DTRACE_VM(vm_map_lock_w);
 		return TRUE;
 	}
@@ -1513,11 +1689,21 @@ vm_map_create_options(
 	result->max_offset = max;
 	result->first_free = vm_map_to_entry(result);
 	result->hint = vm_map_to_entry(result);
+	result->vmmap_serial = os_atomic_inc(&vm_map_serial_next, relaxed);
 
 	if (options & VM_MAP_CREATE_NEVER_FAULTS) {
 		assert(pmap == kernel_pmap);
 		result->never_faults = true;
 	}
+	if (pmap != kernel_pmap) {
+		result->fault_around = MIN(vm_fault_around_default,
+		    VM_FAULT_AROUND_MAX);
+	}
+	if (pmap != kernel_pmap && pmap != PMAP_NULL && vm_map_lockless_faults) {
+		counter_alloc(&result->vmmap_pins_taken);
+		counter_alloc(&result->vmmap_pins_dropped);
+		result->vmmap_pin_epoch = 1;
+	}
 
 	/* "has_corpse_footprint" and "holelistenabled" are mutually exclusive */
 	if (options & VM_MAP_CREATE_CORPSE_FOOTPRINT) {
@@ -1814,6 +2000,11 @@ vm_map_destroy(
 
 	lck_rw_destroy(&map->lock, &vm_map_lck_grp);
 
+	if (map->vmmap_pins_taken != NULL) {
+		counter_free(&map->vmmap_pins_taken);
+		counter_free(&map->vmmap_pins_dropped);
+	}
+
 #if CONFIG_MAP_RANGES
 	kfree_data(map->extra_ranges,
 	    map->extra_ranges_count * sizeof(struct vm_map_user_range));
@@ -1898,6 +2089,75 @@ vm_map_lookup_entry_or_next(
 	return false;
 }
 
+/*
+ *	vm_map_lookup_entry_cached:	[ internal use only ]
+ *
+ *	vm_map_lookup_entry() for vm_map_lookup_and_lock_object().
+ *	The map's hint is the entry last inserted, which does little
+ *	for threads faulting in different regions of the same map, so
+ *	each thread remembers the last few entries it found there, and
+ *	uses one again as long as nobody has had the map exclusive since:
+ *	every exclusive holder bumps vmmap_pin_epoch as it takes the lock.
+ *
+ *	The map must be locked shared or pinned, not exclusive: an
+ *	exclusive holder changes entries after bumping the epoch.
+ *	A writer bumps the epoch before it waits for the pins to be
+ *	dropped, so under a pin the entries found are tagged with the
+ *	epoch the pin was taken in, which the writer leaves behind.
+ *	Kernel maps are looked up as usual.
+ */
+static boolean_t
+vm_map_lookup_entry_cached(
+	vm_map_t        map,
+	vm_map_offset_t address,
+	vm_map_entry_t  *entry)         /* OUT */
+{
+	thread_t thread = current_thread();
+	struct thread_map_lookup *tml;
+	uint32_t victim = THREAD_MAP_LOOKUP_CACHE_SIZE;
+	uint64_t epoch;
+
+	if (map->pmap == kernel_pmap) {
+		return vm_map_lookup_entry(map, address, entry);
+	}
+
+	if (vm_map_is_pinned(map)) {
+		epoch = thread->t_map_fault_pin_epoch;
+	} else {
+		epoch = os_atomic_load(&map->vmmap_pin_epoch, relaxed);
+	}
+
+	for (uint32_t i = 0; i < THREAD_MAP_LOOKUP_CACHE_SIZE; i++) {
+		tml = &thread->t_map_lookup_cache[i];
+		if (tml->tml_serial != map->vmmap_serial ||
+		    tml->tml_epoch != epoch) {
+			/* another map's, or stale: reuse it first */
+			victim = i;
+			continue;
+		}
+		if (address >= tml->tml_entry->vme_start &&
+		    address < tml->tml_entry->vme_end) {
+			thread->t_map_lookup_hits++;
+			*entry = tml->tml_entry;
+			return TRUE;
+		}
+	}
+
+	thread->t_map_lookup_misses++;
+	if (!vm_map_lookup_entry(map, address, entry)) {
+		return FALSE;
+	}
+
+	if (victim == THREAD_MAP_LOOKUP_CACHE_SIZE) {
+		victim = thread->t_map_lookup_next++ % THREAD_MAP_LOOKUP_CACHE_SIZE;
+	}
+	tml = &thread->t_map_lookup_cache[victim];
+	tml->tml_serial = map->vmmap_serial;
+	tml->tml_epoch = epoch;
+	tml->tml_entry = *entry;
+	return TRUE;
+}
+
 #if CONFIG_PROB_GZALLOC
 boolean_t
 vm_map_lookup_entry_allow_pgz(
@@ -8888,6 +9148,8 @@ in_transition:
 
 			if (lck_rw_lock_yield_exclusive(&map->lock,
 			    LCK_RW_YIELD_ANY_WAITER)) {
+				/* whoever had it since shut pins back in */
+				vm_map_pin_writer_begin(map);
 				if (last_timestamp != map->timestamp + 1) {
 					state |= VMDS_NEEDS_LOOKUP;
 				}
@@ -8967,6 +9229,44 @@ vm_map_remove_guard(
 	return vm_map_remove_and_unlock(map, start, end, flags, guard);
 }
 
+/*
+ *	vm_map_remove_ranges:
+ *
+ *	Remove several address ranges from the target map under a
+ *	single hold of its lock, for callers that give back many small
+ *	ranges at once.  Stops at the first range that can't be removed
+ *	and returns its index in *failed_idx; the ranges before it are
+ *	gone.
+ */
+kmem_return_t
+vm_map_remove_ranges(
+	vm_map_t                map,
+	const struct mach_vm_range *ranges,
+	uint32_t                count,
+	vmr_flags_t             flags,
+	uint32_t                *failed_idx)
+{
+	kmem_return_t ret = { };
+	VM_MAP_ZAP_DECLARE(zap);
+
+	*failed_idx = count;
+
+	vm_map_lock(map);
+	for (uint32_t i = 0; i < count; i++) {
+		ret = vm_map_delete(map, ranges[i].min_address,
+		    ranges[i].max_address, flags, KMEM_GUARD_NONE, &zap);
+		if (ret.kmr_return != KERN_SUCCESS) {
+			*failed_idx = i;
+			break;
+		}
+	}
+	vm_map_unlock(map);
+
+	vm_map_zap_dispose(&zap);
+
+	return ret;
+}
+
 /*
  *	vm_map_terminate:
  *
@@ -13305,6 +13605,8 @@ vm_map_fork(
 
 	/* inherit cs_enforcement */
 	vm_map_cs_enforcement_set(new_map, old_map->cs_enforcement);
+	/* and the fault-around window */
+	new_map->fault_around = old_map->fault_around;
 
 	vm_map_lock(new_map);
 	vm_commit_pagezero_status(new_map);
@@ -13787,9 +14089,10 @@ RetryLookup:
 
 		/*
 		 *	Entry was either not a valid hint, or the vaddr
-		 *	was not contained in the entry, so do a full lookup.
+		 *	was not contained in the entry, so try the entries
+		 *	this thread found last, then do a full lookup.
 		 */
-		if (!vm_map_lookup_entry(map, vaddr, &tmp_entry)) {
+		if (!vm_map_lookup_entry_cached(map, vaddr, &tmp_entry)) {
 			if ((cow_sub_map_parent) && (cow_sub_map_parent != map)) {
 				vm_map_unlock(cow_sub_map_parent);
 			}
@@ -20621,6 +20924,30 @@ vm_map_set_tpro(vm_map_t map)
 #endif
 }
 
+/*
+ * Number of pages around a soft read fault that vm_fault() maps when
+ * they are resident, 0 to only map the faulting page.
+ */
+void
+vm_map_set_fault_around(vm_map_t map, unsigned int pages)
+{
+	vm_map_lock(map);
+	map->fault_around = MIN(pages, VM_FAULT_AROUND_MAX);
+	vm_map_unlock(map);
+}
+
+unsigned int
+vm_map_fault_around(vm_map_t map)
+{
+	return map->fault_around;
+}
+
+uint32_t
+vm_map_fault_around_pages(vm_map_t map)
+{
+	return os_atomic_load(&map->fault_around_pages, relaxed);
+}
+
 /*
  * Does this map have TPRO enforcement enabled
  */
@@ -21254,7 +21581,7 @@ vm_map_inject_error(vm_map_t map, vm_map_offset_t vaddr)
 	int result = KERN_FAILURE;
 
 	vaddr = vm_map_trunc_page(vaddr, PAGE_MASK);
-	vm_map_lock(map);
+	vm_map_lock_read(map);
 
 	result = vm_map_lookup_and_lock_object(&map, vaddr, VM_PROT_READ,
 	    OBJECT_LOCK_EXCLUSIVE, &version, &object, &offset, &prot, &wired,
@@ -21275,7 +21602,7 @@ vm_map_inject_error(vm_map_t map, vm_map_offset_t vaddr)
 	if (real_map != map) {
 		vm_map_unlock(real_map);
 	}
-	vm_map_unlock(map);
+	vm_map_unlock_read(map);
 
 	return result;
 }
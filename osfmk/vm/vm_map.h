@@ -94,6 +94,7 @@
 #include <kern/locks.h>
 #include <kern/zalloc.h>
 #include <kern/macro_help.h>
+#include <kern/counter.h>
 
 #include <kern/thread.h>
 #include <os/refcnt.h>
@@ -625,8 +626,19 @@ struct _vm_map {
 	/* boolean_t */ never_faults:1,           /* this map should never cause faults */
 	/* boolean_t */ uses_user_ranges:1,       /* has the map been configured to use user VM ranges */
 	/* boolean_t */ tpro_enforcement:1,       /* enforce TPRO propagation */
-	/* reserved  */ pad:11;
+	/* unsigned  */ fault_around:6,           /* pages mapped around a soft read fault, 0 = off */
+	/* reserved  */ pad:5;
 	unsigned int            timestamp;        /* Version number */
+	uint32_t                fault_around_pages; /* resident neighbors mapped by fault-around */
+
+	/* lockless fault lookups, see vm_map_lock_read_fault() */
+	scalable_counter_t      vmmap_pins_taken;   /* pins taken, NULL if not enabled */
+	scalable_counter_t      vmmap_pins_dropped; /* pins dropped */
+	uint64_t                vmmap_pin_epoch;    /* bumped by each exclusive holder */
+	uint64_t                vmmap_pin_used;     /* last epoch a pin was taken in */
+	bool                    vmmap_pin_writer;   /* held exclusive, no new pins */
+
+	uint64_t                vmmap_serial;       /* unique to this map, for vm_map_lookup_entry_cached() */
 };
 
 #define CAST_TO_VM_MAP_ENTRY(x) ((struct vm_map_entry *)(uintptr_t)(x))
@@ -750,17 +762,51 @@ vm_map_copy_adjust_to_target(
 	((map)->timestamp = 0 ,                                         \
 	lck_rw_init(&(map)->lock, &vm_map_lck_grp, &vm_map_lck_rw_attr))
 
+/*
+ * A map with pins enabled can be read by vm_fault() without its lock:
+ * see vm_map_lock_read_fault().  Every exclusive holder of the lock
+ * calls vm_map_pin_writer_begin() once it owns it, which waits for
+ * such readers to be done, and vm_map_pin_writer_end() before letting
+ * go of it.  vm_map_pin_writer_begin() bumps vmmap_pin_epoch of every
+ * map, pins or not, for vm_map_lookup_entry_cached().  vm_map_unlock()
+ * and vm_map_unlock_read() of a map the thread pinned drop the pin.
+ */
+#define vm_map_pin_writer_begin(map)                    \
+	MACRO_BEGIN                                     \
+	if ((map)->vmmap_pins_taken != NULL) {          \
+	        vm_map_pin_drain(map);                  \
+	} else {                                        \
+	        (map)->vmmap_pin_epoch++;               \
+	}                                               \
+	MACRO_END
+
+#define vm_map_pin_writer_end(map)                                      \
+	MACRO_BEGIN                                                     \
+	if ((map)->vmmap_pins_taken != NULL) {                          \
+	        os_atomic_store(&(map)->vmmap_pin_writer, false, release); \
+	}                                                               \
+	MACRO_END
+
+#define vm_map_is_pinned(map) \
+	(current_thread()->t_map_fault_pin == (map))
+
 #define vm_map_lock(map)                     \
 	MACRO_BEGIN                          \
 	DTRACE_VM(vm_map_lock_w);            \
 	lck_rw_lock_exclusive(&(map)->lock); \
+	vm_map_pin_writer_begin(map);        \
 	MACRO_END
 
-#define vm_map_unlock(map)          \
-	MACRO_BEGIN                 \
-	DTRACE_VM(vm_map_unlock_w); \
-	(map)->timestamp++;         \
-	lck_rw_done(&(map)->lock);  \
+#define vm_map_unlock(map)                      \
+	MACRO_BEGIN                             \
+	DTRACE_VM(vm_map_unlock_w);             \
+	if (__improbable(vm_map_is_pinned(map))) { \
+	        vm_map_unpin(map);              \
+	} else {                                \
+	        (map)->timestamp++;             \
+	        vm_map_pin_writer_end(map);     \
+	        lck_rw_done(&(map)->lock);      \
+	}                                       \
 	MACRO_END
 
 #define vm_map_lock_read(map)             \
@@ -769,19 +815,30 @@ vm_map_copy_adjust_to_target(
 	lck_rw_lock_shared(&(map)->lock); \
 	MACRO_END
 
-#define vm_map_unlock_read(map)     \
-	MACRO_BEGIN                 \
-	DTRACE_VM(vm_map_unlock_r); \
-	lck_rw_done(&(map)->lock);  \
+#define vm_map_unlock_read(map)                 \
+	MACRO_BEGIN                             \
+	DTRACE_VM(vm_map_unlock_r);             \
+	if (__improbable(vm_map_is_pinned(map))) { \
+	        vm_map_unpin(map);              \
+	} else {                                \
+	        lck_rw_done(&(map)->lock);      \
+	}                                       \
 	MACRO_END
 
 #define vm_map_lock_write_to_read(map)                 \
 	MACRO_BEGIN                                    \
 	DTRACE_VM(vm_map_lock_downgrade);              \
 	(map)->timestamp++;                            \
+	vm_map_pin_writer_end(map);                    \
 	lck_rw_lock_exclusive_to_shared(&(map)->lock); \
 	MACRO_END
 
+extern void vm_map_lock_read_fault(vm_map_t map);
+
+extern void vm_map_unpin(vm_map_t map);
+
+extern void vm_map_pin_drain(vm_map_t map);
+
 __attribute__((always_inline))
 int vm_map_lock_read_to_write(vm_map_t map);
 
@@ -794,10 +851,18 @@ boolean_t vm_map_try_lock_read(vm_map_t map);
 int vm_self_region_page_shift(vm_map_t target_map);
 int vm_self_region_page_shift_safely(vm_map_t target_map);
 
-#define vm_map_lock_assert_held(map) \
-	LCK_RW_ASSERT(&(map)->lock, LCK_RW_ASSERT_HELD)
-#define vm_map_lock_assert_shared(map)  \
-	LCK_RW_ASSERT(&(map)->lock, LCK_RW_ASSERT_SHARED)
+#define vm_map_lock_assert_held(map)                            \
+	MACRO_BEGIN                                             \
+	if (!vm_map_is_pinned(map)) {                           \
+	        LCK_RW_ASSERT(&(map)->lock, LCK_RW_ASSERT_HELD); \
+	}                                                       \
+	MACRO_END
+#define vm_map_lock_assert_shared(map)                            \
+	MACRO_BEGIN                                               \
+	if (!vm_map_is_pinned(map)) {                             \
+	        LCK_RW_ASSERT(&(map)->lock, LCK_RW_ASSERT_SHARED); \
+	}                                                         \
+	MACRO_END
 #define vm_map_lock_assert_exclusive(map) \
 	LCK_RW_ASSERT(&(map)->lock, LCK_RW_ASSERT_EXCLUSIVE)
 #define vm_map_lock_assert_notheld(map) \
@@ -883,8 +948,11 @@ extern void             vm_map_reference(
  */
 #define vm_map_entry_wait(map, interruptible)           \
 	((map)->timestamp++ ,                           \
-	 lck_rw_sleep(&(map)->lock, LCK_SLEEP_EXCLUSIVE|LCK_SLEEP_PROMOTED_PRI, \
-	                          (event_t)&(map)->hdr,	interruptible))
+	 vm_map_entry_sleep(map, interruptible))
+
+extern wait_result_t    vm_map_entry_sleep(
+	vm_map_t                map,
+	wait_interrupt_t        interruptible);
 
 
 #define vm_map_entry_wakeup(map)        \
@@ -1540,6 +1608,12 @@ extern void             vm_map_kernel_flags_update_range_id(
 	vm_map_kernel_flags_t  *flags,
 	vm_map_t                map);
 
+#define VM_FAULT_AROUND_MAX     32      /* pages */
+
+extern void vm_map_set_fault_around(vm_map_t map, unsigned int pages);
+extern unsigned int vm_map_fault_around(vm_map_t map);
+extern uint32_t vm_map_fault_around_pages(vm_map_t map);
+
 #if XNU_TARGET_OS_OSX
 extern void vm_map_mark_alien(vm_map_t map);
 extern void vm_map_single_jit(vm_map_t map);
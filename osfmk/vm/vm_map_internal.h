@@ -177,6 +177,14 @@ extern kmem_return_t vm_map_remove_and_unlock(
 	vmr_flags_t     flags,
 	kmem_guard_t    guard) __result_use_check;
 
+/* Deallocate several regions, taking the map lock once */
+extern kmem_return_t vm_map_remove_ranges(
+	vm_map_t                map,
+	const struct mach_vm_range *ranges,
+	uint32_t                count,
+	vmr_flags_t             flags,
+	uint32_t                *failed_idx) __result_use_check;
+
 /* Deallocate a region */
 static inline void
 vm_map_remove(
@@ -229,11 +229,11 @@ struct vm_page {
 	    vmp_reference:1,                 /* page has been used (P) */
 	    vmp_lopage:1,
 	    vmp_realtime:1,                  /* page used by realtime thread */
+	    vmp_gen:2,                       /* generation of an active page, see VM_MGLRU_GEN (P) */
 #if !CONFIG_TRACK_UNMODIFIED_ANON_PAGES
-	    vmp_unused_page_bits:3;
+	    vmp_unused_page_bits:1;
 #else /* ! CONFIG_TRACK_UNMODIFIED_ANON_PAGES */
-	vmp_unmodified_ro:1,                 /* Tracks if an anonymous page is modified after a decompression (O&P).*/
-	vmp_unused_page_bits:2;
+	vmp_unmodified_ro:1;                 /* Tracks if an anonymous page is modified after a decompression (O&P).*/
 #endif /* ! CONFIG_TRACK_UNMODIFIED_ANON_PAGES */
 
 	/*
@@ -1249,6 +1249,45 @@ vm_page_queue_head_t    vm_page_queue_anonymous;        /* inactive memory queue
 extern
 vm_page_queue_head_t    vm_page_queue_throttled;        /* memory queue for throttled pageout pages */
 
+/*
+ * Generations of the active queue, for the multi-generational LRU mode
+ * of the pageout daemon (vm_pageout_mglru).
+ *
+ * Generations are numbered by a sequence that only grows: the youngest
+ * is vm_mglru_max_seq and the oldest still holding pages is
+ * vm_mglru_min_seq.  An active page stores the sequence of its
+ * generation modulo VM_MGLRU_NGENS in vmp_gen.  Pages enter the queue
+ * at its tail in the youngest generation, or at its head in the oldest,
+ * so that the queue always runs from the oldest generation to the
+ * youngest.  The page counts are kept in both modes; the sequences only
+ * move in multi-generational mode.  All of it is protected by the page
+ * queues lock.
+ */
+#define VM_MGLRU_NGENS          4
+#define VM_MGLRU_MIN_GENS       2
+#define VM_MGLRU_GEN(seq)       ((seq) % VM_MGLRU_NGENS)
+
+extern
+uint32_t        vm_mglru_min_seq;
+extern
+uint32_t        vm_mglru_max_seq;
+extern
+uint32_t        vm_mglru_gen_pages[VM_MGLRU_NGENS];
+
+static inline void
+vm_page_mglru_enter(vm_page_t m, uint32_t seq)
+{
+	m->vmp_gen = VM_MGLRU_GEN(seq);
+	vm_mglru_gen_pages[m->vmp_gen]++;
+}
+
+static inline void
+vm_page_mglru_leave(vm_page_t m)
+{
+	assert(vm_mglru_gen_pages[m->vmp_gen] > 0);
+	vm_mglru_gen_pages[m->vmp_gen]--;
+}
+
 extern
 queue_head_t    vm_objects_wired;
 extern
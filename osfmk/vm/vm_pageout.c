@@ -158,6 +158,16 @@ const bool vps_dynamic_priority_enabled = false;
 #endif
 boolean_t vps_yield_for_pgqlockwaiters = TRUE;
 
+/*
+ * Age the active queue in generations (see vm_page_mglru_balance_inactive)
+ * rather than deactivating its pages in FIFO order.
+ */
+TUNABLE_WRITEABLE(uint32_t, vm_pageout_mglru, "vm_pageout_mglru", 0);
+
+#ifndef VM_MGLRU_SCAN_FACTOR
+#define VM_MGLRU_SCAN_FACTOR    8       /* active pages looked at per page deactivated */
+#endif
+
 #ifndef VM_PAGEOUT_BURST_INACTIVE_THROTTLE  /* maximum iterations of the inactive queue w/o stealing/cleaning a page */
 #if !XNU_TARGET_OS_OSX
 #define VM_PAGEOUT_BURST_INACTIVE_THROTTLE 1024
@@ -2853,6 +2863,7 @@ vps_deal_with_throttled_queues(vm_page_t m, vm_object_t *object, uint32_t *vm_pa
 		assert(m->vmp_q_state == VM_PAGE_NOT_ON_Q);
 		vm_page_queue_enter(&vm_page_queue_active, m, vmp_pageq);
 		m->vmp_q_state = VM_PAGE_ON_ACTIVE_Q;
+		vm_page_mglru_enter(m, vm_mglru_max_seq);
 		vm_page_active_count++;
 		vm_page_pageable_external_count++;
 
@@ -2923,6 +2934,122 @@ vps_deal_with_throttled_queues(vm_page_t m, vm_object_t *object, uint32_t *vm_pa
 }
 
 
+/*
+ * Start a new youngest generation.  This ages every active page at once:
+ * pages are only looked at again when they reach the head of the queue.
+ */
+static void
+vm_page_mglru_age(void)
+{
+	assert(vm_mglru_max_seq - vm_mglru_min_seq + 1 < VM_MGLRU_NGENS);
+	assert(vm_mglru_gen_pages[VM_MGLRU_GEN(vm_mglru_max_seq + 1)] == 0);
+
+	vm_mglru_max_seq++;
+	vm_pageout_vminfo.vm_pageout_mglru_aged++;
+
+	VM_DEBUG_CONSTANT_EVENT(vm_mglru_age, VM_MGLRU_AGE, DBG_FUNC_NONE,
+	    vm_mglru_min_seq, vm_mglru_max_seq,
+	    vm_mglru_gen_pages[VM_MGLRU_GEN(vm_mglru_min_seq)], vm_page_active_count);
+}
+
+/*
+ * Multi-generational LRU mode of vm_page_balance_inactive().
+ *
+ * Pages are taken from the head of the active queue, i.e. from the
+ * oldest generation.  The ones that were referenced since they joined
+ * their generation, as told by the pmap's accessed bits, are promoted to
+ * the youngest generation at the tail of the queue; the others move to
+ * the inactive queues, where the pageout scan treats them as usual.
+ * Empty generations are retired from the old end, and a new generation
+ * is started once the youngest one holds its share of the active pages.
+ */
+static void
+vm_page_mglru_balance_inactive(int max_to_move)
+{
+	vm_page_t m;
+	int max_to_scan = max_to_move * VM_MGLRU_SCAN_FACTOR;
+	int refmod_state;
+
+	while (max_to_move > 0 && max_to_scan-- > 0 &&
+	    (vm_page_inactive_count + vm_page_speculative_count) < vm_page_inactive_target &&
+	    !vm_page_queue_empty(&vm_page_queue_active)) {
+		uint32_t ngens;
+
+		while (vm_mglru_min_seq != vm_mglru_max_seq &&
+		    vm_mglru_gen_pages[VM_MGLRU_GEN(vm_mglru_min_seq)] == 0) {
+			vm_mglru_min_seq++;
+		}
+		ngens = vm_mglru_max_seq - vm_mglru_min_seq + 1;
+		if (ngens < VM_MGLRU_MIN_GENS ||
+		    (ngens < VM_MGLRU_NGENS &&
+		    vm_mglru_gen_pages[VM_MGLRU_GEN(vm_mglru_max_seq)] * VM_MGLRU_NGENS >= vm_page_active_count)) {
+			vm_page_mglru_age();
+		}
+
+		m = (vm_page_t) vm_page_queue_first(&vm_page_queue_active);
+
+		assert(m->vmp_q_state == VM_PAGE_ON_ACTIVE_Q);
+		assert(!m->vmp_laundry);
+		assert(!is_kernel_object(VM_PAGE_OBJECT(m)));
+		assert(VM_PAGE_GET_PHYS_PAGE(m) != vm_page_guard_addr);
+
+		DTRACE_VM2(scan, int, 1, (uint64_t *), NULL);
+
+		refmod_state = 0;
+		if (m->vmp_pmapped == TRUE) {
+			/*
+			 * Harvesting the accessed bits can take a while if the page
+			 * has lots of mappings: see vm_page_balance_inactive().
+			 * Stale TLB entries only hide references made in the past,
+			 * so no TLB flush either.
+			 */
+			vm_page_lockconvert_queues();
+			refmod_state = pmap_get_refmod(VM_PAGE_GET_PHYS_PAGE(m));
+			if (refmod_state & VM_MEM_REFERENCED) {
+				pmap_clear_refmod_options(VM_PAGE_GET_PHYS_PAGE(m),
+				    VM_MEM_REFERENCED, PMAP_OPTIONS_NOFLUSH, (void *)NULL);
+			}
+		}
+
+		if (m->vmp_reference || (refmod_state & VM_MEM_REFERENCED)) {
+			m->vmp_reference = FALSE;
+			vm_page_queue_remove(&vm_page_queue_active, m, vmp_pageq);
+			vm_page_mglru_leave(m);
+			vm_page_queue_enter(&vm_page_queue_active, m, vmp_pageq);
+			vm_page_mglru_enter(m, vm_mglru_max_seq);
+			vm_pageout_vminfo.vm_pageout_mglru_promoted++;
+			continue;
+		}
+
+		/*
+		 * The page might be absent or busy,
+		 * but vm_page_deactivate can handle that.
+		 * Its reference bit is already clear.
+		 */
+		vm_page_deactivate_internal(m, FALSE);
+		vm_pageout_vminfo.vm_pageout_mglru_deactivated++;
+		max_to_move--;
+	}
+}
+
+void
+vm_page_mglru_snapshot(uint32_t *min_seq, uint32_t *max_seq, uint32_t *gen_pages, uint32_t ngens)
+{
+	vm_page_lock_queues();
+	*min_seq = vm_mglru_min_seq;
+	*max_seq = vm_mglru_max_seq;
+	for (uint32_t i = 0; i < ngens; i++) {
+		uint32_t seq = vm_mglru_min_seq + i;
+
+		if (i < VM_MGLRU_NGENS && seq <= vm_mglru_max_seq) {
+			gen_pages[i] = vm_mglru_gen_pages[VM_MGLRU_GEN(seq)];
+		} else {
+			gen_pages[i] = 0;
+		}
+	}
+	vm_page_unlock_queues();
+}
+
 void
 vm_page_balance_inactive(int max_to_move)
 {
@@ -2945,6 +3072,11 @@ vm_page_balance_inactive(int max_to_move)
 	    vm_page_inactive_count +
 	    vm_page_speculative_count);
 
+	if (vm_pageout_mglru) {
+		vm_page_mglru_balance_inactive(max_to_move);
+		return;
+	}
+
 	while (max_to_move-- && (vm_page_inactive_count + vm_page_speculative_count) < vm_page_inactive_target) {
 		VM_PAGEOUT_DEBUG(vm_pageout_balanced, 1);
 
@@ -4103,6 +4235,26 @@ uint32_t vm_compressor_time_thread; /* Set via sysctl to record time accrued by
                                      * this thread.
                                      */
 
+/*
+ * Whether "m" can join a batch of pages of "object" compressed together
+ * by vm_pageout_compress_pages().
+ */
+static inline bool
+vm_pageout_compress_batchable(vm_page_t m, vm_object_t object)
+{
+	if (VM_PAGE_OBJECT(m) != object ||
+	    m->vmp_on_specialq == VM_PAGE_SPECIAL_Q_DONATE) {
+		return false;
+	}
+#if CONFIG_TRACK_UNMODIFIED_ANON_PAGES
+	if (m->vmp_unmodified_ro) {
+		return false;
+	}
+#endif /* CONFIG_TRACK_UNMODIFIED_ANON_PAGES */
+	return true;
+}
+
+static uint32_t vm_pageout_compress_pages(void **, char *, vm_page_t *, uint32_t);
 
 OS_NORETURN
 static void
@@ -4224,6 +4376,9 @@ vm_pageout_iothread_internal_continue(struct pgo_iothread_state *cq, __unused wa
 			KERNEL_DEBUG(0xe0400018 | DBG_FUNC_END, q->pgo_laundry, 0, 0, 0, 0);
 
 			while (local_q) {
+				vm_page_t       batch[VM_COMPRESSOR_PUT_BATCH_MAX];
+				uint32_t        batch_cnt, ncompressed;
+
 				KERNEL_DEBUG(0xe0400024 | DBG_FUNC_START, local_cnt, 0, 0, 0, 0);
 
 				m = local_q;
@@ -4252,15 +4407,35 @@ vm_pageout_iothread_internal_continue(struct pgo_iothread_state *cq, __unused wa
 					chead = &cq->current_regular_swapout_chead;
 				}
 
-				if (vm_pageout_compress_page(chead, cq->scratch_buf, m) == KERN_SUCCESS) {
+				/*
+				 * Regular pages of the same object that follow this one
+				 * are compressed with it as a batch.
+				 */
+				batch[0] = m;
+				batch_cnt = 1;
+				if (chead == &cq->current_regular_swapout_chead &&
+				    vm_pageout_compress_batchable(m, VM_PAGE_OBJECT(m))) {
+					while (batch_cnt < VM_COMPRESSOR_PUT_BATCH_MAX && local_q &&
+					    vm_pageout_compress_batchable(local_q, VM_PAGE_OBJECT(m))) {
+						batch[batch_cnt] = local_q;
+						local_q = local_q->vmp_snext;
+						batch[batch_cnt]->vmp_snext = NULL;
+						batch_cnt++;
+					}
+				}
+
+				ncompressed = vm_pageout_compress_pages(chead, cq->scratch_buf, batch, batch_cnt);
+				if (ncompressed) {
 #if DEVELOPMENT || DEBUG
-					ncomps++;
+					ncomps += ncompressed;
 #endif
 					KERNEL_DEBUG(0xe0400024 | DBG_FUNC_END, local_cnt, 0, 0, 0, 0);
 
-					m->vmp_snext = local_freeq;
-					local_freeq = m;
-					local_freed++;
+					for (uint32_t i = 0; i < ncompressed; i++) {
+						batch[i]->vmp_snext = local_freeq;
+						local_freeq = batch[i];
+						local_freed++;
+					}
 
 					if (local_freed >= MAX_FREE_BATCH) {
 						OSAddAtomic64(local_freed, &vm_pageout_vminfo.vm_pageout_compressions);
@@ -4272,7 +4447,7 @@ vm_pageout_iothread_internal_continue(struct pgo_iothread_state *cq, __unused wa
 					}
 				}
 #if DEVELOPMENT || DEBUG
-				num_pages_processed++;
+				num_pages_processed += batch_cnt;
 #endif /* DEVELOPMENT || DEBUG */
 #if !CONFIG_JETSAM
 				while (vm_page_free_count < COMPRESSOR_FREE_RESERVED_LIMIT) {
@@ -4521,6 +4696,101 @@ vm_pageout_compress_page(void **current_chead, char *scratch_buf, vm_page_t m)
 	return retval;
 }
 
+/*
+ * Compresses "count" pages of the same object, each with an activity in
+ * progress on that object, via vm_compressor_pager_put_batch().
+ *
+ * Returns the number of pages compressed, which are always the first
+ * ones and have been removed from the object like in
+ * vm_pageout_compress_page(). The others have been reactivated.
+ */
+static uint32_t
+vm_pageout_compress_pages(void **current_chead, char *scratch_buf, vm_page_t *pages, uint32_t count)
+{
+	vm_object_t             object;
+	memory_object_t         pager;
+	memory_object_offset_t  offsets[VM_COMPRESSOR_PUT_BATCH_MAX];
+	ppnum_t                 ppnums[VM_COMPRESSOR_PUT_BATCH_MAX];
+	int                     compressed_count_delta;
+	uint32_t                compressed, i;
+
+	object = VM_PAGE_OBJECT(pages[0]);
+	pager = object->pager;
+
+	if (count == 1 || !object->pager_initialized || pager == MEMORY_OBJECT_NULL) {
+		/*
+		 * vm_pageout_compress_page() knows how to set up the pager,
+		 * and this is rare enough to not bother batching.
+		 */
+		compressed = 0;
+		for (i = 0; i < count; i++) {
+			if (vm_pageout_compress_page(current_chead, scratch_buf, pages[i]) == KERN_SUCCESS) {
+				if (i != compressed) {
+					pages[compressed] = pages[i];
+				}
+				compressed++;
+			}
+		}
+		return compressed;
+	}
+	assert(object->activity_in_progress >= count);
+
+	for (i = 0; i < count; i++) {
+		assert(VM_PAGE_OBJECT(pages[i]) == object);
+		assert(!pages[i]->vmp_free_when_done);
+		assert(!pages[i]->vmp_laundry);
+
+		offsets[i] = pages[i]->vmp_offset + object->paging_offset;
+		ppnums[i] = VM_PAGE_GET_PHYS_PAGE(pages[i]);
+	}
+
+	compressed = vm_compressor_pager_put_batch(pager, offsets, ppnums, count,
+	    current_chead, scratch_buf, &compressed_count_delta);
+
+	vm_object_lock(object);
+
+	vm_compressor_pager_count(pager,
+	    compressed_count_delta,
+	    FALSE,                       /* shared_lock */
+	    object);
+
+	if (compressed) {
+		/* see vm_pageout_compress_page() */
+		if ((object->purgable != VM_PURGABLE_DENY ||
+		    object->vo_ledger_tag) &&
+		    object->vo_owner != NULL) {
+			vm_object_owner_compressed_update(object,
+			    compressed_count_delta);
+		}
+		counter_add(&vm_statistics_compressions, compressed);
+	}
+
+	for (i = 0; i < count; i++) {
+		vm_page_t m = pages[i];
+
+		assert(!VM_PAGE_WIRED(m));
+
+		if (i < compressed) {
+			if (m->vmp_tabled) {
+				vm_page_remove(m, TRUE);
+			}
+		} else {
+			PAGE_WAKEUP_DONE(m);
+
+			vm_page_lockspin_queues();
+
+			vm_page_activate(m);
+			vm_pageout_vminfo.vm_compressor_failed++;
+
+			vm_page_unlock_queues();
+		}
+		vm_object_activity_end(object);
+	}
+	vm_object_unlock(object);
+
+	return compressed;
+}
+
 
 static void
 vm_pageout_adjust_eq_iothrottle(struct pgo_iothread_state *ethr, boolean_t req_lowpriority)
@@ -8243,7 +8513,16 @@ commit_next_page:
 
 						token_new_pagecount += local_queue_count;
 					} else {
+						vm_page_t lm;
+
 						vm_page_active_count += local_queue_count;
+						/* they went in at the head, i.e. in the oldest generation */
+						for (lm = first_local;; lm = (vm_page_t)VM_PAGE_UNPACK_PTR(lm->vmp_pageq.next)) {
+							vm_page_mglru_enter(lm, vm_mglru_min_seq);
+							if (lm == last_local) {
+								break;
+							}
+						}
 					}
 
 					if (shadow_object->internal) {
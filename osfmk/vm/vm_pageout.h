@@ -196,6 +196,12 @@ extern int      vm_debug_events;
 
 #define VM_PHYS_WRITE_ACCT              0x142
 
+#define VM_RECLAIM_CHUNK                0x143
+#define VM_RECLAIM_DRAIN                0x144
+#define VM_RECLAIM_ALL                  0x145
+
+#define VM_MGLRU_AGE                    0x146
+
 #define VM_DEBUG_EVENT(name, event, control, arg1, arg2, arg3, arg4)    \
 	MACRO_BEGIN                                             \
 	if (__improbable(vm_debug_events)) {                    \
@@ -268,6 +274,26 @@ extern kern_return_t vm_page_alloc_list(
 	kma_flags_t flags,
 	vm_page_t  *list);
 
+/*
+ * Page counts of the generations of the active queue, oldest first:
+ * gen_pages[i] is the size of generation *min_seq + i.
+ */
+extern void vm_page_mglru_snapshot(
+	uint32_t    *min_seq,
+	uint32_t    *max_seq,
+	uint32_t    *gen_pages,
+	uint32_t    ngens);
+
+#if CONFIG_PHANTOM_CACHE
+/*
+ * Refaults of evicted file pages, by log2 of the number of pages
+ * evicted between the eviction and the refault (see vm_phantom_cache.c).
+ */
+extern void vm_phantom_cache_refault_distances(
+	uint64_t    *buckets,
+	uint32_t    nbuckets);
+#endif /* CONFIG_PHANTOM_CACHE */
+
 #endif  /* XNU_KERNEL_PRIVATE */
 
 extern struct vnode * upl_lookup_vnode(upl_t upl);
@@ -748,6 +774,10 @@ struct vm_pageout_vminfo {
 	unsigned long vm_phantom_cache_found_ghost;
 	unsigned long vm_phantom_cache_added_ghost;
 
+	unsigned long vm_pageout_mglru_aged;
+	unsigned long vm_pageout_mglru_promoted;
+	unsigned long vm_pageout_mglru_deactivated;
+
 	unsigned long vm_pageout_protected_sharedcache;
 	unsigned long vm_pageout_forcereclaimed_sharedcache;
 	unsigned long vm_pageout_protected_realtime;
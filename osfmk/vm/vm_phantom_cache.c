@@ -32,6 +32,7 @@
 #include <vm/vm_pageout.h>
 #include <vm/vm_phantom_cache.h>
 #include <vm/vm_compressor.h>
+#include <kern/misc_protos.h>
 
 
 uint32_t phantom_cache_eval_period_in_msecs = 250;
@@ -79,6 +80,17 @@ uint32_t        vm_ghost_hash_mask;             /* Mask for hash function */
 uint32_t        vm_ghost_bucket_hash;           /* Basic bucket hash */
 
 
+/*
+ * Refault distances: the number of entries the phantom cache took in
+ * between the eviction of a page and its refault, in log2 buckets.
+ * That is about how many pages were evicted meanwhile, so it tells how
+ * much more memory would have kept the page, whichever policy (see
+ * vm_pageout_mglru) chose to evict it.  An entry holds up to
+ * VM_GHOST_PAGES_PER_ENTRY neighboring pages and is dated by the first.
+ */
+uint64_t        vm_phantom_cache_refault_distance[VM_GHOST_REFAULT_BUCKETS];
+
+
 int pg_masks[4] = {
 	0x1, 0x2, 0x4, 0x8
 };
@@ -103,6 +115,15 @@ struct phantom_cache_stats {
 
 
 
+void
+vm_phantom_cache_refault_distances(uint64_t *buckets, uint32_t nbuckets)
+{
+	for (uint32_t i = 0; i < nbuckets; i++) {
+		buckets[i] = i < VM_GHOST_REFAULT_BUCKETS ? vm_phantom_cache_refault_distance[i] : 0;
+	}
+}
+
+
 void
 vm_phantom_cache_init(void)
 {
@@ -337,8 +358,18 @@ vm_phantom_cache_update(vm_page_t m)
 	pg_mask = pg_masks[(m->vmp_offset >> PAGE_SHIFT) & VM_GHOST_PAGE_MASK];
 
 	if ((vpce = vm_phantom_cache_lookup_ghost(m, pg_mask))) {
+		uint32_t        ring_size = vm_phantom_cache_num_entries - 1;
+		uint32_t        distance;
+
 		vpce->g_pages_held &= ~pg_mask;
 
+		/* entries 1 to ring_size are handed out in order, see vm_phantom_cache_add_ghost() */
+		distance = (vm_phantom_cache_nindx + ring_size - (uint32_t)(vpce - vm_phantom_cache)) % ring_size;
+		if (distance == 0) {
+			distance = ring_size;
+		}
+		vm_phantom_cache_refault_distance[MIN(fls(distance), VM_GHOST_REFAULT_BUCKETS - 1)]++;
+
 		phantom_cache_stats.pcs_updated_phantom_state++;
 		vm_pageout_vminfo.vm_phantom_cache_found_ghost++;
 
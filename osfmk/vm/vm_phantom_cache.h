@@ -34,6 +34,7 @@
 #define         VM_GHOST_PAGE_MASK      0x3
 #define         VM_GHOST_PAGE_SHIFT     2
 #define         VM_GHOST_INDEX_BITS     (64 - VM_GHOST_OFFSET_BITS - VM_GHOST_PAGES_PER_ENTRY)
+#define         VM_GHOST_REFAULT_BUCKETS (VM_GHOST_INDEX_BITS + 2)
 
 struct  vm_ghost {
 	uint64_t        g_next_index:VM_GHOST_INDEX_BITS,
@@ -51,3 +52,4 @@ extern  vm_ghost_t      vm_phantom_cache_lookup_ghost(vm_page_t, uint32_t);
 extern  void            vm_phantom_cache_update(vm_page_t);
 extern  boolean_t       vm_phantom_cache_check_pressure(void);
 extern  void            vm_phantom_cache_restart_sample(void);
+extern  uint64_t        vm_phantom_cache_refault_distance[VM_GHOST_REFAULT_BUCKETS];
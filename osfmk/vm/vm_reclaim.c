@@ -31,6 +31,7 @@
 #include <kern/task.h>
 #include <kern/zalloc.h>
 #include <kern/misc_protos.h>
+#include <kern/priority_queue.h>
 #include <kern/startup.h>
 #include <kern/sched.h>
 #include <libkern/OSAtomic.h>
@@ -40,6 +41,7 @@
 #include <os/log.h>
 #include <pexpert/pexpert.h>
 #include <vm/vm_map_internal.h>
+#include <vm/vm_pageout.h>
 #include <vm/vm_reclaim_internal.h>
 #include <sys/queue.h>
 #include <os/atomic_private.h>
@@ -47,6 +49,8 @@
 #pragma mark Tunables
 TUNABLE(uint32_t, kReclaimChunkSize, "vm_reclaim_chunk_size", 16);
 static integer_t kReclaimThreadPriority = BASEPRI_VM;
+// Number of threads draining the async reclamation queue
+TUNABLE(uint32_t, kReclaimThreadCount, "vm_reclaim_thread_count", 4);
 // Reclaim down to vm_reclaim_max_threshold / vm_reclaim_trim_divisor when doing a trim reclaim operation
 TUNABLE_DEV_WRITEABLE(uint64_t, vm_reclaim_trim_divisor, "vm_reclaim_trim_divisor", 2);
 TUNABLE_DT_DEV_WRITEABLE(uint64_t, vm_reclaim_max_threshold, "/defaults", "kern.vm_reclaim_max_threshold", "vm_reclaim_max_threshold", 0, TUNABLE_DT_NONE);
@@ -65,7 +69,14 @@ static bool reclaim_copyin_busy(vm_deferred_reclamation_metadata_t metadata, uin
 
 struct vm_deferred_reclamation_metadata_s {
 	TAILQ_ENTRY(vm_deferred_reclamation_metadata_s) vdrm_list; // Global list containing every reclamation buffer
-	TAILQ_ENTRY(vm_deferred_reclamation_metadata_s) vdrm_async_list; // A list containing buffers that are ripe for reclamation
+	/*
+	 * Links buffers that are ripe for reclamation, keyed by their estimated
+	 * reclaimable bytes at the time they were queued.
+	 * The three async fields are protected by the async_reclamation_buffers_lock.
+	 */
+	struct priority_queue_entry_deadline vdrm_async_link;
+	size_t vdrm_async_threshold; // Reclaim down to this many bytes once dequeued
+	bool vdrm_async_queued;
 	decl_lck_mtx_data(, vdrm_lock); /* Held when reclaiming from the buffer */
 	/*
 	 * The task owns this structure but we maintain a backpointer here
@@ -77,7 +88,6 @@ struct vm_deferred_reclamation_metadata_s {
 	user_addr_t vdrm_reclaim_buffer;
 	mach_vm_size_t vdrm_buffer_size;
 	user_addr_t vdrm_reclaim_indices;
-	uint64_t vdrm_reclaimed_at;
 	/*
 	 * These two values represent running sums of bytes placed in the buffer and bytes reclaimed out of the buffer
 	 * cumulatively. Both values are in terms of virtual memory, so they give an upper bound
@@ -88,7 +98,7 @@ struct vm_deferred_reclamation_metadata_s {
 	_Atomic size_t vdrm_num_bytes_put_in_buffer;
 	_Atomic size_t vdrm_num_bytes_reclaimed;
 };
-static void process_async_reclamation_list(void);
+static bool process_async_reclamation_one(void);
 
 extern void *proc_find(int pid);
 extern task_t proc_task(proc_t);
@@ -100,25 +110,28 @@ static os_log_t vm_reclaim_log_handle;
 static size_t kReclaimChunkFailed = UINT64_MAX;
 
 /*
- * We maintain two lists of reclamation buffers.
+ * We maintain two collections of reclamation buffers.
  * The reclamation_buffers list contains every buffer in the system.
- * The async_reclamation_buffers_list contains buffers that are ripe for reclamation.
- * Each list has its own lock.
+ * The async_reclamation_buffers queue contains buffers that are ripe for reclamation,
+ * the one with the most reclaimable bytes first. A pool of kReclaimThreadCount
+ * threads drains it in parallel.
+ * Each collection has its own lock.
  */
 static TAILQ_HEAD(, vm_deferred_reclamation_metadata_s) reclamation_buffers = TAILQ_HEAD_INITIALIZER(reclamation_buffers);
 
-static TAILQ_HEAD(, vm_deferred_reclamation_metadata_s) async_reclamation_buffers = TAILQ_HEAD_INITIALIZER(async_reclamation_buffers);
+static struct priority_queue_deadline_max async_reclamation_buffers = PRIORITY_QUEUE_INITIALIZER;
 /*
  * The reclamation_buffers_lock protects the reclamation_buffers list.
  * It must be held when iterating over the list or manipulating the list.
  * It should be dropped when acting on a specific metadata entry after acquiring the vdrm_lock.
+ * When both are needed, it is taken before the async_reclamation_buffers_lock.
  */
 LCK_MTX_DECLARE(reclamation_buffers_lock, &vm_reclaim_lock_grp);
 LCK_MTX_DECLARE(async_reclamation_buffers_lock, &vm_reclaim_lock_grp);
 static size_t reclamation_buffers_length;
-static uint64_t reclamation_counter; // generation count for global reclaims
+// Buffers taken off the async queue that are still being reclaimed from
+static uint32_t async_reclamation_buffers_busy;
 
-static SECURITY_READ_ONLY_LATE(thread_t) vm_reclaim_thread;
 static void reclaim_thread(void *param __unused, wait_result_t wr __unused);
 
 #pragma mark Implementation
@@ -245,13 +258,12 @@ vm_deferred_reclamation_buffer_uninstall(vm_deferred_reclamation_metadata_t meta
 	lck_mtx_unlock(&reclamation_buffers_lock);
 
 	/*
-	 * Now remove it from the async list (if present)
+	 * Now remove it from the async queue (if present)
 	 */
 	lck_mtx_lock(&async_reclamation_buffers_lock);
-	if (metadata->vdrm_async_list.tqe_next != NULL || metadata->vdrm_async_list.tqe_prev != NULL) {
-		TAILQ_REMOVE(&async_reclamation_buffers, metadata, vdrm_async_list);
-		metadata->vdrm_async_list.tqe_next = NULL;
-		metadata->vdrm_async_list.tqe_prev = NULL;
+	if (metadata->vdrm_async_queued) {
+		priority_queue_remove(&async_reclamation_buffers, &metadata->vdrm_async_link);
+		metadata->vdrm_async_queued = false;
 	}
 	lck_mtx_unlock(&async_reclamation_buffers_lock);
 
@@ -325,7 +337,7 @@ reclaim_kill_with_reason(
 	 * if there's someone blocked on this reclaim they hold a map reference
 	 * and thus need to be woken up so the map can be freed.
 	 */
-	thread_wakeup(&metadata->vdrm_async_list);
+	thread_wakeup(&metadata->vdrm_async_link);
 	lck_mtx_unlock(&metadata->vdrm_lock);
 
 	if (reason == kGUARD_EXC_DEALLOC_GAP) {
@@ -493,11 +505,14 @@ reclaim_chunk(vm_deferred_reclamation_metadata_t metadata)
 	LCK_MTX_ASSERT(&metadata->vdrm_lock, LCK_MTX_ASSERT_OWNED);
 
 	int result = 0;
-	size_t num_reclaimed = 0;
+	size_t num_reclaimed = 0, num_bytes_reclaimed = 0;
 	uint64_t head = 0, tail = 0, busy = 0, num_to_reclaim = 0, new_tail = 0, num_copied = 0, buffer_len = 0;
 	user_addr_t indices;
 	vm_map_t map = metadata->vdrm_map, old_map;
 	mach_vm_reclaim_entry_v1_t reclaim_entries[kReclaimChunkSize];
+	struct mach_vm_range reclaim_ranges[kReclaimChunkSize];
+	uint32_t num_ranges = 0, failed_idx;
+	kern_return_t kr;
 	bool success;
 
 	buffer_len = metadata->vdrm_buffer_size / sizeof(mach_vm_reclaim_entry_v1_t);
@@ -609,28 +624,45 @@ reclaim_chunk(vm_deferred_reclamation_metadata_t metadata)
 		head += num_to_copy;
 	}
 
+	/*
+	 * Remove the whole chunk while taking the map lock once.
+	 * Empty entries are skipped: compact the others so that they line up
+	 * with their ranges.
+	 */
 	for (size_t i = 0; i < num_to_reclaim; i++) {
 		mach_vm_reclaim_entry_v1_t *entry = &reclaim_entries[i];
 		if (entry->address != 0 && entry->size != 0) {
-			kern_return_t kr = vm_map_remove_guard(map,
-			    vm_map_trunc_page(entry->address,
-			    VM_MAP_PAGE_MASK(map)),
-			    vm_map_round_page(entry->address + entry->size,
-			    VM_MAP_PAGE_MASK(map)),
-			    VM_MAP_REMOVE_GAPS_FAIL,
-			    KMEM_GUARD_NONE).kmr_return;
-			if (kr == KERN_INVALID_VALUE) {
-				reclaim_kill_with_reason(metadata, kGUARD_EXC_DEALLOC_GAP, entry->address);
-				goto fail;
-			} else if (kr != KERN_SUCCESS) {
-				os_log_error(vm_reclaim_log_handle,
-				    "vm_reclaim: Unable to deallocate 0x%llx (%u) from 0x%llx. Err: %d\n",
-				    entry->address, entry->size, (uint64_t) map, kr);
-				reclaim_kill_with_reason(metadata, kGUARD_EXC_RECLAIM_DEALLOCATE_FAILURE, kr);
-				goto fail;
-			}
-			num_reclaimed++;
-			os_atomic_add(&metadata->vdrm_num_bytes_reclaimed, entry->size, relaxed);
+			reclaim_entries[num_ranges] = *entry;
+			reclaim_ranges[num_ranges].min_address = vm_map_trunc_page(entry->address,
+			    VM_MAP_PAGE_MASK(map));
+			reclaim_ranges[num_ranges].max_address = vm_map_round_page(entry->address + entry->size,
+			    VM_MAP_PAGE_MASK(map));
+			num_ranges++;
+		}
+	}
+
+	if (num_ranges > 0) {
+		VM_DEBUG_CONSTANT_EVENT(vm_reclaim_chunk, VM_RECLAIM_CHUNK, DBG_FUNC_START,
+		    task_pid(metadata->vdrm_task), num_to_reclaim, num_ranges, 0);
+		kr = vm_map_remove_ranges(map, reclaim_ranges, num_ranges,
+		    VM_MAP_REMOVE_GAPS_FAIL, &failed_idx).kmr_return;
+		for (uint32_t i = 0; i < failed_idx; i++) {
+			num_bytes_reclaimed += reclaim_entries[i].size;
+		}
+		num_reclaimed = failed_idx;
+		os_atomic_add(&metadata->vdrm_num_bytes_reclaimed, num_bytes_reclaimed, relaxed);
+		VM_DEBUG_CONSTANT_EVENT(vm_reclaim_chunk, VM_RECLAIM_CHUNK, DBG_FUNC_END,
+		    num_reclaimed, num_bytes_reclaimed, kr, 0);
+
+		if (kr == KERN_INVALID_VALUE) {
+			reclaim_kill_with_reason(metadata, kGUARD_EXC_DEALLOC_GAP, reclaim_entries[failed_idx].address);
+			goto fail;
+		} else if (kr != KERN_SUCCESS) {
+			os_log_error(vm_reclaim_log_handle,
+			    "vm_reclaim: Unable to deallocate 0x%llx (%u) from 0x%llx. Err: %d\n",
+			    reclaim_entries[failed_idx].address, reclaim_entries[failed_idx].size, (uint64_t) map, kr);
+			reclaim_kill_with_reason(metadata, kGUARD_EXC_RECLAIM_DEALLOCATE_FAILURE, kr);
+			goto fail;
 		}
 	}
 
@@ -789,6 +821,48 @@ vm_deferred_reclamation_buffer_update_reclaimable_bytes_internal(task_t task, si
 	return KERN_SUCCESS;
 }
 
+static size_t
+vmdr_metadata_reclaimable_bytes(vm_deferred_reclamation_metadata_t metadata)
+{
+	size_t put_in_buffer = os_atomic_load(&metadata->vdrm_num_bytes_put_in_buffer, relaxed);
+	size_t reclaimed = os_atomic_load(&metadata->vdrm_num_bytes_reclaimed, relaxed);
+
+	return put_in_buffer > reclaimed ? put_in_buffer - reclaimed : 0;
+}
+
+/*
+ * Queue a buffer for the reclaim threads, or requeue it if it already is,
+ * with its current estimate of reclaimable bytes as the key.
+ * A buffer queued twice is reclaimed once, down to the lower threshold.
+ */
+static void
+vmdr_async_enqueue_locked(vm_deferred_reclamation_metadata_t metadata, size_t threshold)
+{
+	uint64_t bytes = vmdr_metadata_reclaimable_bytes(metadata);
+
+	LCK_MTX_ASSERT(&async_reclamation_buffers_lock, LCK_MTX_ASSERT_OWNED);
+
+	if (metadata->vdrm_async_queued) {
+		uint64_t old_bytes = metadata->vdrm_async_link.deadline;
+
+		metadata->vdrm_async_threshold = MIN(metadata->vdrm_async_threshold, threshold);
+		metadata->vdrm_async_link.deadline = bytes;
+		if (bytes > old_bytes) {
+			priority_queue_entry_increased(&async_reclamation_buffers,
+			    &metadata->vdrm_async_link);
+		} else if (bytes < old_bytes) {
+			priority_queue_entry_decreased(&async_reclamation_buffers,
+			    &metadata->vdrm_async_link);
+		}
+	} else {
+		priority_queue_entry_init(&metadata->vdrm_async_link);
+		metadata->vdrm_async_link.deadline = bytes;
+		metadata->vdrm_async_threshold = threshold;
+		metadata->vdrm_async_queued = true;
+		priority_queue_insert(&async_reclamation_buffers, &metadata->vdrm_async_link);
+	}
+}
+
 static inline size_t
 pick_reclaim_threshold(vm_deferred_reclamation_action_t action)
 {
@@ -805,41 +879,48 @@ pick_reclaim_threshold(vm_deferred_reclamation_action_t action)
 void
 vm_deferred_reclamation_reclaim_memory(vm_deferred_reclamation_action_t action)
 {
+	vm_deferred_reclamation_metadata_t metadata;
+	size_t reclaim_threshold = pick_reclaim_threshold(action);
+	size_t num_queued = 0;
+
 	if (action == RECLAIM_ASYNC) {
 		lck_mtx_lock(&async_reclamation_buffers_lock);
-
-		process_async_reclamation_list();
+		while (process_async_reclamation_one()) {
+		}
 		lck_mtx_unlock(&async_reclamation_buffers_lock);
-	} else {
-		size_t reclaim_threshold = pick_reclaim_threshold(action);
-		lck_mtx_lock(&reclamation_buffers_lock);
-		reclamation_counter++;
-		while (true) {
-			vm_deferred_reclamation_metadata_t metadata = TAILQ_FIRST(&reclamation_buffers);
-			if (metadata == NULL) {
-				break;
-			}
-			lck_mtx_lock(&metadata->vdrm_lock);
-			if (metadata->vdrm_reclaimed_at >= reclamation_counter) {
-				// We've already seen this one. We're done
-				lck_mtx_unlock(&metadata->vdrm_lock);
-				break;
-			}
-			metadata->vdrm_reclaimed_at = reclamation_counter;
-
-			TAILQ_REMOVE(&reclamation_buffers, metadata, vdrm_list);
-			TAILQ_INSERT_TAIL(&reclamation_buffers, metadata, vdrm_list);
-			lck_mtx_unlock(&reclamation_buffers_lock);
+		return;
+	}
 
-			size_t num_reclaimed = reclaim_entries_from_buffer(metadata, reclaim_threshold);
-			if (num_reclaimed != kReclaimChunkFailed) {
-				lck_mtx_unlock(&metadata->vdrm_lock);
-			}
+	/*
+	 * Queue every buffer, the largest first, and have the reclaim threads
+	 * drain them in parallel with us. Then wait for the buffers they took
+	 * to be done.
+	 */
+	VM_DEBUG_CONSTANT_EVENT(vm_reclaim_all, VM_RECLAIM_ALL, DBG_FUNC_START,
+	    action, reclaim_threshold, 0, 0);
+	lck_mtx_lock(&reclamation_buffers_lock);
+	lck_mtx_lock(&async_reclamation_buffers_lock);
+	TAILQ_FOREACH(metadata, &reclamation_buffers, vdrm_list) {
+		vmdr_async_enqueue_locked(metadata, reclaim_threshold);
+		num_queued++;
+	}
+	lck_mtx_unlock(&reclamation_buffers_lock);
 
-			lck_mtx_lock(&reclamation_buffers_lock);
+	thread_wakeup(&async_reclamation_buffers);
+	while (true) {
+		while (process_async_reclamation_one()) {
 		}
-		lck_mtx_unlock(&reclamation_buffers_lock);
+		if (async_reclamation_buffers_busy == 0) {
+			break;
+		}
+		assert_wait(&async_reclamation_buffers_busy, THREAD_UNINT);
+		lck_mtx_unlock(&async_reclamation_buffers_lock);
+		thread_block(THREAD_CONTINUE_NULL);
+		lck_mtx_lock(&async_reclamation_buffers_lock);
 	}
+	lck_mtx_unlock(&async_reclamation_buffers_lock);
+	VM_DEBUG_CONSTANT_EVENT(vm_reclaim_all, VM_RECLAIM_ALL, DBG_FUNC_END,
+	    num_queued, 0, 0, 0);
 }
 
 void
@@ -856,15 +937,11 @@ vm_deferred_reclamation_reclaim_from_task_async(task_t task)
 
 	if (metadata != NULL) {
 		lck_mtx_lock(&async_reclamation_buffers_lock);
-		if (metadata->vdrm_async_list.tqe_next != NULL ||
-		    metadata->vdrm_async_list.tqe_prev != NULL) {
-			// move this buffer to the tail if still on the async list
-			TAILQ_REMOVE(&async_reclamation_buffers, metadata, vdrm_async_list);
-		}
-		TAILQ_INSERT_TAIL(&async_reclamation_buffers, metadata, vdrm_async_list);
+		// NB: The reclaim threads fully reclaim buffers queued this way.
+		vmdr_async_enqueue_locked(metadata, 0);
 		lck_mtx_unlock(&async_reclamation_buffers_lock);
 		queued = true;
-		thread_wakeup(&vm_reclaim_thread);
+		thread_wakeup_one(&async_reclamation_buffers);
 	}
 
 	return queued;
@@ -943,34 +1020,51 @@ reclaim_thread_init(void)
 }
 
 
-static void
-process_async_reclamation_list(void)
+/*
+ * Reclaim from the buffer with the most reclaimable bytes on the async queue.
+ * Called and returns with the async_reclamation_buffers_lock held, but drops
+ * it while reclaiming. Returns false if the queue was empty.
+ */
+static bool
+process_async_reclamation_one(void)
 {
+	vm_deferred_reclamation_metadata_t metadata;
+	size_t threshold, num_reclaimed;
+	uint64_t bytes;
+	int pid;
+
 	LCK_MTX_ASSERT(&async_reclamation_buffers_lock, LCK_MTX_ASSERT_OWNED);
 
-	vm_deferred_reclamation_metadata_t metadata = TAILQ_FIRST(&async_reclamation_buffers);
-	while (metadata != NULL) {
-		TAILQ_REMOVE(&async_reclamation_buffers, metadata, vdrm_async_list);
-		metadata->vdrm_async_list.tqe_next = NULL;
-		metadata->vdrm_async_list.tqe_prev = NULL;
-		lck_mtx_lock(&metadata->vdrm_lock);
-		lck_mtx_unlock(&async_reclamation_buffers_lock);
+	if (priority_queue_empty(&async_reclamation_buffers)) {
+		return false;
+	}
+	metadata = priority_queue_remove_max(&async_reclamation_buffers,
+	    struct vm_deferred_reclamation_metadata_s, vdrm_async_link);
+	metadata->vdrm_async_queued = false;
+	threshold = metadata->vdrm_async_threshold;
+	bytes = metadata->vdrm_async_link.deadline;
+	async_reclamation_buffers_busy++;
+	lck_mtx_lock(&metadata->vdrm_lock);
+	lck_mtx_unlock(&async_reclamation_buffers_lock);
 
-		// NB: Currently the async reclaim thread fully reclaims the buffer.
-		size_t num_reclaimed = reclaim_entries_from_buffer(metadata, 0);
-		if (num_reclaimed == kReclaimChunkFailed) {
-			/* Lock has already been released & task is in the process of getting killed. */
-			goto next;
-		}
+	pid = task_pid(metadata->vdrm_task);
+	VM_DEBUG_CONSTANT_EVENT(vm_reclaim_drain, VM_RECLAIM_DRAIN, DBG_FUNC_START,
+	    pid, bytes, threshold, 0);
+	num_reclaimed = reclaim_entries_from_buffer(metadata, threshold);
+	if (num_reclaimed != kReclaimChunkFailed) {
 		/* Wakeup anyone waiting on this buffer getting processed */
-		thread_wakeup(&metadata->vdrm_async_list);
-		assert(current_thread()->map == kernel_map);
+		thread_wakeup(&metadata->vdrm_async_link);
 		lck_mtx_unlock(&metadata->vdrm_lock);
+	}
+	/* Lock has been released: the buffer may be freed from here on */
+	VM_DEBUG_CONSTANT_EVENT(vm_reclaim_drain, VM_RECLAIM_DRAIN, DBG_FUNC_END,
+	    pid, num_reclaimed, 0, 0);
 
-next:
-		lck_mtx_lock(&async_reclamation_buffers_lock);
-		metadata = TAILQ_FIRST(&async_reclamation_buffers);
+	lck_mtx_lock(&async_reclamation_buffers_lock);
+	if (--async_reclamation_buffers_busy == 0) {
+		thread_wakeup(&async_reclamation_buffers_busy);
 	}
+	return true;
 }
 
 __enum_decl(reclaim_thread_state, uint32_t, {
@@ -983,8 +1077,10 @@ reclaim_thread_continue(void)
 {
 	lck_mtx_lock(&async_reclamation_buffers_lock);
 
-	process_async_reclamation_list();
-	assert_wait(&vm_reclaim_thread, THREAD_UNINT);
+	while (process_async_reclamation_one()) {
+		assert(current_thread()->map == kernel_map);
+	}
+	assert_wait(&async_reclamation_buffers, THREAD_UNINT);
 
 	lck_mtx_unlock(&async_reclamation_buffers_lock);
 }
@@ -1010,9 +1106,16 @@ vm_deferred_reclamation_init(void)
 	// Note: no-op pending rdar://27006343 (Custom kernel log handles)
 	vm_reclaim_log_handle = os_log_create("com.apple.mach.vm", "reclaim");
 
-	(void)kernel_thread_start_priority(reclaim_thread,
-	    (void *)RECLAIM_THREAD_INIT, kReclaimThreadPriority,
-	    &vm_reclaim_thread);
+	for (uint32_t i = 0; i < MAX(kReclaimThreadCount, 1); i++) {
+		thread_t thread;
+
+		if (kernel_thread_start_priority(reclaim_thread,
+		    (void *)RECLAIM_THREAD_INIT, kReclaimThreadPriority,
+		    &thread) != KERN_SUCCESS) {
+			panic("vm_reclaim: failed to start reclaim thread %u", i);
+		}
+		thread_deallocate(thread);
+	}
 }
 
 STARTUP(EARLY_BOOT, STARTUP_RANK_MIDDLE, vm_deferred_reclamation_init);
@@ -1049,15 +1152,15 @@ vm_deferred_reclamation_block_until_pid_has_been_reclaimed(int pid)
 	}
 
 	lck_mtx_lock(&async_reclamation_buffers_lock);
-	while (metadata->vdrm_async_list.tqe_next != NULL || metadata->vdrm_async_list.tqe_prev != NULL) {
-		assert_wait(&metadata->vdrm_async_list, THREAD_UNINT);
+	while (metadata->vdrm_async_queued) {
+		assert_wait(&metadata->vdrm_async_link, THREAD_UNINT);
 		lck_mtx_unlock(&async_reclamation_buffers_lock);
 		thread_block(THREAD_CONTINUE_NULL);
 		lck_mtx_lock(&async_reclamation_buffers_lock);
 	}
 
 	/*
-	 * The async reclaim thread first removes the buffer from the list
+	 * The async reclaim threads first remove the buffer from the queue
 	 * and then reclaims it (while holding its lock).
 	 * So grab the metadata buffer's lock here to ensure the
 	 * reclaim is done.
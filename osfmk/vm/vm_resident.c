@@ -402,6 +402,10 @@ vm_page_queue_head_t    vm_page_queue_secluded VM_PAGE_PACKED_ALIGNED;
 vm_page_queue_head_t    vm_page_queue_anonymous VM_PAGE_PACKED_ALIGNED;  /* inactive memory queue for anonymous pages */
 vm_page_queue_head_t    vm_page_queue_throttled VM_PAGE_PACKED_ALIGNED;
 
+uint32_t        vm_mglru_min_seq = 0;
+uint32_t        vm_mglru_max_seq = VM_MGLRU_MIN_GENS - 1;
+uint32_t        vm_mglru_gen_pages[VM_MGLRU_NGENS];
+
 queue_head_t    vm_objects_wired;
 
 void vm_update_darkwake_mode(boolean_t);
@@ -5276,6 +5280,7 @@ vm_page_reactivate_all_throttled(void)
 			}
 
 			m->vmp_q_state = VM_PAGE_ON_ACTIVE_Q;
+			vm_page_mglru_enter(m, vm_mglru_min_seq);
 			VM_PAGE_CHECK(m);
 			vm_page_add_to_specialq(m, FALSE);
 		}
@@ -5367,6 +5372,7 @@ vm_page_reactivate_local(uint32_t lid, boolean_t force, boolean_t nolocks)
 
 			m->vmp_local_id = 0;
 			m->vmp_q_state = VM_PAGE_ON_ACTIVE_Q;
+			vm_page_mglru_enter(m, vm_mglru_min_seq);
 			VM_PAGE_CHECK(m);
 			vm_page_add_to_specialq(m, FALSE);
 			count++;
@@ -8789,6 +8795,7 @@ vm_page_queues_remove(vm_page_t mem, boolean_t remove_from_specialq)
 	{
 		vm_page_queue_remove(&vm_page_queue_active, mem, vmp_pageq);
 		vm_page_active_count--;
+		vm_page_mglru_leave(mem);
 		break;
 	}
 
@@ -8979,8 +8986,10 @@ vm_page_enqueue_active(vm_page_t mem, boolean_t first)
 	mem->vmp_q_state = VM_PAGE_ON_ACTIVE_Q;
 	if (first == TRUE) {
 		vm_page_queue_enter_first(&vm_page_queue_active, mem, vmp_pageq);
+		vm_page_mglru_enter(mem, vm_mglru_min_seq);
 	} else {
 		vm_page_queue_enter(&vm_page_queue_active, mem, vmp_pageq);
+		vm_page_mglru_enter(mem, vm_mglru_max_seq);
 	}
 	vm_page_active_count++;
 
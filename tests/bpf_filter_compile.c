@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Differential test of the compiled BPF filters against the interpreter:
+ * both are built from bsd/net/bpf_filter.c in user space and run on
+ * random (but valid, in the bpf_validate() sense) programs and packets.
+ * The mbuf chain paths only exist in the kernel, they are exercised
+ * through the debug.bpf_filter_probe sysctl.
+ */
+#include <darwintest.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/sysctl.h>
+#include <mach/mach_time.h>
+
+#include "test_rand.h"
+#include "../bsd/net/bpf_filter.c"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_RUN_CONCURRENTLY(true),
+	T_META_CHECK_LEAKS(false));
+
+#define TEST_PROGRAMS           20000
+#define TEST_PACKETS            32
+#define TEST_MAX_INSNS          48
+#define TEST_MAX_PKTLEN         96
+
+static uint32_t
+rand_below(uint32_t n)
+{
+	return test_rand32() % n;
+}
+
+/* mostly small offsets and constants, so that loads and tests hit */
+static uint32_t
+rand_k(void)
+{
+	switch (rand_below(8)) {
+	case 0:
+		return test_rand32();
+	case 1:
+		return UINT32_MAX - rand_below(8);
+	default:
+		return rand_below(TEST_MAX_PKTLEN + 8);
+	}
+}
+
+static const u_short test_codes[] = {
+	BPF_RET | BPF_K, BPF_RET | BPF_A,
+	BPF_LD | BPF_W | BPF_ABS, BPF_LD | BPF_H | BPF_ABS, BPF_LD | BPF_B | BPF_ABS,
+	BPF_LD | BPF_W | BPF_IND, BPF_LD | BPF_H | BPF_IND, BPF_LD | BPF_B | BPF_IND,
+	BPF_LDX | BPF_MSH | BPF_B,
+	BPF_LD | BPF_W | BPF_LEN, BPF_LDX | BPF_W | BPF_LEN,
+	BPF_LD | BPF_IMM, BPF_LDX | BPF_IMM,
+	BPF_LD | BPF_MEM, BPF_LDX | BPF_MEM, BPF_ST, BPF_STX,
+	BPF_JMP | BPF_JA,
+	BPF_JMP | BPF_JGT | BPF_K, BPF_JMP | BPF_JGE | BPF_K,
+	BPF_JMP | BPF_JEQ | BPF_K, BPF_JMP | BPF_JSET | BPF_K,
+	BPF_JMP | BPF_JGT | BPF_X, BPF_JMP | BPF_JGE | BPF_X,
+	BPF_JMP | BPF_JEQ | BPF_X, BPF_JMP | BPF_JSET | BPF_X,
+	BPF_ALU | BPF_ADD | BPF_K, BPF_ALU | BPF_SUB | BPF_K,
+	BPF_ALU | BPF_MUL | BPF_K, BPF_ALU | BPF_DIV | BPF_K,
+	BPF_ALU | BPF_AND | BPF_K, BPF_ALU | BPF_OR | BPF_K,
+	BPF_ALU | BPF_LSH | BPF_K, BPF_ALU | BPF_RSH | BPF_K,
+	BPF_ALU | BPF_ADD | BPF_X, BPF_ALU | BPF_SUB | BPF_X,
+	BPF_ALU | BPF_MUL | BPF_X, BPF_ALU | BPF_DIV | BPF_X,
+	BPF_ALU | BPF_AND | BPF_X, BPF_ALU | BPF_OR | BPF_X,
+	BPF_ALU | BPF_LSH | BPF_X, BPF_ALU | BPF_RSH | BPF_X,
+	BPF_ALU | BPF_NEG, BPF_MISC | BPF_TAX, BPF_MISC | BPF_TXA,
+};
+
+/*
+ * Loads followed by equality tests are over-represented, since that is
+ * what real filters look like and what gets fused by the compiler.
+ */
+static void
+random_program(struct bpf_insn *f, u_int len)
+{
+	for (u_int i = 0; i < len - 1; i++) {
+		struct bpf_insn *p = &f[i];
+		u_int left = len - i - 1;
+
+		if (i > 0 && BPF_CLASS(f[i - 1].code) == BPF_LD &&
+		    BPF_MODE(f[i - 1].code) == BPF_ABS && rand_below(2)) {
+			p->code = BPF_JMP | BPF_JEQ | BPF_K;
+		} else {
+			p->code = test_codes[rand_below(sizeof(test_codes) / sizeof(test_codes[0]))];
+		}
+		p->jt = p->jf = 0;
+		p->k = rand_k();
+
+		switch (BPF_CLASS(p->code)) {
+		case BPF_LD:
+		case BPF_LDX:
+		case BPF_ST:
+		case BPF_STX:
+			if (BPF_MODE(p->code) == BPF_MEM || p->code == BPF_ST ||
+			    p->code == BPF_STX) {
+				p->k = rand_below(BPF_MEMWORDS);
+			}
+			break;
+		case BPF_ALU:
+			if (p->code == (BPF_ALU | BPF_DIV | BPF_K) && p->k == 0) {
+				p->k = 1;
+			}
+			break;
+		case BPF_JMP:
+			if (p->code == (BPF_JMP | BPF_JA)) {
+				p->k = rand_below(left);
+			} else {
+				p->jt = (u_char)rand_below(MIN(left, 256));
+				p->jf = (u_char)rand_below(MIN(left, 256));
+			}
+			break;
+		}
+	}
+	f[len - 1].code = rand_below(2) ? (BPF_RET | BPF_K) : (BPF_RET | BPF_A);
+	f[len - 1].jt = f[len - 1].jf = 0;
+	f[len - 1].k = rand_below(2) ? 0 : rand_k();
+}
+
+T_DECL(bpf_filter_compile_differential,
+    "compiled BPF filters return the same verdicts as bpf_filter()")
+{
+	struct bpf_insn f[TEST_MAX_INSNS];
+	struct bpf_cinsn cf[TEST_MAX_INSNS];
+	u_char pkt[TEST_MAX_PKTLEN];
+	u_int mismatches = 0;
+
+	T_LOG("seed %llu", test_rand_seed());
+
+	for (u_int n = 0; n < TEST_PROGRAMS && mismatches < 10; n++) {
+		u_int len = 1 + rand_below(TEST_MAX_INSNS);
+
+		random_program(f, len);
+		T_QUIET; T_ASSERT_TRUE(bpf_compile_insns(f, len, cf), "bpf_compile_insns");
+
+		for (u_int i = 0; i < TEST_PACKETS; i++) {
+			u_int buflen = rand_below(TEST_MAX_PKTLEN + 1);
+			u_int wirelen = buflen + rand_below(64);
+			u_int r1, r2;
+
+			for (u_int j = 0; j < buflen; j++) {
+				pkt[j] = (u_char)test_rand32();
+			}
+
+			r1 = bpf_filter(f, pkt, wirelen, buflen);
+			r2 = bpf_filter_cinsns(cf, pkt, wirelen, buflen);
+			if (r1 != r2) {
+				T_LOG("program %u (%u insns), packet %u (%u bytes): "
+				    "interpreter %u, compiled %u", n, len, i, buflen, r1, r2);
+				for (u_int j = 0; j < len; j++) {
+					T_LOG("  %3u: code 0x%04x jt %3u jf %3u k 0x%08x", j,
+					    f[j].code, f[j].jt, f[j].jf, f[j].k);
+				}
+				mismatches++;
+				break;
+			}
+		}
+	}
+	T_ASSERT_EQ(mismatches, 0, "no verdict mismatch over %u programs", TEST_PROGRAMS);
+}
+
+/* Must match bsd/net/bpf.c */
+#define BPF_FILTER_PROBE_MAX_INSNS      64
+#define BPF_FILTER_PROBE_MAX_SEGS       16
+#define BPF_FILTER_PROBE_MAX_DATA       256
+
+struct bpf_filter_probe {
+	uint32_t        bfp_ninsns;
+	uint32_t        bfp_wirelen;
+	uint16_t        bfp_hdrlen;
+	uint16_t        bfp_nsegs;
+	uint16_t        bfp_seglen[BPF_FILTER_PROBE_MAX_SEGS];
+	struct bpf_insn bfp_insns[BPF_FILTER_PROBE_MAX_INSNS];
+	u_char          bfp_data[BPF_FILTER_PROBE_MAX_DATA];
+};
+
+struct bpf_filter_probe_result {
+	uint32_t        bfpr_interpreted;
+	uint32_t        bfpr_compiled;
+};
+
+#define TEST_CHAIN_PROGRAMS     2000
+#define TEST_CHAIN_PACKETS      16
+
+_Static_assert(TEST_MAX_INSNS <= BPF_FILTER_PROBE_MAX_INSNS, "probe insns");
+_Static_assert(TEST_MAX_PKTLEN <= BPF_FILTER_PROBE_MAX_DATA, "probe data");
+
+/*
+ * Splits the packet into an optional header and mbufs of mostly a few
+ * bytes, so that halves and words often straddle two of them (or three,
+ * which m_xword() refuses).  Headers end inside the link and IP headers
+ * the way a pktap or ethernet header prepended to the chain would.
+ */
+static void
+random_chain(struct bpf_filter_probe *p, u_int pktlen)
+{
+	u_int left;
+
+	p->bfp_hdrlen = (uint16_t)(rand_below(3) ? 0 : rand_below(MIN(pktlen, 40) + 1));
+	left = pktlen - p->bfp_hdrlen;
+	p->bfp_nsegs = 0;
+	while (p->bfp_nsegs < BPF_FILTER_PROBE_MAX_SEGS - 1 && left > 0) {
+		u_int len = rand_below(4) ? 1 + rand_below(5) : 1 + rand_below(left);
+
+		len = MIN(len, left);
+		p->bfp_seglen[p->bfp_nsegs++] = (uint16_t)len;
+		left -= len;
+	}
+	/* the last mbuf takes what is left, sometimes an empty one trails */
+	if (left > 0 || p->bfp_nsegs == 0 || rand_below(4) == 0) {
+		p->bfp_seglen[p->bfp_nsegs++] = (uint16_t)left;
+	}
+}
+
+static bool
+probe(struct bpf_filter_probe *p, struct bpf_filter_probe_result *res)
+{
+	size_t len = sizeof(*res);
+
+	if (sysctlbyname("debug.bpf_filter_probe", res, &len, p, sizeof(*p)) != 0) {
+		T_QUIET; T_ASSERT_EQ(errno, ENOENT, "debug.bpf_filter_probe");
+		return false;
+	}
+	T_QUIET; T_ASSERT_EQ(len, sizeof(*res), "result size");
+	return true;
+}
+
+T_DECL(bpf_filter_compile_mbuf_chain,
+    "compiled BPF filters agree with bpf_filter() on mbuf chains",
+    T_META_ASROOT(true))
+{
+	struct bpf_filter_probe *p;
+	struct bpf_filter_probe_result res;
+	u_int mismatches = 0;
+
+	T_LOG("seed %llu", test_rand_seed());
+
+	p = calloc(1, sizeof(*p));
+	T_QUIET; T_ASSERT_NOTNULL(p, "calloc");
+
+	for (u_int n = 0; n < TEST_CHAIN_PROGRAMS && mismatches < 10; n++) {
+		u_int len = 1 + rand_below(TEST_MAX_INSNS);
+
+		random_program(p->bfp_insns, len);
+		/* bpf_validate() refuses offsets past bpf_maxbufsize */
+		for (u_int i = 0; i < len; i++) {
+			struct bpf_insn *f = &p->bfp_insns[i];
+
+			if ((BPF_CLASS(f->code) == BPF_LD || BPF_CLASS(f->code) == BPF_LDX) &&
+			    (BPF_MODE(f->code) == BPF_ABS || BPF_MODE(f->code) == BPF_IND ||
+			    BPF_MODE(f->code) == BPF_MSH)) {
+				f->k %= TEST_MAX_PKTLEN + 8;
+			}
+		}
+		p->bfp_ninsns = len;
+
+		for (u_int i = 0; i < TEST_CHAIN_PACKETS; i++) {
+			u_int pktlen = 1 + rand_below(TEST_MAX_PKTLEN);
+
+			for (u_int j = 0; j < pktlen; j++) {
+				p->bfp_data[j] = (u_char)test_rand32();
+			}
+			p->bfp_wirelen = pktlen + rand_below(64);
+			random_chain(p, pktlen);
+
+			if (!probe(p, &res)) {
+				free(p);
+				T_SKIP("debug.bpf_filter_probe not supported (release kernel?)");
+			}
+			if (res.bfpr_interpreted != res.bfpr_compiled) {
+				T_LOG("program %u (%u insns), packet %u (%u bytes, header %u, "
+				    "%u mbufs): interpreter %u, compiled %u", n, len, i, pktlen,
+				    p->bfp_hdrlen, p->bfp_nsegs, res.bfpr_interpreted,
+				    res.bfpr_compiled);
+				for (u_int j = 0; j < p->bfp_nsegs; j++) {
+					T_LOG("  mbuf %2u: %u bytes", j, p->bfp_seglen[j]);
+				}
+				for (u_int j = 0; j < len; j++) {
+					T_LOG("  %3u: code 0x%04x jt %3u jf %3u k 0x%08x", j,
+					    p->bfp_insns[j].code, p->bfp_insns[j].jt,
+					    p->bfp_insns[j].jf, p->bfp_insns[j].k);
+				}
+				mismatches++;
+				break;
+			}
+		}
+	}
+	free(p);
+	T_ASSERT_EQ(mismatches, 0, "no verdict mismatch over %u programs on mbuf chains",
+	    TEST_CHAIN_PROGRAMS);
+}
+
+/*
+ * The word at offset 12 straddles the header and the first mbuf, the
+ * half at 22 the first and second mbuf and the word at 26 three mbufs.
+ */
+T_DECL(bpf_filter_compile_mbuf_straddle,
+    "loads across the header and mbuf boundaries",
+    T_META_ASROOT(true))
+{
+	static const struct bpf_insn f[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, 12 },
+		{ BPF_JMP | BPF_JEQ | BPF_K, 0, 5, 0x0c0d0e0f },
+		{ BPF_LD | BPF_H | BPF_ABS, 0, 0, 22 },
+		{ BPF_JMP | BPF_JEQ | BPF_K, 0, 3, 0x1617 },
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, 26 },
+		{ BPF_RET | BPF_K, 0, 0, 1 },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+		{ BPF_RET | BPF_K, 0, 0, 2 },
+	};
+	static const uint16_t segs[] = { 9, 2, 2, 1, 20 };
+	struct bpf_filter_probe *p;
+	struct bpf_filter_probe_result res;
+
+	p = calloc(1, sizeof(*p));
+	T_QUIET; T_ASSERT_NOTNULL(p, "calloc");
+
+	memcpy(p->bfp_insns, f, sizeof(f));
+	p->bfp_ninsns = sizeof(f) / sizeof(f[0]);
+	for (u_int i = 0; i < 48; i++) {
+		p->bfp_data[i] = (u_char)i;
+	}
+	p->bfp_wirelen = 48;
+	p->bfp_hdrlen = 14;
+	p->bfp_nsegs = sizeof(segs) / sizeof(segs[0]);
+	memcpy(p->bfp_seglen, segs, sizeof(segs));
+
+	if (!probe(p, &res)) {
+		free(p);
+		T_SKIP("debug.bpf_filter_probe not supported (release kernel?)");
+	}
+	T_EXPECT_EQ(res.bfpr_interpreted, 0u,
+	    "bpf_filter() refuses a word over three mbufs");
+	T_EXPECT_EQ(res.bfpr_compiled, res.bfpr_interpreted, "same verdict");
+
+	/* one mbuf for the rest: all three loads succeed */
+	p->bfp_nsegs = 2;
+	p->bfp_seglen[0] = 9;
+	p->bfp_seglen[1] = 25;
+	T_ASSERT_TRUE(probe(p, &res), "probe");
+	T_EXPECT_EQ(res.bfpr_interpreted, 1u, "bpf_filter() accepts");
+	T_EXPECT_EQ(res.bfpr_compiled, res.bfpr_interpreted, "same verdict");
+	free(p);
+}
+
+T_DECL(bpf_filter_compile_invalid,
+    "unknown opcodes and out of range jumps are handled like bpf_filter()")
+{
+	struct bpf_insn f[] = {
+		{ BPF_LD | BPF_H | BPF_MEM, 0, 0, 0 },
+		{ BPF_RET | BPF_K, 0, 0, 0xffff },
+	};
+	struct bpf_insn bad_jump[] = {
+		{ BPF_JMP | BPF_JEQ | BPF_K, 1, 0, 0 },
+		{ BPF_RET | BPF_K, 0, 0, 0xffff },
+	};
+	struct bpf_cinsn cf[2];
+	u_char pkt[16] = { 0 };
+
+	T_ASSERT_TRUE(bpf_compile_insns(f, 2, cf), "compile unknown opcode");
+	T_ASSERT_EQ(bpf_filter_cinsns(cf, pkt, sizeof(pkt), sizeof(pkt)), 0u,
+	    "unknown opcode rejects the packet");
+	T_ASSERT_FALSE(bpf_compile_insns(bad_jump, 2, cf),
+	    "jump past the end of the program is refused");
+}
+
+/*
+ * "ip and tcp dst port 80" as compiled by tcpdump for DLT_EN10MB.
+ */
+static const struct bpf_insn tcp_port_80[] = {
+	{ BPF_LD | BPF_H | BPF_ABS, 0, 0, 12 },
+	{ BPF_JMP | BPF_JEQ | BPF_K, 0, 8, 0x0800 },
+	{ BPF_LD | BPF_B | BPF_ABS, 0, 0, 23 },
+	{ BPF_JMP | BPF_JEQ | BPF_K, 0, 6, 6 },
+	{ BPF_LD | BPF_H | BPF_ABS, 0, 0, 20 },
+	{ BPF_JMP | BPF_JSET | BPF_K, 4, 0, 0x1fff },
+	{ BPF_LDX | BPF_MSH | BPF_B, 0, 0, 14 },
+	{ BPF_LD | BPF_H | BPF_IND, 0, 0, 16 },
+	{ BPF_JMP | BPF_JEQ | BPF_K, 0, 1, 80 },
+	{ BPF_RET | BPF_K, 0, 0, 262144 },
+	{ BPF_RET | BPF_K, 0, 0, 0 },
+};
+
+#define BENCH_ITERATIONS        (4u << 20)
+
+T_DECL(bpf_filter_compile_perf,
+    "per packet cost of bpf_filter() and of the compiled filter",
+    T_META_TAG_PERF)
+{
+	u_int len = sizeof(tcp_port_80) / sizeof(tcp_port_80[0]);
+	struct bpf_cinsn cf[sizeof(tcp_port_80) / sizeof(tcp_port_80[0])];
+	mach_timebase_info_data_t tb;
+	u_char pkt[64] = { 0 };
+	uint64_t start, interp_ns, compiled_ns;
+	volatile u_int sink = 0;
+
+	/* ethernet + IPv4 + TCP to port 80 */
+	pkt[12] = 0x08;
+	pkt[14] = 0x45;
+	pkt[23] = 6;
+	pkt[36] = 0;
+	pkt[37] = 80;
+
+	T_QUIET; T_ASSERT_TRUE(bpf_compile_insns(tcp_port_80, len, cf), "compile");
+	T_ASSERT_EQ(bpf_filter(tcp_port_80, pkt, sizeof(pkt), sizeof(pkt)),
+	    bpf_filter_cinsns(cf, pkt, sizeof(pkt), sizeof(pkt)), "same verdict");
+	T_QUIET; T_ASSERT_NE(bpf_filter_cinsns(cf, pkt, sizeof(pkt), sizeof(pkt)), 0u,
+	    "packet matches");
+
+	mach_timebase_info(&tb);
+
+	start = mach_absolute_time();
+	for (u_int i = 0; i < BENCH_ITERATIONS; i++) {
+		sink += bpf_filter(tcp_port_80, pkt, sizeof(pkt), sizeof(pkt));
+	}
+	interp_ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	start = mach_absolute_time();
+	for (u_int i = 0; i < BENCH_ITERATIONS; i++) {
+		sink += bpf_filter_cinsns(cf, pkt, sizeof(pkt), sizeof(pkt));
+	}
+	compiled_ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	T_PERF("bpf_filter_interpreted", (double)interp_ns / BENCH_ITERATIONS,
+	    "ns", "bpf_filter() per packet");
+	T_PERF("bpf_filter_compiled", (double)compiled_ns / BENCH_ITERATIONS,
+	    "ns", "compiled filter per packet");
+	(void)sink;
+}
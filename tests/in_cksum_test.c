@@ -2,13 +2,16 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
+#include <mach/mach_time.h>
 
 #include <darwintest.h>
 
 T_GLOBAL_META(T_META_RUN_CONCURRENTLY(true));
 
 extern uint32_t os_cpu_in_cksum(const void *, uint32_t, uint32_t);
+extern uint32_t os_cpu_copy_in_cksum(const void *, void *, uint32_t, uint32_t);
 
 /****************************************************************/
 static void
@@ -233,3 +236,109 @@ T_DECL(in_cksum_49479689b, "tests os_cpu_in_cksum with many random packets in va
 		test_one_random_packet(4096);
 	}
 }
+
+/* fold a partial sum, treating 0 and -0 alike */
+static uint16_t
+fold_sum(uint32_t sum)
+{
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum = (sum >> 16) + (sum & 0xffff);
+	return sum == 0xffff ? 0 : (uint16_t)sum;
+}
+
+T_DECL(in_cksum_copy, "tests os_cpu_copy_in_cksum with random packets, alignments and initial sums")
+{
+	const uint32_t maxlen = 9000;
+	uint8_t *src = malloc(maxlen + 8);
+	uint8_t *dst = malloc(maxlen + 8);
+
+	T_QUIET; T_ASSERT_NOTNULL(src, "malloc");
+	T_QUIET; T_ASSERT_NOTNULL(dst, "malloc");
+
+	for (int i = 0; i < 1000; i++) {
+		uint32_t len = arc4random_uniform(maxlen);
+		uint32_t soff = arc4random_uniform(8), doff = arc4random_uniform(8);
+		uint32_t sum0 = arc4random_uniform(0x10000);
+		uint16_t dsum, osum;
+
+		arc4random_buf(src + soff, len);
+		memset(dst, 0, maxlen + 8);
+
+		dsum = ~dumb_in_cksum(src + soff, len) & 0xffff;
+		dsum = fold_sum(dsum + sum0);
+		osum = fold_sum(os_cpu_copy_in_cksum(src + soff, dst + doff, len, sum0));
+
+		T_QUIET; T_ASSERT_EQ(memcmp(src + soff, dst + doff, len), 0,
+		    "len %u src align %u dst align %u: data copied", len, soff, doff);
+		T_QUIET; T_ASSERT_EQ(osum, dsum,
+		    "len %u src align %u dst align %u: checksum", len, soff, doff);
+	}
+	free(src);
+	free(dst);
+	T_PASS("os_cpu_copy_in_cksum OK");
+}
+
+/*
+ * Throughput of the checksum and of the fused copy and checksum, across
+ * the sizes that matter for networking (headers, MTU sized packets, TSO
+ * and LRO sized aggregates) and source alignments.
+ */
+#define CKSUM_BENCH_BYTES       (256u << 20)
+
+static double
+cksum_bench_mbps(const uint8_t *src, uint8_t *dst, uint32_t len)
+{
+	static mach_timebase_info_data_t tb;
+	uint32_t iterations = CKSUM_BENCH_BYTES / len;
+	volatile uint32_t sink = 0;
+	uint64_t start, ns;
+
+	if (tb.denom == 0) {
+		mach_timebase_info(&tb);
+	}
+
+	start = mach_absolute_time();
+	for (uint32_t i = 0; i < iterations; i++) {
+		if (dst != NULL) {
+			sink += os_cpu_copy_in_cksum(src, dst, len, 0);
+		} else {
+			sink += os_cpu_in_cksum(src, len, 0);
+		}
+	}
+	ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+	(void)sink;
+
+	return ((double)iterations * len / (1024 * 1024)) / ((double)ns / 1e9);
+}
+
+T_DECL(in_cksum_perf, "measures os_cpu_in_cksum and os_cpu_copy_in_cksum throughput",
+    T_META_TAG_PERF, T_META_RUN_CONCURRENTLY(false))
+{
+	static const uint32_t sizes[] = { 20, 64, 256, 1500, 4096, 9000, 16384, 65536 };
+	static const uint32_t aligns[] = { 0, 1, 2, 4 };
+	uint32_t maxlen = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	uint8_t *src = malloc(maxlen + 8);
+	uint8_t *dst = malloc(maxlen + 8);
+	char metric[64];
+
+	T_QUIET; T_ASSERT_NOTNULL(src, "malloc");
+	T_QUIET; T_ASSERT_NOTNULL(dst, "malloc");
+	arc4random_buf(src, maxlen + 8);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (size_t j = 0; j < sizeof(aligns) / sizeof(aligns[0]); j++) {
+			uint32_t len = sizes[i], off = aligns[j];
+			double mbps;
+
+			mbps = cksum_bench_mbps(src + off, NULL, len);
+			snprintf(metric, sizeof(metric), "in_cksum_%u_align_%u", len, off);
+			T_PERF(metric, mbps, "MB/s", "os_cpu_in_cksum throughput");
+
+			mbps = cksum_bench_mbps(src + off, dst, len);
+			snprintf(metric, sizeof(metric), "copy_in_cksum_%u_align_%u", len, off);
+			T_PERF(metric, mbps, "MB/s", "os_cpu_copy_in_cksum throughput");
+		}
+	}
+	free(src);
+	free(dst);
+}
@@ -0,0 +1,36 @@
+#include <sys/sysctl.h>
+
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.iokit"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IOKit"),
+	T_META_CHECK_LEAKS(false));
+
+static int64_t
+run_sysctl_test(const char *t, int64_t value)
+{
+	char name[1024];
+	int64_t result = 0;
+	size_t s = sizeof(value);
+	int rc;
+
+	snprintf(name, sizeof(name), "debug.test.%s", t);
+	rc = sysctlbyname(name, &result, &s, &value, s);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "sysctlbyname(%s)", t);
+	return result;
+}
+
+T_DECL(dictionary_hash,
+    "OSDictionary lookups, and sorted iteration, below and past the hash threshold")
+{
+	/* dictionaries get a hash index at a capacity of 32 */
+	static const int64_t sizes[] = { 4, 31, 32, 33, 100, 1000 };
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		T_EXPECT_EQ(1ll, run_sysctl_test("iokit_dictionary_hash", sizes[i]),
+		    "%lld keys", sizes[i]);
+	}
+}
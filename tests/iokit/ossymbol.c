@@ -1,4 +1,8 @@
 #include <sys/sysctl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <time.h>
 
 #include <darwintest.h>
@@ -32,3 +36,81 @@ T_DECL(symbol_basic, "Basic tests around OSSymbols")
 		    "test succeeded");
 	}
 }
+
+#define SYMBOL_BENCH_ITERATIONS 1000000
+
+static _Atomic uint32_t symbol_bench_ready;
+static _Atomic bool symbol_bench_go;
+
+static void *
+symbol_bench_thread(void *arg __unused)
+{
+	atomic_fetch_add(&symbol_bench_ready, 1);
+	while (!atomic_load(&symbol_bench_go)) {
+		/* spin so that all threads start at the same time */
+	}
+	/* returns how long the lookups took, in ns */
+	T_QUIET; T_ASSERT_GT(run_sysctl_test("iokit_symbol_lookup_bench",
+	    SYMBOL_BENCH_ITERATIONS), 0ll, "iokit_symbol_lookup_bench");
+	return NULL;
+}
+
+static void
+symbol_bench_run(uint32_t n)
+{
+	pthread_t *threads;
+	uint64_t start, elapsed;
+	char metric[64];
+	double rate;
+
+	threads = calloc(n, sizeof(*threads));
+	T_QUIET; T_ASSERT_NOTNULL(threads, "calloc");
+
+	atomic_store(&symbol_bench_ready, 0);
+	atomic_store(&symbol_bench_go, false);
+
+	for (uint32_t i = 0; i < n; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i], NULL,
+		    symbol_bench_thread, NULL), "pthread_create");
+	}
+	while (atomic_load(&symbol_bench_ready) < n) {
+		/* wait for all threads to be ready */
+	}
+
+	start = clock_gettime_nsec_np(CLOCK_MONOTONIC);
+	atomic_store(&symbol_bench_go, true);
+	for (uint32_t i = 0; i < n; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL),
+		    "pthread_join");
+	}
+	elapsed = clock_gettime_nsec_np(CLOCK_MONOTONIC) - start;
+	free(threads);
+
+	rate = (double)n * SYMBOL_BENCH_ITERATIONS * 1e9 / (double)elapsed;
+	snprintf(metric, sizeof(metric), "symbol_lookups_%u_threads", n);
+	T_LOG("%2u threads: %.0f lookups/s (%.0f lookups/s/thread)",
+	    n, rate, rate / n);
+	T_PERF(metric, rate, "lookups/s", "OSSymbol::withCString() throughput");
+}
+
+T_DECL(symbol_lookup_scalability,
+    "Measure OSSymbol lookups per second vs. the number of cores",
+    T_META_TAG_PERF)
+{
+	uint32_t ncpu = 0;
+	size_t len = sizeof(ncpu);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.activecpu",
+	    &ncpu, &len, NULL, 0), "hw.activecpu");
+
+	/* warm up the symbol pool */
+	T_ASSERT_GT(run_sysctl_test("iokit_symbol_lookup_bench", 1024), 0ll,
+	    "iokit_symbol_lookup_bench");
+
+	for (uint32_t n = 1; n < ncpu; n *= 2) {
+		symbol_bench_run(n);
+	}
+	symbol_bench_run(ncpu);
+
+	T_PASS("symbol_lookup_scalability");
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * With net.link.generic.system.input_threads_per_if set, a feth attached
+ * with the legacy input model gets several DLIL input threads.  Frames
+ * of many UDP flows written to its peer with BPF must be spread across
+ * them, all the frames of one flow must land on the same thread, and
+ * net.link.generic.system.input_queue_stats.<ifindex> must account for
+ * every frame.  Destroying the interface then tears the threads down.
+ */
+#include <darwintest.h>
+
+#include <sys/ioctl.h>
+#include <sys/sysctl.h>
+
+#include <net/if.h>
+#include <net/if_var.h>
+#include <net/ethernet.h>
+
+#include <netinet/ip.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "net_test_lib.h"
+#include "bpflib.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_ASROOT(true),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_RUN_CONCURRENTLY(false),
+	T_META_CHECK_LEAKS(false));
+
+#define RSS_THREADS             4
+#define RSS_FLOWS               64
+#define RSS_FLOW_FRAMES         16
+#define RSS_WAIT_SECONDS        10
+
+static int udp_fd = -1;
+static int bpf_fd = -1;
+static char ifname1[IF_NAMESIZE];
+static char ifname2[IF_NAMESIZE];
+static int saved_threads = -1;
+
+static void
+cleanup(void)
+{
+	if (bpf_fd != -1) {
+		(void) close(bpf_fd);
+	}
+	if (udp_fd != -1) {
+		if (ifname1[0] != '\0') {
+			(void) ifnet_destroy(udp_fd, ifname1, false);
+		}
+		if (ifname2[0] != '\0') {
+			(void) ifnet_destroy(udp_fd, ifname2, false);
+		}
+		(void) close(udp_fd);
+	}
+	if (saved_threads != -1) {
+		(void) sysctlbyname("net.link.generic.system.input_threads_per_if",
+		    NULL, NULL, &saved_threads, sizeof(saved_threads));
+	}
+}
+
+static uint32_t
+get_queue_stats(const char *ifname, struct if_inputq_stats *stats, uint32_t max)
+{
+	int mib[CTL_MAXNAME];
+	size_t miblen = CTL_MAXNAME - 1;
+	size_t len = max * sizeof(*stats);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlnametomib(
+		    "net.link.generic.system.input_queue_stats", mib, &miblen),
+	    "input_queue_stats");
+	mib[miblen] = (int)if_nametoindex(ifname);
+	T_QUIET; T_ASSERT_NE(mib[miblen], 0, "if_nametoindex(%s)", ifname);
+
+	memset(stats, 0, len);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctl(mib, (u_int)miblen + 1, stats,
+	    &len, NULL, 0), "input_queue_stats.%s", ifname);
+	T_QUIET; T_ASSERT_EQ(len % sizeof(*stats), 0ul, "whole entries");
+	return (uint32_t)(len / sizeof(*stats));
+}
+
+static uint64_t
+total_packets(struct if_inputq_stats *stats, uint32_t n)
+{
+	uint64_t total = 0;
+
+	for (uint32_t i = 0; i < n; i++) {
+		total += stats[i].ifiq_packets;
+	}
+	return total;
+}
+
+/* the most packets any one thread got between two snapshots */
+static uint64_t
+max_packets(struct if_inputq_stats *before, struct if_inputq_stats *after,
+    uint32_t n)
+{
+	uint64_t max = 0;
+
+	for (uint32_t i = 0; i < n; i++) {
+		max = MAX(max, after[i].ifiq_packets - before[i].ifiq_packets);
+	}
+	return max;
+}
+
+/*
+ * Write frames of a UDP flow, told apart by its source port, and wait
+ * until one of the peer's input threads has them all; other traffic
+ * of the interface may show up on any thread meanwhile.
+ */
+static void
+send_flow(uint16_t port, int frames, struct if_inputq_stats *before,
+    struct if_inputq_stats *after, uint32_t n)
+{
+	static unsigned char frame[ETHER_HDR_LEN + 256];
+	ether_addr_t src = {}, dst = {};
+	struct in_addr src_ip = { .s_addr = htonl(0x0a000001) };
+	struct in_addr dst_ip = { .s_addr = htonl(0x0a000002) };
+	char payload[64] = "input steering";
+	mach_timebase_info_data_t tb;
+	uint64_t deadline;
+	u_int len;
+
+	ifnet_get_lladdr(udp_fd, ifname1, &src);
+	ifnet_get_lladdr(udp_fd, ifname2, &dst);
+	len = ethernet_udp4_frame_populate(frame, sizeof(frame), &src, src_ip,
+	    port, &dst, dst_ip, 9, payload, sizeof(payload));
+	T_QUIET; T_ASSERT_GT(len, 0u, "frame");
+
+	T_QUIET; T_ASSERT_EQ(get_queue_stats(ifname2, before, n), n, "stats");
+	for (int i = 0; i < frames; i++) {
+		T_QUIET; T_ASSERT_EQ((ssize_t)len, write(bpf_fd, frame, len),
+		    "bpf write");
+	}
+
+	mach_timebase_info(&tb);
+	deadline = mach_absolute_time() +
+	    RSS_WAIT_SECONDS * NSEC_PER_SEC * tb.denom / tb.numer;
+	for (;;) {
+		T_QUIET; T_ASSERT_EQ(get_queue_stats(ifname2, after, n), n, "stats");
+		if (max_packets(before, after, n) >= (uint64_t)frames) {
+			break;
+		}
+		if (mach_absolute_time() > deadline) {
+			T_ASSERT_FAIL("%d frames of port %u didn't all reach one "
+			    "input thread of %s, %llu in total", frames, port,
+			    ifname2, total_packets(after, n) - total_packets(before, n));
+		}
+		usleep(1000);
+	}
+}
+
+T_DECL(net_input_rss,
+    "legacy input is steered across several input threads by flow")
+{
+	struct if_inputq_stats before[RSS_THREADS], after[RSS_THREADS];
+	struct if_inputq_stats first[RSS_THREADS];
+	int threads = RSS_THREADS;
+	size_t len = sizeof(saved_threads);
+	uint32_t n, busy = 0;
+
+	T_ATEND(cleanup);
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.link.generic.system.input_threads_per_if",
+	    &saved_threads, &len, &threads, sizeof(threads)),
+	    "input_threads_per_if = %d", threads);
+
+	udp_fd = inet_dgram_socket();
+	strlcpy(ifname1, FETH_NAME, sizeof(ifname1));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(udp_fd, ifname1, sizeof(ifname1)), "create %s", ifname1);
+	strlcpy(ifname2, FETH_NAME, sizeof(ifname2));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(udp_fd, ifname2, sizeof(ifname2)), "create %s", ifname2);
+	T_ASSERT_POSIX_ZERO(fake_set_peer(udp_fd, ifname1, ifname2), "peer");
+	T_ASSERT_POSIX_ZERO(ifnet_set_flags(udp_fd, ifname1, IFF_UP, 0), "up");
+	T_ASSERT_POSIX_ZERO(ifnet_set_flags(udp_fd, ifname2, IFF_UP, 0), "up");
+
+	n = get_queue_stats(ifname2, first, RSS_THREADS);
+	if (n < RSS_THREADS) {
+		T_SKIP("%s has %u input thread(s), not the legacy input model", ifname2, n);
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		T_QUIET; T_ASSERT_EQ(first[i].ifiq_index, i, "thread %u is reported in order", i);
+	}
+
+	bpf_fd = bpf_new();
+	T_ASSERT_POSIX_SUCCESS(bpf_fd, "bpf_new");
+	T_ASSERT_POSIX_SUCCESS(bpf_setif(bpf_fd, ifname1), "bpf set if %s", ifname1);
+
+	/* a flow sticks to one thread */
+	for (uint16_t port = 0; port < RSS_FLOWS; port++) {
+		send_flow(10000 + port, RSS_FLOW_FRAMES, before, after, n);
+	}
+	T_PASS("each of %d flows went to a single input thread", RSS_FLOWS);
+
+	/* and the flows are spread across all the threads */
+	for (uint32_t i = 0; i < n; i++) {
+		uint64_t pkts = after[i].ifiq_packets - first[i].ifiq_packets;
+
+		T_LOG("input thread %u: %llu packets, queue max %u, %llu dropped",
+		    i, pkts, after[i].ifiq_len_max, after[i].ifiq_dropped);
+		busy += (pkts != 0);
+	}
+	T_EXPECT_GE(total_packets(after, n) - total_packets(first, n),
+	    (uint64_t)RSS_FLOWS * RSS_FLOW_FRAMES, "every frame accounted for");
+	T_EXPECT_EQ(busy, n, "%d flows used all %u input threads", RSS_FLOWS, n);
+
+	/* tear the threads down with traffic just queued */
+	send_flow(20000, RSS_FLOW_FRAMES, before, after, n);
+	T_ASSERT_POSIX_ZERO(ifnet_destroy(udp_fd, ifname2, true), "destroy %s", ifname2);
+	ifname2[0] = '\0';
+}
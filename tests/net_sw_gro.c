@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Runs batches of TCP segments through the software GRO of the legacy
+ * DLIL input path with net.link.generic.system.sw_gro_replay (DEVELOPMENT
+ * kernels), which checks that every flow's packets come out in sequence
+ * with intact data, and checks how much got coalesced.
+ */
+#include <darwintest.h>
+
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false),
+	T_META_CHECK_LEAKS(false));
+
+/* Must match bsd/net/dlil.c */
+struct dlil_gro_replay_seg {
+	uint32_t        dgrs_off;
+	uint16_t        dgrs_len;
+	uint8_t         dgrs_flags;
+	uint8_t         dgrs_flow;
+	uint32_t        dgrs_ctl;
+};
+
+#define DLIL_GRO_REPLAY_EOB     0x1
+#define DLIL_GRO_REPLAY_OFF     0x2
+#define DLIL_GRO_REPLAY_HOLD    0x4
+
+struct dlil_gro_replay_result {
+	uint64_t        dgrr_delivered;
+	uint32_t        dgrr_pkts;
+	uint32_t        dgrr_merged;
+	uint32_t        dgrr_misordered;
+	uint32_t        dgrr_corrupt;
+	uint32_t        dgrr_fin;
+	uint32_t        dgrr_rst;
+	uint32_t        dgrr_held;
+	uint32_t        dgrr_max_segs;
+};
+
+#define GRO_MSS                 1000
+#define GRO_MAX_SEGS            64
+
+struct gro_run {
+	struct dlil_gro_replay_seg      segs[GRO_MAX_SEGS];
+	size_t                          nsegs;
+	uint32_t                        next[8];        /* per flow */
+};
+
+static void
+add_seg(struct gro_run *run, uint8_t flow, uint16_t len, uint8_t flags,
+    uint32_t ctl)
+{
+	T_QUIET; T_ASSERT_LT(run->nsegs, (size_t)GRO_MAX_SEGS, "segment list size");
+	run->segs[run->nsegs++] = (struct dlil_gro_replay_seg){
+		.dgrs_off = run->next[flow],
+		.dgrs_len = len,
+		.dgrs_flags = flags,
+		.dgrs_flow = flow,
+		.dgrs_ctl = ctl,
+	};
+	run->next[flow] += len + ((flags & TH_FIN) ? 1 : 0);
+}
+
+static void
+replay(struct gro_run *run, struct dlil_gro_replay_result *res)
+{
+	size_t len = sizeof(*res);
+
+	if (sysctlbyname("net.link.generic.system.sw_gro_replay", res, &len,
+	    run->segs, run->nsegs * sizeof(run->segs[0])) != 0) {
+		T_QUIET; T_ASSERT_EQ(errno, ENOENT, "net.link.generic.system.sw_gro_replay");
+		T_SKIP("net.link.generic.system.sw_gro_replay not supported (release kernel?)");
+	}
+	T_QUIET; T_ASSERT_EQ(len, sizeof(*res), "result size");
+}
+
+static void
+check_flows(const char *what, struct gro_run *run,
+    struct dlil_gro_replay_result *res)
+{
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < run->nsegs; i++) {
+		total += run->segs[i].dgrs_len;
+	}
+	T_EXPECT_EQ(res->dgrr_misordered, 0, "%s: every flow delivered in sequence", what);
+	T_EXPECT_EQ(res->dgrr_corrupt, 0, "%s: delivered data intact", what);
+	T_EXPECT_EQ(res->dgrr_delivered, total, "%s: all data delivered", what);
+	T_EXPECT_EQ(res->dgrr_pkts + res->dgrr_merged, (uint32_t)run->nsegs,
+	    "%s: every segment delivered or merged", what);
+}
+
+T_DECL(sw_gro_merge, "in-order segments of a flow are coalesced")
+{
+	struct dlil_gro_replay_result res = {};
+	struct gro_run run = {};
+
+	for (int i = 0; i < 8; i++) {
+		add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	}
+	replay(&run, &res);
+
+	check_flows("one flow", &run, &res);
+	T_EXPECT_EQ(res.dgrr_pkts, 1, "one coalesced packet");
+	T_EXPECT_EQ(res.dgrr_max_segs, 8, "of all 8 segments");
+}
+
+T_DECL(sw_gro_fin_ack_order,
+    "FIN, RST and pure ACKs don't overtake data of their flow held by GRO")
+{
+	struct dlil_gro_replay_result res = {};
+	struct gro_run run = {};
+
+	/* two interleaved flows, in a single batch */
+	add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 1, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 0, 0, TH_ACK, 0);
+	add_seg(&run, 1, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 0, GRO_MSS / 2, TH_FIN | TH_ACK, 0);
+	add_seg(&run, 1, 0, TH_RST | TH_ACK, 0);
+	replay(&run, &res);
+
+	check_flows("interleaved", &run, &res);
+	T_EXPECT_EQ(res.dgrr_fin, 1, "FIN delivered");
+	T_EXPECT_EQ(res.dgrr_rst, 1, "RST delivered");
+	T_EXPECT_EQ(res.dgrr_merged, 2, "both flows coalesced their first segments");
+}
+
+T_DECL(sw_gro_held_across_batches,
+    "segments GRO holds past a batch go out ahead of the next batch")
+{
+	struct dlil_gro_replay_result res = {};
+	struct gro_run run = {};
+
+	/* held, then a RST of the flow with GRO still on */
+	add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 0, GRO_MSS, TH_ACK, DLIL_GRO_REPLAY_EOB | DLIL_GRO_REPLAY_HOLD);
+	add_seg(&run, 0, 0, TH_RST | TH_ACK, DLIL_GRO_REPLAY_EOB);
+	replay(&run, &res);
+
+	check_flows("RST after hold", &run, &res);
+	T_EXPECT_EQ(res.dgrr_held, 1, "first batch held its flow");
+	T_EXPECT_EQ(res.dgrr_max_segs, 2, "held segments were coalesced");
+	T_EXPECT_EQ(res.dgrr_rst, 1, "RST delivered");
+}
+
+T_DECL(sw_gro_toggle, "turning GRO off mid-stream keeps every flow in order")
+{
+	struct dlil_gro_replay_result res = {};
+	struct gro_run run = {};
+
+	/* GRO on and holding, then off, then on again */
+	add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 1, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 1, GRO_MSS, TH_ACK, DLIL_GRO_REPLAY_EOB | DLIL_GRO_REPLAY_HOLD);
+	add_seg(&run, 0, GRO_MSS, TH_ACK, DLIL_GRO_REPLAY_OFF);
+	add_seg(&run, 1, 0, TH_ACK, DLIL_GRO_REPLAY_OFF);
+	add_seg(&run, 0, GRO_MSS, TH_ACK, DLIL_GRO_REPLAY_EOB | DLIL_GRO_REPLAY_OFF);
+	add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 0, GRO_MSS, TH_ACK, 0);
+	add_seg(&run, 1, GRO_MSS, TH_FIN | TH_ACK, 0);
+	add_seg(&run, 0, GRO_MSS, TH_FIN | TH_ACK, DLIL_GRO_REPLAY_EOB);
+	replay(&run, &res);
+
+	check_flows("toggle", &run, &res);
+	T_EXPECT_EQ(res.dgrr_held, 1, "only the first batch held flows");
+	T_EXPECT_EQ(res.dgrr_fin, 2, "both FINs delivered");
+	T_EXPECT_EQ(res.dgrr_max_segs, 2, "coalesced with GRO on");
+	/* 2 merged while holding, 1 after GRO came back on */
+	T_EXPECT_EQ(res.dgrr_merged, 3, "nothing coalesced with GRO off");
+}
@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Checks the pf filter rule index against linear evaluation: the index
+ * is built from bsd/net/pf_ruleset.c in user space for random rulesets,
+ * and random packets must come out with the same matching rule whether
+ * all rules or only the ones the index lists are evaluated, with the
+ * first quick or last match rule as in pf_test_rule().
+ */
+#include <darwintest.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <mach/mach_time.h>
+
+#include "test_rand.h"
+#include "../bsd/net/pf_ruleset.c"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_RUN_CONCURRENTLY(true),
+	T_META_CHECK_LEAKS(false));
+
+#define TEST_RULESETS           400
+#define TEST_PACKETS            2000
+#define TEST_MAX_RULES          600
+
+struct test_packet {
+	u_int8_t        dir;
+	u_int8_t        proto;
+	sa_family_t     af;
+	u_int16_t       dport;          /* network order */
+	u_int32_t       id;
+};
+
+/* pf_match() from pf.c, in host order */
+static int
+port_match(u_int8_t op, u_int32_t a1, u_int32_t a2, u_int32_t p)
+{
+	switch (op) {
+	case PF_OP_IRG:
+		return (p > a1) && (p < a2);
+	case PF_OP_XRG:
+		return (p < a1) || (p > a2);
+	case PF_OP_RRG:
+		return (p >= a1) && (p <= a2);
+	case PF_OP_EQ:
+		return p == a1;
+	case PF_OP_NE:
+		return p != a1;
+	case PF_OP_LT:
+		return p < a1;
+	case PF_OP_LE:
+		return p <= a1;
+	case PF_OP_GT:
+		return p > a1;
+	case PF_OP_GE:
+		return p >= a1;
+	}
+	return 0;
+}
+
+/*
+ * The checks of pf_test_rule() the index knows about, plus a stand-in
+ * for all the others (addresses, flags, tags...) that it does not.
+ */
+static int
+rule_match(struct pf_rule *r, struct test_packet *p)
+{
+	if (r->direction && r->direction != p->dir) {
+		return 0;
+	}
+	if (r->af && r->af != p->af) {
+		return 0;
+	}
+	if (r->proto && r->proto != p->proto) {
+		return 0;
+	}
+	if (r->proto == p->proto &&
+	    (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) &&
+	    r->dst.xport.range.op &&
+	    !port_match(r->dst.xport.range.op,
+	    ntohs(r->dst.xport.range.port[0]),
+	    ntohs(r->dst.xport.range.port[1]), ntohs(p->dport))) {
+		return 0;
+	}
+	return ((r->nr * 2654435761u) ^ p->id) % 5 != 0;
+}
+
+static int
+eval_linear(struct pf_rulequeue *rules, struct test_packet *p,
+    u_int32_t *evaluated)
+{
+	struct pf_rule *r;
+	int match = -1;
+
+	TAILQ_FOREACH(r, rules, entries) {
+		(*evaluated)++;
+		if (rule_match(r, p)) {
+			match = (int)r->nr;
+			if (r->quick) {
+				break;
+			}
+		}
+	}
+	return match;
+}
+
+static int
+eval_indexed(struct pf_rule_index *idx, struct pf_rulequeue *rules,
+    struct test_packet *p, u_int32_t *evaluated)
+{
+	struct pf_rule **v;
+	u_int32_t n, i;
+	int match = -1;
+
+	if (idx == NULL || !pf_rule_index_lookup(idx, p->dir, p->af,
+	    p->proto, p->dport, &v, &n)) {
+		return eval_linear(rules, p, evaluated);
+	}
+	for (i = 0; i < n; i++) {
+		(*evaluated)++;
+		if (i > 0) {
+			T_QUIET; T_ASSERT_LT(v[i - 1]->nr, v[i]->nr,
+			    "index lists rules in order");
+		}
+		if (rule_match(v[i], p)) {
+			match = (int)v[i]->nr;
+			if (v[i]->quick) {
+				break;
+			}
+		}
+	}
+	return match;
+}
+
+static u_int16_t
+random_port(u_int16_t *seen, u_int32_t nseen)
+{
+	/* mostly ports the rules use, and their neighbours */
+	if (nseen > 0 && test_rand32() % 4 != 0) {
+		return (u_int16_t)(seen[test_rand32() % nseen] + (int)(test_rand32() % 3) - 1);
+	}
+	switch (test_rand32() % 4) {
+	case 0:
+		return 0;
+	case 1:
+		return 65535;
+	default:
+		return (u_int16_t)test_rand32();
+	}
+}
+
+static void
+random_rules(struct pf_rule *rules, u_int32_t nrules, struct pf_rulequeue *q,
+    u_int16_t *seen, u_int32_t *nseen, u_int32_t nports)
+{
+	static const u_int8_t protos[] = { 0, IPPROTO_TCP, IPPROTO_UDP,
+		                           IPPROTO_ICMP };
+	u_int32_t i, a1, a2;
+
+	TAILQ_INIT(q);
+	*nseen = 0;
+	for (i = 0; i < nrules; i++) {
+		struct pf_rule *r = &rules[i];
+
+		memset(r, 0, sizeof(*r));
+		r->nr = i;
+		r->direction = (u_int8_t)(test_rand32() % 3);
+		r->af = test_rand32() % 3 == 0 ? 0 :
+		    (test_rand32() % 2 ? AF_INET : AF_INET6);
+		r->proto = protos[test_rand32() % 4];
+		r->quick = test_rand32() % 8 == 0;
+		if ((r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) &&
+		    test_rand32() % 4 != 0) {
+			a1 = test_rand32() % nports;
+			a2 = test_rand32() % 4 == 0 ? test_rand32() % nports :
+			    a1 + test_rand32() % 64;
+			if (test_rand32() % 16 == 0) {
+				a1 = test_rand32() % 2 ? 0 : 65535;
+			}
+			r->dst.xport.range.op =
+			    (u_int8_t)(1 + test_rand32() % PF_OP_RRG);
+			r->dst.xport.range.port[0] = htons((u_int16_t)a1);
+			r->dst.xport.range.port[1] = htons((u_int16_t)MIN(a2, 65535));
+			seen[(*nseen)++] = (u_int16_t)a1;
+			seen[(*nseen)++] = (u_int16_t)MIN(a2, 65535);
+		}
+		TAILQ_INSERT_TAIL(q, r, entries);
+	}
+}
+
+/*
+ * What large anchors tend to look like: a default rule, then a long list
+ * of quick rules for one protocol and port each.
+ */
+static void
+service_rules(struct pf_rule *rules, u_int32_t nrules, struct pf_rulequeue *q,
+    u_int16_t *seen, u_int32_t *nseen)
+{
+	u_int32_t i, port;
+
+	TAILQ_INIT(q);
+	*nseen = 0;
+	for (i = 0; i < nrules; i++) {
+		struct pf_rule *r = &rules[i];
+
+		memset(r, 0, sizeof(*r));
+		r->nr = i;
+		if (i > 0) {
+			port = 1 + test_rand32() % 65535;
+			r->direction = PF_IN;
+			r->af = test_rand32() % 2 ? AF_INET : AF_INET6;
+			r->proto = test_rand32() % 2 ? IPPROTO_TCP : IPPROTO_UDP;
+			r->quick = 1;
+			r->dst.xport.range.op = PF_OP_EQ;
+			r->dst.xport.range.port[0] = htons((u_int16_t)port);
+			seen[(*nseen)++] = (u_int16_t)port;
+		}
+		TAILQ_INSERT_TAIL(q, r, entries);
+	}
+}
+
+static void
+random_packet(struct test_packet *p, u_int16_t *seen, u_int32_t nseen)
+{
+	static const u_int8_t protos[] = { IPPROTO_TCP, IPPROTO_UDP,
+		                           IPPROTO_ICMP };
+
+	p->dir = test_rand32() % 2 ? PF_IN : PF_OUT;
+	p->af = test_rand32() % 2 ? AF_INET : AF_INET6;
+	p->proto = protos[test_rand32() % 3];
+	p->dport = htons(random_port(seen, nseen));
+	p->id = test_rand32();
+}
+
+T_DECL(pf_rule_index_equivalence,
+    "indexed filter rule evaluation matches linear evaluation")
+{
+	struct pf_rule *rules;
+	struct pf_rulequeue q;
+	struct pf_rule_index *idx;
+	struct test_packet p;
+	u_int16_t *seen;
+	u_int32_t nseen, nrules, indexed = 0, lin_evals = 0, idx_evals = 0;
+
+	T_LOG("seed %llu", test_rand_seed());
+
+	rules = calloc(TEST_MAX_RULES, sizeof(*rules));
+	seen = calloc(2 * TEST_MAX_RULES, sizeof(*seen));
+	T_QUIET; T_ASSERT_NOTNULL(rules, "calloc");
+	T_QUIET; T_ASSERT_NOTNULL(seen, "calloc");
+
+	for (int rs = 0; rs < TEST_RULESETS; rs++) {
+		nrules = 1 + test_rand32() % TEST_MAX_RULES;
+		/* a narrow port space makes ranges overlap more */
+		random_rules(rules, nrules, &q, seen, &nseen,
+		    rs % 2 ? 1024 : 65536);
+		idx = pf_rule_index_build(&q, nrules);
+		if (idx != NULL) {
+			indexed++;
+		}
+		for (int i = 0; i < TEST_PACKETS; i++) {
+			int expect, got;
+
+			random_packet(&p, seen, nseen);
+			expect = eval_linear(&q, &p, &lin_evals);
+			got = eval_indexed(idx, &q, &p, &idx_evals);
+			if (expect != got) {
+				T_ASSERT_EQ(got, expect,
+				    "ruleset %d (%u rules), packet dir %u af %u "
+				    "proto %u dport %u id %u", rs, nrules, p.dir,
+				    p.af, p.proto, ntohs(p.dport), p.id);
+			}
+		}
+		pf_rule_index_free(idx);
+	}
+	T_LOG("%u of %d rulesets indexed, %u rules evaluated instead of %u",
+	    indexed, TEST_RULESETS, idx_evals, lin_evals);
+	T_ASSERT_GT(indexed, 0, "some rulesets were indexed");
+	free(seen);
+	free(rules);
+}
+
+T_DECL(pf_rule_index_perf,
+    "rule evaluation time with the index and with a plain walk of the "
+    "rules (no skip steps), by ruleset size",
+    T_META_TAG_PERF)
+{
+	static const u_int32_t sizes[] = { 64, 1024, 8192 };
+	struct pf_rule *rules;
+	struct pf_rulequeue q;
+	struct pf_rule_index *idx;
+	struct test_packet *pkts;
+	u_int16_t *seen;
+	u_int32_t nseen, evals = 0;
+	mach_timebase_info_data_t tb;
+	uint64_t start, lin, ixd;
+	char metric[64];
+
+	mach_timebase_info(&tb);
+	test_rand_set_seed(1);
+	rules = calloc(sizes[2], sizeof(*rules));
+	seen = calloc(sizes[2], sizeof(*seen));
+	pkts = calloc(TEST_PACKETS, sizeof(*pkts));
+	T_QUIET; T_ASSERT_NOTNULL(rules, "calloc");
+	T_QUIET; T_ASSERT_NOTNULL(seen, "calloc");
+	T_QUIET; T_ASSERT_NOTNULL(pkts, "calloc");
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		service_rules(rules, sizes[s], &q, seen, &nseen);
+		start = mach_absolute_time();
+		idx = pf_rule_index_build(&q, sizes[s]);
+		T_LOG("%u rules: index built in %llu us", sizes[s],
+		    (mach_absolute_time() - start) * tb.numer / tb.denom / 1000);
+		T_QUIET; T_ASSERT_NOTNULL(idx, "index built");
+		for (int i = 0; i < TEST_PACKETS; i++) {
+			random_packet(&pkts[i], seen, nseen);
+			pkts[i].dir = PF_IN;
+			pkts[i].proto = i % 2 ? IPPROTO_TCP : IPPROTO_UDP;
+		}
+
+		start = mach_absolute_time();
+		for (int i = 0; i < TEST_PACKETS; i++) {
+			(void)eval_linear(&q, &pkts[i], &evals);
+		}
+		lin = (mach_absolute_time() - start) * tb.numer / tb.denom;
+		start = mach_absolute_time();
+		for (int i = 0; i < TEST_PACKETS; i++) {
+			(void)eval_indexed(idx, &q, &pkts[i], &evals);
+		}
+		ixd = (mach_absolute_time() - start) * tb.numer / tb.denom;
+		pf_rule_index_free(idx);
+
+		T_LOG("%u rules: %.1f ns/packet linear, %.1f ns/packet indexed",
+		    sizes[s], (double)lin / TEST_PACKETS,
+		    (double)ixd / TEST_PACKETS);
+		snprintf(metric, sizeof(metric), "pf_rule_eval_ns_%u_linear",
+		    sizes[s]);
+		T_PERF(metric, (double)lin / TEST_PACKETS, "ns",
+		    "linear rule evaluation per packet");
+		snprintf(metric, sizeof(metric), "pf_rule_eval_ns_%u_indexed",
+		    sizes[s]);
+		T_PERF(metric, (double)ixd / TEST_PACKETS, "ns",
+		    "indexed rule evaluation per packet");
+	}
+	free(pkts);
+	free(seen);
+	free(rules);
+}
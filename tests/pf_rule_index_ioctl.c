@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Checks the pf filter rule index as pf_test_rule() uses it: random
+ * rulesets with addresses, ports, TCP flags, quick rules and nested and
+ * wildcard anchors are loaded with DIOCADDRULE, then edited with
+ * DIOCCHANGERULE, and random packets must be decided by the same rule
+ * with and without the index (debug.pf_rule_probe).
+ *
+ * The filter rules of the main ruleset are replaced for the duration of
+ * the test and restored afterwards, so it only runs while pf is disabled.
+ */
+#include <darwintest.h>
+
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <net/pfvar.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_rand.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false),
+	T_META_CHECK_LEAKS(false));
+
+/* Must match bsd/net/pf.c */
+struct pf_rule_probe {
+	struct pf_addr  prb_saddr;
+	struct pf_addr  prb_daddr;
+	u_int16_t       prb_sport;      /* network byte order */
+	u_int16_t       prb_dport;      /* network byte order */
+	sa_family_t     prb_af;
+	u_int8_t        prb_proto;
+	u_int8_t        prb_dir;        /* PF_IN or PF_OUT */
+	u_int8_t        prb_flags;      /* TCP flags */
+	u_int8_t        prb_noindex;
+};
+
+struct pf_rule_probe_result {
+	u_int32_t       prr_action;
+	u_int32_t       prr_nr;         /* UINT32_MAX for the default rule */
+	u_int32_t       prr_anchor_nr;  /* UINT32_MAX outside of anchors */
+	char            prr_anchor[MAXPATHLEN];
+};
+
+#define TEST_ANCHOR             "xnu_rule_index"
+#define TEST_RULESETS           6
+#define TEST_ROUNDS             5
+#define TEST_PACKETS            2000
+#define TEST_CHANGES            100
+#define TEST_CHANGE_PACKETS     100
+#define TEST_PORTS              64
+
+/*
+ * The main ruleset calls a0, a1 and every child of w, a0 calls a0/n.
+ * a1 stays under the 32 rules needed for an index, the others don't.
+ */
+static const char *test_anchors[TEST_RULESETS] = {
+	"",
+	TEST_ANCHOR "/a0",
+	TEST_ANCHOR "/a0/n",
+	TEST_ANCHOR "/a1",
+	TEST_ANCHOR "/w/c0",
+	TEST_ANCHOR "/w/c1",
+};
+
+static int pf_fd = -1;
+static struct pfioc_rule *saved_rules;
+static u_int32_t nsaved;
+static u_int32_t nrules[TEST_RULESETS];
+static u_int16_t ports[TEST_PORTS];
+
+static const char *
+ruleset_name(int rs)
+{
+	return test_anchors[rs][0] ? test_anchors[rs] : "main";
+}
+
+static void
+trans_begin(struct pfioc_trans_e *ioe)
+{
+	struct pfioc_trans io;
+
+	memset(ioe, 0, TEST_RULESETS * sizeof(*ioe));
+	for (int i = 0; i < TEST_RULESETS; i++) {
+		ioe[i].rs_num = PF_RULESET_FILTER;
+		strlcpy(ioe[i].anchor, test_anchors[i], sizeof(ioe[i].anchor));
+	}
+	memset(&io, 0, sizeof(io));
+	io.size = TEST_RULESETS;
+	io.esize = sizeof(*ioe);
+	io.array = ioe;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCXBEGIN, &io), "DIOCXBEGIN");
+}
+
+static void
+trans_commit(struct pfioc_trans_e *ioe)
+{
+	struct pfioc_trans io;
+
+	memset(&io, 0, sizeof(io));
+	io.size = TEST_RULESETS;
+	io.esize = sizeof(*ioe);
+	io.array = ioe;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCXCOMMIT, &io), "DIOCXCOMMIT");
+}
+
+static u_int32_t
+pool_ticket(void)
+{
+	struct pfioc_pooladdr pp;
+
+	memset(&pp, 0, sizeof(pp));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCBEGINADDRS, &pp),
+	    "DIOCBEGINADDRS");
+	return pp.ticket;
+}
+
+static void
+add_rule(int rs, u_int32_t ticket, struct pf_rule *r, const char *call)
+{
+	struct pfioc_rule *pr;
+
+	pr = calloc(1, sizeof(*pr));
+	T_QUIET; T_ASSERT_NOTNULL(pr, "calloc");
+	strlcpy(pr->anchor, test_anchors[rs], sizeof(pr->anchor));
+	if (call != NULL) {
+		strlcpy(pr->anchor_call, call, sizeof(pr->anchor_call));
+	}
+	pr->rule = *r;
+	pr->ticket = ticket;
+	pr->pool_ticket = pool_ticket();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCADDRULE, pr),
+	    "DIOCADDRULE %s", ruleset_name(rs));
+	free(pr);
+	nrules[rs]++;
+}
+
+static void
+save_main_rules(void)
+{
+	struct pfioc_rule pr;
+
+	memset(&pr, 0, sizeof(pr));
+	pr.rule.action = PF_PASS;
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCGETRULES, &pr), "DIOCGETRULES");
+	nsaved = pr.nr;
+	saved_rules = calloc(nsaved + 1, sizeof(*saved_rules));
+	T_QUIET; T_ASSERT_NOTNULL(saved_rules, "calloc");
+	for (u_int32_t i = 0; i < nsaved; i++) {
+		struct pfioc_rule *sr = &saved_rules[i];
+
+		*sr = pr;
+		sr->nr = i;
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCGETRULE, sr),
+		    "DIOCGETRULE %u", i);
+		if (sr->rule.rt != 0) {
+			/* DIOCGETRULE doesn't return the route-to pool */
+			free(saved_rules);
+			saved_rules = NULL;
+			T_SKIP("main ruleset has route-to rules, not replacing it");
+		}
+	}
+	T_LOG("saved %u main filter rules", nsaved);
+}
+
+static void
+restore_main_rules(void)
+{
+	struct pfioc_trans_e ioe[TEST_RULESETS];
+
+	if (saved_rules == NULL) {
+		return;
+	}
+	/* empties the test anchors, they go away with the calls to them */
+	trans_begin(ioe);
+	for (u_int32_t i = 0; i < nsaved; i++) {
+		struct pfioc_rule *sr = &saved_rules[i];
+
+		sr->ticket = ioe[0].ticket;
+		sr->pool_ticket = pool_ticket();
+		T_QUIET; T_EXPECT_POSIX_SUCCESS(ioctl(pf_fd, DIOCADDRULE, sr),
+		    "restore main filter rule %u", i);
+	}
+	trans_commit(ioe);
+	free(saved_rules);
+	saved_rules = NULL;
+}
+
+static void
+close_pf(void)
+{
+	close(pf_fd);
+}
+
+static bool
+probe(struct pf_rule_probe *prb, struct pf_rule_probe_result *res)
+{
+	size_t len = sizeof(*res);
+
+	memset(res, 0, sizeof(*res));
+	if (sysctlbyname("debug.pf_rule_probe", res, &len, prb, sizeof(*prb)) != 0) {
+		T_QUIET; T_ASSERT_EQ(errno, ENOENT, "debug.pf_rule_probe");
+		return false;
+	}
+	T_QUIET; T_ASSERT_EQ(len, sizeof(*res), "result size");
+	return true;
+}
+
+static void
+setup(void)
+{
+	struct pf_rule_probe prb;
+	struct pf_rule_probe_result res;
+	struct pf_status status;
+
+	T_LOG("seed %llu", test_rand_seed());
+
+	pf_fd = open("/dev/pf", O_RDWR);
+	if (pf_fd < 0) {
+		T_SKIP("/dev/pf not available (errno %d)", errno);
+	}
+	T_ATEND(close_pf);
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCGETSTATUS, &status),
+	    "DIOCGETSTATUS");
+	if (status.running) {
+		T_SKIP("pf is enabled, not replacing its rules");
+	}
+
+	memset(&prb, 0, sizeof(prb));
+	prb.prb_af = AF_INET;
+	prb.prb_proto = IPPROTO_UDP;
+	prb.prb_dir = PF_IN;
+	prb.prb_sport = prb.prb_dport = htons(53);
+	if (!probe(&prb, &res)) {
+		T_SKIP("debug.pf_rule_probe not supported (release kernel?)");
+	}
+
+	save_main_rules();
+	T_ATEND(restore_main_rules);
+}
+
+static void
+random_addr(sa_family_t af, struct pf_addr *a)
+{
+	/* a few networks, so that prefixes nest and skip steps form */
+	static const u_int32_t nets[] = {
+		0x0a010203, 0x0a010909, 0x0ac80001, 0xc0a80101, 0xac100001,
+	};
+	u_int32_t net = nets[test_rand32() % (sizeof(nets) / sizeof(nets[0]))];
+
+	memset(a, 0, sizeof(*a));
+	if (test_rand32() % 4 == 0) {
+		net ^= test_rand32() & 0xff;
+	}
+	if (af == AF_INET) {
+		a->v4addr.s_addr = htonl(net);
+	} else {
+		a->addr32[0] = htonl(0xfd000000);
+		a->addr32[3] = htonl(net);
+	}
+}
+
+static void
+random_mask(sa_family_t af, struct pf_addr *m)
+{
+	static const u_int8_t plens[] = { 8, 16, 24, 32 };
+	u_int8_t plen = plens[test_rand32() % 4];
+
+	memset(m, 0, sizeof(*m));
+	if (af == AF_INET) {
+		m->v4addr.s_addr = htonl(0xffffffffu << (32 - plen));
+	} else {
+		/* the same prefix inside fd00::/96 */
+		m->addr32[0] = m->addr32[1] = m->addr32[2] = 0xffffffff;
+		m->addr32[3] = htonl(0xffffffffu << (32 - plen));
+	}
+}
+
+static void
+random_port_range(struct pf_port_range *range)
+{
+	u_int16_t a1 = ports[test_rand32() % TEST_PORTS];
+	u_int16_t a2 = (u_int16_t)MIN(a1 + test_rand32() % 64, 65535);
+
+	range->op = (u_int8_t)(1 + test_rand32() % PF_OP_RRG);
+	range->port[0] = htons(a1);
+	range->port[1] = htons(a2);
+}
+
+/*
+ * Rules sharing their fields with their neighbours, for the skip
+ * steps, and rules pf_rule_index_build() can and cannot narrow down.
+ */
+static void
+random_rule(struct pf_rule *r, const struct pf_rule *prev)
+{
+	static const u_int8_t protos[] = { 0, IPPROTO_TCP, IPPROTO_UDP };
+
+	if (prev != NULL && test_rand32() % 3 == 0) {
+		*r = *prev;
+	} else {
+		memset(r, 0, sizeof(*r));
+		r->direction = (u_int8_t)(test_rand32() % 3);
+		r->af = test_rand32() % 3 == 0 ? 0 :
+		    (test_rand32() % 2 ? AF_INET : AF_INET6);
+		r->proto = protos[test_rand32() % 3];
+		if (r->af && test_rand32() % 2) {
+			random_addr(r->af, &r->src.addr.v.a.addr);
+			random_mask(r->af, &r->src.addr.v.a.mask);
+			r->src.neg = test_rand32() % 8 == 0;
+		}
+		if (r->af && test_rand32() % 3 == 0) {
+			random_addr(r->af, &r->dst.addr.v.a.addr);
+			random_mask(r->af, &r->dst.addr.v.a.mask);
+		}
+	}
+	r->action = test_rand32() % 3 ? PF_PASS : PF_DROP;
+	r->quick = test_rand32() % 6 == 0;
+	r->keep_state = 0;
+	if (r->proto == IPPROTO_TCP || r->proto == IPPROTO_UDP) {
+		if (test_rand32() % 4 != 0) {
+			random_port_range(&r->dst.xport.range);
+		}
+		if (test_rand32() % 8 == 0) {
+			random_port_range(&r->src.xport.range);
+		}
+	}
+	if (r->proto == IPPROTO_TCP && test_rand32() % 8 == 0) {
+		r->flags = TH_SYN;
+		r->flagset = TH_SYN | TH_ACK;
+	}
+}
+
+static void
+add_random_rules(int rs, u_int32_t ticket, u_int32_t n)
+{
+	struct pf_rule r, prev;
+
+	for (u_int32_t i = 0; i < n; i++) {
+		random_rule(&r, i > 0 ? &prev : NULL);
+		add_rule(rs, ticket, &r, NULL);
+		prev = r;
+	}
+}
+
+/* anchor calls filter like any rule, and can be quick too */
+static void
+add_anchor_call(int rs, u_int32_t ticket, const char *call)
+{
+	struct pf_rule r;
+
+	random_rule(&r, NULL);
+	r.action = PF_PASS;
+	r.flags = r.flagset = 0;
+	if (test_rand32() % 2) {
+		r.direction = 0;
+		r.af = 0;
+		r.proto = 0;
+		memset(&r.src, 0, sizeof(r.src));
+		memset(&r.dst, 0, sizeof(r.dst));
+	}
+	add_rule(rs, ticket, &r, call);
+}
+
+static void
+load_random_rulesets(void)
+{
+	struct pfioc_trans_e ioe[TEST_RULESETS];
+	u_int32_t n;
+
+	for (int i = 0; i < TEST_PORTS; i++) {
+		ports[i] = (u_int16_t)(test_rand32() % 4 == 0 ?
+		    1 + test_rand32() % 1024 : 1 + test_rand32() % 65535);
+	}
+	memset(nrules, 0, sizeof(nrules));
+
+	trans_begin(ioe);
+
+	n = 40 + test_rand32() % 200;
+	for (u_int32_t i = 0; i < n; i++) {
+		if (i == n / 4) {
+			add_anchor_call(0, ioe[0].ticket, TEST_ANCHOR "/a0");
+		} else if (i == n / 2) {
+			add_anchor_call(0, ioe[0].ticket, TEST_ANCHOR "/w/*");
+		} else if (i == 3 * n / 4) {
+			add_anchor_call(0, ioe[0].ticket, TEST_ANCHOR "/a1");
+		} else {
+			add_random_rules(0, ioe[0].ticket, 1);
+		}
+	}
+
+	n = 40 + test_rand32() % 120;
+	add_random_rules(1, ioe[1].ticket, n / 2);
+	add_anchor_call(1, ioe[1].ticket, "n");
+	add_random_rules(1, ioe[1].ticket, n - n / 2);
+
+	add_random_rules(2, ioe[2].ticket, 32 + test_rand32() % 64);
+	add_random_rules(3, ioe[3].ticket, 1 + test_rand32() % 16);
+	add_random_rules(4, ioe[4].ticket, 32 + test_rand32() % 64);
+	add_random_rules(5, ioe[5].ticket, 32 + test_rand32() % 64);
+
+	trans_commit(ioe);
+}
+
+static void
+random_probe(struct pf_rule_probe *prb)
+{
+	static const u_int8_t flags[] = { TH_SYN, TH_SYN | TH_ACK, TH_ACK,
+		                          TH_ACK | TH_FIN };
+
+	memset(prb, 0, sizeof(*prb));
+	prb->prb_af = test_rand32() % 2 ? AF_INET : AF_INET6;
+	prb->prb_proto = test_rand32() % 2 ? IPPROTO_TCP : IPPROTO_UDP;
+	prb->prb_dir = test_rand32() % 2 ? PF_IN : PF_OUT;
+	prb->prb_flags = flags[test_rand32() % 4];
+	random_addr(prb->prb_af, &prb->prb_saddr);
+	random_addr(prb->prb_af, &prb->prb_daddr);
+	/* mostly ports the rules use, and their neighbours */
+	prb->prb_sport = htons((u_int16_t)(1 + test_rand32() % 65535));
+	if (test_rand32() % 4 != 0) {
+		prb->prb_dport = htons((u_int16_t)MAX(1,
+		    ports[test_rand32() % TEST_PORTS] + (int)(test_rand32() % 3) - 1));
+	} else {
+		prb->prb_dport = htons((u_int16_t)(1 + test_rand32() % 65535));
+	}
+}
+
+struct check_stats {
+	u_int32_t       packets;
+	u_int32_t       mismatches;
+	u_int32_t       in_anchor;
+	u_int32_t       by_default;
+};
+
+static void
+check_packets(const char *what, u_int32_t npackets, struct check_stats *st)
+{
+	struct pf_rule_probe prb;
+	struct pf_rule_probe_result indexed, linear;
+
+	for (u_int32_t i = 0; i < npackets; i++) {
+		random_probe(&prb);
+		prb.prb_noindex = 0;
+		T_QUIET; T_ASSERT_TRUE(probe(&prb, &indexed), "probe");
+		prb.prb_noindex = 1;
+		T_QUIET; T_ASSERT_TRUE(probe(&prb, &linear), "probe");
+
+		st->packets++;
+		if (linear.prr_anchor[0]) {
+			st->in_anchor++;
+		}
+		if (linear.prr_nr == UINT32_MAX) {
+			st->by_default++;
+		}
+		if (indexed.prr_action != linear.prr_action ||
+		    indexed.prr_nr != linear.prr_nr ||
+		    indexed.prr_anchor_nr != linear.prr_anchor_nr ||
+		    strcmp(indexed.prr_anchor, linear.prr_anchor) != 0) {
+			T_LOG("%s: dir %u af %u proto %u sport %u dport %u flags 0x%x: "
+			    "indexed rule %d in \"%s\" (anchor %d) action %u, "
+			    "linear rule %d in \"%s\" (anchor %d) action %u", what,
+			    prb.prb_dir, prb.prb_af, prb.prb_proto,
+			    ntohs(prb.prb_sport), ntohs(prb.prb_dport), prb.prb_flags,
+			    (int)indexed.prr_nr, indexed.prr_anchor,
+			    (int)indexed.prr_anchor_nr, indexed.prr_action,
+			    (int)linear.prr_nr, linear.prr_anchor,
+			    (int)linear.prr_anchor_nr, linear.prr_action);
+			st->mismatches++;
+		}
+	}
+}
+
+/*
+ * One DIOCCHANGERULE on a random ruleset: a random rule added at either
+ * end or next to a random rule, or a random rule removed.  Anchor calls
+ * can be removed too, only the main ruleset is not emptied.
+ */
+static void
+random_change(void)
+{
+	struct pfioc_rule *pr;
+	int rs = (int)(test_rand32() % TEST_RULESETS);
+	u_int32_t action;
+
+	pr = calloc(1, sizeof(*pr));
+	T_QUIET; T_ASSERT_NOTNULL(pr, "calloc");
+	strlcpy(pr->anchor, test_anchors[rs], sizeof(pr->anchor));
+	pr->rule.action = PF_PASS;
+	pr->action = PF_CHANGE_GET_TICKET;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCCHANGERULE, pr),
+	    "DIOCCHANGERULE get ticket %s", ruleset_name(rs));
+
+	action = PF_CHANGE_ADD_HEAD + test_rand32() % 5;
+	if (nrules[rs] <= 1 && (action == PF_CHANGE_REMOVE ||
+	    action == PF_CHANGE_ADD_BEFORE || action == PF_CHANGE_ADD_AFTER)) {
+		action = PF_CHANGE_ADD_TAIL;
+	}
+	pr->action = action;
+	pr->nr = nrules[rs] ? test_rand32() % nrules[rs] : 0;
+	if (action != PF_CHANGE_REMOVE) {
+		random_rule(&pr->rule, NULL);
+		pr->pool_ticket = pool_ticket();
+	}
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCCHANGERULE, pr),
+	    "DIOCCHANGERULE %u on %s rule %u", action, ruleset_name(rs), pr->nr);
+	if (action == PF_CHANGE_REMOVE) {
+		nrules[rs]--;
+	} else {
+		nrules[rs]++;
+	}
+	free(pr);
+}
+
+T_DECL(pf_rule_index_ioctl,
+    "rules loaded and changed through /dev/pf decide the same with and "
+    "without the filter rule index")
+{
+	struct check_stats st = {};
+	char what[64];
+
+	setup();
+
+	for (int round = 0; round < TEST_ROUNDS; round++) {
+		load_random_rulesets();
+		T_LOG("round %d: %u main rules, %u in a0, %u in a0/n, %u in a1, "
+		    "%u in w/c0, %u in w/c1", round, nrules[0], nrules[1],
+		    nrules[2], nrules[3], nrules[4], nrules[5]);
+
+		snprintf(what, sizeof(what), "round %d", round);
+		check_packets(what, TEST_PACKETS, &st);
+
+		for (int c = 0; c < TEST_CHANGES && st.mismatches < 10; c++) {
+			random_change();
+			snprintf(what, sizeof(what), "round %d change %d", round, c);
+			check_packets(what, TEST_CHANGE_PACKETS, &st);
+		}
+		if (st.mismatches >= 10) {
+			break;
+		}
+	}
+
+	T_LOG("%u packets: %u decided in anchors, %u by the default rule",
+	    st.packets, st.in_anchor, st.by_default);
+	T_EXPECT_GT(st.in_anchor, 0, "some packets are decided inside anchors");
+	T_EXPECT_LT(st.by_default, st.packets, "some packets match a rule");
+	T_ASSERT_EQ(st.mismatches, 0, "same rule decides with and without the index");
+}
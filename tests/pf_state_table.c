@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Fills the pf state table through DIOCADDSTATE and measures insert and
+ * DIOCNATLOOK lookup rates in both the lan_ext and ext_gwy tables.  The
+ * number of states defaults to 1M and can be changed with
+ * PF_STATE_TABLE_STATES.
+ */
+#include <darwintest.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/tcp_fsm.h>
+#include <net/pfvar.h>
+#include <mach/mach_time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_rand.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false),
+	T_META_CHECK_LEAKS(false));
+
+#define STATE_TABLE_STATES      (1 << 20)
+#define STATE_TABLE_LOOKUPS     (1 << 21)
+#define STATE_EXT_ADDR          0x11000001      /* 17.0.0.1 */
+#define STATE_EXT_PORT          443
+
+static int pf_fd = -1;
+static struct pfioc_limit saved_limit;
+
+static double
+elapsed_ns(uint64_t start)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0) {
+		mach_timebase_info(&tb);
+	}
+	return (double)(mach_absolute_time() - start) * tb.numer / tb.denom;
+}
+
+/* state i is 10.x.y.z:(1024 + i % 16) <-> 17.0.0.1:443, without NAT */
+static void
+state_lan(uint32_t i, uint32_t *addr, uint16_t *port)
+{
+	*addr = htonl(0x0a000000 | (i >> 4));
+	*port = htons((uint16_t)(1024 + (i & 15)));
+}
+
+static void
+clear_states(void)
+{
+	struct pfioc_state_kill psk;
+
+	memset(&psk, 0, sizeof(psk));
+	(void)ioctl(pf_fd, DIOCCLRSTATES, &psk);
+}
+
+static void
+restore_limit(void)
+{
+	clear_states();
+	(void)ioctl(pf_fd, DIOCSETLIMIT, &saved_limit);
+	close(pf_fd);
+}
+
+static uint32_t
+state_table_setup(void)
+{
+	struct pfioc_limit pl;
+	const char *env = getenv("PF_STATE_TABLE_STATES");
+	uint32_t nstates = STATE_TABLE_STATES;
+
+	if (env != NULL) {
+		nstates = (uint32_t)strtoul(env, NULL, 0);
+	}
+	T_QUIET; T_ASSERT_GT(nstates, 0, "PF_STATE_TABLE_STATES");
+	T_QUIET; T_ASSERT_LE(nstates, 1u << 28, "PF_STATE_TABLE_STATES");
+
+	pf_fd = open("/dev/pf", O_RDWR);
+	if (pf_fd < 0) {
+		T_SKIP("/dev/pf not available (errno %d)", errno);
+	}
+
+	memset(&saved_limit, 0, sizeof(saved_limit));
+	saved_limit.index = PF_LIMIT_STATES;
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCGETLIMIT, &saved_limit),
+	    "DIOCGETLIMIT states");
+
+	pl.index = PF_LIMIT_STATES;
+	pl.limit = nstates + 1;
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCSETLIMIT, &pl),
+	    "raise the state limit to %u", nstates + 1);
+	T_ATEND(restore_limit);
+
+	clear_states();
+	return nstates;
+}
+
+static uint32_t
+state_table_fill(uint32_t nstates)
+{
+	struct pfioc_state ps;
+	struct pfsync_state *sp = &ps.state;
+	uint64_t start;
+	uint32_t i, lan;
+	uint16_t port;
+	double ns;
+
+	memset(&ps, 0, sizeof(ps));
+	strlcpy(sp->ifname, "lo0", sizeof(sp->ifname));
+	sp->af_lan = sp->af_gwy = AF_INET;
+	sp->proto = IPPROTO_TCP;
+	sp->direction = PF_OUT;
+	sp->timeout = PFTM_TCP_ESTABLISHED;
+	sp->src.state = sp->dst.state = TCPS_ESTABLISHED;
+	sp->ext_lan.addr.v4addr.s_addr = htonl(STATE_EXT_ADDR);
+	sp->ext_lan.xport.port = htons(STATE_EXT_PORT);
+	sp->ext_gwy = sp->ext_lan;
+
+	start = mach_absolute_time();
+	for (i = 0; i < nstates; i++) {
+		state_lan(i, &lan, &port);
+		sp->lan.addr.v4addr.s_addr = lan;
+		sp->lan.xport.port = port;
+		sp->gwy = sp->lan;
+		if (ioctl(pf_fd, DIOCADDSTATE, &ps) != 0) {
+			T_QUIET; T_ASSERT_EQ(errno, ENOMEM, "DIOCADDSTATE %u", i);
+			T_LOG("out of memory after %u states", i);
+			break;
+		}
+	}
+	ns = elapsed_ns(start);
+	T_ASSERT_GT(i, 0, "inserted %u states", i);
+
+	T_LOG("%u inserts: %.0f inserts/s", i, i / (ns / 1e9));
+	T_PERF("pf_state_inserts_per_sec", i / (ns / 1e9), "inserts/s",
+	    "DIOCADDSTATE rate while filling the state table");
+	return i;
+}
+
+static void
+state_table_lookups(uint32_t nstates, u_int8_t direction, const char *metric)
+{
+	struct pfioc_natlook pnl;
+	uint64_t start;
+	uint32_t n, i, lan, misses = 0;
+	uint16_t port;
+	double ns;
+
+	memset(&pnl, 0, sizeof(pnl));
+	pnl.af = AF_INET;
+	pnl.proto = IPPROTO_TCP;
+	pnl.direction = direction;
+
+	start = mach_absolute_time();
+	for (n = 0; n < STATE_TABLE_LOOKUPS; n++) {
+		i = test_rand32() % nstates;
+		state_lan(i, &lan, &port);
+		/* the connection as seen by the caller, see DIOCNATLOOK */
+		if (direction == PF_OUT) {
+			pnl.daddr.v4addr.s_addr = lan;
+			pnl.dxport.port = port;
+			pnl.saddr.v4addr.s_addr = htonl(STATE_EXT_ADDR);
+			pnl.sxport.port = htons(STATE_EXT_PORT);
+		} else {
+			pnl.saddr.v4addr.s_addr = lan;
+			pnl.sxport.port = port;
+			pnl.daddr.v4addr.s_addr = htonl(STATE_EXT_ADDR);
+			pnl.dxport.port = htons(STATE_EXT_PORT);
+		}
+		if (ioctl(pf_fd, DIOCNATLOOK, &pnl) != 0) {
+			misses++;
+		}
+	}
+	ns = elapsed_ns(start);
+
+	T_EXPECT_EQ(misses, 0, "%u lookups found their state", n);
+	T_LOG("%s: %.0f lookups/s, %.1f ns/lookup", metric,
+	    n / (ns / 1e9), ns / n);
+	T_PERF(metric, n / (ns / 1e9), "lookups/s",
+	    "DIOCNATLOOK rate on a full state table");
+}
+
+T_DECL(pf_state_table_perf,
+    "pf state table insert and lookup rates with a million states",
+    T_META_TAG_PERF)
+{
+	uint32_t nstates;
+
+	(void)test_rand_seed();
+	nstates = state_table_setup();
+	nstates = state_table_fill(nstates);
+
+	state_table_lookups(nstates, PF_OUT, "pf_state_lookups_lan_ext_per_sec");
+	state_table_lookups(nstates, PF_IN, "pf_state_lookups_ext_gwy_per_sec");
+}
@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Checks pf table matching (DIOCRTSTADDRS) against a brute force longest
+ * match while nested and negated prefixes are added and deleted, then
+ * measures the match rate of tables with 10k, 100k and 1M addresses.
+ */
+#include <darwintest.h>
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <net/pfvar.h>
+#include <mach/mach_time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_rand.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false),
+	T_META_CHECK_LEAKS(false));
+
+#define MATCH_TABLE_NAME        "xnu_table_match"
+#define MATCH_TEST_PREFIXES     3000
+#define MATCH_TEST_LOOKUPS      20000
+#define MATCH_PERF_MAX_ADDRS    1000000
+#define MATCH_PERF_LOOKUPS      (1 << 21)
+#define MATCH_PERF_BATCH        1024
+
+static int pf_fd = -1;
+static struct pfioc_limit saved_limit;
+
+static double
+elapsed_ns(uint64_t start)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0) {
+		mach_timebase_info(&tb);
+	}
+	return (double)(mach_absolute_time() - start) * tb.numer / tb.denom;
+}
+
+static uint32_t
+mask(uint8_t plen)
+{
+	return plen == 0 ? 0 : 0xffffffffu << (32 - plen);
+}
+
+static void
+table_ioc(struct pfioc_table *io, struct pfr_addr *addrs, int n)
+{
+	memset(io, 0, sizeof(*io));
+	strlcpy(io->pfrio_table.pfrt_name, MATCH_TABLE_NAME,
+	    sizeof(io->pfrio_table.pfrt_name));
+	io->pfrio_buffer = addrs;
+	io->pfrio_esize = sizeof(struct pfr_addr);
+	io->pfrio_size = n;
+}
+
+static void
+delete_table(void)
+{
+	struct pfioc_table io;
+	struct pfr_table tbl;
+
+	memset(&tbl, 0, sizeof(tbl));
+	strlcpy(tbl.pfrt_name, MATCH_TABLE_NAME, sizeof(tbl.pfrt_name));
+	memset(&io, 0, sizeof(io));
+	io.pfrio_buffer = &tbl;
+	io.pfrio_esize = sizeof(tbl);
+	io.pfrio_size = 1;
+	(void)ioctl(pf_fd, DIOCRDELTABLES, &io);
+}
+
+static void
+restore_limit(void)
+{
+	delete_table();
+	(void)ioctl(pf_fd, DIOCSETLIMIT, &saved_limit);
+	close(pf_fd);
+}
+
+static void
+match_setup(void)
+{
+	struct pfioc_limit pl;
+	struct pfioc_table io;
+	struct pfr_table tbl;
+
+	T_LOG("seed %llu", test_rand_seed());
+
+	pf_fd = open("/dev/pf", O_RDWR);
+	if (pf_fd < 0) {
+		T_SKIP("/dev/pf not available (errno %d)", errno);
+	}
+
+	memset(&saved_limit, 0, sizeof(saved_limit));
+	saved_limit.index = PF_LIMIT_TABLE_ENTRIES;
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCGETLIMIT, &saved_limit),
+	    "DIOCGETLIMIT table-entries");
+
+	/* DIOCRSETADDRS holds the old and the new addresses for a moment */
+	pl.index = PF_LIMIT_TABLE_ENTRIES;
+	pl.limit = 2 * MATCH_PERF_MAX_ADDRS + 1;
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCSETLIMIT, &pl),
+	    "raise the table entry limit to %u", pl.limit);
+	T_ATEND(restore_limit);
+
+	delete_table();
+	memset(&tbl, 0, sizeof(tbl));
+	strlcpy(tbl.pfrt_name, MATCH_TABLE_NAME, sizeof(tbl.pfrt_name));
+	tbl.pfrt_flags = PFR_TFLAG_PERSIST;
+	memset(&io, 0, sizeof(io));
+	io.pfrio_buffer = &tbl;
+	io.pfrio_esize = sizeof(tbl);
+	io.pfrio_size = 1;
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCRADDTABLES, &io),
+	    "DIOCRADDTABLES %s", MATCH_TABLE_NAME);
+}
+
+static void
+set_addr(struct pfr_addr *ad, uint32_t addr, uint8_t plen, uint8_t not)
+{
+	memset(ad, 0, sizeof(*ad));
+	ad->pfra_af = AF_INET;
+	ad->pfra_ip4addr.s_addr = htonl(addr & mask(plen));
+	ad->pfra_net = plen;
+	ad->pfra_not = not;
+}
+
+static uint8_t
+brute_force_fback(struct pfr_addr *prefixes, uint32_t n, uint32_t addr)
+{
+	struct pfr_addr *best = NULL;
+
+	for (uint32_t i = 0; i < n; i++) {
+		struct pfr_addr *p = &prefixes[i];
+
+		if ((addr & mask(p->pfra_net)) == ntohl(p->pfra_ip4addr.s_addr) &&
+		    (best == NULL || p->pfra_net > best->pfra_net)) {
+			best = p;
+		}
+	}
+	if (best == NULL) {
+		return PFR_FB_NONE;
+	}
+	return best->pfra_not ? PFR_FB_NOTMATCH : PFR_FB_MATCH;
+}
+
+static void
+check_matches(struct pfr_addr *prefixes, uint32_t n, uint32_t base)
+{
+	struct pfr_addr *probes;
+	struct pfioc_table io;
+	uint32_t i, addr;
+
+	probes = calloc(MATCH_TEST_LOOKUPS, sizeof(*probes));
+	T_QUIET; T_ASSERT_NOTNULL(probes, "calloc");
+	for (i = 0; i < MATCH_TEST_LOOKUPS; i++) {
+		if (i % 2 == 0) {
+			struct pfr_addr *p = &prefixes[test_rand32() % n];
+
+			addr = ntohl(p->pfra_ip4addr.s_addr) |
+			    (test_rand32() & ~mask(p->pfra_net));
+		} else {
+			addr = base ^ (test_rand32() & 0x00ffffff);
+		}
+		set_addr(&probes[i], addr, 32, 0);
+	}
+
+	table_ioc(&io, probes, MATCH_TEST_LOOKUPS);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCRTSTADDRS, &io),
+	    "DIOCRTSTADDRS");
+	for (i = 0; i < MATCH_TEST_LOOKUPS; i++) {
+		addr = ntohl(probes[i].pfra_ip4addr.s_addr);
+		T_QUIET; T_ASSERT_EQ(probes[i].pfra_fback,
+		    brute_force_fback(prefixes, n, addr),
+		    "match of 0x%08x with %u prefixes", addr, n);
+	}
+	free(probes);
+}
+
+T_DECL(pf_table_match,
+    "table matches agree with a brute force longest match")
+{
+	struct pfr_addr *prefixes;
+	struct pfioc_table io;
+	uint32_t base, n = 0, ndel;
+
+	match_setup();
+
+	prefixes = calloc(MATCH_TEST_PREFIXES, sizeof(*prefixes));
+	T_QUIET; T_ASSERT_NOTNULL(prefixes, "calloc");
+
+	/* mostly inside one /8 so that prefixes nest, a quarter negated */
+	base = test_rand32();
+	while (n < MATCH_TEST_PREFIXES) {
+		uint8_t plen = (uint8_t)(8 + test_rand32() % 25);
+		uint32_t addr = (base ^ (test_rand32() & 0x00ffffff)) & mask(plen);
+		bool dup = false;
+
+		for (uint32_t i = 0; i < n && !dup; i++) {
+			dup = prefixes[i].pfra_net == plen &&
+			    ntohl(prefixes[i].pfra_ip4addr.s_addr) == addr;
+		}
+		if (!dup) {
+			set_addr(&prefixes[n++], addr, plen, test_rand32() % 4 == 0);
+		}
+	}
+
+	table_ioc(&io, prefixes, n);
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCRADDADDRS, &io),
+	    "DIOCRADDADDRS %u prefixes", n);
+	T_QUIET; T_ASSERT_EQ(io.pfrio_nadd, (int)n, "all prefixes added");
+	check_matches(prefixes, n, base);
+
+	/* deleting rebuilds the snapshot; take out the first third */
+	ndel = n / 3;
+	table_ioc(&io, prefixes, ndel);
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCRDELADDRS, &io),
+	    "DIOCRDELADDRS %u prefixes", ndel);
+	T_QUIET; T_ASSERT_EQ(io.pfrio_ndel, (int)ndel, "all prefixes deleted");
+	check_matches(prefixes + ndel, n - ndel, base);
+
+	/* and back to a handful, below the snapshot threshold */
+	table_ioc(&io, prefixes, 8);
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCRSETADDRS, &io),
+	    "DIOCRSETADDRS 8 prefixes");
+	check_matches(prefixes, 8, base);
+
+	free(prefixes);
+}
+
+static void
+match_perf(struct pfr_addr *addrs, uint32_t n)
+{
+	struct pfr_addr *probes;
+	struct pfioc_table io;
+	uint64_t start;
+	uint32_t i, j, misses = 0;
+	char metric[64];
+	double ns;
+
+	table_ioc(&io, addrs, n);
+	start = mach_absolute_time();
+	T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCRSETADDRS, &io),
+	    "DIOCRSETADDRS %u addresses", n);
+	ns = elapsed_ns(start);
+	T_LOG("%u addresses loaded in %.1f ms", n, ns / 1e6);
+
+	probes = calloc(MATCH_PERF_BATCH, sizeof(*probes));
+	T_QUIET; T_ASSERT_NOTNULL(probes, "calloc");
+	table_ioc(&io, probes, MATCH_PERF_BATCH);
+
+	/* three in four hit an entry, the rest are random */
+	ns = 0;
+	for (i = 0; i < MATCH_PERF_LOOKUPS; i += MATCH_PERF_BATCH) {
+		for (j = 0; j < MATCH_PERF_BATCH; j++) {
+			struct pfr_addr *p = &addrs[test_rand32() % n];
+			uint32_t addr = test_rand32();
+
+			if (j % 4 != 0) {
+				addr = ntohl(p->pfra_ip4addr.s_addr) |
+				    (addr & ~mask(p->pfra_net));
+			}
+			set_addr(&probes[j], addr, 32, 0);
+		}
+		start = mach_absolute_time();
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(pf_fd, DIOCRTSTADDRS, &io),
+		    "DIOCRTSTADDRS");
+		ns += elapsed_ns(start);
+		for (j = 0; j < MATCH_PERF_BATCH; j++) {
+			if (j % 4 != 0 && probes[j].pfra_fback != PFR_FB_MATCH) {
+				misses++;
+			}
+		}
+	}
+	free(probes);
+
+	T_EXPECT_EQ(misses, 0, "every address inside an entry matched");
+	T_LOG("%u addresses: %.0f matches/s, %.1f ns/match", n,
+	    i / (ns / 1e9), ns / i);
+	snprintf(metric, sizeof(metric), "pf_table_matches_per_sec_%u", n);
+	T_PERF(metric, i / (ns / 1e9), "matches/s",
+	    "DIOCRTSTADDRS rate, in batches of 1024 addresses");
+}
+
+T_DECL(pf_table_match_perf,
+    "table match rates with 10k, 100k and 1M addresses",
+    T_META_TAG_PERF)
+{
+	static const uint32_t sizes[] = { 10000, 100000, MATCH_PERF_MAX_ADDRS };
+	struct pfr_addr *addrs;
+
+	match_setup();
+
+	/* a block list: mostly hosts, one in sixteen a /24 */
+	addrs = calloc(MATCH_PERF_MAX_ADDRS, sizeof(*addrs));
+	T_QUIET; T_ASSERT_NOTNULL(addrs, "calloc");
+	for (uint32_t i = 0; i < MATCH_PERF_MAX_ADDRS; i++) {
+		set_addr(&addrs[i], (1 + test_rand32() % 223) << 24 |
+		    (test_rand32() & 0x00ffffff), i % 16 == 0 ? 24 : 32, 0);
+	}
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		match_perf(addrs, sizes[i]);
+	}
+	free(addrs);
+}
@@ -0,0 +1,294 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Builds the IPv4 FIB from bsd/net/rt_fib.c in user space.  Random
+ * tables with prefixes coming and going, some of them switching to a
+ * wider root midway, must give the same longest match as a brute force
+ * search, and a table shaped like a full
+ * Internet routing table (900k prefixes, mostly /24) is timed for
+ * inserts, lookups and removals.
+ */
+#include <darwintest.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <mach/mach_time.h>
+
+#include "test_rand.h"
+#include "../bsd/net/rt_fib.c"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_RUN_CONCURRENTLY(true),
+	T_META_CHECK_LEAKS(false));
+
+#define FIB_TEST_TABLES         200
+#define FIB_TEST_PREFIXES       2000
+#define FIB_TEST_LOOKUPS        20000
+
+#define FIB_PERF_PREFIXES       900000
+#define FIB_PERF_LOOKUPS        (1 << 24)
+
+struct test_prefix {
+	uint32_t        addr;
+	uint8_t         plen;
+	bool            live;
+};
+
+static double
+elapsed_ns(uint64_t start)
+{
+	static mach_timebase_info_data_t tb;
+
+	if (tb.denom == 0) {
+		mach_timebase_info(&tb);
+	}
+	return (double)(mach_absolute_time() - start) * tb.numer / tb.denom;
+}
+
+static struct test_prefix *
+brute_force_lookup(struct test_prefix *prefixes, uint32_t n, uint32_t addr)
+{
+	struct test_prefix *best = NULL;
+
+	for (uint32_t i = 0; i < n; i++) {
+		struct test_prefix *p = &prefixes[i];
+
+		if (p->live && (addr & rt_fib_mask(p->plen)) == p->addr &&
+		    (best == NULL || p->plen > best->plen)) {
+			best = p;
+		}
+	}
+	return best;
+}
+
+static bool
+is_live(struct test_prefix *prefixes, uint32_t n, uint32_t addr, uint8_t plen)
+{
+	for (uint32_t i = 0; i < n; i++) {
+		if (prefixes[i].live && prefixes[i].addr == addr &&
+		    prefixes[i].plen == plen) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* mostly addresses near base, so that prefixes nest */
+static uint32_t
+random_addr(uint32_t base)
+{
+	return test_rand32() % 4 != 0 ? base ^ (test_rand32() & 0x00ffffff) : test_rand32();
+}
+
+T_DECL(route_fib_lpm,
+    "random tables give the same longest match as a brute force search")
+{
+	struct test_prefix *prefixes;
+
+	T_LOG("seed %llu", test_rand_seed());
+
+	prefixes = calloc(FIB_TEST_PREFIXES, sizeof(*prefixes));
+	T_QUIET; T_ASSERT_NOTNULL(prefixes, "calloc");
+
+	for (int t = 0; t < FIB_TEST_TABLES; t++) {
+		struct rt_fib *fib = rt_fib_create(t % 2 == 0 ? 16 : 8);
+		uint32_t base = test_rand32(), n = 0, addr;
+		struct test_prefix *p;
+
+		T_QUIET; T_ASSERT_NOTNULL(fib, "rt_fib_create");
+		for (uint32_t i = 0; i < FIB_TEST_PREFIXES; i++) {
+			uint8_t plen = (uint8_t)(test_rand32() % 33);
+			bool dup;
+			int error;
+
+			/* the narrow tables grow their root halfway */
+			if (t % 2 != 0 && i == FIB_TEST_PREFIXES / 2) {
+				T_QUIET; T_ASSERT_EQ(rt_fib_grow(fib, 9), EINVAL,
+				    "growing by part of a stride");
+				T_QUIET; T_ASSERT_POSIX_ZERO(rt_fib_grow(fib,
+				    t % 4 == 1 ? 14 : 20), "rt_fib_grow");
+			}
+
+			addr = random_addr(base) & rt_fib_mask(plen);
+			dup = is_live(prefixes, n, addr, plen);
+			error = rt_fib_insert(fib, addr, plen, &prefixes[n]);
+			if (dup) {
+				T_QUIET; T_ASSERT_EQ(error, EEXIST, "duplicate insert");
+				continue;
+			}
+			T_QUIET; T_ASSERT_EQ(error, 0, "rt_fib_insert");
+			prefixes[n].addr = addr;
+			prefixes[n].plen = plen;
+			prefixes[n].live = true;
+			n++;
+
+			/* take out a third of them again, in random order */
+			if (test_rand32() % 3 == 0) {
+				p = &prefixes[test_rand32() % n];
+				if (p->live) {
+					T_QUIET; T_ASSERT_EQ_PTR(rt_fib_remove(fib, p->addr, p->plen),
+					    (void *)p, "rt_fib_remove");
+					p->live = false;
+				}
+			}
+		}
+
+		for (uint32_t i = 0; i < FIB_TEST_LOOKUPS; i++) {
+			if (i % 4 == 0) {
+				p = &prefixes[test_rand32() % n];
+				addr = p->addr | (test_rand32() & ~rt_fib_mask(p->plen));
+			} else {
+				addr = random_addr(base);
+			}
+			T_QUIET; T_ASSERT_EQ_PTR(rt_fib_lookup(fib, addr),
+			    (void *)brute_force_lookup(prefixes, n, addr),
+			    "table %d: lookup of 0x%08x", t, addr);
+		}
+
+		/* emptying the table must fold every node away */
+		for (uint32_t i = 0; i < n; i++) {
+			p = &prefixes[i];
+			if (p->live) {
+				T_QUIET; T_ASSERT_EQ_PTR(rt_fib_remove(fib, p->addr, p->plen),
+				    (void *)p, "rt_fib_remove");
+				p->live = false;
+			}
+		}
+		T_QUIET; T_ASSERT_EQ(rt_fib_count(fib), 0, "no prefixes left");
+		T_QUIET; T_ASSERT_EQ(fib->fib_nodes, 0, "no nodes left");
+		rt_fib_destroy(fib);
+	}
+	free(prefixes);
+	T_PASS("%d random tables", FIB_TEST_TABLES);
+}
+
+/*
+ * Roughly the prefix length distribution of a full IPv4 BGP table:
+ * about 60% /24, 30% /19 to /23, the rest /8 to /18, and a few /32s.
+ */
+static uint8_t
+internet_plen(void)
+{
+	uint32_t r = test_rand32() % 1000;
+
+	if (r < 600) {
+		return 24;
+	} else if (r < 900) {
+		return (uint8_t)(19 + test_rand32() % 5);
+	} else if (r < 995) {
+		return (uint8_t)(8 + test_rand32() % 11);
+	}
+	return 32;
+}
+
+static void
+fib_perf(struct test_prefix *prefixes, unsigned int root_bits)
+{
+	struct rt_fib *fib;
+	uint32_t i, n = 0, misses = 0;
+	uint64_t start;
+	char metric[64];
+	double ns;
+
+	fib = rt_fib_create(root_bits);
+	T_QUIET; T_ASSERT_NOTNULL(fib, "rt_fib_create");
+	start = mach_absolute_time();
+	for (i = 0; i < FIB_PERF_PREFIXES; i++) {
+		prefixes[i].live = rt_fib_insert(fib, prefixes[i].addr,
+		    prefixes[i].plen, &prefixes[i]) == 0;
+		if (prefixes[i].live) {
+			n++;
+		}
+	}
+	ns = elapsed_ns(start);
+	T_LOG("%u-bit root, %u prefixes: %.0f inserts/s, %.1f MB", root_bits, n,
+	    n / (ns / 1e9), rt_fib_size(fib) / 1048576.0);
+	snprintf(metric, sizeof(metric), "route_fib_inserts_per_sec_root%u", root_bits);
+	T_PERF(metric, n / (ns / 1e9), "inserts/s", "building a 900k prefix table");
+	snprintf(metric, sizeof(metric), "route_fib_table_mb_root%u", root_bits);
+	T_PERF(metric, rt_fib_size(fib) / 1048576.0, "MB",
+	    "memory held by a 900k prefix table");
+
+	/* destinations inside the table's prefixes, as forwarded traffic */
+	start = mach_absolute_time();
+	for (i = 0; i < FIB_PERF_LOOKUPS; i++) {
+		struct test_prefix *p = &prefixes[test_rand32() % FIB_PERF_PREFIXES];
+
+		if (rt_fib_lookup(fib, p->addr | (test_rand32() & ~rt_fib_mask(p->plen))) == NULL) {
+			misses++;
+		}
+	}
+	ns = elapsed_ns(start);
+	T_EXPECT_EQ(misses, 0, "every destination matched");
+	T_LOG("%u-bit root: %.0f lookups/s, %.1f ns/lookup", root_bits,
+	    i / (ns / 1e9), ns / i);
+	snprintf(metric, sizeof(metric), "route_fib_lookups_per_sec_root%u", root_bits);
+	T_PERF(metric, i / (ns / 1e9), "lookups/s",
+	    "random destinations covered by a 900k prefix table");
+
+	start = mach_absolute_time();
+	for (i = 0; i < FIB_PERF_PREFIXES; i++) {
+		if (prefixes[i].live) {
+			T_QUIET; T_ASSERT_EQ_PTR(rt_fib_remove(fib, prefixes[i].addr,
+			    prefixes[i].plen), (void *)&prefixes[i], "rt_fib_remove");
+		}
+	}
+	ns = elapsed_ns(start);
+	T_LOG("%u-bit root: %.0f removes/s", root_bits, n / (ns / 1e9));
+	snprintf(metric, sizeof(metric), "route_fib_removes_per_sec_root%u", root_bits);
+	T_PERF(metric, n / (ns / 1e9), "removes/s", "emptying a 900k prefix table");
+	T_EXPECT_EQ(fib->fib_nodes, 0, "no nodes left");
+
+	rt_fib_destroy(fib);
+}
+
+T_DECL(route_fib_perf,
+    "insert, lookup and remove rates with a 900k prefix table",
+    T_META_TAG_PERF)
+{
+	struct test_prefix *prefixes;
+
+	T_LOG("seed %llu", test_rand_seed());
+
+	prefixes = calloc(FIB_PERF_PREFIXES, sizeof(*prefixes));
+	T_QUIET; T_ASSERT_NOTNULL(prefixes, "calloc");
+	for (uint32_t i = 0; i < FIB_PERF_PREFIXES; i++) {
+		prefixes[i].plen = internet_plen();
+		/* unicast space, 1.0.0.0 to 223.255.255.255 */
+		prefixes[i].addr = ((1 + test_rand32() % 223) << 24 | (test_rand32() & 0x00ffffff)) &
+		    rt_fib_mask(prefixes[i].plen);
+	}
+
+	/* the kernel's table (18-bit root), and one with a 4 times smaller root */
+	fib_perf(prefixes, 18);
+	fib_perf(prefixes, 16);
+	free(prefixes);
+}
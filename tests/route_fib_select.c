@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+/*
+ * Checks which routes the lock-free IPv4 route lookup, rtalloc1_fib(),
+ * hands out and which lookups it leaves to rnh_lock, through
+ * net.route.fib_probe (DEVELOPMENT kernels).  Whenever it gives a route,
+ * it must be the one the lookup under rnh_lock gives.  A pair of feth
+ * interfaces gets a subnet each; a connected UDP socket clones, and
+ * holds on to, a host route in the first subnet.
+ */
+#include <darwintest.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+
+#include <net/if.h>
+#include <net/route.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net_test_lib.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_ASROOT(true),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_RUN_CONCURRENTLY(false),
+	T_META_CHECK_LEAKS(false));
+
+/* Must match bsd/net/route.c */
+struct rt_fib_probe {
+	struct sockaddr_in      rfp_dst;
+	uint32_t                rfp_ifscope;
+	uint32_t                rfp_report;
+	uint32_t                rfp_hit;
+	uint32_t                rfp_same;
+	uint32_t                rfp_ifindex;
+	uint32_t                rfp_flags;
+};
+
+#define SELECT_NET1             "10.211.1."
+#define SELECT_NET2             "10.211.2."
+
+static int udp_fd = -1;
+static char ifname1[IF_NAMESIZE];
+static char ifname2[IF_NAMESIZE];
+static int saved_fib = -1;
+
+static void
+cleanup(void)
+{
+	if (udp_fd != -1) {
+		if (ifname1[0] != '\0') {
+			(void) ifnet_destroy(udp_fd, ifname1, false);
+		}
+		if (ifname2[0] != '\0') {
+			(void) ifnet_destroy(udp_fd, ifname2, false);
+		}
+		(void) close(udp_fd);
+	}
+	if (saved_fib != -1) {
+		(void) sysctlbyname("net.route.fib", NULL, NULL,
+		    &saved_fib, sizeof(saved_fib));
+	}
+}
+
+static struct in_addr
+inet_addr4(const char *str)
+{
+	struct in_addr addr;
+
+	T_QUIET; T_ASSERT_EQ(inet_pton(AF_INET, str, &addr), 1, "%s", str);
+	return addr;
+}
+
+static void
+add_subnet(const char *ifname, const char *addr)
+{
+	struct in_aliasreq ifra = {};
+
+	strlcpy(ifra.ifra_name, ifname, sizeof(ifra.ifra_name));
+	ifra.ifra_addr.sin_len = sizeof(ifra.ifra_addr);
+	ifra.ifra_addr.sin_family = AF_INET;
+	ifra.ifra_addr.sin_addr = inet_addr4(addr);
+	ifra.ifra_mask.sin_len = sizeof(ifra.ifra_mask);
+	ifra.ifra_mask.sin_family = AF_INET;
+	ifra.ifra_mask.sin_addr = inet_addr4("255.255.255.0");
+	T_ASSERT_POSIX_SUCCESS(ioctl(udp_fd, SIOCAIFADDR, &ifra),
+	    "%s/24 on %s", addr, ifname);
+}
+
+/* A UDP socket connected to addr, holding a reference on its route */
+static int
+connect_to(const char *addr)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_port = htons(9),
+		.sin_addr = inet_addr4(addr),
+	};
+	int s;
+
+	s = inet_dgram_socket();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(s, (struct sockaddr *)&sin,
+	    sizeof(sin)), "connect to %s", addr);
+	return s;
+}
+
+/* Whether the lock-free lookup gave a route, which must be rnh_lock's */
+static bool
+probe(const char *addr, unsigned int ifscope, bool report,
+    struct rt_fib_probe *out)
+{
+	struct rt_fib_probe probe = {
+		.rfp_dst = {
+			.sin_len = sizeof(struct sockaddr_in),
+			.sin_family = AF_INET,
+			.sin_addr = inet_addr4(addr),
+		},
+		.rfp_ifscope = ifscope,
+		.rfp_report = report,
+	};
+	size_t len = sizeof(probe);
+
+	if (sysctlbyname("net.route.fib_probe", &probe, &len,
+	    &probe, sizeof(probe)) != 0) {
+		T_QUIET; T_ASSERT_EQ(errno, ENOENT, "net.route.fib_probe");
+		T_SKIP("net.route.fib_probe not supported (release kernel?)");
+	}
+	T_QUIET; T_ASSERT_EQ(len, sizeof(probe), "result size");
+	if (probe.rfp_hit) {
+		T_QUIET; T_EXPECT_TRUE(probe.rfp_same,
+		    "%s scope %u: the route rnh_lock's lookup gives", addr, ifscope);
+	}
+	if (out != NULL) {
+		*out = probe;
+	}
+	return probe.rfp_hit != 0;
+}
+
+T_DECL(route_fib_select,
+    "the lock-free IPv4 route lookup picks rnh_lock's route, or defers to it")
+{
+	struct rt_fib_probe res;
+	unsigned int if1, if2, lo;
+	int fib = 1, s;
+	size_t len = sizeof(saved_fib);
+
+	T_ATEND(cleanup);
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.route.fib", &saved_fib, &len,
+	    &fib, sizeof(fib)), "net.route.fib = 1");
+
+	udp_fd = inet_dgram_socket();
+	strlcpy(ifname1, FETH_NAME, sizeof(ifname1));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(udp_fd, ifname1, sizeof(ifname1)), "create %s", ifname1);
+	strlcpy(ifname2, FETH_NAME, sizeof(ifname2));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(udp_fd, ifname2, sizeof(ifname2)), "create %s", ifname2);
+	T_ASSERT_POSIX_ZERO(fake_set_peer(udp_fd, ifname1, ifname2), "peer");
+	T_ASSERT_POSIX_ZERO(ifnet_set_flags(udp_fd, ifname1, IFF_UP, 0), "up");
+	T_ASSERT_POSIX_ZERO(ifnet_set_flags(udp_fd, ifname2, IFF_UP, 0), "up");
+	add_subnet(ifname1, SELECT_NET1 "1");
+	add_subnet(ifname2, SELECT_NET2 "1");
+	if1 = if_nametoindex(ifname1);
+	if2 = if_nametoindex(ifname2);
+	lo = if_nametoindex("lo0");
+
+	/* the subnet route would be cloned */
+	T_EXPECT_FALSE(probe(SELECT_NET1 "6", 0, true, NULL),
+	    "a route to be cloned is left to rnh_lock");
+
+	/* a cloned host route with a reference */
+	s = connect_to(SELECT_NET1 "5");
+	T_ASSERT_TRUE(probe(SELECT_NET1 "5", 0, true, &res),
+	    "the referenced host route is found without rnh_lock");
+	T_EXPECT_EQ(res.rfp_ifindex, if1, "on %s", ifname1);
+	T_EXPECT_EQ(res.rfp_flags & (RTF_HOST | RTF_WASCLONED),
+	    (uint32_t)(RTF_HOST | RTF_WASCLONED), "cloned host route");
+
+	/* the same scoped to its interface, or to another one */
+	T_EXPECT_TRUE(probe(SELECT_NET1 "5", if1, true, &res),
+	    "scoped to %s, the host route is found", ifname1);
+	T_EXPECT_EQ(res.rfp_ifindex, if1, "on %s", ifname1);
+	T_EXPECT_FALSE(probe(SELECT_NET1 "5", if2, true, NULL),
+	    "scoped to %s, with no route there, the fallback is left to rnh_lock",
+	    ifname2);
+	T_EXPECT_FALSE(probe(SELECT_NET1 "5", lo, true, NULL),
+	    "scoped to lo0, the loopback exception is left to rnh_lock");
+
+	/* the loopback route itself isn't subject to scoping */
+	if (probe("127.0.0.1", lo, true, &res)) {
+		T_EXPECT_EQ(res.rfp_ifindex, lo, "loopback route on lo0");
+	}
+
+	/* once nobody holds the host route, it takes rnh_lock to revive */
+	T_ASSERT_POSIX_ZERO(close(s), "close");
+	T_EXPECT_FALSE(probe(SELECT_NET1 "5", 0, true, NULL),
+	    "an unreferenced route is left to rnh_lock");
+
+	s = connect_to(SELECT_NET1 "5");
+	T_EXPECT_TRUE(probe(SELECT_NET1 "5", 0, true, NULL),
+	    "referenced again, the host route is found without rnh_lock");
+	(void) close(s);
+}
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Replays loss and reordering patterns through the TCP reassembly queue
+ * with net.inet.tcp.reass.replay (DEVELOPMENT kernels), which checks
+ * that the stream comes out intact and reports the time spent in the
+ * queue.  Setting TCP_REASS_REPLAY_TRACE to a file of "offset length
+ * [flags]" lines (relative sequence number, payload length, TH_* bits in
+ * hex), e.g. extracted from a packet capture, has tcp_reass_replay_trace
+ * replay that recording as well.
+ */
+#include <darwintest.h>
+
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "test_rand.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_ASROOT(true),
+	T_META_RUN_CONCURRENTLY(false),
+	T_META_CHECK_LEAKS(false));
+
+/* Must match bsd/netinet/tcp_input.c */
+struct tcp_reass_replay_seg {
+	uint32_t        trs_off;
+	uint16_t        trs_len;
+	uint16_t        trs_flags;
+};
+
+struct tcp_reass_replay_result {
+	uint64_t        trr_ns;
+	uint64_t        trr_delivered;
+	uint64_t        trr_dupbytes;
+	uint32_t        trr_corrupt;
+	uint32_t        trr_fin;
+	uint32_t        trr_max_pkts;
+	uint32_t        trr_ranges;
+};
+
+#define REPLAY_MAX_SEGS         (1 << 20)
+#define REPLAY_MSS              1448
+
+static void
+replay(struct tcp_reass_replay_seg *segs, size_t nsegs,
+    struct tcp_reass_replay_result *res)
+{
+	size_t len = sizeof(*res);
+
+	if (sysctlbyname("net.inet.tcp.reass.replay", res, &len,
+	    segs, nsegs * sizeof(*segs)) != 0) {
+		T_QUIET; T_ASSERT_EQ(errno, ENOENT, "net.inet.tcp.reass.replay");
+		T_SKIP("net.inet.tcp.reass.replay not supported (release kernel?)");
+	}
+	T_QUIET; T_ASSERT_EQ(len, sizeof(*res), "result size");
+}
+
+static void
+check_stream(const char *what, struct tcp_reass_replay_result *res,
+    uint64_t total)
+{
+	T_QUIET; T_EXPECT_EQ(res->trr_corrupt, 0, "%s: delivered data intact", what);
+	T_QUIET; T_EXPECT_EQ(res->trr_delivered, total, "%s: whole stream delivered", what);
+	T_QUIET; T_EXPECT_EQ(res->trr_fin, 1, "%s: FIN delivered", what);
+	T_QUIET; T_EXPECT_EQ(res->trr_ranges, 0, "%s: queue drained", what);
+}
+
+static void
+add_seg(struct tcp_reass_replay_seg *segs, size_t *n, uint32_t off,
+    uint32_t len, uint16_t flags)
+{
+	T_QUIET; T_ASSERT_LT(*n, (size_t)REPLAY_MAX_SEGS, "segment list size");
+	segs[*n].trs_off = off;
+	segs[*n].trs_len = (uint16_t)len;
+	segs[*n].trs_flags = flags;
+	(*n)++;
+}
+
+/*
+ * A stream of npkts segments of mss bytes: reordered within a window,
+ * with a fraction lost and some spurious overlapping retransmissions,
+ * followed by an in-order retransmission of everything.
+ */
+static size_t
+lossy_stream(struct tcp_reass_replay_seg *segs, uint32_t npkts, uint32_t mss,
+    uint32_t reorder, uint32_t loss_pct)
+{
+	struct tcp_reass_replay_seg *sent;
+	uint32_t total = npkts * mss;
+	size_t n = 0;
+
+	sent = calloc(npkts, sizeof(*sent));
+	T_QUIET; T_ASSERT_NOTNULL(sent, "calloc");
+	for (uint32_t i = 0; i < npkts; i++) {
+		add_seg(sent, &n, i * mss, mss, i == npkts - 1 ? (TH_FIN | TH_PUSH) : 0);
+	}
+	for (uint32_t i = 0; i < npkts; i++) {
+		uint32_t j = i + test_rand32() % reorder;
+		struct tcp_reass_replay_seg tmp;
+
+		if (j >= npkts) {
+			j = npkts - 1;
+		}
+		tmp = sent[i];
+		sent[i] = sent[j];
+		sent[j] = tmp;
+	}
+
+	/* drop the losses, sprinkling in overlapping segments */
+	n = 0;
+	for (uint32_t i = 0; i < npkts; i++) {
+		if (test_rand32() % 100 < loss_pct) {
+			continue;
+		}
+		segs[n++] = sent[i];
+		if (test_rand32() % 8 == 0) {
+			uint32_t off = test_rand32() % total;
+			uint32_t len = 1 + test_rand32() % MIN(2 * mss, 2048);
+
+			/* never up to the FIN, which only the last segment carries */
+			if (off + len >= total) {
+				len = total - off - 1;
+			}
+			if (len > 0) {
+				add_seg(segs, &n, off, len, 0);
+			}
+		}
+	}
+	free(sent);
+
+	for (uint32_t i = 0; i < npkts; i++) {
+		add_seg(segs, &n, i * mss, mss, i == npkts - 1 ? (TH_FIN | TH_PUSH) : 0);
+	}
+	return n;
+}
+
+T_DECL(tcp_reass_replay_random,
+    "random loss and reordering patterns come out of the reassembly queue intact")
+{
+	struct tcp_reass_replay_seg *segs;
+	struct tcp_reass_replay_result res;
+
+	T_LOG("seed %llu", test_rand_seed());
+
+	segs = calloc(REPLAY_MAX_SEGS, sizeof(*segs));
+	T_QUIET; T_ASSERT_NOTNULL(segs, "calloc");
+
+	for (int run = 0; run < 500; run++) {
+		uint32_t npkts = 16 + test_rand32() % 4000;
+		uint32_t mss = run % 4 == 0 ? 1 + test_rand32() % REPLAY_MSS : REPLAY_MSS;
+		uint32_t reorder = 1 + test_rand32() % 256;
+		uint32_t loss = test_rand32() % 50;
+		size_t n = lossy_stream(segs, npkts, mss, reorder, loss);
+		char what[64];
+
+		replay(segs, n, &res);
+		snprintf(what, sizeof(what), "run %d (%u x %u, reorder %u, loss %u%%)",
+		    run, npkts, mss, reorder, loss);
+		check_stream(what, &res, (uint64_t)npkts * mss);
+	}
+	free(segs);
+	T_PASS("tcp_reass_replay_random");
+}
+
+T_DECL(tcp_reass_replay_perf,
+    "CPU time per segment in the reassembly queue with many holes",
+    T_META_TAG_PERF)
+{
+	/* the largest keeps 32MB of clusters queued */
+	static const uint32_t holes[] = { 16, 256, 4096, 16384 };
+	struct tcp_reass_replay_seg *segs;
+	struct tcp_reass_replay_result res;
+	char metric[64];
+
+	segs = calloc(REPLAY_MAX_SEGS, sizeof(*segs));
+	T_QUIET; T_ASSERT_NOTNULL(segs, "calloc");
+
+	for (size_t h = 0; h < sizeof(holes) / sizeof(holes[0]); h++) {
+		uint32_t npkts = 2 * holes[h];
+		size_t n = 0;
+
+		/*
+		 * Every other segment is lost, then the losses are
+		 * retransmitted last to first, so each one lands in the
+		 * middle of the queue and merges two ranges.
+		 */
+		for (uint32_t i = 1; i < npkts; i += 2) {
+			add_seg(segs, &n, i * REPLAY_MSS, REPLAY_MSS,
+			    i == npkts - 1 ? (TH_FIN | TH_PUSH) : 0);
+		}
+		for (uint32_t i = npkts - 2;; i -= 2) {
+			add_seg(segs, &n, i * REPLAY_MSS, REPLAY_MSS, 0);
+			if (i == 0) {
+				break;
+			}
+		}
+
+		replay(segs, n, &res);
+		check_stream("holes", &res, (uint64_t)npkts * REPLAY_MSS);
+		T_LOG("%u holes: %zu segments, %.1f ns/segment, up to %u packets queued",
+		    holes[h], n, (double)res.trr_ns / n, res.trr_max_pkts);
+		snprintf(metric, sizeof(metric), "tcp_reass_ns_per_seg_%u_holes", holes[h]);
+		T_PERF(metric, (double)res.trr_ns / n, "ns", "reassembly CPU time per segment");
+	}
+	free(segs);
+}
+
+T_DECL(tcp_reass_replay_trace,
+    "replay a recorded segment trace given by TCP_REASS_REPLAY_TRACE")
+{
+	const char *path = getenv("TCP_REASS_REPLAY_TRACE");
+	struct tcp_reass_replay_seg *segs;
+	struct tcp_reass_replay_result res;
+	unsigned int off, len, flags;
+	char line[128];
+	size_t n = 0;
+	FILE *f;
+
+	if (path == NULL) {
+		T_SKIP("TCP_REASS_REPLAY_TRACE not set");
+	}
+	f = fopen(path, "r");
+	T_ASSERT_NOTNULL(f, "open %s", path);
+
+	segs = calloc(REPLAY_MAX_SEGS, sizeof(*segs));
+	T_QUIET; T_ASSERT_NOTNULL(segs, "calloc");
+	while (fgets(line, sizeof(line), f) != NULL) {
+		flags = 0;
+		if (line[0] == '#' || sscanf(line, "%u %u %x", &off, &len, &flags) < 2) {
+			continue;
+		}
+		add_seg(segs, &n, off, len, (uint16_t)(flags & (TH_FIN | TH_PUSH)));
+	}
+	fclose(f);
+	T_ASSERT_GT(n, (size_t)0, "%zu segments in trace", n);
+
+	replay(segs, n, &res);
+	T_LOG("%zu segments: %llu bytes delivered, %llu duplicate, "
+	    "%.1f ns/segment, up to %u packets queued, %u ranges left",
+	    n, res.trr_delivered, res.trr_dupbytes, (double)res.trr_ns / n,
+	    res.trr_max_pkts, res.trr_ranges);
+	T_EXPECT_EQ(res.trr_corrupt, 0, "delivered data intact");
+	T_PERF("tcp_reass_ns_per_seg_trace", (double)res.trr_ns / n, "ns",
+	    "reassembly CPU time per segment");
+	free(segs);
+}
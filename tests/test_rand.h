@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Seeded pseudo-random numbers for randomized tests.  Tests log the
+ * seed test_rand_seed() returns, and a failure reproduces by running
+ * the test again with TEST_RAND_SEED set to it.
+ */
+#ifndef __test_rand_h__
+#define __test_rand_h__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <mach/mach_time.h>
+
+static uint64_t test_rand_state = 1;
+
+/* Seed the generator; 0 isn't a valid xorshift state */
+static inline void
+test_rand_set_seed(uint64_t seed)
+{
+	test_rand_state = seed != 0 ? seed : 1;
+}
+
+/* Seed the generator from TEST_RAND_SEED, or the clock, and return the seed */
+static inline uint64_t
+test_rand_seed(void)
+{
+	const char *env = getenv("TEST_RAND_SEED");
+	uint64_t seed;
+
+	seed = env != NULL ? strtoull(env, NULL, 0) : (mach_absolute_time() | 1);
+	test_rand_set_seed(seed);
+	return test_rand_state;
+}
+
+static inline uint64_t
+test_rand64(void)
+{
+	/* xorshift64* */
+	test_rand_state ^= test_rand_state >> 12;
+	test_rand_state ^= test_rand_state << 25;
+	test_rand_state ^= test_rand_state >> 27;
+	return test_rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint32_t
+test_rand32(void)
+{
+	return (uint32_t)(test_rand64() >> 32);
+}
+
+#endif /* __test_rand_h__ */
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Measures how long a major compaction of a fragmented compressor takes
+ * depending on vm.compressor_major_compact_workers.
+ *
+ * Each round fills the compressor with pages, frees every other one of
+ * them (which is what a large process exiting looks like, as far as the
+ * segments are concerned), and then has the kernel major compact the
+ * age queue through vm.compressor_major_compact_test.  The pages left
+ * must read back intact after compaction moved them around.
+ */
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <darwintest.h>
+#include <TargetConditionals.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("VM"),
+	T_META_ASROOT(true),
+	T_META_CHECK_LEAKS(false),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define COMPACTION_BENCH_SIZE   (256ull << 20)
+#define PAGEOUT_WAIT_SECONDS    30
+
+static int orig_workers = -1;
+
+static void
+restore_workers(void)
+{
+	if (orig_workers > 0) {
+		sysctlbyname("vm.compressor_major_compact_workers", NULL, NULL,
+		    &orig_workers, sizeof(orig_workers));
+	}
+}
+
+static void *
+fragment_compressor(size_t size)
+{
+	size_t npages = size / vm_kernel_page_size;
+	mach_timebase_info_data_t tb;
+	uint64_t deadline;
+	unsigned char vec;
+	uint32_t *buf;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE(buf, MAP_FAILED, "mmap");
+
+	/* compressible, but neither zero nor single value pages */
+	for (size_t i = 0; i < size / sizeof(uint32_t); i++) {
+		buf[i] = (uint32_t)(i % 1021);
+	}
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(madvise(buf, size, MADV_PAGEOUT), "madvise(MADV_PAGEOUT)");
+	mach_timebase_info(&tb);
+	deadline = mach_absolute_time() +
+	    PAGEOUT_WAIT_SECONDS * NSEC_PER_SEC * tb.denom / tb.numer;
+	for (size_t i = 0; i < npages; i++) {
+		for (;;) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(mincore((char *)buf + i * vm_kernel_page_size,
+			    1, (char *)&vec), "mincore");
+			if (!(vec & MINCORE_INCORE)) {
+				break;
+			}
+			if (mach_absolute_time() > deadline) {
+				T_ASSERT_FAIL("page %zu of %zu still resident %d s after MADV_PAGEOUT",
+				    i, npages, PAGEOUT_WAIT_SECONDS);
+			}
+			usleep(100);
+		}
+	}
+
+	/* free every other compressed page, leaving holes in every segment */
+	for (size_t i = 0; i < npages; i += 2) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(munmap((char *)buf + i * vm_kernel_page_size,
+		    vm_kernel_page_size), "munmap");
+	}
+	return buf;
+}
+
+/* the pages fragment_compressor() left must still hold what it wrote */
+static void
+check_pages(uint32_t *buf, size_t size)
+{
+	size_t npages = size / vm_kernel_page_size;
+	size_t words = vm_kernel_page_size / sizeof(uint32_t);
+
+	for (size_t i = 1; i < npages; i += 2) {
+		for (size_t j = i * words; j < (i + 1) * words; j++) {
+			if (buf[j] != (uint32_t)(j % 1021)) {
+				T_ASSERT_FAIL("page %zu word %zu: %#x, expected %#x",
+				    i, j - i * words, buf[j], (uint32_t)(j % 1021));
+			}
+		}
+	}
+}
+
+static uint64_t
+parallel_runs(void)
+{
+	uint64_t runs = 0;
+	size_t len = sizeof(runs);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("vm.compressor_major_compact_parallel_runs",
+	    &runs, &len, NULL, 0), "vm.compressor_major_compact_parallel_runs");
+	return runs;
+}
+
+T_DECL(compaction_chunk_sysctl,
+    "vm.compressor_major_compact_chunk rejects empty and oversized runs")
+{
+	int chunk, bad;
+	size_t len = sizeof(chunk);
+
+	if (sysctlbyname("vm.compressor_major_compact_chunk", &chunk, &len, NULL, 0) != 0) {
+		T_SKIP("vm.compressor_major_compact_chunk not supported");
+	}
+	T_ASSERT_GE(chunk, 1, "chunk is %d", chunk);
+
+	bad = 0;
+	T_ASSERT_POSIX_FAILURE(sysctlbyname("vm.compressor_major_compact_chunk", NULL, NULL,
+	    &bad, sizeof(bad)), EINVAL, "chunk of 0 rejected");
+	bad = 1 << 20;
+	T_ASSERT_POSIX_FAILURE(sysctlbyname("vm.compressor_major_compact_chunk", NULL, NULL,
+	    &bad, sizeof(bad)), EINVAL, "chunk of %d rejected", bad);
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("vm.compressor_major_compact_chunk", NULL, NULL,
+	    &chunk, sizeof(chunk)), "chunk of %d accepted", chunk);
+}
+
+T_DECL(compaction_workers,
+    "measure major compaction wall time vs. the number of compaction workers",
+    T_META_ENABLED(!TARGET_OS_WATCH && !TARGET_OS_TV),
+    T_META_TAG_PERF)
+{
+	static const int worker_counts[] = { 1, 2, 4, 8 };
+	size_t len = sizeof(orig_workers);
+	uint64_t result[2];
+	char metric[64];
+	void *buf;
+	int one = 1;
+
+	if (sysctlbyname("vm.compressor_major_compact_workers", &orig_workers, &len, NULL, 0) != 0) {
+		T_SKIP("vm.compressor_major_compact_workers not supported");
+	}
+	T_ATEND(restore_workers);
+
+	for (size_t i = 0; i < sizeof(worker_counts) / sizeof(worker_counts[0]); i++) {
+		int workers = worker_counts[i];
+		uint64_t runs;
+
+		if (sysctlbyname("vm.compressor_major_compact_workers", NULL, NULL,
+		    &workers, sizeof(workers)) != 0) {
+			T_LOG("%d workers not supported, stopping", workers);
+			break;
+		}
+
+		buf = fragment_compressor(COMPACTION_BENCH_SIZE);
+		runs = parallel_runs();
+
+		len = sizeof(result);
+		if (sysctlbyname("vm.compressor_major_compact_test", result, &len, &one, sizeof(one)) != 0) {
+			munmap(buf, COMPACTION_BENCH_SIZE);
+			T_SKIP("vm.compressor_major_compact_test not supported (release kernel?)");
+		}
+
+		snprintf(metric, sizeof(metric), "compaction_wall_time_%d_workers", workers);
+		T_LOG("%d workers: compacted %llu segments in %llu us", workers, result[0], result[1]);
+		T_PERF(metric, (double)result[1], "us", "major compaction wall time");
+
+		T_EXPECT_GT(result[0], 0ull, "%d workers compacted segments", workers);
+		if (workers > 1) {
+			T_EXPECT_GT(parallel_runs(), runs, "%d workers shared the runs", workers);
+		}
+		check_pages(buf, COMPACTION_BENCH_SIZE);
+
+		/* unmapping the partially unmapped range again is fine */
+		munmap(buf, COMPACTION_BENCH_SIZE);
+	}
+	T_PASS("compacted pages read back intact");
+}
@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2023 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+/*
+ * Host side harness for the VM compressor codecs.
+ *
+ * Replays a page dump (a file made of raw, page sized pages) through the
+ * kernel's own metacompressor() / metadecompressor() built in userspace
+ * against the portable WKdm (osfmk/vm/WKdm_sw.c) and LZ4 (osfmk/vm/lz4.c)
+ * code, once per codec mode, and reports the compression ratio, the time
+ * spent per page and the decisions the hybrid selector made
+ * (compressor_preselect() / compressor_selector_update()).
+ *
+ * The tuneables that the kernel exposes as vm.lz4_* / vm.wkdm_* sysctls
+ * can be overridden with -T to evaluate a policy before deploying it.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mach/vm_page_size.h>
+#include <mach/boolean.h>
+#include <mach/vm_param.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Definitions normally provided by the kernel headers that
+ * vm_compressor_algorithms.c does not include in this configuration.
+ */
+#define VM_COMPRESSOR_CODEC_TEST        1
+#define XNU_KERNEL_PRIVATE              1
+#define DEVELOPMENT                     1
+#define DEBUG                           0
+#ifndef __probable
+#define __probable(x)                   __builtin_expect(!!(x), 1)
+#define __improbable(x)                 __builtin_expect(!!(x), 0)
+#endif
+#define assertf(e, fmt, ...)            assert(e)
+#define panic(fmt, ...)                 errx(1, fmt, ##__VA_ARGS__)
+#define PE_parse_boot_argn(n, p, s)     false
+#define C_SLOT_NO_POPCOUNT              0xffffu
+
+#include "../../osfmk/vm/vm_compressor_algorithms.c"
+#include "../../osfmk/vm/lz4.c"
+#include "../../osfmk/vm/WKdm_sw.c"
+
+#define countof(x) (sizeof(x) / sizeof(x[0]))
+
+static int kInvalidArgument = 1;
+static int kAllocationFailure = 2;
+static int kDecompressionFailure = 3;
+
+static const struct {
+	const char          *name;
+	vm_compressor_mode_t mode;
+} codec_modes[] = {
+	{ "wk", CMODE_WK },
+	{ "lz4", CMODE_LZ4 },
+	{ "hyb", CMODE_HYB },
+};
+
+#define TUNEABLE(field) { #field, (uint32_t *)&vmctune.field }
+static const struct {
+	const char *name;
+	uint32_t   *value;
+} tuneables[] = {
+	TUNEABLE(lz4_threshold),
+	TUNEABLE(wkdm_reeval_threshold),
+	TUNEABLE(lz4_max_failure_skips),
+	TUNEABLE(lz4_max_failure_run_length),
+	TUNEABLE(lz4_max_preselects),
+	TUNEABLE(lz4_run_preselection_threshold),
+	TUNEABLE(lz4_run_continue_bytes),
+	TUNEABLE(lz4_profitable_bytes),
+};
+#undef TUNEABLE
+
+typedef struct test_args {
+	const char *ta_dump_path;
+	uint32_t    ta_modes;           /* bitmap of codec_modes[] indices */
+	uint32_t    ta_iterations;
+	bool        ta_verbose;
+} test_args_t;
+
+struct codec_results {
+	uint64_t cr_pages;
+	uint64_t cr_input_bytes;
+	uint64_t cr_compressed_bytes;
+	uint64_t cr_wk_pages;
+	uint64_t cr_lz4_pages;
+	uint64_t cr_sv_pages;
+	uint64_t cr_incompressible_pages;
+	uint64_t cr_compress_ns;
+	uint64_t cr_decompress_ns;
+	compressor_state_t cr_state;
+	compressor_stats_t cr_stats;
+};
+
+static void parse_arguments(int argc, char *const *argv, test_args_t *args /* OUT */);
+static void print_help(char *const *argv);
+static void run_codec(const test_args_t *args, const uint8_t *pages,
+    size_t npages, vm_compressor_mode_t mode, struct codec_results *res /* OUT */);
+
+int
+main(int argc, char *const *argv)
+{
+	test_args_t args;
+	struct codec_results results[countof(codec_modes)] = { };
+	struct stat st;
+	uint8_t *pages;
+	size_t npages;
+	int fd;
+
+	/* mirror vm_compressor_algorithm_init(), before any -T override */
+	if (PAGE_SIZE == 16384) {
+		vmctune.lz4_threshold = 12288;
+	}
+	parse_arguments(argc, argv, &args);
+
+	fd = open(args.ta_dump_path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		err(kInvalidArgument, "%s", args.ta_dump_path);
+	}
+	npages = (size_t)st.st_size / PAGE_SIZE;
+	if (npages == 0) {
+		errx(kInvalidArgument, "%s: smaller than one %lu byte page",
+		    args.ta_dump_path, (unsigned long)PAGE_SIZE);
+	}
+	if ((size_t)st.st_size % PAGE_SIZE) {
+		warnx("%s: ignoring %lld trailing bytes", args.ta_dump_path,
+		    (long long)((size_t)st.st_size % PAGE_SIZE));
+	}
+	pages = mmap(NULL, npages * PAGE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (pages == MAP_FAILED) {
+		err(kAllocationFailure, "mmap(%s)", args.ta_dump_path);
+	}
+	close(fd);
+
+	for (size_t m = 0; m < countof(codec_modes); m++) {
+		if (args.ta_modes & (1u << m)) {
+			if (args.ta_verbose) {
+				fprintf(stderr, "Running %s over %zu pages\n",
+				    codec_modes[m].name, npages);
+			}
+			run_codec(&args, pages, npages, codec_modes[m].mode, &results[m]);
+		}
+	}
+
+	printf("-----Results-----\n");
+	printf("Codec, Pages, Compression Ratio, Compress ns/page, Decompress ns/page, "
+	    "WK Pages, LZ4 Pages, Single Value Pages, Incompressible Pages, "
+	    "LZ4 Preselects, LZ4 Failure Skips, LZ4 Failures, LZ4 Negatives, "
+	    "LZ4 Unprofitables, WK Exclusive\n");
+	for (size_t m = 0; m < countof(codec_modes); m++) {
+		const struct codec_results *r = &results[m];
+
+		if (!(args.ta_modes & (1u << m))) {
+			continue;
+		}
+		printf("%s, %llu, %.3f, %.1f, %.1f, %llu, %llu, %llu, %llu, "
+		    "%u, %u, %u, %u, %u, %llu\n",
+		    codec_modes[m].name, r->cr_pages,
+		    r->cr_compressed_bytes ?
+		    (double)r->cr_input_bytes / r->cr_compressed_bytes : 0.0,
+		    (double)r->cr_compress_ns / r->cr_pages,
+		    (double)r->cr_decompress_ns / r->cr_pages,
+		    r->cr_wk_pages, r->cr_lz4_pages, r->cr_sv_pages,
+		    r->cr_incompressible_pages,
+		    r->cr_state.lz4_total_preselects,
+		    r->cr_state.lz4_total_failure_skips,
+		    r->cr_state.lz4_total_failures,
+		    r->cr_state.lz4_total_negatives,
+		    r->cr_state.lz4_total_unprofitables,
+		    r->cr_stats.wk_compressions_exclusive);
+	}
+
+	munmap(pages, npages * PAGE_SIZE);
+	return 0;
+}
+
+static void
+run_codec(const test_args_t *args, const uint8_t *pages, size_t npages,
+    vm_compressor_mode_t mode, struct codec_results *res)
+{
+	size_t scratch_size;
+	uint8_t *cbuf, *dbuf, *cscratch, *dscratch;
+
+	vm_compressor_current_codec = mode;
+	scratch_size = MAX(vm_compressor_get_encode_scratch_size(),
+	    vm_compressor_get_decode_scratch_size());
+
+	/* WKdm may scribble up to a page past the budget before bailing */
+	cbuf = aligned_alloc(64, 2 * PAGE_SIZE);
+	dbuf = aligned_alloc(64, PAGE_SIZE);
+	cscratch = aligned_alloc(64, roundup(scratch_size, 64));
+	dscratch = aligned_alloc(64, roundup(scratch_size, 64));
+	if (!cbuf || !dbuf || !cscratch || !dscratch) {
+		err(kAllocationFailure, "Unable to allocate codec buffers");
+	}
+
+	for (uint32_t iter = 0; iter < args->ta_iterations; iter++) {
+		/*
+		 * Every iteration starts from a cold selector, the way
+		 * a freshly booted kernel would.
+		 */
+		memset(&vmcstate, 0, sizeof(vmcstate));
+		memset(&compressor_stats, 0, sizeof(compressor_stats));
+
+		for (size_t i = 0; i < npages; i++) {
+			const uint8_t *page = pages + i * PAGE_SIZE;
+			uint16_t codec = CINVALID;
+			boolean_t incomp_copy = FALSE;
+			uint32_t popcount;
+			uint64_t start, end;
+			int c_size;
+
+			start = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+			/* c_compress_page() keeps 4 bytes of the budget in reserve */
+			c_size = metacompressor(page, cbuf, (int32_t)PAGE_SIZE - 4, &codec,
+			    cscratch, &incomp_copy, &popcount);
+			end = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+			res->cr_compress_ns += end - start;
+			res->cr_pages++;
+			res->cr_input_bytes += PAGE_SIZE;
+
+			if (c_size == -1) {
+				res->cr_incompressible_pages++;
+				res->cr_compressed_bytes += PAGE_SIZE;
+				continue;
+			}
+			if (c_size == 0) {
+				/* recorded in the single value hash, no segment space */
+				res->cr_sv_pages++;
+				continue;
+			}
+
+			res->cr_compressed_bytes += (uint64_t)c_size;
+			if (codec == CCLZ4) {
+				res->cr_lz4_pages++;
+			} else {
+				res->cr_wk_pages++;
+			}
+
+			start = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+			bool ok = metadecompressor(cbuf, dbuf, (uint32_t)c_size, codec,
+			    dscratch, &popcount);
+			end = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+			res->cr_decompress_ns += end - start;
+
+			if (!ok || memcmp(dbuf, page, PAGE_SIZE) != 0) {
+				errx(kDecompressionFailure,
+				    "page %zu did not round trip (codec %u, size %d)",
+				    i, codec, c_size);
+			}
+		}
+
+		res->cr_state = vmcstate;
+		res->cr_stats = compressor_stats;
+	}
+
+	free(cbuf);
+	free(dbuf);
+	free(cscratch);
+	free(dscratch);
+}
+
+static bool
+parse_tuneable(const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	char *end;
+	unsigned long value;
+
+	if (eq == NULL) {
+		return false;
+	}
+	value = strtoul(eq + 1, &end, 0);
+	if (*end != '\0' || end == eq + 1) {
+		return false;
+	}
+	for (size_t i = 0; i < countof(tuneables); i++) {
+		if (strlen(tuneables[i].name) == (size_t)(eq - arg) &&
+		    strncmp(tuneables[i].name, arg, (size_t)(eq - arg)) == 0) {
+			*tuneables[i].value = (uint32_t)value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+parse_arguments(int argc, char *const *argv, test_args_t *args)
+{
+	int ch;
+
+	memset(args, 0, sizeof(*args));
+	args->ta_iterations = 1;
+
+	while ((ch = getopt(argc, argv, "vm:i:T:")) != -1) {
+		switch (ch) {
+		case 'v':
+			args->ta_verbose = true;
+			break;
+		case 'm':
+			if (strcmp(optarg, "all") == 0) {
+				args->ta_modes = (1u << countof(codec_modes)) - 1;
+				break;
+			}
+			for (size_t i = 0; i < countof(codec_modes); i++) {
+				if (strcmp(optarg, codec_modes[i].name) == 0) {
+					args->ta_modes |= 1u << i;
+					goto next;
+				}
+			}
+			print_help(argv);
+			exit(kInvalidArgument);
+		case 'i':
+			args->ta_iterations = (uint32_t)strtoul(optarg, NULL, 10);
+			if (args->ta_iterations == 0) {
+				print_help(argv);
+				exit(kInvalidArgument);
+			}
+			break;
+		case 'T':
+			if (!parse_tuneable(optarg)) {
+				fprintf(stderr, "Invalid tuneable %s\n", optarg);
+				print_help(argv);
+				exit(kInvalidArgument);
+			}
+			break;
+		default:
+			print_help(argv);
+			exit(kInvalidArgument);
+		}
+next:
+		;
+	}
+
+	if (optind + 1 != argc) {
+		print_help(argv);
+		exit(kInvalidArgument);
+	}
+	if (args->ta_modes == 0) {
+		args->ta_modes = (1u << countof(codec_modes)) - 1;
+	}
+	args->ta_dump_path = argv[optind];
+}
+
+static void
+print_help(char *const *argv)
+{
+	fprintf(stderr, "%s: [-v] [-m wk|lz4|hyb|all]... [-i iterations] "
+	    "[-T tuneable=value]... page_dump\n", argv[0]);
+	fprintf(stderr, "\npage_dump is a file of raw %lu byte pages.\n",
+	    (unsigned long)PAGE_SIZE);
+	fprintf(stderr, "\ntuneables (see the vm.* sysctls of the same name):\n");
+	for (size_t i = 0; i < countof(tuneables); i++) {
+		fprintf(stderr, "	%s (default %u)\n", tuneables[i].name,
+		    *tuneables[i].value);
+	}
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * 64 threads of one process, some of them faulting pages of their own
+ * region over and over, the others mapping, touching and unmapping
+ * small regions, like a malloc zone growing and shrinking next to busy
+ * threads.  Faults look the map up without its lock (vm.lockless_faults)
+ * and mmap/munmap take it exclusive, so this checks that every page
+ * still reads back what was written to it, and measures both rates for
+ * a few mixes of faulting and mapping threads.
+ */
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("VM"),
+	T_META_CHECK_LEAKS(false),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define STRESS_THREADS          64
+#define STRESS_SECONDS          2
+#define STRESS_FAULT_PAGES      256     /* region of each faulting thread */
+#define STRESS_MAP_PAGES        16      /* region of each mmap/munmap */
+
+struct stress_thread {
+	pthread_t               st_thread;
+	bool                    st_mapper;
+	uint32_t                st_id;
+	uint64_t                st_ops;
+	uint64_t                st_errors;
+};
+
+static atomic_bool stress_stop;
+
+static void *
+fault_thread(void *arg)
+{
+	struct stress_thread *st = arg;
+	size_t size = STRESS_FAULT_PAGES * vm_kernel_page_size;
+	uint64_t *buf;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)buf, MAP_FAILED, "mmap");
+
+	for (uint64_t pass = 1; !atomic_load_explicit(&stress_stop, memory_order_relaxed); pass++) {
+		/* one zero fill fault per page, then read them all back */
+		for (size_t i = 0; i < STRESS_FAULT_PAGES; i++) {
+			buf[i * vm_kernel_page_size / sizeof(*buf)] = pass << 32 | st->st_id;
+		}
+		for (size_t i = 0; i < STRESS_FAULT_PAGES; i++) {
+			if (buf[i * vm_kernel_page_size / sizeof(*buf)] != (pass << 32 | st->st_id)) {
+				st->st_errors++;
+			}
+		}
+		st->st_ops += STRESS_FAULT_PAGES;
+
+		/* give the pages back, so that the next pass faults again */
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(madvise(buf, size, MADV_FREE_REUSABLE),
+		    "madvise(MADV_FREE_REUSABLE)");
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(madvise(buf, size, MADV_FREE_REUSE),
+		    "madvise(MADV_FREE_REUSE)");
+	}
+
+	munmap(buf, size);
+	return NULL;
+}
+
+static void *
+map_thread(void *arg)
+{
+	struct stress_thread *st = arg;
+	size_t size = STRESS_MAP_PAGES * vm_kernel_page_size;
+	uint64_t *buf;
+
+	while (!atomic_load_explicit(&stress_stop, memory_order_relaxed)) {
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+		T_QUIET; T_ASSERT_NE((void *)buf, MAP_FAILED, "mmap");
+
+		/* a new region must not show anything another thread wrote */
+		if (buf[0] != 0) {
+			st->st_errors++;
+		}
+		buf[0] = st->st_id;
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(munmap(buf, size), "munmap");
+		st->st_ops++;
+	}
+	return NULL;
+}
+
+static uint64_t
+sysctl_u64(const char *name)
+{
+	uint64_t value = 0;
+	size_t len = sizeof(value);
+
+	sysctlbyname(name, &value, &len, NULL, 0);
+	return value;
+}
+
+static void
+run_mix(uint32_t mappers)
+{
+	struct stress_thread threads[STRESS_THREADS] = { };
+	uint64_t faults = 0, maps = 0, errors = 0;
+	uint64_t pins, fallbacks, drains;
+	char metric[64];
+
+	pins = sysctl_u64("vm.lockless_fault_pins");
+	fallbacks = sysctl_u64("vm.lockless_fault_fallbacks");
+	drains = sysctl_u64("vm.lockless_fault_drains");
+
+	atomic_store(&stress_stop, false);
+	for (uint32_t i = 0; i < STRESS_THREADS; i++) {
+		threads[i].st_id = i;
+		threads[i].st_mapper = i < mappers;
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i].st_thread, NULL,
+		    threads[i].st_mapper ? map_thread : fault_thread, &threads[i]),
+		    "pthread_create");
+	}
+	sleep(STRESS_SECONDS);
+	atomic_store(&stress_stop, true);
+
+	for (uint32_t i = 0; i < STRESS_THREADS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i].st_thread, NULL),
+		    "pthread_join");
+		if (threads[i].st_mapper) {
+			maps += threads[i].st_ops;
+		} else {
+			faults += threads[i].st_ops;
+		}
+		errors += threads[i].st_errors;
+	}
+
+	T_EXPECT_EQ(errors, 0ull, "%u mapping threads: no page read back wrong", mappers);
+	T_LOG("%u mapping threads: %llu faults/s, %llu mmap+munmap/s, "
+	    "%llu lockless, %llu fallbacks, %llu drains", mappers,
+	    faults / STRESS_SECONDS, maps / STRESS_SECONDS,
+	    sysctl_u64("vm.lockless_fault_pins") - pins,
+	    sysctl_u64("vm.lockless_fault_fallbacks") - fallbacks,
+	    sysctl_u64("vm.lockless_fault_drains") - drains);
+
+	if (mappers < STRESS_THREADS) {
+		snprintf(metric, sizeof(metric), "fault_mmap_stress_faults_per_sec_%u_mappers", mappers);
+		T_PERF(metric, (double)faults / STRESS_SECONDS, "faults/s",
+		    "zero fill faults next to mmap/munmap threads");
+	}
+	if (mappers > 0) {
+		snprintf(metric, sizeof(metric), "fault_mmap_stress_maps_per_sec_%u_mappers", mappers);
+		T_PERF(metric, (double)maps / STRESS_SECONDS, "mmap+munmap/s",
+		    "mmap, touch and munmap next to faulting threads");
+	}
+}
+
+T_DECL(fault_mmap_stress,
+    "faults and mmap/munmap from 64 threads of the same process",
+    T_META_TAG_PERF)
+{
+	uint32_t lockless = 0;
+	size_t len = sizeof(lockless);
+
+	if (sysctlbyname("vm.lockless_faults", &lockless, &len, NULL, 0) == 0) {
+		T_LOG("vm.lockless_faults: %u", lockless);
+	}
+
+	/* faults only, a few mappers, half and half, and mappers only */
+	run_mix(0);
+	run_mix(8);
+	run_mix(STRESS_THREADS / 2);
+	run_mix(STRESS_THREADS);
+}
@@ -1,10 +1,15 @@
 /*
  * Benchmark VM fault throughput.
  * This test faults memory for a configurable amount of time across a
- * configurable number of threads. Currently it only measures zero fill faults.
- * Currently it supports two variants:
- * 1. Each thread gets its own vm objects to fault in
- * 2. Threads share vm objects
+ * configurable number of threads.
+ * Currently it supports three variants:
+ * 1. Each thread gets its own vm objects to fault in (zero fill faults)
+ * 2. Threads share vm objects (zero fill faults)
+ * 3. Each thread maps a file whose pages are all resident (soft faults)
+ *
+ * The third variant is the one fault-around (vm.fault_around) helps with;
+ * -a <pages> sets the window for the benchmark process, and the number of
+ * faults taken per page read is printed along with the results.
  *
  * We'll add more fault types as we identify problematic user-facing workloads
  * in macro benchmarks.
@@ -23,11 +28,14 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/sysctl.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 /*
  * TODO: Make this benchmark runnable on linux so we can do a perf comparison.
@@ -74,7 +82,8 @@ typedef struct fault_buffer {
 
 typedef enum test_variant {
 	VARIANT_SEPARATE_VM_OBJECTS,
-	VARIANT_SHARE_VM_OBJECTS
+	VARIANT_SHARE_VM_OBJECTS,
+	VARIANT_RESIDENT_FILE
 } test_variant_t;
 
 typedef struct test_globals {
@@ -90,6 +99,8 @@ typedef struct test_globals {
 	unsigned int tg_num_threads;
 	test_variant_t tg_variant;
 	bool pin_threads;
+	/* The file mapped by the resident-file variant, or -1. */
+	int tg_file_fd;
 	/*
 	 * An array of memory objects to fault in.
 	 * This is basically a workqueue of
@@ -119,6 +130,7 @@ static faulting_thread_args_t *faulting_thread_args;
 
 static const char* kSeparateObjectsArgument = "separate-objects";
 static const char* kShareObjectsArgument = "share-objects";
+static const char* kResidentFileArgument = "resident-file";
 
 /* Arguments parsed from the command line */
 typedef struct test_args {
@@ -128,6 +140,7 @@ typedef struct test_args {
 	test_variant_t variant;
 	bool pin_threads;
 	bool verbose;
+	int fault_around; /* vm.fault_around for this process, or -1 to leave it */
 } test_args_t;
 
 /*
@@ -179,7 +192,15 @@ static void setup_memory(test_globals_t* globals, test_variant_t variant);
  * Dump test results as a csv to stdout.
  * Use fault_throughput.lua to convert to perfdata.
  */
-static void output_results(const test_globals_t *globals, double walltime_elapsed_seconds, double cputime_elapsed_seconds);
+static void output_results(const test_globals_t *globals, double walltime_elapsed_seconds, double cputime_elapsed_seconds,
+    uint64_t faults);
+/* The number of faults this task has taken so far. */
+static uint64_t task_faults(void);
+/*
+ * Creates the file mapped by the resident-file variant, and reads it in
+ * so that faults on it only have to map pages that are already resident.
+ */
+static int create_resident_file(size_t size);
 static void cleanup_test(test_globals_t *globals);
 /*
  * Join the background threads and return the total microseconds
@@ -209,9 +230,11 @@ main(int argc, char **argv)
 	/* Total cpu-time spent faulting in pages */
 	uint64_t cpu_time_faulting_us = 0;
 	uint64_t start_time_ns;
+	uint64_t faults;
 	test_args_t args;
 	parse_arguments(argc, argv, &args);
 	pthread_t* threads = setup_test(globals, &args, kMemSize, args.verbose);
+	faults = task_faults();
 
 	/* Keep doing more iterations until we've hit our (wall) time budget */
 	while (wall_time_elapsed_ns < args.duration_seconds * kNumNanosecondsInSecond) {
@@ -223,9 +246,10 @@ main(int argc, char **argv)
 
 	benchmark_log(args.verbose, "Hit time budget\nJoining worker threads\n");
 	cpu_time_faulting_us = join_background_threads(globals, threads);
+	faults = task_faults() - faults;
 	benchmark_log(args.verbose, "----End Test Output----\n");
 	output_results(globals, (double) wall_time_elapsed_ns / kNumNanosecondsInSecond,
-	    (double)cpu_time_faulting_us / kNumMicrosecondsInSecond);
+	    (double)cpu_time_faulting_us / kNumMicrosecondsInSecond, faults);
 	cleanup_test(globals);
 
 	return 0;
@@ -412,7 +436,15 @@ setup_memory(test_globals_t* globals, test_variant_t variant)
 	size_t stride = fault_buffer_stride(globals);
 	for (size_t i = 0; i < globals->tg_fault_buffer_arr_length; i += stride) {
 		fault_buffer_t *object = &globals->tg_fault_buffer_arr[i];
-		object->fb_start = mmap_buffer(kVmObjectSize);
+		if (variant == VARIANT_RESIDENT_FILE) {
+			object->fb_start = mmap(NULL, kVmObjectSize, PROT_READ, MAP_SHARED, globals->tg_file_fd, 0);
+			if ((void *)object->fb_start == MAP_FAILED) {
+				fprintf(stderr, "Unable to map the test file: %s\n", strerror(errno));
+				exit(2);
+			}
+		} else {
+			object->fb_start = mmap_buffer(kVmObjectSize);
+		}
 		object->fb_size = kVmObjectSize;
 		if (variant == VARIANT_SHARE_VM_OBJECTS) {
 			/*
@@ -426,7 +458,7 @@ setup_memory(test_globals_t* globals, test_variant_t variant)
 				offset_object->fb_start = object->fb_start + offset;
 				offset_object->fb_size = object->fb_size - offset;
 			}
-		} else if (variant != VARIANT_SEPARATE_VM_OBJECTS) {
+		} else if (variant != VARIANT_SEPARATE_VM_OBJECTS && variant != VARIANT_RESIDENT_FILE) {
 			fprintf(stderr, "Unknown test variant.\n");
 			exit(2);
 		}
@@ -493,13 +525,14 @@ init_globals(test_globals_t *globals, const test_args_t *args)
 	globals->tg_num_threads = args->n_threads;
 	globals->tg_variant = args->variant;
 	globals->pin_threads = args->pin_threads;
+	globals->tg_file_fd = -1;
 }
 
 static void
 init_fault_buffer_arr(test_globals_t *globals, const test_args_t *args, size_t memory_size)
 {
-	if (args->variant == VARIANT_SEPARATE_VM_OBJECTS) {
-		// This variant creates separate vm objects up to memory size bytes total
+	if (args->variant == VARIANT_SEPARATE_VM_OBJECTS || args->variant == VARIANT_RESIDENT_FILE) {
+		// This variant creates separate mappings up to memory size bytes total
 		globals->tg_fault_buffer_arr_length = memory_size / kVmObjectSize;
 	} else if (args->variant == VARIANT_SHARE_VM_OBJECTS) {
 		// This variant creates separate vm objects up to memory size bytes total
@@ -547,6 +580,16 @@ setup_test(test_globals_t *globals, const test_args_t *args, size_t memory_size,
 {
 	init_globals(globals, args);
 	init_fault_buffer_arr(globals, args, memory_size);
+	if (args->variant == VARIANT_RESIDENT_FILE) {
+		globals->tg_file_fd = create_resident_file(kVmObjectSize);
+	}
+	if (args->fault_around >= 0) {
+		int ret = sysctlbyname("vm.fault_around", NULL, 0, &args->fault_around, sizeof(args->fault_around));
+		if (ret != 0) {
+			fprintf(stderr, "Unable to set vm.fault_around: %s\n", strerror(errno));
+			exit(2);
+		}
+	}
 	benchmark_log(verbose, "Initialized global data structures.\n");
 	pthread_t *workers = spawn_worker_threads(globals, args->n_threads, args->first_cpu);
 	benchmark_log(verbose, "Spawned workers.\n");
@@ -587,12 +630,59 @@ cleanup_test(test_globals_t* globals)
 	assert(ret == 0);
 	ret = pthread_cond_destroy(&globals->tg_cv);
 	assert(ret == 0);
+	if (globals->tg_file_fd != -1) {
+		close(globals->tg_file_fd);
+	}
 	free(globals->tg_fault_buffer_arr);
 	free(globals);
 }
 
+static uint64_t
+task_faults(void)
+{
+	task_events_info_data_t info;
+	mach_msg_type_number_t count = TASK_EVENTS_INFO_COUNT;
+	kern_return_t kr = task_info(mach_task_self(), TASK_EVENTS_INFO, (task_info_t)&info, &count);
+	assert(kr == KERN_SUCCESS);
+	return (uint64_t)info.faults;
+}
+
+static int
+create_resident_file(size_t size)
+{
+	char path[] = "/tmp/fault_throughput.XXXXXX";
+	unsigned char *buf;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	if (fd == -1) {
+		fprintf(stderr, "Unable to create the test file: %s\n", strerror(errno));
+		exit(2);
+	}
+	ret = unlink(path);
+	assert(ret == 0);
+
+	buf = malloc(size);
+	assert(buf != NULL);
+	for (size_t i = 0; i < size; i++) {
+		buf[i] = (unsigned char)i;
+	}
+	if (pwrite(fd, buf, size, 0) != (ssize_t)size) {
+		fprintf(stderr, "Unable to write the test file: %s\n", strerror(errno));
+		exit(2);
+	}
+	/* and read it back, in case writing it did not leave it all cached */
+	if (pread(fd, buf, size, 0) != (ssize_t)size) {
+		fprintf(stderr, "Unable to read the test file: %s\n", strerror(errno));
+		exit(2);
+	}
+	free(buf);
+	return fd;
+}
+
 static void
-output_results(const test_globals_t* globals, double walltime_elapsed_seconds, double cputime_elapsed_seconds)
+output_results(const test_globals_t* globals, double walltime_elapsed_seconds, double cputime_elapsed_seconds,
+    uint64_t faults)
 {
 	size_t pgsize;
 	size_t sysctl_size = sizeof(pgsize);
@@ -607,6 +697,15 @@ output_results(const test_globals_t* globals, double walltime_elapsed_seconds, d
 	num_pages *= globals->tg_iterations_completed;
 	walltime_throughput = num_pages / walltime_elapsed_seconds;
 	cputime_throughput = num_pages / cputime_elapsed_seconds;
+
+	int fault_around = 0;
+	uint32_t fault_around_mapped = 0;
+	sysctl_size = sizeof(fault_around);
+	(void)sysctlbyname("vm.fault_around", &fault_around, &sysctl_size, NULL, 0);
+	sysctl_size = sizeof(fault_around_mapped);
+	(void)sysctlbyname("vm.fault_around_mapped", &fault_around_mapped, &sysctl_size, NULL, 0);
+	printf("Fault-around window %d pages: %llu faults for %zu pages (%.3f faults/page), %u neighbors mapped\n",
+	    fault_around, faults, num_pages, num_pages ? (double)faults / num_pages : 0.0, fault_around_mapped);
 	printf("-----Results-----\n");
 	printf("Throughput (pages / wall second), Throughput (pages / CPU second)\n");
 	printf("%f,%f\n", walltime_throughput, cputime_throughput);
@@ -615,10 +714,12 @@ output_results(const test_globals_t* globals, double walltime_elapsed_seconds, d
 static void
 print_help(char** argv)
 {
-	fprintf(stderr, "%s: <test-variant> [-v] duration num_threads\n", argv[0]);
+	fprintf(stderr, "%s: [-v] [-a pages] <test-variant> duration num_threads [first_cpu]\n", argv[0]);
 	fprintf(stderr, "\ntest variants:\n");
 	fprintf(stderr, "	%s	Fault in different vm objects in each thread.\n", kSeparateObjectsArgument);
 	fprintf(stderr, "	%s		Share vm objects across faulting threads.\n", kShareObjectsArgument);
+	fprintf(stderr, "	%s		Fault in mappings of a resident file in each thread.\n", kResidentFileArgument);
+	fprintf(stderr, "\n-a sets the fault-around window (vm.fault_around) of the benchmark.\n");
 }
 
 static void
@@ -626,13 +727,16 @@ parse_arguments(int argc, char** argv, test_args_t *args)
 {
 	int current_argument = 1;
 	memset(args, 0, sizeof(test_args_t));
-	if (argc < 4 || argc > 6) {
-		print_help(argv);
-		exit(1);
-	}
-	if (argv[current_argument][0] == '-') {
+	args->fault_around = -1;
+	while (current_argument < argc && argv[current_argument][0] == '-') {
 		if (strcmp(argv[current_argument], "-v") == 0) {
 			args->verbose = true;
+		} else if (strcmp(argv[current_argument], "-a") == 0 && current_argument + 1 < argc) {
+			args->fault_around = (int)strtol(argv[++current_argument], NULL, 10);
+			if (args->fault_around < 0) {
+				print_help(argv);
+				exit(1);
+			}
 		} else {
 			fprintf(stderr, "Unknown argument %s\n", argv[current_argument]);
 			print_help(argv);
@@ -640,10 +744,16 @@ parse_arguments(int argc, char** argv, test_args_t *args)
 		}
 		current_argument++;
 	}
+	if (argc - current_argument < 3 || argc - current_argument > 4) {
+		print_help(argv);
+		exit(1);
+	}
 	if (strncasecmp(argv[current_argument], kSeparateObjectsArgument, strlen(kSeparateObjectsArgument)) == 0) {
 		args->variant = VARIANT_SEPARATE_VM_OBJECTS;
 	} else if (strncasecmp(argv[current_argument], kShareObjectsArgument, strlen(kShareObjectsArgument)) == 0) {
 		args->variant = VARIANT_SHARE_VM_OBJECTS;
+	} else if (strncasecmp(argv[current_argument], kResidentFileArgument, strlen(kResidentFileArgument)) == 0) {
+		args->variant = VARIANT_RESIDENT_FILE;
 	} else {
 		print_help(argv);
 		exit(1);
@@ -684,7 +794,7 @@ static size_t
 fault_buffer_stride(const test_globals_t *globals)
 {
 	size_t stride;
-	if (globals->tg_variant == VARIANT_SEPARATE_VM_OBJECTS) {
+	if (globals->tg_variant == VARIANT_SEPARATE_VM_OBJECTS || globals->tg_variant == VARIANT_RESIDENT_FILE) {
 		stride = 1;
 	} else if (globals->tg_variant == VARIANT_SHARE_VM_OBJECTS) {
 		stride = globals->tg_num_threads;
@@ -42,10 +42,16 @@ local benchmark = benchrun.new({
     parser:option{
       name = '--variant',
       description = 'Which benchmark variant to run',
-      choices = { 'separate-objects', 'share-objects' },
+      choices = { 'separate-objects', 'share-objects', 'resident-file' },
       default = 'separate-objects',
       argname = 'name',
     }
+    parser:option{
+      name = '--fault-around',
+      description = 'Fault-around window of the benchmark process (vm.fault_around)',
+      convert = tonumber,
+      argname = 'pages',
+    }
     parser:option{
       name = '--first-cpu',
       description = 'Pin threads to CPUs, starting with this CPU ID; requires enable_skstb=1 boot-arg',
@@ -101,6 +107,10 @@ for _, thread_count in ipairs(test_threads) do
   if benchmark.opt.verbose then
     cmd[#cmd + 1] = '-v'
   end
+  if benchmark.opt.fault_around then
+    cmd[#cmd + 1] = '-a'
+    cmd[#cmd + 1] = benchmark.opt.fault_around
+  end
   cmd[#cmd + 1] = benchmark.opt.variant
   cmd[#cmd + 1] = benchmark.opt.duration
   cmd[#cmd + 1] = thread_count
@@ -117,7 +127,8 @@ for _, thread_count in ipairs(test_threads) do
         benchmark.writer:add_value(k, page_throughput_unit, tonumber(v), {
           [perfdata.larger_better] = true,
           threads = thread_count,
-          variant = benchmark.opt.variant
+          variant = benchmark.opt.variant,
+          fault_around = benchmark.opt.fault_around or 0
         })
       end
     end
@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Threads of one process each fault pages of a few regions of their
+ * own in turn.  The map's hint only remembers the entry inserted last,
+ * so it never helps here, but each thread's map lookup cache should
+ * find these entries without walking the map, which task_vm_info
+ * reports.
+ *
+ * Nothing takes the map exclusive while the threads fault, so each of
+ * them must miss exactly once per region, the first time round, and
+ * hit for every other page.
+ *
+ * Then threads replace their own regions with new ones at the same
+ * address, over and over, and fault them in, next to threads that keep
+ * faulting without the map lock (vm.lockless_faults): a fault must
+ * never use an entry its thread cached before the replacement, so each
+ * new region must read as zeroes before it's written to.
+ */
+#include <sys/mman.h>
+#include <mach/mach.h>
+#include <unistd.h>
+#include <mach/task_info.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <darwintest.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("VM"),
+	T_META_CHECK_LEAKS(false),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define LOOKUP_THREADS          16
+#define LOOKUP_REGIONS          4       /* per thread, fits the thread's cache */
+#define LOOKUP_PAGES            1024    /* per region */
+
+static char *regions[LOOKUP_THREADS][LOOKUP_REGIONS];
+static _Atomic uint32_t lookup_ready, lookup_done;
+static _Atomic bool lookup_go, lookup_exit;
+
+static void *
+fault_thread(void *arg)
+{
+	char **mine = arg;
+
+	/*
+	 * Threads being created or exiting change the map:
+	 * fault only once they all exist, and exit once they're all done.
+	 */
+	atomic_fetch_add(&lookup_ready, 1);
+	while (!atomic_load(&lookup_go)) {
+	}
+
+	/* one zero fill fault per page, going round the regions */
+	for (size_t page = 1; page < LOOKUP_PAGES; page++) {
+		for (int r = 0; r < LOOKUP_REGIONS; r++) {
+			mine[r][page * vm_kernel_page_size] = 1;
+		}
+	}
+
+	atomic_fetch_add(&lookup_done, 1);
+	while (!atomic_load(&lookup_exit)) {
+	}
+	return NULL;
+}
+
+static void
+get_lookup_counts(uint64_t *hits, uint64_t *misses)
+{
+	task_vm_info_data_t info = { };
+	mach_msg_type_number_t count = TASK_VM_INFO_REV7_COUNT;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(task_info(mach_task_self(), TASK_VM_INFO,
+	    (task_info_t)&info, &count), "task_info(TASK_VM_INFO)");
+	T_QUIET; T_ASSERT_EQ(count, TASK_VM_INFO_REV7_COUNT, "rev7 task_vm_info");
+	*hits = info.map_lookup_cache_hits;
+	*misses = info.map_lookup_cache_misses;
+}
+
+T_DECL(map_lookup_cache,
+    "threads faulting in several regions of the same map hit their lookup cache")
+{
+	pthread_t threads[LOOKUP_THREADS];
+	uint64_t hits, misses, hits_after, misses_after;
+	size_t size = LOOKUP_PAGES * vm_kernel_page_size;
+
+	for (int t = 0; t < LOOKUP_THREADS; t++) {
+		for (int r = 0; r < LOOKUP_REGIONS; r++) {
+			regions[t][r] = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			    MAP_ANON | MAP_PRIVATE, -1, 0);
+			T_QUIET; T_ASSERT_NE((void *)regions[t][r], MAP_FAILED, "mmap");
+			/* the first fault gives the entry its object, under the map lock */
+			regions[t][r][0] = 1;
+		}
+	}
+
+	for (int t = 0; t < LOOKUP_THREADS; t++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[t], NULL,
+		    fault_thread, regions[t]), "pthread_create");
+	}
+	while (atomic_load(&lookup_ready) < LOOKUP_THREADS) {
+	}
+
+	get_lookup_counts(&hits, &misses);
+	atomic_store(&lookup_go, true);
+	while (atomic_load(&lookup_done) < LOOKUP_THREADS) {
+	}
+	get_lookup_counts(&hits_after, &misses_after);
+
+	atomic_store(&lookup_exit, true);
+	for (int t = 0; t < LOOKUP_THREADS; t++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[t], NULL),
+		    "pthread_join");
+	}
+
+	hits = hits_after - hits;
+	misses = misses_after - misses;
+	T_LOG("%llu lookups hit the threads' caches, %llu missed", hits, misses);
+	T_EXPECT_EQ(misses, (uint64_t)LOOKUP_THREADS * LOOKUP_REGIONS,
+	    "one miss per region and thread");
+	T_EXPECT_EQ(hits, (uint64_t)LOOKUP_THREADS * LOOKUP_REGIONS * (LOOKUP_PAGES - 2),
+	    "every other fault hit");
+
+	for (int t = 0; t < LOOKUP_THREADS; t++) {
+		for (int r = 0; r < LOOKUP_REGIONS; r++) {
+			munmap(regions[t][r], size);
+		}
+	}
+}
+
+#define REMAP_THREADS           8
+#define REMAP_FAULTERS          8
+#define REMAP_PAGES             16
+#define REMAP_SECONDS           5
+
+static _Atomic bool remap_stop;
+
+static void *
+remap_fault_thread(void *arg __unused)
+{
+	size_t size = LOOKUP_PAGES * vm_kernel_page_size;
+	char *buf;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)buf, MAP_FAILED, "mmap");
+
+	/* keep pinning the map, for the writers to wait on */
+	while (!atomic_load_explicit(&remap_stop, memory_order_relaxed)) {
+		for (size_t off = 0; off < size; off += vm_kernel_page_size) {
+			buf[off] = 1;
+		}
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(madvise(buf, size, MADV_FREE_REUSABLE),
+		    "madvise(MADV_FREE_REUSABLE)");
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(madvise(buf, size, MADV_FREE_REUSE),
+		    "madvise(MADV_FREE_REUSE)");
+	}
+
+	munmap(buf, size);
+	return NULL;
+}
+
+static void *
+remap_thread(void *arg)
+{
+	size_t size = REMAP_PAGES * vm_kernel_page_size;
+	uint64_t *errors = arg;
+	uint64_t *buf, *fresh;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)buf, MAP_FAILED, "mmap");
+
+	for (uint64_t pass = 1; !atomic_load_explicit(&remap_stop, memory_order_relaxed); pass++) {
+		/* the old entry is freed and a new one takes its place */
+		fresh = mmap(buf, size, PROT_READ | PROT_WRITE,
+		    MAP_ANON | MAP_PRIVATE | MAP_FIXED, -1, 0);
+		T_QUIET; T_ASSERT_EQ_PTR((void *)fresh, (void *)buf, "mmap(MAP_FIXED)");
+
+		for (size_t i = 0; i < REMAP_PAGES; i++) {
+			uint64_t *page = &buf[i * vm_kernel_page_size / sizeof(*buf)];
+
+			if (*page != 0) {
+				(*errors)++;
+			}
+			*page = pass;
+		}
+	}
+
+	munmap(buf, size);
+	return NULL;
+}
+
+T_DECL(map_lookup_cache_remap,
+    "faults don't use cached entries of regions replaced since")
+{
+	pthread_t threads[REMAP_THREADS + REMAP_FAULTERS];
+	uint64_t errors[REMAP_THREADS] = { };
+	uint64_t total = 0;
+
+	for (int t = 0; t < REMAP_THREADS + REMAP_FAULTERS; t++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[t], NULL,
+		    t < REMAP_THREADS ? remap_thread : remap_fault_thread,
+		    t < REMAP_THREADS ? &errors[t] : NULL), "pthread_create");
+	}
+	sleep(REMAP_SECONDS);
+	atomic_store(&remap_stop, true);
+
+	for (int t = 0; t < REMAP_THREADS + REMAP_FAULTERS; t++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[t], NULL),
+		    "pthread_join");
+		if (t < REMAP_THREADS) {
+			total += errors[t];
+		}
+	}
+	T_EXPECT_EQ(total, 0ull, "no replaced region showed its old contents");
+}
@@ -4,10 +4,15 @@
  *
  * Functional tests for VM compressor/swap.
  */
+#include <sys/mman.h>
 #include <sys/sysctl.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <kern/kcdata.h>
 #include <darwintest.h>
 #include <darwintest_utils.h>
 #include <TargetConditionals.h>
+#include <unistd.h>
 
 T_GLOBAL_META(
 	T_META_NAMESPACE("xnu.vm"),
@@ -26,3 +31,163 @@ T_DECL(swap_enabled,
 	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "Failed to query sysctl `vm.swap_enabled`");
 	T_EXPECT_EQ(swap_enabled, 1, "Check that vm.swap_enabled is set");
 }
+
+static uint64_t
+sysctl_quad(const char *name)
+{
+	uint64_t value = 0;
+	size_t len = sizeof(value);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &value, &len, NULL, 0),
+	    "sysctl %s", name);
+	return value;
+}
+
+#define PAGEOUT_WAIT_SECONDS    30
+
+/* wait for MADV_PAGEOUT to (asynchronously) compress every page of buf */
+static void
+wait_for_pageout(void *buf, size_t npages)
+{
+	mach_timebase_info_data_t tb;
+	uint64_t deadline;
+	unsigned char vec;
+
+	mach_timebase_info(&tb);
+	deadline = mach_absolute_time() +
+	    PAGEOUT_WAIT_SECONDS * NSEC_PER_SEC * tb.denom / tb.numer;
+	for (size_t i = 0; i < npages; i++) {
+		for (;;) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(mincore((char *)buf + i * vm_kernel_page_size,
+			    1, (char *)&vec), "mincore");
+			if (!(vec & MINCORE_INCORE)) {
+				break;
+			}
+			if (mach_absolute_time() > deadline) {
+				T_ASSERT_FAIL("page %zu of %zu still resident %d s after MADV_PAGEOUT",
+				    i, npages, PAGEOUT_WAIT_SECONDS);
+			}
+			usleep(100);
+		}
+	}
+}
+
+T_DECL(compress_batch,
+    "Check that pages of the same object get compressed in batches",
+    T_META_ENABLED(!TARGET_OS_WATCH))
+{
+	const size_t npages = 256;
+	size_t size = npages * vm_kernel_page_size;
+	uint64_t batches, pages, batches_after, pages_after;
+	uint32_t *buf;
+	uint32_t batch_max = 0;
+	size_t len = sizeof(batch_max);
+	size_t mismatches = 0;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE(buf, MAP_FAILED, "mmap");
+
+	/* compressible, but neither zero nor single value pages */
+	for (size_t i = 0; i < size / sizeof(uint32_t); i++) {
+		buf[i] = (uint32_t)(i % 1021);
+	}
+
+	batches = sysctl_quad("vm.c_compress_batches");
+	pages = sysctl_quad("vm.c_compress_batched_pages");
+
+	T_ASSERT_POSIX_SUCCESS(madvise(buf, size, MADV_PAGEOUT), "madvise(MADV_PAGEOUT)");
+
+	wait_for_pageout(buf, npages);
+
+	pages_after = sysctl_quad("vm.c_compress_batched_pages");
+	batches_after = sysctl_quad("vm.c_compress_batches");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("vm.c_compress_batch_size_max",
+	    &batch_max, &len, NULL, 0), "vm.c_compress_batch_size_max");
+	T_LOG("%llu pages in %llu batches, largest batch %u",
+	    pages_after - pages, batches_after - batches, batch_max);
+
+	T_EXPECT_GE(pages_after - pages, (uint64_t)npages, "pages went through c_compress_pages()");
+	T_EXPECT_GT(batches_after, batches, "batches were compressed");
+	T_EXPECT_GT(pages_after - pages, batches_after - batches,
+	    "some batches held more than one page");
+	T_EXPECT_GT(batch_max, 1u, "vm.c_compress_batch_size_max is more than one page");
+
+	for (size_t i = 0; i < size / sizeof(uint32_t); i++) {
+		if (buf[i] != (uint32_t)(i % 1021)) {
+			mismatches++;
+		}
+	}
+	T_EXPECT_EQ(mismatches, 0ul, "contents intact after decompression");
+
+	munmap(buf, size);
+}
+
+static void
+compressor_outcomes(struct compressor_outcome_stats *cos)
+{
+	size_t len = sizeof(*cos);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("vm.compressor_outcomes",
+	    cos, &len, NULL, 0), "vm.compressor_outcomes");
+	T_QUIET; T_ASSERT_EQ(len, sizeof(*cos), "vm.compressor_outcomes size");
+}
+
+static uint64_t
+sum_codecs(const uint64_t counts[COMPRESSOR_OUTCOME_CODECS])
+{
+	uint64_t sum = 0;
+
+	for (int i = 0; i < COMPRESSOR_OUTCOME_CODECS; i++) {
+		sum += counts[i];
+	}
+	return sum;
+}
+
+T_DECL(compressor_outcomes,
+    "Check that the compressor outcome counters account for zero and compressed pages",
+    T_META_ENABLED(!TARGET_OS_WATCH))
+{
+	const size_t npages = 64;
+	size_t size = 2 * npages * vm_kernel_page_size;
+	struct compressor_outcome_stats before, after;
+	uint64_t buckets = 0;
+	uint32_t *buf;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE(buf, MAP_FAILED, "mmap");
+
+	/* first half: touched zero pages, second half: compressible pages */
+	for (size_t i = 0; i < size / sizeof(uint32_t); i++) {
+		buf[i] = i < size / sizeof(uint32_t) / 2 ? 0 : (uint32_t)(i % 1021);
+	}
+
+	compressor_outcomes(&before);
+	T_ASSERT_EQ(before.cos_page_size, (uint32_t)vm_kernel_page_size, "cos_page_size");
+	T_ASSERT_EQ(before.cos_bucket_size * COMPRESSOR_OUTCOME_SIZE_BUCKETS,
+	    before.cos_page_size, "cos_bucket_size");
+
+	T_ASSERT_POSIX_SUCCESS(madvise(buf, size, MADV_PAGEOUT), "madvise(MADV_PAGEOUT)");
+
+	wait_for_pageout(buf, 2 * npages);
+
+	compressor_outcomes(&after);
+
+	T_EXPECT_GE(sum_codecs(after.cos_sv_zero_pages) - sum_codecs(before.cos_sv_zero_pages),
+	    (uint64_t)npages, "zero pages counted as single value pages");
+	T_EXPECT_GE(sum_codecs(after.cos_sv_pages) - sum_codecs(before.cos_sv_pages),
+	    sum_codecs(after.cos_sv_zero_pages) - sum_codecs(before.cos_sv_zero_pages),
+	    "zero pages are a subset of single value pages");
+	T_EXPECT_GE(sum_codecs(after.cos_compressed_pages) - sum_codecs(before.cos_compressed_pages),
+	    (uint64_t)npages, "compressible pages counted as compressed");
+
+	for (int c = 0; c < COMPRESSOR_OUTCOME_CODECS; c++) {
+		for (int b = 0; b < COMPRESSOR_OUTCOME_SIZE_BUCKETS; b++) {
+			buckets += after.cos_size_buckets[c][b] - before.cos_size_buckets[c][b];
+		}
+	}
+	T_EXPECT_GE(buckets, (uint64_t)npages, "compressed pages land in size buckets");
+	T_LOG("sv hash full: %llu, seg full retries: %llu, limit bailouts: %llu",
+	    after.cos_sv_hash_full, after.cos_seg_full_retries, after.cos_limit_bailouts);
+
+	munmap(buf, size);
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed software downloaded from or made available by
+ * Apple, in particular the "Apple Public Source License Version 2.0".
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * Runs the same workload, reading a file mapping larger than memory over
+ * and over with a smaller hot part read more often, with the pageout
+ * daemon in its default mode and in multi-generational mode
+ * (vm.pageout_mglru), and reports the sizes of the active queue's
+ * generations, what became of the pages aged out of the oldest one, and
+ * the refault distances of the file's pages for each.
+ *
+ * The file is sparse and only ever read, so its pages are clean: they
+ * get evicted without any I/O, and the file takes no disk space.
+ */
+#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <mach/mach.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.vm"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("VM"),
+	T_META_CHECK_LEAKS(false),
+	T_META_RUN_CONCURRENTLY(false));
+
+#define MGLRU_GENS              4
+#define MGLRU_REFAULT_BUCKETS   32
+#define MGLRU_HOT_SHIFT         3       /* the hot part is an 8th of memory */
+#define MGLRU_PASSES            4
+
+static uint32_t saved_mglru;
+static bool mglru_saved;
+
+static void
+restore_mglru(void)
+{
+	if (mglru_saved) {
+		(void)sysctlbyname("vm.pageout_mglru", NULL, NULL,
+		    &saved_mglru, sizeof(saved_mglru));
+	}
+}
+
+static uint64_t
+sysctl_ulong(const char *name)
+{
+	uint64_t value = 0;
+	size_t len = sizeof(value);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &value, &len, NULL, 0), "%s", name);
+	return value;
+}
+
+static uint32_t
+sysctl_uint(const char *name)
+{
+	uint32_t value = 0;
+	size_t len = sizeof(value);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &value, &len, NULL, 0), "%s", name);
+	return value;
+}
+
+static void
+log_generations(const char *mode)
+{
+	uint32_t gen_pages[MGLRU_GENS] = { };
+	size_t len = sizeof(gen_pages);
+	uint32_t min_seq, max_seq;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("vm.mglru_gen_pages", gen_pages, &len, NULL, 0),
+	    "vm.mglru_gen_pages");
+	min_seq = sysctl_uint("vm.mglru_min_seq");
+	max_seq = sysctl_uint("vm.mglru_max_seq");
+
+	T_EXPECT_LT(max_seq - min_seq, (uint32_t)MGLRU_GENS, "%s: at most %d generations", mode, MGLRU_GENS);
+	T_LOG("%s: generations %u to %u hold %u %u %u %u pages", mode, min_seq, max_seq,
+	    gen_pages[0], gen_pages[1], gen_pages[2], gen_pages[3]);
+}
+
+static bool
+get_refault_distances(uint64_t buckets[MGLRU_REFAULT_BUCKETS])
+{
+	size_t len = MGLRU_REFAULT_BUCKETS * sizeof(buckets[0]);
+
+	/* only there with the phantom cache */
+	return sysctlbyname("vm.phantom_cache_refault_distance", buckets, &len, NULL, 0) == 0;
+}
+
+static void
+log_refault_distances(const char *mode, uint64_t before[MGLRU_REFAULT_BUCKETS])
+{
+	uint64_t buckets[MGLRU_REFAULT_BUCKETS] = { };
+	uint64_t total = 0;
+
+	if (!get_refault_distances(buckets)) {
+		return;
+	}
+	for (int i = 1; i < MGLRU_REFAULT_BUCKETS; i++) {
+		if (buckets[i] != before[i]) {
+			T_LOG("%s: %llu refaults after %llu to %llu evictions", mode,
+			    buckets[i] - before[i], 1ull << (i - 1), (1ull << i) - 1);
+			total += buckets[i] - before[i];
+		}
+	}
+	T_EXPECT_GT(total, 0ull, "%s: evicted file pages were refaulted", mode);
+}
+
+static void
+run_workload(int fd, size_t size, uint32_t mglru)
+{
+	const char *mode = mglru ? "multi-generational" : "default";
+	size_t hot = size >> MGLRU_HOT_SHIFT;
+	uint64_t refaults[MGLRU_REFAULT_BUCKETS] = { };
+	uint64_t aged, promoted, deactivated;
+	volatile const char *buf;
+	char sum = 0;
+	int ret;
+
+	ret = sysctlbyname("vm.pageout_mglru", NULL, NULL, &mglru, sizeof(mglru));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ret, "vm.pageout_mglru=%u", mglru);
+
+	get_refault_distances(refaults);
+	aged = sysctl_ulong("vm.pageout_mglru_aged");
+	promoted = sysctl_ulong("vm.pageout_mglru_promoted");
+	deactivated = sysctl_ulong("vm.pageout_mglru_deactivated");
+
+	buf = mmap(NULL, size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+	T_QUIET; T_ASSERT_NE((void *)buf, MAP_FAILED, "mmap");
+
+	/* the hot part is read 4 times a pass, the rest once */
+	for (int pass = 0; pass < MGLRU_PASSES; pass++) {
+		for (int round = 0; round < 4; round++) {
+			for (size_t off = 0; off < hot; off += vm_page_size) {
+				sum |= buf[off];
+			}
+		}
+		for (size_t off = hot; off < size; off += vm_page_size) {
+			sum |= buf[off];
+		}
+	}
+	T_QUIET; T_ASSERT_EQ(sum, 0, "a sparse file reads as zeroes");
+
+	aged = sysctl_ulong("vm.pageout_mglru_aged") - aged;
+	promoted = sysctl_ulong("vm.pageout_mglru_promoted") - promoted;
+	deactivated = sysctl_ulong("vm.pageout_mglru_deactivated") - deactivated;
+
+	log_generations(mode);
+	T_LOG("%s: %llu generations started, %llu pages promoted, %llu deactivated", mode,
+	    aged, promoted, deactivated);
+	if (mglru) {
+		T_EXPECT_GT(aged, 0ull, "%s: generations were started", mode);
+		T_EXPECT_GT(deactivated, 0ull, "%s: pages were deactivated from the oldest generation", mode);
+	}
+	log_refault_distances(mode, refaults);
+
+	munmap((void *)(uintptr_t)buf, size);
+}
+
+T_DECL(vm_mglru_generations,
+    "compare the pageout daemon's default and multi-generational modes",
+    T_META_ASROOT(true),
+    T_META_TIMEOUT(1800))
+{
+	char path[PATH_MAX];
+	uint64_t memsize;
+	size_t len = sizeof(saved_mglru);
+	size_t size;
+	int fd;
+
+	if (sysctlbyname("vm.pageout_mglru", &saved_mglru, &len, NULL, 0) != 0) {
+		T_SKIP("vm.pageout_mglru not present");
+	}
+	mglru_saved = true;
+	T_ATEND(restore_mglru);
+
+	/* more than memory holds, for the pageout daemon to have work */
+	memsize = sysctl_ulong("hw.memsize");
+	size = (size_t)(memsize + (memsize >> MGLRU_HOT_SHIFT));
+	size = (size + vm_page_size - 1) & ~((size_t)vm_page_size - 1);
+
+	snprintf(path, sizeof(path), "%s/vm_mglru.XXXXXX", dt_tmpdir());
+	fd = mkstemp(path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "mkstemp(%s)", path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(unlink(path), "unlink(%s)", path);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ftruncate(fd, (off_t)size), "ftruncate(%zu)", size);
+	T_LOG("reading %llu MB of file with %llu MB of memory", (uint64_t)size >> 20, memsize >> 20);
+
+	run_workload(fd, size, 0);
+	run_workload(fd, size, 1);
+
+	close(fd);
+}
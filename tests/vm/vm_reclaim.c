@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <sys/sysctl.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #include <mach/mach_vm.h>
 #include <mach/vm_reclaim.h>
 #include <mach-o/dyld.h>
@@ -645,3 +646,90 @@ T_DECL(reclaim_async_on_repeated_suspend,
 		T_END;
 	});
 }
+
+#define THROUGHPUT_TASKS 100
+#define THROUGHPUT_ENTRIES 64
+#define THROUGHPUT_ALLOCATION_SIZE (64UL << 10) // 64KB
+
+/*
+ * Defer free memory from many processes, then suspend them all at once so
+ * that the kernel's reclaim threads drain every buffer, and time how long
+ * it takes for all of them to be reclaimed.
+ */
+T_DECL(vm_reclaim_async_throughput,
+    "async reclaim throughput across 100 suspended processes",
+    T_META_TAG_PERF,
+    T_META_ASROOT(true),
+    T_META_BOOTARGS_SET(VM_RECLAIM_THRESHOLD_BOOTARG_HIGH))
+{
+	pid_t pids[THROUGHPUT_TASKS];
+	int ready[2];
+	char c;
+	size_t num_ledger_entries = 0;
+	size_t phys_footprint_index = ledger_phys_footprint_index(&num_ledger_entries);
+	int64_t before_footprint = 0, after_footprint = 0, reclaimed_bytes;
+	uint64_t start, elapsed_ns;
+	mach_timebase_info_data_t tb;
+	double seconds;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(ready), "pipe");
+	for (int i = 0; i < THROUGHPUT_TASKS; i++) {
+		pids[i] = fork();
+		T_QUIET; T_WITH_ERRNO; T_ASSERT_NE(pids[i], -1, "fork()");
+		if (pids[i] == 0) {
+			struct mach_vm_reclaim_ringbuffer_v1_s ringbuffer;
+			mach_vm_address_t addr;
+
+			kern_return_t kr = mach_vm_reclaim_ringbuffer_init(&ringbuffer);
+			T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_vm_reclaim_ringbuffer_init");
+			for (size_t j = 0; j < THROUGHPUT_ENTRIES; j++) {
+				addr = 0;
+				allocate_and_defer_free(THROUGHPUT_ALLOCATION_SIZE, &ringbuffer, (unsigned char) j, &addr);
+			}
+			/* Tell the parent we're ready, and wait to be killed */
+			write(ready[1], "r", 1);
+			while (1) {
+				pause();
+			}
+		}
+	}
+	for (int i = 0; i < THROUGHPUT_TASKS; i++) {
+		T_QUIET; T_ASSERT_EQ(read(ready[0], &c, 1), 1L, "child is ready");
+	}
+
+	for (int i = 0; i < THROUGHPUT_TASKS; i++) {
+		before_footprint += get_ledger_entry_for_pid(pids[i], phys_footprint_index, num_ledger_entries);
+	}
+
+	start = mach_absolute_time();
+	for (int i = 0; i < THROUGHPUT_TASKS; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(pid_suspend(pids[i]), "pid_suspend");
+	}
+	for (int i = 0; i < THROUGHPUT_TASKS; i++) {
+		drain_async_queue(pids[i]);
+	}
+	mach_timebase_info(&tb);
+	elapsed_ns = (mach_absolute_time() - start) * tb.numer / tb.denom;
+
+	for (int i = 0; i < THROUGHPUT_TASKS; i++) {
+		after_footprint += get_ledger_entry_for_pid(pids[i], phys_footprint_index, num_ledger_entries);
+	}
+	reclaimed_bytes = before_footprint - after_footprint;
+	T_EXPECT_GE(reclaimed_bytes, (int64_t) (THROUGHPUT_TASKS * THROUGHPUT_ENTRIES * THROUGHPUT_ALLOCATION_SIZE),
+	    "memory was reclaimed from every process");
+
+	seconds = (double) elapsed_ns / NSEC_PER_SEC;
+	T_LOG("reclaimed %lld bytes from %d processes in %.3f ms", reclaimed_bytes,
+	    THROUGHPUT_TASKS, (double) elapsed_ns / NSEC_PER_MSEC);
+	T_PERF("vm_reclaim_async_bytes_per_sec", (double) reclaimed_bytes / seconds, "bytes/s",
+	    "deferred frees reclaimed from 100 suspended processes");
+	T_PERF("vm_reclaim_async_entries_per_sec", THROUGHPUT_TASKS * THROUGHPUT_ENTRIES / seconds, "entries/s",
+	    "deferred frees reclaimed from 100 suspended processes");
+
+	for (int i = 0; i < THROUGHPUT_TASKS; i++) {
+		int status;
+
+		resume_and_kill_proc(pids[i]);
+		T_QUIET; T_ASSERT_EQ(waitpid(pids[i], &status, 0), pids[i], "waitpid");
+	}
+}
@@ -0,0 +1,381 @@
+/*
+ * Differential fuzzer and throughput benchmark for the portable WKdm codec
+ * (osfmk/vm/WKdm_sw.c).
+ *
+ * The scalar and SSE2/NEON instantiations of the codec must emit the very
+ * same bytes and return the very same values for every input and budget,
+ * and must agree on whether a (possibly corrupted) stream decodes.
+ *
+ * This only depends on libc so that it can be built and run anywhere,
+ * including x86_64 Linux:
+ *
+ *	cc -O2 -o wkdm_sw_bench tests/vm/wkdm_sw_bench.c
+ *	./wkdm_sw_bench fuzz [-n iterations] [-s seed]
+ *	./wkdm_sw_bench bench [-n iterations]
+ *
+ * Add -DWKDM_SW_BENCH_PAGE_SIZE=16384 to exercise 16K pages.
+ */
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef WKDM_SW_BENCH_PAGE_SIZE
+#define WKDM_SW_BENCH_PAGE_SIZE 4096
+#endif
+
+#undef PAGE_SIZE
+#define PAGE_SIZE WKDM_SW_BENCH_PAGE_SIZE
+
+#include "../test_rand.h"
+#include "../../osfmk/vm/WKdm_sw.c"
+
+#define NWORDS          (PAGE_SIZE / sizeof(WK_word))
+#define countof(x)      (sizeof(x) / sizeof(x[0]))
+
+/* room for the worst case of either encoding plus some red zone */
+#define DEST_WORDS      (2 * NWORDS)
+
+static WK_word src[NWORDS] __attribute__((aligned(64)));
+static WK_word dst_scalar[DEST_WORDS] __attribute__((aligned(64)));
+static WK_word dst_simd[DEST_WORDS] __attribute__((aligned(64)));
+static WK_word out_scalar[NWORDS] __attribute__((aligned(64)));
+static WK_word out_simd[NWORDS] __attribute__((aligned(64)));
+static WK_word scratch[PAGE_SIZE / sizeof(WK_word)] __attribute__((aligned(64)));
+
+static uint32_t
+rng_below(uint32_t n)
+{
+	return (uint32_t)(test_rand64() % n);
+}
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+enum page_kind {
+	PAGE_ZERO,
+	PAGE_SINGLE_VALUE,
+	PAGE_SPARSE,
+	PAGE_POINTERS,
+	PAGE_SMALL_INTS,
+	PAGE_TEXT,
+	PAGE_RANDOM,
+	PAGE_DICT_STRESS,
+	PAGE_KIND_COUNT,
+};
+
+static const char *page_kind_names[PAGE_KIND_COUNT] = {
+	[PAGE_ZERO]         = "zero",
+	[PAGE_SINGLE_VALUE] = "single",
+	[PAGE_SPARSE]       = "sparse",
+	[PAGE_POINTERS]     = "pointers",
+	[PAGE_SMALL_INTS]   = "ints",
+	[PAGE_TEXT]         = "text",
+	[PAGE_RANDOM]       = "random",
+	[PAGE_DICT_STRESS]  = "dict",
+};
+
+static void
+fill_page(WK_word *page, enum page_kind kind)
+{
+	uint32_t base = (uint32_t)test_rand64();
+
+	switch (kind) {
+	case PAGE_ZERO:
+		memset(page, 0, PAGE_SIZE);
+		break;
+	case PAGE_SINGLE_VALUE:
+		for (uint32_t i = 0; i < NWORDS; i++) {
+			page[i] = base;
+		}
+		break;
+	case PAGE_SPARSE:
+		memset(page, 0, PAGE_SIZE);
+		for (uint32_t n = rng_below(NWORDS / 8) + 1; n; n--) {
+			page[rng_below(NWORDS)] = (uint32_t)test_rand64();
+		}
+		break;
+	case PAGE_POINTERS:
+		for (uint32_t i = 0; i < NWORDS; i++) {
+			uint32_t r = rng_below(8);
+
+			if (r < 2) {
+				page[i] = 0;
+			} else if (r < 6) {
+				page[i] = (base & ~0xfffffu) | (rng_below(0x100000) & ~7u);
+			} else {
+				page[i] = (i & 1) ? 0x0000ffffu : (uint32_t)test_rand64();
+			}
+		}
+		break;
+	case PAGE_SMALL_INTS:
+		for (uint32_t i = 0; i < NWORDS; i++) {
+			page[i] = rng_below(2048);
+		}
+		break;
+	case PAGE_TEXT:
+		for (uint32_t i = 0; i < NWORDS * 4; i++) {
+			((uint8_t *)page)[i] = "etaoin shrdlu\n"[rng_below(14)];
+		}
+		break;
+	case PAGE_RANDOM:
+		for (uint32_t i = 0; i < NWORDS; i++) {
+			page[i] = (uint32_t)test_rand64();
+		}
+		break;
+	case PAGE_DICT_STRESS:
+		/* few distinct high parts: mostly exact and partial matches */
+		for (uint32_t i = 0; i < NWORDS; i++) {
+			page[i] = ((rng_below(4) * 0x9e3779b9u) & ~0x3ffu) |
+			    (rng_below(3) ? 0 : rng_below(1024));
+		}
+		break;
+	default:
+		abort();
+	}
+
+	/* sprinkle some damage to hit run boundaries */
+	for (uint32_t n = rng_below(4); n; n--) {
+		page[rng_below(NWORDS)] = rng_below(2) ? 0 : (uint32_t)test_rand64();
+	}
+}
+
+static unsigned int
+pick_limit(void)
+{
+	switch (rng_below(4)) {
+	case 0:
+		return PAGE_SIZE - 4;
+	case 1:
+		return rng_below(PAGE_SIZE);
+	case 2:
+		return rng_below(64 + NWORDS / 4);
+	default:
+		return PAGE_SIZE;
+	}
+}
+
+static void
+dump_failure(const char *what, enum page_kind kind, unsigned int limit, uint64_t seed)
+{
+	errx(1, "%s: page kind %s, limit %u, seed 0x%llx", what,
+	    page_kind_names[kind], limit, (unsigned long long)seed);
+}
+
+static int
+fuzz(uint64_t iterations, uint64_t seed)
+{
+	uint64_t corrupt_ok = 0, corrupt_rejected = 0;
+	uint64_t results[3] = { 0 };
+
+#if !WKDM_SW_SIMD
+	warnx("no SIMD support on this target, checking scalar only");
+#endif
+
+	for (uint64_t it = 0; it < iterations; it++) {
+		uint64_t       page_seed = seed + it;
+		enum page_kind kind;
+		unsigned int   limit;
+		int            rs, rv;
+		bool           ds, dv;
+
+		test_rand_set_seed(page_seed * 0x9e3779b97f4a7c15ull + 1);
+		kind = (enum page_kind)rng_below(PAGE_KIND_COUNT);
+		limit = pick_limit();
+		fill_page(src, kind);
+
+		memset(dst_scalar, 0xa5, sizeof(dst_scalar));
+		memset(dst_simd, 0xa5, sizeof(dst_simd));
+
+		rs = WKdm_compress_scalar(src, dst_scalar, scratch, limit);
+#if WKDM_SW_SIMD
+		rv = WKdm_compress_simd(src, dst_simd, scratch, limit);
+#else
+		rv = WKdm_compress_scalar(src, dst_simd, scratch, limit);
+#endif
+
+		if (rs != rv) {
+			dump_failure("compressed size mismatch", kind, limit, page_seed);
+		}
+		if (rs > (int)limit) {
+			dump_failure("budget overrun", kind, limit, page_seed);
+		}
+		if (memcmp(dst_scalar, dst_simd, sizeof(dst_scalar)) != 0) {
+			dump_failure("compressed stream mismatch", kind, limit, page_seed);
+		}
+		results[rs < 0 ? 0 : rs == 0 ? 1 : 2]++;
+		if (rs <= 0) {
+			continue;
+		}
+
+		ds = WKdm_decompress_scalar(dst_scalar, out_scalar, scratch, (unsigned int)rs);
+#if WKDM_SW_SIMD
+		dv = WKdm_decompress_simd(dst_scalar, out_simd, scratch, (unsigned int)rs);
+#else
+		dv = WKdm_decompress_scalar(dst_scalar, out_simd, scratch, (unsigned int)rs);
+#endif
+		if (!ds || !dv || memcmp(out_scalar, src, PAGE_SIZE) ||
+		    memcmp(out_simd, src, PAGE_SIZE)) {
+			dump_failure("round trip failure", kind, limit, page_seed);
+		}
+
+		/* corrupt the stream and check both decoders still agree */
+		for (uint32_t n = rng_below(4) + 1; n; n--) {
+			((uint8_t *)dst_scalar)[rng_below((uint32_t)rs)] ^= (uint8_t)(1u << rng_below(8));
+		}
+		ds = WKdm_decompress_scalar(dst_scalar, out_scalar, scratch, (unsigned int)rs);
+#if WKDM_SW_SIMD
+		dv = WKdm_decompress_simd(dst_scalar, out_simd, scratch, (unsigned int)rs);
+#else
+		dv = WKdm_decompress_scalar(dst_scalar, out_simd, scratch, (unsigned int)rs);
+#endif
+		if (ds != dv || (ds && memcmp(out_scalar, out_simd, PAGE_SIZE))) {
+			dump_failure("corrupted stream decode mismatch", kind, limit, page_seed);
+		}
+		if (ds) {
+			corrupt_ok++;
+		} else {
+			corrupt_rejected++;
+		}
+	}
+
+	printf("%llu pages: %llu incompressible, %llu zero/single value, %llu compressed\n",
+	    (unsigned long long)iterations, (unsigned long long)results[0],
+	    (unsigned long long)results[1], (unsigned long long)results[2]);
+	printf("corrupted streams: %llu decoded, %llu rejected\n",
+	    (unsigned long long)corrupt_ok, (unsigned long long)corrupt_rejected);
+	return 0;
+}
+
+typedef int (*compress_fn)(const WK_word *, WK_word *, WK_word *, unsigned int);
+typedef bool (*decompress_fn)(const WK_word *, WK_word *, WK_word *, unsigned int);
+
+static const struct {
+	const char    *name;
+	compress_fn    compress;
+	decompress_fn  decompress;
+} bench_impls[] = {
+	{ "scalar", WKdm_compress_scalar, WKdm_decompress_scalar },
+#if WKDM_SW_SIMD
+#if WKDM_SW_NEON
+	{ "neon", WKdm_compress_simd, WKdm_decompress_simd },
+#else
+	{ "sse2", WKdm_compress_simd, WKdm_decompress_simd },
+#endif
+#endif
+};
+
+#define BENCH_PAGES     256
+
+static int
+bench(uint64_t iterations)
+{
+	static WK_word pages[BENCH_PAGES][NWORDS];
+	static WK_word streams[BENCH_PAGES][NWORDS];
+	static int sizes[BENCH_PAGES];
+	static const enum page_kind kinds[] = {
+		PAGE_ZERO, PAGE_SPARSE, PAGE_POINTERS, PAGE_SMALL_INTS,
+		PAGE_TEXT, PAGE_RANDOM,
+	};
+
+	printf("-----Results-----\n");
+	printf("impl,data,compress MB/s,decompress MB/s,ratio\n");
+
+	for (size_t k = 0; k < countof(kinds); k++) {
+		test_rand_set_seed(0x1234 + k);
+		for (int p = 0; p < BENCH_PAGES; p++) {
+			fill_page(pages[p], kinds[k]);
+		}
+
+		for (size_t m = 0; m < countof(bench_impls); m++) {
+			uint64_t start, ctime, dtime;
+			uint64_t in_bytes = 0, out_bytes = 0, decoded_bytes = 0;
+
+			start = now_ns();
+			for (uint64_t it = 0; it < iterations; it++) {
+				for (int p = 0; p < BENCH_PAGES; p++) {
+					sizes[p] = bench_impls[m].compress(pages[p],
+					    streams[p], scratch, PAGE_SIZE - 4);
+				}
+			}
+			ctime = now_ns() - start;
+
+			for (int p = 0; p < BENCH_PAGES; p++) {
+				in_bytes += PAGE_SIZE;
+				out_bytes += sizes[p] < 0 ? PAGE_SIZE : (uint64_t)sizes[p];
+				decoded_bytes += sizes[p] > 0 ? PAGE_SIZE : 0;
+			}
+
+			start = now_ns();
+			for (uint64_t it = 0; it < iterations; it++) {
+				for (int p = 0; p < BENCH_PAGES; p++) {
+					if (sizes[p] > 0 && !bench_impls[m].decompress(streams[p],
+					    out_scalar, scratch, (unsigned int)sizes[p])) {
+						errx(1, "decompression failed");
+					}
+				}
+			}
+			dtime = now_ns() - start;
+
+			/* zero, single value and incompressible pages aren't decoded */
+			printf("%s,%s,%.1f,%.1f,%.2f\n", bench_impls[m].name,
+			    page_kind_names[kinds[k]],
+			    (double)(in_bytes * iterations) * 1e3 / (double)ctime,
+			    (double)(decoded_bytes * iterations) * 1e3 / (double)(dtime ? dtime : 1),
+			    (double)in_bytes / (double)out_bytes);
+		}
+	}
+	return 0;
+}
+
+static void
+usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s fuzz|bench [-n iterations] [-s seed]\n", progname);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	uint64_t iterations = 0, seed = (uint64_t)time(NULL);
+	const char *mode;
+	int c;
+
+	if (argc < 2) {
+		usage(argv[0]);
+	}
+	mode = argv[1];
+	optind = 2;
+	while ((c = getopt(argc, argv, "n:s:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (strcmp(mode, "fuzz") == 0) {
+		printf("seed 0x%llx\n", (unsigned long long)seed);
+		return fuzz(iterations ? iterations : 200000, seed);
+	}
+	if (strcmp(mode, "bench") == 0) {
+		return bench(iterations ? iterations : 100);
+	}
+	usage(argv[0]);
+}
@@ -1,5 +1,7 @@
 #include <sys/sysctl.h>
 #include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <darwintest.h>
 #include <darwintest_utils.h>
 
@@ -88,3 +90,147 @@ T_DECL(zlog_smoke_test, "check that zlog functions at all",
 	    "found the line we wanted");
 	dispatch_release(sema);
 }
+
+/* keep in sync with osfmk/kern/zalloc.h */
+struct zone_cache_info {
+	char                zci_name[80];
+	uint16_t            zci_mag_size;
+	uint16_t            zci_depot_size;
+	uint16_t            zci_depot_limit;
+	uint16_t            zci_mag_size_max;
+	uint32_t            zci_recirc_cont_wma;
+	uint32_t            zci_cached;
+	uint64_t            zci_cluster_spills;
+	uint64_t            zci_cluster_refills;
+	uint64_t            zci_cluster_migrations;
+};
+
+T_DECL(zone_cache_info, "check kern.zone_cache_info is sane")
+{
+	struct zone_cache_info *zci;
+	size_t size = 0;
+	size_t count;
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.zone_cache_info",
+	    NULL, &size, NULL, 0), "sysctl(kern.zone_cache_info) size");
+
+	/* zones can start caching at any time, leave some slack */
+	size += 16 * sizeof(*zci);
+	zci = malloc(size);
+	T_QUIET; T_ASSERT_NOTNULL(zci, "malloc");
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.zone_cache_info",
+	    zci, &size, NULL, 0), "sysctl(kern.zone_cache_info)");
+	T_QUIET; T_ASSERT_EQ(size % sizeof(*zci), 0ul, "size is a multiple of records");
+
+	count = size / sizeof(*zci);
+	T_ASSERT_GT(count, 0ul, "some zones have caching enabled");
+
+	for (size_t i = 0; i < count; i++) {
+		/* zci_recirc_cont_wma is in Z_WMA_UNIT (1/256th) units */
+		T_LOG("%-32s mag_size %2d/%2d depot %3d/%3d contention %.2f/s cached %d",
+		    zci[i].zci_name, zci[i].zci_mag_size, zci[i].zci_mag_size_max,
+		    zci[i].zci_depot_size, zci[i].zci_depot_limit,
+		    zci[i].zci_recirc_cont_wma / 256.0, zci[i].zci_cached);
+		T_QUIET; T_EXPECT_GT(zci[i].zci_mag_size, 0, "%s: mag_size", zci[i].zci_name);
+		T_QUIET; T_EXPECT_LE(zci[i].zci_mag_size, zci[i].zci_mag_size_max,
+		    "%s: mag_size <= mag_size_max", zci[i].zci_name);
+		T_QUIET; T_EXPECT_LE(zci[i].zci_depot_size, zci[i].zci_depot_limit,
+		    "%s: depot_size <= depot_limit", zci[i].zci_name);
+		T_QUIET; T_EXPECT_LE(zci[i].zci_cluster_migrations, zci[i].zci_cluster_refills,
+		    "%s: cluster migrations <= refills", zci[i].zci_name);
+		if (zci[i].zci_cluster_refills) {
+			T_LOG("%-32s cluster spills %lld refills %lld migrations %lld",
+			    zci[i].zci_name, zci[i].zci_cluster_spills,
+			    zci[i].zci_cluster_refills, zci[i].zci_cluster_migrations);
+		}
+	}
+
+	free(zci);
+}
+
+/* keep in sync with osfmk/kern/zalloc.h */
+struct zone_sample_stats {
+	uint32_t            zss_interval;
+	uint32_t            zss_sites;
+	uint64_t            zss_samples;
+	uint64_t            zss_dropped;
+	uint64_t            zss_live_samples;
+	uint64_t            zss_live_bytes;
+};
+
+struct zone_sample_site_info {
+	char                zssi_zone[80];
+	uint32_t            zssi_depth;
+	uint32_t            zssi_live_count;
+	uint64_t            zssi_live_bytes;
+	uint64_t            zssi_total_count;
+	uint64_t            zssi_total_bytes;
+	uint64_t            zssi_frames[15];
+};
+
+static uint32_t zone_sample_orig_interval;
+
+static void
+zone_sample_restore(void)
+{
+	sysctlbyname("kern.zone_sample.interval", NULL, NULL,
+	    &zone_sample_orig_interval, sizeof(zone_sample_orig_interval));
+}
+
+T_DECL(zone_sample_profiler, "check that the zone sampling profiler records samples",
+    T_META_RUN_CONCURRENTLY(false))
+{
+	struct zone_sample_site_info *sites;
+	struct zone_sample_stats stats;
+	uint32_t interval = 4096;
+	size_t size = sizeof(zone_sample_orig_interval);
+	int fds[2];
+
+	if (sysctlbyname("kern.zone_sample.interval", &zone_sample_orig_interval,
+	    &size, NULL, 0) != 0) {
+		T_SKIP("kern.zone_sample.interval not supported");
+	}
+	T_ATEND(zone_sample_restore);
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.zone_sample.interval", NULL, NULL,
+	    &interval, sizeof(interval)), "enable sampling every %d bytes", interval);
+
+	/* pipes and sockets make plenty of kalloc/kalloc_type allocations */
+	for (int i = 0; i < 10000; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds), "pipe");
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	size = sizeof(stats);
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.zone_sample.stats",
+	    &stats, &size, NULL, 0), "kern.zone_sample.stats");
+	T_LOG("interval %d, samples %lld (dropped %lld), sites %d, live %lld (%lld bytes)",
+	    stats.zss_interval, stats.zss_samples, stats.zss_dropped,
+	    stats.zss_sites, stats.zss_live_samples, stats.zss_live_bytes);
+	T_EXPECT_EQ(stats.zss_interval, interval, "interval");
+	T_EXPECT_GT(stats.zss_samples, 0ull, "allocations were sampled");
+	T_EXPECT_GT(stats.zss_sites, 0u, "sites were recorded");
+
+	size = (stats.zss_sites + 64) * sizeof(*sites);
+	sites = calloc(1, size);
+	T_QUIET; T_ASSERT_NOTNULL(sites, "calloc");
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.zone_sample.sites",
+	    sites, &size, NULL, 0), "kern.zone_sample.sites");
+	T_QUIET; T_ASSERT_EQ(size % sizeof(*sites), 0ul, "size is a multiple of records");
+
+	for (size_t i = 0; i < size / sizeof(*sites); i++) {
+		T_QUIET; T_EXPECT_GT(sites[i].zssi_depth, 0u, "site has a backtrace");
+		T_QUIET; T_EXPECT_LE(sites[i].zssi_live_bytes, sites[i].zssi_total_bytes,
+		    "%s: live <= total", sites[i].zssi_zone);
+	}
+	free(sites);
+
+	interval = 0;
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.zone_sample.interval", NULL, NULL,
+	    &interval, sizeof(interval)), "disable sampling");
+	size = sizeof(stats);
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.zone_sample.stats",
+	    &stats, &size, NULL, 0), "kern.zone_sample.stats");
+	T_EXPECT_EQ(stats.zss_live_samples, 0ull, "disabling discards samples");
+}
@@ -128,6 +128,7 @@ kcdata_type_def = {
     'STACKSHOT_KCTYPE_SHAREDCACHE_AOTINFO' : 0x944,
     'STACKSHOT_KCTYPE_SHAREDCACHE_ID' : 0x945,
     'STACKSHOT_KCTYPE_CODESIGNING_INFO' : 0x946,
+    'STACKSHOT_KCTYPE_COMPRESSOR_OUTCOMES' : 0x947,
 
     'KCDATA_TYPE_BUFFER_END':      0xF19158ED,
 
@@ -856,6 +857,24 @@ KNOWN_TYPES_COLLECTION[0x902] = KCTypeDescription(0x902, (
     'mem_and_io_snapshot'
 )
 
+COMPRESSOR_OUTCOME_CODECS = 2
+COMPRESSOR_OUTCOME_SIZE_BUCKETS = 16
+
+KNOWN_TYPES_COLLECTION[0x947] = KCTypeDescription(0x947, (
+    KCSubTypeElement.FromBasicCtype('cos_page_size', KCSUBTYPE_TYPE.KC_ST_UINT32, 0),
+    KCSubTypeElement.FromBasicCtype('cos_bucket_size', KCSUBTYPE_TYPE.KC_ST_UINT32, 4),
+    KCSubTypeElement('cos_sv_pages', KCSUBTYPE_TYPE.KC_ST_UINT64, KCSubTypeElement.GetSizeForArray(COMPRESSOR_OUTCOME_CODECS, 8), 8, 1),
+    KCSubTypeElement('cos_sv_zero_pages', KCSUBTYPE_TYPE.KC_ST_UINT64, KCSubTypeElement.GetSizeForArray(COMPRESSOR_OUTCOME_CODECS, 8), 24, 1),
+    KCSubTypeElement.FromBasicCtype('cos_sv_hash_full', KCSUBTYPE_TYPE.KC_ST_UINT64, 40),
+    KCSubTypeElement('cos_compressed_pages', KCSUBTYPE_TYPE.KC_ST_UINT64, KCSubTypeElement.GetSizeForArray(COMPRESSOR_OUTCOME_CODECS, 8), 48, 1),
+    KCSubTypeElement('cos_incompressible_pages', KCSUBTYPE_TYPE.KC_ST_UINT64, KCSubTypeElement.GetSizeForArray(COMPRESSOR_OUTCOME_CODECS, 8), 64, 1),
+    KCSubTypeElement.FromBasicCtype('cos_seg_full_retries', KCSUBTYPE_TYPE.KC_ST_UINT64, 80),
+    KCSubTypeElement.FromBasicCtype('cos_limit_bailouts', KCSUBTYPE_TYPE.KC_ST_UINT64, 88),
+    KCSubTypeElement('cos_size_buckets', KCSUBTYPE_TYPE.KC_ST_UINT64, KCSubTypeElement.GetSizeForArray(COMPRESSOR_OUTCOME_CODECS * COMPRESSOR_OUTCOME_SIZE_BUCKETS, 8), 96, 1)
+),
+    'compressor_outcome_stats'
+)
+
 
 KNOWN_TYPES_COLLECTION[0x930] = KCTypeDescription(0x930, (
     KCSubTypeElement.FromBasicCtype('tts_unique_pid', KCSUBTYPE_TYPE.KC_ST_UINT64, 0),